@@ -19,11 +19,21 @@
 #define DEFAULT_EFI_BLOB "BOOTIA32.EFI"
 #endif
 
+/**
+ * Presence of this file beneath the kernel configuration directory has
+ * kernels installed as unified kernel images. It may name the EFI stub to
+ * use, relative to the root.
+ */
+#define BOOTLOADER_UKI_CONFIG KERNEL_CONF_DIRECTORY "/uki"
+
 typedef bool (*boot_loader_init)(const BootManager *);
 typedef bool (*boot_loader_install_kernel)(const BootManager *, const Kernel *);
 typedef const char *(*boot_loader_get_kernel_destination)(const BootManager *);
 typedef bool (*boot_loader_remove_kernel)(const BootManager *, const Kernel *);
+typedef bool (*boot_loader_remove_kernels)(const BootManager *, NcArray *kernels);
+typedef bool (*boot_loader_reconcile_kernels)(const BootManager *, NcArray *install, NcArray *keep);
 typedef bool (*boot_loader_set_default_kernel)(const BootManager *, const Kernel *kernel);
+typedef bool (*boot_loader_set_timeout)(const BootManager *);
 typedef bool (*boot_loader_needs_update)(const BootManager *);
 typedef bool (*boot_loader_needs_install)(const BootManager *);
 typedef bool (*boot_loader_install)(const BootManager *);
@@ -37,7 +47,8 @@ typedef enum {
         BOOTLOADER_CAP_UEFI = 1 << 1,   /**<Bootloader supports UEFI */
         BOOTLOADER_CAP_GPT = 1 << 2,    /**<Bootloader supports GPT boot partition */
         BOOTLOADER_CAP_LEGACY = 1 << 3, /**<Bootloader supports legacy boot */
-        BOOTLOADER_CAP_MAX = 1 << 4
+        BOOTLOADER_CAP_UKI = 1 << 4,    /**<Kernels are installed as unified images */
+        BOOTLOADER_CAP_MAX = 1 << 5
 } BootLoaderCapability;
 
 /**
@@ -50,7 +61,10 @@ typedef struct BootLoader {
             get_kernel_destination; /**<Get location where bootloader expects the kernels to reside */
         boot_loader_install_kernel install_kernel;         /**<Install a given kernel */
         boot_loader_remove_kernel remove_kernel;           /**<Remove a given kernel */
+        boot_loader_remove_kernels remove_kernels;         /**<Optional, several at once */
+        boot_loader_reconcile_kernels reconcile_kernels;   /**<Optional, all entries at once */
         boot_loader_set_default_kernel set_default_kernel; /**<Set the default kernel */
+        boot_loader_set_timeout set_timeout; /**<Optional, apply only the configured timeout */
         boot_loader_needs_update needs_update;             /**<Check if an update is required */
         boot_loader_needs_install needs_install;           /**<Check if an install is required */
         boot_loader_install install;                       /**<Install this bootloader */
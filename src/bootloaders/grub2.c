@@ -10,16 +10,22 @@
  */
 
 /**
+ * Create /etc/grub.d/10_$nom, or in native mode the menu entries in
+ * /boot/grub/clr-boot-manager.cfg along with a fixed 10_$nom sourcing them
+ * Skip the rest if nothing grub-mkconfig depends on has changed
  * Remove /vmlinuz & /initrd.img
- * Create /etc/grub.d/10_$nom
  * Run grub-mkconfig -o /boot/grub/grub.cfg
  * Recreate symlinks for default
  */
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "bootloader.h"
@@ -27,7 +33,9 @@
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "sha256.h"
 #include "system_stub.h"
+#include "trace.h"
 #include "util.h"
 #include "writer.h"
 
@@ -43,6 +51,7 @@ typedef struct Grub2Config {
         const char *os_id;
         bool is_separate;
         bool submenu;
+        bool native;
 } Grub2Config;
 
 /**
@@ -62,10 +71,52 @@ typedef struct Grub2Config {
 "
 
 /**
- * Maintain a queue of kernels until we set_default, allowing us to build
- * a single file vs multiple files
+ * Records the inputs of the last successful grub-mkconfig, relative to the
+ * boot directory
  */
-static KernelArray *kernel_queue = NULL;
+#define GRUB2_MKCONFIG_STAMP "grub/.clr-boot-manager-mkconfig"
+
+/**
+ * Presence of this file in the kernel configuration directory selects the
+ * native mode: the menu entries are written in GRUB's own syntax to
+ * GRUB2_NATIVE_CONFIG, and our grub.d script only sources that file. The
+ * script then never changes with the kernels, so grub-mkconfig only needs
+ * to run when the distro's GRUB configuration does.
+ */
+#define GRUB2_NATIVE_MARKER "grub2-native"
+
+/**
+ * Native menu entries, relative to the boot directory. Being next to grub.cfg,
+ * GRUB finds it within ${config_directory}.
+ */
+#define GRUB2_NATIVE_CONFIG "grub/" KERNEL_NAMESPACE ".cfg"
+
+/**
+ * grub.d script for the native mode. The device access and video setup are
+ * only known to grub-mkconfig, so they're handed to the entries in
+ * variables.
+ */
+#define GRUB2_NATIVE_SCRIPT                                                                        \
+        "#!/bin/bash\n\
+set -e\n\
+. \"/usr/share/grub/grub-mkconfig_lib\"\n\
+echo \"if [ -f \\${config_directory}/" KERNEL_NAMESPACE ".cfg ]; then\"\n\
+prep_root=\"$(prepare_grub_to_access_device ${GRUB_DEVICE_BOOT})\"\n\
+printf '\t%s\\n' \"${prep_root}\"\n\
+echo \"\tset cbm_root=\\$root\"\n\
+echo \"\tset cbm_gfxpayload='${GRUB_GFXPAYLOAD_LINUX}'\"\n\
+echo \"\tsource \\${config_directory}/" KERNEL_NAMESPACE ".cfg\"\n\
+echo \"fi\"\n\
+"
+
+/**
+ * Each manager maintains a queue of kernels until we set_default, allowing us
+ * to build a single file vs multiple files
+ */
+static inline KernelArray *grub2_get_kernel_queue(const BootManager *manager)
+{
+        return boot_manager_get_bootloader_data((BootManager *)manager);
+}
 
 /**
  * Form the full path to the GRUB2 configuration script
@@ -89,6 +140,20 @@ static inline bool grub2_is_separate_boot_partition(void)
         return cbm_system_is_mounted(BOOT_DIRECTORY);
 }
 
+/**
+ * Determine whether the native mode was asked for
+ */
+static bool grub2_is_native(BootManager *manager)
+{
+        autofree(char) *marker = NULL;
+
+        marker = string_printf("%s%s/%s",
+                               boot_manager_get_prefix(manager),
+                               KERNEL_CONF_DIRECTORY,
+                               GRUB2_NATIVE_MARKER);
+        return cbm_file_exists(marker);
+}
+
 /**
  * Return relative dir, i.e. instead of /boot, boot
  */
@@ -98,29 +163,36 @@ static inline char *grub2_get_boot_relative(void)
         return string_printf("%s", grub_bootdir + 1);
 }
 
-bool grub2_init(__cbm_unused__ const BootManager *manager)
+bool grub2_init(const BootManager *manager)
 {
-        kernel_queue = nc_array_new();
+        KernelArray *kernel_queue = nc_array_new();
+
         if (!kernel_queue) {
                 DECLARE_OOM();
                 abort();
         }
+        boot_manager_set_bootloader_data((BootManager *)manager, kernel_queue);
         return true;
 }
 
-void grub2_destroy(__cbm_unused__ const BootManager *manager)
+void grub2_destroy(const BootManager *manager)
 {
+        KernelArray *kernel_queue = grub2_get_kernel_queue(manager);
+
         if (kernel_queue) {
                 /* kernels pointers inside are not owned by the array */
                 nc_array_free(&kernel_queue, NULL);
+                boot_manager_set_bootloader_data((BootManager *)manager, NULL);
         }
 }
 
 /**
  * Push a pointer to the kernel into our queue for processing during set_default
  */
-bool grub2_install_kernel(__cbm_unused__ const BootManager *manager, const Kernel *kernel)
+bool grub2_install_kernel(const BootManager *manager, const Kernel *kernel)
 {
+        KernelArray *kernel_queue = grub2_get_kernel_queue(manager);
+
         /* We may end up adding the same kernel again, when in repair situations
          * for existing kernels (and current == tip cases)
          */
@@ -152,7 +224,7 @@ bool grub2_remove_kernel(const BootManager *manager, const Kernel *kernel)
         autofree(char) *conf_path = NULL;
 
         conf_path = grub2_get_entry_path_for_kernel((BootManager *)manager, kernel);
-        if (nc_file_exists(conf_path) && unlink(conf_path) < 0) {
+        if (cbm_file_exists(conf_path) && cbm_unlink(conf_path) < 0) {
                 LOG_FATAL("grub2_remove_kernel: Failed to remove %s: %s",
                           conf_path,
                           strerror(errno));
@@ -161,6 +233,72 @@ bool grub2_remove_kernel(const BootManager *manager, const Kernel *kernel)
         return true;
 }
 
+/**
+ * Write out the menuentry for a single kernel in GRUB's own syntax, for the
+ * native mode. The settings grub-mkconfig would have baked in come from the
+ * variables set by GRUB2_NATIVE_SCRIPT.
+ */
+static void grub2_write_native_kernel(const Grub2Config *config, const Kernel *kernel)
+{
+        const char *tab = config->submenu ? "\t\t" : "\t";
+        const char *root_tab = config->submenu ? "\t" : "";
+
+        cbm_writer_append_printf(config->writer,
+                                 "%smenuentry '%s (%s-%d.%s)' --class %s --class gnu-linux "
+                                 "--class gnu --class os $menuentry_id_option '%s-%s-%d.%s' {\n",
+                                 root_tab,
+                                 config->os_name,
+                                 kernel->meta.version,
+                                 kernel->meta.release,
+                                 kernel->meta.ktype,
+                                 config->os_id,
+                                 config->os_id,
+                                 kernel->meta.version,
+                                 kernel->meta.release,
+                                 kernel->meta.ktype);
+
+        cbm_writer_append_printf(config->writer,
+                                 "%sif [ \"x$cbm_gfxpayload\" = x ]; then\n"
+                                 "%s\tload_video\n"
+                                 "%sfi\n",
+                                 tab,
+                                 tab,
+                                 tab);
+        cbm_writer_append_printf(config->writer, "%sinsmod gzio\n", tab);
+        cbm_writer_append_printf(config->writer, "%sset root=$cbm_root\n", tab);
+
+        cbm_writer_append_printf(config->writer,
+                                 "%secho 'Loading %s %s ...'\n",
+                                 tab,
+                                 config->os_name,
+                                 kernel->meta.version);
+        cbm_writer_append_printf(config->writer,
+                                 "%slinux %s/%s root=UUID=%s ",
+                                 tab,
+                                 config->is_separate ? "" : BOOT_DIRECTORY,
+                                 kernel->target.legacy_path,
+                                 config->root_dev->uuid);
+        if (config->root_dev->luks_uuid) {
+                cbm_writer_append_printf(config->writer,
+                                         "rd.luks.uuid=%s ",
+                                         config->root_dev->luks_uuid);
+        }
+        cbm_writer_append_printf(config->writer, "%s\n", kernel->meta.cmdline);
+
+        if (kernel->target.initrd_path) {
+                cbm_writer_append_printf(config->writer,
+                                         "%secho 'Loading initial ramdisk'\n",
+                                         tab);
+                cbm_writer_append_printf(config->writer,
+                                         "%sinitrd %s/%s\n",
+                                         tab,
+                                         config->is_separate ? "" : BOOT_DIRECTORY,
+                                         kernel->target.initrd_path);
+        }
+
+        cbm_writer_append_printf(config->writer, "%s}\n\n", root_tab);
+}
+
 /**
  * Write out the menuentry for a single kernel
  */
@@ -169,6 +307,10 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         if (!config || !kernel) {
                 return false;
         }
+        if (config->native) {
+                grub2_write_native_kernel(config, kernel);
+                return true;
+        }
         /* Submenu uses two tabs */
         const char *tab = config->submenu ? "\t\t" : "\t";
         const char *root_tab = config->submenu ? "\t" : "";
@@ -263,26 +405,81 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         return true;
 }
 
-static bool grub2_write_config(const BootManager *manager, const Kernel *default_kernel)
+/**
+ * Commit @writer to @path through @stage if it changed, optionally marking
+ * it executable
+ */
+static bool grub2_commit(CbmStage *stage, CbmWriter *writer, const char *path, bool executable)
+{
+        bool changed = false;
+
+        /* If our new config matches the old config, nothing is written */
+        if (!cbm_writer_commit_if_changed(writer, stage, path, &changed)) {
+                LOG_FATAL("Failed to create loader entry for: %s", strerror(errno));
+                return false;
+        }
+        if (!changed) {
+                return true;
+        }
+
+        /* Ensure it's executable */
+        if (executable && chmod(path, 00755) != 0) {
+                LOG_FATAL("Failed to mark loader entry as executable: %s [%s]",
+                          path,
+                          strerror(errno));
+                return false;
+        }
+
+        cbm_sync_path(path);
+
+        return true;
+}
+
+/**
+ * Write out the fixed grub.d script of the native mode
+ */
+static bool grub2_write_native_script(CbmStage *stage, const char *conf_path)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        if (!cbm_writer_open(writer)) {
+                return false;
+        }
+        cbm_writer_append(writer, GRUB2_NATIVE_SCRIPT);
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+        return grub2_commit(stage, writer, conf_path, true);
+}
+
+static bool grub2_write_config(const BootManager *manager, const Kernel *default_kernel,
+                               bool native)
 {
         if (!manager) {
                 return false;
         }
 
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
         autofree(char) *grub_dir = NULL;
         const CbmDeviceProbe *root_dev = NULL;
         const char *os_name = NULL;
         const char *os_id = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(char) *conf_path = NULL;
+        autofree(char) *native_path = NULL;
+        autofree(char) *native_dir = NULL;
         autofree(char) *boot_dir = NULL;
+        autofree(char) *full_boot_dir = NULL;
         const char *prefix = NULL;
         bool is_separate;
         Grub2Config config = { 0 };
         bool wrote_submenu = false;
+        KernelArray *kernel_queue = grub2_get_kernel_queue(manager);
 
-        if (!cbm_writer_open(writer)) {
+        /* Every menuentry is around a kilobyte of script */
+        if (!cbm_writer_open_sized(writer, 1024 * (size_t)(kernel_queue->len + 1))) {
                 return false;
         }
 
@@ -300,8 +497,10 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         os_id = boot_manager_get_os_id((BootManager *)manager);
 
         /* Write out the stock header for our script */
-        cbm_writer_append(writer, "#!/bin/bash\nset -e\n");
-        cbm_writer_append(writer, ". \"/usr/share/grub/grub-mkconfig_lib\"\n");
+        if (!native) {
+                cbm_writer_append(writer, "#!/bin/bash\nset -e\n");
+                cbm_writer_append(writer, ". \"/usr/share/grub/grub-mkconfig_lib\"\n");
+        }
 
         /* Share our bits with grub2_write_kernel */
         config = (Grub2Config){
@@ -312,6 +511,7 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
                 .os_id = os_id,
                 .is_separate = is_separate,
                 .submenu = false,
+                .native = native,
         };
 
         /* Try to select a default kernel for update situations whereby CBM
@@ -343,7 +543,14 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
                         continue;
                 }
 
-                if (config.submenu && !wrote_submenu) {
+                if (config.submenu && !wrote_submenu && native) {
+                        cbm_writer_append_printf(writer,
+                                                 "submenu '%s (alternative boot entries)'"
+                                                 " $menuentry_id_option '%s-cbm-submenu' {\n",
+                                                 os_name,
+                                                 KERNEL_NAMESPACE);
+                        wrote_submenu = true;
+                } else if (config.submenu && !wrote_submenu) {
                         cbm_writer_append_printf(writer,
                                                  "echo \"submenu '%s (alternative boot entries)'",
                                                  os_name);
@@ -364,7 +571,7 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
 
         if (wrote_submenu) {
                 /* Finalize the submenu */
-                cbm_writer_append(writer, "echo \"}\"\n\n");
+                cbm_writer_append(writer, native ? "}\n\n" : "echo \"}\"\n\n");
         }
 
         cbm_writer_close(writer);
@@ -374,132 +581,336 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         }
 
         conf_path = string_printf("%s/etc/grub.d/10_%s", prefix, KERNEL_NAMESPACE);
-        /* If our new config matches the old config, just return. */
-        if (file_get_text(conf_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
-        }
 
         /* Ensure the grub.d directory actually exists (should do..) */
         grub_dir = string_printf("%s/etc/grub.d", prefix);
-        if (!nc_file_exists(grub_dir) && !nc_mkdir_p(grub_dir, 00755)) {
+        if (!cbm_file_exists(grub_dir) && !nc_mkdir_p(grub_dir, 00755)) {
                 LOG_FATAL("Failed to create grub.d dir: %s [%s]", grub_dir, strerror(errno));
                 return false;
         }
 
-        if (!file_set_text(conf_path, writer->buffer)) {
-                LOG_FATAL("Failed to create loader entry for: %s", strerror(errno));
-                return false;
+        full_boot_dir = boot_manager_get_boot_dir((BootManager *)manager);
+        native_path = string_printf("%s/%s", full_boot_dir, GRUB2_NATIVE_CONFIG);
+
+        if (!native) {
+                /* Left over from the native mode, nothing sources it now */
+                if (cbm_file_exists(native_path) && cbm_unlink(native_path) < 0) {
+                        LOG_WARNING("Failed to remove %s: %s", native_path, strerror(errno));
+                }
+                return grub2_commit(stage, writer, conf_path, true);
         }
 
-        /* Ensure it's executable */
-        if (chmod(conf_path, 00755) != 0) {
-                LOG_FATAL("Failed to mark loader entry as executable: %s [%s]",
-                          conf_path,
-                          strerror(errno));
+        native_dir = string_printf("%s/grub", full_boot_dir);
+        if (!cbm_file_exists(native_dir) && !nc_mkdir_p(native_dir, 00755)) {
+                LOG_FATAL("Failed to create GRUB2 dir: %s [%s]", native_dir, strerror(errno));
                 return false;
         }
+        return grub2_commit(stage, writer, native_path, false) &&
+               grub2_write_native_script(stage, conf_path);
+}
+
+/**
+ * Feed the names, modes and contents of every entry in @dir into the digest,
+ * in a stable order. A missing directory is simply empty.
+ */
+static bool grub2_digest_dir(CbmSha256 *ctx, const char *dir, bool contents)
+{
+        struct dirent **entries = NULL;
+        bool ret = true;
+        int n = 0;
+
+        n = scandir(dir, &entries, NULL, alphasort);
+        if (n < 0) {
+                return errno == ENOENT;
+        }
 
-        cbm_sync();
+        for (int i = 0; i < n; i++) {
+                const char *name = entries[i]->d_name;
+                autofree(char) *path = NULL;
+                struct stat st = { 0 };
 
-        return true;
+                if (!ret || streq(name, ".") || streq(name, "..")) {
+                        continue;
+                }
+
+                cbm_sha256_update(ctx, name, strlen(name) + 1);
+                if (!contents) {
+                        continue;
+                }
+
+                path = string_printf("%s/%s", dir, name);
+                if (stat(path, &st) != 0) {
+                        continue;
+                }
+                cbm_sha256_update(ctx, &st.st_mode, sizeof(st.st_mode));
+                if (S_ISREG(st.st_mode) && !cbm_sha256_update_file(ctx, path)) {
+                        ret = false;
+                }
+        }
+
+        for (int i = 0; i < n; i++) {
+                free(entries[i]);
+        }
+        free(entries);
+        return ret;
 }
 
-bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_kernel)
+/**
+ * Compute the record for a grub-mkconfig run from everything it depends on
+ * that we can know about: the grub.d scripts (including our own), the
+ * defaults file, the kernels visible in the boot directory, the chosen
+ * default, and the grub.cfg that was generated from them.
+ *
+ * In the native mode the kernels only show up in our own entries, which
+ * grub.cfg merely sources, so neither the boot directory nor the default
+ * are part of the record.
+ *
+ * @return A newly allocated record, or NULL if the inputs cannot be read
+ */
+static char *grub2_mkconfig_record(const char *prefix, const char *boot_dir,
+                                   const Kernel *default_kernel, bool native)
 {
-        if (!manager) {
-                return false;
+        autofree(char) *grub_d = NULL;
+        autofree(char) *defaults = NULL;
+        autofree(char) *grub_cfg = NULL;
+        uint8_t digest[CBM_SHA256_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        CbmFileKey cfg_key = { 0 };
+        CbmSha256 ctx;
+
+        grub_d = string_printf("%s/etc/grub.d", prefix);
+        defaults = string_printf("%s/etc/default/grub", prefix);
+        grub_cfg = string_printf("%s/grub/grub.cfg", boot_dir);
+
+        if (!cbm_file_key_for_path(&cfg_key, grub_cfg)) {
+                return NULL;
+        }
+
+        cbm_sha256_init(&ctx);
+        if (!grub2_digest_dir(&ctx, grub_d, true)) {
+                return NULL;
+        }
+        cbm_sha256_update(&ctx, "\0", 1);
+        if (cbm_file_exists(defaults) && !cbm_sha256_update_file(&ctx, defaults)) {
+                return NULL;
+        }
+        cbm_sha256_update(&ctx, "\0", 1);
+        if (!native && !grub2_digest_dir(&ctx, boot_dir, false)) {
+                return NULL;
+        }
+        cbm_sha256_update(&ctx, "\0", 1);
+        if (default_kernel && !native) {
+                cbm_sha256_update(&ctx,
+                                  default_kernel->target.legacy_path,
+                                  strlen(default_kernel->target.legacy_path) + 1);
+                if (default_kernel->target.initrd_path) {
+                        cbm_sha256_update(&ctx,
+                                          default_kernel->target.initrd_path,
+                                          strlen(default_kernel->target.initrd_path) + 1);
+                }
         }
-        autofree(char) *vmlinuz_path = NULL;
-        autofree(char) *initrd_path = NULL;
-        autofree(char) *command = NULL;
-        autofree(char) *boot_dir = NULL;
-        autofree(char) *grub_dir = NULL;
-        autofree(char) *vmlinuz_rel = NULL;
-        autofree(char) *initrd_rel = NULL;
-        autofree(char) *boot_rel = NULL;
-        const char *prefix = NULL;
-        int ret;
+        cbm_sha256_final(&ctx, digest);
+        cbm_sha256_to_hex(digest, hex);
 
-        prefix = boot_manager_get_prefix((BootManager *)manager);
-        boot_dir = boot_manager_get_boot_dir((BootManager *)manager);
-        vmlinuz_path = string_printf("%s/vmlinuz", prefix);
-        initrd_path = string_printf("%s/initrd.img", prefix);
+        return string_printf("%s " CBM_FILE_KEY_FORMAT "\n", hex, CBM_FILE_KEY_ARGS(&cfg_key));
+}
 
-        /* Always nuke the files *before* running grub-mkconfig to stop duped
-         * entries being created */
-        if (nc_file_exists(vmlinuz_path) && unlink(vmlinuz_path) < 0) {
-                LOG_ERROR("grub2_set_default_kernel: Failed to remove %s: %s",
-                          vmlinuz_path,
-                          strerror(errno));
-                return false;
+/**
+ * Determine whether @link is a symlink to @target, or absent when @target
+ * is NULL
+ */
+static bool grub2_link_current(const char *link, const char *target)
+{
+        char buf[PATH_MAX];
+        ssize_t len = 0;
+
+        len = readlink(link, buf, sizeof(buf) - 1);
+        if (len < 0) {
+                return !target && errno == ENOENT;
         }
+        buf[len] = '\0';
+        return target && streq(buf, target);
+}
 
-        if (nc_file_exists(initrd_path) && unlink(initrd_path) < 0) {
+/**
+ * Point @link at @target, or remove it when @target is NULL
+ */
+static bool grub2_set_link(const char *link, const char *target)
+{
+        if (grub2_link_current(link, target)) {
+                return true;
+        }
+        if (cbm_unlink(link) < 0 && errno != ENOENT) {
                 LOG_FATAL("grub2_set_default_kernel: Failed to remove %s: %s",
-                          initrd_path,
+                          link,
+                          strerror(errno));
+                return false;
+        }
+        if (target && symlink(target, link) != 0) {
+                LOG_FATAL("grub2_set_default_kernel: Failed to update default link %s: %s",
+                          link,
                           strerror(errno));
                 return false;
         }
+        return true;
+}
+
+/**
+ * grub-mkconfig runs every grub.d script and os-prober, which is slow.
+ * Only run it when one of its inputs changed since it last succeeded.
+ */
+static bool grub2_mkconfig_current(CbmStage *stage, const char *prefix, const char *boot_dir,
+                                   const Kernel *default_kernel, bool native)
+{
+        autofree(char) *stamp_path = NULL;
+        autofree(char) *old_record = NULL;
+        autofree(char) *record = NULL;
+
+        stamp_path = string_printf("%s/%s", boot_dir, GRUB2_MKCONFIG_STAMP);
+        if (!file_get_text_staged(stage, stamp_path, &old_record)) {
+                return false;
+        }
+        record = grub2_mkconfig_record(prefix, boot_dir, default_kernel, native);
+        return record && streq(record, old_record);
+}
+
+/**
+ * Remember the inputs of a successful run. Failure only means the next run
+ * can't be skipped.
+ */
+static void grub2_mkconfig_save(CbmStage *stage, const char *prefix, const char *boot_dir,
+                                const Kernel *default_kernel, bool native)
+{
+        autofree(char) *stamp_path = NULL;
+        autofree(char) *record = NULL;
+
+        stamp_path = string_printf("%s/%s", boot_dir, GRUB2_MKCONFIG_STAMP);
+        record = grub2_mkconfig_record(prefix, boot_dir, default_kernel, native);
+        if (!record || !file_set_text_staged(stage, stamp_path, record)) {
+                LOG_DEBUG("Unable to record grub-mkconfig inputs: %s", stamp_path);
+                cbm_unlink(stamp_path);
+        }
+}
+
+/**
+ * Run grub-mkconfig, without any default links around to stop 10_linux
+ * creating duplicate entries from them
+ */
+static bool grub2_mkconfig(const char *prefix, const char *boot_dir, const char *vmlinuz_path,
+                           const char *initrd_path)
+{
+        autofree(char) *command = NULL;
+        autofree(char) *grub_dir = NULL;
+        autofree(char) *stamp_path = NULL;
+        CbmTraceSpan span = { 0 };
+        int ret;
+
+        if (!grub2_set_link(vmlinuz_path, NULL) || !grub2_set_link(initrd_path, NULL)) {
+                return false;
+        }
 
         /* Ensure the GRUB2 directory tree exists */
         grub_dir = string_printf("%s/grub", boot_dir);
-        if (!nc_file_exists(grub_dir) && !nc_mkdir_p(grub_dir, 00755)) {
+        if (!cbm_file_exists(grub_dir) && !nc_mkdir_p(grub_dir, 00755)) {
                 LOG_FATAL("grub2_set_default_kernel: Failed to mkdir %s: %s",
                           grub_dir,
                           strerror(errno));
                 return false;
         }
 
-        /* Write the grub configuration */
-        if (!grub2_write_config(manager, default_kernel)) {
-                LOG_FATAL("Failed to write GRUB2 configuration: %s", strerror(errno));
-                return false;
+        /* Run grub-mkconfig now, forgetting the last run in case it fails */
+        stamp_path = string_printf("%s/%s", boot_dir, GRUB2_MKCONFIG_STAMP);
+        if (cbm_file_exists(stamp_path)) {
+                cbm_unlink(stamp_path);
         }
-
-        /* Run grub-mkconfig now */
         command = string_printf("%s/usr/sbin/grub-mkconfig -o %s/grub/grub.cfg", prefix, boot_dir);
+        span = cbm_trace_begin("grub-mkconfig");
         ret = cbm_system_system(command);
+        cbm_trace_end(&span);
         if (ret != 0) {
                 LOG_FATAL("grub2_set_default_kernel: grub-mkconfig exited with status code %d: %s",
                           ret,
                           strerror(errno));
                 return false;
         }
+        return true;
+}
 
-        /* Nothing else to do here */
-        if (!default_kernel) {
-                return true;
-        }
+static bool grub2_apply_default_kernel(const BootManager *manager, const Kernel *default_kernel)
+{
+        autofree(char) *vmlinuz_path = NULL;
+        autofree(char) *initrd_path = NULL;
+        autofree(char) *boot_dir = NULL;
+        autofree(char) *vmlinuz_rel = NULL;
+        autofree(char) *initrd_rel = NULL;
+        autofree(char) *boot_rel = NULL;
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
+        const char *prefix = NULL;
+        bool native = false;
+        bool ran = false;
 
-        /* i.e. boot */
-        boot_rel = grub2_get_boot_relative();
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+        boot_dir = boot_manager_get_boot_dir((BootManager *)manager);
+        vmlinuz_path = string_printf("%s/vmlinuz", prefix);
+        initrd_path = string_printf("%s/initrd.img", prefix);
+        native = grub2_is_native((BootManager *)manager);
 
-        /* /vmlinuz -> boot/kernel-* */
-        vmlinuz_rel = string_printf("%s/%s", boot_rel, default_kernel->target.legacy_path);
-        if (symlink(vmlinuz_rel, vmlinuz_path) != 0) {
-                LOG_FATAL("grub2_set_default_kernel: Failed to update kernel default link: %s",
-                          strerror(errno));
+        /* Write the grub configuration */
+        if (!grub2_write_config(manager, default_kernel, native)) {
+                LOG_FATAL("Failed to write GRUB2 configuration: %s", strerror(errno));
                 return false;
         }
 
-        /* No initrd, just continue */
-        if (!default_kernel->target.initrd_path) {
-                return true;
+        if (grub2_mkconfig_current(stage, prefix, boot_dir, default_kernel, native)) {
+                LOG_DEBUG("GRUB2 configuration is up to date, skipping grub-mkconfig");
+        } else if (grub2_mkconfig(prefix, boot_dir, vmlinuz_path, initrd_path)) {
+                ran = true;
+        } else {
+                return false;
         }
 
-        /* /initrd.img -> boot/initrd-* */
-        initrd_rel = string_printf("%s/%s", boot_rel, default_kernel->target.initrd_path);
-        if (symlink(initrd_rel, initrd_path) != 0) {
-                LOG_FATAL("grub2_set_default_kernel: Failed to update initrd default link: %s",
-                          strerror(errno));
+        if (default_kernel) {
+                /* i.e. boot */
+                boot_rel = grub2_get_boot_relative();
+
+                /* /vmlinuz -> boot/kernel-*, /initrd.img -> boot/initrd-* */
+                vmlinuz_rel = string_printf("%s/%s", boot_rel, default_kernel->target.legacy_path);
+                if (default_kernel->target.initrd_path) {
+                        initrd_rel =
+                            string_printf("%s/%s", boot_rel, default_kernel->target.initrd_path);
+                }
+        }
+        if (!grub2_set_link(vmlinuz_path, vmlinuz_rel) ||
+            !grub2_set_link(initrd_path, initrd_rel)) {
                 return false;
         }
 
+        if (ran) {
+                grub2_mkconfig_save(stage, prefix, boot_dir, default_kernel, native);
+        }
         return true;
 }
 
+bool grub2_set_default_kernel(const BootManager *manager, const Kernel *default_kernel)
+{
+        bool ret = false;
+
+        if (!manager) {
+                return false;
+        }
+
+        ret = grub2_apply_default_kernel(manager, default_kernel);
+
+        /* The queued kernels are owned by the caller and only valid for this
+         * update, so the next one must start afresh. */
+        grub2_destroy(manager);
+        if (!grub2_init(manager)) {
+                return false;
+        }
+
+        return ret;
+}
+
 bool grub2_needs_install(__cbm_unused__ const BootManager *manager)
 {
         return false;
@@ -18,6 +18,7 @@
 #include "bootvar.h"
 #include "config.h"
 #include "files.h"
+#include "manifest.h"
 #include "nica/files.h"
 #include "systemd-class.h"
 #include <log.h>
@@ -61,6 +62,8 @@
 static const char *shim_systemd_get_kernel_destination(const BootManager *);
 static bool shim_systemd_install_kernel(const BootManager *, const Kernel *);
 static bool shim_systemd_remove_kernel(const BootManager *, const Kernel *);
+static bool shim_systemd_remove_kernels(const BootManager *, NcArray *);
+static bool shim_systemd_reconcile_kernels(const BootManager *, NcArray *, NcArray *);
 static bool shim_systemd_set_default_kernel(const BootManager *, const Kernel *);
 static bool shim_systemd_needs_install(const BootManager *);
 static bool shim_systemd_needs_update(const BootManager *);
@@ -77,7 +80,10 @@ __cbm_export__ const BootLoader
                                .get_kernel_destination = shim_systemd_get_kernel_destination,
                                .install_kernel = shim_systemd_install_kernel,
                                .remove_kernel = shim_systemd_remove_kernel,
+                               .remove_kernels = shim_systemd_remove_kernels,
+                               .reconcile_kernels = shim_systemd_reconcile_kernels,
                                .set_default_kernel = shim_systemd_set_default_kernel,
+                               .set_timeout = sd_class_set_timeout,
                                .needs_install = shim_systemd_needs_install,
                                .needs_update = shim_systemd_needs_update,
                                .install = shim_systemd_install,
@@ -132,15 +138,22 @@ __cbm_export__ const BootLoader
         "/"                                                                                        \
         "BOOT" EFI_SUFFIX
 
-static char *shim_src;
-static char *shim_dst_host; /* as accessible by the CMB for file ops. */
-static char *shim_dst_esp;  /* absolute location of shim on the ESP. */
-static char *systemd_src;
-static char *systemd_dst_host;
-static int is_image_mode;
-static int has_boot_rec = -1;
-
-extern void sd_class_set_get_kernel_destination_impl(const char *(*)(const BootManager *));
+/* state of each BootManager, attached alongside that of sd_class. */
+typedef struct ShimSystemdState {
+        char *shim_src;
+        char *shim_dst_host;       /* as accessible by the CMB for file ops. */
+        const char *shim_dst_esp;  /* absolute location of shim on the ESP. */
+        char *systemd_src;
+        char *systemd_dst_host;
+        int is_image_mode;
+        int has_boot_rec;          /* -1 until looked for */
+        bootvar_table_t *bootvars; /* NULL in image mode */
+} ShimSystemdState;
+
+static inline ShimSystemdState *shim_systemd_get(const BootManager *manager)
+{
+        return sd_class_get_data(manager);
+}
 
 static const char *shim_systemd_get_kernel_destination(__cbm_unused__ const BootManager *manager)
 {
@@ -157,6 +170,17 @@ static bool shim_systemd_remove_kernel(const BootManager *manager, const Kernel
         return sd_class_remove_kernel(manager, kernel);
 }
 
+static bool shim_systemd_remove_kernels(const BootManager *manager, NcArray *kernels)
+{
+        return sd_class_remove_kernels(manager, kernels);
+}
+
+static bool shim_systemd_reconcile_kernels(const BootManager *manager, NcArray *install,
+                                           NcArray *keep)
+{
+        return sd_class_reconcile_kernels(manager, install, keep);
+}
+
 static bool shim_systemd_set_default_kernel(const BootManager *manager, const Kernel *kernel)
 {
         /* this writes systemd config. systemd has the configuration paths
@@ -164,112 +188,123 @@ static bool shim_systemd_set_default_kernel(const BootManager *manager, const Ke
         return sd_class_set_default_kernel(manager, kernel);
 }
 
-static bool exists_identical(const char *path, const char *spath)
+static bool exists_identical(const BootManager *manager, const char *path, const char *spath)
 {
-        if (!nc_file_exists(path)) {
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
+
+        if (!cbm_file_exists(path)) {
                 return false;
         }
-        if (spath && !cbm_files_match(path, spath)) {
+        if (spath && !cbm_manifest_files_match(manifest, spath, path)) {
                 return false;
         }
         return true;
 }
 
-static bool shim_systemd_needs_install(__cbm_unused__ const BootManager *manager)
+/**
+ * Look for our boot entry once, every later check reuses the result
+ */
+static bool shim_systemd_has_boot_rec(ShimSystemdState *st)
 {
-        if (has_boot_rec < 0) {
-                if (!is_image_mode) {
-                        has_boot_rec = bootvar_has_boot_rec(BOOT_DIRECTORY, shim_dst_esp);
+        if (st->has_boot_rec < 0) {
+                if (!st->is_image_mode) {
+                        st->has_boot_rec =
+                            bootvar_has_boot_rec(st->bootvars, BOOT_DIRECTORY, st->shim_dst_esp);
                 } else {
-                        has_boot_rec = 1;
+                        st->has_boot_rec = 1;
                 }
         }
-        if (!exists_identical(shim_dst_host, NULL)) {
+        return st->has_boot_rec;
+}
+
+static bool shim_systemd_needs_install(const BootManager *manager)
+{
+        ShimSystemdState *st = shim_systemd_get(manager);
+
+        if (!exists_identical(manager, st->shim_dst_host, NULL)) {
                 return true;
         }
-        if (!exists_identical(systemd_dst_host, NULL)) {
+        if (!exists_identical(manager, st->systemd_dst_host, NULL)) {
                 return true;
         }
-        return !has_boot_rec;
+        return !shim_systemd_has_boot_rec(st);
 }
 
-static bool shim_systemd_needs_update(__cbm_unused__ const BootManager *manager)
+static bool shim_systemd_needs_update(const BootManager *manager)
 {
-        if (has_boot_rec < 0) {
-                if (!is_image_mode) {
-                        has_boot_rec = bootvar_has_boot_rec(BOOT_DIRECTORY, shim_dst_esp);
-                } else {
-                        has_boot_rec = 1;
-                }
-        }
-        if (!exists_identical(shim_dst_host, shim_src)) {
+        ShimSystemdState *st = shim_systemd_get(manager);
+
+        if (!exists_identical(manager, st->shim_dst_host, st->shim_src)) {
                 return true;
         }
-        if (!exists_identical(systemd_dst_host, systemd_src)) {
+        if (!exists_identical(manager, st->systemd_dst_host, st->systemd_src)) {
                 return true;
         }
-        return !has_boot_rec;
+        return !shim_systemd_has_boot_rec(st);
 }
 
 static bool make_layout(const BootManager *manager)
 {
-        char *boot_root = boot_manager_get_boot_dir((BootManager *)manager);
-        char *path = NULL;
-        path = string_printf("%s%s", boot_root, DST_DIR);
-        if (!nc_mkdir_p(path, 00755)) {
-                goto fail;
-        }
-        free(path);
-        path = string_printf("%s%s", boot_root, KERNEL_DST_DIR);
-        if (!nc_mkdir_p(path, 00755)) {
-                goto fail;
-        }
-        free(path);
-        path = string_printf("%s%s", boot_root, SYSTEMD_ENTRIES);
-        if (!nc_mkdir_p(path, 00755)) {
-                goto fail;
-        }
-        free(path);
+        ShimSystemdState *st = shim_systemd_get(manager);
+        autofree(char) *boot_root = boot_manager_get_boot_dir((BootManager *)manager);
+        const char *dirs[] = { DST_DIR, KERNEL_DST_DIR, SYSTEMD_ENTRIES, EFI_FALLBACK_DIR };
         /* in case of image creation, override the fallback bootloader, so the
          * media will be bootable. */
-        if (is_image_mode) {
-                path = string_printf("%s%s", boot_root, EFI_FALLBACK_DIR);
-                LOG_INFO("Image mode: creating dir for fallback: %s", path);
+        size_t n_dirs = st->is_image_mode ? ARRAY_SIZE(dirs) : ARRAY_SIZE(dirs) - 1;
+
+        for (size_t i = 0; i < n_dirs; i++) {
+                autofree(char) *path = string_printf("%s%s", boot_root, dirs[i]);
+
+                /* Already laid out, nothing to write */
+                if (cbm_file_exists(path)) {
+                        continue;
+                }
+                if (streq(dirs[i], EFI_FALLBACK_DIR)) {
+                        LOG_INFO("Image mode: creating dir for fallback: %s", path);
+                }
                 if (!nc_mkdir_p(path, 00755)) {
-                        goto fail;
+                        LOG_FATAL("Failed to make dir: %s", path);
+                        return false;
                 }
-                free(path);
         }
-        free(boot_root);
         return true;
-fail:
-        free(boot_root);
-        if (path) {
-                LOG_FATAL("Failed to make dir: %s", path);
-                free(path);
+}
+
+/**
+ * Install @src at @dst, unless it's already there
+ */
+static bool shim_systemd_install_blob(const BootManager *manager, const char *src,
+                                      const char *dst)
+{
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
+
+        if (exists_identical(manager, dst, src)) {
+                LOG_DEBUG("%s is up to date", dst);
+                return true;
+        }
+        if (!cbm_manifest_install_file(manifest, src, dst, 00644)) {
+                LOG_FATAL("Cannot copy %s to %s", src, dst);
+                return false;
         }
-        return false;
+        return true;
 }
 
 /* Installs EFI fallback (default) bootloader at /EFI/Boot/BOOTX64.EFI */
 static bool shim_systemd_install_fallback_bootloader(const BootManager *manager)
 {
-        char *boot_dir = boot_manager_get_boot_dir((BootManager *)manager);
-        char *dst = string_printf("%s%s", boot_dir, EFI_FALLBACK_PATH);
-        bool result = true;
-
-        free(boot_dir);
+        autofree(char) *boot_dir = boot_manager_get_boot_dir((BootManager *)manager);
+        autofree(char) *dst = string_printf("%s%s", boot_dir, EFI_FALLBACK_PATH);
 
-        if (!copy_file_atomic(systemd_src, dst, 00644)) {
-                LOG_FATAL("Cannot copy %s to %s", systemd_src, dst);
-                result = false;
-        }
-        free(dst);
-        return result;
+        return shim_systemd_install_blob(manager, shim_systemd_get(manager)->systemd_src, dst);
 }
 
-static bool shim_systemd_install(const BootManager *manager)
+/**
+ * Bring the layout, blobs and boot entry in line, touching only what's
+ * missing or differs. An up to date system sees no writes at all.
+ */
+static bool shim_systemd_apply(const BootManager *manager)
 {
+        ShimSystemdState *st = shim_systemd_get(manager);
         char varname[9];
 
         if (!make_layout(manager)) {
@@ -277,21 +312,28 @@ static bool shim_systemd_install(const BootManager *manager)
                 return false;
         }
 
-        if (!copy_file_atomic(shim_src, shim_dst_host, 00644)) {
-                LOG_FATAL("Cannot copy %s to %s", shim_src, shim_dst_host);
+        if (!shim_systemd_install_blob(manager, st->shim_src, st->shim_dst_host)) {
                 return false;
         }
-        if (!copy_file_atomic(systemd_src, systemd_dst_host, 00644)) {
-                LOG_FATAL("Cannot copy %s to %s", systemd_src, systemd_dst_host);
+        if (!shim_systemd_install_blob(manager, st->systemd_src, st->systemd_dst_host)) {
                 return false;
         }
 
-        if (!is_image_mode) {
-                if (!has_boot_rec) {
-                        if (bootvar_create(BOOT_DIRECTORY, shim_dst_esp, varname, 9)) {
+        if (!st->is_image_mode) {
+                if (!shim_systemd_has_boot_rec(st)) {
+                        if (bootvar_create(st->bootvars,
+                                           BOOT_DIRECTORY,
+                                           st->shim_dst_esp,
+                                           varname,
+                                           9)) {
                                 LOG_FATAL("Cannot create EFI variable (boot entry)");
                                 return false;
                         }
+                        if (bootvar_commit(st->bootvars)) {
+                                LOG_FATAL("Cannot update EFI BootOrder");
+                                return false;
+                        }
+                        st->has_boot_rec = 1;
                 }
         } else {
                 /* override the fallback bootloader in case it's the image mode,
@@ -304,9 +346,14 @@ static bool shim_systemd_install(const BootManager *manager)
         return true;
 }
 
+static bool shim_systemd_install(const BootManager *manager)
+{
+        return shim_systemd_apply(manager);
+}
+
 static bool shim_systemd_update(const BootManager *manager)
 {
-        return shim_systemd_install(manager);
+        return shim_systemd_apply(manager);
 }
 
 static bool shim_systemd_remove(__cbm_unused__ const BootManager *manager)
@@ -317,18 +364,10 @@ static bool shim_systemd_remove(__cbm_unused__ const BootManager *manager)
 
 static bool shim_systemd_init(const BootManager *manager)
 {
+        ShimSystemdState *st = NULL;
         size_t len;
         char *prefix, *boot_root;
 
-        if (!boot_manager_is_image_mode((BootManager *)manager)) {
-                if (bootvar_init()) {
-                        return false;
-                }
-                is_image_mode = 0;
-        } else {
-                is_image_mode = 1;
-        }
-
         /* init systemd-class since we're reusing it for kernel install.
          * specific values do not matter as long as sd_class is not used to
          * install the bootloaders themselves. */
@@ -336,16 +375,37 @@ static bool shim_systemd_init(const BootManager *manager)
                                                   .efi_dir = "/usr/lib/systemd/boot/efi",
                                                   .efi_blob = "systemd-boot" EFI_SUFFIX,
                                                   .name = "systemd-boot" };
-        sd_class_init(manager, &systemd_config);
-        sd_class_set_get_kernel_destination_impl(shim_systemd_get_kernel_destination);
+        if (!sd_class_init(manager, &systemd_config)) {
+                return false;
+        }
+        sd_class_set_get_kernel_destination_impl(manager, shim_systemd_get_kernel_destination);
+
+        st = calloc(1, sizeof(ShimSystemdState));
+        if (!st) {
+                DECLARE_OOM();
+                abort();
+        }
+        sd_class_set_data(manager, st);
+
+        /* The boot entries may have changed since we last looked */
+        st->has_boot_rec = -1;
+
+        if (!boot_manager_is_image_mode((BootManager *)manager)) {
+                if (bootvar_init(&st->bootvars)) {
+                        return false;
+                }
+                st->is_image_mode = 0;
+        } else {
+                st->is_image_mode = 1;
+        }
 
         prefix = strdup(boot_manager_get_prefix((BootManager *)manager));
         len = strlen(prefix);
         if (len > 0 && prefix[len - 1] == '/') {
                 prefix[len - 1] = '\0';
         }
-        shim_src = string_printf("%s/%s", prefix, SHIM_SRC);
-        systemd_src = string_printf("%s/%s", prefix, SYSTEMD_SRC);
+        st->shim_src = string_printf("%s/%s", prefix, SHIM_SRC);
+        st->systemd_src = string_printf("%s/%s", prefix, SYSTEMD_SRC);
 
         boot_root = boot_manager_get_boot_dir((BootManager *)manager);
         len = strlen(boot_root);
@@ -354,10 +414,10 @@ static bool shim_systemd_init(const BootManager *manager)
         if (len > 0 && boot_root[len - 1] == '/') {
                 boot_root[len - 1] = '\0';
         }
-        shim_dst_host = string_printf("%s%s", boot_root, SHIM_DST);
-        systemd_dst_host = string_printf("%s%s", boot_root, SYSTEMD_DST);
+        st->shim_dst_host = string_printf("%s%s", boot_root, SHIM_DST);
+        st->systemd_dst_host = string_printf("%s%s", boot_root, SYSTEMD_DST);
 
-        shim_dst_esp = SHIM_DST;
+        st->shim_dst_esp = SHIM_DST;
 
         free(prefix);
         free(boot_root);
@@ -367,21 +427,25 @@ static bool shim_systemd_init(const BootManager *manager)
 
 static void shim_systemd_destroy(const BootManager *manager)
 {
-        free(shim_src);
-        free(systemd_src);
-        free(shim_dst_host);
-        free(systemd_dst_host);
-        if (!is_image_mode) {
-                bootvar_destroy();
+        ShimSystemdState *st = shim_systemd_get(manager);
+
+        if (st) {
+                free(st->shim_src);
+                free(st->systemd_src);
+                free(st->shim_dst_host);
+                free(st->systemd_dst_host);
+                bootvar_destroy(st->bootvars);
+                free(st);
+                sd_class_set_data(manager, NULL);
         }
         sd_class_destroy(manager);
 
         return;
 }
 
-static int shim_systemd_get_capabilities(__cbm_unused__ const BootManager *manager)
+static int shim_systemd_get_capabilities(const BootManager *manager)
 {
-        return BOOTLOADER_CAP_GPT | BOOTLOADER_CAP_UEFI;
+        return sd_class_get_capabilities(manager);
 }
 
 /*
@@ -27,59 +27,61 @@
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "sha256.h"
 #include "system_stub.h"
+#include "trace.h"
 #include "util.h"
 #include "writer.h"
 
 #define CBM_MBR_SYSLINUX_SIZE 440
 
-static KernelArray *kernel_queue = NULL;
-static char *extlinux_cmd = NULL;
-static char *base_path = NULL;
+/**
+ * Records what the last successful extlinux run left behind, relative to the
+ * boot directory. ldlinux.sys is patched with its own location on install,
+ * so it can't be compared against any source, only against itself.
+ */
+#define SYSLINUX_EXTLINUX_STAMP ".clr-boot-manager-extlinux"
+
+/**
+ * State of each BootManager, from init until destroy
+ */
+typedef struct SyslinuxState {
+        KernelArray *kernel_queue; /**<Kernels for the conf, pointers not owned */
+        char *base_path;           /**<Boot directory */
+} SyslinuxState;
+
+static inline SyslinuxState *syslinux_get(const BootManager *manager)
+{
+        return boot_manager_get_bootloader_data((BootManager *)manager);
+}
 
 static bool syslinux_init(const BootManager *manager)
 {
-        autofree(char) *ldlinux = NULL;
-        const char *prefix = NULL;
+        SyslinuxState *st = NULL;
 
-        if (kernel_queue) {
-                kernel_array_free(kernel_queue);
-        }
-        kernel_queue = nc_array_new();
-        if (!kernel_queue) {
+        st = calloc(1, sizeof(SyslinuxState));
+        if (!st) {
                 DECLARE_OOM();
                 abort();
         }
-        if (base_path) {
-                free(base_path);
-                base_path = NULL;
-        }
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
-        OOM_CHECK_RET(base_path, false);
-
-        if (extlinux_cmd) {
-                free(extlinux_cmd);
-                extlinux_cmd = NULL;
-        }
+        boot_manager_set_bootloader_data((BootManager *)manager, st);
 
-        ldlinux = string_printf("%s/ldlinux.sys", base_path);
-
-        prefix = boot_manager_get_prefix((BootManager *)manager);
-
-        if (nc_file_exists(ldlinux)) {
-                extlinux_cmd =
-                    string_printf("%s/usr/bin/extlinux -U %s &> /dev/null", prefix, base_path);
-        } else {
-                extlinux_cmd =
-                    string_printf("%s/usr/bin/extlinux -i %s &> /dev/null", prefix, base_path);
+        st->kernel_queue = nc_array_new();
+        if (!st->kernel_queue) {
+                DECLARE_OOM();
+                abort();
         }
+        st->base_path = boot_manager_get_boot_dir((BootManager *)manager);
+        OOM_CHECK_RET(st->base_path, false);
 
         return true;
 }
 
 /* Queue kernel to be added to conf */
-static bool syslinux_install_kernel(__cbm_unused__ const BootManager *manager, const Kernel *kernel)
+static bool syslinux_install_kernel(const BootManager *manager, const Kernel *kernel)
 {
+        KernelArray *kernel_queue = syslinux_get(manager)->kernel_queue;
+
         /* We may end up adding the same kernel again, when in repair situations
          * for existing kernels (and current == tip cases)
          */
@@ -108,9 +110,10 @@ static bool syslinux_remove_kernel(__cbm_unused__ const BootManager *manager,
 /* Actually creates the whole conf by iterating through the queued kernels */
 static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel *default_kernel)
 {
+        SyslinuxState *st = syslinux_get(manager);
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
         autofree(char) *config_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
 
         root_dev = boot_manager_get_root_device((BootManager *)manager);
@@ -119,9 +122,10 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
                 return false;
         }
 
-        config_path = string_printf("%s/syslinux.cfg", base_path);
+        config_path = string_printf("%s/syslinux.cfg", st->base_path);
 
-        if (!cbm_writer_open(writer)) {
+        /* Each entry is a handful of short lines plus the cmdline */
+        if (!cbm_writer_open_sized(writer, 512 * (size_t)(st->kernel_queue->len + 1))) {
                 DECLARE_OOM();
                 abort();
         }
@@ -131,8 +135,8 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
                 cbm_writer_append(writer, "TIMEOUT 100\n");
         }
 
-        for (uint16_t i = 0; i < kernel_queue->len; i++) {
-                const Kernel *k = nc_array_get(kernel_queue, i);
+        for (uint16_t i = 0; i < st->kernel_queue->len; i++) {
+                const Kernel *k = nc_array_get(st->kernel_queue, i);
 
                 /* Mark it default */
                 if (default_kernel && streq(k->source.path, default_kernel->source.path)) {
@@ -172,77 +176,263 @@ static bool syslinux_set_default_kernel(const BootManager *manager, const Kernel
         }
 
         /* If the file is the same, don't write it again or sync */
-        if (file_get_text(config_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
-        }
-
-        if (!file_set_text(config_path, writer->buffer)) {
+        if (!cbm_writer_commit_if_changed(writer, stage, config_path, NULL)) {
                 LOG_FATAL("syslinux_set_default_kernel: Failed to write %s: %s",
                           config_path,
                           strerror(errno));
                 return false;
         }
 
-        cbm_sync();
         return true;
 }
 
-static bool syslinux_needs_update(__cbm_unused__ const BootManager *manager)
+/**
+ * Determine whether the MBR of @disk already holds the boot code in @source
+ */
+static bool syslinux_mbr_current(const char *disk, const char *source)
 {
-        return true;
-}
+        char disk_mbr[CBM_MBR_SYSLINUX_SIZE];
+        char source_mbr[CBM_MBR_SYSLINUX_SIZE];
+        ssize_t disk_len = 0;
+        ssize_t source_len = 0;
+        int disk_fd = -1;
+        int source_fd = -1;
+
+        disk_fd = open(disk, O_RDONLY | O_CLOEXEC);
+        source_fd = open(source, O_RDONLY | O_CLOEXEC);
+        if (disk_fd >= 0 && source_fd >= 0) {
+                disk_len = pread(disk_fd, disk_mbr, sizeof(disk_mbr), 0);
+                source_len = pread(source_fd, source_mbr, sizeof(source_mbr), 0);
+        }
+        if (disk_fd >= 0) {
+                close(disk_fd);
+        }
+        if (source_fd >= 0) {
+                close(source_fd);
+        }
 
-static bool syslinux_needs_install(__cbm_unused__ const BootManager *manager)
-{
-        return true;
+        return disk_len == CBM_MBR_SYSLINUX_SIZE && source_len == CBM_MBR_SYSLINUX_SIZE &&
+               memcmp(disk_mbr, source_mbr, CBM_MBR_SYSLINUX_SIZE) == 0;
 }
 
-static bool syslinux_install(const BootManager *manager)
+/**
+ * Write the boot code in @source to the MBR of @disk
+ */
+static bool syslinux_write_mbr(const char *disk, const char *source)
 {
-        autofree(char) *boot_device = NULL;
-        autofree(char) *syslinux_path = NULL;
-        const char *prefix = NULL;
         int mbr = -1;
         int syslinux_mbr = -1;
         ssize_t count = 0;
 
-        prefix = boot_manager_get_prefix((BootManager *)manager);
-        boot_device = get_parent_disk((char *)prefix);
-        mbr = open(boot_device, O_WRONLY);
+        mbr = open(disk, O_WRONLY);
         if (mbr < 0) {
                 return false;
         }
 
-        syslinux_path = string_printf("%s/usr/share/syslinux/gptmbr.bin", prefix);
-
-        syslinux_mbr = open(syslinux_path, O_RDONLY);
+        syslinux_mbr = open(source, O_RDONLY);
         if (syslinux_mbr < 0) {
                 close(mbr);
                 return false;
         }
 
         count = sendfile(mbr, syslinux_mbr, NULL, CBM_MBR_SYSLINUX_SIZE);
-        if (count != CBM_MBR_SYSLINUX_SIZE) {
+        if (count != CBM_MBR_SYSLINUX_SIZE || !cbm_sync_fd(mbr)) {
                 close(mbr);
                 close(syslinux_mbr);
                 return false;
         }
         close(mbr);
         close(syslinux_mbr);
+        return true;
+}
 
-        if (cbm_system_system(extlinux_cmd) != 0) {
+/**
+ * Feed the hash of @path into the digest, or a marker if it's missing
+ */
+static bool syslinux_digest_file(CbmSha256 *ctx, const char *path)
+{
+        uint8_t digest[CBM_SHA256_SIZE];
+
+        if (!cbm_file_exists(path)) {
+                cbm_sha256_update(ctx, "", 1);
+                return true;
+        }
+        if (!cbm_sha256_file(path, digest)) {
                 return false;
         }
+        cbm_sha256_update(ctx, digest, sizeof(digest));
+        return true;
+}
+
+/**
+ * Compute the record of an extlinux install from the extlinux binary that
+ * performed it and the loader files it left in the boot directory
+ *
+ * @return A newly allocated record, or NULL if the inputs cannot be read
+ */
+static char *syslinux_extlinux_record(const BootManager *manager)
+{
+        SyslinuxState *st = syslinux_get(manager);
+        autofree(char) *extlinux = NULL;
+        autofree(char) *ldlinux_sys = NULL;
+        autofree(char) *ldlinux_c32 = NULL;
+        uint8_t digest[CBM_SHA256_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        CbmFileKey extlinux_key = { 0 };
+        const char *prefix = NULL;
+        CbmSha256 ctx;
 
-        cbm_sync();
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+        extlinux = string_printf("%s/usr/bin/extlinux", prefix);
+        ldlinux_sys = string_printf("%s/ldlinux.sys", st->base_path);
+        ldlinux_c32 = string_printf("%s/ldlinux.c32", st->base_path);
+
+        /* A missing extlinux has nothing to tell apart */
+        (void)cbm_file_key_for_path(&extlinux_key, extlinux);
+
+        cbm_sha256_init(&ctx);
+        if (!syslinux_digest_file(&ctx, ldlinux_sys) || !syslinux_digest_file(&ctx, ldlinux_c32)) {
+                return NULL;
+        }
+        cbm_sha256_final(&ctx, digest);
+        cbm_sha256_to_hex(digest, hex);
+
+        return string_printf(CBM_FILE_KEY_FORMAT " %s\n", CBM_FILE_KEY_ARGS(&extlinux_key), hex);
+}
+
+/**
+ * extlinux must run again if it's been replaced since it last ran, or if the
+ * files it installed changed since
+ */
+static bool syslinux_extlinux_current(const BootManager *manager)
+{
+        SyslinuxState *st = syslinux_get(manager);
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
+        autofree(char) *stamp_path = NULL;
+        autofree(char) *old_record = NULL;
+        autofree(char) *record = NULL;
+
+        stamp_path = string_printf("%s/%s", st->base_path, SYSLINUX_EXTLINUX_STAMP);
+        if (!file_get_text_staged(stage, stamp_path, &old_record)) {
+                return false;
+        }
+        record = syslinux_extlinux_record(manager);
+        return record && streq(record, old_record);
+}
+
+/**
+ * Run extlinux, and on success remember what it left behind. Failing to
+ * record that only means the next update can't skip it.
+ */
+static bool syslinux_run_extlinux(const BootManager *manager)
+{
+        SyslinuxState *st = syslinux_get(manager);
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
+        autofree(char) *ldlinux = NULL;
+        autofree(char) *command = NULL;
+        autofree(char) *stamp_path = NULL;
+        autofree(char) *record = NULL;
+        const char *prefix = NULL;
+        CbmTraceSpan span = { 0 };
+        int ret;
+
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+        ldlinux = string_printf("%s/ldlinux.sys", st->base_path);
+        command = string_printf("%s/usr/bin/extlinux %s %s &> /dev/null",
+                                prefix,
+                                cbm_file_exists(ldlinux) ? "-U" : "-i",
+                                st->base_path);
+
+        /* Forget the last run in case this one fails */
+        stamp_path = string_printf("%s/%s", st->base_path, SYSLINUX_EXTLINUX_STAMP);
+        if (cbm_file_exists(stamp_path)) {
+                cbm_unlink(stamp_path);
+        }
+
+        span = cbm_trace_begin("extlinux");
+        ret = cbm_system_system(command);
+        cbm_trace_end(&span);
+        if (ret != 0) {
+                return false;
+        }
+
+        record = syslinux_extlinux_record(manager);
+        if (!record || !file_set_text_staged(stage, stamp_path, record)) {
+                LOG_DEBUG("Unable to record extlinux install: %s", stamp_path);
+                cbm_unlink(stamp_path);
+        }
+
+        /* extlinux writes behind our back, so flush the whole boot filesystem */
+        cbm_sync_filesystem(st->base_path);
         return true;
 }
 
+static bool syslinux_needs_update(const BootManager *manager)
+{
+        autofree(char) *boot_device = NULL;
+        autofree(char) *syslinux_path = NULL;
+        const char *prefix = NULL;
+
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+        boot_device = get_parent_disk((char *)prefix);
+        if (!boot_device) {
+                return true;
+        }
+        syslinux_path = string_printf("%s/usr/share/syslinux/gptmbr.bin", prefix);
+
+        return !syslinux_mbr_current(boot_device, syslinux_path) ||
+               !syslinux_extlinux_current(manager);
+}
+
+static bool syslinux_needs_install(const BootManager *manager)
+{
+        autofree(char) *ldlinux = NULL;
+
+        /* Once installed, syslinux_needs_update knows what to redo */
+        ldlinux = string_printf("%s/ldlinux.sys", syslinux_get(manager)->base_path);
+        return !cbm_file_exists(ldlinux);
+}
+
+/**
+ * Bring the MBR and the extlinux install in line with their sources. Raw
+ * disk writes and extlinux are slow, so only what differs is touched.
+ */
+static bool syslinux_apply(const BootManager *manager)
+{
+        autofree(char) *boot_device = NULL;
+        autofree(char) *syslinux_path = NULL;
+        const char *prefix = NULL;
+
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+        boot_device = get_parent_disk((char *)prefix);
+        if (!boot_device) {
+                return false;
+        }
+        syslinux_path = string_printf("%s/usr/share/syslinux/gptmbr.bin", prefix);
+
+        if (!syslinux_mbr_current(boot_device, syslinux_path)) {
+                if (!syslinux_write_mbr(boot_device, syslinux_path)) {
+                        return false;
+                }
+        } else {
+                LOG_DEBUG("MBR of %s is up to date", boot_device);
+        }
+
+        if (syslinux_extlinux_current(manager)) {
+                LOG_DEBUG("extlinux install is up to date, skipping extlinux");
+                return true;
+        }
+        return syslinux_run_extlinux(manager);
+}
+
+static bool syslinux_install(const BootManager *manager)
+{
+        return syslinux_apply(manager);
+}
+
 static bool syslinux_update(const BootManager *manager)
 {
-        return syslinux_install(manager);
+        return syslinux_apply(manager);
 }
 
 static bool syslinux_remove(__cbm_unused__ const BootManager *manager)
@@ -251,20 +441,20 @@ static bool syslinux_remove(__cbm_unused__ const BootManager *manager)
         return true;
 }
 
-static void syslinux_destroy(__cbm_unused__ const BootManager *manager)
+static void syslinux_destroy(const BootManager *manager)
 {
-        if (kernel_queue) {
-                /* kernels pointers inside are not owned by the array */
-                nc_array_free(&kernel_queue, NULL);
-        }
-        if (extlinux_cmd) {
-                free(extlinux_cmd);
-                extlinux_cmd = NULL;
+        SyslinuxState *st = syslinux_get(manager);
+
+        if (!st) {
+                return;
         }
-        if (base_path) {
-                free(base_path);
-                base_path = NULL;
+        if (st->kernel_queue) {
+                /* kernels pointers inside are not owned by the array */
+                nc_array_free(&st->kernel_queue, NULL);
         }
+        free(st->base_path);
+        free(st);
+        boot_manager_set_bootloader_data((BootManager *)manager, NULL);
 }
 
 static int syslinux_get_capabilities(__cbm_unused__ const BootManager *manager)
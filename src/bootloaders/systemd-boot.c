@@ -29,7 +29,10 @@ __cbm_export__ const BootLoader
                           .get_kernel_destination = sd_class_get_kernel_destination,
                           .install_kernel = sd_class_install_kernel,
                           .remove_kernel = sd_class_remove_kernel,
+                          .remove_kernels = sd_class_remove_kernels,
+                          .reconcile_kernels = sd_class_reconcile_kernels,
                           .set_default_kernel = sd_class_set_default_kernel,
+                          .set_timeout = sd_class_set_timeout,
                           .needs_install = sd_class_needs_install,
                           .needs_update = sd_class_needs_update,
                           .install = sd_class_install,
@@ -11,25 +11,38 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "bootloader.h"
 #include "bootman.h"
+#include "casepath.h"
 #include "config.h"
 #include "files.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/files.h"
 #include "systemd-class.h"
+#include "uki.h"
 #include "util.h"
 #include "writer.h"
 
 /**
- * Private to systemd-class implementation
+ * EFI stub unified kernel images are assembled from, unless configured
+ */
+#define SD_CLASS_UKI_STUB "/usr/lib/systemd/boot/efi/linux" SYSTEMD_EFI_SUFFIX ".stub"
+
+/**
+ * Private to systemd-class implementation, one for each BootManager
  */
 typedef struct SdClassConfig {
+        BootLoaderConfig *config;
+        const char *(*get_kernel_destination)(const BootManager *);
+        void *data; /**<State of the bootloader built on top, if any */
         char *efi_dir;
         char *vendor_dir;
         char *entries_dir;
@@ -39,28 +52,53 @@ typedef struct SdClassConfig {
         char *default_path_efi_blob;
         char *loader_config;
         char *kernel_dir;
+        char *uki_dir;        /**<Where the loader discovers images, /EFI/Linux */
+        char *uki_stub;       /**<Stub to assemble images from, NULL unless in UKI mode */
+        char *uki_os_release; /**<Loaded on first use */
 } SdClassConfig;
 
-static SdClassConfig sd_class_config = { 0 };
-static BootLoaderConfig *sd_config = NULL;
-
-static const char *(*get_kernel_destination_impl)(const BootManager *);
+static inline SdClassConfig *sd_class_get(const BootManager *manager)
+{
+        return boot_manager_get_bootloader_data((BootManager *)manager);
+}
 
-#define FREE_IF_SET(x)                                                                             \
-        {                                                                                          \
-                if (x) {                                                                           \
-                        free(x);                                                                   \
-                        x = NULL;                                                                  \
-                }                                                                                  \
-        }
+const char *sd_class_get_kernel_destination_default(const BootManager *manager)
+{
+        return sd_class_get(manager)->kernel_dir;
+}
 
-const char *sd_class_get_kernel_destination_default(__cbm_unused__ const BootManager *manager)
+/**
+ * Enter UKI mode if it's configured and there is a stub to build upon
+ */
+static void sd_class_init_uki(SdClassConfig *sd, const char *prefix)
 {
-        return sd_class_config.kernel_dir;
+        autofree(char) *config = NULL;
+        autofree(char) *text = NULL;
+        char *stub = NULL;
+
+        config = string_printf("%s%s", prefix, BOOTLOADER_UKI_CONFIG);
+        if (!cbm_file_exists(config)) {
+                return;
+        }
+        if (!file_get_text(config, &text)) {
+                LOG_ERROR("Unable to read %s: %s", config, strerror(errno));
+                return;
+        }
+        stub = strtok(text, " \t\r\n");
+        sd->uki_stub = string_printf("%s%s", prefix, stub ? stub : SD_CLASS_UKI_STUB);
+
+        /* Still bootable the old way, rather than not at all */
+        if (!cbm_file_exists(sd->uki_stub)) {
+                LOG_WARNING("EFI stub %s not found, not installing unified kernel images",
+                            sd->uki_stub);
+                free(sd->uki_stub);
+                sd->uki_stub = NULL;
+        }
 }
 
 bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
 {
+        SdClassConfig *sd = NULL;
         char *base_path = NULL;
         char *efi_dir = NULL;
         char *vendor_dir = NULL;
@@ -71,82 +109,132 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
         char *loader_config = NULL;
         const char *prefix = NULL;
 
-        sd_config = config;
+        sd = calloc(1, sizeof(SdClassConfig));
+        if (!sd) {
+                DECLARE_OOM();
+                abort();
+        }
+        /* Attached straight away, so sd_class_destroy cleans up after failure */
+        boot_manager_set_bootloader_data((BootManager *)manager, sd);
 
-        get_kernel_destination_impl = sd_class_get_kernel_destination_default;
+        sd->config = config;
+
+        sd->get_kernel_destination = sd_class_get_kernel_destination_default;
+
+        /* The boot directory may have been mounted since we last looked */
+        cbm_case_path_reset();
 
         /* Cache all of these to save useless allocs of the same paths later */
         base_path = boot_manager_get_boot_dir((BootManager *)manager);
         OOM_CHECK_RET(base_path, false);
-        sd_class_config.base_path = base_path;
+        sd->base_path = base_path;
 
-        efi_dir = nc_build_case_correct_path(base_path, "EFI", "Boot", NULL);
+        efi_dir = cbm_case_path_build(base_path, "EFI", "Boot", NULL);
         OOM_CHECK_RET(efi_dir, false);
-        sd_class_config.efi_dir = efi_dir;
+        sd->efi_dir = efi_dir;
 
-        vendor_dir = nc_build_case_correct_path(base_path, "EFI", sd_config->vendor_dir, NULL);
+        vendor_dir = cbm_case_path_build(base_path, "EFI", sd->config->vendor_dir, NULL);
         OOM_CHECK_RET(vendor_dir, false);
-        sd_class_config.vendor_dir = vendor_dir;
+        sd->vendor_dir = vendor_dir;
 
-        entries_dir = nc_build_case_correct_path(base_path, "loader", "entries", NULL);
+        entries_dir = cbm_case_path_build(base_path, "loader", "entries", NULL);
         OOM_CHECK_RET(entries_dir, false);
-        sd_class_config.entries_dir = entries_dir;
+        sd->entries_dir = entries_dir;
 
         prefix = boot_manager_get_prefix((BootManager *)manager);
 
         /* EFI paths */
         efi_blob_source =
-            string_printf("%s/%s/%s", prefix, sd_config->efi_dir, sd_config->efi_blob);
-        sd_class_config.efi_blob_source = efi_blob_source;
-
-        efi_blob_dest = nc_build_case_correct_path(sd_class_config.base_path,
-                                                   "EFI",
-                                                   sd_config->vendor_dir,
-                                                   sd_config->efi_blob,
-                                                   NULL);
+            string_printf("%s/%s/%s", prefix, sd->config->efi_dir, sd->config->efi_blob);
+        sd->efi_blob_source = efi_blob_source;
+
+        efi_blob_dest = cbm_case_path_build(sd->base_path,
+                                            "EFI",
+                                            sd->config->vendor_dir,
+                                            sd->config->efi_blob,
+                                            NULL);
         OOM_CHECK_RET(efi_blob_dest, false);
-        sd_class_config.efi_blob_dest = efi_blob_dest;
+        sd->efi_blob_dest = efi_blob_dest;
 
         /* default EFI loader path */
-        default_path_efi_blob = nc_build_case_correct_path(sd_class_config.base_path,
-                                                           "EFI",
-                                                           "Boot",
-                                                           DEFAULT_EFI_BLOB,
-                                                           NULL);
+        default_path_efi_blob =
+            cbm_case_path_build(sd->base_path, "EFI", "Boot", DEFAULT_EFI_BLOB, NULL);
         OOM_CHECK_RET(default_path_efi_blob, false);
-        sd_class_config.default_path_efi_blob = default_path_efi_blob;
+        sd->default_path_efi_blob = default_path_efi_blob;
 
         /* Loader entry */
-        loader_config =
-            nc_build_case_correct_path(sd_class_config.base_path, "loader", "loader.conf", NULL);
+        loader_config = cbm_case_path_build(sd->base_path, "loader", "loader.conf", NULL);
         OOM_CHECK_RET(loader_config, false);
-        sd_class_config.loader_config = loader_config;
+        sd->loader_config = loader_config;
+
+        sd->kernel_dir = "/EFI/" KERNEL_NAMESPACE;
 
-        sd_class_config.kernel_dir = "/EFI/" KERNEL_NAMESPACE;
+        sd->uki_dir = cbm_case_path_build(sd->base_path, "EFI", "Linux", NULL);
+        OOM_CHECK_RET(sd->uki_dir, false);
+        sd_class_init_uki(sd, prefix);
 
         return true;
 }
 
-void sd_class_set_get_kernel_destination_impl(const char *(*impl)(const BootManager *))
+void sd_class_set_get_kernel_destination_impl(const BootManager *manager,
+                                              const char *(*impl)(const BootManager *))
 {
-        get_kernel_destination_impl = impl;
+        sd_class_get(manager)->get_kernel_destination = impl;
 }
 
 const char *sd_class_get_kernel_destination(const BootManager *manager)
 {
-        return get_kernel_destination_impl(manager);
+        return sd_class_get(manager)->get_kernel_destination(manager);
 }
 
-void sd_class_destroy(__cbm_unused__ const BootManager *manager)
+void sd_class_set_data(const BootManager *manager, void *data)
 {
-        FREE_IF_SET(sd_class_config.efi_dir);
-        FREE_IF_SET(sd_class_config.vendor_dir);
-        FREE_IF_SET(sd_class_config.entries_dir);
-        FREE_IF_SET(sd_class_config.base_path);
-        FREE_IF_SET(sd_class_config.efi_blob_source);
-        FREE_IF_SET(sd_class_config.efi_blob_dest);
-        FREE_IF_SET(sd_class_config.default_path_efi_blob);
-        FREE_IF_SET(sd_class_config.loader_config);
+        sd_class_get(manager)->data = data;
+}
+
+void *sd_class_get_data(const BootManager *manager)
+{
+        SdClassConfig *sd = sd_class_get(manager);
+
+        return sd ? sd->data : NULL;
+}
+
+void sd_class_destroy(const BootManager *manager)
+{
+        SdClassConfig *sd = sd_class_get(manager);
+
+        if (!sd) {
+                return;
+        }
+        free(sd->efi_dir);
+        free(sd->vendor_dir);
+        free(sd->entries_dir);
+        free(sd->base_path);
+        free(sd->efi_blob_source);
+        free(sd->efi_blob_dest);
+        free(sd->default_path_efi_blob);
+        free(sd->loader_config);
+        free(sd->uki_dir);
+        free(sd->uki_stub);
+        free(sd->uki_os_release);
+        free(sd);
+        boot_manager_set_bootloader_data((BootManager *)manager, NULL);
+}
+
+/* i.e. Clear-linux-native-4.1.6-113.conf, or .efi for an image */
+static char *get_entry_name_for_kernel(const BootManager *manager, const Kernel *kernel,
+                                       const char *suffix)
+{
+        const char *prefix = NULL;
+
+        prefix = boot_manager_get_vendor_prefix((BootManager *)manager);
+
+        return string_printf("%s-%s-%s-%d%s",
+                             prefix,
+                             kernel->meta.ktype,
+                             kernel->meta.version,
+                             kernel->meta.release,
+                             suffix);
 }
 
 /* i.e. $prefix/$boot/loader/entries/Clear-linux-native-4.1.6-113.conf */
@@ -155,81 +243,170 @@ static char *get_entry_path_for_kernel(BootManager *manager, const Kernel *kerne
         if (!manager || !kernel) {
                 return NULL;
         }
+        SdClassConfig *sd = sd_class_get(manager);
         autofree(char) *item_name = NULL;
-        const char *prefix = NULL;
 
-        prefix = boot_manager_get_vendor_prefix(manager);
+        item_name = get_entry_name_for_kernel(manager, kernel, ".conf");
 
-        item_name = string_printf("%s-%s-%s-%d.conf",
-                                  prefix,
-                                  kernel->meta.ktype,
-                                  kernel->meta.version,
-                                  kernel->meta.release);
-
-        return nc_build_case_correct_path(sd_class_config.base_path,
-                                          "loader",
-                                          "entries",
-                                          item_name,
-                                          NULL);
+        return cbm_case_path_build(sd->base_path, "loader", "entries", item_name, NULL);
 }
 
-static bool sd_class_ensure_dirs(void)
+static bool sd_class_ensure_dirs(const SdClassConfig *sd)
 {
-        autofree(char) *kernel_destination_path = nc_build_case_correct_path(sd_class_config.base_path,
-                                                                             sd_class_config.kernel_dir,
-                                                                             NULL);
+        autofree(char) *kernel_destination_path =
+            cbm_case_path_build(sd->base_path, sd->kernel_dir, NULL);
 
-        if (!nc_mkdir_p(sd_class_config.efi_dir, 00755)) {
-                LOG_FATAL("Failed to create %s: %s", sd_class_config.efi_dir, strerror(errno));
+        if (!nc_mkdir_p(sd->efi_dir, 00755)) {
+                LOG_FATAL("Failed to create %s: %s", sd->efi_dir, strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_sync_path(sd->efi_dir);
 
-        if (!nc_mkdir_p(sd_class_config.vendor_dir, 00755)) {
-                LOG_FATAL("Failed to create %s: %s", sd_class_config.vendor_dir, strerror(errno));
+        if (!nc_mkdir_p(sd->vendor_dir, 00755)) {
+                LOG_FATAL("Failed to create %s: %s", sd->vendor_dir, strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_sync_path(sd->vendor_dir);
 
         if (!nc_mkdir_p(kernel_destination_path, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", kernel_destination_path, strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_sync_path(kernel_destination_path);
 
-        if (!nc_mkdir_p(sd_class_config.entries_dir, 00755)) {
-                LOG_FATAL("Failed to create %s: %s", sd_class_config.entries_dir, strerror(errno));
+        if (!nc_mkdir_p(sd->entries_dir, 00755)) {
+                LOG_FATAL("Failed to create %s: %s", sd->entries_dir, strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_sync_path(sd->entries_dir);
+
+        if (sd->uki_stub) {
+                if (!nc_mkdir_p(sd->uki_dir, 00755)) {
+                        LOG_FATAL("Failed to create %s: %s", sd->uki_dir, strerror(errno));
+                        return false;
+                }
+                cbm_sync_path(sd->uki_dir);
+        }
 
         return true;
 }
 
-bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
+/**
+ * Append the complete kernel command line of @kernel to @writer
+ */
+static bool sd_class_append_options(const BootManager *manager, const Kernel *kernel,
+                                    CbmWriter *writer)
 {
-        if (!manager || !kernel) {
+        const CbmDeviceProbe *root_dev = NULL;
+
+        root_dev = boot_manager_get_root_device((BootManager *)manager);
+        if (!root_dev) {
+                LOG_FATAL("Root device unknown, this should never happen! %s", kernel->source.path);
                 return false;
         }
-        autofree(char) *conf_path = NULL;
-        const CbmDeviceProbe *root_dev = NULL;
-        const char *os_name = NULL;
-        autofree(char) *old_conf = NULL;
-        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
 
-        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+        /* Add the root= section */
+        if (root_dev->part_uuid) {
+                cbm_writer_append_printf(writer, "root=PARTUUID=%s ", root_dev->part_uuid);
+        } else {
+                cbm_writer_append_printf(writer, "root=UUID=%s ", root_dev->uuid);
+        }
+        /* Add LUKS information if relevant */
+        if (root_dev->luks_uuid) {
+                cbm_writer_append_printf(writer, "rd.luks.uuid=%s ", root_dev->luks_uuid);
+        }
 
-        if (!cbm_writer_open(writer)) {
+        /* Finish it off with the command line options */
+        cbm_writer_append(writer, kernel->meta.cmdline);
+        return true;
+}
+
+/**
+ * os-release of the root, as embedded in every image
+ */
+static const char *sd_class_get_os_release(const BootManager *manager, SdClassConfig *sd)
+{
+        const char *prefix = boot_manager_get_prefix((BootManager *)manager);
+        const char *paths[] = { "/etc/os-release", "/usr/lib/os-release" };
+
+        if (sd->uki_os_release) {
+                return sd->uki_os_release;
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(paths) && !sd->uki_os_release; i++) {
+                autofree(char) *path = string_printf("%s%s", prefix, paths[i]);
+
+                if (!file_get_text(path, &sd->uki_os_release)) {
+                        sd->uki_os_release = NULL;
+                }
+        }
+        if (!sd->uki_os_release) {
+                sd->uki_os_release =
+                    string_printf("PRETTY_NAME=\"%s\"\n",
+                                  boot_manager_get_os_name((BootManager *)manager));
+        }
+        return sd->uki_os_release;
+}
+
+/**
+ * Assemble the unified kernel image of @kernel at @path, the loader finds it
+ * without an entry of its own
+ */
+static bool sd_class_write_uki(const BootManager *manager, const Kernel *kernel,
+                               const char *path, __cbm_unused__ bool exists)
+{
+        SdClassConfig *sd = sd_class_get(manager);
+        autofree(CbmWriter) *cmdline = CBM_WRITER_INIT;
+        CbmUkiInputs inputs = { 0 };
+
+        if (!cbm_writer_open_sized(cmdline, 256 + strlen(kernel->meta.cmdline))) {
+                DECLARE_OOM();
+                abort();
+        }
+        if (!sd_class_append_options(manager, kernel, cmdline)) {
+                return false;
+        }
+        cbm_writer_close(cmdline);
+        if (cbm_writer_error(cmdline) != 0) {
                 DECLARE_OOM();
                 abort();
         }
 
-        /* Build the options for the entry */
-        root_dev = boot_manager_get_root_device((BootManager *)manager);
-        if (!root_dev) {
-                LOG_FATAL("Root device unknown, this should never happen! %s", kernel->source.path);
+        inputs.stub = sd->uki_stub;
+        inputs.kernel = kernel->source.path;
+        inputs.initrd = boot_manager_kernel_get_initrd_source(kernel);
+        inputs.cmdline = cmdline->buffer;
+        inputs.os_release = sd_class_get_os_release(manager, sd);
+        inputs.manifest = boot_manager_get_manifest((BootManager *)manager);
+
+        /* Unchanged inputs leave the image as it is */
+        if (!cbm_uki_install(&inputs, path, NULL)) {
+                LOG_FATAL("Failed to install unified kernel image %s for %s: %s",
+                          path,
+                          kernel->source.path,
+                          strerror(errno));
                 return false;
         }
+        return true;
+}
+
+/**
+ * Write the loader entry for @kernel to @conf_path
+ *
+ * @param exists Whether @conf_path may exist already, only then is it
+ * compared against the new entry
+ */
+static bool sd_class_write_entry(const BootManager *manager, const Kernel *kernel,
+                                 const char *conf_path, bool exists)
+{
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
+        const char *os_name = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        /* Room for the fixed lines plus the cmdline */
+        if (!cbm_writer_open_sized(writer, 256 + strlen(kernel->meta.cmdline))) {
+                DECLARE_OOM();
+                abort();
+        }
 
         os_name = boot_manager_get_os_name((BootManager *)manager);
 
@@ -237,28 +414,20 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
         cbm_writer_append_printf(writer, "title %s\n", os_name);
         cbm_writer_append_printf(writer,
                                  "linux %s/%s\n",
-                                 get_kernel_destination_impl(manager),
+                                 sd_class_get_kernel_destination(manager),
                                  kernel->target.path);
         /* Optional initrd */
         if (kernel->target.initrd_path) {
                 cbm_writer_append_printf(writer,
                                          "initrd %s/%s\n",
-                                         get_kernel_destination_impl(manager),
+                                         sd_class_get_kernel_destination(manager),
                                          kernel->target.initrd_path);
         }
-        /* Add the root= section */
-        if (root_dev->part_uuid) {
-                cbm_writer_append_printf(writer, "options root=PARTUUID=%s ", root_dev->part_uuid);
-        } else {
-                cbm_writer_append_printf(writer, "options root=UUID=%s ", root_dev->uuid);
-        }
-        /* Add LUKS information if relevant */
-        if (root_dev->luks_uuid) {
-                cbm_writer_append_printf(writer, "rd.luks.uuid=%s ", root_dev->luks_uuid);
+        cbm_writer_append(writer, "options ");
+        if (!sd_class_append_options(manager, kernel, writer)) {
+                return false;
         }
-
-        /* Finish it off with the command line options */
-        cbm_writer_append_printf(writer, "%s\n", kernel->meta.cmdline);
+        cbm_writer_append(writer, "\n");
         cbm_writer_close(writer);
 
         if (cbm_writer_error(writer) != 0) {
@@ -266,55 +435,315 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
                 abort();
         }
 
-        /* If our new config matches the old config, just return. */
-        if (file_get_text(conf_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
-        }
-
-        if (!file_set_text(conf_path, writer->buffer)) {
+        /* If our new config matches the old config, this won't write anything */
+        if (exists ? !cbm_writer_commit_if_changed(writer, stage, conf_path, NULL)
+                   : !file_set_text_staged(stage, conf_path, writer->buffer)) {
                 LOG_FATAL("Failed to create loader entry for: %s [%s]",
                           kernel->source.path,
                           strerror(errno));
                 return false;
         }
 
-        cbm_sync();
+        return true;
+}
+
+/**
+ * Write the entry or image of @kernel at @path, as a sd_class_write_entry
+ */
+typedef bool (*sd_class_write_func)(const BootManager *manager, const Kernel *kernel,
+                                    const char *path, bool exists);
+
+bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
+{
+        if (!manager || !kernel) {
+                return false;
+        }
+        SdClassConfig *sd = sd_class_get(manager);
+        autofree(char) *conf_path = NULL;
+        autofree(char) *name = NULL;
+
+        if (sd->uki_stub) {
+                name = get_entry_name_for_kernel(manager, kernel, ".efi");
+                conf_path = cbm_case_path_build(sd->base_path, "EFI", "Linux", name, NULL);
+                OOM_CHECK_RET(conf_path, false);
+                return sd_class_write_uki(manager, kernel, conf_path, true);
+        }
+
+        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+
+        return sd_class_write_entry(manager, kernel, conf_path, true);
+}
+
+/**
+ * Entry names compare case-insensitively, as they would on vfat
+ */
+static char *sd_class_fold_name(const char *name)
+{
+        char *ret = strdup(name);
+
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (char *c = ret; *c; c++) {
+                *c = (char)tolower(*c);
+        }
+        return ret;
+}
+
+/**
+ * Record the folded entry name with @suffix of every kernel in @kernels in
+ * @owned
+ */
+static void sd_class_own_entries(const BootManager *manager, NcArray *kernels, const char *suffix,
+                                 NcHashmap *owned)
+{
+        for (uint16_t i = 0; kernels && i < kernels->len; i++) {
+                autofree(char) *name =
+                    get_entry_name_for_kernel(manager, nc_array_get(kernels, i), suffix);
+                char *key = sd_class_fold_name(name);
+
+                if (!nc_hashmap_put(owned, key, key)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+}
+
+/**
+ * Determine whether @entry is named like one of our entries with @suffix
+ */
+static bool sd_class_is_own_entry(const char *entry, const char *own_prefix, const char *suffix)
+{
+        size_t len = strlen(entry);
+        size_t prefix_len = strlen(own_prefix);
+        size_t suffix_len = strlen(suffix);
+
+        return len > prefix_len + suffix_len && strncasecmp(entry, own_prefix, prefix_len) == 0 &&
+               strcasecmp(entry + len - suffix_len, suffix) == 0;
+}
+
+/**
+ * Bring the entries with @suffix in @dir in line with the kernels, writing
+ * those of @install with @write. Passing no @write prunes all of our
+ * entries from @dir, if it exists at all.
+ */
+static bool sd_class_reconcile_dir(const BootManager *manager, const char *dir,
+                                   const char *suffix, sd_class_write_func write, NcArray *install,
+                                   NcArray *keep)
+{
+        autofree(NcHashmap) *entries = NULL;
+        autofree(NcHashmap) *existing = NULL;
+        autofree(NcHashmap) *owned = NULL;
+        autofree(char) *own_prefix = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *entry = NULL;
+        bool changed = false;
+
+        /* One scan tells us which entries exist, and how they're spelled */
+        entries = cbm_get_dir_entries(dir);
+        if (!entries) {
+                if (!write) {
+                        return true;
+                }
+                LOG_FATAL("Failed to read %s: %s", dir, strerror(errno));
+                return false;
+        }
+        existing = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        owned = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!existing || !owned) {
+                DECLARE_OOM();
+                abort();
+        }
+        nc_hashmap_iter_init(entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&entry, NULL)) {
+                if (!nc_hashmap_put(existing, sd_class_fold_name(entry), (void *)entry)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        if (write) {
+                sd_class_own_entries(manager, install, suffix, owned);
+                sd_class_own_entries(manager, keep, suffix, owned);
+        }
+
+        /* Add or update, only comparing entries known to exist */
+        for (uint16_t i = 0; write && install && i < install->len; i++) {
+                const Kernel *kernel = nc_array_get(install, i);
+                autofree(char) *name = get_entry_name_for_kernel(manager, kernel, suffix);
+                autofree(char) *key = sd_class_fold_name(name);
+                autofree(char) *path = NULL;
+                const char *spelling = nc_hashmap_get(existing, key);
+
+                path = string_printf("%s/%s", dir, spelling ? spelling : name);
+                if (!write(manager, kernel, path, spelling != NULL)) {
+                        return false;
+                }
+        }
+
+        /* Prune anything of ours that no current kernel owns */
+        own_prefix = string_printf("%s-", boot_manager_get_vendor_prefix((BootManager *)manager));
+        nc_hashmap_iter_init(entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&entry, NULL)) {
+                autofree(char) *key = NULL;
+                autofree(char) *path = NULL;
+
+                if (!sd_class_is_own_entry(entry, own_prefix, suffix)) {
+                        continue;
+                }
+                key = sd_class_fold_name(entry);
+                if (nc_hashmap_contains(owned, key)) {
+                        continue;
+                }
+
+                path = string_printf("%s/%s", dir, entry);
+                LOG_INFO("Removing stale loader entry %s", path);
+                if (cbm_unlink(path) < 0) {
+                        LOG_ERROR("Failed to remove %s: %s", path, strerror(errno));
+                        continue;
+                }
+                changed = true;
+        }
+
+        /* One barrier for every removal */
+        if (changed) {
+                cbm_case_path_invalidate(dir);
+                cbm_sync_path(dir);
+        }
 
         return true;
 }
 
+bool sd_class_reconcile_kernels(const BootManager *manager, NcArray *install, NcArray *keep)
+{
+        if (!manager) {
+                return false;
+        }
+        SdClassConfig *sd = sd_class_get(manager);
+        bool uki = sd->uki_stub != NULL;
+
+        /* Whichever kind isn't in use is pruned, for switching between them */
+        if (!sd_class_reconcile_dir(manager,
+                                    sd->entries_dir,
+                                    ".conf",
+                                    uki ? NULL : sd_class_write_entry,
+                                    install,
+                                    keep)) {
+                return false;
+        }
+        return sd_class_reconcile_dir(manager,
+                                      sd->uki_dir,
+                                      ".efi",
+                                      uki ? sd_class_write_uki : NULL,
+                                      install,
+                                      keep);
+}
+
+/**
+ * Remove the entries with @suffix in @dir which belong to @kernels
+ */
+static void sd_class_remove_from_dir(const BootManager *manager, const char *dir,
+                                     const char *suffix, NcArray *kernels)
+{
+        autofree(NcHashmap) *entries = NULL;
+        autofree(NcHashmap) *doomed = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *entry = NULL;
+        bool changed = false;
+
+        /* One scan finds every entry, however it's spelled */
+        entries = cbm_get_dir_entries(dir);
+        if (!entries) {
+                /* Nothing there to remove */
+                return;
+        }
+        doomed = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!doomed) {
+                DECLARE_OOM();
+                abort();
+        }
+        sd_class_own_entries(manager, kernels, suffix, doomed);
+
+        nc_hashmap_iter_init(entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&entry, NULL)) {
+                autofree(char) *key = sd_class_fold_name(entry);
+                autofree(char) *path = NULL;
+
+                if (!nc_hashmap_contains(doomed, key)) {
+                        continue;
+                }
+                path = string_printf("%s/%s", dir, entry);
+
+                /* As with a single removal, failures aren't fatal */
+                if (cbm_unlink(path) < 0) {
+                        LOG_ERROR("sd_class_remove_kernels: Failed to remove %s: %s",
+                                  path,
+                                  strerror(errno));
+                        continue;
+                }
+                changed = true;
+        }
+
+        if (changed) {
+                cbm_case_path_invalidate(dir);
+                cbm_sync_path(dir);
+        }
+}
+
 bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
 {
         if (!manager || !kernel) {
                 return false;
         }
-
+        SdClassConfig *sd = sd_class_get(manager);
         autofree(char) *conf_path = NULL;
+        autofree(char) *uki_name = NULL;
+        autofree(char) *uki_path = NULL;
 
         conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
         OOM_CHECK_RET(conf_path, false);
+        uki_name = get_entry_name_for_kernel(manager, kernel, ".efi");
+        uki_path = cbm_case_path_build(sd->base_path, "EFI", "Linux", uki_name, NULL);
+        OOM_CHECK_RET(uki_path, false);
 
         /* We must take a non-fatal approach in a remove operation */
-        if (nc_file_exists(conf_path)) {
-                if (unlink(conf_path) < 0) {
+        const char *paths[] = { conf_path, uki_path };
+        for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
+                if (!cbm_file_exists(paths[i])) {
+                        continue;
+                }
+                if (cbm_unlink(paths[i]) < 0) {
                         LOG_ERROR("sd_class_remove_kernel: Failed to remove %s: %s",
-                                  conf_path,
+                                  paths[i],
                                   strerror(errno));
                 } else {
-                        cbm_sync();
+                        cbm_case_path_invalidate(paths[i]);
+                        cbm_sync_path(paths[i]);
                 }
         }
 
         return true;
 }
 
+bool sd_class_remove_kernels(const BootManager *manager, NcArray *kernels)
+{
+        if (!manager || !kernels) {
+                return false;
+        }
+        SdClassConfig *sd = sd_class_get(manager);
+
+        sd_class_remove_from_dir(manager, sd->entries_dir, ".conf", kernels);
+        sd_class_remove_from_dir(manager, sd->uki_dir, ".efi", kernels);
+        return true;
+}
+
 bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kernel)
 {
         if (!manager) {
                 return false;
         }
+        SdClassConfig *sd = sd_class_get(manager);
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
 
         autofree(char) *item_name = NULL;
         int timeout = 0;
@@ -353,21 +782,80 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
         }
 
 write_config:
-        if (file_get_text(sd_class_config.loader_config, &old_conf)) {
+        if (file_get_text_staged(stage, sd->loader_config, &old_conf)) {
                 if (streq(old_conf, item_name)) {
                         return true;
                 }
         }
 
-        if (!file_set_text(sd_class_config.loader_config, item_name)) {
+        if (!file_set_text_staged(stage, sd->loader_config, item_name)) {
                 LOG_FATAL("sd_class_set_default_kernel: Failed to write %s: %s",
-                          sd_class_config.loader_config,
+                          sd->loader_config,
+                          strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+bool sd_class_set_timeout(const BootManager *manager)
+{
+        if (!manager) {
+                return false;
+        }
+        SdClassConfig *sd = sd_class_get(manager);
+        CbmStage *stage = boot_manager_get_stage((BootManager *)manager);
+
+        autofree(char) *old_conf = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        char *line = NULL;
+        char *state = NULL;
+        bool have_default = false;
+        int timeout = 0;
+
+        if (!file_get_text_staged(stage, sd->loader_config, &old_conf)) {
+                LOG_ERROR("Cannot apply the timeout, %s is missing: %s",
+                          sd->loader_config,
                           strerror(errno));
                 return false;
         }
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return false;
+        }
 
-        cbm_sync();
+        /* Exactly what sd_class_set_default_kernel writes for the same default */
+        timeout = boot_manager_get_timeout_value((BootManager *)manager);
+        if (timeout > 0) {
+                cbm_writer_append_printf(writer, "timeout %d\n", timeout);
+        }
+        for (line = strtok_r(old_conf, "\n", &state); line; line = strtok_r(NULL, "\n", &state)) {
+                if (strncmp(line, "timeout", 7) == 0 &&
+                    (line[7] == '\0' || line[7] == ' ' || line[7] == '\t')) {
+                        continue;
+                }
+                if (strncmp(line, "default ", 8) == 0) {
+                        have_default = true;
+                }
+                cbm_writer_append_printf(writer, "%s\n", line);
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
 
+        /* Without a default it's in timeout mode, which has a timeout of its own */
+        if (!have_default) {
+                LOG_DEBUG("No default kernel in %s, leaving its timeout", sd->loader_config);
+                return true;
+        }
+        if (!cbm_writer_commit_if_changed(writer, stage, sd->loader_config, NULL)) {
+                LOG_FATAL("sd_class_set_timeout: Failed to write %s: %s",
+                          sd->loader_config,
+                          strerror(errno));
+                return false;
+        }
         return true;
 }
 
@@ -376,13 +864,13 @@ bool sd_class_needs_install(const BootManager *manager)
         if (!manager) {
                 return false;
         }
+        SdClassConfig *sd = sd_class_get(manager);
 
-        const char *paths[] = { sd_class_config.efi_blob_dest,
-                                sd_class_config.default_path_efi_blob };
-        const char *source_path = sd_class_config.efi_blob_source;
+        const char *paths[] = { sd->efi_blob_dest, sd->default_path_efi_blob };
+        const char *source_path = sd->efi_blob_source;
 
         /* Catch this in the install */
-        if (!nc_file_exists(source_path)) {
+        if (!cbm_file_exists(source_path)) {
                 return true;
         }
 
@@ -390,7 +878,7 @@ bool sd_class_needs_install(const BootManager *manager)
         for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
                 const char *check_p = paths[i];
 
-                if (!nc_file_exists(check_p)) {
+                if (!cbm_file_exists(check_p)) {
                         return true;
                 }
         }
@@ -403,15 +891,17 @@ bool sd_class_needs_update(const BootManager *manager)
         if (!manager) {
                 return false;
         }
+        SdClassConfig *sd = sd_class_get(manager);
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
 
-        const char *paths[] = { sd_class_config.efi_blob_dest,
-                                sd_class_config.default_path_efi_blob };
-        const char *source_path = sd_class_config.efi_blob_source;
+        const char *paths[] = { sd->efi_blob_dest, sd->default_path_efi_blob };
+        const char *source_path = sd->efi_blob_source;
 
         for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
                 const char *check_p = paths[i];
 
-                if (nc_file_exists(check_p) && !cbm_files_match(source_path, check_p)) {
+                if (cbm_file_exists(check_p) &&
+                    !cbm_manifest_files_match(manifest, source_path, check_p)) {
                         return true;
                 }
         }
@@ -424,33 +914,28 @@ bool sd_class_install(const BootManager *manager)
         if (!manager) {
                 return false;
         }
+        SdClassConfig *sd = sd_class_get(manager);
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
 
-        if (!sd_class_ensure_dirs()) {
-                LOG_FATAL("Failed to create required directories for %s", sd_config->name);
+        if (!sd_class_ensure_dirs(sd)) {
+                LOG_FATAL("Failed to create required directories for %s", sd->config->name);
                 return false;
         }
 
         /* Install vendor EFI blob */
-        if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                              sd_class_config.efi_blob_dest,
-                              00644)) {
-                LOG_FATAL("Failed to install %s: %s",
-                          sd_class_config.efi_blob_dest,
-                          strerror(errno));
+        if (!cbm_manifest_install_file(manifest, sd->efi_blob_source, sd->efi_blob_dest, 00644)) {
+                LOG_FATAL("Failed to install %s: %s", sd->efi_blob_dest, strerror(errno));
                 return false;
         }
-        cbm_sync();
 
         /* Install default EFI blob */
-        if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                              sd_class_config.default_path_efi_blob,
-                              00644)) {
-                LOG_FATAL("Failed to install %s: %s",
-                          sd_class_config.default_path_efi_blob,
-                          strerror(errno));
+        if (!cbm_manifest_install_file(manifest,
+                                       sd->efi_blob_source,
+                                       sd->default_path_efi_blob,
+                                       00644)) {
+                LOG_FATAL("Failed to install %s: %s", sd->default_path_efi_blob, strerror(errno));
                 return false;
         }
-        cbm_sync();
 
         return true;
 }
@@ -460,35 +945,34 @@ bool sd_class_update(const BootManager *manager)
         if (!manager) {
                 return false;
         }
-        if (!sd_class_ensure_dirs()) {
-                LOG_FATAL("Failed to create required directories for %s", sd_config->name);
+        SdClassConfig *sd = sd_class_get(manager);
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
+        if (!sd_class_ensure_dirs(sd)) {
+                LOG_FATAL("Failed to create required directories for %s", sd->config->name);
                 return false;
         }
 
-        if (!cbm_files_match(sd_class_config.efi_blob_source, sd_class_config.efi_blob_dest)) {
-                if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                                      sd_class_config.efi_blob_dest,
-                                      00644)) {
-                        LOG_FATAL("Failed to update %s: %s",
-                                  sd_class_config.efi_blob_dest,
-                                  strerror(errno));
+        if (!cbm_manifest_files_match(manifest, sd->efi_blob_source, sd->efi_blob_dest)) {
+                if (!cbm_manifest_install_file(manifest,
+                                               sd->efi_blob_source,
+                                               sd->efi_blob_dest,
+                                               00644)) {
+                        LOG_FATAL("Failed to update %s: %s", sd->efi_blob_dest, strerror(errno));
                         return false;
                 }
         }
-        cbm_sync();
 
-        if (!cbm_files_match(sd_class_config.efi_blob_source,
-                             sd_class_config.default_path_efi_blob)) {
-                if (!copy_file_atomic(sd_class_config.efi_blob_source,
-                                      sd_class_config.default_path_efi_blob,
-                                      00644)) {
+        if (!cbm_manifest_files_match(manifest, sd->efi_blob_source, sd->default_path_efi_blob)) {
+                if (!cbm_manifest_install_file(manifest,
+                                               sd->efi_blob_source,
+                                               sd->default_path_efi_blob,
+                                               00644)) {
                         LOG_FATAL("Failed to update %s: %s",
-                                  sd_class_config.default_path_efi_blob,
+                                  sd->default_path_efi_blob,
                                   strerror(errno));
                         return false;
                 }
         }
-        cbm_sync();
 
         return true;
 }
@@ -498,39 +982,45 @@ bool sd_class_remove(const BootManager *manager)
         if (!manager) {
                 return false;
         }
+        SdClassConfig *sd = sd_class_get(manager);
 
         /* We call multiple syncs in case something goes wrong in removal, where we could be seeing
          * an ESP umount after */
-        if (nc_file_exists(sd_class_config.vendor_dir) && !nc_rm_rf(sd_class_config.vendor_dir)) {
+        if (cbm_file_exists(sd->vendor_dir) && !nc_rm_rf(sd->vendor_dir)) {
                 LOG_FATAL("Failed to remove vendor dir: %s", strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_case_path_invalidate(sd->vendor_dir);
+        cbm_sync_path(sd->vendor_dir);
 
-        if (nc_file_exists(sd_class_config.default_path_efi_blob) &&
-            unlink(sd_class_config.default_path_efi_blob) < 0) {
+        if (cbm_file_exists(sd->default_path_efi_blob) &&
+            cbm_unlink(sd->default_path_efi_blob) < 0) {
                 LOG_FATAL("Failed to remove %s: %s",
-                          sd_class_config.default_path_efi_blob,
+                          sd->default_path_efi_blob,
                           strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_case_path_invalidate(sd->default_path_efi_blob);
+        cbm_sync_path(sd->default_path_efi_blob);
 
-        if (nc_file_exists(sd_class_config.loader_config) &&
-            unlink(sd_class_config.loader_config) < 0) {
-                LOG_FATAL("Failed to remove %s: %s",
-                          sd_class_config.loader_config,
-                          strerror(errno));
+        if (cbm_file_exists(sd->loader_config) && cbm_unlink(sd->loader_config) < 0) {
+                LOG_FATAL("Failed to remove %s: %s", sd->loader_config, strerror(errno));
                 return false;
         }
-        cbm_sync();
+        cbm_case_path_invalidate(sd->loader_config);
+        cbm_sync_path(sd->loader_config);
 
         return true;
 }
 
-int sd_class_get_capabilities(__cbm_unused__ const BootManager *manager)
+int sd_class_get_capabilities(const BootManager *manager)
 {
+        SdClassConfig *sd = sd_class_get(manager);
+
         /* Very trivial bootloader, we support UEFI/GPT only */
+        if (sd && sd->uki_stub) {
+                return BOOTLOADER_CAP_GPT | BOOTLOADER_CAP_UEFI | BOOTLOADER_CAP_UKI;
+        }
         return BOOTLOADER_CAP_GPT | BOOTLOADER_CAP_UEFI;
 }
 
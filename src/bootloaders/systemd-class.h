@@ -35,8 +35,14 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel);
 
 bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel);
 
+bool sd_class_remove_kernels(const BootManager *manager, NcArray *kernels);
+
+bool sd_class_reconcile_kernels(const BootManager *manager, NcArray *install, NcArray *keep);
+
 bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kernel);
 
+bool sd_class_set_timeout(const BootManager *manager);
+
 bool sd_class_needs_install(const BootManager *manager);
 
 bool sd_class_needs_update(const BootManager *manager);
@@ -51,6 +57,24 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config);
 
 void sd_class_destroy(const BootManager *manager);
 
+/**
+ * Override where the entries of this manager expect the kernels to reside
+ */
+void sd_class_set_get_kernel_destination_impl(const BootManager *manager,
+                                              const char *(*impl)(const BootManager *));
+
+/**
+ * Attach the state of a bootloader built on top of sd_class to the manager,
+ * alongside that of sd_class itself. It must be released by that bootloader
+ * before sd_class_destroy.
+ */
+void sd_class_set_data(const BootManager *manager, void *data);
+
+/**
+ * Return the state attached with sd_class_set_data, if any
+ */
+void *sd_class_get_data(const BootManager *manager);
+
 int sd_class_get_capabilities(const BootManager *manager);
 
 /*
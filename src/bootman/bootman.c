@@ -14,16 +14,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
 #include "bootloader.h"
 #include "bootman.h"
 #include "bootman_private.h"
+#include "casepath.h"
 #include "cmdline.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "config.h"
 
@@ -65,6 +69,12 @@ BootManager *boot_manager_new()
         if (!r) {
                 return NULL;
         }
+        r->manifest = cbm_manifest_new();
+        r->stage = cbm_stage_new();
+        if (!r->stage) {
+                boot_manager_free(r);
+                return NULL;
+        }
 
         /* Try to parse the currently running kernel */
         if (uname(&uts) == 0) {
@@ -76,6 +86,7 @@ BootManager *boot_manager_new()
 
         /* CLI can override this */
         boot_manager_set_image_mode(r, false);
+        boot_manager_set_jobs(r, 1);
 
         return r;
 }
@@ -86,23 +97,105 @@ void boot_manager_free(BootManager *self)
                 return;
         }
 
+        /* Never leave a mount of ours behind */
+        (void)boot_manager_release_mount(self);
+
         if (self->bootloader) {
+                CBM_TRACE_SCOPE("bootloader.destroy");
                 self->bootloader->destroy(self);
         }
 
-        if (self->os_release) {
-                cbm_os_release_free(self->os_release);
+        /* A mirror only borrowed these from its parent */
+        if (!self->parent) {
+                if (self->os_release) {
+                        cbm_os_release_free(self->os_release);
+                }
+                cbm_free_sysconfig(self->sysconfig);
+                free(self->kernel_dir);
+                free(self->cmdline);
+                free(self->io_policy);
+                cbm_device_spec_free(self->device_spec);
+                if (self->changed_types) {
+                        nc_hashmap_free(self->changed_types);
+                }
         }
 
-        cbm_free_sysconfig(self->sysconfig);
-        free(self->kernel_dir);
         free(self->abs_bootdir);
-        free(self->cmdline);
+        free(self->plan);
+        free(self->report);
+        boot_manager_installs_end(self);
+        cbm_stage_free(self->stage);
+        cbm_manifest_free(self->manifest);
         free(self);
 }
 
+/**
+ * Initialise the selected bootloader
+ */
+static bool boot_manager_init_bootloader(BootManager *self)
+{
+        CBM_TRACE_SCOPE("bootloader.init");
+
+        return self->bootloader->init(self);
+}
+
+BootManager *boot_manager_new_mirror(BootManager *parent, const char *boot_dir, unsigned int jobs)
+{
+        struct BootManager *r = NULL;
+
+        assert(parent != NULL);
+        assert(boot_dir != NULL);
+
+        /* Everything borrowed must be settled before it's shared */
+        (void)boot_manager_get_cmdline(parent);
+        if (!boot_manager_require(parent, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return NULL;
+        }
+
+        r = calloc(1, sizeof(struct BootManager));
+        if (!r) {
+                return NULL;
+        }
+        r->parent = parent;
+        r->manifest = cbm_manifest_new();
+        r->stage = cbm_stage_new();
+        r->abs_bootdir = strdup(boot_dir);
+        if (!r->stage || !r->abs_bootdir) {
+                boot_manager_free(r);
+                return NULL;
+        }
+
+        r->sysconfig = parent->sysconfig;
+        r->kernel_dir = parent->kernel_dir;
+        r->os_release = parent->os_release;
+        r->cmdline = parent->cmdline;
+        r->have_cmdline = true;
+        r->io_policy = parent->io_policy;
+        r->device_spec = parent->device_spec;
+        r->changed_types = parent->changed_types;
+        r->sys_kernel = parent->sys_kernel;
+        r->have_sys_kernel = parent->have_sys_kernel;
+        r->image_mode = parent->image_mode;
+        r->facets = parent->facets;
+        r->failed_facets = parent->failed_facets;
+        r->verify = parent->verify;
+        r->dry_run = parent->dry_run;
+        r->dedup = parent->dedup;
+        boot_manager_set_jobs(r, jobs);
+
+        r->bootloader = parent->bootloader;
+        if (!boot_manager_init_bootloader(r)) {
+                LOG_FATAL("Initialisation of bootloader for %s failed", boot_dir);
+                boot_manager_free(r);
+                return NULL;
+        }
+        return r;
+}
+
 static bool boot_manager_select_bootloader(BootManager *self)
 {
+        CBM_TRACE_SCOPE("select_bootloader");
+
         const BootLoader *selected = NULL;
         int selected_boot_mask = 0;
         int wanted_boot_mask = self->sysconfig->wanted_boot_mask;
@@ -132,9 +225,10 @@ static bool boot_manager_select_bootloader(BootManager *self)
         }
 
         /* Finally, initialise the bootloader itself now */
-        if (!self->bootloader->init(self)) {
+        if (!boot_manager_init_bootloader(self)) {
                 self->bootloader->destroy(self);
                 LOG_FATAL("Cannot initialise bootloader %s", self->bootloader->name);
+                self->bootloader = NULL;
                 return false;
         }
 
@@ -147,15 +241,29 @@ bool boot_manager_set_prefix(BootManager *self, char *prefix)
 
         char *kernel_dir = NULL;
         SystemConfig *config = NULL;
+        CbmTraceSpan span = { 0 };
+
+        CBM_TRACE_SCOPE("set_prefix");
 
         if (!prefix) {
                 return false;
         }
 
+        if (self->bootloader) {
+                span = cbm_trace_begin("bootloader.destroy");
+                self->bootloader->destroy(self);
+                cbm_trace_end(&span);
+                self->bootloader = NULL;
+        }
+
         cbm_free_sysconfig(self->sysconfig);
         self->sysconfig = NULL;
+        self->facets = 0;
+        self->failed_facets = 0;
 
-        config = cbm_inspect_root(prefix, self->image_mode);
+        /* Everything else is only inspected once it's needed, though as
+         * things stand now in terms of image mode */
+        config = cbm_new_sysconfig(prefix, self->image_mode);
         if (!config) {
                 return false;
         }
@@ -173,36 +281,124 @@ bool boot_manager_set_prefix(BootManager *self, char *prefix)
         }
         self->kernel_dir = kernel_dir;
 
-        if (self->bootloader) {
-                self->bootloader->destroy(self);
-                self->bootloader = NULL;
-        }
-
         if (self->os_release) {
                 cbm_os_release_free(self->os_release);
                 self->os_release = NULL;
         }
 
-        self->os_release = cbm_os_release_new_for_root(prefix);
-        if (!self->os_release) {
-                DECLARE_OOM();
-                abort();
-        }
+        /* The cmdline is only loaded once a kernel needs it */
+        free(self->cmdline);
+        self->cmdline = NULL;
+        self->have_cmdline = false;
 
-        /* Load cmdline */
-        if (self->cmdline) {
-                free(self->cmdline);
-                self->cmdline = NULL;
+        return true;
+}
+
+/**
+ * Set up a single facet, its dependencies being set up already
+ */
+static bool boot_manager_init_facet(BootManager *self, BootManagerFacet facet)
+{
+        CbmTraceSpan span = { 0 };
+
+        switch (facet) {
+        case BOOT_MANAGER_FACET_PROBE:
+                span = cbm_trace_begin("inspect_root");
+                if (self->device_spec) {
+                        cbm_apply_device_spec(self->sysconfig, self->device_spec);
+                        cbm_trace_end(&span);
+                        return true;
+                }
+                if (boot_manager_load_snapshot(self)) {
+                        /* os-release came along with it */
+                        self->facets |= BOOT_MANAGER_FACET_OS_RELEASE;
+                        cbm_trace_end(&span);
+                        return true;
+                }
+                cbm_probe_sysconfig(self->sysconfig);
+                cbm_trace_end(&span);
+                /* The snapshot is only worth having complete */
+                if (!boot_manager_require(self, BOOT_MANAGER_FACET_OS_RELEASE)) {
+                        return false;
+                }
+                boot_manager_save_snapshot(self);
+                return true;
+        case BOOT_MANAGER_FACET_OS_RELEASE:
+                span = cbm_trace_begin("os_release");
+                self->os_release = cbm_os_release_new_for_root(self->sysconfig->prefix);
+                cbm_trace_end(&span);
+                if (!self->os_release) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                return true;
+        case BOOT_MANAGER_FACET_BOOTLOADER:
+                return boot_manager_select_bootloader(self);
+        default:
+                return false;
         }
-        self->cmdline = cbm_parse_cmdline_files(config->prefix);
+}
 
-        if (!boot_manager_select_bootloader(self)) {
+bool boot_manager_require(BootManager *self, unsigned int facets)
+{
+        static const BootManagerFacet order[] = {
+                BOOT_MANAGER_FACET_PROBE,
+                BOOT_MANAGER_FACET_OS_RELEASE,
+                BOOT_MANAGER_FACET_BOOTLOADER,
+        };
+
+        assert(self != NULL);
+
+        if (!self->sysconfig) {
                 return false;
         }
 
+        /* The bootloader is selected by the probe, and may ask for the OS */
+        if ((facets & BOOT_MANAGER_FACET_BOOTLOADER) == BOOT_MANAGER_FACET_BOOTLOADER) {
+                facets |= BOOT_MANAGER_FACET_PROBE | BOOT_MANAGER_FACET_OS_RELEASE;
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(order); i++) {
+                BootManagerFacet facet = order[i];
+
+                if ((facets & facet) != facet || (self->facets & facet) == facet) {
+                        continue;
+                }
+                if ((self->failed_facets & facet) == facet) {
+                        return false;
+                }
+                if (!boot_manager_init_facet(self, facet)) {
+                        self->failed_facets |= facet;
+                        return false;
+                }
+                self->facets |= facet;
+        }
         return true;
 }
 
+const char *boot_manager_get_cmdline(BootManager *self)
+{
+        autofree(char) *cache_path = NULL;
+
+        assert(self != NULL);
+
+        if (self->have_cmdline || !self->sysconfig) {
+                return self->cmdline;
+        }
+
+        CBM_TRACE_SCOPE("parse_cmdline");
+
+        /* Never leave our state behind inside an image */
+        if (!self->image_mode) {
+                cache_path =
+                    string_printf("%s/%s", self->sysconfig->prefix, CBM_CMDLINE_CACHE_PATH);
+        }
+        self->cmdline = cbm_parse_cmdline_files_cached(self->sysconfig->prefix, cache_path);
+        self->have_cmdline = true;
+
+        return self->cmdline;
+}
+
 const char *boot_manager_get_prefix(BootManager *self)
 {
         assert(self != NULL);
@@ -225,7 +421,10 @@ const char *boot_manager_get_vendor_prefix(__cbm_unused__ BootManager *self)
 const char *boot_manager_get_os_name(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->os_release != NULL);
+
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_OS_RELEASE)) {
+                return NULL;
+        }
 
         return cbm_os_release_get_value(self->os_release, OS_RELEASE_PRETTY_NAME);
 }
@@ -233,7 +432,10 @@ const char *boot_manager_get_os_name(BootManager *self)
 const char *boot_manager_get_os_id(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->os_release != NULL);
+
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_OS_RELEASE)) {
+                return NULL;
+        }
 
         return cbm_os_release_get_value(self->os_release, OS_RELEASE_ID);
 }
@@ -241,58 +443,176 @@ const char *boot_manager_get_os_id(BootManager *self)
 const CbmDeviceProbe *boot_manager_get_root_device(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->sysconfig != NULL);
 
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_PROBE)) {
+                return NULL;
+        }
         return (const CbmDeviceProbe *)self->sysconfig->root_device;
 }
 
+bool boot_manager_bootloader_install_kernel(const BootManager *self, const Kernel *kernel)
+{
+        CBM_TRACE_SCOPE("bootloader.install_kernel");
+
+        return self->bootloader->install_kernel(self, kernel);
+}
+
 bool boot_manager_install_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!kernel || !self->bootloader) {
+        if (!kernel || !boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
                 return false;
         }
         if (!cbm_is_sysconfig_sane(self->sysconfig)) {
                 return false;
         }
 
+        /* Already done during this update */
+        if (boot_manager_install_done(self, kernel)) {
+                cbm_stats_inc(CBM_STAT_KERNELS_SKIPPED);
+                return true;
+        }
+
         /* Install the kernel blob first */
         if (!boot_manager_install_kernel_internal(self, kernel)) {
                 return false;
         }
+        cbm_stats_inc(CBM_STAT_KERNELS_INSTALLED);
         /* Hand over to the bootloader to finish it up */
-        return self->bootloader->install_kernel(self, kernel);
+        if (!boot_manager_bootloader_install_kernel(self, kernel)) {
+                return false;
+        }
+        boot_manager_install_record(self, kernel);
+        return true;
+}
+
+void boot_manager_installs_begin(BootManager *self)
+{
+        assert(self != NULL);
+
+        boot_manager_installs_end(self);
+        self->installed = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!self->installed) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+void boot_manager_installs_end(BootManager *self)
+{
+        assert(self != NULL);
+
+        if (self->installed) {
+                nc_hashmap_free(self->installed);
+                self->installed = NULL;
+        }
+}
+
+bool boot_manager_install_done(const BootManager *self, const Kernel *kernel)
+{
+        assert(self != NULL);
+
+        if (!self->installed) {
+                return false;
+        }
+        return nc_hashmap_contains(self->installed, kernel->source.path);
+}
+
+void boot_manager_install_record(BootManager *self, const Kernel *kernel)
+{
+        char *key = NULL;
+
+        assert(self != NULL);
+
+        if (!self->installed || nc_hashmap_contains(self->installed, kernel->source.path)) {
+                return;
+        }
+        key = strdup(kernel->source.path);
+        if (!key || !nc_hashmap_put(self->installed, key, key)) {
+                DECLARE_OOM();
+                abort();
+        }
 }
 
 bool boot_manager_remove_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!kernel || !self->bootloader) {
+        if (!kernel || !boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
                 return false;
         }
         if (!cbm_is_sysconfig_sane(self->sysconfig)) {
                 return false;
         }
+        /* A removed kernel would need installing afresh */
+        if (self->installed) {
+                nc_hashmap_remove(self->installed, kernel->source.path);
+        }
+
         /* Remove the kernel blob first */
         if (!boot_manager_remove_kernel_internal(self, kernel)) {
                 return false;
         }
+        cbm_stats_inc(CBM_STAT_KERNELS_REMOVED);
         /* Hand over to the bootloader to finish it up */
+        CBM_TRACE_SCOPE("bootloader.remove_kernel");
         return self->bootloader->remove_kernel(self, kernel);
 }
 
+bool boot_manager_remove_kernels(BootManager *self, NcArray *kernels)
+{
+        assert(self != NULL);
+        CbmTraceSpan span = { 0 };
+        bool ret = true;
+
+        if (!kernels || !boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return false;
+        }
+        if (!cbm_is_sysconfig_sane(self->sysconfig)) {
+                return false;
+        }
+        for (uint16_t i = 0; self->installed && i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+
+                nc_hashmap_remove(self->installed, k->source.path);
+        }
+
+        /* The blobs first, then the entries, with one barrier for both */
+        cbm_sync_phase_begin();
+        if (!boot_manager_remove_kernels_internal(self, kernels, self->jobs)) {
+                ret = false;
+        }
+
+        span = cbm_trace_begin("bootloader.remove_kernels");
+        if (self->bootloader->remove_kernels) {
+                ret = self->bootloader->remove_kernels(self, kernels) && ret;
+        } else {
+                for (uint16_t i = 0; i < kernels->len; i++) {
+                        ret = self->bootloader->remove_kernel(self, nc_array_get(kernels, i)) &&
+                              ret;
+                }
+        }
+        cbm_trace_end(&span);
+
+        if (!cbm_sync_phase_end()) {
+                LOG_ERROR("Failed to flush kernel removals to disk");
+                ret = false;
+        }
+        return ret;
+}
+
 bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!self->bootloader) {
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
                 return false;
         }
         if (!cbm_is_sysconfig_sane(self->sysconfig)) {
                 return false;
         }
+        CBM_TRACE_SCOPE("bootloader.set_default_kernel");
         return self->bootloader->set_default_kernel(self, kernel);
 }
 
@@ -322,6 +642,8 @@ char *boot_manager_get_boot_dir(BootManager *self)
 
 bool boot_manager_set_boot_dir(BootManager *self, const char *bootdir)
 {
+        CbmTraceSpan span = { 0 };
+
         assert(self != NULL);
 
         if (!bootdir) {
@@ -342,8 +664,10 @@ bool boot_manager_set_boot_dir(BootManager *self, const char *bootdir)
         if (!self->bootloader) {
                 return true;
         }
+        span = cbm_trace_begin("bootloader.destroy");
         self->bootloader->destroy(self);
-        if (!self->bootloader->init(self)) {
+        cbm_trace_end(&span);
+        if (!boot_manager_init_bootloader(self)) {
                 /* Ensure cleanup. */
                 self->bootloader->destroy(self);
                 LOG_FATAL("Re-initialisation of bootloader failed");
@@ -357,7 +681,7 @@ bool boot_manager_modify_bootloader(BootManager *self, int flags)
         assert(self != NULL);
         autofree(char) *boot_dir = NULL;
 
-        if (!self->bootloader) {
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
                 return false;
         }
 
@@ -374,23 +698,20 @@ bool boot_manager_modify_bootloader(BootManager *self, int flags)
         bool nocheck = (flags & BOOTLOADER_OPERATION_NO_CHECK) == BOOTLOADER_OPERATION_NO_CHECK;
 
         if ((flags & BOOTLOADER_OPERATION_INSTALL) == BOOTLOADER_OPERATION_INSTALL) {
-                if (nocheck) {
-                        return self->bootloader->install(self);
-                }
-                if (self->bootloader->needs_install(self)) {
-                        return self->bootloader->install(self);
+                if (!nocheck && !boot_manager_needs_install(self)) {
+                        return true;
                 }
-                return true;
+                CBM_TRACE_SCOPE("bootloader.install");
+                return self->bootloader->install(self);
         } else if ((flags & BOOTLOADER_OPERATION_REMOVE) == BOOTLOADER_OPERATION_REMOVE) {
+                CBM_TRACE_SCOPE("bootloader.remove");
                 return self->bootloader->remove(self);
         } else if ((flags & BOOTLOADER_OPERATION_UPDATE) == BOOTLOADER_OPERATION_UPDATE) {
-                if (nocheck) {
-                        return self->bootloader->update(self);
-                }
-                if (self->bootloader->needs_update(self)) {
-                        return self->bootloader->update(self);
+                if (!nocheck && !boot_manager_needs_update(self)) {
+                        return true;
                 }
-                return true;
+                CBM_TRACE_SCOPE("bootloader.update");
+                return self->bootloader->update(self);
         } else {
                 LOG_FATAL("Unknown bootloader operation");
                 return false;
@@ -411,10 +732,197 @@ void boot_manager_set_image_mode(BootManager *self, bool image_mode)
         self->image_mode = image_mode;
 }
 
+void boot_manager_set_jobs(BootManager *self, unsigned int jobs)
+{
+        assert(self != NULL);
+
+        self->jobs = jobs > 0 ? jobs : 1;
+}
+
+unsigned int boot_manager_get_jobs(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->jobs;
+}
+
+void boot_manager_set_bootloader_data(BootManager *self, void *data)
+{
+        assert(self != NULL);
+
+        self->bootloader_data = data;
+}
+
+void *boot_manager_get_bootloader_data(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->bootloader_data;
+}
+
+CbmManifest *boot_manager_get_manifest(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->manifest;
+}
+
+CbmStage *boot_manager_get_stage(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->stage;
+}
+
+void boot_manager_set_verify(BootManager *self, bool verify)
+{
+        assert(self != NULL);
+
+        self->verify = verify;
+}
+
+void boot_manager_set_dedup(BootManager *self, bool dedup)
+{
+        if (!self) {
+                return;
+        }
+        self->dedup = dedup;
+}
+
+bool boot_manager_set_io_policy(BootManager *self, const char *spec)
+{
+        CbmIoPolicy policy = { 0 };
+        char *dup = NULL;
+
+        assert(self != NULL);
+
+        if (spec) {
+                if (!cbm_io_policy_parse(spec, &policy)) {
+                        return false;
+                }
+                dup = strdup(spec);
+                OOM_CHECK_RET(dup, false);
+        }
+        free(self->io_policy);
+        self->io_policy = dup;
+        return true;
+}
+
+bool boot_manager_set_device_spec(BootManager *self, const char *path)
+{
+        CbmDeviceSpec *spec = NULL;
+
+        assert(self != NULL);
+
+        if (path) {
+                spec = cbm_device_spec_load(path);
+                if (!spec) {
+                        return false;
+                }
+        }
+        cbm_device_spec_free(self->device_spec);
+        self->device_spec = spec;
+        return true;
+}
+
+bool boot_manager_add_changed_kernel(BootManager *self, const char *name)
+{
+        const char *base = NULL;
+        char type[16] = { 0 };
+        char version[16] = { 0 };
+        int release = 0;
+        char *key = NULL;
+
+        assert(self != NULL);
+
+        base = strrchr(name, '/');
+        base = base ? base + 1 : name;
+        /* Parsed like any kernel, but it may well be gone already */
+        if (sscanf(base, KERNEL_NAMESPACE ".%15[^.].%15[^-]-%d", type, version, &release) != 3) {
+                return false;
+        }
+
+        if (!self->changed_types) {
+                self->changed_types =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+                OOM_CHECK_RET(self->changed_types, false);
+        }
+        if (nc_hashmap_contains(self->changed_types, type)) {
+                return true;
+        }
+        key = strdup(type);
+        OOM_CHECK_RET(key, false);
+        if (!nc_hashmap_put(self->changed_types, key, key)) {
+                free(key);
+                DECLARE_OOM();
+                return false;
+        }
+        return true;
+}
+
+void boot_manager_set_dry_run(BootManager *self, bool dry_run)
+{
+        assert(self != NULL);
+
+        self->dry_run = dry_run;
+}
+
+void boot_manager_set_wait(BootManager *self, bool wait)
+{
+        assert(self != NULL);
+
+        self->wait = wait;
+}
+
+bool boot_manager_update_deferred(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->deferred;
+}
+
+void boot_manager_set_keep_mounted(BootManager *self, bool keep_mounted)
+{
+        assert(self != NULL);
+
+        self->keep_mounted = keep_mounted;
+}
+
+void boot_manager_refresh(BootManager *self)
+{
+        assert(self != NULL);
+
+        /* The boot directory may have been changed by anybody meanwhile */
+        cbm_case_path_reset();
+
+        /* The next lookup revalidates against the cmdline cache */
+        free(self->cmdline);
+        self->cmdline = NULL;
+        self->have_cmdline = false;
+}
+
+const char *boot_manager_get_plan(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->plan;
+}
+
+const char *boot_manager_get_report(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->report;
+}
+
 bool boot_manager_needs_install(BootManager *self)
 {
         assert(self != NULL);
 
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return false;
+        }
+        CBM_TRACE_SCOPE("bootloader.needs_install");
         return self->bootloader->needs_install(self);
 }
 
@@ -422,6 +930,10 @@ bool boot_manager_needs_update(BootManager *self)
 {
         assert(self != NULL);
 
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return false;
+        }
+        CBM_TRACE_SCOPE("bootloader.needs_update");
         return self->bootloader->needs_update(self);
 }
 
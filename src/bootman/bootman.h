@@ -11,10 +11,15 @@
 
 #pragma once
 
+#include "arena.h"
+#include "manifest.h"
 #include "nica/array.h"
 #include "nica/hashmap.h"
 #include "probe.h"
+#include "sha256.h"
+#include "stage.h"
 #include "util.h"
+#include "writer.h"
 
 typedef struct BootManager BootManager;
 
@@ -53,42 +58,72 @@ typedef struct Kernel {
                 char *ktype;   /**<Type of this kernel */
                 char *cmdline; /**<Contents of the cmdline file */
                 bool boots;    /**<Is this known to boot? */
+                /* Seconds since the epoch, 0 if it never booted */
+                uint64_t last_boot; /**<When it last booted */
         } meta;
 
         /* Source paths */
         struct {
                 char *path;             /**<Path to this kernel */
                 char *cmdline_file;     /**<Path to the cmdline file */
-                char *kconfig_file;     /**<Path to the kconfig file */
                 char *initrd_file;      /**<System initrd file */
                 char *user_initrd_file; /**<User's initrd file */
-                char *kboot_file;       /**<Path to the k_booted_$(uname -r) file */
-                char *module_dir;       /**<Path to the modules directory */
-                char *sysmap_file;      /**<Path to the System.map file */
-                char *headers_dir;      /**<Path to the kernels header directory */
+                char *packed_initrd;    /**<Recompressed initrd installed in place of either */
         } source;
 
+        /* Optional source paths, nothing installs them. Only looked up on
+         * first use with the boot_manager_kernel_get_*() accessors. */
+        struct {
+                unsigned int resolved; /**<Fields looked up so far */
+                char *kconfig_file;    /**<Path to the kconfig file */
+                char *kboot_file;      /**<Path to the legacy k_booted_$(uname -r) file */
+                char *module_dir;      /**<Path to the modules directory */
+                char *sysmap_file;     /**<Path to the System.map file */
+                char *headers_dir;     /**<Path to the kernels header directory */
+        } extra;
+
         /* Target (basename) paths */
         struct {
                 char *path;        /**<Basename path of the kernel for the target */
                 char *legacy_path; /**<Old path prior to namespacing (basename) */
                 char *initrd_path; /**<Basename path of initrd for the target */
+                /* Hex encoded SHA-256 of what this update installed, empty if
+                 * the target was already up to date */
+                char digest[CBM_SHA256_HEX_SIZE];        /**<Digest of the kernel */
+                char initrd_digest[CBM_SHA256_HEX_SIZE]; /**<Digest of the initrd */
         } target;
+
+        CbmArena *arena; /**<Storage of the strings and the Kernel, NULL if on the heap */
 } Kernel;
 
 typedef NcArray KernelArray;
 
 /**
  * Represenative of the system configuration of a given target prefix.
- * This is populated upon examination by @boot_manager_set_prefix.
+ * The prefix is set by @boot_manager_set_prefix, the devices are only
+ * probed once something needs them.
  */
 typedef struct SystemConfig {
         char *prefix;                /**<Prefix for all operations */
         CbmDeviceProbe *root_device; /**<The physical root device */
         char *boot_device;           /**<The physical boot device */
+        NcArray *boot_mirrors;       /**<Further ESPs kept identical to boot_device */
         int wanted_boot_mask;        /**<The required bootloader mask */
+        bool image_mode;             /**<Whether the prefix is an image */
 } SystemConfig;
 
+/**
+ * The devices of a root as given by a device spec file, standing in for
+ * probing them. Images built on loop or device-mapper devices know what they
+ * will be booted from, while probing those devices is slow and contends with
+ * udev.
+ */
+typedef struct CbmDeviceSpec {
+        CbmDeviceProbe root;  /**<Identifiers of the root device */
+        char *boot_device;    /**<The physical boot device, if any */
+        int wanted_boot_mask; /**<The required bootloader mask */
+} CbmDeviceSpec;
+
 /**
  * Construct a new BootManager
  *
@@ -129,7 +164,10 @@ bool boot_manager_set_uname(BootManager *manager, const char *uname);
 /**
  * Set the prefix to apply to all filesystem paths
  *
- * @note The path must exist for this function call to work
+ * @note The path must exist for this function call to work. The devices,
+ * os-release and bootloader of the prefix are only inspected once needed,
+ * so failing to find a bootloader is only reported by the operation that
+ * needed one.
  *
  * @param prefix Path to use for prefix operations
  *
@@ -206,6 +244,48 @@ KernelArray *boot_manager_get_kernels(BootManager *manager);
  */
 Kernel *boot_manager_inspect_kernel(BootManager *manager, char *path);
 
+/**
+ * Return the modules directory of @kernel, under the current or the older
+ * namespace, looking it up on first use
+ *
+ * @note The string is owned by the kernel. The result is cached within the
+ * kernel, so calls for the same kernel must not race.
+ *
+ * @return the path, or NULL if the kernel has no modules
+ */
+const char *boot_manager_kernel_get_module_dir(BootManager *manager, Kernel *kernel);
+
+/**
+ * Return the kernel headers directory of @kernel, as with
+ * boot_manager_kernel_get_module_dir
+ */
+const char *boot_manager_kernel_get_headers_dir(BootManager *manager, Kernel *kernel);
+
+/**
+ * Return the kconfig file shipped alongside @kernel, as with
+ * boot_manager_kernel_get_module_dir
+ */
+const char *boot_manager_kernel_get_kconfig_file(Kernel *kernel);
+
+/**
+ * Return the initrd installed for @kernel: the recompressed initrd if an
+ * update resolved one, else the user's initrd, else the system initrd. NULL
+ * if it has none.
+ */
+const char *boot_manager_kernel_get_initrd_source(const Kernel *kernel);
+
+/**
+ * Return the System.map shipped alongside @kernel, as with
+ * boot_manager_kernel_get_module_dir
+ */
+const char *boot_manager_kernel_get_sysmap_file(Kernel *kernel);
+
+/**
+ * Return where older versions recorded boots of @kernel. Unlike the others
+ * this is only the path, whether or not it exists.
+ */
+const char *boot_manager_kernel_get_kboot_file(BootManager *manager, Kernel *kernel);
+
 /**
  * Attempt installation of the given kernel
  *
@@ -230,6 +310,18 @@ char *boot_manager_get_boot_dir(BootManager *manager);
 
 bool boot_manager_remove_kernel(BootManager *manager, const Kernel *kernel);
 
+/**
+ * Uninstall several previously installed kernels at once. Their blobs are
+ * removed in parallel, up to the configured number of jobs, and the
+ * bootloader drops all of their entries in a single pass. Changes are
+ * flushed with one barrier once everything is gone.
+ *
+ * @param kernels Kernels to remove
+ *
+ * @return False if any of them couldn't be removed
+ */
+bool boot_manager_remove_kernels(BootManager *manager, NcArray *kernels);
+
 /**
  * Attempt to set the default kernel entry
  */
@@ -248,6 +340,30 @@ const CbmDeviceProbe *boot_manager_get_root_device(BootManager *manager);
  */
 bool boot_manager_modify_bootloader(BootManager *manager, int ops);
 
+/**
+ * Attach the private state of the selected bootloader to this manager. The
+ * bootloader sets it up in init and releases it in destroy, so that several
+ * managers can each drive their own.
+ */
+void boot_manager_set_bootloader_data(BootManager *manager, void *data);
+
+/**
+ * Return the state attached with boot_manager_set_bootloader_data, if any
+ */
+void *boot_manager_get_bootloader_data(BootManager *manager);
+
+/**
+ * Return the manifest tracking the files this manager installs. It is only
+ * open for the duration of an update, and closed (untracked) otherwise.
+ */
+CbmManifest *boot_manager_get_manifest(BootManager *manager);
+
+/**
+ * Return the staging this manager's update writes small files through. It
+ * only stages anything while an update is being executed.
+ */
+CbmStage *boot_manager_get_stage(BootManager *manager);
+
 /**
  * Determine if the BootManager is operating in image mode, i.e.
  * the prefix/root is not "/" - the native filesystem
@@ -259,12 +375,198 @@ bool boot_manager_is_image_mode(BootManager *manager);
  */
 void boot_manager_set_image_mode(BootManager *manager, bool image_mode);
 
+/**
+ * Set the maximum number of kernels to install concurrently during an
+ * update. Bootloader configuration is always written serially.
+ *
+ * @param jobs Number of concurrent jobs, 0 is treated as 1
+ */
+void boot_manager_set_jobs(BootManager *manager, unsigned int jobs);
+
+/**
+ * Return the maximum number of concurrent install jobs
+ */
+unsigned int boot_manager_get_jobs(BootManager *manager);
+
+/**
+ * Force a full content comparison of every installed file during update,
+ * instead of trusting the manifest stored on the boot partition.
+ *
+ * @param verify Whether to verify installed files in full
+ */
+void boot_manager_set_verify(BootManager *manager, bool verify);
+
+/**
+ * Store the kernels and initrds installed by an update in a content addressed
+ * store within the kernel destination, so that identical files are installed
+ * once and shared by every entry using them. Blobs no entry refers to are
+ * removed by the update. Without this, updates move their entries back to
+ * their own files and the store empties as it's left unused.
+ *
+ * @param dedup Whether to share identical blobs
+ */
+void boot_manager_set_dedup(BootManager *manager, bool dedup);
+
+/**
+ * Set how updates read and write the kernels they copy, overriding the
+ * io-policy file in the kernel configuration directory. The @spec is a list
+ * of options separated by commas or whitespace:
+ *
+ *  - drop-cache: Drop the copied files from the page cache once on disk
+ *  - direct: Read sources with O_DIRECT where the filesystem allows it
+ *  - idle: Run in the idle I/O scheduling class
+ *  - rate=N[K|M|G]: Cap reads to N bytes per second
+ *
+ * @param spec The policy to use, or NULL to go back to the io-policy file
+ * @return False if @spec can't be parsed
+ */
+bool boot_manager_set_io_policy(BootManager *manager, const char *spec);
+
+/**
+ * Describe the devices of the root with the device spec file at @path, rather
+ * than probing them with blkid. The spec holds one KEY=VALUE per line, where
+ * # starts a comment:
+ *
+ *  - ROOT_UUID: UUID of the root filesystem
+ *  - ROOT_PARTUUID: PartUUID of the root partition
+ *  - ROOT_LUKS_UUID: UUID of the LUKS container holding the root, if any
+ *  - GPT: yes or no, whether the root lives on a GPT disk. Defaults to yes
+ *    when ROOT_PARTUUID is given.
+ *  - BOOT_MASK: uefi or legacy, along with gpt for a GPT boot partition
+ *  - BOOT_DEVICE: The boot device, if any
+ *
+ * At least one of ROOT_UUID and ROOT_PARTUUID must be given, along with
+ * BOOT_MASK. The spec takes effect the next time the root is inspected, and
+ * is kept across boot_manager_set_prefix.
+ *
+ * @param path The device spec file, or NULL to go back to probing
+ * @return False if the spec can't be read or parsed
+ */
+bool boot_manager_set_device_spec(BootManager *manager, const char *path);
+
+/**
+ * Forget what was learned from the kernel configuration, such as the global
+ * cmdline, so that the next update reads it afresh. The inspected system
+ * (boot device, root probe and bootloader) is kept, which allows one manager
+ * to be reused for many updates.
+ */
+void boot_manager_refresh(BootManager *manager);
+
+/**
+ * Limit updates to the type of the kernel named @name, for when a package
+ * added or removed just that kernel. @name is a kernel file name such as
+ * org.clearlinux.native.4.2.1-137, or its path, which needn't exist any more.
+ * May be called for several kernels.
+ *
+ * Only kernels of the named types are then installed, repaired or garbage
+ * collected, along with the default kernel, and the bootloader itself is
+ * only checked for changes when verifying. The loader entries of every other
+ * type are left as they are.
+ *
+ * @return False if @name isn't a kernel name
+ */
+bool boot_manager_add_changed_kernel(BootManager *manager, const char *name);
+
+/**
+ * When set, boot_manager_update only computes what it would do, without
+ * modifying anything. The result is available from boot_manager_get_plan.
+ * Nor is the inventory of kernels written back, so a dry run leaves no
+ * trace at all.
+ *
+ * @param dry_run Whether updates should only be planned
+ */
+void boot_manager_set_dry_run(BootManager *manager, bool dry_run);
+
+/**
+ * Decide what happens when another process is already updating the system.
+ * By default we leave our changes for it to pick up and return immediately,
+ * otherwise we wait for it to finish, and update again if it didn't cover
+ * everything we asked for. Image and dry-run updates never wait.
+ *
+ * @param wait Whether to wait for a running update
+ */
+void boot_manager_set_wait(BootManager *manager, bool wait);
+
+/**
+ * Whether the last update was left for an update already running in another
+ * process, having returned without waiting. Its changes are then not known
+ * to be applied: if the running update fails, they're lost with it.
+ */
+bool boot_manager_update_deferred(BootManager *manager);
+
+/**
+ * When set, a boot device mounted by boot_manager_update stays mounted once
+ * the update completes, so that following updates find the vfat caches warm.
+ * Everything is still flushed at the end of each update. The mount is left
+ * in place until boot_manager_release_mount, or until the manager is freed.
+ *
+ * @param keep_mounted Whether to keep the boot device mounted
+ */
+void boot_manager_set_keep_mounted(BootManager *manager, bool keep_mounted);
+
+/**
+ * Determine whether a boot device mounted by an earlier update was kept
+ */
+bool boot_manager_has_kept_mount(BootManager *manager);
+
+/**
+ * Unmount the boot device if an earlier update kept it mounted
+ *
+ * @return False if it couldn't be unmounted
+ */
+bool boot_manager_release_mount(BootManager *manager);
+
+/**
+ * Return the plan computed by the last boot_manager_update, one action per
+ * line, or NULL if no update has been planned yet.
+ *
+ * Each line begins with the action, followed by its space separated
+ * arguments:
+ *
+ *      bootloader install|update
+ *      install <type> <path> <kernel bytes> <initrd bytes>
+ *      entry <type> <path>
+ *      default <path>|timeout
+ *      config regenerate
+ *      remove <type> <path>
+ *      total <bytes to copy> <installs> <removals>
+ *
+ * When the ESP is mirrored, each ESP's plan is preceded by an esp <device>
+ * line, the boot device first.
+ *
+ * @note The returned string is owned by the manager
+ */
+const char *boot_manager_get_plan(BootManager *manager);
+
+/**
+ * Return the outcome of the last boot_manager_update or
+ * boot_manager_apply_timeout for each ESP, as one esp <device>
+ * updated|failed line each, or NULL unless the ESP is mirrored.
+ *
+ * @note The returned string is owned by the manager
+ */
+const char *boot_manager_get_report(BootManager *manager);
+
 /**
  * Determine the default timeout based on the contents of
  * SYSCONFDIR/boot_timeout
  */
 int boot_manager_get_timeout_value(BootManager *manager);
 
+/**
+ * Append what is installed and what an update would change to @writer,
+ * either as "key value" rows or as a single line JSON object.
+ *
+ * Only the root is consulted: kernels come from the inventory cache, and
+ * whether each is installed from the manifest on the boot directory along
+ * with the digests cached by earlier updates. Nothing is probed, mounted or
+ * written, so answers that need the ESP are unknown while it isn't mounted,
+ * and the manager is best put in dry run mode beforehand.
+ *
+ * @return False if the kernels couldn't be discovered
+ */
+bool boot_manager_write_status(BootManager *manager, CbmWriter *writer, bool json);
+
 /**
  * Determine the default kernel for the given type if it is in the set
  * This does not create a new instance, simply a pointer to the existing
@@ -280,6 +582,59 @@ Kernel *boot_manager_get_default_for_type(BootManager *manager, KernelArray *ker
  */
 NcHashmap *boot_manager_map_kernels(BootManager *manager, KernelArray *kernels);
 
+/**
+ * Kernels of one type within a KernelIndex
+ */
+typedef struct KernelTypeIndex {
+        const char *ktype;      /**<Type of these kernels */
+        KernelArray *kernels;   /**<Kernels of this type, highest release first */
+        Kernel *default_kernel; /**<Target of the default-$type link, if any */
+        Kernel *last_booted;    /**<Highest release known to boot, if any */
+} KernelTypeIndex;
+
+/**
+ * Every lookup an update needs over a set of kernels, resolved up front
+ */
+typedef struct KernelIndex {
+        KernelArray *kernels;  /**<The indexed set, highest release first */
+        NcArray *types;        /**<KernelTypeIndex of each type, newest type first */
+        NcHashmap *by_type;    /**<ktype -> KernelTypeIndex */
+        NcHashmap *by_name;    /**<Basename -> Kernel */
+        NcHashmap *by_release; /**<"ktype-release" -> Kernel */
+        CbmArena *arena;       /**<Storage of the keys and type indexes */
+} KernelIndex;
+
+/**
+ * Index @kernels, sorting them from the highest release down. Each type's
+ * default- link is read once. The index only refers to the kernels, which
+ * must outlive it.
+ */
+KernelIndex *boot_manager_index_kernels(BootManager *manager, KernelArray *kernels);
+
+/**
+ * Free an index, leaving the kernels it refers to alone
+ */
+void kernel_index_free(KernelIndex *index);
+
+/**
+ * Look up the kernels of @ktype
+ *
+ * @return the type index, or NULL if there are no kernels of @ktype
+ */
+KernelTypeIndex *kernel_index_get_type(KernelIndex *index, const char *ktype);
+
+/**
+ * Same as boot_manager_get_running_kernel, falling back to the first kernel
+ * of the same type and release, as boot_manager_get_running_kernel_fallback
+ */
+Kernel *boot_manager_index_get_running_kernel(BootManager *manager, KernelIndex *index);
+
+/**
+ * Discard the snapshot of the inspected system, ensuring the next inspection
+ * probes the devices again
+ */
+void boot_manager_discard_snapshot(BootManager *manager);
+
 /**
  * Set the timeout to be used in the bootloader
  *
@@ -287,6 +642,17 @@ NcHashmap *boot_manager_map_kernels(BootManager *manager, KernelArray *kernels);
  */
 bool boot_manager_set_timeout_value(BootManager *manager, int timeout);
 
+/**
+ * Apply the configured timeout to the installed bootloader configuration,
+ * mounting the boot directory if need be. Only the file holding the timeout
+ * is rewritten: no kernels are discovered, compared or collected.
+ * Bootloaders whose configuration doesn't carry the timeout have nothing
+ * to apply. Every mirrored ESP is given the timeout too.
+ *
+ * While another update is running, it's left to apply the timeout.
+ */
+bool boot_manager_apply_timeout(BootManager *manager);
+
 bool boot_manager_needs_install(BootManager *manager);
 
 bool boot_manager_needs_update(BootManager *manager);
@@ -334,25 +700,60 @@ void cbm_free_sysconfig(SystemConfig *config);
  */
 SystemConfig *cbm_inspect_root(const char *path, bool image_mode);
 
+/**
+ * Return a new SystemConfig for the root path, without probing any devices
+ */
+SystemConfig *cbm_new_sysconfig(const char *path, bool image_mode);
+
+/**
+ * Probe the boot and root devices of a SystemConfig from cbm_new_sysconfig
+ */
+void cbm_probe_sysconfig(SystemConfig *config);
+
+/**
+ * Parse the contents of a device spec file, see boot_manager_set_device_spec
+ *
+ * @return a newly allocated spec, or NULL if it isn't valid
+ */
+CbmDeviceSpec *cbm_device_spec_parse(const char *text);
+
+/**
+ * Read and parse the device spec file at @path
+ */
+CbmDeviceSpec *cbm_device_spec_load(const char *path);
+
+/**
+ * Free a device spec
+ */
+void cbm_device_spec_free(CbmDeviceSpec *spec);
+
+/**
+ * Fill in the devices of @config from @spec, in place of cbm_probe_sysconfig
+ */
+void cbm_apply_device_spec(SystemConfig *config, const CbmDeviceSpec *spec);
+
 /**
  * Determine if the given SystemConfig is sane for use
  */
 bool cbm_is_sysconfig_sane(SystemConfig *config);
 
 /**
- * Free a kernel type
+ * Free a kernel type. Kernels from the arena of a KernelArray are released
+ * with the array instead, so this does nothing for them.
  */
 void free_kernel(Kernel *t);
 
-static inline void kernel_array_free(void *v)
-{
-        KernelArray *a = v;
-        nc_array_free(&a, (array_free_func)free_kernel);
-}
+/**
+ * Free a KernelArray along with every kernel it contains, releasing the
+ * arena of the scan that built it
+ */
+void kernel_array_free(void *v);
 
 DEF_AUTOFREE(BootManager, boot_manager_free)
 DEF_AUTOFREE(KernelArray, kernel_array_free)
 DEF_AUTOFREE(Kernel, free_kernel)
+DEF_AUTOFREE(KernelIndex, kernel_index_free)
+DEF_AUTOFREE(CbmDeviceSpec, cbm_device_spec_free)
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
@@ -19,33 +19,399 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 #include "bootloader.h"
 #include "bootman.h"
+#include "initrd.h"
+#include "nica/hashmap.h"
 #include "os-release.h"
 
+/**
+ * Lists further ESPs to keep identical to the boot device, relative to the
+ * root. Each line names a device node, PARTUUID=... or PARTLABEL=...
+ */
+#define BOOT_MANAGER_MIRRORS_FILE KERNEL_CONF_DIRECTORY "/boot-mirrors"
+
+/**
+ * How many kernels updates keep installed beyond those always kept, relative
+ * to the root
+ */
+#define BOOT_MANAGER_RETENTION_FILE KERNEL_CONF_DIRECTORY "/retention"
+
+/**
+ * How initrds are recompressed as they're installed, relative to the root.
+ * Without it, initrds are installed as they're shipped.
+ */
+#define BOOT_MANAGER_INITRD_COMPRESSION_FILE KERNEL_CONF_DIRECTORY "/initrd-compression"
+
+/**
+ * Which kernels an update keeps. The running kernel and the default and last
+ * booted kernel of each type are always kept, along with any pinned kernel.
+ * Further kernels are kept newest first, so long as they're within the age
+ * and byte limits.
+ */
+typedef struct RetentionPolicy {
+        bool configured;   /**<Read from the retention file */
+        unsigned int keep; /**<Further kernels kept of each type */
+        uint64_t max_age;  /**<Seconds since a further kernel booted or was installed, 0 for any */
+        uint64_t budget;   /**<Bytes of kernels and initrds kept in total, 0 for any */
+        NcHashmap *pins;   /**<Kernels always kept, by basename or "type-release" */
+} RetentionPolicy;
+
+/**
+ * What an update does with a kernel
+ */
+typedef enum {
+        RETENTION_SKIP = 0, /**<Left alone, for want of knowing the running kernel */
+        RETENTION_REMOVE,   /**<Garbage collected */
+        RETENTION_KEEP,     /**<Kept, and installed unless that fails */
+        RETENTION_REQUIRE,  /**<Kept, and the update fails unless it's installed */
+} RetentionVerdict;
+
+/**
+ * Parse a retention policy from a list of whitespace or comma separated
+ * options: keep=N, max-age=N with an optional s, m, h, d or w suffix,
+ * budget=N with an optional K, M or G suffix, and pin=NAME, which may be
+ * given repeatedly. Anything following a # on a line is a comment.
+ *
+ * @return True if every option was understood
+ */
+bool boot_manager_retention_parse(const char *spec, RetentionPolicy *policy);
+
+/**
+ * Read the retention policy of the root from BOOT_MANAGER_RETENTION_FILE,
+ * or the default of keeping no further kernels if there is none
+ *
+ * @return False if the file couldn't be read or understood, leaving the
+ * default in @policy
+ */
+bool boot_manager_load_retention(BootManager *manager, RetentionPolicy *policy);
+
+/**
+ * Release everything held by @policy, leaving the default
+ */
+void boot_manager_retention_clear(RetentionPolicy *policy);
+
+/**
+ * Decide what an update does with each kernel of @index. Kernels are only
+ * collected when the running kernel is known, or the policy was configured,
+ * in which case the kernel booted most recently stands in for the running
+ * one. Each kernel is looked at once, and only those that could be kept
+ * further are stat'ed.
+ *
+ * @param running The running kernel, NULL if it isn't known
+ * @param verdicts Receives one verdict per kernel of index->kernels, in the
+ * same order
+ */
+void boot_manager_retention_evaluate(const RetentionPolicy *policy, KernelIndex *index,
+                                     const Kernel *running, RetentionVerdict *verdicts);
+
+/**
+ * Read the initrd recompression policy of the root from
+ * BOOT_MANAGER_INITRD_COMPRESSION_FILE, or the default of keeping initrds as
+ * they are if there is none
+ *
+ * @return False if the file couldn't be read or understood, leaving the
+ * default in @policy
+ */
+bool boot_manager_load_initrd_policy(BootManager *manager, CbmInitrdPolicy *policy);
+
+/**
+ * Point source.packed_initrd of @kernel at its initrd recompressed as
+ * @policy asks. It's only recompressed once for each initrd, which the
+ * kernel must be configured to unpack, and only if that makes it smaller.
+ * Otherwise the field is cleared and the initrd is installed as it is.
+ *
+ * @param create Whether to recompress an initrd not seen before, rather than
+ * install it as it is
+ *
+ * @return False if out of memory
+ */
+bool boot_manager_pack_initrd(BootManager *manager, const CbmInitrdPolicy *policy, Kernel *kernel,
+                              bool create);
+
+/**
+ * Find the initrd of @kernel as recompressed with @compression by an earlier
+ * update, whatever the policy is now
+ *
+ * @return a newly allocated path, or NULL if there is none
+ */
+char *boot_manager_find_packed_initrd(const BootManager *manager, const Kernel *kernel,
+                                      CbmInitrdCompression compression);
+
+/**
+ * Remove the recompressed initrds of every initrd no longer shipped for one
+ * of @kernels
+ */
+void boot_manager_collect_packed_initrds(BootManager *manager, KernelArray *kernels);
+
+/**
+ * Parts of a BootManager that are only set up once something needs them.
+ * Listing or changing the timeout shouldn't need to touch a block device.
+ */
+typedef enum {
+        BOOT_MANAGER_FACET_PROBE = 1 << 0,      /**<Root and boot devices probed */
+        BOOT_MANAGER_FACET_OS_RELEASE = 1 << 1, /**<os-release parsed */
+        BOOT_MANAGER_FACET_BOOTLOADER = 1 << 2, /**<Bootloader selected and initialised */
+} BootManagerFacet;
+
 struct BootManager {
         char *kernel_dir;             /**<Kernel directory */
         const BootLoader *bootloader; /**<Selected bootloader */
+        void *bootloader_data;        /**<Private to the selected bootloader */
+        CbmManifest *manifest;        /**<Files installed by this manager's updates */
+        CbmStage *stage;              /**<Small files being written by the current update */
         CbmOsRelease *os_release;     /**<Parsed os-release file */
         char *abs_bootdir;            /**<Real boot dir */
         SystemKernel sys_kernel;      /**<Native kernel info, if any */
         bool have_sys_kernel;         /**<Whether sys_kernel is set */
         bool image_mode;              /**<Are we in image mode? */
         SystemConfig *sysconfig;      /**<System configuration */
+        unsigned int facets;          /**<BootManagerFacet set up so far */
+        unsigned int failed_facets;   /**<BootManagerFacet that failed to set up */
         char *cmdline;                /**<Additional cmdline to append */
+        bool have_cmdline;            /**<Whether cmdline has been loaded */
+        unsigned int jobs;            /**<Maximum concurrent install jobs */
+        bool verify;                  /**<Compare installed files in full */
+        bool dry_run;                 /**<Only plan updates, never execute them */
+        bool wait;                    /**<Wait for a concurrent update to finish */
+        bool deferred;                /**<Last update was left to a running one */
+        bool keep_mounted;            /**<Leave a boot dir we mounted in place */
+        char *kept_mount;             /**<Boot dir we mounted and left in place */
+        bool dedup;                   /**<Share identical blobs through the blob store */
+        char *io_policy;              /**<I/O policy given on the command line */
+        CbmDeviceSpec *device_spec;   /**<Devices of the root, in place of probing */
+        char *plan;                   /**<Description of the last planned update */
+        char *report;                 /**<Outcome of the last update for each ESP */
+        NcHashmap *installed;         /**<Kernels installed during this update */
+        NcHashmap *changed_types;     /**<Kernel types updates are limited to, NULL for all */
+        BootManager *parent;          /**<Manager a mirror borrows the root from, if any */
 };
 
+/**
+ * Create a manager for a mirrored ESP mounted at @boot_dir, with its own
+ * bootloader state, manifest and stage. The root, its configuration and
+ * its kernels are borrowed from @parent, which must outlive it and must
+ * not change while it's in use, so that mirrors may be updated
+ * concurrently. Only the ESP is ever written through it.
+ *
+ * @param jobs Concurrent install jobs for this ESP alone
+ * @return a newly allocated manager, or NULL if the bootloader can't be
+ * set up for @boot_dir
+ */
+BootManager *boot_manager_new_mirror(BootManager *parent, const char *boot_dir, unsigned int jobs);
+
+/**
+ * Set up each of the @facets not set up yet, in order of dependency. A facet
+ * that failed isn't retried until the prefix is set again.
+ *
+ * @return False if any of them can't be set up
+ */
+bool boot_manager_require(BootManager *manager, unsigned int facets);
+
+/**
+ * Restore the probed devices and os-release of the native root from the
+ * snapshot taken earlier during this boot, if it's still valid
+ *
+ * @return True if the snapshot was restored
+ */
+bool boot_manager_load_snapshot(BootManager *manager);
+
+/**
+ * Snapshot the probed devices and os-release of the native root
+ */
+void boot_manager_save_snapshot(BootManager *manager);
+
+/**
+ * Additional cmdline to append to every kernel, merged from the cmdline
+ * files beneath the prefix the first time a kernel needs it.
+ *
+ * @return the cmdline, or NULL if none could be loaded
+ */
+const char *boot_manager_get_cmdline(BootManager *manager);
+
+/**
+ * Begin remembering which kernels have been installed, so that installing
+ * the same kernel again within one update is free.
+ */
+void boot_manager_installs_begin(BootManager *manager);
+
+/**
+ * Forget every installed kernel, i.e. once the update is complete
+ */
+void boot_manager_installs_end(BootManager *manager);
+
+/**
+ * Determine whether @kernel was already installed during this update
+ */
+bool boot_manager_install_done(const BootManager *manager, const Kernel *kernel);
+
+/**
+ * Record that @kernel has been installed in full during this update
+ */
+void boot_manager_install_record(BootManager *manager, const Kernel *kernel);
+
+/**
+ * Determine the installed locations of a kernel's blobs.
+ *
+ * @param kernel_target Set to the newly allocated path of the kernel blob
+ * @param initrd_source Set to the initrd to be installed, or NULL if none
+ * @param initrd_target Set to the newly allocated path of the initrd, or NULL
+ * @return False if the bootloader has no kernel destination
+ */
+bool boot_manager_get_kernel_targets(const BootManager *manager, const Kernel *kernel,
+                                     char **kernel_target, const char **initrd_source,
+                                     char **initrd_target);
+
+/**
+ * Hand the kernel over to the bootloader, once its blobs are installed
+ */
+bool boot_manager_bootloader_install_kernel(const BootManager *manager, const Kernel *kernel);
+
 /**
  * Internal function to install the kernel blob itself
  */
 bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel);
 
+/**
+ * Install only the requested blobs of @kernel, for an update that has already
+ * determined which of them need copying
+ */
+bool boot_manager_install_kernel_files(const BootManager *manager, const Kernel *kernel,
+                                       bool install_kernel, bool install_initrd);
+
 /**
  * Internal function to remove the kernel blob itself
  */
 bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel);
 
+/**
+ * Remove the blobs of every kernel in @kernels, using up to @jobs threads.
+ * Every kernel is attempted, even once one of them failed.
+ *
+ * @return False if any of the kernels couldn't be removed
+ */
+bool boot_manager_remove_kernels_internal(const BootManager *manager, NcArray *kernels,
+                                          unsigned int jobs);
+
+/**
+ * Allocate a new Kernel for the given path, populating only those fields
+ * which can be derived from the file name itself.
+ *
+ * @param arena Where the Kernel and its strings are allocated, or NULL to
+ * allocate them on the heap
+ * @return a newly allocated Kernel, or NULL if the path isn't a kernel
+ */
+Kernel *boot_manager_alloc_kernel(BootManager *manager, CbmArena *arena, const char *path);
+
+/**
+ * Replace the string @field of @kernel with a copy of @value, allocated
+ * wherever @kernel keeps its strings. Whatever @field held is released,
+ * unless it lives in the arena of @kernel.
+ *
+ * @param value New contents, or NULL to clear @field
+ */
+void boot_manager_kernel_set_field(Kernel *kernel, char **field, const char *value);
+
+/**
+ * Fill in the remaining derived fields of a Kernel once the source paths
+ * are known. Whether it's known to boot is left to the caller.
+ */
+void boot_manager_complete_kernel(BootManager *manager, Kernel *kernel);
+
+/**
+ * Build the paths at which the initrd and user initrd of @kernel would be
+ * found, whether or not they exist
+ */
+void boot_manager_kernel_initrd_paths(const Kernel *kernel, char **initrd, char **user_initrd);
+
+/**
+ * Sort @kernels by release number, highest first
+ */
+void boot_manager_sort_kernels(KernelArray *kernels);
+
+/**
+ * Name of the kernel blob on the target when it isn't shared
+ *
+ * @return a newly allocated basename
+ */
+char *boot_manager_kernel_target_name(const Kernel *kernel);
+
+/**
+ * Name of the initrd on the target when it isn't shared
+ *
+ * @return a newly allocated basename
+ */
+char *boot_manager_initrd_target_name(const Kernel *kernel);
+
+/**
+ * Identifier of the kernel in the boot ledger, i.e. 4.4.0-120.lts
+ *
+ * @return a newly allocated identifier
+ */
+char *boot_manager_kernel_ledger_name(const Kernel *kernel);
+
+/**
+ * Rewrite the boot ledger to only describe @kernels, if worthwhile, also
+ * importing the legacy k_booted files. Failure isn't fatal, the ledger is
+ * only ever read.
+ */
+void boot_manager_compact_boot_ledger(const BootManager *self, NcArray *kernels);
+
+/**
+ * Point the targets of @kernel at the blob store when @shared is set, or
+ * otherwise at the kernel's own files. Only the kernels of UEFI bootloaders
+ * are ever shared, elsewhere the kernel name doubles as the entry name.
+ * A blob that can't be hashed is simply left unshared.
+ */
+void boot_manager_share_kernel(const BootManager *manager, Kernel *kernel, bool shared);
+
+/**
+ * Garbage collect the blob store once the loader entries are up to date.
+ *
+ * The entries of @installed were just written, so they refer to exactly
+ * their current targets, and any own files they moved away from are removed.
+ * The entries of @kept were left alone and may refer to either their own
+ * files or to blobs. Any blob that no entry can refer to is removed.
+ *
+ * @return False if anything that should go couldn't be removed
+ */
+bool boot_manager_collect_blobs(const BootManager *manager, NcArray *installed, NcArray *kept);
+
+/**
+ * Persistent inventory of previously inspected kernels, keyed by the
+ * (dev, ino, size, mtime) of each kernel blob.
+ */
+typedef struct CbmKernelCache CbmKernelCache;
+
+/**
+ * Load the kernel inventory for the manager's prefix
+ *
+ * @return a new CbmKernelCache, or NULL if caching isn't applicable
+ */
+CbmKernelCache *cbm_kernel_cache_open(BootManager *manager);
+
+/**
+ * Construct a Kernel from the inventory if the file is unchanged
+ *
+ * @param arena Where the Kernel is allocated, or NULL for the heap
+ * @return a newly allocated Kernel, or NULL on a cache miss
+ */
+Kernel *cbm_kernel_cache_lookup(CbmKernelCache *cache, CbmArena *arena, const char *path,
+                                const struct stat *st);
+
+/**
+ * Remember the freshly inspected kernel for the next run
+ */
+void cbm_kernel_cache_insert(CbmKernelCache *cache, const Kernel *kernel, const struct stat *st);
+
+/**
+ * Write back the inventory if it changed, and free the cache
+ */
+void cbm_kernel_cache_close(CbmKernelCache *cache);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
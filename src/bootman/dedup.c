@@ -0,0 +1,295 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "casepath.h"
+#include "files.h"
+#include "log.h"
+#include "manifest.h"
+
+/**
+ * The blob store lives alongside the kernels, each blob named by the SHA-256
+ * of its contents so that identical kernels and initrds are stored once.
+ * vfat has no hardlinks, so sharing happens at the entry level: each loader
+ * entry names the blob itself, and a blob lives for as long as any entry
+ * still refers to it.
+ */
+#define CBM_BLOB_PREFIX "blob-"
+
+static bool boot_manager_is_blob(const char *name)
+{
+        return name && strncmp(name, CBM_BLOB_PREFIX, strlen(CBM_BLOB_PREFIX)) == 0;
+}
+
+static bool boot_manager_is_uefi(const BootManager *self)
+{
+        return (self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
+               BOOTLOADER_CAP_UEFI;
+}
+
+/**
+ * Name the blob holding the contents of @source
+ *
+ * @return a newly allocated basename, or NULL if @source can't be hashed
+ */
+static char *boot_manager_blob_name(const BootManager *self, const char *source)
+{
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+
+        if (!cbm_manifest_digest(self->manifest, source, digest)) {
+                LOG_WARNING("Cannot hash %s, not sharing it: %s", source, strerror(errno));
+                return NULL;
+        }
+        return string_printf(CBM_BLOB_PREFIX "%s", digest);
+}
+
+/**
+ * Point @target of @kernel at @name, taking ownership of it
+ */
+static void boot_manager_set_target(Kernel *kernel, char **target, char *name)
+{
+        boot_manager_kernel_set_field(kernel, target, name);
+        free(name);
+}
+
+void boot_manager_share_kernel(const BootManager *self, Kernel *kernel, bool shared)
+{
+        const char *initrd = boot_manager_kernel_get_initrd_source(kernel);
+        char *name = NULL;
+
+        if (boot_manager_is_uefi(self)) {
+                name = shared ? boot_manager_blob_name(self, kernel->source.path) : NULL;
+                boot_manager_set_target(kernel,
+                                        &kernel->target.path,
+                                        name ? name : boot_manager_kernel_target_name(kernel));
+        }
+
+        /* Only kernels which have an initrd target at all */
+        if (kernel->target.initrd_path && initrd) {
+                name = shared ? boot_manager_blob_name(self, initrd) : NULL;
+                boot_manager_set_target(kernel,
+                                        &kernel->target.initrd_path,
+                                        name ? name : boot_manager_initrd_target_name(kernel));
+        }
+}
+
+/**
+ * Directory the kernels, and thus the blobs, are installed to
+ */
+static char *boot_manager_blob_dir(const BootManager *self)
+{
+        autofree(char) *base_path = NULL;
+        const char *efi_boot_dir = NULL;
+
+        base_path = boot_manager_get_boot_dir((BootManager *)self);
+        OOM_CHECK_RET(base_path, NULL);
+
+        if (!boot_manager_is_uefi(self)) {
+                return strdup(base_path);
+        }
+        efi_boot_dir = self->bootloader->get_kernel_destination(self);
+        if (!efi_boot_dir) {
+                return NULL;
+        }
+        return string_printf("%s%s", base_path, efi_boot_dir);
+}
+
+static void boot_manager_add_ref(NcHashmap *refs, const char *name)
+{
+        char *key = NULL;
+
+        if (!boot_manager_is_blob(name) || nc_hashmap_contains(refs, name)) {
+                return;
+        }
+        key = strdup(name);
+        if (!key || !nc_hashmap_put(refs, key, key)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+/**
+ * Reference the blob of every initrd a kept entry of @kernel may name. It
+ * may have been installed as shipped, or recompressed under whichever policy
+ * was in place then.
+ *
+ * @return False if one of them can't be hashed
+ */
+static bool boot_manager_ref_initrd_blobs(const BootManager *self, NcHashmap *refs,
+                                          const Kernel *kernel)
+{
+        const char *shipped = kernel->source.user_initrd_file ? kernel->source.user_initrd_file
+                                                              : kernel->source.initrd_file;
+
+        for (int c = CBM_INITRD_KEEP; shipped && c <= CBM_INITRD_XZ; c++) {
+                autofree(char) *packed = NULL;
+                autofree(char) *blob = NULL;
+
+                if (c != CBM_INITRD_KEEP) {
+                        packed = boot_manager_find_packed_initrd(self, kernel, c);
+                        if (!packed) {
+                                continue;
+                        }
+                }
+                blob = boot_manager_blob_name(self, packed ? packed : shipped);
+                if (!blob) {
+                        return false;
+                }
+                boot_manager_add_ref(refs, blob);
+        }
+        return true;
+}
+
+/**
+ * Remove @name from the blob directory if it's there
+ */
+static bool boot_manager_remove_target(const BootManager *self, const char *dir,
+                                       NcHashmap *entries, const char *name, bool *removed)
+{
+        autofree(char) *path = NULL;
+
+        if (!name || !nc_hashmap_contains(entries, name)) {
+                return true;
+        }
+        *removed = true;
+        path = string_printf("%s/%s", dir, name);
+        if (cbm_unlink(path) < 0) {
+                LOG_ERROR("Failed to remove %s: %s", path, strerror(errno));
+                return false;
+        }
+        cbm_manifest_forget(self->manifest, path);
+        cbm_case_path_invalidate(path);
+        return true;
+}
+
+bool boot_manager_collect_blobs(const BootManager *self, NcArray *installed, NcArray *kept)
+{
+        autofree(char) *dir = NULL;
+        NcHashmap *entries = NULL;
+        NcHashmap *refs = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *name = NULL;
+        bool have_blobs = false;
+        bool removed = false;
+        bool ret = true;
+
+        dir = boot_manager_blob_dir(self);
+        if (!dir) {
+                return false;
+        }
+        entries = cbm_get_dir_entries(dir);
+        if (!entries) {
+                /* Nothing installed, nothing to collect */
+                return true;
+        }
+        refs = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!refs) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* These entries moved to the store, so their own files are unused */
+        for (uint16_t i = 0; i < installed->len; i++) {
+                const Kernel *k = nc_array_get(installed, i);
+                autofree(char) *kernel_name = NULL;
+                autofree(char) *initrd_name = NULL;
+
+                boot_manager_add_ref(refs, k->target.path);
+                boot_manager_add_ref(refs, k->target.initrd_path);
+
+                if (boot_manager_is_blob(k->target.path)) {
+                        kernel_name = boot_manager_kernel_target_name(k);
+                        ret = boot_manager_remove_target(self,
+                                                         dir,
+                                                         entries,
+                                                         kernel_name,
+                                                         &removed) &&
+                              ret;
+                }
+                if (boot_manager_is_blob(k->target.initrd_path)) {
+                        initrd_name = boot_manager_initrd_target_name(k);
+                        ret = boot_manager_remove_target(self,
+                                                         dir,
+                                                         entries,
+                                                         initrd_name,
+                                                         &removed) &&
+                              ret;
+                }
+        }
+
+        nc_hashmap_iter_init(entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&name, NULL)) {
+                if (boot_manager_is_blob(name)) {
+                        have_blobs = true;
+                        break;
+                }
+        }
+
+        /* Without reading every kept entry back we can't tell which files it
+         * names, so each of them keeps the blobs of its own contents alive.
+         * Only worth hashing for if there are any blobs at all. */
+        for (uint16_t i = 0; have_blobs && i < kept->len; i++) {
+                const Kernel *k = nc_array_get(kept, i);
+                autofree(char) *kernel_blob = NULL;
+
+                boot_manager_add_ref(refs, k->target.path);
+                boot_manager_add_ref(refs, k->target.initrd_path);
+
+                if (boot_manager_is_uefi(self)) {
+                        kernel_blob = boot_manager_blob_name(self, k->source.path);
+                        if (!kernel_blob) {
+                                /* Can't tell which blob it may use, so keep them all */
+                                goto done;
+                        }
+                        boot_manager_add_ref(refs, kernel_blob);
+                }
+                if (k->target.initrd_path && !boot_manager_ref_initrd_blobs(self, refs, k)) {
+                        goto done;
+                }
+        }
+
+        nc_hashmap_iter_init(entries, &iter);
+        while (have_blobs && nc_hashmap_iter_next(&iter, (void **)&name, NULL)) {
+                if (!boot_manager_is_blob(name) || nc_hashmap_contains(refs, name)) {
+                        continue;
+                }
+                LOG_INFO("Removing unreferenced blob %s", name);
+                ret = boot_manager_remove_target(self, dir, entries, name, &removed) && ret;
+        }
+
+done:
+        if (removed) {
+                cbm_sync_path(dir);
+        }
+        nc_hashmap_free(refs);
+        nc_hashmap_free(entries);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,262 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "initrd.h"
+#include "log.h"
+#include "manifest.h"
+#include "nica/files.h"
+#include "system_stub.h"
+
+/**
+ * Where recompressed initrds are kept on the root, named for the digest of
+ * the initrd they were made from. A zero length file named with the
+ * CBM_INITRD_KEPT suffix records an initrd not worth recompressing.
+ */
+#define CBM_INITRD_CACHE_DIR "var/cache/clr-boot-manager/initrd"
+
+/**
+ * Runtime directory holding them for image mode, as nothing may be left in
+ * the image
+ */
+#define CBM_INITRD_RUNTIME_DIR "clr-boot-manager/initrd"
+
+#define CBM_INITRD_KEPT "none"
+
+bool boot_manager_load_initrd_policy(BootManager *self, CbmInitrdPolicy *policy)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+
+        *policy = (CbmInitrdPolicy){ 0 };
+
+        if (!self->sysconfig) {
+                return true;
+        }
+
+        path = string_printf("%s%s",
+                             self->sysconfig->prefix,
+                             BOOT_MANAGER_INITRD_COMPRESSION_FILE);
+        if (!nc_file_exists(path)) {
+                return true;
+        }
+        if (!file_get_text(path, &text)) {
+                LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                return false;
+        }
+        if (!cbm_initrd_parse_policy(text, policy)) {
+                LOG_ERROR("Invalid initrd compression in %s", path);
+                *policy = (CbmInitrdPolicy){ 0 };
+                return false;
+        }
+        return true;
+}
+
+static char *boot_manager_initrd_cache_dir(const BootManager *self)
+{
+        if (boot_manager_is_image_mode((BootManager *)self)) {
+                return string_printf("%s/%s",
+                                     cbm_system_get_runtime_path(),
+                                     CBM_INITRD_RUNTIME_DIR);
+        }
+        return string_printf("%s/%s", self->sysconfig->prefix, CBM_INITRD_CACHE_DIR);
+}
+
+/**
+ * The initrd shipped for @kernel, before any recompression
+ */
+static const char *boot_manager_shipped_initrd(const Kernel *kernel)
+{
+        return kernel->source.user_initrd_file ? kernel->source.user_initrd_file
+                                               : kernel->source.initrd_file;
+}
+
+char *boot_manager_find_packed_initrd(const BootManager *self, const Kernel *kernel,
+                                      CbmInitrdCompression compression)
+{
+        autofree(char) *dir = NULL;
+        const char *initrd = boot_manager_shipped_initrd(kernel);
+        const char *suffix = cbm_initrd_suffix(compression);
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        char *packed = NULL;
+
+        if (!initrd || !suffix || !cbm_manifest_digest(self->manifest, initrd, digest)) {
+                return NULL;
+        }
+        dir = boot_manager_initrd_cache_dir(self);
+        OOM_CHECK_RET(dir, NULL);
+        packed = string_printf("%s/%s.%s", dir, digest, suffix);
+        OOM_CHECK_RET(packed, NULL);
+        if (!cbm_file_exists(packed)) {
+                free(packed);
+                return NULL;
+        }
+        return packed;
+}
+
+bool boot_manager_pack_initrd(BootManager *self, const CbmInitrdPolicy *policy, Kernel *kernel,
+                              bool create)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *packed = NULL;
+        autofree(char) *kept = NULL;
+        const char *initrd = boot_manager_shipped_initrd(kernel);
+        const char *suffix = cbm_initrd_suffix(policy->compression);
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        CbmInitrdResult result = CBM_INITRD_FAILED;
+
+        boot_manager_kernel_set_field(kernel, &kernel->source.packed_initrd, NULL);
+        if (!initrd || !suffix) {
+                return true;
+        }
+        /* It's the kernel being installed that has to unpack it */
+        if (!cbm_initrd_kconfig_supports(boot_manager_kernel_get_kconfig_file(kernel),
+                                         policy->compression)) {
+                LOG_DEBUG("initrd: %s can't unpack %s, installing %s as it is",
+                          kernel->meta.bpath,
+                          suffix,
+                          initrd);
+                return true;
+        }
+        if (!cbm_manifest_digest(self->manifest, initrd, digest)) {
+                LOG_WARNING("Cannot hash %s, not recompressing it: %s", initrd, strerror(errno));
+                return true;
+        }
+
+        dir = boot_manager_initrd_cache_dir(self);
+        OOM_CHECK_RET(dir, false);
+        packed = string_printf("%s/%s.%s", dir, digest, suffix);
+        kept = string_printf("%s/%s." CBM_INITRD_KEPT, dir, digest);
+        OOM_CHECK_RET(packed, false);
+        OOM_CHECK_RET(kept, false);
+
+        if (cbm_file_exists(packed)) {
+                boot_manager_kernel_set_field(kernel, &kernel->source.packed_initrd, packed);
+                return true;
+        }
+        if (cbm_file_exists(kept) || !create) {
+                return true;
+        }
+
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_WARNING("Cannot create %s: %s", dir, strerror(errno));
+                return true;
+        }
+        result = cbm_initrd_recompress(initrd, packed, policy);
+        if (result == CBM_INITRD_PACKED) {
+                boot_manager_kernel_set_field(kernel, &kernel->source.packed_initrd, packed);
+        } else if (result == CBM_INITRD_UNSUITABLE) {
+                /* Only the outcome is kept, so it's not tried again */
+                char empty[] = "";
+
+                if (!file_set_text(kept, empty)) {
+                        LOG_DEBUG("Cannot write %s: %s", kept, strerror(errno));
+                }
+        } else {
+                LOG_WARNING("Cannot recompress %s, installing it as it is", initrd);
+        }
+        return true;
+}
+
+void boot_manager_collect_packed_initrds(BootManager *self, KernelArray *kernels)
+{
+        autofree(char) *dir = NULL;
+        NcHashmap *digests = NULL;
+        void *listing = NULL;
+        const char *name = NULL;
+        bool removed = false;
+
+        dir = boot_manager_initrd_cache_dir(self);
+        OOM_CHECK(dir);
+        if (!nc_file_exists(dir)) {
+                return;
+        }
+        digests = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!digests) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *k = nc_array_get(kernels, i);
+                const char *initrd = boot_manager_shipped_initrd(k);
+                char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+                char *key = NULL;
+
+                if (!initrd) {
+                        continue;
+                }
+                if (!cbm_manifest_digest(self->manifest, initrd, digest)) {
+                        /* Can't tell which entry is its own */
+                        goto done;
+                }
+                key = strdup(digest);
+                if (!key || !nc_hashmap_put(digests, key, key)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        listing = cbm_system_opendir(dir);
+        if (!listing) {
+                goto done;
+        }
+        while ((name = cbm_system_readdir(listing)) != NULL) {
+                autofree(char) *path = NULL;
+                autofree(char) *digest = NULL;
+                const char *dot = strchr(name, '.');
+
+                if (name[0] == '.') {
+                        continue;
+                }
+                digest = dot ? strndup(name, (size_t)(dot - name)) : strdup(name);
+                OOM_CHECK(digest);
+                if (nc_hashmap_contains(digests, digest)) {
+                        continue;
+                }
+                path = string_printf("%s/%s", dir, name);
+                OOM_CHECK(path);
+                LOG_DEBUG("Removing unused recompressed initrd %s", path);
+                if (cbm_unlink(path) < 0) {
+                        LOG_WARNING("Failed to remove %s: %s", path, strerror(errno));
+                        continue;
+                }
+                removed = true;
+        }
+        cbm_system_closedir(listing);
+        if (removed) {
+                cbm_sync_path(dir);
+        }
+
+done:
+        nc_hashmap_free(digests);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -15,59 +15,70 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "bootman.h"
 #include "bootman_private.h"
 #include "cmdline.h"
 #include "files.h"
+#include "ledger.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/files.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "config.h"
 
 /**
- * Determine the applicable kboot file
+ * Allocate a string owned by @kernel, from its arena if it has one
  */
-__cbm_inline__ static inline char *boot_manager_get_kboot_file(BootManager *self, Kernel *k)
+static char *kernel_printf(Kernel *kernel, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static char *kernel_printf(Kernel *kernel, const char *fmt, ...)
 {
-        char *p = NULL;
-        /* /var/lib/kernel/k_booted_4.4.0-120.lts - new */
-        p = string_printf("%s/var/lib/kernel/k_booted_%s-%d.%s",
-                          self->sysconfig->prefix,
-                          k->meta.version,
-                          k->meta.release,
-                          k->meta.ktype);
-        return p;
+        char *ret = NULL;
+        va_list va;
+
+        va_start(va, fmt);
+        if (kernel->arena) {
+                ret = cbm_arena_vprintf(kernel->arena, fmt, va);
+        } else if (vasprintf(&ret, fmt, va) < 0) {
+                DECLARE_OOM();
+                abort();
+        }
+        va_end(va);
+        return ret;
 }
 
-Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
+void boot_manager_kernel_set_field(Kernel *kernel, char **field, const char *value)
+{
+        if (!kernel->arena) {
+                free(*field);
+        }
+        *field = value ? kernel_printf(kernel, "%s", value) : NULL;
+}
+
+Kernel *boot_manager_alloc_kernel(BootManager *self, CbmArena *arena, const char *path)
 {
         Kernel *kern = NULL;
-        autofree(char) *cmp = NULL;
+        autofree(char) *parent = NULL;
+        const char *bcp = NULL;
         char type[15] = { 0 };
         char version[15] = { 0 };
         int release = 0;
-        autofree(char) *parent = NULL;
-        autofree(char) *cmdline = NULL;
-        autofree(char) *module_dir = NULL;
-        autofree(char) *kconfig_file = NULL;
-        autofree(char) *initrd_file = NULL;
-        autofree(char) *user_initrd_file = NULL;
-        autofree(char) *sysmap_file = NULL;
-        autofree(char) *headers_dir = NULL;
         ssize_t r = 0;
-        char *bcp = NULL;
 
         if (!self || !path) {
                 return NULL;
         }
 
-        cmp = strdup(path);
-        if (!cmp) {
-                return NULL;
-        }
-        bcp = basename(cmp);
+        bcp = strrchr(path, '/');
+        bcp = bcp ? bcp + 1 : path;
 
         /* org.clearlinux.kvm.4.2.1-121 */
         r = sscanf(bcp, KERNEL_NAMESPACE ".%15[^.].%15[^-]-%d", type, version, &release);
@@ -75,166 +86,584 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 return NULL;
         }
 
-        parent = cbm_get_file_parent(path);
-        cmdline = string_printf("%s/cmdline-%s-%d.%s", parent, version, release, type);
-        kconfig_file = string_printf("%s/config-%s-%d.%s", parent, version, release, type);
-        sysmap_file = string_printf("%s/System.map-%s-%d.%s", parent, version, release, type);
-
-        /* i.e. /usr/lib/kernel/initrd-org.clearlinux.lts.4.9.1-1  */
-        initrd_file = string_printf("%s/initrd-%s.%s.%s-%d",
-                                    parent,
-                                    KERNEL_NAMESPACE,
-                                    type,
-                                    version,
-                                    release);
-
-        /* i.e. /etc/kernel/initrd-org.clearlinux.lts.4.9.1-1  */
-        user_initrd_file = string_printf("%s/initrd-%s.%s.%s-%d",
-                                         KERNEL_CONF_DIRECTORY,
-                                         KERNEL_NAMESPACE,
-                                         type,
-                                         version,
-                                         release);
-
-        /* TODO: We may actually be uninstalling a partially flopped kernel,
-         * so validity of existing kernels may be questionable
-         * Thus, flag it, and return kernel */
-        if (!nc_file_exists(cmdline)) {
-                LOG_ERROR("Valid kernel found with no cmdline: %s (expected %s)", path, cmdline);
-                return NULL;
-        }
-
-        /* Check local modules */
-        module_dir = string_printf("%s/%s/%s-%d.%s",
-                                   self->sysconfig->prefix,
-                                   KERNEL_MODULES_DIRECTORY,
-                                   version,
-                                   release,
-                                   type);
-
-        /* Fallback to an older namespace */
-        if (!nc_file_exists(module_dir)) {
-                free(module_dir);
-                module_dir = string_printf("%s/%s/%s-%d",
-                                           self->sysconfig->prefix,
-                                           KERNEL_MODULES_DIRECTORY,
-                                           version,
-                                           release);
-
-                if (!nc_file_exists(module_dir)) {
-                        LOG_WARNING("Found kernel with no modules: %s %s", path, module_dir);
-                        free(module_dir);
-                        module_dir = NULL;
-                }
-        }
-
-        /* Check headers directory, standardised path on all distros */
-        headers_dir = string_printf("%s/usr/src/linux-headers-%s-%d.%s",
-                                    self->sysconfig->prefix,
-                                    version,
-                                    release,
-                                    type);
-
-        /* Got this far, we have a valid clear kernel */
-        kern = calloc(1, sizeof(struct Kernel));
+        kern = arena ? cbm_arena_alloc(arena, sizeof(struct Kernel))
+                     : calloc(1, sizeof(struct Kernel));
         if (!kern) {
                 abort();
         }
+        kern->arena = arena;
+
+        kern->source.path = kernel_printf(kern, "%s", path);
+        kern->meta.bpath = kernel_printf(kern, "%s", bcp);
+        kern->meta.version = kernel_printf(kern, "%s", version);
+        kern->meta.ktype = kernel_printf(kern, "%s", type);
+        kern->meta.release = (int16_t)release;
 
-        kern->source.path = strdup(path);
-        kern->meta.bpath = strdup(bcp);
-        kern->meta.version = strdup(version);
-        if (module_dir) {
-                kern->source.module_dir = strdup(module_dir);
-        }
-        kern->meta.ktype = strdup(type);
         /* Legacy path should be used by non-UEFI bootloaders */
         kern->target.legacy_path = kern->meta.bpath;
 
         /* New path is virtually identical to the old one with the exception of
          * a kernel- prefix */
-        kern->target.path = string_printf("kernel-%s", kern->target.legacy_path);
+        kern->target.path = kernel_printf(kern, "kernel-%s", kern->target.legacy_path);
 
-        if (nc_file_exists(kconfig_file)) {
-                kern->source.kconfig_file = strdup(kconfig_file);
-                if (!kern->source.kconfig_file) {
-                        DECLARE_OOM();
-                        abort();
-                }
+        parent = cbm_get_file_parent(path);
+        kern->source.cmdline_file =
+            kernel_printf(kern, "%s/cmdline-%s-%d.%s", parent, version, release, type);
+
+        return kern;
+}
+
+char *boot_manager_kernel_target_name(const Kernel *kernel)
+{
+        return string_printf("kernel-%s", kernel->target.legacy_path);
+}
+
+/**
+ * Name of the initrd on the target, shared with the source initrd names
+ */
+#define KERNEL_INITRD_NAME "initrd-" KERNEL_NAMESPACE ".%s.%s-%d"
+
+char *boot_manager_initrd_target_name(const Kernel *kernel)
+{
+        return string_printf(KERNEL_INITRD_NAME,
+                             kernel->meta.ktype,
+                             kernel->meta.version,
+                             kernel->meta.release);
+}
+
+void boot_manager_complete_kernel(BootManager *self, Kernel *kern)
+{
+        if (!self || !kern) {
+                return;
         }
 
-        if (nc_file_exists(sysmap_file)) {
-                kern->source.sysmap_file = strdup(sysmap_file);
-                if (!kern->source.sysmap_file) {
-                        DECLARE_OOM();
-                        abort();
-                }
+        /* Target initrd is just basename'd initrd file, simpler to just
+         * reprintf it than copy & basename it */
+        if (!kern->target.initrd_path && (kern->source.initrd_file || kern->source.initrd_file)) {
+                kern->target.initrd_path = kernel_printf(kern,
+                                                         KERNEL_INITRD_NAME,
+                                                         kern->meta.ktype,
+                                                         kern->meta.version,
+                                                         kern->meta.release);
         }
+}
 
-        if (nc_file_exists(headers_dir)) {
-                kern->source.headers_dir = strdup(headers_dir);
-                if (!kern->source.headers_dir) {
-                        DECLARE_OOM();
-                        abort();
-                }
+char *boot_manager_kernel_ledger_name(const Kernel *kernel)
+{
+        /* The same identifiers as the legacy files used */
+        return string_printf("%s-%d.%s",
+                             kernel->meta.version,
+                             kernel->meta.release,
+                             kernel->meta.ktype);
+}
+
+void boot_manager_compact_boot_ledger(const BootManager *self, NcArray *kernels)
+{
+        autofree(NcHashmap) *keep = NULL;
+        autofree(char) *dir = NULL;
+
+        keep = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        if (!keep) {
+                DECLARE_OOM();
+                abort();
         }
+        for (uint16_t i = 0; kernels && i < kernels->len; i++) {
+                char *name = boot_manager_kernel_ledger_name(nc_array_get(kernels, i));
 
-        if (nc_file_exists(initrd_file)) {
-                kern->source.initrd_file = strdup(initrd_file);
-                if (!kern->source.initrd_file) {
+                if (!name || !nc_hashmap_put(keep, name, name)) {
                         DECLARE_OOM();
                         abort();
                 }
         }
 
-        if (nc_file_exists(user_initrd_file)) {
-                kern->source.user_initrd_file = strdup(user_initrd_file);
-                if (!kern->source.user_initrd_file) {
-                        DECLARE_OOM();
-                        abort();
-                }
+        dir = string_printf("%s" CBM_BOOT_LEDGER_DIR, self->sysconfig->prefix);
+        if (!cbm_boot_ledger_compact(dir, keep)) {
+                LOG_WARNING("Failed to compact the boot ledger in %s", dir);
         }
+}
 
-        /* Target initrd is just basename'd initrd file, simpler to just
-         * reprintf it than copy & basename it */
-        if (kern->source.initrd_file || kern->source.initrd_file) {
-                kern->target.initrd_path =
-                    string_printf("initrd-%s.%s.%s-%d", KERNEL_NAMESPACE, type, version, release);
+/**
+ * Determine if the kernel boots, and when it last did
+ *
+ * @param booted Boot records of the ledger, NULL if it couldn't be read
+ */
+static void kernel_resolve_boots(Kernel *kern, NcHashmap *booted)
+{
+        autofree(char) *name = NULL;
+        const CbmBootRecord *record = NULL;
+
+        if (!booted) {
+                return;
         }
+        name = boot_manager_kernel_ledger_name(kern);
+        record = nc_hashmap_get(booted, name);
+        kern->meta.boots = record != NULL;
+        kern->meta.last_boot = record ? record->timestamp : 0;
+}
 
-        kern->meta.release = (int16_t)release;
+/**
+ * Directory listings consulted while inspecting kernels, gathered once per
+ * scan so that each artifact is resolved by name rather than by stat()
+ */
+typedef struct KernelDirIndex {
+        NcHashmap *kernel_dir; /**<Entries of the kernel directory */
+        NcHashmap *conf_dir;   /**<Entries of the kernel config directory */
+} KernelDirIndex;
+
+static void kernel_dir_index_init(BootManager *self, KernelDirIndex *index)
+{
+        /* Any directory we fail to read simply falls back to stat() */
+        index->kernel_dir = cbm_get_dir_entries(self->kernel_dir);
+        index->conf_dir = cbm_get_dir_entries(KERNEL_CONF_DIRECTORY);
+}
+
+static void kernel_dir_index_clear(KernelDirIndex *index)
+{
+        nc_hashmap_free(index->kernel_dir);
+        nc_hashmap_free(index->conf_dir);
+        memset(index, 0, sizeof(struct KernelDirIndex));
+}
+
+/**
+ * Build the path for @name within @dir, returning it only if it exists
+ *
+ * @param entries Listing of @dir, or NULL to ask the filesystem directly
+ * @return a string owned by @kernel, or NULL
+ */
+static char *kernel_find_artifact(Kernel *kernel, NcHashmap *entries, const char *dir,
+                                  const char *name)
+{
+        autofree(char) *path = NULL;
+
+        if (entries) {
+                return nc_hashmap_contains(entries, name)
+                           ? kernel_printf(kernel, "%s/%s", dir, name)
+                           : NULL;
+        }
+        path = string_printf("%s/%s", dir, name);
+        if (!cbm_file_exists(path)) {
+                return NULL;
+        }
+        return kernel_printf(kernel, "%s", path);
+}
+
+void boot_manager_kernel_initrd_paths(const Kernel *kernel, char **initrd, char **user_initrd)
+{
+        const char *cmdline_file = kernel->source.cmdline_file;
+        const char *slash = strrchr(cmdline_file, '/');
+        char name[PATH_MAX] = { 0 };
+
+        snprintf(name,
+                 sizeof(name),
+                 KERNEL_INITRD_NAME,
+                 kernel->meta.ktype,
+                 kernel->meta.version,
+                 kernel->meta.release);
+        /* Beside the kernel, like the cmdline file */
+        *initrd = slash ? string_printf("%.*s/%s", (int)(slash - cmdline_file), cmdline_file, name)
+                        : string_printf("%s", name);
+        *user_initrd = string_printf("%s/%s", KERNEL_CONF_DIRECTORY, name);
+        if (!*initrd || !*user_initrd) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+static Kernel *boot_manager_inspect_kernel_indexed(BootManager *self, CbmArena *arena,
+                                                   char *path, const KernelDirIndex *index)
+{
+        static const KernelDirIndex no_index = { 0 };
+        Kernel *kern = NULL;
+        autofree(char) *parent = NULL;
+        autofree(char) *cmdline = NULL;
+        char name[PATH_MAX] = { 0 };
+        const char *cmdline_name = NULL;
+        const char *global_cmdline = NULL;
+        const char *type = NULL;
+        const char *version = NULL;
+        int release = 0;
+
+        if (!self || !path) {
+                return NULL;
+        }
+        if (!index) {
+                index = &no_index;
+        }
+
+        kern = boot_manager_alloc_kernel(self, arena, path);
+        if (!kern) {
+                return NULL;
+        }
+        type = kern->meta.ktype;
+        version = kern->meta.version;
+        release = kern->meta.release;
+
+        /* cmdline file is always a direct sibling of the kernel */
+        cmdline_name = strrchr(kern->source.cmdline_file, '/');
+        parent = strndup(kern->source.cmdline_file,
+                         (size_t)(cmdline_name - kern->source.cmdline_file));
+        if (!parent) {
+                DECLARE_OOM();
+                abort();
+        }
+        ++cmdline_name;
+
+        /* TODO: We may actually be uninstalling a partially flopped kernel,
+         * so validity of existing kernels may be questionable
+         * Thus, flag it, and return kernel */
+        if (index->kernel_dir ? !nc_hashmap_contains(index->kernel_dir, cmdline_name)
+                              : !cbm_file_exists(kern->source.cmdline_file)) {
+                LOG_ERROR("Valid kernel found with no cmdline: %s (expected %s)",
+                          path,
+                          kern->source.cmdline_file);
+                free_kernel(kern);
+                return NULL;
+        }
+
+        /* Modules, headers, config and System.map wait for their accessors */
+
+        /* i.e. initrd-org.clearlinux.lts.4.9.1-1 in kernel dir or /etc/kernel */
+        snprintf(name, sizeof(name), KERNEL_INITRD_NAME, type, version, release);
+        kern->source.initrd_file = kernel_find_artifact(kern, index->kernel_dir, parent, name);
+        kern->source.user_initrd_file =
+            kernel_find_artifact(kern, index->conf_dir, KERNEL_CONF_DIRECTORY, name);
 
         /* cmdline */
-        kern->meta.cmdline = cbm_parse_cmdline_file(cmdline);
-        if (!kern->meta.cmdline) {
-                LOG_ERROR("Unable to load cmdline %s: %s", cmdline, strerror(errno));
+        cmdline = cbm_parse_cmdline_file(kern->source.cmdline_file);
+        if (!cmdline) {
+                LOG_ERROR("Unable to load cmdline %s: %s",
+                          kern->source.cmdline_file,
+                          strerror(errno));
                 free_kernel(kern);
                 return NULL;
         }
 
         /* Merge global cmdline if we have one */
-        if (self->cmdline) {
-                char *cm = string_printf("%s %s", kern->meta.cmdline, self->cmdline);
-                free(kern->meta.cmdline);
-                kern->meta.cmdline = cm;
+        global_cmdline = boot_manager_get_cmdline(self);
+        if (global_cmdline) {
+                kern->meta.cmdline = kernel_printf(kern, "%s %s", cmdline, global_cmdline);
+        } else {
+                kern->meta.cmdline = kernel_printf(kern, "%s", cmdline);
         }
 
-        kern->source.cmdline_file = strdup(cmdline);
+        boot_manager_complete_kernel(self, kern);
+        cbm_stats_inc(CBM_STAT_KERNELS_INSPECTED);
+        return kern;
+}
 
-        /** Determine if the kernel boots */
-        kern->source.kboot_file = boot_manager_get_kboot_file(self, kern);
-        if (kern->source.kboot_file && nc_file_exists(kern->source.kboot_file)) {
-                kern->meta.boots = true;
+/**
+ * Read the boot ledger once, rather than checking for each kernel's boots
+ *
+ * @return the boot records, or NULL if the ledger can't be read
+ */
+static NcHashmap *kernel_list_booted(BootManager *self)
+{
+        autofree(char) *dir = NULL;
+
+        dir = string_printf("%s" CBM_BOOT_LEDGER_DIR, self->sysconfig->prefix);
+        return cbm_boot_ledger_load(dir);
+}
+
+Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
+{
+        Kernel *kern = boot_manager_inspect_kernel_indexed(self, NULL, path, NULL);
+        NcHashmap *booted = NULL;
+
+        if (kern) {
+                booted = kernel_list_booted(self);
+                kernel_resolve_boots(kern, booted);
+                nc_hashmap_free(booted);
         }
         return kern;
 }
 
+/**
+ * Look up the modules directory of @kernel, under the current or the older
+ * namespace
+ *
+ * @return a newly allocated path, or NULL if there is none
+ */
+static char *kernel_lookup_module_dir(const BootManager *self, const Kernel *kernel)
+{
+        autofree(char) *modules_dir = NULL;
+        char *path = NULL;
+
+        /* Check local modules */
+        modules_dir = string_printf("%s/%s", self->sysconfig->prefix, KERNEL_MODULES_DIRECTORY);
+        path = string_printf("%s/%s-%d.%s",
+                             modules_dir,
+                             kernel->meta.version,
+                             kernel->meta.release,
+                             kernel->meta.ktype);
+        if (cbm_file_exists(path)) {
+                return path;
+        }
+        free(path);
+
+        /* Fallback to an older namespace */
+        path = string_printf("%s/%s-%d", modules_dir, kernel->meta.version, kernel->meta.release);
+        if (cbm_file_exists(path)) {
+                return path;
+        }
+        LOG_WARNING("Found kernel with no modules: %s %s", kernel->source.path, path);
+        free(path);
+        return NULL;
+}
+
+/**
+ * Look up the headers directory of @kernel, standardised path on all distros
+ */
+static char *kernel_lookup_headers_dir(const BootManager *self, const Kernel *kernel)
+{
+        char *path = string_printf("%s/usr/src/linux-headers-%s-%d.%s",
+                                   self->sysconfig->prefix,
+                                   kernel->meta.version,
+                                   kernel->meta.release,
+                                   kernel->meta.ktype);
+
+        if (!cbm_file_exists(path)) {
+                free(path);
+                return NULL;
+        }
+        return path;
+}
+
+/**
+ * Look up the file called @prefix-$version-$release.$type next to @kernel
+ */
+static char *kernel_lookup_sibling(const Kernel *kernel, const char *prefix)
+{
+        autofree(char) *parent = NULL;
+        char *path = NULL;
+
+        parent = cbm_get_file_parent(kernel->source.path);
+        path = string_printf("%s/%s-%s-%d.%s",
+                             parent,
+                             prefix,
+                             kernel->meta.version,
+                             kernel->meta.release,
+                             kernel->meta.ktype);
+        if (!cbm_file_exists(path)) {
+                free(path);
+                return NULL;
+        }
+        return path;
+}
+
+/**
+ * /var/lib/kernel/k_booted_4.4.0-120.lts - new
+ */
+static char *kernel_kboot_path(const BootManager *self, const Kernel *kernel)
+{
+        return string_printf("%s/var/lib/kernel/k_booted_%s-%d.%s",
+                             self->sysconfig->prefix,
+                             kernel->meta.version,
+                             kernel->meta.release,
+                             kernel->meta.ktype);
+}
+
+/**
+ * Fields of Kernel.extra, as flagged in its resolved mask
+ */
+enum {
+        KERNEL_EXTRA_MODULE_DIR = 1 << 0,
+        KERNEL_EXTRA_HEADERS_DIR = 1 << 1,
+        KERNEL_EXTRA_KCONFIG_FILE = 1 << 2,
+        KERNEL_EXTRA_SYSMAP_FILE = 1 << 3,
+        KERNEL_EXTRA_KBOOT_FILE = 1 << 4,
+};
+
+/**
+ * Cache the looked up @value of @field within @kernel, unless that's been
+ * done already
+ *
+ * @param value Newly allocated path, or NULL, which is consumed
+ */
+static const char *kernel_extra_store(Kernel *kernel, unsigned int flag, char **field, char *value)
+{
+        if (!(kernel->extra.resolved & flag)) {
+                *field = value ? kernel_printf(kernel, "%s", value) : NULL;
+                kernel->extra.resolved |= flag;
+        }
+        free(value);
+        return *field;
+}
+
+const char *boot_manager_kernel_get_module_dir(BootManager *self, Kernel *kernel)
+{
+        assert(self != NULL);
+
+        if (kernel->extra.resolved & KERNEL_EXTRA_MODULE_DIR) {
+                return kernel->extra.module_dir;
+        }
+        return kernel_extra_store(kernel,
+                                  KERNEL_EXTRA_MODULE_DIR,
+                                  &kernel->extra.module_dir,
+                                  kernel_lookup_module_dir(self, kernel));
+}
+
+const char *boot_manager_kernel_get_headers_dir(BootManager *self, Kernel *kernel)
+{
+        assert(self != NULL);
+
+        if (kernel->extra.resolved & KERNEL_EXTRA_HEADERS_DIR) {
+                return kernel->extra.headers_dir;
+        }
+        return kernel_extra_store(kernel,
+                                  KERNEL_EXTRA_HEADERS_DIR,
+                                  &kernel->extra.headers_dir,
+                                  kernel_lookup_headers_dir(self, kernel));
+}
+
+const char *boot_manager_kernel_get_kconfig_file(Kernel *kernel)
+{
+        if (kernel->extra.resolved & KERNEL_EXTRA_KCONFIG_FILE) {
+                return kernel->extra.kconfig_file;
+        }
+        return kernel_extra_store(kernel,
+                                  KERNEL_EXTRA_KCONFIG_FILE,
+                                  &kernel->extra.kconfig_file,
+                                  kernel_lookup_sibling(kernel, "config"));
+}
+
+const char *boot_manager_kernel_get_initrd_source(const Kernel *kernel)
+{
+        if (kernel->source.packed_initrd) {
+                return kernel->source.packed_initrd;
+        }
+        return kernel->source.user_initrd_file ? kernel->source.user_initrd_file
+                                               : kernel->source.initrd_file;
+}
+
+const char *boot_manager_kernel_get_sysmap_file(Kernel *kernel)
+{
+        if (kernel->extra.resolved & KERNEL_EXTRA_SYSMAP_FILE) {
+                return kernel->extra.sysmap_file;
+        }
+        return kernel_extra_store(kernel,
+                                  KERNEL_EXTRA_SYSMAP_FILE,
+                                  &kernel->extra.sysmap_file,
+                                  kernel_lookup_sibling(kernel, "System.map"));
+}
+
+const char *boot_manager_kernel_get_kboot_file(BootManager *self, Kernel *kernel)
+{
+        assert(self != NULL);
+
+        if (kernel->extra.resolved & KERNEL_EXTRA_KBOOT_FILE) {
+                return kernel->extra.kboot_file;
+        }
+        return kernel_extra_store(kernel,
+                                  KERNEL_EXTRA_KBOOT_FILE,
+                                  &kernel->extra.kboot_file,
+                                  kernel_kboot_path(self, kernel));
+}
+
+/**
+ * A candidate of the kernel directory, in the order it was listed
+ */
+typedef struct KernelScanEntry {
+        char *path;     /**<Path of the candidate */
+        struct stat st; /**<Its identity, for the inventory cache */
+        Kernel *kernel; /**<The kernel it is, NULL if it isn't one */
+        bool inspected; /**<Inspected by this scan, rather than cached */
+} KernelScanEntry;
+
+/**
+ * A contiguous run of the candidates the cache didn't know, inspected by
+ * a single worker into an arena of its own
+ */
+typedef struct KernelScanChunk {
+        BootManager *self;
+        const KernelDirIndex *index;
+        NcArray *misses; /**<Every candidate the cache didn't know */
+        uint16_t start;  /**<First of the chunk within @misses */
+        uint16_t len;
+        CbmArena *arena;
+} KernelScanChunk;
+
+static void kernel_scan_chunk(void *item, __cbm_unused__ void *userdata)
+{
+        KernelScanChunk *chunk = item;
+        CBM_TRACE_SCOPE("inspect_kernels");
+
+        for (uint16_t i = 0; i < chunk->len; i++) {
+                KernelScanEntry *entry = nc_array_get(chunk->misses, chunk->start + i);
+
+                entry->kernel = boot_manager_inspect_kernel_indexed(chunk->self,
+                                                                    chunk->arena,
+                                                                    entry->path,
+                                                                    chunk->index);
+        }
+}
+
+/**
+ * Inspect every candidate in @misses, partitioned across up to @jobs
+ * workers. The arenas of the workers are added to @arenas.
+ */
+static void kernel_scan_inspect(BootManager *self, const KernelDirIndex *index, NcArray *misses,
+                                CbmArena *arena, unsigned int jobs, NcArray *arenas)
+{
+        NcArray *chunks = NULL;
+        uint16_t n_chunks = 0;
+        uint16_t offset = 0;
+
+        n_chunks = jobs < misses->len ? (uint16_t)jobs : misses->len;
+        if (n_chunks < 2) {
+                KernelScanChunk chunk = {.self = self,
+                                         .index = index,
+                                         .misses = misses,
+                                         .len = misses->len,
+                                         .arena = arena };
+                kernel_scan_chunk(&chunk, NULL);
+                return;
+        }
+
+        /* Inspecting merges the global cmdline, so have it parsed up front */
+        (void)boot_manager_get_cmdline(self);
+
+        chunks = nc_array_new();
+        if (!chunks) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (uint16_t i = 0; i < n_chunks; i++) {
+                KernelScanChunk *chunk = calloc(1, sizeof(struct KernelScanChunk));
+                uint16_t len = (uint16_t)((misses->len - offset) / (n_chunks - i));
+
+                if (!chunk || !nc_array_add(chunks, chunk)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                *chunk = (KernelScanChunk){.self = self,
+                                           .index = index,
+                                           .misses = misses,
+                                           .start = offset,
+                                           .len = len,
+                                           .arena = cbm_arena_new() };
+                if (!nc_array_add(arenas, chunk->arena)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                offset = (uint16_t)(offset + len);
+        }
+        cbm_pool_run(chunks, n_chunks, kernel_scan_chunk, NULL);
+        nc_array_free(&chunks, free);
+}
+
 KernelArray *boot_manager_get_kernels(BootManager *self)
 {
         KernelArray *ret = NULL;
         DIR *dir = NULL;
         struct dirent *ent = NULL;
-        struct stat st = { 0 };
+        CbmKernelCache *cache = NULL;
+        KernelDirIndex index = { 0 };
+        CbmArena *arena = NULL;
+        NcHashmap *booted = NULL;
+        NcArray *entries = NULL;
+        NcArray *misses = NULL;
+        NcArray *arenas = NULL;
+        CBM_TRACE_SCOPE("get_kernels");
         if (!self || !self->kernel_dir) {
                 return NULL;
         }
@@ -249,130 +678,418 @@ KernelArray *boot_manager_get_kernels(BootManager *self)
                 return NULL;
         }
 
+        entries = nc_array_new();
+        misses = nc_array_new();
+        arenas = nc_array_new();
+        if (!entries || !misses || !arenas) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* Every kernel of the scan lives in here, and dies with the array */
+        arena = cbm_arena_new();
+        if (!nc_array_add(arenas, arena)) {
+                DECLARE_OOM();
+                abort();
+        }
+        booted = kernel_list_booted(self);
+
+        cache = cbm_kernel_cache_open(self);
+
         while ((ent = readdir(dir)) != NULL) {
-                autofree(char) *path = NULL;
-                Kernel *kern = NULL;
+                KernelScanEntry *entry = NULL;
+                struct stat st = { 0 };
+                char *path = NULL;
 
                 path = string_printf("%s/%s", self->kernel_dir, ent->d_name);
 
-                /* Some kind of broken link */
-                if (lstat(path, &st) != 0) {
+                /* Some kind of broken link, anything irregular, or empty */
+                if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+                        free(path);
                         continue;
                 }
 
-                /* Regular only */
-                if (!S_ISREG(st.st_mode)) {
-                        continue;
+                entry = calloc(1, sizeof(struct KernelScanEntry));
+                if (!entry || !nc_array_add(entries, entry)) {
+                        DECLARE_OOM();
+                        abort();
                 }
-
-                /* empty files are skipped too */
-                if (st.st_size == 0) {
-                        continue;
+                entry->path = path;
+                entry->st = st;
+
+                /* Reuse the last inspection if the blob is unchanged */
+                entry->kernel = cbm_kernel_cache_lookup(cache, arena, path, &st);
+                if (!entry->kernel) {
+                        entry->inspected = true;
+                        if (!nc_array_add(misses, entry)) {
+                                DECLARE_OOM();
+                                abort();
+                        }
                 }
+        }
+        closedir(dir);
+
+        /* Only pay for the directory scans on a cache miss */
+        if (misses->len > 0) {
+                kernel_dir_index_init(self, &index);
+                kernel_scan_inspect(self, &index, misses, arena, self->jobs, arenas);
+                kernel_dir_index_clear(&index);
+        }
+
+        /* Whichever worker inspected them, kernels are listed in scan order */
+        for (uint16_t i = 0; i < entries->len; i++) {
+                KernelScanEntry *entry = nc_array_get(entries, i);
+                Kernel *kern = entry->kernel;
 
-                /* Now see if its a kernel */
-                kern = boot_manager_inspect_kernel(self, path);
                 if (!kern) {
                         continue;
                 }
+                if (entry->inspected) {
+                        cbm_kernel_cache_insert(cache, kern, &entry->st);
+                }
+                kernel_resolve_boots(kern, booted);
                 if (!nc_array_add(ret, kern)) {
                         DECLARE_OOM();
                         abort();
                 }
         }
-        closedir(dir);
+        cbm_kernel_cache_close(cache);
+        if (booted) {
+                nc_hashmap_free(booted);
+        }
+
+        /* Only reachable through their kernels */
+        for (uint16_t i = 0; i < arenas->len; i++) {
+                CbmArena *a = nc_array_get(arenas, i);
+                bool used = false;
+
+                for (uint16_t j = 0; j < ret->len && !used; j++) {
+                        used = ((Kernel *)nc_array_get(ret, j))->arena == a;
+                }
+                if (!used) {
+                        cbm_arena_free(a);
+                }
+        }
+        for (uint16_t i = 0; i < entries->len; i++) {
+                free(((KernelScanEntry *)nc_array_get(entries, i))->path);
+        }
+        nc_array_free(&entries, free);
+        nc_array_free(&misses, NULL);
+        nc_array_free(&arenas, NULL);
         return ret;
 }
 
 void free_kernel(Kernel *t)
 {
-        if (!t) {
+        if (!t || t->arena) {
+                return;
+        }
+        free(t->meta.bpath);
+        free(t->meta.version);
+        free(t->meta.cmdline);
+        free(t->meta.ktype);
+        free(t->source.path);
+        free(t->source.cmdline_file);
+        free(t->extra.module_dir);
+        free(t->extra.headers_dir);
+        free(t->extra.kconfig_file);
+        free(t->extra.sysmap_file);
+        free(t->extra.kboot_file);
+        free(t->source.initrd_file);
+        free(t->source.user_initrd_file);
+        free(t->source.packed_initrd);
+        free(t->target.initrd_path);
+        free(t->target.path);
+        free(t);
+}
+
+void kernel_array_free(void *v)
+{
+        KernelArray *a = v;
+        NcArray *arenas = NULL;
+
+        if (!a) {
+                return;
+        }
+        arenas = nc_array_new();
+        if (!arenas) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* A scan uses an arena per worker at most, so this is short. The
+         * kernels live in the arenas, so they're only released once all have
+         * been seen. */
+        for (uint16_t i = 0; i < a->len; i++) {
+                Kernel *k = nc_array_get(a, i);
+                bool seen = false;
+
+                if (!k->arena) {
+                        free_kernel(k);
+                        continue;
+                }
+                for (uint16_t j = 0; j < arenas->len && !seen; j++) {
+                        seen = nc_array_get(arenas, j) == k->arena;
+                }
+                if (!seen && !nc_array_add(arenas, k->arena)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        nc_array_free(&arenas, (array_free_func)cbm_arena_free);
+        nc_array_free(&a, NULL);
+}
+
+Kernel *boot_manager_get_default_for_type(BootManager *self, KernelArray *kernels, const char *type)
+{
+        autofree(char) *default_file = NULL;
+        char linkbuf[PATH_MAX] = { 0 };
+
+        if (!self || !kernels || !type) {
+                return NULL;
+        }
+
+        default_file = string_printf("%s/default-%s", self->kernel_dir, type);
+
+        if (readlink(default_file, linkbuf, sizeof(linkbuf)) < 0) {
+                return NULL;
+        }
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                Kernel *k = nc_array_get(kernels, i);
+                if (streq(k->meta.bpath, linkbuf)) {
+                        return k;
+                }
+        }
+
+        return NULL;
+}
+
+static inline void kern_dup_free(void *v)
+{
+        NcArray *array = v;
+        nc_array_free(&array, NULL);
+}
+
+NcHashmap *boot_manager_map_kernels(BootManager *self, KernelArray *kernels)
+{
+        if (!self || !kernels) {
+                return NULL;
+        }
+
+        NcHashmap *map = NULL;
+
+        map = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, kern_dup_free);
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                KernelArray *r = NULL;
+                Kernel *cur = nc_array_get(kernels, i);
+
+                r = nc_hashmap_get(map, cur->meta.ktype);
+                if (!r) {
+                        r = nc_array_new();
+                        if (!r) {
+                                goto oom;
+                        }
+                        if (!nc_hashmap_put(map, strdup(cur->meta.ktype), r)) {
+                                kern_dup_free(r);
+                                goto oom;
+                        }
+                }
+                if (!nc_array_add(r, cur)) {
+                        goto oom;
+                }
+        }
+
+        return map;
+oom:
+        DECLARE_OOM();
+        nc_hashmap_free(map);
+        return NULL;
+}
+
+/**
+ * Sort by release number, putting highest first
+ */
+static int kernel_compare_reverse(const void *a, const void *b)
+{
+        const Kernel *ka = *(const Kernel **)a;
+        const Kernel *kb = *(const Kernel **)b;
+
+        if (ka->meta.release > kb->meta.release) {
+                return -1;
+        }
+        return 1;
+}
+
+void boot_manager_sort_kernels(KernelArray *kernels)
+{
+        nc_array_qsort(kernels, kernel_compare_reverse);
+}
+
+/**
+ * Add @value under @key unless there already is an entry, keeping the first,
+ * i.e. the highest release, as a linear scan of the sorted set would
+ */
+static void kernel_index_put(NcHashmap *map, const char *key, void *value)
+{
+        if (nc_hashmap_contains(map, key)) {
+                return;
+        }
+        if (!nc_hashmap_put(map, (void *)key, value)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+static NcHashmap *kernel_index_map(void)
+{
+        /* Keys live in the index arena or in the kernels themselves */
+        NcHashmap *ret = nc_hashmap_new_full(nc_string_hash, nc_string_compare, NULL, NULL);
+
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+/**
+ * Resolve the default- link of @type within the index
+ */
+static void kernel_index_resolve_default(BootManager *self, KernelIndex *index,
+                                         KernelTypeIndex *type)
+{
+        char default_file[PATH_MAX] = { 0 };
+        char linkbuf[PATH_MAX] = { 0 };
+        Kernel *k = NULL;
+
+        snprintf(default_file, sizeof(default_file), "%s/default-%s", self->kernel_dir, type->ktype);
+        if (readlink(default_file, linkbuf, sizeof(linkbuf) - 1) < 0) {
                 return;
         }
-        free(t->meta.bpath);
-        free(t->meta.version);
-        free(t->meta.cmdline);
-        free(t->meta.ktype);
-        free(t->source.path);
-        free(t->source.module_dir);
-        free(t->source.cmdline_file);
-        free(t->source.headers_dir);
-        free(t->source.kconfig_file);
-        free(t->source.sysmap_file);
-        free(t->source.kboot_file);
-        free(t->source.initrd_file);
-        free(t->source.user_initrd_file);
-        free(t->target.initrd_path);
-        free(t->target.path);
-        free(t);
+        k = nc_hashmap_get(index->by_name, linkbuf);
+        if (k && streq(k->meta.ktype, type->ktype)) {
+                type->default_kernel = k;
+        }
 }
 
-Kernel *boot_manager_get_default_for_type(BootManager *self, KernelArray *kernels, const char *type)
+KernelIndex *boot_manager_index_kernels(BootManager *self, KernelArray *kernels)
 {
-        autofree(char) *default_file = NULL;
-        char linkbuf[PATH_MAX] = { 0 };
+        KernelIndex *index = NULL;
 
-        if (!self || !kernels || !type) {
+        if (!self || !kernels) {
                 return NULL;
         }
 
-        default_file = string_printf("%s/default-%s", self->kernel_dir, type);
-
-        if (readlink(default_file, linkbuf, sizeof(linkbuf)) < 0) {
-                return NULL;
+        index = calloc(1, sizeof(struct KernelIndex));
+        if (!index) {
+                DECLARE_OOM();
+                abort();
+        }
+        index->kernels = kernels;
+        index->arena = cbm_arena_new();
+        index->types = nc_array_new();
+        index->by_type = kernel_index_map();
+        index->by_name = kernel_index_map();
+        index->by_release = kernel_index_map();
+        if (!index->types) {
+                DECLARE_OOM();
+                abort();
         }
 
+        /* Sorted once, so every type inherits the order */
+        boot_manager_sort_kernels(kernels);
+
         for (uint16_t i = 0; i < kernels->len; i++) {
                 Kernel *k = nc_array_get(kernels, i);
-                if (streq(k->meta.bpath, linkbuf)) {
-                        return k;
+                KernelTypeIndex *type = nc_hashmap_get(index->by_type, k->meta.ktype);
+
+                if (!type) {
+                        type = cbm_arena_alloc(index->arena, sizeof(struct KernelTypeIndex));
+                        type->ktype = k->meta.ktype;
+                        type->kernels = nc_array_new();
+                        if (!type->kernels || !nc_array_add(index->types, type)) {
+                                DECLARE_OOM();
+                                abort();
+                        }
+                        kernel_index_put(index->by_type, type->ktype, type);
                 }
+                if (!nc_array_add(type->kernels, k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+
+                /* Highest booting release, the last of any equals */
+                if (k->meta.boots && (!type->last_booted ||
+                                      k->meta.release >= type->last_booted->meta.release)) {
+                        type->last_booted = k;
+                }
+
+                kernel_index_put(index->by_name, k->meta.bpath, k);
+                kernel_index_put(index->by_release,
+                                 cbm_arena_printf(index->arena,
+                                                  "%s-%d",
+                                                  k->meta.ktype,
+                                                  k->meta.release),
+                                 k);
         }
 
-        return NULL;
+        for (uint16_t i = 0; i < index->types->len; i++) {
+                kernel_index_resolve_default(self, index, nc_array_get(index->types, i));
+        }
+
+        return index;
 }
 
-static inline void kern_dup_free(void *v)
+void kernel_index_free(KernelIndex *index)
 {
-        NcArray *array = v;
-        nc_array_free(&array, NULL);
+        if (!index) {
+                return;
+        }
+        for (uint16_t i = 0; i < index->types->len; i++) {
+                KernelTypeIndex *type = nc_array_get(index->types, i);
+
+                nc_array_free(&type->kernels, NULL);
+        }
+        nc_array_free(&index->types, NULL);
+        nc_hashmap_free(index->by_type);
+        nc_hashmap_free(index->by_name);
+        nc_hashmap_free(index->by_release);
+        cbm_arena_free(index->arena);
+        free(index);
 }
 
-NcHashmap *boot_manager_map_kernels(BootManager *self, KernelArray *kernels)
+KernelTypeIndex *kernel_index_get_type(KernelIndex *index, const char *ktype)
 {
-        if (!self || !kernels) {
+        if (!index || !ktype) {
                 return NULL;
         }
+        return nc_hashmap_get(index->by_type, ktype);
+}
 
-        NcHashmap *map = NULL;
-
-        map = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, kern_dup_free);
-
-        for (uint16_t i = 0; i < kernels->len; i++) {
-                KernelArray *r = NULL;
-                Kernel *cur = nc_array_get(kernels, i);
+Kernel *boot_manager_index_get_running_kernel(BootManager *self, KernelIndex *index)
+{
+        const SystemKernel *k = NULL;
+        char key[PATH_MAX] = { 0 };
+        Kernel *ret = NULL;
 
-                r = nc_hashmap_get(map, cur->meta.ktype);
-                if (!r) {
-                        r = nc_array_new();
-                        if (!r) {
-                                goto oom;
-                        }
-                        if (!nc_hashmap_put(map, strdup(cur->meta.ktype), r)) {
-                                kern_dup_free(r);
-                                goto oom;
-                        }
-                }
-                if (!nc_array_add(r, cur)) {
-                        goto oom;
-                }
+        if (!self || !index) {
+                return NULL;
+        }
+        k = boot_manager_get_system_kernel(self);
+        if (!k) {
+                return NULL;
         }
 
-        return map;
-oom:
-        DECLARE_OOM();
-        nc_hashmap_free(map);
-        return NULL;
+        /* The basename names exactly the type, version and release */
+        snprintf(key, sizeof(key), KERNEL_NAMESPACE ".%s.%s-%d", k->ktype, k->version, k->release);
+        ret = nc_hashmap_get(index->by_name, key);
+        if (ret) {
+                return ret;
+        }
+        snprintf(key, sizeof(key), "%s-%d", k->ktype, k->release);
+        return nc_hashmap_get(index->by_release, key);
 }
 
 bool cbm_parse_system_kernel(const char *inp, SystemKernel *kernel)
@@ -538,6 +1255,7 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         autofree(char) *base_path = NULL;
         autofree(char) *initrd_target = NULL;
         autofree(char) *kfile_target = NULL;
+        autofree(char) *initrd_name = NULL;
         bool ret = true;
         bool migrated = false;
 
@@ -547,12 +1265,16 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         /* Boot path */
         base_path = boot_manager_get_boot_dir((BootManager *)manager);
 
+        /* Legacy copies were never shared, so never named as blobs */
+        if (kernel->target.initrd_path) {
+                initrd_name = boot_manager_initrd_target_name(kernel);
+        }
         kfile_target = string_printf("%s/%s", base_path, kernel->target.legacy_path);
-        initrd_target = string_printf("%s/%s", base_path, kernel->target.initrd_path);
+        initrd_target = string_printf("%s/%s", base_path, initrd_name);
 
         /* Remove old kernel */
-        if (nc_file_exists(kfile_target)) {
-                if (unlink(kfile_target) < 0) {
+        if (cbm_file_exists(kfile_target)) {
+                if (cbm_unlink(kfile_target) < 0) {
                         LOG_ERROR("Failed to remove legacy-path UEFI kernel %s: %s",
                                   kfile_target,
                                   strerror(errno));
@@ -563,8 +1285,8 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         }
 
         /* Remove old initrd */
-        if (nc_file_exists(initrd_target)) {
-                if (unlink(initrd_target) < 0) {
+        if (cbm_file_exists(initrd_target)) {
+                if (cbm_unlink(initrd_target) < 0) {
                         LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
                                   initrd_target,
                                   strerror(errno));
@@ -583,15 +1305,11 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         return ret;
 }
 
-/**
- * Internal function to install the kernel blob itself
- */
-bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel)
+bool boot_manager_get_kernel_targets(const BootManager *manager, const Kernel *kernel,
+                                     char **kernel_target, const char **initrd_source,
+                                     char **initrd_target)
 {
-        autofree(char) *kfile_target = NULL;
         autofree(char) *base_path = NULL;
-        autofree(char) *initrd_target = NULL;
-        const char *initrd_source = NULL;
         bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
                         BOOTLOADER_CAP_UEFI);
         const char *efi_boot_dir =
@@ -600,6 +1318,10 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
         assert(manager != NULL);
         assert(kernel != NULL);
 
+        *kernel_target = NULL;
+        *initrd_source = NULL;
+        *initrd_target = NULL;
+
         if (is_uefi && !efi_boot_dir) {
                 return false;
         }
@@ -610,36 +1332,90 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
 
         /* for UEFI, the kernel location is prefixed with efi_boot_dir which is
          * guaranteed to start with '/' since it's its absolute path on ESP. */
-        kfile_target = string_printf("%s%s/%s",
-                                     base_path,
-                                     (is_uefi ? efi_boot_dir : ""),
-                                     (is_uefi ? kernel->target.path : kernel->target.legacy_path));
+        *kernel_target = string_printf("%s%s/%s",
+                                       base_path,
+                                       (is_uefi ? efi_boot_dir : ""),
+                                       (is_uefi ? kernel->target.path : kernel->target.legacy_path));
+
+        /* Install user initrd if it exists, otherwise system initrd */
+        *initrd_source = boot_manager_kernel_get_initrd_source(kernel);
+        if (!*initrd_source) {
+                /* No initrd file for this kernel */
+                return true;
+        }
+
+        *initrd_target = string_printf("%s%s/%s",
+                                       base_path,
+                                       (is_uefi ? efi_boot_dir : ""),
+                                       kernel->target.initrd_path);
+        return true;
+}
+
+/**
+ * Internal function to install the kernel blob itself
+ */
+bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel)
+{
+        return boot_manager_install_kernel_files(manager, kernel, true, true);
+}
+
+bool boot_manager_install_kernel_files(const BootManager *manager, const Kernel *kernel,
+                                       bool install_kernel, bool install_initrd)
+{
+        autofree(char) *kfile_target = NULL;
+        autofree(char) *initrd_target = NULL;
+        const char *initrd_source = NULL;
+        int caps = manager->bootloader->get_capabilities(manager);
+        bool is_uefi = ((caps & BOOTLOADER_CAP_UEFI) == BOOTLOADER_CAP_UEFI);
+        char mirror_digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        char mirror_initrd_digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        /* Distinct fields per kernel, so safe from the install pool, but the
+         * kernels of a mirror are shared with every other ESP updated at once */
+        char *kernel_digest = manager->parent ? mirror_digest : ((Kernel *)kernel)->target.digest;
+        char *initrd_digest =
+            manager->parent ? mirror_initrd_digest : ((Kernel *)kernel)->target.initrd_digest;
+
+        assert(manager != NULL);
+        assert(kernel != NULL);
+
+        /* The bootloader assembles the blobs into an image of its own */
+        if (caps & BOOTLOADER_CAP_UKI) {
+                return true;
+        }
+
+        if (!boot_manager_get_kernel_targets(manager,
+                                             kernel,
+                                             &kfile_target,
+                                             &initrd_source,
+                                             &initrd_target)) {
+                return false;
+        }
 
         /* Now copy the kernel file to it's new location */
-        if (!cbm_files_match(kernel->source.path, kfile_target)) {
-                if (!copy_file_atomic(kernel->source.path, kfile_target, 00644)) {
+        if (install_kernel &&
+            !cbm_manifest_files_match(manager->manifest, kernel->source.path, kfile_target)) {
+                if (!cbm_manifest_install_file_measured(manager->manifest,
+                                                        kernel->source.path,
+                                                        kfile_target,
+                                                        00644,
+                                                        kernel_digest)) {
                         LOG_FATAL("Failed to install kernel %s: %s", kfile_target, strerror(errno));
                         return false;
                 }
         }
 
-        /* Install user initrd if it exists, otherwise system initrd */
-        if (kernel->source.user_initrd_file) {
-                initrd_source = kernel->source.user_initrd_file;
-        } else if (kernel->source.initrd_file) {
-                initrd_source = kernel->source.initrd_file;
-        } else {
-                /* No initrd file for this kernel */
+        /* No initrd file for this kernel */
+        if (!initrd_source) {
                 return true;
         }
 
-        initrd_target = string_printf("%s%s/%s",
-                                      base_path,
-                                      (is_uefi ? efi_boot_dir : ""),
-                                      kernel->target.initrd_path);
-
-        if (!cbm_files_match(initrd_source, initrd_target)) {
-                if (!copy_file_atomic(initrd_source, initrd_target, 00644)) {
+        if (install_initrd &&
+            !cbm_manifest_files_match(manager->manifest, initrd_source, initrd_target)) {
+                if (!cbm_manifest_install_file_measured(manager->manifest,
+                                                        initrd_source,
+                                                        initrd_target,
+                                                        00644,
+                                                        initrd_digest)) {
                         LOG_FATAL("Failed to install initrd %s: %s",
                                   initrd_target,
                                   strerror(errno));
@@ -659,6 +1435,94 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
         return true;
 }
 
+/**
+ * Remove everything beneath the root that a removed kernel leaves behind,
+ * its modules, headers and other files, and finally the kernel itself
+ */
+static bool kernel_remove_sources(const BootManager *manager, const Kernel *kernel)
+{
+        autofree(char) *module_dir = NULL;
+        autofree(char) *headers_dir = NULL;
+        autofree(char) *kconfig_file = NULL;
+        autofree(char) *sysmap_file = NULL;
+        autofree(char) *kboot_file = NULL;
+
+        /* Looked up afresh, as the scan never needed them */
+        module_dir = kernel_lookup_module_dir(manager, kernel);
+        headers_dir = kernel_lookup_headers_dir(manager, kernel);
+        kconfig_file = kernel_lookup_sibling(kernel, "config");
+        sysmap_file = kernel_lookup_sibling(kernel, "System.map");
+        kboot_file = kernel_kboot_path(manager, kernel);
+
+        /* Purge the kernel modules from disk */
+        if (module_dir) {
+                if (!nc_rm_rf(module_dir)) {
+                        LOG_ERROR("Failed to remove module dir (-rf) %s: %s",
+                                  module_dir,
+                                  strerror(errno));
+                } else {
+                        cbm_sync_path(module_dir);
+                }
+        }
+
+        /* Purge the kernel headers from disk */
+        if (headers_dir) {
+                if (!nc_rm_rf(headers_dir)) {
+                        LOG_ERROR("Failed to remove headers dir (-rf) %s: %s",
+                                  headers_dir,
+                                  strerror(errno));
+                } else {
+                        cbm_sync_path(headers_dir);
+                }
+        }
+
+        if (kernel->source.cmdline_file && cbm_file_exists(kernel->source.cmdline_file)) {
+                if (cbm_unlink(kernel->source.cmdline_file) < 0) {
+                        LOG_ERROR("Failed to remove cmdline file %s: %s",
+                                  kernel->source.cmdline_file,
+                                  strerror(errno));
+                }
+        }
+        if (kconfig_file) {
+                if (cbm_unlink(kconfig_file) < 0) {
+                        LOG_ERROR("Failed to remove kconfig file %s: %s",
+                                  kconfig_file,
+                                  strerror(errno));
+                }
+        }
+        if (sysmap_file) {
+                if (cbm_unlink(sysmap_file) < 0) {
+                        LOG_ERROR("Failed to remove System.map file %s: %s",
+                                  sysmap_file,
+                                  strerror(errno));
+                }
+        }
+        if (kboot_file && cbm_file_exists(kboot_file)) {
+                if (cbm_unlink(kboot_file) < 0) {
+                        LOG_ERROR("Failed to remove kboot file %s: %s",
+                                  kboot_file,
+                                  strerror(errno));
+                }
+        }
+
+        if (kernel->source.initrd_file && cbm_file_exists(kernel->source.initrd_file) &&
+            cbm_unlink(kernel->source.initrd_file) < 0) {
+                LOG_ERROR("Failed to remove initrd file %s: %s",
+                          kernel->source.initrd_file,
+                          strerror(errno));
+        }
+
+        /* Lastly, remove the source, unless an earlier update already did */
+        if (cbm_unlink(kernel->source.path) < 0 && errno != ENOENT) {
+                LOG_ERROR("Failed to remove kernel blob %s: %s",
+                          kernel->source.path,
+                          strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
 /**
  * Internal function to remove the kernel blob itself
  */
@@ -698,94 +1562,102 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
         }
 
         /* Remove the kernel from the ESP */
-        if (nc_file_exists(kfile_target) && unlink(kfile_target) < 0) {
+        if (cbm_file_exists(kfile_target) && cbm_unlink(kfile_target) < 0) {
                 LOG_ERROR("Failed to remove kernel %s: %s", kfile_target, strerror(errno));
         } else {
-                cbm_sync();
+                cbm_manifest_forget(manager->manifest, kfile_target);
+                cbm_sync_path(kfile_target);
         }
 
-        /* Purge the kernel modules from disk */
-        if (kernel->source.module_dir && nc_file_exists(kernel->source.module_dir)) {
-                if (!nc_rm_rf(kernel->source.module_dir)) {
-                        LOG_ERROR("Failed to remove module dir (-rf) %s: %s",
-                                  kernel->source.module_dir,
-                                  strerror(errno));
-                } else {
-                        cbm_sync();
-                }
+        if (initrd_target && cbm_file_exists(initrd_target) && cbm_unlink(initrd_target) < 0) {
+                LOG_ERROR("Failed to remove initrd blob %s: %s", initrd_target, strerror(errno));
+        } else if (initrd_target) {
+                cbm_manifest_forget(manager->manifest, initrd_target);
         }
 
-        /* Purge the kernel headers from disk */
-        if (kernel->source.headers_dir && nc_file_exists(kernel->source.headers_dir)) {
-                if (!nc_rm_rf(kernel->source.headers_dir)) {
-                        LOG_ERROR("Failed to remove headers dir (-rf) %s: %s",
-                                  kernel->source.module_dir,
-                                  strerror(errno));
-                } else {
-                        cbm_sync();
-                }
+        /* The root is left to the boot device's own update */
+        if (!manager->parent && !kernel_remove_sources(manager, kernel)) {
+                return false;
         }
 
-        if (kernel->source.cmdline_file && nc_file_exists(kernel->source.cmdline_file)) {
-                if (unlink(kernel->source.cmdline_file) < 0) {
-                        LOG_ERROR("Failed to remove cmdline file %s: %s",
-                                  kernel->source.cmdline_file,
-                                  strerror(errno));
-                }
-        }
-        if (kernel->source.kconfig_file && nc_file_exists(kernel->source.kconfig_file)) {
-                if (unlink(kernel->source.kconfig_file) < 0) {
-                        LOG_ERROR("Failed to remove kconfig file %s: %s",
-                                  kernel->source.kconfig_file,
-                                  strerror(errno));
-                }
+        /* Our portion is complete, remove any legacy uefi bits we might have
+         * from previous runs.
+         */
+        if (is_uefi && !boot_manager_remove_legacy_uefi_kernel(manager, kernel)) {
+                LOG_WARNING("Failed to remove legacy kernel on ESP: %s",
+                            kernel->target.legacy_path);
         }
-        if (kernel->source.sysmap_file && nc_file_exists(kernel->source.sysmap_file)) {
-                if (unlink(kernel->source.sysmap_file) < 0) {
-                        LOG_ERROR("Failed to remove System.map file %s: %s",
-                                  kernel->source.sysmap_file,
-                                  strerror(errno));
-                }
+
+        return true;
+}
+
+/**
+ * A single kernel of a batch removal
+ */
+typedef struct KernelRemoveJob {
+        const Kernel *kernel; /**<Kernel to remove */
+        bool removed;         /**<Set by the worker */
+} KernelRemoveJob;
+
+static void boot_manager_remove_job(void *item, void *userdata)
+{
+        KernelRemoveJob *job = item;
+
+        job->removed = boot_manager_remove_kernel_internal(userdata, job->kernel);
+        if (job->removed) {
+                cbm_stats_inc(CBM_STAT_KERNELS_REMOVED);
         }
-        if (kernel->source.kboot_file && nc_file_exists(kernel->source.kboot_file)) {
-                if (unlink(kernel->source.kboot_file) < 0) {
-                        LOG_ERROR("Failed to remove kboot file %s: %s",
-                                  kernel->source.kboot_file,
-                                  strerror(errno));
-                }
+}
+
+bool boot_manager_remove_kernels_internal(const BootManager *manager, NcArray *kernels,
+                                          unsigned int jobs)
+{
+        KernelRemoveJob *items = NULL;
+        NcArray *work = NULL;
+        bool ret = true;
+
+        assert(manager != NULL);
+        assert(kernels != NULL);
+
+        if (kernels->len == 0) {
+                return true;
         }
 
-        if (kernel->source.initrd_file) {
-                if (nc_file_exists(kernel->source.initrd_file) &&
-                    unlink(kernel->source.initrd_file) < 0) {
-                        LOG_ERROR("Failed to remove initrd file %s: %s",
-                                  kernel->source.initrd_file,
-                                  strerror(errno));
-                }
-                if (nc_file_exists(initrd_target) && unlink(initrd_target) < 0) {
-                        LOG_ERROR("Failed to remove initrd blob %s: %s",
-                                  initrd_target,
-                                  strerror(errno));
+        items = calloc(kernels->len, sizeof(KernelRemoveJob));
+        work = nc_array_new();
+        if (!items || !work) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                items[i].kernel = nc_array_get(kernels, i);
+                if (!nc_array_add(work, &items[i])) {
+                        DECLARE_OOM();
+                        abort();
                 }
         }
 
-        /* Lastly, remove the source */
-        if (unlink(kernel->source.path) < 0) {
-                LOG_ERROR("Failed to remove kernel blob %s: %s",
-                          kernel->source.path,
-                          strerror(errno));
-                return false;
+        /* Each kernel owns distinct files, and a sync phase defers their
+         * barriers to one flush, so the unlinks and module trees can go in
+         * parallel */
+        CBM_TRACE_SCOPE("remove_kernel_blobs");
+        cbm_sync_phase_begin();
+        cbm_pool_run(work, jobs, boot_manager_remove_job, (void *)manager);
+        if (!cbm_sync_phase_end()) {
+                LOG_ERROR("Failed to flush kernel removals to disk");
+                ret = false;
         }
 
-        /* Our portion is complete, remove any legacy uefi bits we might have
-         * from previous runs.
-         */
-        if (is_uefi && !boot_manager_remove_legacy_uefi_kernel(manager, kernel)) {
-                LOG_WARNING("Failed to remove legacy kernel on ESP: %s",
-                            kernel->target.legacy_path);
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                if (!items[i].removed) {
+                        LOG_ERROR("Failed to remove kernel: %s", items[i].kernel->source.path);
+                        ret = false;
+                }
         }
 
-        return true;
+        nc_array_free(&work, NULL);
+        free(items);
+        return ret;
 }
 
 /*
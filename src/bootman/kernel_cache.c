@@ -0,0 +1,451 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+#include "writer.h"
+
+#include "config.h"
+
+/**
+ * Location of the inventory, relative to the prefix
+ */
+#define CBM_KERNEL_CACHE_DIR "var/cache/clr-boot-manager"
+#define CBM_KERNEL_CACHE_FILE "kernels"
+
+/**
+ * Bump whenever the record layout changes
+ */
+#define CBM_KERNEL_CACHE_MAGIC "clr-boot-manager-kernel-cache 3"
+
+/**
+ * Number of tab separated fields within a record
+ */
+#define CBM_KERNEL_CACHE_FIELDS 6
+
+/**
+ * A single cached inspection result
+ */
+typedef struct CbmKernelCacheEntry {
+        CbmFileKey kernel_key;      /**<Identity of the kernel blob */
+        CbmFileKey cmdline_key;     /**<Identity of the kernel's cmdline file */
+        CbmFileKey initrd_key;      /**<Identity of its initrd, zeroed if it has none */
+        CbmFileKey user_initrd_key; /**<Identity of its user initrd, zeroed if none */
+        char *cmdline;              /**<Fully merged cmdline */
+        bool used;                  /**<Seen during this scan */
+} CbmKernelCacheEntry;
+
+struct CbmKernelCache {
+        BootManager *manager; /**<Owning BootManager */
+        char *path;           /**<Path to the on-disk inventory */
+        char *fingerprint;    /**<Global state every entry depends on */
+        NcHashmap *entries;   /**<Kernel path -> CbmKernelCacheEntry */
+        bool dirty;           /**<Needs writing back to disk */
+};
+
+static void cbm_kernel_cache_entry_free(void *v)
+{
+        CbmKernelCacheEntry *entry = v;
+
+        if (!entry) {
+                return;
+        }
+        free(entry->cmdline);
+        free(entry);
+}
+
+static void cbm_file_key_write(CbmWriter *writer, const CbmFileKey *key)
+{
+        cbm_writer_append_printf(writer, CBM_FILE_KEY_FORMAT, CBM_FILE_KEY_ARGS(key));
+}
+
+/**
+ * Every entry depends on the global cmdline (merged into each kernel) and on
+ * the contents of the user initrd directory, which lives outside of the
+ * kernel package. Should either change, we throw the whole inventory away.
+ *
+ * Initrds may come and go beside an unchanged kernel, so each entry also
+ * records which of them it saw. Modules, headers, config and System.map
+ * aren't recorded at all, they're only looked up when asked for.
+ */
+static char *cbm_kernel_cache_fingerprint(BootManager *self)
+{
+        CbmFileKey conf_key = { 0 };
+        autofree(char) *conf_dir = NULL;
+        const char *cmdline = boot_manager_get_cmdline(self);
+
+        conf_dir = string_printf("%s/%s", self->sysconfig->prefix, KERNEL_CONF_DIRECTORY);
+        (void)cbm_file_key_for_path(&conf_key, conf_dir);
+
+        return string_printf("%llu:%llu:%lld:%lld.%lld\t%s",
+                             conf_key.dev,
+                             conf_key.ino,
+                             conf_key.size,
+                             conf_key.mtime_sec,
+                             conf_key.mtime_nsec,
+                             cmdline ? cmdline : "");
+}
+
+/**
+ * Parse a single record from the inventory into the cache
+ */
+static bool cbm_kernel_cache_parse_line(CbmKernelCache *self, char *line)
+{
+        char *fields[CBM_KERNEL_CACHE_FIELDS] = { 0 };
+        CbmKernelCacheEntry *entry = NULL;
+        char *path = NULL;
+        size_t i;
+
+        /* The last field is the cmdline and may contain anything but a newline */
+        for (i = 0; i < CBM_KERNEL_CACHE_FIELDS - 1; i++) {
+                fields[i] = strsep(&line, "\t");
+                if (!line) {
+                        return false;
+                }
+        }
+        fields[i] = line;
+
+        entry = calloc(1, sizeof(struct CbmKernelCacheEntry));
+        if (!entry) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        if (!cbm_file_key_parse(&entry->kernel_key, fields[1]) ||
+            !cbm_file_key_parse(&entry->cmdline_key, fields[2]) ||
+            !cbm_file_key_parse(&entry->initrd_key, fields[3]) ||
+            !cbm_file_key_parse(&entry->user_initrd_key, fields[4])) {
+                free(entry);
+                return false;
+        }
+
+        entry->cmdline = strdup(fields[5]);
+        path = strdup(fields[0]);
+        if (!entry->cmdline || !path) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        if (!nc_hashmap_put(self->entries, path, entry)) {
+                DECLARE_OOM();
+                abort();
+        }
+        return true;
+}
+
+CbmKernelCache *cbm_kernel_cache_open(BootManager *manager)
+{
+        CbmKernelCache *self = NULL;
+        autofree(char) *text = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+
+        if (!manager || !manager->sysconfig) {
+                return NULL;
+        }
+
+        /* Never leave our state behind inside an image */
+        if (boot_manager_is_image_mode(manager)) {
+                return NULL;
+        }
+
+        self = calloc(1, sizeof(struct CbmKernelCache));
+        if (!self) {
+                DECLARE_OOM();
+                abort();
+        }
+        self->manager = manager;
+        self->path = string_printf("%s/%s/%s",
+                                   manager->sysconfig->prefix,
+                                   CBM_KERNEL_CACHE_DIR,
+                                   CBM_KERNEL_CACHE_FILE);
+        self->fingerprint = cbm_kernel_cache_fingerprint(manager);
+        self->entries = nc_hashmap_new_full(nc_string_hash,
+                                            nc_string_compare,
+                                            free,
+                                            cbm_kernel_cache_entry_free);
+        if (!self->entries) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        if (!file_get_text(self->path, &text)) {
+                LOG_DEBUG("No kernel cache found at %s", self->path);
+                self->dirty = true;
+                return self;
+        }
+
+        /* Magic first, then the fingerprint, then one record per line */
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, CBM_KERNEL_CACHE_MAGIC)) {
+                LOG_DEBUG("Discarding incompatible kernel cache %s", self->path);
+                self->dirty = true;
+                return self;
+        }
+
+        line = strtok_r(NULL, "\n", &saveptr);
+        if (!line || !streq(line, self->fingerprint)) {
+                LOG_DEBUG("Discarding stale kernel cache %s", self->path);
+                self->dirty = true;
+                return self;
+        }
+
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                if (!cbm_kernel_cache_parse_line(self, line)) {
+                        LOG_DEBUG("Skipping corrupt kernel cache record");
+                        self->dirty = true;
+                }
+        }
+
+        return self;
+}
+
+/**
+ * Identify the file at @path, if there is one, leaving @key zeroed otherwise
+ */
+static void cbm_kernel_cache_key(CbmFileKey *key, const char *path)
+{
+        *key = (CbmFileKey){ 0 };
+        if (path && !cbm_file_key_for_path(key, path)) {
+                *key = (CbmFileKey){ 0 };
+        }
+}
+
+/**
+ * Restore the initrd at @path if it's the one recorded, or still absent
+ */
+static bool cbm_kernel_cache_restore(Kernel *kernel, char **field, const char *path,
+                                     const CbmFileKey *recorded)
+{
+        static const CbmFileKey none = { 0 };
+        CbmFileKey key = { 0 };
+
+        cbm_kernel_cache_key(&key, path);
+        if (!cbm_file_key_equal(&key, recorded)) {
+                return false;
+        }
+        boot_manager_kernel_set_field(kernel, field, cbm_file_key_equal(&key, &none) ? NULL : path);
+        return true;
+}
+
+Kernel *cbm_kernel_cache_lookup(CbmKernelCache *self, CbmArena *arena, const char *path,
+                                const struct stat *st)
+{
+        CbmKernelCacheEntry *entry = NULL;
+        CbmFileKey key = { 0 };
+        CbmFileKey cmdline_key = { 0 };
+        autofree(char) *initrd = NULL;
+        autofree(char) *user_initrd = NULL;
+        Kernel *kern = NULL;
+
+        if (!self || !path || !st) {
+                return NULL;
+        }
+
+        entry = nc_hashmap_get(self->entries, path);
+        if (!entry) {
+                return NULL;
+        }
+
+        cbm_file_key_from_stat(&key, st);
+        if (!cbm_file_key_equal(&key, &entry->kernel_key)) {
+                return NULL;
+        }
+
+        kern = boot_manager_alloc_kernel(self->manager, arena, path);
+        if (!kern) {
+                return NULL;
+        }
+
+        /* The cmdline file is the one sibling users routinely edit, and
+         * initrds may be generated or removed beside the kernel */
+        boot_manager_kernel_initrd_paths(kern, &initrd, &user_initrd);
+        if (!cbm_file_key_for_path(&cmdline_key, kern->source.cmdline_file) ||
+            !cbm_file_key_equal(&cmdline_key, &entry->cmdline_key) ||
+            !cbm_kernel_cache_restore(kern,
+                                      &kern->source.initrd_file,
+                                      initrd,
+                                      &entry->initrd_key) ||
+            !cbm_kernel_cache_restore(kern,
+                                      &kern->source.user_initrd_file,
+                                      user_initrd,
+                                      &entry->user_initrd_key)) {
+                free_kernel(kern);
+                return NULL;
+        }
+
+        boot_manager_kernel_set_field(kern, &kern->meta.cmdline, entry->cmdline);
+
+        boot_manager_complete_kernel(self->manager, kern);
+        entry->used = true;
+
+        return kern;
+}
+
+void cbm_kernel_cache_insert(CbmKernelCache *self, const Kernel *kernel, const struct stat *st)
+{
+        CbmKernelCacheEntry *entry = NULL;
+        char *path = NULL;
+
+        if (!self || !kernel || !st) {
+                return;
+        }
+
+        entry = calloc(1, sizeof(struct CbmKernelCacheEntry));
+        if (!entry) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        cbm_file_key_from_stat(&entry->kernel_key, st);
+        if (!cbm_file_key_for_path(&entry->cmdline_key, kernel->source.cmdline_file)) {
+                /* Can't validate it next time, so don't remember it */
+                free(entry);
+                return;
+        }
+
+        cbm_kernel_cache_key(&entry->initrd_key, kernel->source.initrd_file);
+        cbm_kernel_cache_key(&entry->user_initrd_key, kernel->source.user_initrd_file);
+        entry->cmdline = strdup(kernel->meta.cmdline ? kernel->meta.cmdline : "");
+        path = strdup(kernel->source.path);
+        if (!entry->cmdline || !path) {
+                DECLARE_OOM();
+                abort();
+        }
+        entry->used = true;
+
+        /* Replace any stale record */
+        nc_hashmap_remove(self->entries, kernel->source.path);
+        if (!nc_hashmap_put(self->entries, path, entry)) {
+                DECLARE_OOM();
+                abort();
+        }
+        self->dirty = true;
+}
+
+/**
+ * Write the inventory back to disk, dropping any kernels that have gone away
+ * since the last run.
+ */
+static bool cbm_kernel_cache_write(CbmKernelCache *self)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *dir = NULL;
+        autofree(char) *tmp_path = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *path = NULL;
+        CbmKernelCacheEntry *entry = NULL;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        cbm_writer_append_printf(writer, "%s\n%s\n", CBM_KERNEL_CACHE_MAGIC, self->fingerprint);
+
+        nc_hashmap_iter_init(self->entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&path, (void **)&entry)) {
+                if (!entry->used) {
+                        continue;
+                }
+                cbm_writer_append_printf(writer, "%s\t", path);
+                cbm_file_key_write(writer, &entry->kernel_key);
+                cbm_writer_append(writer, "\t");
+                cbm_file_key_write(writer, &entry->cmdline_key);
+                cbm_writer_append(writer, "\t");
+                cbm_file_key_write(writer, &entry->initrd_key);
+                cbm_writer_append(writer, "\t");
+                cbm_file_key_write(writer, &entry->user_initrd_key);
+                cbm_writer_append_printf(writer, "\t%s\n", entry->cmdline);
+        }
+
+        cbm_writer_close(writer);
+
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        dir = string_printf("%s/%s", self->manager->sysconfig->prefix, CBM_KERNEL_CACHE_DIR);
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_DEBUG("Cannot create kernel cache directory %s: %s", dir, strerror(errno));
+                return false;
+        }
+
+        /* Never leave a half written inventory in place */
+        tmp_path = string_printf("%s.TmpWrite", self->path);
+        if (!file_set_text(tmp_path, writer->buffer)) {
+                LOG_DEBUG("Cannot write kernel cache %s: %s", tmp_path, strerror(errno));
+                return false;
+        }
+        if (rename(tmp_path, self->path) != 0) {
+                LOG_DEBUG("Cannot rename kernel cache %s: %s", tmp_path, strerror(errno));
+                (void)unlink(tmp_path);
+                return false;
+        }
+
+        return true;
+}
+
+void cbm_kernel_cache_close(CbmKernelCache *self)
+{
+        NcHashmapIter iter = { 0 };
+        CbmKernelCacheEntry *entry = NULL;
+
+        if (!self) {
+                return;
+        }
+
+        /* Removed kernels also require a rewrite */
+        nc_hashmap_iter_init(self->entries, &iter);
+        while (!self->dirty && nc_hashmap_iter_next(&iter, NULL, (void **)&entry)) {
+                if (!entry->used) {
+                        self->dirty = true;
+                }
+        }
+
+        /* The cache is purely an optimisation, never fail because of it. A
+         * dry run leaves no trace, so its inspections are simply repeated */
+        if (self->dirty && !self->manager->dry_run && !cbm_kernel_cache_write(self)) {
+                LOG_WARNING("Unable to update the kernel cache %s", self->path);
+        }
+
+        nc_hashmap_free(self->entries);
+        free(self->fingerprint);
+        free(self->path);
+        free(self);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,348 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+
+/**
+ * Parse a number of seconds with an optional s, m, h, d or w suffix
+ */
+static bool retention_parse_age(const char *value, uint64_t *age)
+{
+        char *end = NULL;
+        unsigned long long n = 0;
+        uint64_t scale = 1;
+
+        errno = 0;
+        n = strtoull(value, &end, 10);
+        if (errno != 0 || end == value) {
+                return false;
+        }
+        switch (*end) {
+        case 'w':
+                scale *= 7;
+                /* fallthrough */
+        case 'd':
+                scale *= 24;
+                /* fallthrough */
+        case 'h':
+                scale *= 60;
+                /* fallthrough */
+        case 'm':
+                scale *= 60;
+                /* fallthrough */
+        case 's':
+                ++end;
+                break;
+        default:
+                break;
+        }
+        if (*end != '\0' || n > UINT64_MAX / scale) {
+                return false;
+        }
+        *age = (uint64_t)n * scale;
+        return true;
+}
+
+static bool retention_parse_keep(const char *value, unsigned int *keep)
+{
+        char *end = NULL;
+        unsigned long n = 0;
+
+        errno = 0;
+        n = strtoul(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || n > UINT16_MAX) {
+                return false;
+        }
+        *keep = (unsigned int)n;
+        return true;
+}
+
+static bool retention_add_pin(RetentionPolicy *policy, const char *name)
+{
+        char *dup = NULL;
+
+        if (name[0] == '\0') {
+                return false;
+        }
+        if (!policy->pins) {
+                policy->pins = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+                OOM_CHECK_RET(policy->pins, false);
+        }
+        dup = strdup(name);
+        OOM_CHECK_RET(dup, false);
+        if (!nc_hashmap_put(policy->pins, dup, dup)) {
+                free(dup);
+                DECLARE_OOM();
+                return false;
+        }
+        return true;
+}
+
+bool boot_manager_retention_parse(const char *spec, RetentionPolicy *policy)
+{
+        autofree(char) *copy = NULL;
+        char *line = NULL;
+        char *line_state = NULL;
+        bool ret = true;
+
+        *policy = (RetentionPolicy){ 0 };
+
+        copy = strdup(spec);
+        OOM_CHECK_RET(copy, false);
+
+        for (line = strtok_r(copy, "\n", &line_state); line;
+             line = strtok_r(NULL, "\n", &line_state)) {
+                char *comment = strchr(line, '#');
+                char *opt_state = NULL;
+
+                if (comment) {
+                        *comment = '\0';
+                }
+                for (char *opt = strtok_r(line, " \t\r,", &opt_state); opt;
+                     opt = strtok_r(NULL, " \t\r,", &opt_state)) {
+                        if (strncmp(opt, "keep=", 5) == 0 &&
+                            retention_parse_keep(opt + 5, &policy->keep)) {
+                                continue;
+                        } else if (strncmp(opt, "max-age=", 8) == 0 &&
+                                   retention_parse_age(opt + 8, &policy->max_age)) {
+                                continue;
+                        } else if (strncmp(opt, "budget=", 7) == 0 &&
+                                   cbm_parse_size(opt + 7, &policy->budget)) {
+                                continue;
+                        } else if (strncmp(opt, "pin=", 4) == 0 &&
+                                   retention_add_pin(policy, opt + 4)) {
+                                continue;
+                        } else {
+                                LOG_ERROR("Unknown retention option: %s", opt);
+                                ret = false;
+                        }
+                }
+        }
+        policy->configured = true;
+        return ret;
+}
+
+void boot_manager_retention_clear(RetentionPolicy *policy)
+{
+        if (policy->pins) {
+                nc_hashmap_free(policy->pins);
+        }
+        *policy = (RetentionPolicy){ 0 };
+}
+
+bool boot_manager_load_retention(BootManager *self, RetentionPolicy *policy)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+
+        *policy = (RetentionPolicy){ 0 };
+
+        if (!self->sysconfig) {
+                return true;
+        }
+
+        path = string_printf("%s%s", self->sysconfig->prefix, BOOT_MANAGER_RETENTION_FILE);
+        if (!nc_file_exists(path)) {
+                return true;
+        }
+        if (!file_get_text(path, &text)) {
+                LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                return false;
+        }
+        if (!boot_manager_retention_parse(text, policy)) {
+                LOG_ERROR("Invalid retention policy in %s", path);
+                boot_manager_retention_clear(policy);
+                return false;
+        }
+        return true;
+}
+
+static bool retention_pinned(const RetentionPolicy *policy, const Kernel *kernel)
+{
+        autofree(char) *release = NULL;
+
+        if (!policy->pins) {
+                return false;
+        }
+        if (nc_hashmap_contains(policy->pins, kernel->meta.bpath)) {
+                return true;
+        }
+        release = string_printf("%s-%d", kernel->meta.ktype, kernel->meta.release);
+        return nc_hashmap_contains(policy->pins, release);
+}
+
+/**
+ * Bytes the kernel and its initrd take up, as installed
+ *
+ * @param mtime Set to when the kernel was installed on the root, may be NULL
+ */
+static uint64_t retention_kernel_bytes(const Kernel *kernel, uint64_t *mtime)
+{
+        const char *initrd = kernel->source.user_initrd_file;
+        struct stat st = { 0 };
+        uint64_t bytes = 0;
+
+        if (stat(kernel->source.path, &st) == 0) {
+                bytes += (uint64_t)st.st_size;
+                if (mtime) {
+                        *mtime = (uint64_t)st.st_mtime;
+                }
+        }
+        if (!initrd) {
+                initrd = kernel->source.initrd_file;
+        }
+        if (initrd && stat(initrd, &st) == 0) {
+                bytes += (uint64_t)st.st_size;
+        }
+        return bytes;
+}
+
+/**
+ * Position of the kernel's type within the index's types
+ */
+static uint16_t retention_type_slot(KernelIndex *index, const Kernel *kernel)
+{
+        for (uint16_t t = 0; t < index->types->len; t++) {
+                KernelTypeIndex *type = nc_array_get(index->types, t);
+
+                if (streq(type->ktype, kernel->meta.ktype)) {
+                        return t;
+                }
+        }
+        return 0;
+}
+
+void boot_manager_retention_evaluate(const RetentionPolicy *policy, KernelIndex *index,
+                                     const Kernel *running, RetentionVerdict *verdicts)
+{
+        unsigned int *kept = NULL;
+        const Kernel *recent = NULL;
+        RetentionVerdict unkept = RETENTION_SKIP;
+        uint64_t now = (uint64_t)time(NULL);
+        uint64_t used = 0;
+
+        /* Collecting anything needs a config to say a guess is good enough */
+        if (running) {
+                unkept = RETENTION_REMOVE;
+        } else if (policy->configured) {
+                unkept = RETENTION_REMOVE;
+                for (uint16_t i = 0; i < index->kernels->len; i++) {
+                        const Kernel *k = nc_array_get(index->kernels, i);
+
+                        if (k->meta.last_boot > (recent ? recent->meta.last_boot : 0)) {
+                                recent = k;
+                        }
+                }
+        }
+
+        for (uint16_t i = 0; i < index->kernels->len; i++) {
+                const Kernel *k = nc_array_get(index->kernels, i);
+                KernelTypeIndex *type = kernel_index_get_type(index, k->meta.ktype);
+                const Kernel *tip = NULL;
+
+                if (type) {
+                        tip = type->default_kernel;
+                        if (!tip) {
+                                tip = nc_array_get(type->kernels, 0);
+                        }
+                }
+                if (k == tip || (type && k == type->last_booted) || retention_pinned(policy, k)) {
+                        verdicts[i] = RETENTION_REQUIRE;
+                } else if (k == running || k == recent) {
+                        verdicts[i] = RETENTION_KEEP;
+                } else {
+                        verdicts[i] = unkept;
+                        continue;
+                }
+                if (policy->budget) {
+                        used += retention_kernel_bytes(k, NULL);
+                }
+        }
+        if (policy->budget && used > policy->budget) {
+                LOG_WARNING("Kernels that are always kept take %" PRIu64
+                            " bytes, over the budget of %" PRIu64,
+                            used,
+                            policy->budget);
+        }
+        if (policy->keep == 0) {
+                return;
+        }
+
+        kept = calloc(index->types->len ? index->types->len : 1, sizeof(unsigned int));
+        if (!kept) {
+                DECLARE_OOM();
+                return;
+        }
+
+        /* Newest first, so the oldest are the ones left out */
+        for (uint16_t i = 0; i < index->kernels->len; i++) {
+                const Kernel *k = nc_array_get(index->kernels, i);
+                uint16_t slot = 0;
+                uint64_t bytes = 0;
+                uint64_t installed = 0;
+
+                if (verdicts[i] != unkept) {
+                        continue;
+                }
+                slot = retention_type_slot(index, k);
+                if (kept[slot] >= policy->keep) {
+                        continue;
+                }
+                if (policy->budget || policy->max_age) {
+                        bytes = retention_kernel_bytes(k, &installed);
+                }
+                if (policy->max_age) {
+                        uint64_t seen = k->meta.last_boot > installed ? k->meta.last_boot
+                                                                      : installed;
+
+                        if (seen < now && now - seen > policy->max_age) {
+                                LOG_DEBUG("retention: %s is past the maximum age", k->meta.bpath);
+                                continue;
+                        }
+                }
+                if (policy->budget && used + bytes > policy->budget) {
+                        /* Nor may an older one of the type take its place */
+                        LOG_DEBUG("retention: %s is over the budget", k->meta.bpath);
+                        kept[slot] = policy->keep;
+                        continue;
+                }
+                used += bytes;
+                ++kept[slot];
+                verdicts[i] = RETENTION_KEEP;
+        }
+        free(kept);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
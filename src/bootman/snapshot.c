@@ -0,0 +1,456 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "system_stub.h"
+#include "topology.h"
+#include "writer.h"
+
+#include "config.h"
+
+/**
+ * The snapshot records what inspecting the native root found during this
+ * boot, so that every further invocation can skip probing the devices and
+ * parsing os-release. It lives in the runtime directory and so never
+ * survives a reboot, and it's only valid for the boot ID it was taken in.
+ */
+#define CBM_SNAPSHOT_DIR "clr-boot-manager"
+#define CBM_SNAPSHOT_FILE "system"
+#define CBM_BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+/**
+ * Bump whenever the record layout changes
+ */
+#define CBM_SNAPSHOT_MAGIC "clr-boot-manager-snapshot 2"
+
+/**
+ * Anything the probe or os-release depend on that may change during a boot.
+ * Partitions coming and going are seen through the devfs link directories.
+ */
+static const char *cbm_snapshot_prefix_inputs[] = {
+        "/etc/os-release",
+        "/usr/lib/os-release",
+        BOOT_MANAGER_MIRRORS_FILE,
+};
+
+static const char *cbm_snapshot_sysfs_inputs[] = {
+        "/firmware/efi",
+        "/firmware/efi/efivars",
+};
+
+static const char *cbm_snapshot_devfs_inputs[] = {
+        "/disk/by-partuuid",
+        "/disk/by-partlabel",
+        "/disk/by-uuid",
+};
+
+static char *cbm_snapshot_path(void)
+{
+        return string_printf("%s/%s/%s",
+                             cbm_system_get_runtime_path(),
+                             CBM_SNAPSHOT_DIR,
+                             CBM_SNAPSHOT_FILE);
+}
+
+/**
+ * @return the boot ID, or NULL if there is none to tie a snapshot to
+ */
+static char *cbm_snapshot_boot_id(void)
+{
+        autofree(FILE) *fp = NULL;
+        char buf[64] = { 0 };
+        char *ret = NULL;
+
+        /* procfs has no sizes to map, read it the old fashioned way */
+        fp = fopen(CBM_BOOT_ID_PATH, "r");
+        if (!fp || !fgets(buf, sizeof(buf), fp)) {
+                return NULL;
+        }
+        buf[strcspn(buf, "\n")] = '\0';
+        if (buf[0] == '\0') {
+                return NULL;
+        }
+        ret = strdup(buf);
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+/**
+ * Fields are tab separated with one record per line, so neither may appear
+ */
+static bool cbm_snapshot_field_ok(const char *s)
+{
+        return !s || strpbrk(s, "\t\n") == NULL;
+}
+
+static char *cbm_snapshot_field(const char *field)
+{
+        char *ret = NULL;
+
+        if (!field || field[0] == '\0') {
+                return NULL;
+        }
+        ret = strdup(field);
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+static void cbm_snapshot_write_input(CbmWriter *writer, const char *base, const char *path)
+{
+        autofree(char) *full = NULL;
+        CbmFileKey key = { 0 };
+
+        full = string_printf("%s%s", base, path);
+        (void)cbm_file_key_for_path(&key, full);
+        cbm_writer_append(writer, "input\t");
+        cbm_writer_append_printf(writer, CBM_FILE_KEY_FORMAT, CBM_FILE_KEY_ARGS(&key));
+        cbm_writer_append_printf(writer, "\t%s\n", full);
+}
+
+/**
+ * Check a recorded input is still the same file it was
+ */
+static bool cbm_snapshot_input_valid(char *record)
+{
+        CbmFileKey recorded = { 0 };
+        CbmFileKey current = { 0 };
+        char *path = strchr(record, '\t');
+
+        if (!path) {
+                return false;
+        }
+        *path++ = '\0';
+        if (!cbm_file_key_parse(&recorded, record)) {
+                return false;
+        }
+        (void)cbm_file_key_for_path(&current, path);
+        if (!cbm_file_key_equal(&recorded, &current)) {
+                LOG_DEBUG("Snapshot input changed: %s", path);
+                return false;
+        }
+        return true;
+}
+
+static CbmDeviceProbe *cbm_snapshot_parse_root(char *record)
+{
+        CbmDeviceProbe *probe = NULL;
+        char *fields[5] = { 0 };
+        unsigned long long dev = 0;
+        char *end = NULL;
+
+        for (size_t i = 0; i < ARRAY_SIZE(fields) - 1; i++) {
+                fields[i] = strsep(&record, "\t");
+                if (!record) {
+                        return NULL;
+                }
+        }
+        fields[ARRAY_SIZE(fields) - 1] = record;
+
+        errno = 0;
+        dev = strtoull(fields[0], &end, 10);
+        if (errno != 0 || end == fields[0] || *end != '\0') {
+                return NULL;
+        }
+
+        probe = calloc(1, sizeof(struct CbmDeviceProbe));
+        if (!probe) {
+                DECLARE_OOM();
+                abort();
+        }
+        probe->dev = (dev_t)dev;
+        probe->gpt = streq(fields[1], "1");
+        probe->uuid = cbm_snapshot_field(fields[2]);
+        probe->part_uuid = cbm_snapshot_field(fields[3]);
+        probe->luks_uuid = cbm_snapshot_field(fields[4]);
+        return probe;
+}
+
+static void cbm_snapshot_parse_os(CbmOsRelease *os_release, char *record)
+{
+        char *value = strchr(record, '\t');
+        char *key = NULL;
+        char *dup = NULL;
+
+        if (!value) {
+                return;
+        }
+        *value++ = '\0';
+        key = strdup(record);
+        dup = strdup(value);
+        if (!key || !dup || !nc_hashmap_put(os_release, key, dup)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+bool boot_manager_load_snapshot(BootManager *self)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        autofree(char) *boot_id = NULL;
+        autofree(CbmOsRelease) *os_release = NULL;
+        CbmDeviceProbe *root_device = NULL;
+        char *boot_device = NULL;
+        NcArray *boot_mirrors = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+        bool have_boot = false;
+        bool have_prefix = false;
+        bool have_mask = false;
+        int wanted_boot_mask = 0;
+
+        /* Images come and go, only the running system is worth remembering */
+        if (!self->sysconfig || self->sysconfig->image_mode) {
+                return false;
+        }
+
+        path = cbm_snapshot_path();
+        if (!file_get_text(path, &text)) {
+                return false;
+        }
+        boot_id = cbm_snapshot_boot_id();
+
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, CBM_SNAPSHOT_MAGIC)) {
+                LOG_DEBUG("Discarding incompatible snapshot %s", path);
+                return false;
+        }
+
+        os_release = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        if (!os_release) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                char *record = strchr(line, '\t');
+
+                if (!record) {
+                        goto stale;
+                }
+                *record++ = '\0';
+
+                if (streq(line, "boot")) {
+                        have_boot = boot_id && streq(record, boot_id);
+                        if (!have_boot) {
+                                goto stale;
+                        }
+                } else if (streq(line, "prefix")) {
+                        have_prefix = streq(record, self->sysconfig->prefix);
+                        if (!have_prefix) {
+                                goto stale;
+                        }
+                } else if (streq(line, "mask")) {
+                        wanted_boot_mask = atoi(record);
+                        have_mask = true;
+                } else if (streq(line, "boot_device")) {
+                        free(boot_device);
+                        boot_device = cbm_snapshot_field(record);
+                } else if (streq(line, "mirror")) {
+                        char *mirror = cbm_snapshot_field(record);
+                        if (!mirror) {
+                                goto stale;
+                        }
+                        if (!boot_mirrors) {
+                                boot_mirrors = nc_array_new();
+                        }
+                        if (!boot_mirrors || !nc_array_add(boot_mirrors, mirror)) {
+                                DECLARE_OOM();
+                                abort();
+                        }
+                } else if (streq(line, "root")) {
+                        cbm_probe_free(root_device);
+                        root_device = cbm_snapshot_parse_root(record);
+                } else if (streq(line, "os")) {
+                        cbm_snapshot_parse_os(os_release, record);
+                } else if (streq(line, "input")) {
+                        if (!cbm_snapshot_input_valid(record)) {
+                                goto stale;
+                        }
+                } else {
+                        goto stale;
+                }
+        }
+
+        if (!have_boot || !have_prefix || !have_mask || !root_device) {
+                goto stale;
+        }
+
+        /* Whoever asks for the devices next needs to see them afresh */
+        cbm_topology_reset();
+
+        free(self->sysconfig->boot_device);
+        self->sysconfig->boot_device = boot_device;
+        if (self->sysconfig->boot_mirrors) {
+                nc_array_free(&self->sysconfig->boot_mirrors, free);
+        }
+        self->sysconfig->boot_mirrors = boot_mirrors;
+        self->sysconfig->wanted_boot_mask = wanted_boot_mask;
+        cbm_probe_free(self->sysconfig->root_device);
+        self->sysconfig->root_device = root_device;
+        if (!self->os_release) {
+                self->os_release = os_release;
+                os_release = NULL;
+        }
+        LOG_DEBUG("Loaded system snapshot %s", path);
+        return true;
+
+stale:
+        LOG_DEBUG("Discarding stale snapshot %s", path);
+        free(boot_device);
+        if (boot_mirrors) {
+                nc_array_free(&boot_mirrors, free);
+        }
+        cbm_probe_free(root_device);
+        return false;
+}
+
+void boot_manager_save_snapshot(BootManager *self)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *path = NULL;
+        autofree(char) *dir = NULL;
+        autofree(char) *tmp_path = NULL;
+        autofree(char) *boot_id = NULL;
+        const SystemConfig *config = self->sysconfig;
+        const CbmDeviceProbe *root = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *key = NULL;
+        const char *value = NULL;
+
+        if (!config || config->image_mode || !config->root_device || !self->os_release) {
+                return;
+        }
+        root = config->root_device;
+        if (!cbm_snapshot_field_ok(config->prefix) || !cbm_snapshot_field_ok(config->boot_device) ||
+            !cbm_snapshot_field_ok(root->uuid) || !cbm_snapshot_field_ok(root->part_uuid) ||
+            !cbm_snapshot_field_ok(root->luks_uuid)) {
+                return;
+        }
+        for (uint16_t i = 0; config->boot_mirrors && i < config->boot_mirrors->len; i++) {
+                if (!cbm_snapshot_field_ok(nc_array_get(config->boot_mirrors, i))) {
+                        return;
+                }
+        }
+        boot_id = cbm_snapshot_boot_id();
+        if (!boot_id) {
+                return;
+        }
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+        cbm_writer_append_printf(writer,
+                                 "%s\nboot\t%s\nprefix\t%s\nmask\t%d\nboot_device\t%s\n",
+                                 CBM_SNAPSHOT_MAGIC,
+                                 boot_id,
+                                 config->prefix,
+                                 config->wanted_boot_mask,
+                                 config->boot_device ? config->boot_device : "");
+        for (uint16_t i = 0; config->boot_mirrors && i < config->boot_mirrors->len; i++) {
+                cbm_writer_append_printf(writer,
+                                         "mirror\t%s\n",
+                                         (const char *)nc_array_get(config->boot_mirrors, i));
+        }
+        cbm_writer_append_printf(writer,
+                                 "root\t%llu\t%d\t%s\t%s\t%s\n",
+                                 (unsigned long long)root->dev,
+                                 root->gpt ? 1 : 0,
+                                 root->uuid ? root->uuid : "",
+                                 root->part_uuid ? root->part_uuid : "",
+                                 root->luks_uuid ? root->luks_uuid : "");
+
+        nc_hashmap_iter_init(self->os_release, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&key, (void **)&value)) {
+                if (!cbm_snapshot_field_ok(key) || !cbm_snapshot_field_ok(value)) {
+                        return;
+                }
+                cbm_writer_append_printf(writer, "os\t%s\t%s\n", key, value);
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(cbm_snapshot_prefix_inputs); i++) {
+                cbm_snapshot_write_input(writer, config->prefix, cbm_snapshot_prefix_inputs[i]);
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(cbm_snapshot_sysfs_inputs); i++) {
+                cbm_snapshot_write_input(writer,
+                                         cbm_system_get_sysfs_path(),
+                                         cbm_snapshot_sysfs_inputs[i]);
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(cbm_snapshot_devfs_inputs); i++) {
+                cbm_snapshot_write_input(writer,
+                                         cbm_system_get_devfs_path(),
+                                         cbm_snapshot_devfs_inputs[i]);
+        }
+
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* Purely an optimisation, never fail because of it */
+        dir = string_printf("%s/%s", cbm_system_get_runtime_path(), CBM_SNAPSHOT_DIR);
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_DEBUG("Cannot create snapshot directory %s: %s", dir, strerror(errno));
+                return;
+        }
+        path = cbm_snapshot_path();
+        tmp_path = string_printf("%s.TmpWrite", path);
+        if (!file_set_text(tmp_path, writer->buffer)) {
+                LOG_DEBUG("Cannot write snapshot %s: %s", tmp_path, strerror(errno));
+                return;
+        }
+        if (rename(tmp_path, path) != 0) {
+                LOG_DEBUG("Cannot rename snapshot %s: %s", tmp_path, strerror(errno));
+                (void)unlink(tmp_path);
+        }
+}
+
+void boot_manager_discard_snapshot(__cbm_unused__ BootManager *self)
+{
+        autofree(char) *path = cbm_snapshot_path();
+
+        if (unlink(path) < 0 && errno != ENOENT) {
+                LOG_WARNING("Unable to remove snapshot %s: %s", path, strerror(errno));
+        }
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
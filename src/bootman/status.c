@@ -0,0 +1,326 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootloader.h"
+#include "bootman.h"
+#include "bootman_private.h"
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "manifest.h"
+#include "writer.h"
+
+/**
+ * Answers that depend on state we may not be able to see
+ */
+typedef enum {
+        STATUS_UNKNOWN = 0,
+        STATUS_NO,
+        STATUS_YES,
+} StatusAnswer;
+
+/**
+ * Everything reported about a single kernel
+ */
+typedef struct StatusKernel {
+        const Kernel *kernel;
+        bool is_default;      /**<Target of its type's default- link */
+        bool running;         /**<The running kernel */
+        bool keep;            /**<An update keeps it installed */
+        bool remove;          /**<An update removes it */
+        StatusAnswer present; /**<Whether it's installed on the boot directory */
+} StatusKernel;
+
+static const char *status_answer_json(StatusAnswer answer)
+{
+        switch (answer) {
+        case STATUS_YES:
+                return "true";
+        case STATUS_NO:
+                return "false";
+        default:
+                return "null";
+        }
+}
+
+static const char *status_answer_text(StatusAnswer answer)
+{
+        switch (answer) {
+        case STATUS_YES:
+                return "yes";
+        case STATUS_NO:
+                return "no";
+        default:
+                return "unknown";
+        }
+}
+
+/**
+ * Decide whether @kernel is installed, going by its blob's digest alone
+ *
+ * @param installed Digests installed on the boot directory, NULL if unknown
+ * @param digests Cached digests of the sources, NULL if unknown
+ */
+static StatusAnswer status_kernel_present(const Kernel *kernel, NcHashmap *installed,
+                                          NcHashmap *digests)
+{
+        const char *digest = NULL;
+
+        if (!installed || !digests) {
+                return STATUS_UNKNOWN;
+        }
+        /* Every install hashes the source, so none means it never was */
+        digest = nc_hashmap_get(digests, kernel->source.path);
+        if (!digest) {
+                return STATUS_NO;
+        }
+        return nc_hashmap_contains(installed, digest) ? STATUS_YES : STATUS_NO;
+}
+
+static void status_write_kernel_json(CbmWriter *writer, const StatusKernel *sk)
+{
+        const Kernel *k = sk->kernel;
+
+        cbm_writer_append(writer, "{\"name\":");
+        cbm_writer_append_json_string(writer, k->meta.bpath);
+        cbm_writer_append(writer, ",\"path\":");
+        cbm_writer_append_json_string(writer, k->source.path);
+        cbm_writer_append(writer, ",\"type\":");
+        cbm_writer_append_json_string(writer, k->meta.ktype);
+        cbm_writer_append(writer, ",\"version\":");
+        cbm_writer_append_json_string(writer, k->meta.version);
+        cbm_writer_append_printf(writer,
+                                 ",\"release\":%d,\"default\":%s,\"running\":%s",
+                                 k->meta.release,
+                                 sk->is_default ? "true" : "false",
+                                 sk->running ? "true" : "false");
+        if (k->meta.last_boot) {
+                cbm_writer_append_printf(writer, ",\"last_boot\":%" PRIu64, k->meta.last_boot);
+        } else {
+                cbm_writer_append(writer, ",\"last_boot\":null");
+        }
+        cbm_writer_append_printf(writer,
+                                 ",\"keep\":%s,\"installed\":%s}",
+                                 sk->keep ? "true" : "false",
+                                 status_answer_json(sk->present));
+}
+
+static void status_write_kernel_text(CbmWriter *writer, const StatusKernel *sk)
+{
+        cbm_writer_append_printf(writer,
+                                 "%-20s %s installed=%s%s%s%s%s\n",
+                                 "kernel",
+                                 sk->kernel->meta.bpath,
+                                 status_answer_text(sk->present),
+                                 sk->is_default ? " default" : "",
+                                 sk->running ? " running" : "",
+                                 sk->kernel->meta.last_boot ? " booted" : "",
+                                 sk->keep ? " keep" : (sk->remove ? " remove" : ""));
+}
+
+/**
+ * Write @name with the basename of @kernel, or null
+ */
+static void status_write_name(CbmWriter *writer, const char *name, const Kernel *kernel,
+                              bool json)
+{
+        if (!json) {
+                cbm_writer_append_printf(writer,
+                                         "%-20s %s\n",
+                                         name,
+                                         kernel ? kernel->meta.bpath : "none");
+                return;
+        }
+        cbm_writer_append_printf(writer, ",\"%s\":", name);
+        if (kernel) {
+                cbm_writer_append_json_string(writer, kernel->meta.bpath);
+        } else {
+                cbm_writer_append(writer, "null");
+        }
+}
+
+bool boot_manager_write_status(BootManager *self, CbmWriter *writer, bool json)
+{
+        autofree(KernelArray) *kernels = NULL;
+        autofree(KernelIndex) *index = NULL;
+        autofree(NcHashmap) *installed = NULL;
+        autofree(NcHashmap) *digests = NULL;
+        autofree(char) *boot_dir = NULL;
+        autofree(char) *digest_cache = NULL;
+        autofree(char) *uki_config = NULL;
+        StatusKernel *status = NULL;
+        RetentionPolicy retention = { 0 };
+        RetentionVerdict *verdicts = NULL;
+        const Kernel *running = NULL;
+        const Kernel *default_kernel = NULL;
+        const SystemKernel *system_kernel = NULL;
+        KernelTypeIndex *default_type = NULL;
+        StatusAnswer needs_update = STATUS_NO;
+        int timeout = -1;
+
+        if (!self || !self->sysconfig || !writer) {
+                return false;
+        }
+
+        /* Only what's on the root already, nothing is probed or mounted */
+        kernels = boot_manager_get_kernels(self);
+        if (!kernels) {
+                return false;
+        }
+        index = boot_manager_index_kernels(self, kernels);
+        if (!index) {
+                DECLARE_OOM();
+                return false;
+        }
+        running = boot_manager_index_get_running_kernel(self, index);
+
+        /* The manifest's only there to read while the ESP is mounted */
+        boot_dir = boot_manager_get_boot_dir(self);
+        OOM_CHECK_RET(boot_dir, false);
+        installed = cbm_manifest_read(boot_dir);
+        if (!boot_manager_is_image_mode(self)) {
+                digest_cache = string_printf("%s/%s",
+                                             self->sysconfig->prefix,
+                                             CBM_DIGEST_CACHE_PATH);
+                digests = cbm_manifest_read_digests(digest_cache);
+        }
+
+        /* Unified images are assembled per kernel, the manifest can't tell */
+        uki_config = string_printf("%s%s", self->sysconfig->prefix, BOOTLOADER_UKI_CONFIG);
+        if (cbm_file_exists(uki_config)) {
+                nc_hashmap_free(installed);
+                installed = NULL;
+        }
+
+        status = calloc(kernels->len ? kernels->len : 1, sizeof(StatusKernel));
+        verdicts = calloc(kernels->len ? kernels->len : 1, sizeof(RetentionVerdict));
+        if (!status || !verdicts) {
+                free(status);
+                free(verdicts);
+                DECLARE_OOM();
+                return false;
+        }
+
+        /* Decide what an update would do, just as boot_manager_update does */
+        if (!boot_manager_load_retention(self, &retention)) {
+                LOG_WARNING("Ignoring the retention policy");
+        }
+        boot_manager_retention_evaluate(&retention, index, running, verdicts);
+        boot_manager_retention_clear(&retention);
+
+        for (uint16_t i = 0; i < index->kernels->len; i++) {
+                StatusKernel *sk = &status[i];
+                KernelTypeIndex *type = NULL;
+
+                sk->kernel = nc_array_get(index->kernels, i);
+                sk->running = sk->kernel == running;
+                type = kernel_index_get_type(index, sk->kernel->meta.ktype);
+                sk->is_default = type && sk->kernel == type->default_kernel;
+                sk->keep = verdicts[i] >= RETENTION_KEEP;
+                sk->remove = verdicts[i] == RETENTION_REMOVE;
+                sk->present = status_kernel_present(sk->kernel, installed, digests);
+                if ((sk->keep && sk->present == STATUS_NO) ||
+                    (sk->remove && sk->present == STATUS_YES)) {
+                        needs_update = STATUS_YES;
+                } else if (sk->present == STATUS_UNKNOWN && needs_update == STATUS_NO) {
+                        needs_update = STATUS_UNKNOWN;
+                }
+        }
+
+        /* The default follows the running kernel's type */
+        system_kernel = boot_manager_get_system_kernel(self);
+        if (running) {
+                default_type = kernel_index_get_type(index, running->meta.ktype);
+        } else if (system_kernel && system_kernel->ktype[0] != '\0') {
+                default_type = kernel_index_get_type(index, system_kernel->ktype);
+        }
+        if (default_type) {
+                default_kernel = default_type->default_kernel;
+        }
+        timeout = boot_manager_get_timeout_value(self);
+
+        if (json) {
+                cbm_writer_append(writer, "{\"root\":");
+                cbm_writer_append_json_string(writer, self->sysconfig->prefix);
+                cbm_writer_append(writer, ",\"boot_dir\":");
+                cbm_writer_append_json_string(writer, boot_dir);
+                cbm_writer_append_printf(writer,
+                                         ",\"manifest\":%s",
+                                         installed ? "true" : "false");
+                if (timeout > 0) {
+                        cbm_writer_append_printf(writer, ",\"timeout\":%d", timeout);
+                } else {
+                        cbm_writer_append(writer, ",\"timeout\":null");
+                }
+        } else {
+                cbm_writer_append_printf(writer, "%-20s %s\n", "root", self->sysconfig->prefix);
+                cbm_writer_append_printf(writer, "%-20s %s\n", "boot_dir", boot_dir);
+                cbm_writer_append_printf(writer,
+                                         "%-20s %s\n",
+                                         "manifest",
+                                         installed ? "yes" : "no");
+                if (timeout > 0) {
+                        cbm_writer_append_printf(writer, "%-20s %d\n", "timeout", timeout);
+                } else {
+                        cbm_writer_append_printf(writer, "%-20s %s\n", "timeout", "none");
+                }
+        }
+        status_write_name(writer, "running", running, json);
+        status_write_name(writer, "default", default_kernel, json);
+
+        if (json) {
+                cbm_writer_append(writer, ",\"kernels\":[");
+        }
+        for (uint16_t i = 0; i < index->kernels->len; i++) {
+                if (json) {
+                        if (i > 0) {
+                                cbm_writer_append(writer, ",");
+                        }
+                        status_write_kernel_json(writer, &status[i]);
+                } else {
+                        status_write_kernel_text(writer, &status[i]);
+                }
+        }
+        if (json) {
+                cbm_writer_append_printf(writer,
+                                         "],\"needs_update\":%s}\n",
+                                         status_answer_json(needs_update));
+        } else {
+                cbm_writer_append_printf(writer,
+                                         "%-20s %s\n",
+                                         "needs_update",
+                                         status_answer_text(needs_update));
+        }
+
+        free(status);
+        free(verdicts);
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -11,6 +11,7 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,10 +20,12 @@
 
 #include "bootman.h"
 #include "bootman_private.h"
+#include "config.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
+#include "topology.h"
 
 void cbm_free_sysconfig(SystemConfig *config)
 {
@@ -31,20 +34,20 @@ void cbm_free_sysconfig(SystemConfig *config)
         }
         free(config->prefix);
         free(config->boot_device);
+        if (config->boot_mirrors) {
+                nc_array_free(&config->boot_mirrors, free);
+        }
         cbm_probe_free(config->root_device);
         free(config);
 }
 
-SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
+SystemConfig *cbm_new_sysconfig(const char *path, bool image_mode)
 {
         if (!path) {
                 return NULL;
         }
         SystemConfig *c = NULL;
         char *realp = NULL;
-        char *boot = NULL;
-        char *rel = NULL;
-        bool native_uefi = false;
 
         realp = realpath(path, NULL);
         if (!realp) {
@@ -60,6 +63,117 @@ SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
         }
         c->prefix = realp;
         c->wanted_boot_mask = 0;
+        c->image_mode = image_mode;
+        return c;
+}
+
+SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
+{
+        SystemConfig *c = cbm_new_sysconfig(path, image_mode);
+
+        if (c) {
+                cbm_probe_sysconfig(c);
+        }
+        return c;
+}
+
+/**
+ * Resolve one line of the mirrors file: a device node, PARTUUID=... or
+ * PARTLABEL=...
+ *
+ * @return the newly allocated, fully resolved device, or NULL
+ */
+static char *cbm_resolve_boot_mirror(const char *spec)
+{
+        autofree(char) *node = NULL;
+
+        if (strncmp(spec, "PARTUUID=", 9) == 0) {
+                autofree(char) *uuid = strdup(spec + 9);
+                if (!uuid) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                for (char *c = uuid; *c; c++) {
+                        *c = (char)tolower(*c);
+                }
+                node = cbm_topology_part_uuid_node(uuid);
+        } else if (strncmp(spec, "PARTLABEL=", 10) == 0) {
+                node = cbm_topology_part_label_node(spec + 10);
+        } else {
+                node = strdup(spec);
+        }
+        if (!node) {
+                return NULL;
+        }
+        return realpath(node, NULL);
+}
+
+/**
+ * Find the further ESPs listed in the mirrors file of the root, one per
+ * line. The boot device itself and duplicates are skipped.
+ */
+static void cbm_probe_boot_mirrors(SystemConfig *c)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+
+        path = string_printf("%s%s", c->prefix, BOOT_MANAGER_MIRRORS_FILE);
+        if (!nc_file_exists(path)) {
+                return;
+        }
+        if (!file_get_text(path, &text)) {
+                LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                return;
+        }
+
+        for (line = strtok_r(text, "\n", &saveptr); line;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                char *device = NULL;
+                bool known = false;
+
+                line += strspn(line, " \t");
+                line[strcspn(line, " \t#")] = '\0';
+                if (line[0] == '\0') {
+                        continue;
+                }
+
+                device = cbm_resolve_boot_mirror(line);
+                if (!device) {
+                        LOG_WARNING("Cannot find mirrored ESP %s, skipping it", line);
+                        continue;
+                }
+                known = streq(device, c->boot_device);
+                for (uint16_t i = 0; !known && c->boot_mirrors && i < c->boot_mirrors->len; i++) {
+                        known = streq(device, nc_array_get(c->boot_mirrors, i));
+                }
+                if (known) {
+                        free(device);
+                        continue;
+                }
+
+                if (!c->boot_mirrors) {
+                        c->boot_mirrors = nc_array_new();
+                }
+                if (!c->boot_mirrors || !nc_array_add(c->boot_mirrors, device)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                LOG_INFO("Discovered mirrored ESP: %s", device);
+        }
+}
+
+void cbm_probe_sysconfig(SystemConfig *c)
+{
+        bool image_mode = c->image_mode;
+        char *realp = c->prefix;
+        char *boot = NULL;
+        char *rel = NULL;
+        bool native_uefi = false;
+
+        /* Devices may have come and gone since the last inspection */
+        cbm_topology_reset();
 
         /* Determine if this is a native UEFI system. This means we're in a full
          * native mode and have /sys/firmware/efi available. This does not throw
@@ -125,9 +239,222 @@ refine_device:
                 c->wanted_boot_mask |= BOOTLOADER_CAP_GPT;
         }
 
+        /* Only an ESP can be mirrored, with nothing living outside of it */
+        if (c->boot_device && !image_mode && (c->wanted_boot_mask & BOOTLOADER_CAP_UEFI)) {
+                cbm_probe_boot_mirrors(c);
+        }
+
         c->root_device = cbm_probe_path(realp);
+}
 
-        return c;
+void cbm_device_spec_free(CbmDeviceSpec *spec)
+{
+        if (!spec) {
+                return;
+        }
+        free(spec->root.uuid);
+        free(spec->root.part_uuid);
+        free(spec->root.luks_uuid);
+        free(spec->boot_device);
+        free(spec);
+}
+
+/**
+ * Store a copy of @value in @field, replacing any earlier one
+ */
+static void cbm_device_spec_set(char **field, const char *value)
+{
+        free(*field);
+        *field = strdup(value);
+        if (!*field) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+static bool cbm_device_spec_parse_bool(const char *value, bool *out)
+{
+        if (streq(value, "yes") || streq(value, "true") || streq(value, "1")) {
+                *out = true;
+        } else if (streq(value, "no") || streq(value, "false") || streq(value, "0")) {
+                *out = false;
+        } else {
+                return false;
+        }
+        return true;
+}
+
+static bool cbm_device_spec_parse_mask(const char *value, int *out)
+{
+        autofree(char) *words = NULL;
+        char *saveptr = NULL;
+        int mask = 0;
+
+        words = strdup(value);
+        if (!words) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (char *word = strtok_r(words, " \t,", &saveptr); word;
+             word = strtok_r(NULL, " \t,", &saveptr)) {
+                if (streq(word, "uefi")) {
+                        mask |= BOOTLOADER_CAP_UEFI;
+                } else if (streq(word, "legacy")) {
+                        mask |= BOOTLOADER_CAP_LEGACY;
+                } else if (streq(word, "gpt")) {
+                        mask |= BOOTLOADER_CAP_GPT;
+                } else {
+                        return false;
+                }
+        }
+        /* Exactly one way of booting, as probing would find */
+        if (!(mask & BOOTLOADER_CAP_UEFI) == !(mask & BOOTLOADER_CAP_LEGACY)) {
+                return false;
+        }
+        *out = mask;
+        return true;
+}
+
+CbmDeviceSpec *cbm_device_spec_parse(const char *text)
+{
+        autofree(char) *copy = NULL;
+        CbmDeviceSpec *spec = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+        bool have_gpt = false;
+        bool have_mask = false;
+
+        copy = strdup(text);
+        spec = calloc(1, sizeof(CbmDeviceSpec));
+        if (!copy || !spec) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (line = strtok_r(copy, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+                char *value = NULL;
+                char *end = NULL;
+
+                line[strcspn(line, "#")] = '\0';
+                line += strspn(line, " \t");
+                if (line[0] == '\0') {
+                        continue;
+                }
+                value = strchr(line, '=');
+                if (!value) {
+                        LOG_ERROR("Invalid device spec line: %s", line);
+                        goto bail;
+                }
+                *value++ = '\0';
+                line[strcspn(line, " \t")] = '\0';
+                value += strspn(value, " \t");
+                end = value + strlen(value);
+                while (end > value && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+                        *--end = '\0';
+                }
+                if (value[0] == '\0') {
+                        LOG_ERROR("Device spec key %s has no value", line);
+                        goto bail;
+                }
+
+                if (streq(line, "ROOT_UUID")) {
+                        cbm_device_spec_set(&spec->root.uuid, value);
+                } else if (streq(line, "ROOT_PARTUUID")) {
+                        cbm_device_spec_set(&spec->root.part_uuid, value);
+                } else if (streq(line, "ROOT_LUKS_UUID")) {
+                        cbm_device_spec_set(&spec->root.luks_uuid, value);
+                } else if (streq(line, "BOOT_DEVICE")) {
+                        cbm_device_spec_set(&spec->boot_device, value);
+                } else if (streq(line, "GPT")) {
+                        if (!cbm_device_spec_parse_bool(value, &spec->root.gpt)) {
+                                LOG_ERROR("Invalid device spec GPT value: %s", value);
+                                goto bail;
+                        }
+                        have_gpt = true;
+                } else if (streq(line, "BOOT_MASK")) {
+                        if (!cbm_device_spec_parse_mask(value, &spec->wanted_boot_mask)) {
+                                LOG_ERROR("Invalid device spec BOOT_MASK: %s", value);
+                                goto bail;
+                        }
+                        have_mask = true;
+                } else {
+                        LOG_ERROR("Unknown device spec key: %s", line);
+                        goto bail;
+                }
+        }
+
+        if (!spec->root.uuid && !spec->root.part_uuid) {
+                LOG_ERROR("Device spec needs ROOT_UUID or ROOT_PARTUUID");
+                goto bail;
+        }
+        if (!have_mask) {
+                LOG_ERROR("Device spec needs BOOT_MASK");
+                goto bail;
+        }
+        /* Only GPT partitions have a PartUUID */
+        if (!have_gpt) {
+                spec->root.gpt = spec->root.part_uuid != NULL;
+        }
+        return spec;
+
+bail:
+        cbm_device_spec_free(spec);
+        return NULL;
+}
+
+CbmDeviceSpec *cbm_device_spec_load(const char *path)
+{
+        autofree(char) *text = NULL;
+
+        if (!file_get_text(path, &text)) {
+                LOG_ERROR("Unable to read device spec %s: %s", path, strerror(errno));
+                return NULL;
+        }
+        return cbm_device_spec_parse(text);
+}
+
+/**
+ * Copy a string field of the spec, which may well be unset
+ */
+static char *cbm_device_spec_dup(const char *field)
+{
+        char *ret = NULL;
+
+        if (!field) {
+                return NULL;
+        }
+        ret = strdup(field);
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+void cbm_apply_device_spec(SystemConfig *c, const CbmDeviceSpec *spec)
+{
+        CbmDeviceProbe *root = NULL;
+
+        root = calloc(1, sizeof(CbmDeviceProbe));
+        if (!root) {
+                DECLARE_OOM();
+                abort();
+        }
+        root->uuid = cbm_device_spec_dup(spec->root.uuid);
+        root->part_uuid = cbm_device_spec_dup(spec->root.part_uuid);
+        root->luks_uuid = cbm_device_spec_dup(spec->root.luks_uuid);
+        root->gpt = spec->root.gpt;
+
+        free(c->boot_device);
+        c->boot_device = cbm_device_spec_dup(spec->boot_device);
+        if (c->boot_mirrors) {
+                nc_array_free(&c->boot_mirrors, free);
+        }
+        c->wanted_boot_mask = spec->wanted_boot_mask;
+        cbm_probe_free(c->root_device);
+        c->root_device = root;
+
+        LOG_INFO("Using the device spec in place of probing %s", c->prefix);
 }
 
 bool cbm_is_sysconfig_sane(SystemConfig *config)
@@ -13,55 +13,1369 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
 #include "bootman.h"
 #include "bootman_private.h"
+#include "config.h"
 #include "files.h"
+#include "lock.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/files.h"
+#include "pool.h"
+#include "stage.h"
+#include "stats.h"
 #include "system_stub.h"
+#include "trace.h"
+#include "writer.h"
 
 static bool boot_manager_update_image(BootManager *self);
-static bool boot_manager_update_native(BootManager *self);
-static bool boot_manager_update_bootloader(BootManager *self);
 
 /**
- * Sort by release number, putting highest first
+ * A further ESP updated along with the boot device
  */
-static int kernel_compare_reverse(const void *a, const void *b)
+typedef struct BootMirror {
+        const char *device; /**<Device of the ESP, owned by the sysconfig */
+        char *boot_dir;     /**<Where it's mounted, NULL if that failed */
+        bool did_mount;     /**<Whether we mounted it, and so must unmount it */
+} BootMirror;
+
+static bool boot_manager_update_native(BootManager *self, BootMirror *mirrors,
+                                       uint16_t n_mirrors);
+
+/**
+ * Where concurrent updates of the running system coordinate, relative to
+ * the runtime directory
+ */
+#define CBM_UPDATE_LOCK_DIR "clr-boot-manager"
+
+/**
+ * Where mirrored ESPs not mounted already are mounted, relative to the
+ * runtime directory
+ */
+#define CBM_UPDATE_MIRROR_DIR "clr-boot-manager/esp"
+
+/**
+ * Space kept free on the boot directory for everything that isn't a kernel
+ * blob, such as loader entries, the manifest and bootloader updates
+ */
+#define CBM_UPDATE_SPACE_RESERVE (512 * 1024)
+
+/**
+ * A kernel scheduled for installation during an update
+ */
+typedef struct KernelInstallJob {
+        const Kernel *kernel; /**<Kernel to be installed */
+        const char *initrd;   /**<Initrd to be installed with it, if any */
+        bool required;        /**<Failure to install aborts the update */
+        bool installed;       /**<Whether the blobs were installed */
+        bool copy_kernel;     /**<Kernel blob differs from the installed copy */
+        bool copy_initrd;     /**<Initrd differs from the installed copy */
+        off_t kernel_bytes;   /**<Size of the kernel blob to be copied */
+        off_t initrd_bytes;   /**<Size of the initrd to be copied */
+        off_t kernel_replaced; /**<Size of the kernel blob the copy replaces */
+        off_t initrd_replaced; /**<Size of the initrd the copy replaces */
+        const struct KernelInstallJob *owner; /**<Job copying a blob we share, if any */
+} KernelInstallJob;
+
+/**
+ * Every action an update will perform, computed up front so that it may be
+ * reported without touching the target, and so that no-op actions are
+ * skipped when it's executed.
+ */
+typedef struct UpdatePlan {
+        bool bootloader_install;     /**<Bootloader must be installed */
+        bool bootloader_update;      /**<Bootloader must be updated */
+        NcArray *installs;           /**<KernelInstallJob items, in install order */
+        NcArray *removals;           /**<Kernels to garbage collect */
+        KernelArray *kernels;        /**<Every kernel the plan was made from */
+        const Kernel *default_kernel; /**<New default, NULL for timeout mode */
+        bool regenerate_config;      /**<Setting the default regenerates the config */
+        off_t bytes;                 /**<Total number of bytes to be copied */
+        off_t reclaimed;             /**<Bytes freed by removing the kernels */
+        bool remove_first;           /**<Removals must make room for the installs */
+        bool serial;                 /**<Copies must run one at a time to fit */
+        bool settled;                /**<Initrds packed and targets named, for every ESP */
+} UpdatePlan;
+
+static void boot_manager_plan_free(UpdatePlan *plan)
+{
+        if (plan->installs) {
+                nc_array_free(&plan->installs, free);
+        }
+        if (plan->removals) {
+                nc_array_free(&plan->removals, NULL);
+        }
+}
+
+/**
+ * Whether updates cover kernels of @ktype, which is every type unless the
+ * update is limited to those of changed kernels
+ */
+static bool boot_manager_update_covers(const BootManager *self, const char *ktype)
+{
+        return !self->changed_types || nc_hashmap_contains(self->changed_types, ktype);
+}
+
+/**
+ * Queue the kernel for installation, merging with any existing job for the
+ * same kernel so that no two workers ever write the same target.
+ */
+static void boot_manager_queue_install(NcArray *jobs, const Kernel *kernel, bool required)
+{
+        KernelInstallJob *job = NULL;
+
+        for (uint16_t i = 0; i < jobs->len; i++) {
+                job = nc_array_get(jobs, i);
+                if (job->kernel == kernel) {
+                        job->required = job->required || required;
+                        return;
+                }
+        }
+
+        job = calloc(1, sizeof(struct KernelInstallJob));
+        if (!job) {
+                DECLARE_OOM();
+                abort();
+        }
+        job->kernel = kernel;
+        job->required = required;
+
+        if (!nc_array_add(jobs, job)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+/**
+ * Copy the kernel selection of @plan into @copy, to be planned afresh for
+ * another ESP. Only what the plan learns about its target is left behind.
+ */
+static void boot_manager_plan_clone(const UpdatePlan *plan, UpdatePlan *copy)
+{
+        *copy = (UpdatePlan){.kernels = plan->kernels,
+                             .default_kernel = plan->default_kernel,
+                             .settled = plan->settled };
+
+        copy->installs = nc_array_new();
+        if (!copy->installs) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+
+                boot_manager_queue_install(copy->installs, job->kernel, job->required);
+        }
+        if (!plan->removals) {
+                return;
+        }
+        copy->removals = nc_array_new();
+        for (uint16_t i = 0; copy->removals && i < plan->removals->len; i++) {
+                if (!nc_array_add(copy->removals, nc_array_get(plan->removals, i))) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        if (!copy->removals) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+/**
+ * Size of @path, or 0 if it doesn't exist
+ */
+static off_t boot_manager_file_size(const char *path)
+{
+        struct stat st = { 0 };
+
+        if (!path || stat(path, &st) != 0) {
+                return 0;
+        }
+        return st.st_size;
+}
+
+/**
+ * Return the number of bytes needed to install @source at @target, or 0 if
+ * the target is already up to date.
+ *
+ * @param replaced Set to the size of the target the copy replaces
+ */
+static off_t boot_manager_plan_copy(BootManager *self, const char *source, const char *target,
+                                    bool *copy, off_t *replaced)
+{
+        *copy = !cbm_manifest_files_match(self->manifest, source, target);
+        if (!*copy) {
+                return 0;
+        }
+        *replaced = boot_manager_file_size(target);
+        return boot_manager_file_size(source);
+}
+
+/**
+ * Round @bytes up to whole blocks of @block_size
+ */
+static off_t boot_manager_plan_blocks(off_t bytes, off_t block_size)
+{
+        return ((bytes + block_size - 1) / block_size) * block_size;
+}
+
+/**
+ * Determine whether the copies fit within @avail bytes. Each copy is written
+ * next to its target before replacing it, so it needs its own size free only
+ * until the old target is gone. Concurrent copies may all be in flight at
+ * once, so none of the replaced space can be counted on.
+ */
+static bool boot_manager_plan_fits(const UpdatePlan *plan, off_t avail, off_t block_size,
+                                   bool serial)
+{
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+                off_t copies[] = { job->kernel_bytes, job->initrd_bytes };
+                off_t replaced[] = { job->kernel_replaced, job->initrd_replaced };
+
+                for (size_t j = 0; j < ARRAY_SIZE(copies); j++) {
+                        if (copies[j] == 0) {
+                                continue;
+                        }
+                        avail -= boot_manager_plan_blocks(copies[j], block_size);
+                        if (avail < 0) {
+                                return false;
+                        }
+                        if (serial) {
+                                avail += boot_manager_plan_blocks(replaced[j], block_size);
+                        }
+                }
+        }
+        return true;
+}
+
+/**
+ * Order the plan so that it fits in the free space of the boot directory:
+ * copying concurrently if everything fits at once, otherwise one copy at a
+ * time, and if need be after making room by removing the old kernels first.
+ * None of those are ever needed to boot, the running, default and last
+ * booted kernels are always kept. If nothing fits, the update is refused
+ * before anything is touched.
+ */
+static bool boot_manager_plan_schedule(BootManager *self, UpdatePlan *plan)
+{
+        autofree(char) *boot_dir = NULL;
+        struct statvfs vfs = { 0 };
+        off_t block_size = 0;
+        off_t avail = 0;
+
+        boot_dir = boot_manager_get_boot_dir(self);
+        OOM_CHECK_RET(boot_dir, false);
+
+        if (plan->bytes == 0) {
+                return true;
+        }
+        if (cbm_system_statvfs(boot_dir, &vfs) != 0) {
+                LOG_DEBUG("Cannot determine free space of %s: %s", boot_dir, strerror(errno));
+                return true;
+        }
+        block_size = vfs.f_frsize ? (off_t)vfs.f_frsize : (off_t)vfs.f_bsize;
+        if (block_size <= 0) {
+                block_size = 1;
+        }
+        avail = (off_t)vfs.f_bavail * block_size - CBM_UPDATE_SPACE_RESERVE;
+
+        for (uint16_t i = 0; plan->removals && i < plan->removals->len; i++) {
+                const Kernel *k = nc_array_get(plan->removals, i);
+                autofree(char) *kernel_target = NULL;
+                autofree(char) *initrd_target = NULL;
+                const char *initrd_source = NULL;
+
+                if (!boot_manager_get_kernel_targets(self,
+                                                     k,
+                                                     &kernel_target,
+                                                     &initrd_source,
+                                                     &initrd_target)) {
+                        continue;
+                }
+                plan->reclaimed +=
+                    boot_manager_plan_blocks(boot_manager_file_size(kernel_target), block_size) +
+                    boot_manager_plan_blocks(boot_manager_file_size(initrd_target), block_size);
+        }
+
+        if (boot_manager_plan_fits(plan, avail, block_size, false)) {
+                return true;
+        }
+        if (boot_manager_plan_fits(plan, avail, block_size, true)) {
+                LOG_INFO("Copying one file at a time to fit in %s", boot_dir);
+                plan->serial = true;
+                return true;
+        }
+        if (plan->reclaimed > 0) {
+                plan->remove_first = true;
+                avail += plan->reclaimed;
+                if (boot_manager_plan_fits(plan, avail, block_size, false)) {
+                        LOG_INFO("Removing old kernels first to fit in %s", boot_dir);
+                        return true;
+                }
+                if (boot_manager_plan_fits(plan, avail, block_size, true)) {
+                        LOG_INFO("Removing old kernels first, and copying one file at a time "
+                                 "to fit in %s",
+                                 boot_dir);
+                        plan->serial = true;
+                        return true;
+                }
+        }
+
+        LOG_FATAL("Not enough space in %s: %lld bytes to copy, %lld bytes available",
+                  boot_dir,
+                  (long long)plan->bytes,
+                  (long long)(avail > 0 ? avail : 0));
+        return false;
+}
+
+/**
+ * Claim @target for @job to copy. A blob shared with a job that already
+ * claimed it is copied by that job alone, and becomes a dependency.
+ *
+ * @return False if another job already copies it
+ */
+static bool boot_manager_plan_claim(NcHashmap *claims, const char *target, KernelInstallJob *job)
+{
+        KernelInstallJob *owner = nc_hashmap_get(claims, target);
+        char *key = NULL;
+
+        if (owner) {
+                job->owner = owner;
+                return false;
+        }
+        key = strdup(target);
+        if (!key || !nc_hashmap_put(claims, key, job)) {
+                DECLARE_OOM();
+                abort();
+        }
+        return true;
+}
+
+/**
+ * Compare every blob the plan installs with its target in full, all at once,
+ * so that the comparisons run across every core rather than one by one as
+ * each copy is planned
+ */
+static void boot_manager_plan_verify(BootManager *self, const UpdatePlan *plan)
+{
+        CbmManifestPair *pairs = NULL;
+        NcArray *targets = NULL;
+        size_t n_pairs = 0;
+
+        pairs = calloc((size_t)plan->installs->len * 2 + 1, sizeof(CbmManifestPair));
+        targets = nc_array_new();
+        if (!pairs || !targets) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+                char *kernel_target = NULL;
+                char *initrd_target = NULL;
+                const char *initrd_source = NULL;
+
+                /* Left for planning the copy to report */
+                if (!boot_manager_get_kernel_targets(self,
+                                                     job->kernel,
+                                                     &kernel_target,
+                                                     &initrd_source,
+                                                     &initrd_target)) {
+                        continue;
+                }
+                if (!nc_array_add(targets, kernel_target) ||
+                    (initrd_target && !nc_array_add(targets, initrd_target))) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                pairs[n_pairs++] = (CbmManifestPair){.src = job->kernel->source.path,
+                                                     .dst = kernel_target };
+                if (initrd_source) {
+                        pairs[n_pairs++] = (CbmManifestPair){.src = initrd_source,
+                                                             .dst = initrd_target };
+                }
+        }
+
+        cbm_manifest_verify(self->manifest, pairs, n_pairs, self->jobs);
+        free(pairs);
+        nc_array_free(&targets, free);
+}
+
+/**
+ * Complete the plan by determining which blobs actually need copying and
+ * what must happen to the bootloader itself.
+ */
+static bool boot_manager_plan_finish(BootManager *self, UpdatePlan *plan)
+{
+        NcHashmap *claims = NULL;
+        bool ret = false;
+
+        CBM_TRACE_SCOPE("plan");
+
+        plan->bootloader_install = boot_manager_needs_install(self);
+        /* Comparing the blobs is left to full updates, a kernel changed */
+        if (!plan->bootloader_install && (!self->changed_types || self->verify)) {
+                plan->bootloader_update = boot_manager_needs_update(self);
+        }
+        plan->regenerate_config = streq(self->bootloader->name, "grub2");
+
+        claims = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        OOM_CHECK_RET(claims, false);
+
+        if (self->verify) {
+                boot_manager_plan_verify(self, plan);
+        }
+
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                KernelInstallJob *job = nc_array_get(plan->installs, i);
+                autofree(char) *kernel_target = NULL;
+                autofree(char) *initrd_target = NULL;
+                const char *initrd_source = NULL;
+
+                if (!boot_manager_get_kernel_targets(self,
+                                                     job->kernel,
+                                                     &kernel_target,
+                                                     &initrd_source,
+                                                     &initrd_target)) {
+                        LOG_FATAL("Cannot determine install location for %s",
+                                  job->kernel->source.path);
+                        goto done;
+                }
+
+                job->initrd = initrd_source;
+                job->kernel_bytes = boot_manager_plan_copy(self,
+                                                           job->kernel->source.path,
+                                                           kernel_target,
+                                                           &job->copy_kernel,
+                                                           &job->kernel_replaced);
+                if (job->copy_kernel && !boot_manager_plan_claim(claims, kernel_target, job)) {
+                        job->copy_kernel = false;
+                        job->kernel_bytes = 0;
+                }
+                if (initrd_source) {
+                        job->initrd_bytes = boot_manager_plan_copy(self,
+                                                                   initrd_source,
+                                                                   initrd_target,
+                                                                   &job->copy_initrd,
+                                                                   &job->initrd_replaced);
+                        if (job->copy_initrd &&
+                            !boot_manager_plan_claim(claims, initrd_target, job)) {
+                                job->copy_initrd = false;
+                                job->initrd_bytes = 0;
+                        }
+                }
+                plan->bytes += job->kernel_bytes + job->initrd_bytes;
+        }
+        ret = boot_manager_plan_schedule(self, plan);
+
+done:
+        nc_hashmap_free(claims);
+        return ret;
+}
+
+/**
+ * Render the plan in the line oriented format described for
+ * boot_manager_get_plan
+ */
+static bool boot_manager_plan_describe(BootManager *self, const UpdatePlan *plan)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        uint16_t n_removals = plan->removals ? plan->removals->len : 0;
+        uint16_t n_copies = 0;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        if (plan->bootloader_install) {
+                cbm_writer_append(writer, "bootloader install\n");
+        } else if (plan->bootloader_update) {
+                cbm_writer_append(writer, "bootloader update\n");
+        }
+
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+                const Kernel *k = job->kernel;
+
+                if (job->copy_kernel || job->copy_initrd) {
+                        ++n_copies;
+                        cbm_writer_append_printf(writer,
+                                                 "install %s %s %lld %lld\n",
+                                                 k->meta.ktype,
+                                                 k->source.path,
+                                                 (long long)job->kernel_bytes,
+                                                 (long long)job->initrd_bytes);
+                }
+                cbm_writer_append_printf(writer, "entry %s %s\n", k->meta.ktype, k->source.path);
+        }
+
+        cbm_writer_append_printf(writer,
+                                 "default %s\n",
+                                 plan->default_kernel ? plan->default_kernel->source.path
+                                                      : "timeout");
+        if (plan->regenerate_config) {
+                cbm_writer_append(writer, "config regenerate\n");
+        }
+        if (plan->remove_first) {
+                cbm_writer_append(writer, "schedule remove-first\n");
+        }
+        if (plan->serial) {
+                cbm_writer_append(writer, "schedule serial\n");
+        }
+
+        for (uint16_t i = 0; i < n_removals; i++) {
+                const Kernel *k = nc_array_get(plan->removals, i);
+                cbm_writer_append_printf(writer, "remove %s %s\n", k->meta.ktype, k->source.path);
+        }
+
+        cbm_writer_append_printf(writer,
+                                 "total %lld %u %u\n",
+                                 (long long)plan->bytes,
+                                 (unsigned int)n_copies,
+                                 (unsigned int)n_removals);
+        cbm_writer_close(writer);
+
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        free(self->plan);
+        self->plan = strdup(writer->buffer);
+        OOM_CHECK_RET(self->plan, false);
+        return true;
+}
+
+static void boot_manager_install_job(void *item, void *userdata)
+{
+        KernelInstallJob *job = item;
+        const BootManager *self = userdata;
+        CBM_TRACE_SCOPE("install_blobs");
+        /* Workers log on their own threads, so set up their own fields */
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_PHASE, "install");
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_KERNEL, job->kernel->meta.bpath);
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_KTYPE, job->kernel->meta.ktype);
+
+        /* Planning already established the blobs are up to date, or this
+         * kernel was already installed during this update */
+        if ((!job->copy_kernel && !job->copy_initrd) ||
+            boot_manager_install_done(self, job->kernel)) {
+                cbm_stats_inc(CBM_STAT_KERNELS_SKIPPED);
+                job->installed = true;
+                return;
+        }
+        job->installed = boot_manager_install_kernel_files(self,
+                                                           job->kernel,
+                                                           job->copy_kernel,
+                                                           job->copy_initrd);
+        if (job->installed) {
+                cbm_stats_inc(CBM_STAT_KERNELS_INSTALLED);
+        }
+}
+
+/**
+ * Determine whether @kernel is scheduled for garbage collection
+ */
+static bool boot_manager_plan_removes(const UpdatePlan *plan, const Kernel *kernel)
+{
+        for (uint16_t i = 0; plan->removals && i < plan->removals->len; i++) {
+                if (nc_array_get(plan->removals, i) == kernel) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Hand every kernel to the bootloader at once, letting it bring all of its
+ * entries in line with a single scan. Kernels that are neither installed nor
+ * removed by this update keep their entries as they are.
+ */
+static bool boot_manager_reconcile_kernels(BootManager *self, const UpdatePlan *plan)
+{
+        NcArray *install = NULL;
+        NcArray *keep = NULL;
+        NcArray *jobs = plan->installs;
+        bool ret = false;
+
+        CBM_TRACE_SCOPE("bootloader.reconcile_kernels");
+
+        install = nc_array_new();
+        keep = nc_array_new();
+        if (!install || !keep) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (uint16_t i = 0; i < jobs->len; i++) {
+                KernelInstallJob *job = nc_array_get(jobs, i);
+                const Kernel *k = job->kernel;
+                NcArray *target = keep;
+
+                if (boot_manager_install_done(self, k)) {
+                        LOG_DEBUG("Kernel already installed: %s", k->source.path);
+                } else if (job->installed) {
+                        target = install;
+                } else if (job->required) {
+                        LOG_FATAL("Failed to install kernel (%s) %s",
+                                  k->meta.ktype,
+                                  k->source.path);
+                        goto done;
+                } else {
+                        /* Not necessarily fatal, and its entry may still work */
+                        LOG_ERROR("Failed to repair kernel (%s) %s", k->meta.ktype, k->source.path);
+                }
+                if (!nc_array_add(target, (void *)k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        for (uint16_t i = 0; plan->kernels && i < plan->kernels->len; i++) {
+                const Kernel *k = nc_array_get(plan->kernels, i);
+                bool queued = false;
+
+                for (uint16_t j = 0; j < jobs->len && !queued; j++) {
+                        queued = ((KernelInstallJob *)nc_array_get(jobs, j))->kernel == k;
+                }
+                if (queued || boot_manager_plan_removes(plan, k)) {
+                        continue;
+                }
+                if (!nc_array_add(keep, (void *)k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        if (!self->bootloader->reconcile_kernels(self, install, keep)) {
+                LOG_FATAL("Failed to reconcile the %s loader entries", self->bootloader->name);
+                goto done;
+        }
+
+        for (uint16_t i = 0; i < install->len; i++) {
+                const Kernel *k = nc_array_get(install, i);
+
+                boot_manager_install_record(self, k);
+                LOG_SUCCESS("Installed kernel (%s) %s", k->meta.ktype, k->source.path);
+        }
+        ret = true;
+
+done:
+        nc_array_free(&install, NULL);
+        nc_array_free(&keep, NULL);
+        return ret;
+}
+
+/**
+ * Install every queued kernel. The kernel and initrd blobs are copied
+ * concurrently, and the bootloader is then told about each kernel in turn,
+ * in the order they were queued, or about all of them at once if it can
+ * reconcile its entries.
+ *
+ * @return False if any required kernel failed to install
+ */
+static bool boot_manager_install_kernels(BootManager *self, const UpdatePlan *plan)
+{
+        NcArray *jobs = plan->installs;
+
+        CBM_TRACE_SCOPE("install_kernels");
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_PHASE, "install");
+
+        if (!self->bootloader) {
+                return false;
+        }
+        if (!cbm_is_sysconfig_sane(self->sysconfig)) {
+                return false;
+        }
+
+        cbm_pool_run(jobs, plan->serial ? 1 : self->jobs, boot_manager_install_job, self);
+
+        /* A shared blob is only there if the job copying it succeeded */
+        for (uint16_t i = 0; i < jobs->len; i++) {
+                KernelInstallJob *job = nc_array_get(jobs, i);
+
+                if (job->owner && !job->owner->installed) {
+                        job->installed = false;
+                }
+        }
+
+        if (self->bootloader->reconcile_kernels) {
+                return boot_manager_reconcile_kernels(self, plan);
+        }
+
+        for (uint16_t i = 0; i < jobs->len; i++) {
+                KernelInstallJob *job = nc_array_get(jobs, i);
+                const Kernel *k = job->kernel;
+
+                if (boot_manager_install_done(self, k)) {
+                        LOG_DEBUG("Kernel already installed: %s", k->source.path);
+                        continue;
+                }
+                if (job->installed && boot_manager_bootloader_install_kernel(self, k)) {
+                        boot_manager_install_record(self, k);
+                        LOG_SUCCESS("Installed kernel (%s) %s", k->meta.ktype, k->source.path);
+                        continue;
+                }
+                if (job->required) {
+                        LOG_FATAL("Failed to install kernel (%s) %s",
+                                  k->meta.ktype,
+                                  k->source.path);
+                        return false;
+                }
+                /* Not necessarily fatal. */
+                LOG_ERROR("Failed to repair kernel (%s) %s", k->meta.ktype, k->source.path);
+        }
+
+        return true;
+}
+
+/**
+ * Start reading every source that will be copied, so that the reads overlap
+ * with the bootloader work rather than following it
+ */
+static void boot_manager_plan_prefetch(const UpdatePlan *plan)
+{
+        CBM_TRACE_SCOPE("prefetch");
+
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+
+                if (job->copy_kernel) {
+                        cbm_file_prefetch(job->kernel->source.path);
+                }
+                if (job->copy_initrd && job->initrd) {
+                        cbm_file_prefetch(job->initrd);
+                }
+        }
+}
+
+/**
+ * Garbage collect the blob store, once every entry the plan touched is
+ * written and every kernel it removes is gone
+ */
+static bool boot_manager_plan_collect_blobs(BootManager *self, const UpdatePlan *plan)
+{
+        NcArray *installed = NULL;
+        NcArray *kept = NULL;
+        bool ret = false;
+
+        CBM_TRACE_SCOPE("collect_blobs");
+
+        installed = nc_array_new();
+        kept = nc_array_new();
+        if (!installed || !kept) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (uint16_t i = 0; plan->kernels && i < plan->kernels->len; i++) {
+                const Kernel *k = nc_array_get(plan->kernels, i);
+                NcArray *target = kept;
+
+                if (boot_manager_plan_removes(plan, k)) {
+                        continue;
+                }
+                for (uint16_t j = 0; j < plan->installs->len; j++) {
+                        const KernelInstallJob *job = nc_array_get(plan->installs, j);
+                        if (job->kernel == k && job->installed) {
+                                target = installed;
+                                break;
+                        }
+                }
+                if (!nc_array_add(target, (void *)k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        ret = boot_manager_collect_blobs(self, installed, kept);
+        nc_array_free(&installed, NULL);
+        nc_array_free(&kept, NULL);
+        return ret;
+}
+
+/**
+ * Remove the recompressed initrds that only kernels the plan removed used.
+ * Left to full updates, which see every kernel there is.
+ */
+static void boot_manager_plan_collect_initrds(BootManager *self, const UpdatePlan *plan)
+{
+        KernelArray *kept = NULL;
+
+        kept = nc_array_new();
+        if (!kept) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (uint16_t i = 0; plan->kernels && i < plan->kernels->len; i++) {
+                const Kernel *k = nc_array_get(plan->kernels, i);
+
+                if (!boot_manager_plan_removes(plan, k) && !nc_array_add(kept, (void *)k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        boot_manager_collect_packed_initrds(self, kept);
+        nc_array_free(&kept, NULL);
+}
+
+/**
+ * Forget the boots of every kernel the plan removed
+ */
+static void boot_manager_plan_compact_ledger(BootManager *self, const UpdatePlan *plan)
+{
+        NcArray *kept = NULL;
+
+        kept = nc_array_new();
+        if (!kept) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (uint16_t i = 0; plan->kernels && i < plan->kernels->len; i++) {
+                Kernel *k = nc_array_get(plan->kernels, i);
+
+                if (boot_manager_plan_removes(plan, k)) {
+                        continue;
+                }
+                if (!nc_array_add(kept, k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        boot_manager_compact_boot_ledger(self, kept);
+        nc_array_free(&kept, NULL);
+}
+
+/**
+ * Garbage collect the old kernels
+ */
+static bool boot_manager_plan_remove(BootManager *self, const UpdatePlan *plan)
+{
+        if (!plan->removals) {
+                LOG_DEBUG("No kernel removals found");
+                return true;
+        }
+
+        CBM_TRACE_SCOPE("remove_kernels");
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_PHASE, "remove");
+        for (uint16_t i = 0; i < plan->removals->len; i++) {
+                Kernel *k = nc_array_get(plan->removals, i);
+                CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_KERNEL, k->meta.bpath);
+                CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_KTYPE, k->meta.ktype);
+                LOG_INFO("Garbage collecting %s: %s", k->meta.ktype, k->source.path);
+        }
+
+        /* All at once, so the bootloader only scans its entries once */
+        if (!boot_manager_remove_kernels(self, plan->removals)) {
+                LOG_ERROR("Failed to remove %u kernels", (unsigned int)plan->removals->len);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Install or update the bootloader as planned. Every ESP shares the boot
+ * variables of the firmware, which the bootloader reads afresh and then
+ * rewrites, so mirrors updated concurrently take turns.
+ */
+static bool boot_manager_plan_bootloader(BootManager *self, const UpdatePlan *plan)
+{
+        static pthread_mutex_t firmware_lock = PTHREAD_MUTEX_INITIALIZER;
+        int flags = BOOTLOADER_OPERATION_NO_CHECK;
+        bool ret = false;
+
+        if (plan->bootloader_install) {
+                flags |= BOOTLOADER_OPERATION_INSTALL;
+        } else if (plan->bootloader_update) {
+                flags |= BOOTLOADER_OPERATION_UPDATE;
+        } else {
+                return true;
+        }
+
+        pthread_mutex_lock(&firmware_lock);
+        ret = boot_manager_modify_bootloader(self, flags);
+        pthread_mutex_unlock(&firmware_lock);
+        if (!ret) {
+                LOG_FATAL("Failed to %s bootloader",
+                          plan->bootloader_install ? "install" : "update");
+        }
+        return ret;
+}
+
+/**
+ * Everything up to and including the new default, while the configuration
+ * is staged
+ */
+static bool boot_manager_plan_switch(BootManager *self, const UpdatePlan *plan)
+{
+        const Kernel *new_default = plan->default_kernel;
+
+        if (!boot_manager_plan_bootloader(self, plan)) {
+                return false;
+        }
+        LOG_SUCCESS("Bootloader is up to date");
+
+        if (plan->remove_first && !boot_manager_plan_remove(self, plan)) {
+                return false;
+        }
+
+        /* Copy everything over before touching the default */
+        if (!boot_manager_install_kernels(self, plan)) {
+                return false;
+        }
+        LOG_SUCCESS("Installed %d kernels (%lld bytes copied)",
+                    plan->installs->len,
+                    (long long)plan->bytes);
+
+        if (!boot_manager_set_default_kernel(self, new_default)) {
+                LOG_ERROR("Failed to set the default kernel to: %s",
+                          new_default ? new_default->source.path : "<timeout mode>");
+                return false;
+        }
+        if (new_default) {
+                LOG_SUCCESS("Default kernel for %s is %s",
+                            new_default->meta.ktype,
+                            new_default->source.path);
+        }
+
+        return true;
+}
+
+/**
+ * Carry out a completed plan: bootloader first, then the kernels, then the
+ * new default and finally garbage collection of old kernels. When space is
+ * short, the old kernels are removed before the kernels are installed.
+ *
+ * The loader entries and configuration are staged as they're written, and
+ * only switched over once the new default is set. A failure before then
+ * leaves the previous configuration in place.
+ */
+static bool boot_manager_plan_execute(BootManager *self, const UpdatePlan *plan)
+{
+        autofree(char) *boot_dir = NULL;
+        CbmTraceSpan span = { 0 };
+        bool switched = false;
+
+        boot_manager_plan_prefetch(plan);
+
+        boot_dir = boot_manager_get_boot_dir(self);
+        if (!boot_dir) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        /* Only now is anything changed, so only now is there anything to resume */
+        cbm_manifest_journal_begin(self->manifest, self->plan);
+        cbm_stage_begin(self->stage, boot_dir);
+        if (!boot_manager_plan_switch(self, plan)) {
+                cbm_stage_discard(self->stage);
+                return false;
+        }
+        span = cbm_trace_begin("switch");
+        switched = cbm_stage_commit(self->stage);
+        cbm_trace_end(&span);
+        if (!switched) {
+                LOG_FATAL("Failed to switch over to the new boot configuration");
+                return false;
+        }
+
+        /* Now remove the older kernels */
+        if (!plan->remove_first && !boot_manager_plan_remove(self, plan)) {
+                return false;
+        }
+
+        /* Not fatal, unreferenced blobs are collected again next time */
+        if (!boot_manager_plan_collect_blobs(self, plan)) {
+                LOG_WARNING("Failed to collect unused blobs");
+        }
+
+        /* The root is left to the boot device's own update */
+        if (self->parent) {
+                return true;
+        }
+        if (!self->changed_types) {
+                boot_manager_plan_collect_initrds(self, plan);
+        }
+        boot_manager_plan_compact_ledger(self, plan);
+
+        return true;
+}
+
+/**
+ * Settle which initrd each kernel installs, recompressing any the policy of
+ * the root asks for that haven't been already. A dry run only installs what
+ * an earlier update recompressed.
+ */
+static bool boot_manager_plan_pack_initrds(BootManager *self, const UpdatePlan *plan)
+{
+        CbmInitrdPolicy policy = { 0 };
+
+        CBM_TRACE_SCOPE("pack_initrds");
+
+        if (!boot_manager_load_initrd_policy(self, &policy)) {
+                LOG_WARNING("Installing initrds as they are");
+        }
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+
+                if (!boot_manager_pack_initrd(self,
+                                              &policy,
+                                              (Kernel *)job->kernel,
+                                              !self->dry_run)) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Settle the blobs of every kernel and where they're installed, once for
+ * the boot device and each mirrored ESP alike. The kernels are shared by
+ * every ESP, so they never change while the mirrors are updated.
+ */
+static bool boot_manager_plan_settle(BootManager *self, UpdatePlan *plan)
+{
+        if (plan->settled) {
+                return true;
+        }
+        if (!boot_manager_plan_pack_initrds(self, plan)) {
+                return false;
+        }
+        /* Our kernels, so we're free to retarget them */
+        for (uint16_t i = 0; i < plan->installs->len; i++) {
+                const KernelInstallJob *job = nc_array_get(plan->installs, i);
+
+                boot_manager_share_kernel(self, (Kernel *)job->kernel, self->dedup);
+        }
+        plan->settled = true;
+        return true;
+}
+
+/**
+ * Finish the plan and either execute it, or just describe it for a dry run
+ */
+static bool boot_manager_plan_run(BootManager *self, UpdatePlan *plan)
+{
+        if (!boot_manager_plan_settle(self, plan)) {
+                return false;
+        }
+        if (!boot_manager_plan_finish(self, plan)) {
+                return false;
+        }
+        if (!boot_manager_plan_describe(self, plan)) {
+                return false;
+        }
+        if (self->dry_run) {
+                LOG_INFO("Dry run, not applying the update plan");
+                return true;
+        }
+        return boot_manager_plan_execute(self, plan);
+}
+
+/**
+ * Start tracking installed files on the boot partition, so that unchanged
+ * files can be detected without reading them back. Source digests are only
+ * persisted for the native filesystem, never inside an image, and only by
+ * the boot device's update, which mirrors share them with.
+ */
+static void boot_manager_open_manifest(BootManager *self)
+{
+        autofree(char) *boot_dir = NULL;
+        autofree(char) *digest_cache = NULL;
+
+        boot_dir = boot_manager_get_boot_dir(self);
+        if (!boot_dir) {
+                return;
+        }
+        if (!boot_manager_is_image_mode(self) && !self->parent) {
+                digest_cache = string_printf("%s/%s",
+                                             self->sysconfig->prefix,
+                                             CBM_DIGEST_CACHE_PATH);
+        }
+        cbm_manifest_open(self->manifest, boot_dir, digest_cache, self->verify);
+}
+
+/**
+ * A dry run must leave no trace, so anything learned is discarded
+ */
+static void boot_manager_close_manifest(BootManager *self)
+{
+        if (self->dry_run) {
+                cbm_manifest_discard(self->manifest);
+        } else {
+                cbm_manifest_close(self->manifest);
+        }
+}
+
+/**
+ * Plan and apply @plan against the current boot directory, tracking what's
+ * installed there in its manifest
+ */
+static bool boot_manager_plan_apply(BootManager *self, UpdatePlan *plan)
+{
+        bool ret = false;
+
+        boot_manager_open_manifest(self);
+        boot_manager_installs_begin(self);
+        ret = boot_manager_plan_run(self, plan);
+        boot_manager_installs_end(self);
+        boot_manager_close_manifest(self);
+        return ret;
+}
+
+/**
+ * Find or mount every mirrored ESP. Each is left mounted until the update
+ * has been flushed, since the flush happens once at the very end.
+ *
+ * @return a newly allocated array of @n_mirrors entries, NULL if none
+ */
+static BootMirror *boot_manager_mount_mirrors(BootManager *self, uint16_t *n_mirrors)
+{
+        NcArray *devices = self->sysconfig->boot_mirrors;
+        BootMirror *mirrors = NULL;
+        CbmTraceSpan span = { 0 };
+
+        *n_mirrors = 0;
+        if (!devices || devices->len == 0) {
+                return NULL;
+        }
+        mirrors = calloc(devices->len, sizeof(BootMirror));
+        if (!mirrors) {
+                DECLARE_OOM();
+                abort();
+        }
+        *n_mirrors = devices->len;
+
+        for (uint16_t i = 0; i < devices->len; i++) {
+                BootMirror *m = &mirrors[i];
+                autofree(char) *dir = NULL;
+
+                m->device = nc_array_get(devices, i);
+                m->boot_dir = cbm_system_get_mountpoint_for_device(m->device);
+                if (m->boot_dir) {
+                        LOG_DEBUG("Mirrored ESP %s already mounted at %s", m->device, m->boot_dir);
+                        continue;
+                }
+
+                dir = string_printf("%s/%s/%u",
+                                    cbm_system_get_runtime_path(),
+                                    CBM_UPDATE_MIRROR_DIR,
+                                    (unsigned int)i);
+                if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                        LOG_ERROR("Cannot create %s: %s", dir, strerror(errno));
+                        continue;
+                }
+                LOG_INFO("Mounting mirrored ESP %s at %s", m->device, dir);
+                span = cbm_trace_begin("mount");
+                if (cbm_system_mount(m->device, dir, "vfat", MS_MGC_VAL, "") < 0) {
+                        LOG_ERROR("Cannot mount mirrored ESP %s on %s: %s",
+                                  m->device,
+                                  dir,
+                                  strerror(errno));
+                        cbm_trace_end(&span);
+                        continue;
+                }
+                cbm_trace_end(&span);
+                m->boot_dir = dir;
+                m->did_mount = true;
+                dir = NULL;
+        }
+        return mirrors;
+}
+
+static void boot_manager_umount_mirrors(BootMirror *mirrors, uint16_t n_mirrors)
+{
+        CbmTraceSpan span = { 0 };
+
+        for (uint16_t i = 0; i < n_mirrors; i++) {
+                if (mirrors[i].did_mount) {
+                        span = cbm_trace_begin("umount");
+                        if (cbm_system_umount(mirrors[i].boot_dir) < 0) {
+                                LOG_WARNING("Could not unmount %s", mirrors[i].boot_dir);
+                        }
+                        cbm_trace_end(&span);
+                }
+                free(mirrors[i].boot_dir);
+        }
+        free(mirrors);
+}
+
+/**
+ * The update of a single mirrored ESP, run alongside the others
+ */
+typedef struct MirrorJob {
+        const BootMirror *mirror; /**<ESP to update */
+        BootManager *manager;     /**<Manager of the ESP, NULL if it can't be set up */
+        UpdatePlan plan;          /**<Copy of the kernel selection for the ESP */
+        bool updated;             /**<Set by the worker */
+} MirrorJob;
+
+static void boot_manager_mirror_job(void *item, __cbm_unused__ void *userdata)
+{
+        MirrorJob *job = item;
+
+        LOG_INFO("Updating mirrored ESP %s", job->mirror->device);
+        if (job->manager) {
+                job->updated = boot_manager_plan_apply(job->manager, &job->plan);
+        }
+        if (job->updated) {
+                LOG_SUCCESS("Mirrored ESP %s is up to date", job->mirror->device);
+        } else {
+                LOG_ERROR("Failed to update mirrored ESP %s", job->mirror->device);
+        }
+}
+
+/**
+ * Apply the kernel selection already made for the boot device to every
+ * mirrored ESP at once, each through a manager of its own sharing the
+ * kernels and source digests of this one, and report the outcome for
+ * every ESP in order. The jobs are divided between the mirrors.
+ *
+ * @param primary Whether the boot device itself was updated
+ * @return True if every ESP was updated
+ */
+static bool boot_manager_update_mirrors(BootManager *self, UpdatePlan *plan,
+                                        BootMirror *mirrors, uint16_t n_mirrors, bool primary)
 {
-        const Kernel *ka = *(const Kernel **)a;
-        const Kernel *kb = *(const Kernel **)b;
+        autofree(CbmWriter) *plans = CBM_WRITER_INIT;
+        autofree(CbmWriter) *report = CBM_WRITER_INIT;
+        const char *device = self->sysconfig->boot_device;
+        unsigned int workers = self->jobs < n_mirrors ? self->jobs : n_mirrors;
+        NcArray *jobs = NULL;
+        bool settled = false;
+        bool ret = primary;
+
+        if (!cbm_writer_open(plans) || !cbm_writer_open(report)) {
+                DECLARE_OOM();
+                return false;
+        }
+        jobs = nc_array_new();
+        if (!jobs) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        cbm_writer_append_printf(plans, "esp %s\n%s", device, self->plan ? self->plan : "");
+        cbm_writer_append_printf(report, "esp %s %s\n", device, primary ? "updated" : "failed");
+
+        /* Left unsettled if the boot device failed early on */
+        settled = boot_manager_plan_settle(self, plan);
+        for (uint16_t i = 0; i < n_mirrors; i++) {
+                MirrorJob *job = calloc(1, sizeof(MirrorJob));
+
+                if (!job || !nc_array_add(jobs, job)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                job->mirror = &mirrors[i];
+                boot_manager_plan_clone(plan, &job->plan);
+                if (settled && mirrors[i].boot_dir) {
+                        job->manager = boot_manager_new_mirror(self,
+                                                               mirrors[i].boot_dir,
+                                                               self->jobs / workers);
+                }
+        }
+
+        cbm_pool_run(jobs, workers, boot_manager_mirror_job, NULL);
+
+        for (uint16_t i = 0; i < jobs->len; i++) {
+                MirrorJob *job = nc_array_get(jobs, i);
+                const char *mirror_plan = job->manager ? job->manager->plan : NULL;
+
+                ret = job->updated && ret;
+                cbm_writer_append_printf(plans,
+                                         "esp %s\n%s",
+                                         job->mirror->device,
+                                         mirror_plan ? mirror_plan : "");
+                cbm_writer_append_printf(report,
+                                         "esp %s %s\n",
+                                         job->mirror->device,
+                                         job->updated ? "updated" : "failed");
+                boot_manager_free(job->manager);
+                boot_manager_plan_free(&job->plan);
+        }
+        nc_array_free(&jobs, free);
 
-        if (ka->meta.release > kb->meta.release) {
-                return -1;
+        cbm_writer_close(plans);
+        cbm_writer_close(report);
+        if (cbm_writer_error(plans) != 0 || cbm_writer_error(report) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
+        free(self->plan);
+        self->plan = strdup(plans->buffer);
+        self->report = strdup(report->buffer);
+        if (!self->plan || !self->report) {
+                DECLARE_OOM();
+                abort();
         }
-        return 1;
+        return ret;
 }
 
-bool boot_manager_update(BootManager *self)
+/**
+ * Unmount a boot directory mounted by boot_manager_mount_boot_dir, which
+ * must all be flushed by now, or leave it in place for further updates
+ * when @keep is set.
+ *
+ * @param mounted Boot directory we mounted, freed or kept, or NULL
+ */
+static void boot_manager_umount_boot_dir(BootManager *self, char *mounted, bool keep)
+{
+        CbmTraceSpan span = { 0 };
+
+        if (!mounted) {
+                return;
+        }
+        if (keep) {
+                LOG_INFO("Keeping %s mounted for further updates", mounted);
+                free(self->kept_mount);
+                self->kept_mount = mounted;
+                return;
+        }
+        LOG_INFO("Attempting umount of %s", mounted);
+        span = cbm_trace_begin("umount");
+        if (cbm_system_umount(mounted) < 0) {
+                LOG_WARNING("Could not unmount boot directory");
+        }
+        cbm_trace_end(&span);
+        LOG_SUCCESS("Unmounted boot directory");
+        free(mounted);
+}
+
+/**
+ * Ensure the boot directory of the native system is mounted, mounting the
+ * boot device unless it's already mounted somewhere, and reinitialise the
+ * bootloader for wherever that is. Legacy boot directories live on the root
+ * and are never mounted.
+ *
+ * @param mounted Set to the boot directory mounted here, to be handed to
+ * boot_manager_umount_boot_dir, or NULL if nothing was mounted
+ */
+static bool boot_manager_mount_boot_dir(BootManager *self, char **mounted)
 {
-        assert(self != NULL);
-        bool ret = false;
         autofree(char) *boot_dir = NULL;
-        bool did_mount = false;
-        char *root_base = NULL;
         autofree(char) *abs_bootdir = NULL;
+        char *root_base = NULL;
+        CbmTraceSpan span = { 0 };
+        int mount_ret = 0;
 
-        /* Image mode is very simple, no prep/cleanup */
-        if (boot_manager_is_image_mode(self)) {
-                LOG_DEBUG("Skipping to image-update");
-                return boot_manager_update_image(self);
-        }
+        *mounted = NULL;
 
         /* TODO: decide how legacy device detection works */
         /* For now legacy means /boot is on the / partition */
         if ((self->sysconfig->wanted_boot_mask & BOOTLOADER_CAP_LEGACY) == BOOTLOADER_CAP_LEGACY) {
                 LOG_DEBUG("Skipping to legacy-native-install (no mount)");
-                goto perform;
+                return true;
         }
 
         /* Get our boot directory */
@@ -76,7 +1390,7 @@ bool boot_manager_update(BootManager *self)
         /* Already mounted at the default boot dir, nothing for us to do */
         if (cbm_system_is_mounted(boot_dir)) {
                 LOG_INFO("boot_dir is already mounted: %s", boot_dir);
-                goto perform;
+                return true;
         }
 
         /* Determine root device */
@@ -97,16 +1411,19 @@ bool boot_manager_update(BootManager *self)
                 }
                 /* Successfully using their premounted ESP, go use it */
                 LOG_INFO("Skipping to native update");
-                goto perform;
+                return true;
         }
 
         /* The boot directory isn't mounted, so we'll mount it now */
-        if (!nc_file_exists(boot_dir)) {
+        if (!cbm_file_exists(boot_dir)) {
                 LOG_INFO("Creating boot dir");
                 nc_mkdir_p(boot_dir, 0755);
         }
         LOG_INFO("Mounting boot device %s at %s", root_base, boot_dir);
-        if (cbm_system_mount(root_base, boot_dir, "vfat", MS_MGC_VAL, "") < 0) {
+        span = cbm_trace_begin("mount");
+        mount_ret = cbm_system_mount(root_base, boot_dir, "vfat", MS_MGC_VAL, "");
+        cbm_trace_end(&span);
+        if (mount_ret < 0) {
                 LOG_FATAL("FATAL: Cannot mount boot device %s on %s: %s",
                           root_base,
                           boot_dir,
@@ -114,34 +1431,349 @@ bool boot_manager_update(BootManager *self)
                 return false;
         }
         LOG_SUCCESS("%s successfully mounted at %s", root_base, boot_dir);
-        did_mount = true;
+        *mounted = boot_dir;
+        boot_dir = NULL;
 
         /* Reinit bootloader for non-image mode with newly mounted boot partition
          * as it may have paths that already exist, and we must adjust for case
          * sensitivity (ignorant) issues
          */
-        if (!boot_manager_set_boot_dir(self, boot_dir)) {
+        if (!boot_manager_set_boot_dir(self, *mounted)) {
                 LOG_FATAL("Cannot initialise with newly mounted ESP");
+                boot_manager_umount_boot_dir(self, *mounted, false);
+                *mounted = NULL;
                 return false;
         }
+        return true;
+}
 
-perform:
-        /* Do a native update */
-        ret = boot_manager_update_native(self);
+/**
+ * Perform one complete update, mounting the boot device as needed
+ */
+static bool boot_manager_update_pass(BootManager *self)
+{
+        assert(self != NULL);
+        bool ret = false;
+        char *boot_dir = NULL;
+        CbmTraceSpan span = { 0 };
+        BootMirror *mirrors = NULL;
+        uint16_t n_mirrors = 0;
+
+        CBM_TRACE_SCOPE("update");
+
+        /* Never report a stale plan */
+        free(self->plan);
+        self->plan = NULL;
+        free(self->report);
+        self->report = NULL;
+
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return false;
+        }
 
-        /* Cleanup and umount */
-        if (did_mount) {
-                LOG_INFO("Attempting umount of %s", boot_dir);
-                if (cbm_system_umount(boot_dir) < 0) {
-                        LOG_WARNING("Could not unmount boot directory");
+        /* Image mode is very simple, no prep/cleanup */
+        if (boot_manager_is_image_mode(self)) {
+                LOG_DEBUG("Skipping to image-update");
+                cbm_sync_phase_begin();
+                ret = boot_manager_update_image(self);
+                span = cbm_trace_begin("sync");
+                if (!cbm_sync_phase_end()) {
+                        LOG_ERROR("Failed to flush changes to disk");
+                        ret = false;
                 }
-                LOG_SUCCESS("Unmounted boot directory");
+                cbm_trace_end(&span);
+                return ret;
+        }
+
+        if (!boot_manager_mount_boot_dir(self, &boot_dir)) {
+                return false;
+        }
+
+        mirrors = boot_manager_mount_mirrors(self, &n_mirrors);
+
+        /* Do a native update */
+        cbm_sync_phase_begin();
+        ret = boot_manager_update_native(self, mirrors, n_mirrors);
+
+        /* Everything must be on disk before we consider umounting */
+        span = cbm_trace_begin("sync");
+        if (!cbm_sync_phase_end()) {
+                LOG_ERROR("Failed to flush changes to disk");
+                ret = false;
         }
+        cbm_trace_end(&span);
+        boot_manager_umount_mirrors(mirrors, n_mirrors);
+
+        /* Cleanup and umount, unless asked to keep the caches warm */
+        boot_manager_umount_boot_dir(self, boot_dir, self->keep_mounted);
 
         /* Done */
         return ret;
 }
 
+bool boot_manager_has_kept_mount(BootManager *self)
+{
+        assert(self != NULL);
+
+        return self->kept_mount != NULL;
+}
+
+bool boot_manager_release_mount(BootManager *self)
+{
+        assert(self != NULL);
+        autofree(char) *boot_dir = self->kept_mount;
+        CbmTraceSpan span = { 0 };
+        bool ret = true;
+
+        if (!boot_dir) {
+                return true;
+        }
+        self->kept_mount = NULL;
+
+        LOG_INFO("Attempting umount of %s", boot_dir);
+        span = cbm_trace_begin("umount");
+        if (cbm_system_umount(boot_dir) < 0) {
+                LOG_WARNING("Could not unmount boot directory");
+                ret = false;
+        } else {
+                LOG_SUCCESS("Unmounted boot directory");
+        }
+        cbm_trace_end(&span);
+        return ret;
+}
+
+/**
+ * Work out the I/O policy for this update, from the command line if given
+ * and otherwise from the io-policy file
+ */
+static bool boot_manager_load_io_policy(BootManager *self, CbmIoPolicy *policy)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+
+        *policy = (CbmIoPolicy){ 0 };
+
+        if (self->io_policy) {
+                return cbm_io_policy_parse(self->io_policy, policy);
+        }
+        if (!self->sysconfig) {
+                return true;
+        }
+
+        path = string_printf("%s%s/io-policy", self->sysconfig->prefix, KERNEL_CONF_DIRECTORY);
+        if (!nc_file_exists(path)) {
+                return true;
+        }
+        if (!file_get_text(path, &text)) {
+                LOG_ERROR("Unable to read %s: %s", path, strerror(errno));
+                return false;
+        }
+        if (!cbm_io_policy_parse(text, policy)) {
+                LOG_ERROR("Invalid I/O policy in %s", path);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Apply the configured timeout to each of the @mirrors as well, each
+ * through a manager of its own, and report the outcome for every ESP
+ *
+ * @param primary Whether the timeout was applied to the boot device
+ * @return True if every ESP has the timeout
+ */
+static bool boot_manager_timeout_mirrors(BootManager *self, BootMirror *mirrors,
+                                         uint16_t n_mirrors, bool primary)
+{
+        autofree(CbmWriter) *report = CBM_WRITER_INIT;
+        const char *device = self->sysconfig->boot_device;
+        bool ret = primary;
+
+        if (!cbm_writer_open(report)) {
+                DECLARE_OOM();
+                return false;
+        }
+        cbm_writer_append_printf(report, "esp %s %s\n", device, primary ? "updated" : "failed");
+
+        for (uint16_t i = 0; i < n_mirrors; i++) {
+                const BootMirror *m = &mirrors[i];
+                autofree(BootManager) *mirror = NULL;
+                bool updated = false;
+
+                LOG_INFO("Applying the timeout to mirrored ESP %s", m->device);
+                if (m->boot_dir) {
+                        mirror = boot_manager_new_mirror(self, m->boot_dir, 1);
+                }
+                updated = mirror && self->bootloader->set_timeout(mirror);
+                if (!updated) {
+                        LOG_ERROR("Failed to apply the timeout to mirrored ESP %s", m->device);
+                }
+                ret = updated && ret;
+                cbm_writer_append_printf(report,
+                                         "esp %s %s\n",
+                                         m->device,
+                                         updated ? "updated" : "failed");
+        }
+
+        cbm_writer_close(report);
+        if (cbm_writer_error(report) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
+        self->report = strdup(report->buffer);
+        if (!self->report) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+/**
+ * Apply the configured timeout, as boot_manager_update_pass would, on the
+ * bootloader configuration alone of the boot device and every mirror
+ */
+static bool boot_manager_timeout_pass(BootManager *self)
+{
+        char *boot_dir = NULL;
+        CbmTraceSpan span = { 0 };
+        BootMirror *mirrors = NULL;
+        uint16_t n_mirrors = 0;
+        bool ret = false;
+
+        CBM_TRACE_SCOPE("apply_timeout");
+
+        free(self->report);
+        self->report = NULL;
+
+        if (!boot_manager_require(self, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return false;
+        }
+        if (!self->bootloader->set_timeout) {
+                LOG_DEBUG("%s has no timeout of its own to apply", self->bootloader->name);
+                return true;
+        }
+        if (!boot_manager_is_image_mode(self)) {
+                if (!boot_manager_mount_boot_dir(self, &boot_dir)) {
+                        return false;
+                }
+                mirrors = boot_manager_mount_mirrors(self, &n_mirrors);
+        }
+
+        cbm_sync_phase_begin();
+        ret = self->bootloader->set_timeout(self);
+        if (n_mirrors > 0) {
+                ret = boot_manager_timeout_mirrors(self, mirrors, n_mirrors, ret);
+        }
+        span = cbm_trace_begin("sync");
+        if (!cbm_sync_phase_end()) {
+                LOG_ERROR("Failed to flush changes to disk");
+                ret = false;
+        }
+        cbm_trace_end(&span);
+        boot_manager_umount_mirrors(mirrors, n_mirrors);
+
+        boot_manager_umount_boot_dir(self, boot_dir, self->keep_mounted);
+        return ret;
+}
+
+/**
+ * Run @first_pass, and then as many update passes as were requested
+ * meanwhile, holding the update lock throughout
+ */
+static bool boot_manager_update_serialised(BootManager *self,
+                                           bool (*first_pass)(BootManager *self))
+{
+        CbmUpdateLock lock = {.fd = -1 };
+        autofree(char) *lock_dir = NULL;
+        bool ret = false;
+
+        self->deferred = false;
+
+        /* Plans and images are private to this invocation */
+        if (self->dry_run || boot_manager_is_image_mode(self)) {
+                return first_pass(self);
+        }
+
+        lock_dir = string_printf("%s/%s", cbm_system_get_runtime_path(), CBM_UPDATE_LOCK_DIR);
+        switch (cbm_update_lock_enter(&lock, lock_dir, self->wait)) {
+        case CBM_UPDATE_LOCK_ACQUIRED:
+                break;
+        case CBM_UPDATE_LOCK_BUSY:
+                /* Nothing reports back should the running update fail */
+                LOG_WARNING("Left to the running update, which may still fail to apply it");
+                self->deferred = true;
+                return true;
+        case CBM_UPDATE_LOCK_SERVED:
+                return true;
+        default:
+                /* Better an uncoordinated update than none at all */
+                LOG_WARNING("Updating without coordinating with other updates");
+                return first_pass(self);
+        }
+
+        /* Each pass covers every request made before it began, so however
+         * many arrive during a pass, at most one more is needed */
+        for (;;) {
+                uint64_t generation = cbm_update_lock_begin_pass(&lock);
+                bool full = first_pass == boot_manager_update_pass && !self->changed_types;
+
+                ret = first_pass(self);
+                /* A pass limited to some kernel types, or to the timeout,
+                 * serves nobody else */
+                if (!cbm_update_lock_end_pass(&lock, generation, ret && full)) {
+                        break;
+                }
+                first_pass = boot_manager_update_pass;
+                LOG_INFO("Another update was requested meanwhile, updating again");
+                boot_manager_refresh(self);
+                /* Those requests may have been for any kernel */
+                if (self->changed_types) {
+                        nc_hashmap_free(self->changed_types);
+                        self->changed_types = NULL;
+                }
+        }
+
+        return ret;
+}
+
+/**
+ * Run @first_pass serialised with other updates, under the I/O policy
+ */
+static bool boot_manager_run_update(BootManager *self, bool (*first_pass)(BootManager *self))
+{
+        CbmIoPolicy policy = { 0 };
+        bool ret = false;
+
+        /* A broken policy only costs us the throttling, never the update */
+        if (!boot_manager_load_io_policy(self, &policy)) {
+                LOG_WARNING("Ignoring the I/O policy");
+                policy = (CbmIoPolicy){ 0 };
+        }
+
+        cbm_set_io_policy(&policy);
+        ret = boot_manager_update_serialised(self, first_pass);
+        cbm_set_io_policy(NULL);
+
+        /* Long-lived callers shouldn't sit on the outcome until they exit */
+        cbm_log_flush();
+
+        return ret;
+}
+
+bool boot_manager_update(BootManager *self)
+{
+        assert(self != NULL);
+
+        return boot_manager_run_update(self, boot_manager_update_pass);
+}
+
+bool boot_manager_apply_timeout(BootManager *self)
+{
+        assert(self != NULL);
+
+        return boot_manager_run_update(self, boot_manager_timeout_pass);
+}
+
 /**
  * Update the target with logical view of an image creation
  *
@@ -158,7 +1790,11 @@ static bool boot_manager_update_image(BootManager *self)
         assert(self != NULL);
         autofree(KernelArray) *kernels = NULL;
         autofree(char) *boot_dir = NULL;
-        const Kernel *default_kernel = NULL;
+        UpdatePlan plan = { 0 };
+        bool ret = false;
+
+        CBM_TRACE_SCOPE("update_image");
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_PHASE, "plan");
 
         LOG_DEBUG("Now beginning update_image");
 
@@ -179,7 +1815,7 @@ static bool boot_manager_update_image(BootManager *self)
         }
 
         /* If it doesn't exist this is a user error */
-        if (!nc_file_exists(boot_dir)) {
+        if (!cbm_file_exists(boot_dir)) {
                 LOG_ERROR("Cannot find boot directory, ensure it is mounted: %s", boot_dir);
                 return false;
         }
@@ -193,55 +1829,53 @@ static bool boot_manager_update_image(BootManager *self)
         }
 
         /* Sort them to find the newest kernel */
-        nc_array_qsort(kernels, kernel_compare_reverse);
+        boot_manager_sort_kernels(kernels);
 
-        LOG_INFO("update_image: Attempting bootloader update");
-        if (!boot_manager_update_bootloader(self)) {
-                return false;
-        }
-        LOG_SUCCESS("update_image: Bootloader update successful");
+        plan.installs = nc_array_new();
+        OOM_CHECK_RET(plan.installs, false);
+        plan.kernels = kernels;
 
-        /* Go ahead and install the kernels */
+        /* Every kernel is installed, of the changed types if limited */
         for (uint16_t i = 0; i < kernels->len; i++) {
                 const Kernel *k = nc_array_get(kernels, i);
-                LOG_DEBUG("update_image: Attempting install of %s", k->source.path);
-                if (!boot_manager_install_kernel(self, k)) {
-                        LOG_FATAL("Cannot install kernel %s", k->source.path);
-                        return false;
+                if (!boot_manager_update_covers(self, k->meta.ktype)) {
+                        continue;
                 }
-                LOG_SUCCESS("update_image: Successfully installed %s", k->source.path);
+                LOG_DEBUG("update_image: Planning install of %s", k->source.path);
+                boot_manager_queue_install(plan.installs, k, true);
         }
 
         /* Set the default to the highest release kernel */
-        default_kernel = nc_array_get(kernels, 0);
-        LOG_DEBUG("update_image: Setting default_kernel to %s", default_kernel->source.path);
-        if (!boot_manager_set_default_kernel(self, default_kernel)) {
-                LOG_FATAL("Failed to set the default kernel to: %s", default_kernel->source.path);
-                return false;
-        }
-        LOG_SUCCESS("update_image: Default kernel is now %s", default_kernel->source.path);
+        plan.default_kernel = nc_array_get(kernels, 0);
+        LOG_DEBUG("update_image: Default kernel will be %s", plan.default_kernel->source.path);
+        boot_manager_queue_install(plan.installs, plan.default_kernel, true);
 
-        /* Everything succeeded */
-        return true;
+        ret = boot_manager_plan_apply(self, &plan);
+        boot_manager_plan_free(&plan);
+        return ret;
 }
 
 /**
- * Update the target with logical view of a native installation
+ * Update the target with logical view of a native installation, and then
+ * each of the @mirrors with the same selection of kernels
  */
-static bool boot_manager_update_native(BootManager *self)
+static bool boot_manager_update_native(BootManager *self, BootMirror *mirrors,
+                                       uint16_t n_mirrors)
 {
         assert(self != NULL);
         autofree(KernelArray) *kernels = NULL;
-        autofree(NcHashmap) *mapped_kernels = NULL;
+        autofree(KernelIndex) *index = NULL;
+        KernelTypeIndex *default_type = NULL;
         Kernel *running = NULL;
-        NcHashmapIter map_iter = { 0 };
-        const char *kernel_type = NULL;
-        KernelArray *typed_kernels = NULL;
-        NcArray *removals = NULL;
-        Kernel *new_default = NULL;
+        UpdatePlan plan = { 0 };
+        RetentionPolicy retention = { 0 };
+        RetentionVerdict *verdicts = NULL;
         const SystemKernel *system_kernel = NULL;
         bool ret = false;
 
+        CBM_TRACE_SCOPE("update_native");
+        CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_PHASE, "plan");
+
         LOG_DEBUG("Now beginning update_native");
 
         /* Grab the available kernels */
@@ -253,20 +1887,24 @@ static bool boot_manager_update_native(BootManager *self)
 
         LOG_DEBUG("update_native: %d available kernels", kernels->len);
 
-        /* Get them sorted */
-        nc_array_qsort(kernels, kernel_compare_reverse);
-
-        running = boot_manager_get_running_kernel(self, kernels);
-        /* Try fallback comparison */
-        if (!running) {
-                running = boot_manager_get_running_kernel_fallback(self, kernels);
+        /* Sorted and grouped by type once, so every lookup below is direct */
+        index = boot_manager_index_kernels(self, kernels);
+        if (!index || index->types->len == 0) {
+                LOG_FATAL("Failed to map kernels by type, bailing");
+                return false;
         }
 
+        running = boot_manager_index_get_running_kernel(self, index);
+
         system_kernel = boot_manager_get_system_kernel(self);
 
+        if (!boot_manager_load_retention(self, &retention)) {
+                LOG_ERROR("Keeping only the running, default and last booted kernels");
+        }
+
         if (!running) {
-                /* We don't know the currently running kernel, don't try to
-                 * remove anything */
+                /* We don't know the currently running kernel, only remove
+                 * anything if the retention policy says so */
                 LOG_ERROR("Cannot determine the currently running kernel");
         } else {
                 LOG_DEBUG("update_native: Running kernel is (%s) %s",
@@ -274,43 +1912,42 @@ static bool boot_manager_update_native(BootManager *self)
                           running->source.path);
         }
 
-        /** Map kernels to type */
-        mapped_kernels = boot_manager_map_kernels(self, kernels);
-        if (!mapped_kernels || nc_hashmap_size(mapped_kernels) == 0) {
-                LOG_FATAL("Failed to map kernels by type, bailing");
-                return false;
+        verdicts = calloc(index->kernels->len, sizeof(RetentionVerdict));
+        if (!verdicts) {
+                DECLARE_OOM();
+                goto cleanup;
         }
+        boot_manager_retention_evaluate(&retention, index, running, verdicts);
 
-        /* Get the bootloader sorted out */
-        if (!boot_manager_update_bootloader(self)) {
-                return false;
+        plan.installs = nc_array_new();
+        if (!plan.installs) {
+                DECLARE_OOM();
+                goto cleanup;
         }
-
-        LOG_SUCCESS("update_native: Bootloader updated");
+        plan.kernels = kernels;
 
         /* This is mostly to allow a repair-situation */
-        if (running) {
-                /* Not necessarily fatal. */
-                if (!boot_manager_install_kernel(self, running)) {
-                        LOG_ERROR("Failed to repair running kernel");
-                } else {
-                        LOG_SUCCESS("update_native: Repaired running kernel %s",
-                                    running->source.path);
-                }
+        if (running && boot_manager_update_covers(self, running->meta.ktype)) {
+                boot_manager_queue_install(plan.installs, running, false);
         }
 
-        nc_hashmap_iter_init(mapped_kernels, &map_iter);
-        while (nc_hashmap_iter_next(&map_iter, (void **)&kernel_type, (void **)&typed_kernels)) {
+        for (uint16_t t = 0; t < index->types->len; t++) {
+                KernelTypeIndex *type = nc_array_get(index->types, t);
+                const char *kernel_type = type->ktype;
+                KernelArray *typed_kernels = type->kernels;
                 Kernel *tip = NULL;
                 Kernel *last_good = NULL;
+                CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_KTYPE, kernel_type);
 
-                LOG_DEBUG("update_native: Checking kernels for type %s", kernel_type);
+                if (!boot_manager_update_covers(self, kernel_type)) {
+                        LOG_DEBUG("update_native: Leaving type %s as it is", kernel_type);
+                        continue;
+                }
 
-                /* Sort this kernel set highest to lowest */
-                nc_array_qsort(typed_kernels, kernel_compare_reverse);
+                LOG_DEBUG("update_native: Checking kernels for type %s", kernel_type);
 
                 /* Get the default kernel selection */
-                tip = boot_manager_get_default_for_type(self, typed_kernels, kernel_type);
+                tip = type->default_kernel;
                 if (!tip) {
                         LOG_ERROR("Could not find default kernel for type %s, using highest relno",
                                   kernel_type);
@@ -323,150 +1960,88 @@ static bool boot_manager_update_native(BootManager *self)
                 }
 
                 /* Ensure this tip kernel is installed */
-                if (!boot_manager_install_kernel(self, tip)) {
-                        LOG_FATAL("Failed to install default-%s kernel: %s",
-                                  tip->meta.ktype,
-                                  tip->source.path);
-                        goto cleanup;
-                }
-                LOG_SUCCESS("update_native: Installed tip for %s: %s",
-                            kernel_type,
-                            tip->source.path);
+                boot_manager_queue_install(plan.installs, tip, true);
 
                 /* Last known booting kernel, might be null. */
-                last_good = boot_manager_get_last_booted(self, typed_kernels);
+                last_good = type->last_booted;
 
                 /* Ensure this guy is still installed/repaired */
                 if (last_good) {
-                        if (!boot_manager_install_kernel(self, last_good)) {
-                                LOG_FATAL("Failed to install last-good kernel: %s",
-                                          last_good->source.path);
-                                goto cleanup;
-                        }
-                        LOG_SUCCESS("update_native: Installed last_good kernel (%s) (%s)",
-                                    kernel_type,
-                                    last_good->source.path);
+                        LOG_DEBUG("update_native: last_good kernel (%s) (%s)",
+                                  kernel_type,
+                                  last_good->source.path);
+                        boot_manager_queue_install(plan.installs, last_good, true);
                 } else {
                         LOG_DEBUG("update_native: No last_good kernel for type %s", kernel_type);
                 }
+        }
+
+        /* Everything else kept or collected is down to the retention policy */
+        for (uint16_t i = 0; i < index->kernels->len; i++) {
+                Kernel *tk = nc_array_get(index->kernels, i);
+                CBM_LOG_FIELD_SCOPE(CBM_LOG_FIELD_KERNEL, tk->meta.bpath);
 
-                /* Only allow garbage collection when we know the running kernel */
-                if (running) {
-                        for (uint16_t i = 0; i < typed_kernels->len; i++) {
-                                Kernel *tk = nc_array_get(typed_kernels, i);
-                                LOG_DEBUG("update_native: Analyzing for type %s: %s",
-                                          kernel_type,
-                                          tk->source.path);
-                                /* Preserve running kernel */
-                                if (tk == running) {
-                                        LOG_DEBUG("update_native: Skipping running kernel");
-                                        continue;
-                                }
-                                LOG_INFO("update_native: not-running: %s", tk->source.path);
-                                /* Preserve tip */
-                                if (tip && tk == tip) {
-                                        LOG_DEBUG("update_native: Skipping default-%s: %s",
-                                                  kernel_type,
-                                                  tk->source.path);
-                                        continue;
-                                }
-                                LOG_INFO("update_native: not-default-%s: %s",
-                                         kernel_type,
-                                         tk->source.path);
-                                /* Preserve last running */
-                                if (last_good && tk == last_good) {
-                                        LOG_DEBUG("update_native: Skipping last_good kernel");
-                                        continue;
-                                }
-                                LOG_INFO("update_native: not-last-booted: %s", tk->source.path);
-                                if (!removals) {
-                                        removals = nc_array_new();
-                                }
-                                /* Schedule removal of kernel - regardless of install status */
-                                if (!nc_array_add(removals, tk)) {
-                                        DECLARE_OOM();
-                                        goto cleanup;
-                                }
-                                LOG_INFO("update_native: Proposed for deletion from %s: %s",
-                                         kernel_type,
-                                         tk->source.path);
+                if (!boot_manager_update_covers(self, tk->meta.ktype)) {
+                        continue;
+                }
+                switch (verdicts[i]) {
+                case RETENTION_REQUIRE:
+                        boot_manager_queue_install(plan.installs, tk, true);
+                        break;
+                case RETENTION_KEEP:
+                        LOG_DEBUG("update_native: Retaining %s", tk->source.path);
+                        boot_manager_queue_install(plan.installs, tk, false);
+                        break;
+                case RETENTION_REMOVE:
+                        if (!plan.removals) {
+                                plan.removals = nc_array_new();
+                        }
+                        /* Schedule removal of kernel - regardless of install status */
+                        if (!plan.removals || !nc_array_add(plan.removals, tk)) {
+                                DECLARE_OOM();
+                                goto cleanup;
                         }
+                        LOG_INFO("update_native: Proposed for deletion from %s: %s",
+                                 tk->meta.ktype,
+                                 tk->source.path);
+                        break;
+                default:
+                        break;
                 }
         }
 
-        /* Might return NULL */
+        /* Might be NULL, i.e. timeout mode */
         if (!running) {
                 /* Attempt to get it based on the current uname anyway */
                 if (system_kernel && system_kernel->ktype[0] != '\0') {
-                        new_default =
-                            boot_manager_get_default_for_type(self, kernels, system_kernel->ktype);
+                        default_type = kernel_index_get_type(index, system_kernel->ktype);
                 }
         } else {
-                new_default = boot_manager_get_default_for_type(self, kernels, running->meta.ktype);
+                default_type = kernel_index_get_type(index, running->meta.ktype);
         }
-        if (!boot_manager_set_default_kernel(self, new_default)) {
-                LOG_ERROR("Failed to set the default kernel to: %s",
-                          new_default ? new_default->source.path : "<timeout mode>");
-                goto cleanup;
+        if (default_type) {
+                plan.default_kernel = default_type->default_kernel;
         }
-
-        if (new_default) {
-                LOG_SUCCESS("update_native: Default kernel for %s is %s",
-                            new_default->meta.ktype,
-                            new_default->source.path);
-        } else if (running) {
+        if (!plan.default_kernel && running) {
                 LOG_INFO("update_native: No possible default kernel for %s", running->meta.ktype);
         }
-
-        ret = true;
-
-        if (!removals) {
-                /* We're done. */
-                LOG_DEBUG("No kernel removals found");
-                goto cleanup;
+        /* Whatever changed, the default must be installed */
+        if (plan.default_kernel) {
+                boot_manager_queue_install(plan.installs, plan.default_kernel, true);
         }
 
-        /* Now remove the older kernels */
-        for (uint16_t i = 0; i < removals->len; i++) {
-                Kernel *k = nc_array_get(removals, i);
-                LOG_INFO("update_native: Garbage collecting %s: %s", k->meta.ktype, k->source.path);
-                if (!boot_manager_remove_kernel(self, k)) {
-                        LOG_ERROR("Failed to remove kernel: %s", k->source.path);
-                        ret = false;
-                        goto cleanup;
-                }
+        ret = boot_manager_plan_apply(self, &plan);
+        if (n_mirrors > 0) {
+                ret = boot_manager_update_mirrors(self, &plan, mirrors, n_mirrors, ret);
         }
+
 cleanup:
-        if (removals) {
-                nc_array_free(&removals, NULL);
-        }
+        boot_manager_plan_free(&plan);
+        boot_manager_retention_clear(&retention);
+        free(verdicts);
         return ret;
 }
 
-/**
- * Handle the update logic for the bootloader as both methods require the
- * same calls.
- */
-static bool boot_manager_update_bootloader(BootManager *self)
-{
-        if (boot_manager_needs_install(self)) {
-                /* Attempt install of the bootloader */
-                int flags = BOOTLOADER_OPERATION_INSTALL | BOOTLOADER_OPERATION_NO_CHECK;
-                if (!boot_manager_modify_bootloader(self, flags)) {
-                        LOG_FATAL("Failed to install bootloader");
-                        return false;
-                }
-        } else if (boot_manager_needs_update(self)) {
-                /* Attempt update of the bootloader */
-                int flags = BOOTLOADER_OPERATION_UPDATE | BOOTLOADER_OPERATION_NO_CHECK;
-                if (!boot_manager_modify_bootloader(self, flags)) {
-                        LOG_FATAL("Failed to update bootloader");
-                        return false;
-                }
-        }
-        return true;
-}
-
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
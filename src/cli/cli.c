@@ -17,16 +17,27 @@
 #include <string.h>
 
 #include "cli.h"
+#include "util.h"
 
 static struct option default_opts[] = { { "path", required_argument, 0, 'p' },
                                         { "image", no_argument, 0, 'i' },
                                         { 0, 0, 0, 0 } };
 
 bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image)
+{
+        return cli_args_init(argc, argv, root, forced_image, NULL);
+}
+
+bool cli_args_init(int *argc, char ***argv, char **root, bool *forced_image,
+                   const CliOptions *extra)
 {
         int o_in = 0;
         int c;
         char *_root = NULL;
+        autofree(char) *short_opts = NULL;
+        struct option *opts = NULL;
+        size_t n_default = ARRAY_SIZE(default_opts) - 1;
+        size_t n_extra = 0;
 
         /* We actually want to use getopt, so rewind one for getopt */;
         --(*argv);
@@ -36,12 +47,33 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                 return false;
         }
 
+        if (extra && extra->options) {
+                while (extra->options[n_extra].name) {
+                        ++n_extra;
+                }
+        }
+
+        /* Merge in the command specific options, keeping the terminator */
+        opts = calloc(n_default + n_extra + 1, sizeof(struct option));
+        if (!opts) {
+                DECLARE_OOM();
+                return false;
+        }
+        memcpy(opts, default_opts, n_default * sizeof(struct option));
+        if (n_extra > 0) {
+                memcpy(opts + n_default, extra->options, n_extra * sizeof(struct option));
+        }
+        short_opts = string_printf("ip:%s",
+                                   extra && extra->short_options ? extra->short_options : "");
+
         /* Allow setting the root */
         while (true) {
-                c = getopt_long(*argc, *argv, "ip:", default_opts, &o_in);
+                c = getopt_long(*argc, *argv, short_opts, opts, &o_in);
+
                 if (c == -1) {
                         break;
                 }
+
                 switch (c) {
                 case 0:
                 case 'p':
@@ -62,16 +94,26 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                         goto bail;
                         break;
                 default:
+                        if (extra && extra->handler) {
+                                if (!extra->handler(c, optarg, extra->userdata)) {
+                                        goto bail;
+                                }
+                                break;
+                        }
                         abort();
                 }
         }
+
         *argc -= optind;
+        free(opts);
 
         if (_root) {
                 *root = _root;
         }
+
         return true;
 bail:
+        free(opts);
         if (_root) {
                 free(_root);
         }
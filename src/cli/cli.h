@@ -11,6 +11,7 @@
 
 #pragma once
 
+#include <getopt.h>
 #include <stdbool.h>
 
 typedef bool (*subcommand_callback)(int argc, char **argv);
@@ -24,8 +25,35 @@ typedef struct SubCommand {
         bool requires_root;
 } SubCommand;
 
+/**
+ * Handle a single command specific option
+ *
+ * @param c The option value as returned from getopt
+ * @param arg The option argument, if any
+ * @return False if the option is invalid, aborting argument parsing
+ */
+typedef bool (*cli_option_handler)(int c, const char *arg, void *userdata);
+
+/**
+ * Additional options understood by a single command, on top of the
+ * default --path and --image options.
+ */
+typedef struct CliOptions {
+        const struct option *options; /**<NULL terminated long options */
+        const char *short_options;    /**<getopt optstring for the options */
+        cli_option_handler handler;   /**<Invoked for each of the options */
+        void *userdata;               /**<Passed to the handler */
+} CliOptions;
+
 bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image);
 
+/**
+ * As cli_default_args_init, additionally handling the command specific
+ * options given in @extra
+ */
+bool cli_args_init(int *argc, char ***argv, char **root, bool *forced_image,
+                   const CliOptions *extra);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
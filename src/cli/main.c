@@ -18,16 +18,24 @@
 #include "nica/hashmap.h"
 #include "util.h"
 
+#include "ops/batch.h"
+#include "ops/daemon.h"
 #include "ops/report_booted.h"
+#include "ops/status.h"
 #include "ops/timeout.h"
 #include "ops/update.h"
+#include "ops/verify.h"
 
 static SubCommand cmd_update;
+static SubCommand cmd_daemon;
+static SubCommand cmd_batch;
 static SubCommand cmd_help;
 static SubCommand cmd_version;
 static SubCommand cmd_set_timeout;
 static SubCommand cmd_get_timeout;
 static SubCommand cmd_report_booted;
+static SubCommand cmd_status;
+static SubCommand cmd_verify;
 static char *binary_name = NULL;
 static NcHashmap *g_commands = NULL;
 static bool explicit_help = false;
@@ -112,7 +120,9 @@ be automatically garbage collected.\n\
 If necessary, the bootloader will be updated and/or installed during this\n\
 time.",
                 .callback = cbm_command_update,
-                .usage = " [--path=/path/to/filesystem/root]",
+                .usage = " [--path=/path/to/filesystem/root] [--jobs=N] [--verify] [--plan]"
+                         " [--stats[=table|json]] [--wait] [--dedup] [--io-policy=SPEC]"
+                         " [--device-spec=FILE] [--kernel=NAME...] [--image root...]",
                 .requires_root = true
         };
 
@@ -121,6 +131,42 @@ time.",
                 return EXIT_FAILURE;
         }
 
+        /* Long running updates */
+        cmd_daemon = (SubCommand){
+                .name = "daemon",
+                .blurb = "Watch for kernel changes and update automatically",
+                .help = "Watch the kernel and kernel configuration directories, performing an\n\
+update once they have been left unchanged for the quiet window (in\n\
+milliseconds). The system is only inspected once, on startup or on SIGHUP.\n\
+With --keep-mounted, a boot device mounted for an update stays mounted\n\
+until no update happened for the idle time (in milliseconds).",
+                .callback = cbm_command_daemon,
+                .usage = " [--path=/path/to/filesystem/root] [--quiet=MS] [--keep-mounted[=MS]]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_daemon.name, &cmd_daemon)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
+        /* Many operations over one inspection */
+        cmd_batch = (SubCommand){
+                .name = "batch",
+                .blurb = "Perform a sequence of operations on one root",
+                .help = "Read operations from the file, or standard input, one per line:\n\
+set-timeout N, get-timeout and update. The root is inspected once for the\n\
+whole batch and any update is performed once, after all other operations.",
+                .callback = cbm_command_batch,
+                .usage = " [--path=/path/to/filesystem/root] [--image] [file]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_batch.name, &cmd_batch)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
         /* Set the timeout */
         cmd_set_timeout = (SubCommand){
                 .name = "set-timeout",
@@ -129,9 +175,11 @@ time.",
                         " when using\n\
 the \"update\" command.\n\
 This integer value will be used when next configuring the bootloader, and is used\n\
-to forcibly delay the system boot for a specified number of seconds.",
+to forcibly delay the system boot for a specified number of seconds.\n\
+With --apply the bootloader configuration is rewritten straight away, without\n\
+a full update.",
                 .callback = cbm_command_set_timeout,
-                .usage = " [--path=/path/to/filesystem/root]",
+                .usage = " [--path=/path/to/filesystem/root] [--apply]",
                 .requires_root = true,
         };
 
@@ -159,6 +207,44 @@ to forcibly delay the system boot for a specified number of seconds.",
                 return EXIT_FAILURE;
         }
 
+        /* Summarise the boot state */
+        cmd_status = (SubCommand){
+                .name = "status",
+                .blurb = "Show installed kernels and whether an update is needed",
+                .help = "Show the kernels known to " PACKAGE_NAME
+                        ", whether each is installed, the default\n\
+kernel and timeout, and whether the \"update\" command has anything to do.\n\
+Nothing is mounted or probed: installed kernels are only known while the boot\n\
+directory is mounted. With --json a single JSON object is printed.",
+                .callback = cbm_command_status,
+                .usage = " [--path=/path/to/filesystem/root] [--json]",
+                .requires_root = false,
+        };
+
+        if (!nc_hashmap_put(commands, cmd_status.name, &cmd_status)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
+        /* Check the boot directory against what an update would leave */
+        cmd_verify = (SubCommand){
+                .name = "verify",
+                .blurb = "Compare the boot directory with what an update installs",
+                .help = "Compare every kernel and initrd on the boot directory in full with its\n\
+source, using a job per online CPU unless --jobs says otherwise, and print an\n\
+install line for each that differs or is missing, a bootloader line if it's\n\
+out of date and a remove line for each an update would remove. Exits nonzero\n\
+if anything differs. With --repair, only what differs is installed again.",
+                .callback = cbm_command_verify,
+                .usage = " [--path=/path/to/filesystem/root] [--jobs=N] [--repair] [--image]",
+                .requires_root = true,
+        };
+
+        if (!nc_hashmap_put(commands, cmd_verify.name, &cmd_verify)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
         /* Report the system as successfully booted */
         cmd_report_booted =
             (SubCommand){.name = "report-booted",
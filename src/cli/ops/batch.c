@@ -0,0 +1,248 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "bootman.h"
+#include "cli.h"
+#include "log.h"
+#include "nica/array.h"
+#include "timeout.h"
+
+/**
+ * Operations understood within a batch
+ */
+typedef enum {
+        BATCH_OP_SET_TIMEOUT = 0,
+        BATCH_OP_GET_TIMEOUT,
+        BATCH_OP_UPDATE,
+} BatchOpType;
+
+/**
+ * A single parsed line of the batch
+ */
+typedef struct BatchOp {
+        BatchOpType type;
+        int timeout;       /**<Value for set-timeout */
+        unsigned int line; /**<Line of the batch it came from */
+} BatchOp;
+
+/**
+ * Parse one line into @op, returning false if it's invalid. Blank lines and
+ * comments leave @op untouched and set @empty.
+ */
+static bool batch_parse_line(char *line, BatchOp *op, bool *empty)
+{
+        char *saveptr = NULL;
+        char *name = NULL;
+        char *arg = NULL;
+        char *comment = NULL;
+
+        comment = strchr(line, '#');
+        if (comment) {
+                *comment = '\0';
+        }
+
+        *empty = false;
+        name = strtok_r(line, " \t\r\n", &saveptr);
+        if (!name) {
+                *empty = true;
+                return true;
+        }
+        arg = strtok_r(NULL, " \t\r\n", &saveptr);
+
+        if (streq(name, "set-timeout")) {
+                if (!arg || strtok_r(NULL, " \t\r\n", &saveptr)) {
+                        fprintf(stderr, "set-timeout takes one integer parameter\n");
+                        return false;
+                }
+                op->type = BATCH_OP_SET_TIMEOUT;
+                return cbm_timeout_parse(arg, &op->timeout);
+        }
+
+        if (arg) {
+                fprintf(stderr, "%s does not take any parameters\n", name);
+                return false;
+        }
+        if (streq(name, "get-timeout")) {
+                op->type = BATCH_OP_GET_TIMEOUT;
+        } else if (streq(name, "update")) {
+                op->type = BATCH_OP_UPDATE;
+        } else {
+                fprintf(stderr, "Unknown batch operation: %s\n", name);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Parse the whole batch up front, so that a typo late in the batch doesn't
+ * leave it half applied
+ */
+static NcArray *batch_parse(FILE *fp, const char *source)
+{
+        NcArray *ops = NULL;
+        autofree(char) *buf = NULL;
+        size_t sn = 0;
+        unsigned int line = 0;
+
+        ops = nc_array_new();
+        if (!ops) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        while (getline(&buf, &sn, fp) > 0) {
+                BatchOp op = {.line = ++line };
+                BatchOp *copy = NULL;
+                bool empty = false;
+
+                if (!batch_parse_line(buf, &op, &empty)) {
+                        fprintf(stderr, "%s:%u: Invalid operation\n", source, line);
+                        goto fail;
+                }
+                if (empty) {
+                        continue;
+                }
+
+                copy = calloc(1, sizeof(BatchOp));
+                if (!copy) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                *copy = op;
+                if (!nc_array_add(ops, copy)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        if (ferror(fp)) {
+                fprintf(stderr, "Failed to read %s: %s\n", source, strerror(errno));
+                goto fail;
+        }
+        return ops;
+
+fail:
+        nc_array_free(&ops, free);
+        return NULL;
+}
+
+bool cbm_command_batch(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        autofree(FILE) *fp = NULL;
+        NcArray *ops = NULL;
+        const char *source = "-";
+        bool forced_image = false;
+        bool update = false;
+        bool ret = false;
+
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image)) {
+                return false;
+        }
+
+        if (argc > 1) {
+                fprintf(stderr, "batch takes at most one file of operations\n");
+                return false;
+        }
+        if (argc == 1) {
+                source = argv[optind];
+        }
+
+        if (streq(source, "-")) {
+                source = "<stdin>";
+                ops = batch_parse(stdin, source);
+        } else {
+                fp = fopen(source, "r");
+                if (!fp) {
+                        fprintf(stderr, "Unable to open %s: %s\n", source, strerror(errno));
+                        return false;
+                }
+                ops = batch_parse(fp, source);
+        }
+        if (!ops) {
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                goto done;
+        }
+
+        if (root) {
+                autofree(char) *realp = realpath(root, NULL);
+                if (!realp) {
+                        LOG_FATAL("Path specified does not exist: %s", root);
+                        goto done;
+                }
+                /* Anything not / is image mode */
+                boot_manager_set_image_mode(manager, forced_image || !streq(realp, "/"));
+        } else {
+                boot_manager_set_image_mode(manager, forced_image);
+        }
+
+        /* Inspected once, for every operation of the batch */
+        if (!boot_manager_set_prefix(manager, root ? root : "/")) {
+                goto done;
+        }
+
+        for (int i = 0; i < ops->len; i++) {
+                const BatchOp *op = nc_array_get(ops, i);
+
+                switch (op->type) {
+                case BATCH_OP_SET_TIMEOUT:
+                        if (!cbm_timeout_apply(manager, op->timeout)) {
+                                fprintf(stderr, "%s:%u: set-timeout failed\n", source, op->line);
+                                goto done;
+                        }
+                        break;
+                case BATCH_OP_GET_TIMEOUT:
+                        cbm_timeout_print(manager);
+                        break;
+                case BATCH_OP_UPDATE:
+                        /* Nothing else touches the boot directory, so all
+                         * updates are folded into one at the very end */
+                        update = true;
+                        break;
+                default:
+                        abort();
+                }
+        }
+
+        ret = update ? boot_manager_update(manager) : true;
+
+done:
+        nc_array_free(&ops, free);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,312 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "config.h"
+#include "daemon.h"
+#include "log.h"
+
+/**
+ * Default time without changes before an update is run
+ */
+#define DAEMON_DEFAULT_QUIET_MS 1000
+
+/**
+ * Default time without updates before a kept boot device is unmounted
+ */
+#define DAEMON_DEFAULT_IDLE_MS 60000
+
+/**
+ * Everything an update reads its kernels and cmdline from, relative to the
+ * root. inotify isn't recursive, so the cmdline.d directories are listed too.
+ */
+static const char *daemon_watch_dirs[] = {
+        KERNEL_DIRECTORY,
+        KERNEL_CONF_DIRECTORY,
+        KERNEL_CONF_DIRECTORY "/cmdline.d",
+        VENDOR_KERNEL_CONF_DIRECTORY,
+        VENDOR_KERNEL_CONF_DIRECTORY "/cmdline.d",
+};
+
+#define DAEMON_WATCH_EVENTS                                                                        \
+        (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |        \
+         IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * Options specific to the daemon command
+ */
+typedef struct DaemonArgs {
+        int quiet_ms;      /**<Quiet window before updating */
+        bool keep_mounted; /**<Keep the boot device mounted between updates */
+        int idle_ms;       /**<Idle time before unmounting it */
+} DaemonArgs;
+
+static struct option daemon_opts[] = { { "quiet", required_argument, 0, 'q' },
+                                       { "keep-mounted", optional_argument, 0, 'k' },
+                                       { 0, 0, 0, 0 } };
+
+static bool daemon_parse_ms(const char *arg, const char *what, int *ms)
+{
+        char *end = NULL;
+        long value = 0;
+
+        errno = 0;
+        value = strtol(arg, &end, 10);
+        if (errno != 0 || end == arg || *end != '\0' || value < 0 || value > 3600000) {
+                fprintf(stderr, "Invalid %s: %s\n", what, arg);
+                return false;
+        }
+        *ms = (int)value;
+        return true;
+}
+
+static bool daemon_handle_option(int c, const char *arg, void *userdata)
+{
+        DaemonArgs *args = userdata;
+
+        switch (c) {
+        case 'q':
+                return daemon_parse_ms(arg, "quiet window", &args->quiet_ms);
+        case 'k':
+                args->keep_mounted = true;
+                return !arg || daemon_parse_ms(arg, "idle time", &args->idle_ms);
+        default:
+                return false;
+        }
+}
+
+/**
+ * (Re)establish the watches. Directories that don't exist yet are picked up
+ * on a later call, once their parent reported them being created.
+ */
+static void daemon_add_watches(int fd, const char *prefix)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(daemon_watch_dirs); i++) {
+                autofree(char) *path = NULL;
+
+                if (streq(prefix, "/")) {
+                        path = strdup(daemon_watch_dirs[i]);
+                } else {
+                        path = string_printf("%s%s", prefix, daemon_watch_dirs[i]);
+                }
+                if (!path) {
+                        DECLARE_OOM();
+                        abort();
+                }
+
+                /* Watching an already watched directory just returns its watch */
+                if (inotify_add_watch(fd, path, DAEMON_WATCH_EVENTS | IN_ONLYDIR) < 0 &&
+                    errno != ENOENT) {
+                        LOG_WARNING("Unable to watch %s: %s", path, strerror(errno));
+                }
+        }
+}
+
+/**
+ * Drain all queued events. Their details don't matter, any change to the
+ * watched directories calls for an update.
+ */
+static void daemon_drain_events(int fd)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        while (read(fd, buf, sizeof(buf)) > 0) {
+                /* Keep reading */
+        }
+}
+
+static void daemon_update(BootManager *manager)
+{
+        LOG_INFO("Kernel sources changed, updating");
+
+        boot_manager_refresh(manager);
+        if (!boot_manager_update(manager)) {
+                LOG_ERROR("Update failed, retrying on the next change");
+                return;
+        }
+        LOG_SUCCESS("Update complete");
+}
+
+bool cbm_command_daemon(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        autofree(char) *prefix = NULL;
+        DaemonArgs args = {.quiet_ms = DAEMON_DEFAULT_QUIET_MS, .idle_ms = DAEMON_DEFAULT_IDLE_MS };
+        CliOptions extra = {.options = daemon_opts,
+                            .short_options = "q:k::",
+                            .handler = daemon_handle_option,
+                            .userdata = &args };
+        struct pollfd fds[2] = { { 0 } };
+        sigset_t mask;
+        bool pending = true;
+        bool reinspect = false;
+        bool ret = false;
+        int inotify_fd = -1;
+        int signal_fd = -1;
+
+        if (!cli_args_init(&argc, &argv, &root, NULL, &extra)) {
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        if (root) {
+                autofree(char) *realp = realpath(root, NULL);
+                if (!realp) {
+                        LOG_FATAL("Path specified does not exist: %s", root);
+                        return false;
+                }
+                /* Anything not / is image mode */
+                boot_manager_set_image_mode(manager, !streq(realp, "/"));
+        }
+        boot_manager_set_keep_mounted(manager, args.keep_mounted);
+
+        /* The same manager serves every update, keeping its inspection warm */
+        if (!boot_manager_set_prefix(manager, root ? root : "/")) {
+                return false;
+        }
+        prefix = strdup(boot_manager_get_prefix(manager));
+        if (!prefix) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+                LOG_FATAL("Unable to initialise inotify: %s", strerror(errno));
+                return false;
+        }
+
+        /* SIGHUP inspects the system again, anything else stops us */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0 ||
+            (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+                LOG_FATAL("Unable to handle signals: %s", strerror(errno));
+                goto done;
+        }
+
+        daemon_add_watches(inotify_fd, prefix);
+        fds[0] = (struct pollfd){.fd = inotify_fd, .events = POLLIN };
+        fds[1] = (struct pollfd){.fd = signal_fd, .events = POLLIN };
+
+        LOG_INFO("Watching %s for kernel changes", prefix);
+
+        /* Anything may have changed before we started, so update once first */
+        for (;;) {
+                int timeout = -1;
+                int r = 0;
+
+                if (pending) {
+                        timeout = args.quiet_ms;
+                } else if (boot_manager_has_kept_mount(manager)) {
+                        timeout = args.idle_ms;
+                }
+
+                /* Don't keep the last update's messages buffered while we block */
+                cbm_log_flush();
+                r = poll(fds, ARRAY_SIZE(fds), timeout);
+
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        LOG_FATAL("poll() failed: %s", strerror(errno));
+                        goto done;
+                }
+
+                /* Idle for long enough, let the boot device go */
+                if (r == 0 && !pending) {
+                        (void)boot_manager_release_mount(manager);
+                        continue;
+                }
+
+                /* The burst is over */
+                if (r == 0) {
+                        if (reinspect) {
+                                boot_manager_discard_snapshot(manager);
+                                if (!boot_manager_set_prefix(manager, prefix)) {
+                                        LOG_FATAL("Unable to inspect %s again", prefix);
+                                        goto done;
+                                }
+                                reinspect = false;
+                        }
+                        daemon_update(manager);
+                        pending = false;
+                        /* Pick up any directory that appeared meanwhile */
+                        daemon_add_watches(inotify_fd, prefix);
+                        continue;
+                }
+
+                if (fds[1].revents & POLLIN) {
+                        struct signalfd_siginfo info = { 0 };
+
+                        if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                                if (info.ssi_signo != SIGHUP) {
+                                        LOG_INFO("Stopping on signal %u", info.ssi_signo);
+                                        ret = true;
+                                        goto done;
+                                }
+                                reinspect = true;
+                                pending = true;
+                        }
+                }
+
+                /* Every further change restarts the quiet window */
+                if (fds[0].revents & POLLIN) {
+                        daemon_drain_events(inotify_fd);
+                        pending = true;
+                }
+        }
+
+done:
+        /* Unmounted before we exit, i.e. on SIGTERM at shutdown */
+        (void)boot_manager_release_mount(manager);
+        if (signal_fd >= 0) {
+                close(signal_fd);
+        }
+        close(inotify_fd);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
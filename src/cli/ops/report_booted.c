@@ -12,27 +12,53 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bootman.h"
 #include "cli.h"
 #include "config.h"
 #include "files.h"
+#include "ledger.h"
 #include "nica/files.h"
 #include "nica/util.h"
 #include "report_booted.h"
 
+/**
+ * Read the boot ID of the running kernel into @buf, empty if unavailable
+ */
+static void report_booted_boot_id(char *buf, size_t len)
+{
+        ssize_t r = 0;
+        int fd = -1;
+
+        buf[0] = '\0';
+        fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return;
+        }
+        r = read(fd, buf, len - 1);
+        close(fd);
+        if (r <= 0) {
+                buf[0] = '\0';
+                return;
+        }
+        buf[r] = '\0';
+        buf[strcspn(buf, " \t\r\n")] = '\0';
+}
+
 bool cbm_command_report_booted(__cbm_unused__ int argc, __cbm_unused__ char **argv)
 {
         SystemKernel sys = { 0 };
         struct utsname uts = { 0 };
-        const char *lib_dir = "/var/lib/kernel";
-        autofree(char) *boot_rep_path = NULL;
+        autofree(char) *kernel = NULL;
+        char boot_id[64];
 
         /* Try to parse the currently running kernel */
         if (uname(&uts) < 0) {
@@ -45,22 +71,12 @@ bool cbm_command_report_booted(__cbm_unused__ int argc, __cbm_unused__ char **ar
                 return false;
         }
 
-        /* Disable syncs during boot ! */
-        cbm_set_sync_filesystems(false);
-
-        if (!nc_file_exists(lib_dir)) {
-                if (!nc_mkdir_p(lib_dir, 00755)) {
-                        fprintf(stderr, "Unable to mkdir_p: %s %s\n", lib_dir, strerror(errno));
-                        return false;
-                }
-        }
-
-        /* /var/lib/kernel/k_booted_4.4.0-120.lts - new */
-        boot_rep_path =
-            string_printf("/var/lib/kernel/k_booted_%s-%d.%s", sys.version, sys.release, sys.ktype);
+        /* i.e. 4.4.0-120.lts, as the legacy k_booted files were named */
+        kernel = string_printf("%s-%d.%s", sys.version, sys.release, sys.ktype);
+        report_booted_boot_id(boot_id, sizeof(boot_id));
 
-        /* Report ourselves to new path */
-        if (!file_set_text(boot_rep_path, "clr-boot-manager file\n")) {
+        /* One appended record, never synced during boot */
+        if (!cbm_boot_ledger_append(CBM_BOOT_LEDGER_DIR, kernel, boot_id, (uint64_t)time(NULL))) {
                 fprintf(stderr, "Failed to set kernel boot status: %s\n", strerror(errno));
                 return false;
         }
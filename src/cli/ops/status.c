@@ -0,0 +1,100 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "log.h"
+#include "status.h"
+#include "writer.h"
+
+static struct option status_opts[] = { { "json", no_argument, 0, 'J' }, { 0, 0, 0, 0 } };
+
+static bool status_handle_option(int c, __cbm_unused__ const char *arg, void *userdata)
+{
+        bool *json = userdata;
+
+        if (c != 'J') {
+                return false;
+        }
+        *json = true;
+        return true;
+}
+
+bool cbm_command_status(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        bool forced_image = false;
+        bool json = false;
+        CliOptions extra = {.options = status_opts,
+                            .short_options = "J",
+                            .handler = status_handle_option,
+                            .userdata = &json };
+
+        if (!cli_args_init(&argc, &argv, &root, &forced_image, &extra)) {
+                return false;
+        }
+
+        if (argc != 0) {
+                fprintf(stderr, "status does not take any parameters\n");
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        boot_manager_set_image_mode(manager, forced_image);
+        /* Default to "/", bail if it doesn't work. */
+        if (!boot_manager_set_prefix(manager, root ? root : "/")) {
+                return false;
+        }
+        /* A query, so the inventory isn't written back either */
+        boot_manager_set_dry_run(manager, true);
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return false;
+        }
+        if (!boot_manager_write_status(manager, writer, json)) {
+                fprintf(stderr, "Failed to discover kernels\n");
+                return false;
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return false;
+        }
+        fputs(writer->buffer, stdout);
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
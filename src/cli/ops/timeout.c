@@ -16,6 +16,19 @@
 #include "bootman.h"
 #include "cli.h"
 
+static struct option set_timeout_opts[] = { { "apply", no_argument, 0, 'a' }, { 0, 0, 0, 0 } };
+
+static bool set_timeout_handle_option(int c, __cbm_unused__ const char *arg, void *userdata)
+{
+        bool *apply = userdata;
+
+        if (c != 'a') {
+                return false;
+        }
+        *apply = true;
+        return true;
+}
+
 static inline bool is_numeric(const char *str)
 {
         for (char *c = (char *)str; *c; c++) {
@@ -29,13 +42,70 @@ static inline bool is_numeric(const char *str)
         return true;
 }
 
+bool cbm_timeout_parse(const char *value, int *timeout)
+{
+        int n_val = -1;
+
+        if (sscanf(value, "%d", &n_val) < 0) {
+                fprintf(stderr, "Erroneous input. Please provide an integer value.\n");
+                return false;
+        }
+
+        if (!is_numeric(value)) {
+                fprintf(stderr, "Please provide a valid numeric value.\n");
+                return false;
+        }
+
+        if (n_val < -1) {
+                fprintf(stderr,
+                        "Value of '%d' is incorrect. Use 0 if you mean to disable boot timeout.\n",
+                        n_val);
+                return false;
+        }
+
+        *timeout = n_val;
+        return true;
+}
+
+bool cbm_timeout_apply(BootManager *manager, int timeout)
+{
+        if (!boot_manager_set_timeout_value(manager, timeout)) {
+                fprintf(stderr, "Failed to update timeout\n");
+                return false;
+        }
+        if (timeout <= 0) {
+                fprintf(stdout, "Timeout has been removed\n");
+        } else {
+                fprintf(stdout, "New timeout value is: %d\n", timeout);
+        }
+        return true;
+}
+
+void cbm_timeout_print(BootManager *manager)
+{
+        int tval = boot_manager_get_timeout_value(manager);
+
+        if (tval <= 0) {
+                fprintf(stdout, "No timeout is currently configured\n");
+        } else {
+                fprintf(stdout, "Timeout value: %d seconds\n", tval);
+        }
+}
+
 bool cbm_command_set_timeout(int argc, char **argv)
 {
         int n_val = -1;
+        bool apply = false;
+        bool ret = true;
+        const char *report = NULL;
         autofree(char) *root = NULL;
         autofree(BootManager) *manager = NULL;
+        CliOptions extra = {.options = set_timeout_opts,
+                            .short_options = "a",
+                            .handler = set_timeout_handle_option,
+                            .userdata = &apply };
 
-        if (!cli_default_args_init(&argc, &argv, &root, NULL)) {
+        if (!cli_args_init(&argc, &argv, &root, NULL, &extra)) {
                 return false;
         }
 
@@ -62,34 +132,24 @@ bool cbm_command_set_timeout(int argc, char **argv)
                 return false;
         }
 
-        if (sscanf(argv[optind], "%d", &n_val) < 0) {
-                fprintf(stderr, "Erroneous input. Please provide an integer value.\n");
+        if (!cbm_timeout_parse(argv[optind], &n_val)) {
                 return false;
         }
 
-        if (!is_numeric(argv[optind])) {
-                fprintf(stderr, "Please provide a valid numeric value.\n");
+        if (!cbm_timeout_apply(manager, n_val)) {
                 return false;
         }
-
-        if (n_val < -1) {
-                fprintf(stderr,
-                        "Value of '%d' is incorrect. Use 0 if you mean to disable boot timeout.\n",
-                        n_val);
-                return false;
+        if (!apply) {
+                return true;
         }
-
-        if (!boot_manager_set_timeout_value(manager, n_val)) {
-                fprintf(stderr, "Failed to update timeout\n");
-                return false;
-        }
-        if (n_val <= 0) {
-                fprintf(stdout, "Timeout has been removed\n");
-        } else {
-                fprintf(stdout, "New timeout value is: %d\n", n_val);
+        if (!boot_manager_apply_timeout(manager)) {
+                fprintf(stderr, "Failed to apply the timeout to the bootloader\n");
+                ret = false;
         }
-
-        return true;
+        /* Mirrored ESPs may well end up in different states */
+        report = boot_manager_get_report(manager);
+        fputs(report ? report : "", stdout);
+        return ret;
 }
 
 bool cbm_command_get_timeout(int argc, char **argv)
@@ -122,12 +182,7 @@ bool cbm_command_get_timeout(int argc, char **argv)
                 return false;
         }
 
-        int tval = boot_manager_get_timeout_value(manager);
-        if (tval <= 0) {
-                fprintf(stdout, "No timeout is currently configured\n");
-        } else {
-                fprintf(stdout, "Timeout value: %d seconds\n", tval);
-        }
+        cbm_timeout_print(manager);
         return true;
 }
 
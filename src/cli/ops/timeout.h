@@ -11,11 +11,27 @@
 
 #pragma once
 
+#include "bootman.h"
 #include "cli.h"
 
 bool cbm_command_set_timeout(int argc, char **argv);
 bool cbm_command_get_timeout(int argc, char **argv);
 
+/**
+ * Parse a timeout given on the command line, reporting why it's invalid
+ */
+bool cbm_timeout_parse(const char *value, int *timeout);
+
+/**
+ * Store @timeout for the next update and report the new value
+ */
+bool cbm_timeout_apply(BootManager *manager, int timeout);
+
+/**
+ * Report the currently configured timeout
+ */
+void cbm_timeout_print(BootManager *manager);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
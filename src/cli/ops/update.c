@@ -13,22 +13,132 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "bootman.h"
 #include "cli.h"
 #include "log.h"
+#include "stats.h"
+#include "writer.h"
 
-bool cbm_command_update(int argc, char **argv)
+/**
+ * Options specific to the update command
+ */
+typedef struct UpdateArgs {
+        unsigned int jobs; /**<Concurrent kernel installs */
+        bool verify;       /**<Compare installed files in full */
+        bool plan;         /**<Only print what would be done */
+        bool stats;        /**<Print the work counters afterwards */
+        bool stats_json;   /**<Print them as JSON rather than a table */
+        bool wait;         /**<Wait for a concurrent update to finish */
+        bool dedup;        /**<Share identical blobs on the boot directory */
+        char *io_policy;   /**<How kernels are read and written */
+        char *device_spec; /**<Devices of the root, in place of probing */
+        NcArray *kernels;  /**<Changed kernels the update is limited to, if any */
+} UpdateArgs;
+
+static struct option update_opts[] = { { "jobs", required_argument, 0, 'j' },
+                                       { "verify", no_argument, 0, 'V' },
+                                       { "plan", no_argument, 0, 'P' },
+                                       { "stats", optional_argument, 0, 'S' },
+                                       { "wait", no_argument, 0, 'w' },
+                                       { "dedup", no_argument, 0, 'D' },
+                                       { "io-policy", required_argument, 0, 'I' },
+                                       { "device-spec", required_argument, 0, 'd' },
+                                       { "kernel", required_argument, 0, 'k' },
+                                       { 0, 0, 0, 0 } };
+
+static bool update_handle_option(int c, const char *arg, void *userdata)
 {
-        autofree(char) *root = NULL;
-        autofree(BootManager) *manager = NULL;
-        bool forced_image = false;
+        UpdateArgs *args = userdata;
+        char *end = NULL;
+        long jobs = 0;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image)) {
+        switch (c) {
+        case 'j':
+                errno = 0;
+                jobs = strtol(arg, &end, 10);
+                if (errno != 0 || end == arg || *end != '\0' || jobs < 0 || jobs > 256) {
+                        fprintf(stderr, "Invalid number of jobs: %s\n", arg);
+                        return false;
+                }
+                /* 0 means one job per online CPU */
+                if (jobs == 0) {
+                        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                args->jobs = jobs > 0 ? (unsigned int)jobs : 1;
+                return true;
+        case 'V':
+                args->verify = true;
+                return true;
+        case 'P':
+                args->plan = true;
+                return true;
+        case 'w':
+                args->wait = true;
+                return true;
+        case 'D':
+                args->dedup = true;
+                return true;
+        case 'I':
+                args->io_policy = (char *)arg;
+                return true;
+        case 'd':
+                args->device_spec = (char *)arg;
+                return true;
+        case 'k':
+                if (!args->kernels) {
+                        args->kernels = nc_array_new();
+                }
+                if (!args->kernels || !nc_array_add(args->kernels, (void *)arg)) {
+                        DECLARE_OOM();
+                        return false;
+                }
+                return true;
+        case 'S':
+                if (arg && !streq(arg, "table") && !streq(arg, "json")) {
+                        fprintf(stderr, "Invalid stats format: %s\n", arg);
+                        return false;
+                }
+                args->stats = true;
+                args->stats_json = arg && streq(arg, "json");
+                return true;
+        default:
                 return false;
         }
+}
+
+static void update_print_stats(bool json)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                return;
+        }
+        cbm_stats_write(writer, json);
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                return;
+        }
+        fputs(writer->buffer, stdout);
+}
+
+/**
+ * Update a single root with the given options
+ *
+ * @param root Root to update, or NULL for /
+ * @param forced_image Whether image mode was requested
+ * @param batch Whether this is one of many roots, naming it in the plan
+ */
+static bool update_root(const char *root, bool forced_image, bool batch, const UpdateArgs *args)
+{
+        autofree(BootManager) *manager = NULL;
+        bool ret = false;
 
         manager = boot_manager_new();
         if (!manager) {
@@ -53,7 +163,7 @@ bool cbm_command_update(int argc, char **argv)
 
                 /* CBM will check this again, we just needed to check for
                  * image mode.. */
-                if (!boot_manager_set_prefix(manager, root)) {
+                if (!boot_manager_set_prefix(manager, (char *)root)) {
                         return false;
                 }
         } else {
@@ -64,8 +174,114 @@ bool cbm_command_update(int argc, char **argv)
                 }
         }
 
+        /* Only an image can be told what it will boot from */
+        if (args->device_spec && !boot_manager_is_image_mode(manager)) {
+                fprintf(stderr, "--device-spec requires image mode\n");
+                return false;
+        }
+        if (!boot_manager_set_device_spec(manager, args->device_spec)) {
+                fprintf(stderr, "Invalid device spec: %s\n", args->device_spec);
+                return false;
+        }
+
+        for (uint16_t i = 0; args->kernels && i < args->kernels->len; i++) {
+                const char *kernel = nc_array_get(args->kernels, i);
+
+                if (!boot_manager_add_changed_kernel(manager, kernel)) {
+                        fprintf(stderr, "Not a kernel: %s\n", kernel);
+                        return false;
+                }
+        }
+
+        boot_manager_set_jobs(manager, args->jobs);
+        boot_manager_set_verify(manager, args->verify);
+        boot_manager_set_dry_run(manager, args->plan);
+        boot_manager_set_wait(manager, args->wait);
+        boot_manager_set_dedup(manager, args->dedup);
+        if (!boot_manager_set_io_policy(manager, args->io_policy)) {
+                fprintf(stderr, "Invalid I/O policy: %s\n", args->io_policy);
+                return false;
+        }
+
         /* Let CBM take care of the rest */
-        return boot_manager_update(manager);
+        ret = boot_manager_update(manager);
+        if (ret && args->plan) {
+                const char *plan = boot_manager_get_plan(manager);
+                if (batch) {
+                        fprintf(stdout, "root %s\n", root);
+                }
+                fputs(plan ? plan : "", stdout);
+        } else if (ret && boot_manager_update_deferred(manager)) {
+                fprintf(stderr,
+                        "Changes left to the update already running, not yet confirmed;"
+                        " pass --wait to confirm them\n");
+        } else if (!args->plan) {
+                /* Mirrored ESPs may well end up in different states */
+                const char *report = boot_manager_get_report(manager);
+                fputs(report ? report : "", stdout);
+        }
+        return ret;
+}
+
+bool cbm_command_update(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        bool forced_image = false;
+        bool ret = true;
+        UpdateArgs args = {.jobs = 1, .verify = false, .plan = false, .stats = false };
+        CliOptions extra = {.options = update_opts,
+                            .short_options = "j:VPS::wDI:d:k:",
+                            .handler = update_handle_option,
+                            .userdata = &args };
+        int n_roots = 0;
+
+        if (!cli_args_init(&argc, &argv, &root, &forced_image, &extra)) {
+                ret = false;
+                goto done;
+        }
+
+        /* Any further arguments are more image roots, all updated in this
+         * process so that they share what was learned about their sources */
+        n_roots = argc + (root ? 1 : 0);
+        if (n_roots > 1 && !forced_image) {
+                fprintf(stderr, "Updating multiple roots requires --image\n");
+                ret = false;
+                goto done;
+        }
+        if (n_roots > 1 && args.device_spec) {
+                fprintf(stderr, "--device-spec describes a single root\n");
+                ret = false;
+                goto done;
+        }
+
+        if (n_roots <= 1) {
+                ret = update_root(root ? root : (argc > 0 ? argv[optind] : NULL),
+                                  forced_image,
+                                  false,
+                                  &args);
+        } else {
+                if (root && !update_root(root, true, true, &args)) {
+                        LOG_ERROR("Failed to update image root %s", root);
+                        ret = false;
+                }
+                for (int i = 0; i < argc; i++) {
+                        if (!update_root(argv[optind + i], true, true, &args)) {
+                                LOG_ERROR("Failed to update image root %s", argv[optind + i]);
+                                ret = false;
+                        }
+                }
+        }
+
+        /* Failed updates are the most interesting to account for */
+        if (args.stats) {
+                update_print_stats(args.stats_json);
+        }
+
+done:
+        if (args.kernels) {
+                nc_array_free(&args.kernels, NULL);
+        }
+        return ret;
 }
 
 /*
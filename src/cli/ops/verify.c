@@ -0,0 +1,165 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "log.h"
+#include "verify.h"
+
+/**
+ * Options specific to the verify command
+ */
+typedef struct VerifyArgs {
+        unsigned int jobs; /**<Concurrent comparisons */
+        bool repair;       /**<Bring whatever differs back in line */
+} VerifyArgs;
+
+static struct option verify_opts[] = { { "jobs", required_argument, 0, 'j' },
+                                       { "repair", no_argument, 0, 'r' },
+                                       { 0, 0, 0, 0 } };
+
+static bool verify_handle_option(int c, const char *arg, void *userdata)
+{
+        VerifyArgs *args = userdata;
+        char *end = NULL;
+        long jobs = 0;
+
+        switch (c) {
+        case 'j':
+                errno = 0;
+                jobs = strtol(arg, &end, 10);
+                if (errno != 0 || end == arg || *end != '\0' || jobs < 0 || jobs > 256) {
+                        fprintf(stderr, "Invalid number of jobs: %s\n", arg);
+                        return false;
+                }
+                if (jobs == 0) {
+                        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                args->jobs = jobs > 0 ? (unsigned int)jobs : 1;
+                return true;
+        case 'r':
+                args->repair = true;
+                return true;
+        default:
+                return false;
+        }
+}
+
+/**
+ * Whether a line of the plan is something found out of line with the root,
+ * rather than what an update does regardless
+ */
+static bool verify_is_drift(const char *line)
+{
+        return strncmp(line, "bootloader ", 11) == 0 || strncmp(line, "install ", 8) == 0 ||
+               strncmp(line, "remove ", 7) == 0;
+}
+
+/**
+ * Print the drift found in @plan, along with the ESP it was found on when
+ * they're mirrored
+ *
+ * @return The number of drift lines
+ */
+static unsigned int verify_print_drift(const char *plan)
+{
+        unsigned int n_drift = 0;
+        const char *line = plan;
+
+        while (line && *line) {
+                const char *eol = strchr(line, '\n');
+                size_t len = eol ? (size_t)(eol - line) : strlen(line);
+
+                if (verify_is_drift(line)) {
+                        ++n_drift;
+                }
+                if (verify_is_drift(line) || strncmp(line, "esp ", 4) == 0) {
+                        fprintf(stdout, "%.*s\n", (int)len, line);
+                }
+                line = eol ? eol + 1 : NULL;
+        }
+        return n_drift;
+}
+
+bool cbm_command_verify(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        bool forced_image = false;
+        unsigned int n_drift = 0;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        VerifyArgs args = {.jobs = cpus > 0 ? (unsigned int)cpus : 1, .repair = false };
+        CliOptions extra = {.options = verify_opts,
+                            .short_options = "j:r",
+                            .handler = verify_handle_option,
+                            .userdata = &args };
+
+        if (!cli_args_init(&argc, &argv, &root, &forced_image, &extra)) {
+                return false;
+        }
+
+        if (argc != 0) {
+                fprintf(stderr, "verify does not take any parameters\n");
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        boot_manager_set_image_mode(manager, forced_image);
+        /* Default to "/", bail if it doesn't work. */
+        if (!boot_manager_set_prefix(manager, root ? root : "/")) {
+                return false;
+        }
+
+        /* Every installed file is compared in full, and a repair is just an
+         * update acting on what that found */
+        boot_manager_set_jobs(manager, args.jobs);
+        boot_manager_set_verify(manager, true);
+        boot_manager_set_dry_run(manager, !args.repair);
+
+        if (!boot_manager_update(manager)) {
+                return false;
+        }
+
+        n_drift = verify_print_drift(boot_manager_get_plan(manager));
+        if (n_drift == 0) {
+                fprintf(stdout, "verified\n");
+                return true;
+        }
+        fprintf(stdout, "%s %u\n", args.repair ? "repaired" : "drift", n_drift);
+        return args.repair;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
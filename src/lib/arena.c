@@ -0,0 +1,202 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "log.h"
+#include "util.h"
+
+/**
+ * Chunk size, enough for a handful of fully inspected kernels. Anything
+ * larger than a quarter chunk gets a chunk of its own.
+ */
+#define CBM_ARENA_CHUNK (16 * 1024)
+#define CBM_ARENA_ALIGN alignof(max_align_t)
+
+typedef struct CbmArenaChunk {
+        struct CbmArenaChunk *next; /**<Previously filled chunk */
+        size_t size;                /**<Usable bytes in data */
+        size_t used;                /**<Bytes handed out so far */
+        alignas(max_align_t) char data[];
+} CbmArenaChunk;
+
+struct CbmArena {
+        CbmArenaChunk *chunks; /**<Current chunk, linking to older ones */
+};
+
+static size_t cbm_arena_align(size_t n)
+{
+        return (n + CBM_ARENA_ALIGN - 1) & ~(CBM_ARENA_ALIGN - 1);
+}
+
+static CbmArenaChunk *cbm_arena_chunk_new(size_t size)
+{
+        CbmArenaChunk *chunk = malloc(sizeof(struct CbmArenaChunk) + size);
+
+        if (!chunk) {
+                DECLARE_OOM();
+                abort();
+        }
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        return chunk;
+}
+
+CbmArena *cbm_arena_new(void)
+{
+        CbmArena *ret = calloc(1, sizeof(struct CbmArena));
+
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+void cbm_arena_free(CbmArena *arena)
+{
+        CbmArenaChunk *chunk = NULL;
+
+        if (!arena) {
+                return;
+        }
+        chunk = arena->chunks;
+        while (chunk) {
+                CbmArenaChunk *next = chunk->next;
+
+                free(chunk);
+                chunk = next;
+        }
+        free(arena);
+}
+
+/**
+ * Room left in the current chunk, once aligned
+ */
+static size_t cbm_arena_room(const CbmArena *arena)
+{
+        const CbmArenaChunk *chunk = arena->chunks;
+
+        if (!chunk || cbm_arena_align(chunk->used) >= chunk->size) {
+                return 0;
+        }
+        return chunk->size - cbm_arena_align(chunk->used);
+}
+
+/**
+ * Hand out @size bytes without clearing them
+ */
+static void *cbm_arena_take(CbmArena *arena, size_t size)
+{
+        CbmArenaChunk *chunk = NULL;
+        void *ret = NULL;
+
+        if (size > cbm_arena_room(arena)) {
+                if (size > CBM_ARENA_CHUNK / 4) {
+                        /* Behind the current chunk, so its free space isn't lost */
+                        chunk = cbm_arena_chunk_new(size);
+                        chunk->used = size;
+                        if (arena->chunks) {
+                                chunk->next = arena->chunks->next;
+                                arena->chunks->next = chunk;
+                        } else {
+                                arena->chunks = chunk;
+                        }
+                        return chunk->data;
+                }
+                chunk = cbm_arena_chunk_new(CBM_ARENA_CHUNK);
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+        }
+
+        chunk = arena->chunks;
+        chunk->used = cbm_arena_align(chunk->used);
+        ret = chunk->data + chunk->used;
+        chunk->used += size;
+        return ret;
+}
+
+void *cbm_arena_alloc(CbmArena *arena, size_t size)
+{
+        void *ret = cbm_arena_take(arena, size);
+
+        memset(ret, 0, size);
+        return ret;
+}
+
+char *cbm_arena_strdup(CbmArena *arena, const char *s)
+{
+        size_t len = strlen(s) + 1;
+
+        return memcpy(cbm_arena_take(arena, len), s, len);
+}
+
+char *cbm_arena_vprintf(CbmArena *arena, const char *fmt, va_list va)
+{
+        CbmArenaChunk *chunk = NULL;
+        size_t room = cbm_arena_room(arena);
+        char *dst = NULL;
+        va_list copy;
+        int len = 0;
+
+        /* Format straight into the free space, which almost always fits */
+        if (room > 0) {
+                chunk = arena->chunks;
+                dst = chunk->data + cbm_arena_align(chunk->used);
+        }
+        va_copy(copy, va);
+        len = vsnprintf(dst, room, fmt, copy);
+        va_end(copy);
+        if (len < 0) {
+                DECLARE_OOM();
+                abort();
+        }
+        if ((size_t)len < room) {
+                return cbm_arena_take(arena, (size_t)len + 1);
+        }
+
+        dst = cbm_arena_take(arena, (size_t)len + 1);
+        va_copy(copy, va);
+        vsnprintf(dst, (size_t)len + 1, fmt, copy);
+        va_end(copy);
+        return dst;
+}
+
+char *cbm_arena_printf(CbmArena *arena, const char *fmt, ...)
+{
+        char *ret = NULL;
+        va_list va;
+
+        va_start(va, fmt);
+        ret = cbm_arena_vprintf(arena, fmt, va);
+        va_end(va);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,71 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "nica/util.h"
+
+/**
+ * Bump allocator for data that all dies at once, such as the kernels of one
+ * scan. Allocations are carved out of large chunks and are never freed on
+ * their own, only the whole arena is. Not thread safe.
+ */
+typedef struct CbmArena CbmArena;
+
+/**
+ * Construct a new, empty CbmArena
+ */
+CbmArena *cbm_arena_new(void);
+
+/**
+ * Free @arena along with everything ever allocated from it
+ */
+void cbm_arena_free(CbmArena *arena);
+
+/**
+ * Allocate @size zeroed bytes, suitably aligned for any type
+ */
+void *cbm_arena_alloc(CbmArena *arena, size_t size);
+
+/**
+ * Copy @s into the arena
+ */
+char *cbm_arena_strdup(CbmArena *arena, const char *s);
+
+/**
+ * Format a string into the arena, printf style
+ */
+char *cbm_arena_printf(CbmArena *arena, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * va_list variant of cbm_arena_printf
+ */
+char *cbm_arena_vprintf(CbmArena *arena, const char *fmt, va_list va)
+    __attribute__((format(printf, 2, 0)));
+
+DEF_AUTOFREE(CbmArena, cbm_arena_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
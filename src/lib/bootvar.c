@@ -20,7 +20,6 @@
 #define LITTLE_ENDIAN __LITTLE_ENDIAN
 #define BIG_ENDIAN __BIG_ENDIAN
 
-#include <alloca.h>
 #include <blkid.h>
 #include <ctype.h>
 #include <efi.h>
@@ -29,6 +28,7 @@
 #include <efivar.h>
 #include <errno.h>
 #include <log.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,60 +43,155 @@
  * side effects. */
 #define CBM_BOOTVAR_TEST_MODE_VAR "CBM_BOOTVAR_TEST_MODE"
 
-typedef struct boot_rec boot_rec_t;
+/* number of boot record hash buckets, plenty for the few hundred entries even
+ * the most crowded firmware holds. */
+#define BOOT_REC_BUCKETS 64
 
-struct boot_rec {
-        char *name;
-        int num;
-        unsigned char *data;
-        boot_rec_t *next;
+/* a Boot#### variable. enumerating the variables is cheap but reading each
+ * one may not be, so the payload is only read when looking for an existing
+ * record, and at most once. */
+typedef struct boot_rec {
+        char name[9]; /* variable name, e.g. "BootXXXX". */
+        uint16_t num;
+        int loaded; /* payload was read, or failed to be */
+        uint8_t *data;
+        size_t size;
+        uint64_t digest;
+        int next; /* next record in the same bucket, -1 terminated */
+} boot_rec_t;
+
+/* every Boot#### variable, owned by whoever called bootvar_init(). */
+struct bootvar_table {
+        int test_mode; /* no side effects, see CBM_BOOTVAR_TEST_MODE_VAR */
+        boot_rec_t *recs;
+        size_t cnt;
+        size_t alloc;
+        int buckets[BOOT_REC_BUCKETS]; /* loaded records by payload digest */
+        uint64_t used[65536 / 64];     /* boot numbers that are taken */
+        uint16_t *boot_order;          /* BootOrder, read on first use */
+        size_t boot_order_cnt;
+        uint32_t boot_order_attrs;
+        int have_boot_order;
+        int boot_order_dirty; /* boot_order needs writing back */
 };
 
-static boot_rec_t *boot_recs;
-static int boot_recs_cnt;
+static void bootvar_free_boot_recs(bootvar_table_t *table)
+{
+        for (size_t i = 0; i < table->cnt; i++) {
+                free(table->recs[i].data);
+        }
+        free(table->recs);
+        free(table->boot_order);
+        table->recs = NULL;
+        table->cnt = 0;
+        table->alloc = 0;
+        memset(table->used, 0, sizeof(table->used));
+        table->boot_order = NULL;
+        table->boot_order_cnt = 0;
+        table->boot_order_attrs = 0;
+        table->have_boot_order = 0;
+        table->boot_order_dirty = 0;
+        for (size_t i = 0; i < BOOT_REC_BUCKETS; i++) {
+                table->buckets[i] = -1;
+        }
+}
 
-static int test_mode = 0;
+static void bootvar_print_boot_recs(const bootvar_table_t *table) __attribute__((unused));
+static void bootvar_print_boot_recs(const bootvar_table_t *table)
+{
+        for (size_t i = 0; i < table->cnt; i++) {
+                fprintf(stderr,
+                        "Boot record #%d: %s\n",
+                        table->recs[i].num,
+                        table->recs[i].name);
+        }
+}
 
-static void bootvar_free_boot_recs(void)
+/* FNV-1a, only used to bucket payloads. */
+static uint64_t bootvar_digest(const uint8_t *data, size_t size)
 {
-        boot_rec_t *p, *c;
-        c = boot_recs;
-        if (!c) {
-                return;
+        uint64_t h = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < size; i++) {
+                h ^= data[i];
+                h *= 1099511628211ULL;
         }
-        boot_recs = NULL;
-        do {
-                p = c;
-                c = c->next;
-                free(p);
-        } while (c);
+        return h;
 }
 
-static void bootvar_print_boot_recs(void) __attribute__((unused));
-static void bootvar_print_boot_recs(void)
+/* appends a record without payload, returning its index or -1. */
+static int bootvar_append_boot_rec(bootvar_table_t *table, uint16_t num)
 {
-        boot_rec_t *c = boot_recs;
-        if (!c) {
+        boot_rec_t *c;
+
+        if (table->cnt == table->alloc) {
+                size_t alloc = table->alloc ? table->alloc * 2 : 32;
+                boot_rec_t *recs = realloc(table->recs, alloc * sizeof(boot_rec_t));
+                if (!recs) {
+                        LOG_FATAL("Out of memory for boot records");
+                        return -1;
+                }
+                table->recs = recs;
+                table->alloc = alloc;
+        }
+
+        c = &table->recs[table->cnt];
+        memset(c, 0, sizeof(boot_rec_t));
+        snprintf(c->name, sizeof(c->name), "Boot%04X", num);
+        c->num = num;
+        c->next = -1;
+        table->used[num / 64] |= 1ULL << (num % 64);
+
+        return (int)table->cnt++;
+}
+
+/* takes ownership of data as the payload of record i. */
+static void bootvar_set_boot_rec_data(bootvar_table_t *table, int i, uint8_t *data,
+                                      size_t size)
+{
+        boot_rec_t *c = &table->recs[i];
+        size_t bucket;
+
+        c->loaded = 1;
+        c->data = data;
+        c->size = size;
+        c->digest = bootvar_digest(data, size);
+
+        bucket = c->digest % BOOT_REC_BUCKETS;
+        c->next = table->buckets[bucket];
+        table->buckets[bucket] = i;
+}
+
+static void bootvar_load_boot_rec(bootvar_table_t *table, int i)
+{
+        boot_rec_t *c = &table->recs[i];
+        uint8_t *data = NULL;
+        size_t size = 0;
+        uint32_t attr;
+
+        if (c->loaded) {
                 return;
         }
-        do {
-                fprintf(stderr, "Boot record #%d: %s\n", c->num, c->name);
-        } while ((c = c->next));
+        if (efi_get_variable(EFI_GLOBAL_GUID, c->name, &data, &size, &attr) < 0) {
+                LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+                c->loaded = 1;
+                return;
+        }
+        bootvar_set_boot_rec_data(table, i, data, size);
 }
 
-/* enumerates boot recs and initializes boot_recs and boot_recs_cnt. */
-static int bootvar_read_boot_recs(void)
+/* enumerates boot recs and initializes the table. */
+static int bootvar_read_boot_recs(bootvar_table_t *table)
 {
         int res;
         efi_guid_t *guid = NULL;
         char *name = NULL;
-        boot_rec_t *p = NULL, *c;
-        int i = 0;
 
-        bootvar_free_boot_recs();
+        bootvar_free_boot_recs(table);
 
         while ((res = efi_get_next_variable_name(&guid, &name)) > 0) {
                 char *num_end;
+                long num;
                 if (strncmp(name, "Boot", 4)) {
                         continue;
                 }
@@ -108,171 +203,127 @@ static int bootvar_read_boot_recs(void)
                         continue;
                 }
 
-                c = (boot_rec_t *)malloc(sizeof(boot_rec_t));
-                memset(c, 0, sizeof(boot_rec_t));
-                c->name = strdup(name);
-                c->num = (int)strtol(name + 4, &num_end, 16);
-                if (num_end - name - 4 != 4) {
+                num = strtol(name + 4, &num_end, 16);
+                if (num_end - name - 4 != 4 || *num_end != '\0') {
                         continue;
                 }
-
-                if (!boot_recs) {
-                        boot_recs = p = c;
-                } else {
-                        p->next = c;
-                        p = c;
+                if (bootvar_append_boot_rec(table, (uint16_t)num) < 0) {
+                        return -EBOOT_VAR_ERR;
                 }
-                i++;
         }
         if (res < 0) {
                 LOG_FATAL("efi_get_next_variable_name() failed: %s", strerror(errno));
                 return -EBOOT_VAR_ERR;
         }
-        boot_recs_cnt = i;
         return 0;
 }
 
-/* given the record, puts it first in the boot order (via BootOrder EFI
- * variable). */
-static int bootvar_push_to_boot_order(boot_rec_t *rec)
+static int bootvar_load_boot_order(bootvar_table_t *table)
 {
-        uint16_t number;
-        uint16_t *boot_order;
-        uint16_t *new_boot_order;
-        size_t boot_order_size;
-        size_t new_boot_order_size;
-        uint32_t boot_order_attrs;
-        unsigned int i;
-        int found = 0;
+        uint8_t *data = NULL;
+        size_t size = 0;
 
-        if (!rec || !rec->name) {
-                return -EBOOT_VAR_ERR;
+        if (table->have_boot_order) {
+                return 0;
         }
-
         if (efi_get_variable(EFI_GLOBAL_GUID,
                              "BootOrder",
-                             (uint8_t **)&boot_order,
-                             &boot_order_size,
-                             &boot_order_attrs)) {
+                             &data,
+                             &size,
+                             &table->boot_order_attrs)) {
                 LOG_FATAL("efi_get_variable() failed: %s", strerror(errno));
                 return -EBOOT_VAR_ERR;
         }
-
-        sscanf(rec->name, "Boot%04hX", &number);
-
+        table->boot_order = (uint16_t *)data;
         /* read as uint16_t, hence twice less the returned size */
-        boot_order_size >>= 1;
-
-        for (i = 0; i < boot_order_size; i++) {
-                if (boot_order[i] == number) {
-                        found = 1;
-                        break;
-                }
-        }
-
-        if (!found) {
-                new_boot_order_size = boot_order_size + 1;
-                new_boot_order = (uint16_t *)malloc(new_boot_order_size * sizeof(uint16_t));
-                new_boot_order[0] = number;
-                memcpy(new_boot_order + 1, boot_order, boot_order_size * sizeof(uint16_t));
-        } else {
-                uint16_t *c;
-                new_boot_order = (uint16_t *)malloc(boot_order_size * sizeof(uint16_t));
-                new_boot_order[0] = number;
-                c = new_boot_order + 1;
-                for (i = 0; i < boot_order_size; i++) {
-                        if (boot_order[i] != number) {
-                                *c = boot_order[i];
-                                c++;
-                        }
-                }
-                new_boot_order_size = (size_t)(c - new_boot_order);
-        }
-
-        new_boot_order_size <<= 1;
-        if (efi_set_variable(EFI_GLOBAL_GUID,
-                             "BootOrder",
-                             (uint8_t *)new_boot_order,
-                             new_boot_order_size,
-                             boot_order_attrs,
-                             0644)) {
-                LOG_FATAL("efi_set_variable() failed: %s", strerror(errno));
-                return -EBOOT_VAR_ERR;
-        }
-
+        table->boot_order_cnt = size >> 1;
+        table->have_boot_order = 1;
         return 0;
 }
 
-static int cmp(const void *a, const void *b)
-{
-        return *((int *)a) - *((int *)b);
-}
-
-/* finds the first available free number for a boot var. */
-static int bootvar_find_free_no(void)
+/* given the record, puts it first in the boot order. this is only written
+ * back to the BootOrder EFI variable by bootvar_commit(). */
+static int bootvar_push_to_boot_order(bootvar_table_t *table, int rec)
 {
-        int *nums;
-        int res;
-        int i = 0;
-        boot_rec_t *c = boot_recs;
+        uint16_t number;
+        uint16_t *boot_order = NULL;
+        uint16_t *c;
         size_t cnt;
 
-        if (!boot_recs) {
-                return -1;
+        if (rec < 0) {
+                return -EBOOT_VAR_ERR;
         }
-        if (!boot_recs_cnt) {
-                return 0; /* no records. */
+        if (bootvar_load_boot_order(table)) {
+                return -EBOOT_VAR_ERR;
         }
 
-        cnt = (size_t)boot_recs_cnt;
+        number = table->recs[rec].num;
+        cnt = table->boot_order_cnt;
+        if (cnt > 0 && table->boot_order[0] == number) {
+                return 0; /* already first. */
+        }
 
-        nums = (int *)alloca(sizeof(int) * cnt);
-        memset(nums, 0, sizeof(int) * cnt);
+        boot_order = (uint16_t *)malloc((cnt + 1) * sizeof(uint16_t));
+        if (!boot_order) {
+                LOG_FATAL("Out of memory for BootOrder");
+                return -EBOOT_VAR_ERR;
+        }
+        boot_order[0] = number;
+        c = boot_order + 1;
+        for (size_t i = 0; i < cnt; i++) {
+                if (table->boot_order[i] != number) {
+                        *c = table->boot_order[i];
+                        c++;
+                }
+        }
 
-        do {
-                nums[i] = c->num;
-                i++;
-        } while ((c = c->next));
+        free(table->boot_order);
+        table->boot_order = boot_order;
+        table->boot_order_cnt = (size_t)(c - boot_order);
+        table->boot_order_dirty = 1;
 
-        qsort(nums, cnt, sizeof(int), cmp);
+        return 0;
+}
 
-        for (i = 0, res = 0; i < boot_recs_cnt; i++, res++) {
-                if (res < nums[i]) {
-                        break;
+/* finds the first available free number for a boot var, -1 if there is none. */
+static int bootvar_find_free_no(const bootvar_table_t *table)
+{
+        for (size_t i = 0; i < sizeof(table->used) / sizeof(table->used[0]); i++) {
+                if (table->used[i] != UINT64_MAX) {
+                        return (int)(i * 64) + __builtin_ctzll(~table->used[i]);
                 }
         }
-        if (res == nums[boot_recs_cnt - 1]) {
-                res++; /* no gap. */
-        }
-        return res;
+        return -1;
 }
 
-/* finds and returns boot rec whose value is data of size. NULL if not found. */
-static boot_rec_t *bootvar_find_boot_rec(uint8_t *data, size_t size)
+/* finds the index of the boot rec whose value is data of size. -1 if not found. */
+static int bootvar_find_boot_rec(bootvar_table_t *table, const uint8_t *data, size_t size)
 {
-        boot_rec_t *c = boot_recs;
-        boot_rec_t *res = NULL;
-
-        uint8_t *cdata;
-        size_t csize;
-        uint32_t cattr;
-
-        if (!boot_recs || !boot_recs_cnt) {
-                return NULL;
+        uint64_t digest = bootvar_digest(data, size);
+
+        /* records read so far */
+        for (int i = table->buckets[digest % BOOT_REC_BUCKETS]; i >= 0;
+             i = table->recs[i].next) {
+                const boot_rec_t *c = &table->recs[i];
+                if (c->digest == digest && c->size == size && !memcmp(c->data, data, size)) {
+                        return i;
+                }
         }
 
-        do {
-                if (efi_get_variable(EFI_GLOBAL_GUID, c->name, &cdata, &csize, &cattr) < 0) {
-                        LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+        /* then read the rest, only as far as needed */
+        for (size_t i = 0; i < table->cnt; i++) {
+                const boot_rec_t *c = &table->recs[i];
+                if (c->loaded) {
                         continue;
                 }
-                if (csize == size && !memcmp(cdata, data, csize)) {
-                        res = c;
-                        break;
+                bootvar_load_boot_rec(table, (int)i);
+                if (c->data && c->digest == digest && c->size == size &&
+                    !memcmp(c->data, data, size)) {
+                        return (int)i;
                 }
-        } while ((c = c->next));
+        }
 
-        return res;
+        return -1;
 }
 
 typedef struct part_info {
@@ -346,44 +397,48 @@ static int bootvar_get_part_info(const char *path, part_info_t *pi)
         return 0;
 }
 
-/* attempts to look up existing record, otherwise creates a new one. */
-static boot_rec_t *bootvar_add_boot_rec(uint8_t *data, size_t len)
+/* attempts to look up existing record, otherwise creates a new one. returns
+ * the index of the record or -1. */
+static int bootvar_add_boot_rec(bootvar_table_t *table, uint8_t *data, size_t len)
 {
         char name[9]; /* variable name, e.g. "BootXXXX". */
         int slot;
+        int res;
+        uint8_t *copy;
         uint32_t attr = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
                         EFI_VARIABLE_RUNTIME_ACCESS;
-        boot_rec_t *c, *res = bootvar_find_boot_rec(data, len);
 
-        if (res) {
+        res = bootvar_find_boot_rec(table, data, len);
+        if (res >= 0) {
                 return res;
         }
         /* no such record, create one. */
-        slot = bootvar_find_free_no();
+        slot = bootvar_find_free_no(table);
         if (slot < 0) {
-                return NULL;
+                LOG_FATAL("No free boot variable numbers");
+                return -1;
         }
         if (snprintf(name, 9, "Boot%04X", slot) > 8) {
-                return NULL;
+                return -1;
+        }
+        copy = (uint8_t *)malloc(len);
+        if (!copy) {
+                LOG_FATAL("Out of memory for boot record");
+                return -1;
         }
+        memcpy(copy, data, len);
         if (efi_set_variable(EFI_GLOBAL_GUID, name, data, len, attr, 0644) < 0) {
                 LOG_FATAL("efi_set_variable() failed: %s", strerror(errno));
-                return NULL;
-        }
-        /* re-read the records and find the variable that was just created. */
-        if (bootvar_read_boot_recs() < 0) {
-                return NULL;
+                free(copy);
+                return -1;
         }
-        if (!boot_recs) {
-                return NULL; /* something went terribly wrong. */
+        /* we know exactly what was written, no need to read it back. */
+        res = bootvar_append_boot_rec(table, (uint16_t)slot);
+        if (res < 0) {
+                free(copy);
+                return -1;
         }
-        c = boot_recs;
-        do {
-                if (!strcmp(c->name, name)) {
-                        res = c;
-                        break;
-                }
-        } while ((c = c->next));
+        bootvar_set_boot_rec_data(table, res, copy, len);
 
         return res;
 }
@@ -429,12 +484,13 @@ static int bootvar_make_boot_rec_data(const char *esp_mount_path, const char *bo
         return 0;
 }
 
-int bootvar_has_boot_rec(const char *esp_mount_path, const char *bootloader_esp_path)
+int bootvar_has_boot_rec(bootvar_table_t *table, const char *esp_mount_path,
+                         const char *bootloader_esp_path)
 {
         uint8_t data[BOOT_VAR_MAX];
         ssize_t data_size = BOOT_VAR_MAX;
 
-        if (test_mode) {
+        if (table->test_mode) {
                 return 1;
         }
 
@@ -442,18 +498,18 @@ int bootvar_has_boot_rec(const char *esp_mount_path, const char *bootloader_esp_
                 return 0;
         }
 
-        return (bootvar_find_boot_rec(data, (size_t)data_size) != NULL);
+        return (bootvar_find_boot_rec(table, data, (size_t)data_size) >= 0);
 }
 
-int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path, char *varname,
-                   size_t size)
+int bootvar_create(bootvar_table_t *table, const char *esp_mount_path,
+                   const char *bootloader_esp_path, char *varname, size_t size)
 {
         uint8_t data[BOOT_VAR_MAX]; /* this is what efivar supports and it should be
                                        enough. */
         ssize_t data_size = BOOT_VAR_MAX;
-        boot_rec_t *rec;
+        int rec;
 
-        if (test_mode) {
+        if (table->test_mode) {
                 return 0;
         }
 
@@ -461,19 +517,20 @@ int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path,
                 return -EBOOT_VAR_ERR;
         }
 
-        rec = bootvar_add_boot_rec(data, (size_t)data_size);
-        if (!rec) {
+        rec = bootvar_add_boot_rec(table, data, (size_t)data_size);
+        if (rec < 0) {
                 return -EBOOT_VAR_ERR;
         }
 
-        if (bootvar_push_to_boot_order(rec)) {
+        if (bootvar_push_to_boot_order(table, rec)) {
                 return -EBOOT_VAR_ERR;
         }
 
         if (varname && size) {
-                size_t len = strlen(rec->name);
+                const char *name = table->recs[rec].name;
+                size_t len = strlen(name);
                 if (len < size) {
-                        snprintf(varname, len + 1, "%s", rec->name);
+                        snprintf(varname, len + 1, "%s", name);
                 } else {
                         LOG_ERROR("%lu bytes is not enough. Need %lu.", size, len);
                 }
@@ -482,31 +539,66 @@ int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path,
         return 0;
 }
 
-int bootvar_init(void)
+int bootvar_commit(bootvar_table_t *table)
 {
-        char *test_mode_env = getenv(CBM_BOOTVAR_TEST_MODE_VAR);
-        if (test_mode_env && !strncmp(test_mode_env, "yes", 4)) {
-                LOG_INFO("EFI variables support is disabled: " CBM_BOOTVAR_TEST_MODE_VAR " is set");
-                test_mode = 1;
-        }
-        if (test_mode) {
+        if (table->test_mode || !table->boot_order_dirty) {
                 return 0;
         }
-        if (efi_variables_supported() < 0) {
-                return -EBOOT_VAR_NOSUP;
+        if (efi_set_variable(EFI_GLOBAL_GUID,
+                             "BootOrder",
+                             (uint8_t *)table->boot_order,
+                             table->boot_order_cnt * sizeof(uint16_t),
+                             table->boot_order_attrs,
+                             0644)) {
+                LOG_FATAL("efi_set_variable() failed: %s", strerror(errno));
+                return -EBOOT_VAR_ERR;
         }
-        if (bootvar_read_boot_recs() < 0) {
+        table->boot_order_dirty = 0;
+        return 0;
+}
+
+int bootvar_init(bootvar_table_t **out)
+{
+        bootvar_table_t *table = NULL;
+        char *test_mode_env = getenv(CBM_BOOTVAR_TEST_MODE_VAR);
+
+        *out = NULL;
+        table = calloc(1, sizeof(bootvar_table_t));
+        if (!table) {
+                LOG_FATAL("Out of memory for boot records");
                 return -EBOOT_VAR_ERR;
         }
+        bootvar_free_boot_recs(table);
+
+        if (test_mode_env && !strncmp(test_mode_env, "yes", 4)) {
+                LOG_INFO("EFI variables support is disabled: " CBM_BOOTVAR_TEST_MODE_VAR " is set");
+                table->test_mode = 1;
+        }
+        if (!table->test_mode) {
+                if (efi_variables_supported() < 0) {
+                        free(table);
+                        return -EBOOT_VAR_NOSUP;
+                }
+                if (bootvar_read_boot_recs(table) < 0) {
+                        bootvar_free_boot_recs(table);
+                        free(table);
+                        return -EBOOT_VAR_ERR;
+                }
+        }
+        *out = table;
         return 0;
 }
 
-void bootvar_destroy(void)
+void bootvar_destroy(bootvar_table_t *table)
 {
-        if (test_mode) {
+        if (!table) {
                 return;
         }
-        bootvar_free_boot_recs();
+        if (table->boot_order_dirty) {
+                LOG_ERROR("Discarding BootOrder changes that were never committed");
+        }
+        bootvar_free_boot_recs(table);
+        free(table);
 }
 
 /* vim: set nosi noai cin ts=8 sw=8 et tw=80: */
@@ -14,9 +14,16 @@
 #define EBOOT_VAR_ERR 1     /* general error */
 #define EBOOT_VAR_NOSUP 127 /* EFI vars not supported */
 
-int bootvar_init(void);
-void bootvar_destroy(void);
-int bootvar_create(const char *, const char *, char *, size_t);
-int bootvar_has_boot_rec(const char *, const char *);
+/* the boot variables as read by bootvar_init(). each caller has its own, so
+ * separate threads never share one. */
+typedef struct bootvar_table bootvar_table_t;
+
+/* on success, *table must be released with bootvar_destroy(). */
+int bootvar_init(bootvar_table_t **table);
+void bootvar_destroy(bootvar_table_t *);
+int bootvar_create(bootvar_table_t *, const char *, const char *, char *, size_t);
+int bootvar_has_boot_rec(bootvar_table_t *, const char *, const char *);
+/* writes back BootOrder changes made by bootvar_create(), at most once. */
+int bootvar_commit(bootvar_table_t *);
 
 /* vim: set nosi noai cin ts=8 sw=8 et tw=80: */
@@ -0,0 +1,232 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "casepath.h"
+#include "log.h"
+#include "nica/hashmap.h"
+#include "trace.h"
+#include "util.h"
+
+/**
+ * Every directory read so far, mapping its path to a table of its case-folded
+ * entry names to their actual spelling
+ */
+static struct {
+        pthread_mutex_t lock;
+        NcHashmap *dirs;
+} cbm_case_index = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+static char *cbm_case_fold(const char *name)
+{
+        char *ret = strdup(name);
+
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (char *c = ret; *c; c++) {
+                *c = (char)tolower(*c);
+        }
+        return ret;
+}
+
+static void cbm_case_table_free(void *table)
+{
+        nc_hashmap_free(table);
+}
+
+/**
+ * Read @dir into a new table. A missing directory has no entries, which is
+ * worth remembering too until it's created.
+ *
+ * @return NULL if the directory can't be read
+ */
+static NcHashmap *cbm_case_read_dir(const char *dir)
+{
+        NcHashmap *ret = NULL;
+        DIR *dfd = NULL;
+        struct dirent *ent = NULL;
+
+        CBM_TRACE_SCOPE("case_path_scan");
+
+        ret = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        dfd = opendir(dir);
+        if (!dfd) {
+                if (errno == ENOENT || errno == ENOTDIR) {
+                        return ret;
+                }
+                LOG_DEBUG("Unable to read %s: %s", dir, strerror(errno));
+                nc_hashmap_free(ret);
+                return NULL;
+        }
+
+        while ((ent = readdir(dfd)) != NULL) {
+                char *name = NULL;
+                char *folded = NULL;
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+                folded = cbm_case_fold(ent->d_name);
+                /* Ambiguous on a case-sensitive filesystem, keep the first */
+                if (nc_hashmap_contains(ret, folded)) {
+                        free(folded);
+                        continue;
+                }
+                name = strdup(ent->d_name);
+                if (!name || !nc_hashmap_put(ret, folded, name)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        closedir(dfd);
+
+        return ret;
+}
+
+/**
+ * Resolve the spelling of @name within @dir. Must be called with the lock held.
+ *
+ * @return the existing spelling, or @name itself if there is none
+ */
+static const char *cbm_case_lookup(const char *dir, const char *name)
+{
+        NcHashmap *table = NULL;
+        autofree(char) *folded = NULL;
+        const char *found = NULL;
+
+        if (!cbm_case_index.dirs) {
+                cbm_case_index.dirs =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, cbm_case_table_free);
+                if (!cbm_case_index.dirs) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        table = nc_hashmap_get(cbm_case_index.dirs, dir);
+        if (!table) {
+                char *key = NULL;
+
+                table = cbm_case_read_dir(dir);
+                if (!table) {
+                        return name;
+                }
+                key = strdup(dir);
+                if (!key || !nc_hashmap_put(cbm_case_index.dirs, key, table)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        folded = cbm_case_fold(name);
+        found = nc_hashmap_get(table, folded);
+        return found ? found : name;
+}
+
+char *cbm_case_path_build(const char *base, ...)
+{
+        va_list ap;
+        const char *component = NULL;
+        char *ret = NULL;
+
+        ret = strdup(base);
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        pthread_mutex_lock(&cbm_case_index.lock);
+        va_start(ap, base);
+        while ((component = va_arg(ap, const char *)) != NULL) {
+                autofree(char) *dup = strdup(component);
+                char *saveptr = NULL;
+
+                if (!dup) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                for (char *tok = strtok_r(dup, "/", &saveptr); tok;
+                     tok = strtok_r(NULL, "/", &saveptr)) {
+                        char *next = string_printf("%s/%s", ret, cbm_case_lookup(ret, tok));
+
+                        free(ret);
+                        ret = next;
+                }
+        }
+        va_end(ap);
+        pthread_mutex_unlock(&cbm_case_index.lock);
+
+        return ret;
+}
+
+void cbm_case_path_invalidate(const char *path)
+{
+        autofree(char) *dir = NULL;
+        char *slash = NULL;
+
+        dir = strdup(path);
+        if (!dir) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        pthread_mutex_lock(&cbm_case_index.lock);
+        if (cbm_case_index.dirs) {
+                for (;;) {
+                        nc_hashmap_remove(cbm_case_index.dirs, dir);
+                        slash = strrchr(dir, '/');
+                        if (!slash || slash == dir) {
+                                break;
+                        }
+                        *slash = '\0';
+                }
+        }
+        pthread_mutex_unlock(&cbm_case_index.lock);
+}
+
+void cbm_case_path_reset(void)
+{
+        pthread_mutex_lock(&cbm_case_index.lock);
+        if (cbm_case_index.dirs) {
+                nc_hashmap_free(cbm_case_index.dirs);
+                cbm_case_index.dirs = NULL;
+        }
+        pthread_mutex_unlock(&cbm_case_index.lock);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,55 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+/**
+ * Index of the directories within a case-insensitive boot directory.
+ *
+ * Each directory is read once, on the first lookup within it, into a table
+ * keyed by the case-folded names. A name that isn't found resolves to the
+ * spelling asked for, so creating it in that spelling keeps the index valid.
+ * Removing an entry must invalidate it.
+ */
+
+/**
+ * Build a path beneath @base from the given components, using the existing
+ * spelling of every component that's found case-insensitively. Components may
+ * contain slashes, anything not found is used as given.
+ *
+ * @return a newly allocated path
+ */
+char *cbm_case_path_build(const char *base, ...) __attribute__((sentinel(0)));
+
+/**
+ * Forget the indexed entries of @path and every directory above it, i.e.
+ * after creating or removing @path
+ */
+void cbm_case_path_invalidate(const char *path);
+
+/**
+ * Forget everything that has been indexed, i.e. when the boot directory
+ * has been (re)mounted
+ */
+void cbm_case_path_reset(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
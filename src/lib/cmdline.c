@@ -13,127 +13,152 @@
 
 #include "cmdline.h"
 #include "config.h"
+#include "files.h"
 #include "log.h"
 #include "nica/files.h"
 #include "util.h"
+#include "writer.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <glob.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /**
- * Attempt to parse the command line file and add it to the given output file.
- *
- * @Returns negative code if parsing failed, otherwise the number of bytes (>0)
+ * Merged command line being built up. Tokens are written straight into
+ * buffer, which is always NUL terminated.
+ */
+typedef struct CbmCmdline {
+        char *buffer;
+        size_t len;   /**<Length excluding the terminator */
+        size_t alloc; /**<Allocated size of buffer */
+} CbmCmdline;
+
+/**
+ * Ensure there is room for @n more bytes plus the terminator
  */
-static int cbm_parse_cmdline_file_internal(const char *path, FILE *out)
+static void cbm_cmdline_reserve(CbmCmdline *out, size_t n)
 {
-        autofree(FILE) *f = NULL;
-        size_t sn;
-        ssize_t r = 0;
-        char *buf = NULL;
-        bool ret = true;
-        bool hadcontent = false;
-        int nbytes = 0;
+        size_t need = out->len + n + 1;
+        char *buffer = NULL;
 
-        f = fopen(path, "r");
-        if (!f) {
-                if (errno != ENOENT) {
-                        LOG_ERROR("Unable to open %s: %s", path, strerror(errno));
-                }
-                return false;
+        if (need <= out->alloc) {
+                return;
         }
+        if (need < out->alloc * 2) {
+                need = out->alloc * 2;
+        }
+        buffer = realloc(out->buffer, need);
+        if (!buffer) {
+                DECLARE_OOM();
+                abort();
+        }
+        out->buffer = buffer;
+        out->alloc = need;
+        out->buffer[out->len] = '\0';
+}
 
-        while ((r = getline(&buf, &sn, f)) > 0) {
-                ssize_t cur = 0;
+static void cbm_cmdline_append_space(CbmCmdline *out)
+{
+        cbm_cmdline_reserve(out, 1);
+        out->buffer[out->len++] = ' ';
+        out->buffer[out->len] = '\0';
+}
 
-                /* Strip newlines */
-                if (r >= 1 && buf[r - 1] == '\n') {
-                        buf[r - 1] = '\0';
-                        --r;
-                }
-                char *l = buf;
+/**
+ * Tokenize the mapped contents of a cmdline file into @out. Each line is
+ * stripped of surrounding whitespace, empty and comment lines are skipped
+ * and the remainder joined with single spaces.
+ *
+ * Every line we emit gives up at least its newline for the joining space,
+ * so the output never exceeds the input and a single reservation does.
+ *
+ * @Returns the number of bytes written
+ */
+static size_t cbm_cmdline_tokenize(const char *buf, size_t len, CbmCmdline *out)
+{
+        const char *p = buf;
+        const char *end = buf + len;
+        size_t nbytes = 0;
+        bool hadcontent = false;
 
-                /* Skip empty lines */
-                if (r < 1) {
-                        goto next_line;
-                }
+        cbm_cmdline_reserve(out, len);
+
+        while (p < end) {
+                const char *eol = memchr(p, '\n', (size_t)(end - p));
+                const char *l = p;
+                const char *e = eol ? eol : end;
+
+                p = eol ? eol + 1 : end;
 
                 /* Skip the starting whitespace */
-                while (isspace(*l)) {
+                while (l < e && isspace((unsigned char)*l)) {
                         ++l;
-                        if (!*l) {
-                                break;
-                        }
                 }
 
-                /* Skip a comment */
-                if (l[0] == '#') {
-                        goto next_line;
+                /* Skip empty lines and comments */
+                if (l == e || l[0] == '#') {
+                        continue;
                 }
 
-                /* Reset length */
-                cur = (l - buf);
-                r -= cur;
-
                 /* Strip trailing whitespace */
-                l = rstrip(l, (size_t)r, &r);
-
-                /* May now be an empty line */
-                if (r < 1) {
-                        goto next_line;
+                while (e > l && isspace((unsigned char)e[-1])) {
+                        --e;
                 }
 
                 /* For successive new lines, add a space before writing anything. */
                 if (hadcontent) {
-                        if (fwrite(" ", 1, 1, out) != 1) {
-                                ret = false;
-                                break;
-                        }
+                        out->buffer[out->len++] = ' ';
                         ++nbytes;
                 }
 
-                if (fwrite(l, (size_t)r, 1, out) != 1) {
-                        ret = false;
-                        break;
-                }
-                nbytes += (int)r;
+                memcpy(out->buffer + out->len, l, (size_t)(e - l));
+                out->len += (size_t)(e - l);
+                nbytes += (size_t)(e - l);
 
                 hadcontent = true;
-        next_line:
-                free(buf);
-                buf = NULL;
         }
 
-        if (buf) {
-                free(buf);
-                buf = NULL;
-        }
+        out->buffer[out->len] = '\0';
+        return nbytes;
+}
 
-        if (!ret) {
-                return -1;
+/**
+ * Bump whenever the snapshot layout changes
+ */
+#define CBM_CMDLINE_CACHE_MAGIC "clr-boot-manager-cmdline-cache 1"
+
+/**
+ * Attempt to parse the command line file and add it to the given output.
+ * Missing and empty files contribute nothing.
+ *
+ * @Returns the number of bytes written
+ */
+static size_t cbm_parse_cmdline_file_internal(const char *path, CbmCmdline *out)
+{
+        autofree(CbmMappedFile) *mapped = CBM_MAPPED_FILE_INIT;
+
+        if (!cbm_mapped_file_open(path, mapped)) {
+                /* Zero length files can't be mapped (EINVAL) */
+                if (errno != ENOENT && errno != EINVAL) {
+                        LOG_ERROR("Unable to open %s: %s", path, strerror(errno));
+                }
+                return 0;
         }
-        return nbytes;
+
+        return cbm_cmdline_tokenize(mapped->buffer, mapped->length, out);
 }
 
 char *cbm_parse_cmdline_file(const char *file)
 {
-        FILE *memstr = NULL;
-        autofree(char) *buf = NULL;
-        size_t sz = 0;
+        CbmCmdline out = { 0 };
 
-        memstr = open_memstream(&buf, &sz);
-        if (!memstr) {
-                return NULL;
-        }
-        if (cbm_parse_cmdline_file_internal(file, memstr) < 0) {
-                fclose(memstr);
-                return NULL;
-        }
-        fclose(memstr);
-        return strdup(buf);
+        cbm_cmdline_reserve(&out, 0);
+        cbm_parse_cmdline_file_internal(file, &out);
+        return out.buffer;
 }
 
 /**
@@ -180,24 +205,45 @@ static bool cbm_cmdline_disabled_by_link(char *path)
         return streq(p, "/dev/null");
 }
 
+/**
+ * Note the current identity of @path in @inputs, if we're recording them.
+ * Missing files are recorded with an empty key, so that their appearance
+ * is noticed too.
+ */
+static void cbm_cmdline_record_input(CbmWriter *inputs, const char *path)
+{
+        CbmFileKey key = { 0 };
+
+        if (!inputs) {
+                return;
+        }
+        (void)cbm_file_key_for_path(&key, path);
+        cbm_writer_append_printf(inputs,
+                                 CBM_FILE_KEY_FORMAT "\t%s\n",
+                                 CBM_FILE_KEY_ARGS(&key),
+                                 path);
+}
+
 /**
  * Glob *.conf files within the given glob, and merge the resulting command
  * line into the final stream
  *
- * @Returns negative code if the call failed, or the number of files processed.
+ * @Returns the number of files that contributed to the command line
  */
-static int cbm_parse_cmdline_files_directory(const char *root, bool bump_start, bool check_masked,
-                                             char *globfile, FILE *memstr)
+static size_t cbm_parse_cmdline_files_directory(const char *root, bool bump_start,
+                                                bool check_masked, char *globfile,
+                                                CbmCmdline *out, CbmWriter *inputs)
 {
         glob_t glo = { 0 };
         glo.gl_offs = 0;
         glob(globfile, GLOB_DOOFFS, NULL, &glo);
-        int ret = -1;
         size_t true_index = 0;
 
         for (size_t i = 0; i < glo.gl_pathc; i++) {
                 char *argv = glo.gl_pathv[i];
-                int r = 0;
+
+                /* Masked and disabled files too, they follow their links */
+                cbm_cmdline_record_input(inputs, argv);
 
                 /* If we're in a maskable directory, check if it's masked. */
                 if (check_masked && cbm_cmdline_disabled_by_mask(root, argv)) {
@@ -213,88 +259,217 @@ static int cbm_parse_cmdline_files_directory(const char *root, bool bump_start,
 
                 if (true_index > 0 || bump_start) {
                         /* add a space between all files, after the first file. */
-                        if (fwrite(" ", 1, 1, memstr) != 1) {
-                                goto clean;
-                        }
+                        cbm_cmdline_append_space(out);
                         if (bump_start) {
                                 bump_start = false;
                         }
                 }
 
-                r = cbm_parse_cmdline_file_internal(argv, memstr);
-                if (r < 0) {
-                        goto clean;
-                } else if (r > 0) {
+                if (cbm_parse_cmdline_file_internal(argv, out) > 0) {
                         /* Prevent accidental spaces for masked or empty files */
                         ++true_index;
                 }
         }
 
-        // 0 or more
-        ret = (int)true_index;
-
-clean:
         globfree(&glo);
-        return ret;
+        return true_index;
 }
 
-char *cbm_parse_cmdline_files(const char *root)
+/**
+ * Merge every cmdline source beneath @root, optionally recording the
+ * identity of each input in @inputs before it is read
+ */
+static char *cbm_parse_cmdline_files_internal(const char *root, CbmWriter *inputs)
 {
         autofree(char) *cmdline = NULL;
         autofree(char) *globfile = NULL;
         autofree(char) *vendor_glob = NULL;
-        FILE *memstr = NULL;
-        autofree(char) *buf = NULL;
+        autofree(char) *conf_dir = NULL;
+        autofree(char) *cmdline_dir = NULL;
+        autofree(char) *vendor_dir = NULL;
+        CbmCmdline out = { 0 };
         bool bump_start = false;
-        int ret = 0;
-        size_t sz = 0;
-
-        bool fail = true;
 
         /* global cmdline */
         cmdline = string_printf("%s/%s/cmdline", root, KERNEL_CONF_DIRECTORY);
         globfile = string_printf("%s/%s/cmdline.d/*.conf", root, KERNEL_CONF_DIRECTORY);
         vendor_glob = string_printf("%s/%s/cmdline.d/*.conf", root, VENDOR_KERNEL_CONF_DIRECTORY);
 
-        memstr = open_memstream(&buf, &sz);
-        if (!memstr) {
-                return NULL;
+        /* Directory mtimes catch files being added, removed or masked */
+        if (inputs) {
+                conf_dir = string_printf("%s/%s", root, KERNEL_CONF_DIRECTORY);
+                cmdline_dir = string_printf("%s/%s/cmdline.d", root, KERNEL_CONF_DIRECTORY);
+                vendor_dir = string_printf("%s/%s/cmdline.d", root, VENDOR_KERNEL_CONF_DIRECTORY);
+                cbm_cmdline_record_input(inputs, conf_dir);
+                cbm_cmdline_record_input(inputs, cmdline_dir);
+                cbm_cmdline_record_input(inputs, vendor_dir);
+                cbm_cmdline_record_input(inputs, cmdline);
         }
 
+        cbm_cmdline_reserve(&out, 0);
+
         /* Merge vendor cmdline.d files if present */
-        ret = cbm_parse_cmdline_files_directory(root, bump_start, true, vendor_glob, memstr);
-        bump_start = ret >= 1;
-        if (ret < 0) {
-                goto clean;
+        if (cbm_parse_cmdline_files_directory(root, bump_start, true, vendor_glob, &out, inputs) >
+            0) {
+                bump_start = true;
         }
 
         /* If the local system cmdline exists, merge it it */
         if (nc_file_exists(cmdline)) {
                 /* Add a space after the vendor files */
-                if (bump_start && fwrite(" ", 1, 1, memstr) != 1) {
-                        goto clean;
+                if (bump_start) {
+                        cbm_cmdline_append_space(&out);
                 }
-                ret = cbm_parse_cmdline_file_internal(cmdline, memstr);
-                if (ret < 0) {
-                        goto clean;
-                } else if (ret > 0) {
+                if (cbm_parse_cmdline_file_internal(cmdline, &out) > 0) {
                         /* Might not have had vendor files */
                         bump_start = true;
                 }
         }
 
         /* Merge system cmdline.d files if present */
-        if (cbm_parse_cmdline_files_directory(root, bump_start, false, globfile, memstr) < 0) {
-                goto clean;
+        cbm_parse_cmdline_files_directory(root, bump_start, false, globfile, &out, inputs);
+
+        return out.buffer;
+}
+
+char *cbm_parse_cmdline_files(const char *root)
+{
+        return cbm_parse_cmdline_files_internal(root, NULL);
+}
+
+/**
+ * Return the cmdline held in the snapshot @text if every input recorded
+ * there is unchanged, otherwise NULL
+ */
+static char *cbm_cmdline_cache_validate(char *text)
+{
+        char *line = NULL;
+        char *saveptr = NULL;
+        const char *cmdline = NULL;
+        char *ret = NULL;
+
+        /* Magic, then the cmdline itself, then one input per line */
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, CBM_CMDLINE_CACHE_MAGIC)) {
+                return NULL;
+        }
+        /* Never empty, it always carries a leading tab */
+        line = strtok_r(NULL, "\n", &saveptr);
+        if (!line || line[0] != '\t') {
+                return NULL;
+        }
+        cmdline = line + 1;
+
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                CbmFileKey recorded = { 0 };
+                CbmFileKey current = { 0 };
+                char *path = strchr(line, '\t');
+
+                if (!path) {
+                        return NULL;
+                }
+                *path++ = '\0';
+                if (!cbm_file_key_parse(&recorded, line)) {
+                        return NULL;
+                }
+                (void)cbm_file_key_for_path(&current, path);
+                if (!cbm_file_key_equal(&recorded, &current)) {
+                        LOG_DEBUG("cmdline input changed: %s", path);
+                        return NULL;
+                }
+        }
+
+        ret = strdup(cmdline);
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
         }
+        return ret;
+}
 
-        fail = false;
-clean:
-        fclose(memstr);
-        if (!fail) {
-                return strdup(buf);
+/**
+ * Atomically replace the snapshot at @cache_path
+ */
+static bool cbm_cmdline_cache_write(const char *cache_path, const char *text)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *tmp_path = NULL;
+        const char *slash = strrchr(cache_path, '/');
+
+        if (slash && slash != cache_path) {
+                dir = strndup(cache_path, (size_t)(slash - cache_path));
+                if (!dir) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                        return false;
+                }
         }
-        return NULL;
+
+        tmp_path = string_printf("%s.TmpWrite", cache_path);
+        if (!file_set_text(tmp_path, (char *)text)) {
+                return false;
+        }
+        if (rename(tmp_path, cache_path) != 0) {
+                (void)unlink(tmp_path);
+                return false;
+        }
+        return true;
+}
+
+char *cbm_parse_cmdline_files_cached(const char *root, const char *cache_path)
+{
+        autofree(CbmWriter) *inputs = CBM_WRITER_INIT;
+        autofree(CbmWriter) *snapshot = CBM_WRITER_INIT;
+        autofree(char) *text = NULL;
+        char *ret = NULL;
+
+        if (!cache_path) {
+                return cbm_parse_cmdline_files(root);
+        }
+
+        if (file_get_text(cache_path, &text)) {
+                ret = cbm_cmdline_cache_validate(text);
+                if (ret) {
+                        return ret;
+                }
+                LOG_DEBUG("Discarding stale cmdline cache %s", cache_path);
+        }
+
+        if (!cbm_writer_open(inputs)) {
+                DECLARE_OOM();
+                abort();
+        }
+        ret = cbm_parse_cmdline_files_internal(root, inputs);
+        cbm_writer_close(inputs);
+        if (cbm_writer_error(inputs) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        if (!cbm_writer_open(snapshot)) {
+                DECLARE_OOM();
+                abort();
+        }
+        cbm_writer_append_printf(snapshot,
+                                 "%s\n\t%s\n%s",
+                                 CBM_CMDLINE_CACHE_MAGIC,
+                                 ret,
+                                 inputs->buffer);
+        cbm_writer_close(snapshot);
+        if (cbm_writer_error(snapshot) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* Purely an optimisation, never fail because of it */
+        if (!cbm_cmdline_cache_write(cache_path, snapshot->buffer)) {
+                LOG_DEBUG("Unable to update the cmdline cache %s: %s",
+                          cache_path,
+                          strerror(errno));
+        }
+        return ret;
 }
 
 /*
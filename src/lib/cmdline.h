@@ -15,6 +15,11 @@
 
 #include <stdbool.h>
 
+/**
+ * Default location of the merged cmdline snapshot, relative to the prefix
+ */
+#define CBM_CMDLINE_CACHE_PATH "var/cache/clr-boot-manager/cmdline"
+
 /**
  * Parse all user & cmdline files within the root prefix, and merge them
  * into a single cmdline "entry".
@@ -26,6 +31,18 @@
  */
 char *cbm_parse_cmdline_files(const char *root);
 
+/**
+ * As cbm_parse_cmdline_files, but reuse the snapshot at @cache_path from a
+ * previous run while none of its inputs have changed. The snapshot records
+ * the identity (inode, size, mtime) of both cmdline.d directories, the
+ * configuration directory and every file consulted, so validating it only
+ * stats each one rather than globbing, resolving links and masks, and
+ * parsing. A stale or missing snapshot is rewritten.
+ *
+ * @param cache_path Path of the snapshot, or NULL to not cache at all
+ */
+char *cbm_parse_cmdline_files_cached(const char *root, const char *cache_path);
+
 /**
  * Parse a single cmdline, named cmdline file fully.
  */
@@ -11,29 +11,37 @@
 
 #define _GNU_SOURCE
 
-#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
-#include <glob.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "blkid_stub.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "stage.h"
+#include "stats.h"
 #include "system_stub.h"
+#include "topology.h"
+#include "trace.h"
+#include "uring.h"
 #include "util.h"
 
 /**
@@ -42,145 +50,629 @@
 #define CBM_MBR_BOOT_FLAG (1ULL << 2)
 
 /**
- * By default we call sync() - for testing however we disable this due to timeout
- * issues.
+ * By default we flush everything we write - for testing however we disable
+ * this due to timeout issues.
  */
 static bool cbm_should_sync = true;
 
-void cbm_sync(void)
+/**
+ * Chunk size for copies and comparisons that are throttled, or read with
+ * O_DIRECT. Also the alignment O_DIRECT needs for the buffer.
+ */
+#define CBM_IO_CHUNK (1024 * 1024)
+#define CBM_IO_ALIGN 4096
+
+/**
+ * Block size for comparisons. Small enough that a mismatch near the start
+ * is found after reading little, and that both buffers stay cheap.
+ */
+#define CBM_COMPARE_CHUNK (128 * 1024)
+
+/**
+ * ioprio_set() has no libc wrapper
+ */
+#define CBM_IOPRIO_WHO_PROCESS 1
+#define CBM_IOPRIO_CLASS_SHIFT 13
+#define CBM_IOPRIO_CLASS_IDLE 3
+
+/**
+ * Active I/O policy, shared by every install thread
+ */
+static struct {
+        pthread_mutex_t lock;
+        CbmIoPolicy policy;
+        struct timespec next; /**<When the bandwidth cap allows the next read */
+        int saved_ioprio;     /**<Priority to restore when leaving idle, or -1 */
+} cbm_io = {.lock = PTHREAD_MUTEX_INITIALIZER, .saved_ioprio = -1 };
+
+/**
+ * Barriers deferred by an open sync phase. Kernels are installed from
+ * multiple threads, so this is guarded by lock.
+ */
+static struct {
+        pthread_mutex_t lock;
+        unsigned int depth; /**<Nesting level of open phases */
+        NcHashmap *files;   /**<Files to flush when the phase ends */
+        NcHashmap *dirs;    /**<Directories to flush after the files */
+} cbm_sync_state = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * fsync() a single file or directory. Anything that no longer exists has
+ * nothing left to flush.
+ */
+static bool cbm_sync_one(const char *path)
 {
-        if (cbm_should_sync) {
-                sync();
+        int fd = -1;
+        bool ret = true;
+
+        fd = cbm_system_open(path, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+                return errno == ENOENT;
+        }
+        cbm_stats_inc(CBM_STAT_SYNCS);
+        /* Directories on some filesystems refuse fsync, that's fine */
+        if (cbm_system_fsync(fd) != 0 && errno != EINVAL) {
+                LOG_DEBUG("Failed to flush %s: %s", path, strerror(errno));
+                ret = false;
         }
+        cbm_system_close(fd);
+        return ret;
 }
 
-bool cbm_files_match(const char *p1, const char *p2)
+/**
+ * Parent directory of @path, purely lexically as @path may not exist
+ */
+static char *cbm_sync_dirname(const char *path)
 {
-        autofree(CbmMappedFile) *m1 = CBM_MAPPED_FILE_INIT;
-        autofree(CbmMappedFile) *m2 = CBM_MAPPED_FILE_INIT;
+        const char *slash = strrchr(path, '/');
+        char *ret = NULL;
 
-        if (!cbm_mapped_file_open(p1, m1)) {
-                return false;
+        if (!slash) {
+                ret = strdup(".");
+        } else if (slash == path) {
+                ret = strdup("/");
+        } else {
+                ret = strndup(path, (size_t)(slash - path));
+        }
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
         }
+        return ret;
+}
 
-        if (!cbm_mapped_file_open(p2, m2)) {
-                return false;
+static void cbm_sync_defer(NcHashmap *set, const char *path)
+{
+        char *key = NULL;
+
+        if (nc_hashmap_contains(set, path)) {
+                return;
+        }
+        key = strdup(path);
+        if (!key || !nc_hashmap_put(set, key, key)) {
+                DECLARE_OOM();
+                abort();
         }
+}
 
-        /* If the lengths are different they're clearly not the same file */
-        if (m1->length != m2->length) {
-                return false;
+bool cbm_sync_fd(int fd)
+{
+        if (!cbm_should_sync) {
+                return true;
         }
+        cbm_stats_inc(CBM_STAT_SYNCS);
+        return cbm_system_fsync(fd) == 0;
+}
+
+bool cbm_sync_parent(const char *path)
+{
+        autofree(char) *dir = NULL;
 
-        /* Compare both buffers */
-        if (memcmp(m1->buffer, m2->buffer, m1->length) == 0) {
+        if (!cbm_should_sync || !path) {
                 return true;
         }
-        return false;
+        dir = cbm_sync_dirname(path);
+        return cbm_sync_one(dir);
 }
 
-char *get_boot_device()
+bool cbm_sync_path(const char *path)
 {
-        glob_t glo = { 0 };
-        char read_buf[4096];
-        glo.gl_offs = 1;
-        int fd = -1;
+        autofree(char) *dir = NULL;
+        bool ret = true;
 
-        ssize_t size = 0;
-        autofree(char) *uuid = NULL;
-        autofree(char) *p = NULL;
-        autofree(char) *glob_path = NULL;
-        autofree(char) *dev_path = NULL;
+        if (!cbm_should_sync || !path) {
+                return true;
+        }
 
-        glob_path = string_printf("%s/firmware/efi/efivars/LoaderDevicePartUUID*",
-                                  cbm_system_get_sysfs_path());
+        dir = cbm_sync_dirname(path);
 
-        glob(glob_path, GLOB_DOOFFS, NULL, &glo);
+        pthread_mutex_lock(&cbm_sync_state.lock);
+        if (cbm_sync_state.depth > 0) {
+                cbm_sync_defer(cbm_sync_state.files, path);
+                cbm_sync_defer(cbm_sync_state.dirs, dir);
+                pthread_mutex_unlock(&cbm_sync_state.lock);
+                return true;
+        }
+        pthread_mutex_unlock(&cbm_sync_state.lock);
 
-        if (glo.gl_pathc < 1) {
-                globfree(&glo);
-                goto next;
+        /* Contents first, then the directory entry pointing at them */
+        if (!cbm_sync_one(path)) {
+                ret = false;
+        }
+        if (!cbm_sync_one(dir)) {
+                ret = false;
         }
+        return ret;
+}
 
-        /* Read the uuid */
-        fd = open(glo.gl_pathv[1], O_RDONLY | O_NOCTTY | O_CLOEXEC);
-        globfree(&glo);
+bool cbm_sync_filesystem(const char *path)
+{
+        int fd = -1;
+        bool ret = true;
 
+        if (!cbm_should_sync || !path) {
+                return true;
+        }
+
+        fd = cbm_system_open(path, O_RDONLY | O_CLOEXEC, 0);
         if (fd < 0) {
-                LOG_ERROR("Unable to read LoaderDevicePartUUID");
-                return NULL;
+                return false;
+        }
+        cbm_stats_inc(CBM_STAT_SYNCS);
+        /* Other backends have no filesystem beyond the files themselves */
+        if ((cbm_system_has_native_files() ? syncfs(fd) : cbm_system_fsync(fd)) != 0) {
+                LOG_DEBUG("Failed to sync filesystem of %s: %s", path, strerror(errno));
+                ret = false;
         }
+        cbm_system_close(fd);
+        return ret;
+}
 
-        size = read(fd, read_buf, sizeof(read_buf));
-        close(fd);
-        if (size < 1) {
-                goto next;
+void cbm_sync_phase_begin(void)
+{
+        pthread_mutex_lock(&cbm_sync_state.lock);
+        if (cbm_sync_state.depth == 0) {
+                cbm_sync_state.files =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+                cbm_sync_state.dirs =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+                if (!cbm_sync_state.files || !cbm_sync_state.dirs) {
+                        DECLARE_OOM();
+                        abort();
+                }
         }
+        ++cbm_sync_state.depth;
+        pthread_mutex_unlock(&cbm_sync_state.lock);
+}
 
-        uuid = calloc((size_t)(size + 1), sizeof(char));
-        int j = 0;
-        for (ssize_t i = 0; i < size; i++) {
-                char c = read_buf[i];
-                if (!isalnum(c) && c != '-' && c != '_') {
+/**
+ * Wait for the fsyncs queued on @ring, for the files opened as @fds
+ */
+static bool cbm_sync_ring_flush(CbmRing *ring, int *fds, const char **paths, unsigned int n)
+{
+        int results[CBM_RING_ENTRIES];
+        bool ret = true;
+
+        if (n == 0) {
+                return true;
+        }
+        cbm_stats_add(CBM_STAT_SYNCS, n);
+        if (!cbm_ring_run(ring, results)) {
+                /* fsync is idempotent, so just repeat the lot the slow way */
+                for (unsigned int i = 0; i < n; i++) {
+                        results[i] = cbm_system_fsync(fds[i]) == 0 ? 0 : -errno;
+                }
+        }
+        for (unsigned int i = 0; i < n; i++) {
+                /* Directories on some filesystems refuse fsync, that's fine */
+                if (results[i] < 0 && results[i] != -EINVAL) {
+                        LOG_DEBUG("Failed to flush %s: %s", paths[i], strerror(-results[i]));
+                        ret = false;
+                }
+                cbm_system_close(fds[i]);
+        }
+        return ret;
+}
+
+/**
+ * fsync() every path in @set, as batches on @ring when there is one. Only
+ * once every one of them is flushed does this return, which is what orders
+ * the directories after the files.
+ */
+static bool cbm_sync_set(CbmRing *ring, NcHashmap *set)
+{
+        NcHashmapIter iter = { 0 };
+        const char *paths[CBM_RING_ENTRIES];
+        int fds[CBM_RING_ENTRIES];
+        const char *path = NULL;
+        void *value = NULL;
+        unsigned int n = 0;
+        bool ret = true;
+
+        nc_hashmap_iter_init(set, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&path, &value)) {
+                int fd = -1;
+
+                if (!ring) {
+                        if (!cbm_sync_one(path)) {
+                                ret = false;
+                        }
                         continue;
                 }
-                if (c == '_' || c == '-') {
-                        uuid[j] = '-';
+                fd = cbm_system_open(path, O_RDONLY | O_CLOEXEC, 0);
+                if (fd < 0) {
+                        if (errno != ENOENT) {
+                                ret = false;
+                        }
+                        continue;
+                }
+                if (!cbm_ring_queue_fsync(ring, fd, CBM_RING_NONE)) {
+                        cbm_system_close(fd);
+                        if (!cbm_sync_one(path)) {
+                                ret = false;
+                        }
+                        continue;
+                }
+                paths[n] = path;
+                fds[n++] = fd;
+                if (n == CBM_RING_ENTRIES) {
+                        if (!cbm_sync_ring_flush(ring, fds, paths, n)) {
+                                ret = false;
+                        }
+                        n = 0;
+                }
+        }
+        if (!cbm_sync_ring_flush(ring, fds, paths, n)) {
+                ret = false;
+        }
+        return ret;
+}
+
+bool cbm_sync_phase_end(void)
+{
+        NcHashmap *files = NULL;
+        NcHashmap *dirs = NULL;
+        autofree(CbmRing) *ring = NULL;
+        bool ret = true;
+
+        pthread_mutex_lock(&cbm_sync_state.lock);
+        if (cbm_sync_state.depth == 0 || --cbm_sync_state.depth > 0) {
+                pthread_mutex_unlock(&cbm_sync_state.lock);
+                return true;
+        }
+        files = cbm_sync_state.files;
+        dirs = cbm_sync_state.dirs;
+        cbm_sync_state.files = NULL;
+        cbm_sync_state.dirs = NULL;
+        pthread_mutex_unlock(&cbm_sync_state.lock);
+
+        /* Batching only pays off beyond a lone file and its directory */
+        if (nc_hashmap_size(files) > 1) {
+                ring = cbm_ring_new(CBM_RING_ENTRIES);
+        }
+
+        /* Same ordering as an immediate barrier: every file, then every
+         * directory, so that no entry becomes durable before its contents. */
+        if (!cbm_sync_set(ring, files)) {
+                ret = false;
+        }
+        if (!cbm_sync_set(ring, dirs)) {
+                ret = false;
+        }
+
+        nc_hashmap_free(files);
+        nc_hashmap_free(dirs);
+        return ret;
+}
+
+bool cbm_parse_size(const char *value, uint64_t *size)
+{
+        char *end = NULL;
+        unsigned long long n = 0;
+        uint64_t scale = 1;
+
+        errno = 0;
+        n = strtoull(value, &end, 10);
+        if (errno != 0 || end == value) {
+                return false;
+        }
+        switch (*end) {
+        case 'G':
+        case 'g':
+                scale *= 1024;
+                /* fallthrough */
+        case 'M':
+        case 'm':
+                scale *= 1024;
+                /* fallthrough */
+        case 'K':
+        case 'k':
+                scale *= 1024;
+                ++end;
+                break;
+        default:
+                break;
+        }
+        if (*end != '\0' || n > UINT64_MAX / scale) {
+                return false;
+        }
+        *size = (uint64_t)n * scale;
+        return true;
+}
+
+bool cbm_io_policy_parse(const char *spec, CbmIoPolicy *policy)
+{
+        autofree(char) *copy = NULL;
+        char *line = NULL;
+        char *line_state = NULL;
+        bool ret = true;
+
+        *policy = (CbmIoPolicy){ 0 };
+
+        copy = strdup(spec);
+        OOM_CHECK_RET(copy, false);
+
+        for (line = strtok_r(copy, "\n", &line_state); line;
+             line = strtok_r(NULL, "\n", &line_state)) {
+                char *comment = strchr(line, '#');
+                char *opt_state = NULL;
+
+                if (comment) {
+                        *comment = '\0';
+                }
+                for (char *opt = strtok_r(line, " \t\r,", &opt_state); opt;
+                     opt = strtok_r(NULL, " \t\r,", &opt_state)) {
+                        if (streq(opt, "drop-cache")) {
+                                policy->drop_cache = true;
+                        } else if (streq(opt, "direct")) {
+                                policy->direct = true;
+                        } else if (streq(opt, "idle")) {
+                                policy->idle = true;
+                        } else if (strncmp(opt, "rate=", 5) == 0 &&
+                                   cbm_parse_size(opt + 5, &policy->rate)) {
+                                continue;
+                        } else {
+                                LOG_ERROR("Unknown I/O policy option: %s", opt);
+                                ret = false;
+                        }
+                }
+        }
+        return ret;
+}
+
+static int cbm_ioprio_get(void)
+{
+        return (int)syscall(SYS_ioprio_get, CBM_IOPRIO_WHO_PROCESS, 0);
+}
+
+static int cbm_ioprio_set(int prio)
+{
+        return (int)syscall(SYS_ioprio_set, CBM_IOPRIO_WHO_PROCESS, 0, prio);
+}
+
+void cbm_set_io_policy(const CbmIoPolicy *policy)
+{
+        CbmIoPolicy none = { 0 };
+
+        if (!policy) {
+                policy = &none;
+        }
+
+        pthread_mutex_lock(&cbm_io.lock);
+        if (policy->idle && cbm_io.saved_ioprio < 0) {
+                int prio = cbm_ioprio_get();
+
+                if (prio >= 0 &&
+                    cbm_ioprio_set(CBM_IOPRIO_CLASS_IDLE << CBM_IOPRIO_CLASS_SHIFT) == 0) {
+                        cbm_io.saved_ioprio = prio;
                 } else {
-                        uuid[j] = (char)tolower(read_buf[i]);
+                        LOG_WARNING("Cannot use the idle I/O class: %s", strerror(errno));
                 }
-                ++j;
+        } else if (!policy->idle && cbm_io.saved_ioprio >= 0) {
+                (void)cbm_ioprio_set(cbm_io.saved_ioprio);
+                cbm_io.saved_ioprio = -1;
         }
-        read_buf[j] = '\0';
+        cbm_io.policy = *policy;
+        clock_gettime(CLOCK_MONOTONIC, &cbm_io.next);
+        pthread_mutex_unlock(&cbm_io.lock);
+}
+
+static CbmIoPolicy cbm_io_get_policy(void)
+{
+        CbmIoPolicy ret;
 
-        p = string_printf("%s/disk/by-partuuid/%s", cbm_system_get_devfs_path(), uuid);
+        pthread_mutex_lock(&cbm_io.lock);
+        ret = cbm_io.policy;
+        pthread_mutex_unlock(&cbm_io.lock);
+        return ret;
+}
+
+void cbm_io_throttle(uint64_t bytes)
+{
+        struct timespec now = { 0 };
+        struct timespec wake = { 0 };
+        uint64_t delay = 0;
 
-        if (nc_file_exists(p)) {
-                return strdup(p);
+        pthread_mutex_lock(&cbm_io.lock);
+        if (cbm_io.policy.rate == 0) {
+                pthread_mutex_unlock(&cbm_io.lock);
+                return;
         }
-next:
 
-        dev_path = string_printf("%s/disk/by-partlabel/ESP", cbm_system_get_devfs_path());
+        /* One slot after another, whichever thread asks. Time spent idle
+         * isn't banked, or the cap would allow bursts after a pause. */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > cbm_io.next.tv_sec ||
+            (now.tv_sec == cbm_io.next.tv_sec && now.tv_nsec > cbm_io.next.tv_nsec)) {
+                cbm_io.next = now;
+        }
+        wake = cbm_io.next;
+        delay = (bytes * 1000000000ULL) / cbm_io.policy.rate;
+        cbm_io.next.tv_sec += (time_t)(delay / 1000000000ULL);
+        cbm_io.next.tv_nsec += (long)(delay % 1000000000ULL);
+        if (cbm_io.next.tv_nsec >= 1000000000L) {
+                cbm_io.next.tv_sec += 1;
+                cbm_io.next.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_unlock(&cbm_io.lock);
 
-        if (nc_file_exists(dev_path)) {
-                return strdup(dev_path);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+                /* Keep waiting */
         }
-        return NULL;
 }
 
 /**
- * Use libblkid to determine the parent disk for the given path,
- * in order to facilitate partition enumeration
+ * posix_fadvise(), for native files only as the advice is all about the
+ * page cache
  */
-static bool get_parent_disk_devno(char *path, dev_t *diskdevno)
+static void cbm_fadvise(int fd, off_t offset, off_t len, int advice)
 {
-        struct stat st = { 0 };
-        dev_t ret;
+        if (cbm_system_has_native_files()) {
+                (void)posix_fadvise(fd, offset, len, advice);
+        }
+}
 
-        if (stat(path, &st) != 0) {
-                return false;
+void cbm_io_done(int fd)
+{
+        if (fd >= 0 && cbm_io_get_policy().drop_cache) {
+                cbm_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+}
+
+/**
+ * Read exactly @len bytes at @offset, short only at EOF
+ */
+static ssize_t cbm_pread_full(int fd, char *buf, size_t len, off_t offset)
+{
+        size_t done = 0;
+
+        while (done < len) {
+                ssize_t r = cbm_system_pread(fd, buf + done, len - done, offset + (off_t)done);
+
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -1;
+                }
+                if (r == 0) {
+                        break;
+                }
+                done += (size_t)r;
         }
+        return (ssize_t)done;
+}
 
-        if (cbm_blkid_devno_to_wholedisk(st.st_dev, NULL, 0, &ret) < 0) {
-                LOG_ERROR("Invalid block device: %s", path);
+/**
+ * Read the block of @len bytes at @offset of both files, together on @ring if
+ * there is one. A short read through the ring is completed by blocking reads.
+ */
+static bool cbm_files_read_pair(CbmRing *ring, int fd1, int fd2, char *buf1, char *buf2,
+                                size_t len, off_t offset)
+{
+        int results[2] = { -1, -1 };
+
+        if (ring && cbm_ring_queue_pread(ring, fd1, buf1, len, offset, CBM_RING_NONE) &&
+            cbm_ring_queue_pread(ring, fd2, buf2, len, offset, CBM_RING_NONE) &&
+            cbm_ring_run(ring, results) && results[0] == (int)len && results[1] == (int)len) {
+                return true;
+        }
+        return cbm_pread_full(fd1, buf1, len, offset) == (ssize_t)len &&
+               cbm_pread_full(fd2, buf2, len, offset) == (ssize_t)len;
+}
+
+bool cbm_files_match(const char *p1, const char *p2)
+{
+        struct stat st1 = { 0 };
+        struct stat st2 = { 0 };
+        char *buf1 = NULL;
+        char *buf2 = NULL;
+        bool drop_cache = cbm_io_get_policy().drop_cache;
+        autofree(CbmRing) *ring = NULL;
+        bool ret = false;
+        int fd1 = -1;
+        int fd2 = -1;
+        CBM_TRACE_SCOPE("files_match");
+
+        fd1 = cbm_system_open(p1, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+        if (fd1 < 0) {
                 return false;
         }
-        *diskdevno = ret;
-        return true;
+        fd2 = cbm_system_open(p2, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+        if (fd2 < 0 || cbm_system_fstat(fd1, &st1) != 0 || cbm_system_fstat(fd2, &st2) != 0) {
+                goto end;
+        }
+
+        /* If the lengths are different they're clearly not the same file */
+        if (st1.st_size != st2.st_size) {
+                goto end;
+        }
+        /* Nor is there anything to read if they are the very same file */
+        if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+                ret = true;
+                goto end;
+        }
+
+        cbm_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+        cbm_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        buf1 = malloc(CBM_COMPARE_CHUNK);
+        buf2 = malloc(CBM_COMPARE_CHUNK);
+        if (!buf1 || !buf2) {
+                DECLARE_OOM();
+                abort();
+        }
+        /* Both blocks at once, rather than one read after the other */
+        if (st1.st_size > CBM_COMPARE_CHUNK) {
+                ring = cbm_ring_new(2);
+        }
+
+        /* Rebuilt files tend to differ early on, so stop at the first block
+         * that differs rather than reading everything */
+        for (off_t offset = 0; offset < st1.st_size; offset += CBM_COMPARE_CHUNK) {
+                size_t len = (size_t)(st1.st_size - offset);
+
+                if (len > CBM_COMPARE_CHUNK) {
+                        len = CBM_COMPARE_CHUNK;
+                }
+                cbm_io_throttle((uint64_t)len * 2);
+                if (!cbm_files_read_pair(ring, fd1, fd2, buf1, buf2, len, offset)) {
+                        goto end;
+                }
+                cbm_stats_add(CBM_STAT_BYTES_COMPARED, (uint64_t)len * 2);
+                if (memcmp(buf1, buf2, len) != 0) {
+                        goto end;
+                }
+                if (drop_cache) {
+                        cbm_fadvise(fd1, offset, (off_t)len, POSIX_FADV_DONTNEED);
+                        cbm_fadvise(fd2, offset, (off_t)len, POSIX_FADV_DONTNEED);
+                }
+        }
+        ret = true;
+
+end:
+        free(buf1);
+        free(buf2);
+        if (fd2 >= 0) {
+                cbm_system_close(fd2);
+        }
+        cbm_system_close(fd1);
+        return ret;
+}
+
+char *get_boot_device()
+{
+        return cbm_topology_esp();
 }
 
 char *get_parent_disk(char *path)
 {
-        dev_t devt;
-        autofree(char) *node = NULL;
-        const char *devfs = cbm_system_get_devfs_path();
+        struct stat st = { 0 };
 
-        if (!get_parent_disk_devno(path, &devt)) {
+        if (stat(path, &st) != 0) {
                 return NULL;
         }
-
-        node = string_printf("%s/block/%u:%u", devfs, major(devt), minor(devt));
-        return realpath(node, NULL);
+        return cbm_topology_parent_disk(st.st_dev);
 }
 
 char *get_legacy_boot_device(char *path)
@@ -190,7 +682,6 @@ char *get_legacy_boot_device(char *path)
         int part_count = 0;
         char *ret = NULL;
         autofree(char) *parent_disk = NULL;
-        const char *devfs = cbm_system_get_devfs_path();
 
         parent_disk = get_parent_disk(path);
         if (!parent_disk) {
@@ -234,8 +725,10 @@ char *get_legacy_boot_device(char *path)
                                 LOG_ERROR("Not a valid GPT disk");
                                 goto clean;
                         }
-                        pt_path = string_printf("%s/disk/by-partuuid/%s", devfs, part_id);
-                        ret = realpath(pt_path, NULL);
+                        pt_path = cbm_topology_part_uuid_node(part_id);
+                        if (pt_path) {
+                                ret = realpath(pt_path, NULL);
+                        }
                         break;
                 }
         }
@@ -246,6 +739,37 @@ clean:
         return ret;
 }
 
+void cbm_file_key_from_stat(CbmFileKey *key, const struct stat *st)
+{
+        key->dev = (unsigned long long)st->st_dev;
+        key->ino = (unsigned long long)st->st_ino;
+        key->size = (long long)st->st_size;
+        key->mtime_sec = (long long)st->st_mtim.tv_sec;
+        key->mtime_nsec = (long long)st->st_mtim.tv_nsec;
+}
+
+bool cbm_file_key_for_path(CbmFileKey *key, const char *path)
+{
+        struct stat st = { 0 };
+
+        if (cbm_system_stat(path, &st) != 0) {
+                return false;
+        }
+        cbm_file_key_from_stat(key, &st);
+        return true;
+}
+
+bool cbm_file_key_parse(CbmFileKey *key, const char *s)
+{
+        return sscanf(s,
+                      CBM_FILE_KEY_FORMAT,
+                      &key->dev,
+                      &key->ino,
+                      &key->size,
+                      &key->mtime_sec,
+                      &key->mtime_nsec) == 5;
+}
+
 char *cbm_get_file_parent(const char *p)
 {
         char *r = realpath(p, NULL);
@@ -255,38 +779,200 @@ char *cbm_get_file_parent(const char *p)
         return dirname(r);
 }
 
-bool file_set_text(const char *path, char *text)
+NcHashmap *cbm_get_dir_entries(const char *path)
 {
-        FILE *fp = NULL;
-        bool ret = false;
+        NcHashmap *ret = NULL;
+        void *dir = NULL;
+        const char *entry = NULL;
+
+        ret = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, NULL);
+        OOM_CHECK_RET(ret, NULL);
+
+        dir = cbm_system_opendir(path);
+        if (!dir) {
+                if (errno == ENOENT) {
+                        return ret;
+                }
+                nc_hashmap_free(ret);
+                return NULL;
+        }
+
+        while ((entry = cbm_system_readdir(dir)) != NULL) {
+                char *name = NULL;
+
+                if (streq(entry, ".") || streq(entry, "..")) {
+                        continue;
+                }
+                name = strdup(entry);
+                /* Entry names are their own values, keeping lookups unambiguous */
+                if (!name || !nc_hashmap_put(ret, name, name)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        cbm_system_closedir(dir);
+
+        return ret;
+}
+
+bool cbm_file_exists(const char *path)
+{
+        struct stat st = { 0 };
+
+        cbm_stats_inc(CBM_STAT_EXISTS_PROBES);
+        return path && cbm_system_lstat(path, &st) == 0;
+}
+
+int cbm_unlink(const char *path)
+{
+        if (cbm_system_unlink(path) < 0) {
+                return -1;
+        }
+        cbm_stats_inc(CBM_STAT_FILES_UNLINKED);
+        return 0;
+}
+
+bool cbm_mkdir_p(const char *path, mode_t mode)
+{
+        autofree(char) *copy = NULL;
+        struct stat st = { 0 };
+
+        if (cbm_system_stat(path, &st) == 0) {
+                if (!S_ISDIR(st.st_mode)) {
+                        errno = ENOTDIR;
+                        return false;
+                }
+                return true;
+        }
 
-        if (nc_file_exists(path) && unlink(path) < 0) {
+        copy = strdup(path);
+        OOM_CHECK_RET(copy, false);
+
+        /* Every parent in turn, those that already exist just say so */
+        for (char *c = copy + 1; *c; c++) {
+                if (*c != '/') {
+                        continue;
+                }
+                *c = '\0';
+                if (cbm_system_mkdir(copy, mode) != 0 && errno != EEXIST) {
+                        return false;
+                }
+                *c = '/';
+        }
+        if (cbm_system_mkdir(copy, mode) != 0 && errno != EEXIST) {
                 return false;
         }
-        cbm_sync();
+        errno = 0;
+        return true;
+}
 
-        fp = fopen(path, "w");
+bool cbm_rm_rf(const char *path)
+{
+        struct stat st = { 0 };
+        void *dir = NULL;
+        const char *entry = NULL;
+        bool ret = true;
 
-        if (!fp) {
+        if (cbm_system_lstat(path, &st) != 0) {
+                return errno == ENOENT;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+                return cbm_unlink(path) == 0;
+        }
+
+        dir = cbm_system_opendir(path);
+        if (!dir) {
+                return false;
+        }
+        while ((entry = cbm_system_readdir(dir)) != NULL) {
+                autofree(char) *child = NULL;
+
+                if (streq(entry, ".") || streq(entry, "..")) {
+                        continue;
+                }
+                child = string_printf("%s/%s", path, entry);
+                if (!cbm_rm_rf(child)) {
+                        ret = false;
+                }
+        }
+        cbm_system_closedir(dir);
+
+        if (cbm_system_rmdir(path) != 0) {
+                ret = false;
+        }
+        return ret;
+}
+
+static bool cbm_write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t written = cbm_system_write(fd, buf, len);
+
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                buf += written;
+                len -= (size_t)written;
+        }
+        return true;
+}
+
+bool file_set_text(const char *path, char *text)
+{
+        return file_set_text_staged(NULL, path, text);
+}
+
+bool file_set_text_staged(CbmStage *stage, const char *path, char *text)
+{
+        autofree(char) *staged = NULL;
+        bool ret = false;
+        int fd = -1;
+
+        /* Staged files are flushed and moved into place all at once */
+        staged = cbm_stage_path(stage, path);
+        if (staged) {
+                path = staged;
+        } else {
+                if (cbm_file_exists(path) && cbm_unlink(path) < 0) {
+                        return false;
+                }
+                /* vfat protect, the removal must land before the new entry */
+                cbm_sync_parent(path);
+        }
+
+        fd = cbm_system_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOCTTY, 00666);
+        if (fd < 0) {
                 goto end;
         }
 
-        if (fprintf(fp, "%s", text) < 0) {
+        cbm_stats_inc(CBM_STAT_FILES_CREATED);
+        if (!cbm_write_all(fd, text, strlen(text))) {
                 goto end;
         }
         ret = true;
 end:
-        if (fp) {
-                fclose(fp);
+        if (fd >= 0 && cbm_system_close(fd) != 0) {
+                ret = false;
+        }
+        if (ret && !staged) {
+                cbm_sync_path(path);
         }
-        cbm_sync();
 
         return ret;
 }
 
 bool file_get_text(const char *path, char **out_buf)
+{
+        return file_get_text_staged(NULL, path, out_buf);
+}
+
+bool file_get_text_staged(CbmStage *stage, const char *path, char **out_buf)
 {
         autofree(CbmMappedFile) *mapped_file = CBM_MAPPED_FILE_INIT;
+        autofree(char) *staged = NULL;
 
         if (!out_buf) {
                 return false;
@@ -294,7 +980,9 @@ bool file_get_text(const char *path, char **out_buf)
 
         *out_buf = NULL;
 
-        if (!cbm_mapped_file_open(path, mapped_file)) {
+        /* Anything staged reads back as what it's about to become */
+        staged = cbm_stage_resolve(stage, path);
+        if (!cbm_mapped_file_open(staged ? staged : path, mapped_file)) {
                 return false;
         }
 
@@ -305,78 +993,264 @@ bool file_get_text(const char *path, char **out_buf)
         return true;
 }
 
-bool copy_file(const char *src, const char *target, mode_t mode)
+/**
+ * Share the extents of @sfd with @dfd, only possible when both live on the
+ * same reflink capable filesystem (btrfs, xfs)
+ */
+static bool cbm_copy_reflink(int sfd, int dfd)
+{
+#ifdef FICLONE
+        return cbm_system_has_native_files() && ioctl(dfd, FICLONE, sfd) == 0;
+#else
+        (void)sfd;
+        (void)dfd;
+        return false;
+#endif
+}
+
+/**
+ * Copy up to @remaining bytes in kernel space, copy_file_range() first and
+ * then sendfile() when the former isn't supported for this pair of files.
+ * Both operate on the current file offsets, so we can switch at any point.
+ */
+static bool cbm_copy_kernel(int sfd, int dfd, off_t remaining)
+{
+        bool use_range = true;
+
+        while (remaining > 0) {
+                ssize_t written = -1;
+
+                if (use_range) {
+                        written = copy_file_range(sfd, NULL, dfd, NULL, (size_t)remaining, 0);
+                        if (written < 0 && (errno == ENOSYS || errno == EXDEV ||
+                                            errno == EINVAL || errno == EOPNOTSUPP)) {
+                                use_range = false;
+                                continue;
+                        }
+                } else {
+                        written = sendfile(dfd, sfd, NULL, (size_t)remaining);
+                }
+
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                if (written == 0) {
+                        /* Source shrank beneath us */
+                        if (!use_range) {
+                                errno = EIO;
+                                return false;
+                        }
+                        use_range = false;
+                        continue;
+                }
+                remaining -= written;
+        }
+        return true;
+}
+
+/**
+ * Copy @remaining bytes through a user space buffer, so that each chunk can
+ * be throttled, the source may be read with O_DIRECT, and the bytes can be
+ * fed to @ctx on their way through when it's set
+ */
+static bool cbm_copy_chunked(int sfd, int dfd, off_t remaining, CbmSha256 *ctx)
+{
+        char *buf = NULL;
+        bool ret = false;
+
+        if (posix_memalign((void **)&buf, CBM_IO_ALIGN, CBM_IO_CHUNK) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        while (remaining > 0) {
+                ssize_t r = 0;
+
+                cbm_io_throttle(remaining < CBM_IO_CHUNK ? (uint64_t)remaining : CBM_IO_CHUNK);
+
+                /* O_DIRECT reads whole aligned chunks, and stop short at EOF */
+                r = cbm_system_read(sfd, buf, CBM_IO_CHUNK);
+                if (r < 0) {
+                        int flags = fcntl(sfd, F_GETFL);
+
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        /* Not every filesystem really supports O_DIRECT */
+                        if (errno == EINVAL && flags >= 0 && (flags & O_DIRECT) &&
+                            fcntl(sfd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                                continue;
+                        }
+                        goto end;
+                }
+                if (r == 0) {
+                        /* Source shrank beneath us */
+                        errno = EIO;
+                        goto end;
+                }
+                if ((off_t)r > remaining) {
+                        r = (ssize_t)remaining;
+                }
+                if (ctx) {
+                        cbm_sha256_update(ctx, buf, (size_t)r);
+                }
+                if (!cbm_write_all(dfd, buf, (size_t)r)) {
+                        goto end;
+                }
+                remaining -= r;
+        }
+        ret = true;
+
+end:
+        free(buf);
+        return ret;
+}
+
+void cbm_file_prefetch(const char *path)
 {
+        int fd = -1;
+
+        if (!cbm_system_has_native_files()) {
+                return;
+        }
+        fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+                return;
+        }
+        /* Unlike readahead(), this doesn't wait for the reads to complete */
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+}
+
+/**
+ * Implementation of copy_file, hashing the contents into @ctx when set
+ */
+static bool cbm_copy_file(const char *src, const char *target, mode_t mode, CbmSha256 *ctx)
+{
+        CbmIoPolicy policy = cbm_io_get_policy();
+        bool native = cbm_system_has_native_files();
         struct stat sst = { 0 };
-        ssize_t sz;
         int sfd = -1;
         int dfd = -1;
         bool ret = false;
-        ssize_t written;
+        CBM_TRACE_SCOPE("copy_file");
+
+        /* Anything but native files only ever goes through the vtable */
+        policy.direct = policy.direct && native;
 
-        sfd = open(src, O_RDONLY);
+        sfd = cbm_system_open(src, O_RDONLY | (policy.direct ? O_DIRECT : 0), 0);
+        if (sfd < 0 && policy.direct && errno == EINVAL) {
+                sfd = cbm_system_open(src, O_RDONLY, 0);
+        }
         if (sfd < 0) {
                 return false;
         }
-        dfd = open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
+        dfd = cbm_system_open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
         if (dfd < 0) {
                 goto end;
         }
-        if (fstat(sfd, &sst) != 0) {
+        cbm_stats_inc(CBM_STAT_FILES_CREATED);
+        if (cbm_system_fstat(sfd, &sst) != 0) {
                 goto end;
         }
 
-        sz = sst.st_size;
-        for (;;) {
-                written = sendfile(dfd, sfd, NULL, (size_t)sz);
-                if (written == sz) {
-                        break;
-                } else if (written < 0) {
+        if (sst.st_size > 0 && (ctx || !cbm_copy_reflink(sfd, dfd))) {
+                /* Reserve the final size up front so that vfat can allocate
+                 * contiguous clusters, and we fail early if it won't fit */
+                if (native && fallocate(dfd, 0, 0, sst.st_size) != 0) {
+                        if (errno == ENOSPC || errno == EFBIG) {
+                                goto end;
+                        }
+                        errno = 0;
+                }
+                if (ctx || policy.direct || policy.rate || !native) {
+                        if (!cbm_copy_chunked(sfd, dfd, sst.st_size, ctx)) {
+                                goto end;
+                        }
+                } else if (!cbm_copy_kernel(sfd, dfd, sst.st_size)) {
                         goto end;
                 }
-                sz -= written;
+                cbm_stats_add(CBM_STAT_BYTES_COPIED, (uint64_t)sst.st_size);
         }
-        ret = true;
+
+        /* Contents must be on disk before anyone renames us into place */
+        ret = cbm_sync_fd(dfd);
+
+        /* Flushed pages of the new file can be dropped just the same */
+        cbm_io_done(sfd);
+        cbm_io_done(dfd);
 
 end:
-        if (sfd > 0) {
-                close(sfd);
+        if (sfd >= 0) {
+                cbm_system_close(sfd);
         }
-        if (dfd > 0) {
-                close(dfd);
+        if (dfd >= 0) {
+                cbm_system_close(dfd);
         }
         return ret;
 }
 
-bool copy_file_atomic(const char *src, const char *target, mode_t mode)
+bool copy_file(const char *src, const char *target, mode_t mode)
+{
+        return cbm_copy_file(src, target, mode, NULL);
+}
+
+/**
+ * Copy @src beside @target and rename it into place, see copy_file_atomic
+ */
+static bool cbm_copy_file_atomic(const char *src, const char *target, mode_t mode,
+                                 CbmSha256 *ctx)
 {
         autofree(char) *new_name = NULL;
         struct stat st = { 0 };
 
         new_name = string_printf("%s.TmpWrite", target);
 
-        if (!copy_file(src, new_name, mode)) {
-                (void)unlink(new_name);
+        /* copy_file has already flushed the new contents */
+        if (!cbm_copy_file(src, new_name, mode, ctx)) {
+                (void)cbm_unlink(new_name);
                 return false;
         }
-        cbm_sync();
 
         /* Delete target if needed  */
-        if (stat(target, &st) == 0) {
-                if (!S_ISDIR(st.st_mode) && unlink(target) != 0) {
+        if (cbm_system_stat(target, &st) == 0) {
+                if (!S_ISDIR(st.st_mode) && cbm_unlink(target) != 0) {
                         return false;
                 }
-                cbm_sync();
+                /* vfat protect, rename isn't atomic so order the removal first */
+                cbm_sync_parent(target);
         } else {
                 errno = 0;
         }
 
-        if (rename(new_name, target) != 0) {
+        if (cbm_system_rename(new_name, target) != 0) {
                 return false;
         }
-        /* vfat protect */
-        cbm_sync();
+        cbm_sync_path(target);
+
+        return true;
+}
+
+bool copy_file_atomic(const char *src, const char *target, mode_t mode)
+{
+        return cbm_copy_file_atomic(src, target, mode, NULL);
+}
+
+bool copy_file_atomic_measured(const char *src, const char *target, mode_t mode,
+                               char digest[CBM_SHA256_HEX_SIZE])
+{
+        uint8_t raw[CBM_SHA256_SIZE];
+        CbmSha256 ctx;
 
+        cbm_sha256_init(&ctx);
+        if (!cbm_copy_file_atomic(src, target, mode, &ctx)) {
+                return false;
+        }
+        cbm_sha256_final(&ctx, raw);
+        cbm_sha256_to_hex(raw, digest);
         return true;
 }
 
@@ -439,7 +1313,7 @@ bool cbm_system_has_uefi()
         autofree(char) *p = NULL;
 
         p = string_printf("%s/firmware/efi", cbm_system_get_sysfs_path());
-        return nc_file_exists(p);
+        return cbm_file_exists(p);
 }
 
 void cbm_set_sync_filesystems(bool should_sync)
@@ -457,20 +1331,35 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
         ssize_t length = -1;
         char *buffer = NULL;
 
-        fd = open(path, O_RDONLY);
+        fd = cbm_system_open(path, O_RDONLY, 0);
         if (fd < 0) {
                 return false;
         }
-        if (fstat(fd, &st) != 0) {
-                close(fd);
+        if (cbm_system_fstat(fd, &st) != 0) {
+                cbm_system_close(fd);
                 return false;
         }
         length = st.st_size;
 
-        buffer = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (!buffer) {
-                close(fd);
-                return false;
+        /* Only native files can be mapped, the rest is read in */
+        if (!cbm_system_has_native_files()) {
+                buffer = calloc(1, (size_t)length + 1);
+                if (!buffer) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                if (cbm_pread_full(fd, buffer, (size_t)length, 0) != length) {
+                        free(buffer);
+                        cbm_system_close(fd);
+                        return false;
+                }
+                file->allocated = true;
+        } else {
+                buffer = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (buffer == MAP_FAILED) {
+                        cbm_system_close(fd);
+                        return false;
+                }
         }
         file->length = (size_t)length;
         file->buffer = buffer;
@@ -483,9 +1372,20 @@ void cbm_mapped_file_close(CbmMappedFile *file)
         if (!file) {
                 return;
         }
-        munmap(file->buffer, file->length);
-        close(file->fd);
+        /* Never opened, or failed to open */
+        if (file->fd < 0) {
+                return;
+        }
+        if (file->allocated) {
+                free(file->buffer);
+        } else {
+                munmap(file->buffer, file->length);
+        }
+        /* Only now are the pages no longer mapped, and can be dropped */
+        cbm_io_done(file->fd);
+        cbm_system_close(file->fd);
         memset(file, 0, sizeof(CbmMappedFile));
+        file->fd = -1;
 }
 
 /*
@@ -15,8 +15,12 @@
 #include <mntent.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
+#include "nica/hashmap.h"
+#include "sha256.h"
+#include "stage.h"
 #include "util.h"
 
 typedef FILE FILE_MNT;
@@ -33,11 +37,58 @@ DEF_AUTOFREE(FILE_MNT, endmntent)
  * here, this is a pointer to a newly referenced stack object.
  */
 typedef struct CbmMappedFile {
-        int fd;        /**< File descriptor for the mapped file */
-        char *buffer;  /**< Pointer to the mmap()'d contents */
-        size_t length; /**< Length of the mmap()'d file (see fstat) */
+        int fd;         /**< File descriptor for the mapped file */
+        char *buffer;   /**< Pointer to the mmap()'d contents */
+        size_t length;  /**< Length of the mmap()'d file (see fstat) */
+        bool allocated; /**< Contents were read into memory, not mapped */
 } CbmMappedFile;
 
+/**
+ * Identity of a file on disk, used to determine if it changed since we
+ * last looked at it without having to read it.
+ */
+typedef struct CbmFileKey {
+        unsigned long long dev;
+        unsigned long long ino;
+        long long size;
+        long long mtime_sec;
+        long long mtime_nsec;
+} CbmFileKey;
+
+/**
+ * Printable form of a CbmFileKey, consumed by cbm_file_key_parse
+ */
+#define CBM_FILE_KEY_FORMAT "%llu:%llu:%lld:%lld.%lld"
+#define CBM_FILE_KEY_ARGS(k) (k)->dev, (k)->ino, (k)->size, (k)->mtime_sec, (k)->mtime_nsec
+
+/**
+ * Populate @key from an existing stat result
+ */
+void cbm_file_key_from_stat(CbmFileKey *key, const struct stat *st);
+
+/**
+ * Populate @key for the file at @path
+ *
+ * @return True if the file could be stat()'d
+ */
+bool cbm_file_key_for_path(CbmFileKey *key, const char *path);
+
+/**
+ * Determine if two keys refer to the same, unchanged, file
+ */
+static inline bool cbm_file_key_equal(const CbmFileKey *a, const CbmFileKey *b)
+{
+        return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+               a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/**
+ * Parse a key previously printed with CBM_FILE_KEY_FORMAT
+ *
+ * @return True if @s held a complete key
+ */
+bool cbm_file_key_parse(CbmFileKey *key, const char *s);
+
 /**
  * Return the UEFI device that is used for booting (/boot)
  *
@@ -59,8 +110,10 @@ char *get_parent_disk(char *path);
 char *get_legacy_boot_device(char *path);
 
 /**
- * Determine if the files match in content by comparing
- * their checksums
+ * Determine if the files match in content. Differing sizes, or both paths
+ * naming the same file, are settled without reading anything. Otherwise
+ * the contents are compared a block at a time, stopping at the first
+ * difference.
  */
 bool cbm_files_match(const char *p1, const char *p2);
 
@@ -73,6 +126,44 @@ bool cbm_files_match(const char *p1, const char *p2);
  */
 char *cbm_get_file_parent(const char *p);
 
+/**
+ * Read the names of all entries within a directory into a set, allowing
+ * many existence checks against the same directory at the cost of a
+ * single scan. A directory that doesn't exist yields an empty set.
+ *
+ * @note The returned set must be freed with nc_hashmap_free
+ * @param path Path to the directory
+ * @return a newly allocated set, or NULL if the directory can't be read
+ */
+NcHashmap *cbm_get_dir_entries(const char *path);
+
+/**
+ * nc_file_exists, counted in the update statistics
+ */
+bool cbm_file_exists(const char *path);
+
+/**
+ * unlink(), counted in the update statistics
+ *
+ * @return 0 on success, otherwise -1 with errno set
+ */
+int cbm_unlink(const char *path);
+
+/**
+ * nc_mkdir_p, creating @path along with any missing parents
+ *
+ * @return True if @path is now a directory
+ */
+bool cbm_mkdir_p(const char *path, mode_t mode);
+
+/**
+ * nc_rm_rf, removing @path and everything beneath it. Symbolic links are
+ * removed rather than followed.
+ *
+ * @return True if nothing remains of @path
+ */
+bool cbm_rm_rf(const char *path);
+
 /**
  * Quick utility function to write small text files
  *
@@ -85,6 +176,12 @@ char *cbm_get_file_parent(const char *p);
  */
 bool file_set_text(const char *path, char *text);
 
+/**
+ * As file_set_text, writing to the staging directory instead when @path is
+ * staged by @stage, which may be NULL
+ */
+bool file_set_text_staged(CbmStage *stage, const char *path, char *text);
+
 /**
  * Quick utility for reading very small files into a string
  *
@@ -95,6 +192,12 @@ bool file_set_text(const char *path, char *text);
  */
 bool file_get_text(const char *path, char **out_buf);
 
+/**
+ * As file_get_text, reading anything staged for @path by @stage, which may
+ * be NULL, as what it's about to become
+ */
+bool file_get_text_staged(CbmStage *stage, const char *path, char **out_buf);
+
 /**
  * Simple utility to copy path @src to path @dst, with mode @mode
  *
@@ -102,7 +205,10 @@ bool file_get_text(const char *path, char **out_buf);
  * not preserve stat information (As we're interested in copying
  * to an ESP only)
  *
- * Note that the implementation uses sendfile() for performance reasons.
+ * The cheapest available method is used: a reflink when both files share a
+ * capable filesystem, then copy_file_range(), falling back to sendfile().
+ * Otherwise the target is preallocated to its final size to avoid
+ * fragmentation. The new contents are flushed before returning.
  *
  * @param src Path to the source file
  * @param dst Path to the destination file
@@ -112,6 +218,13 @@ bool file_get_text(const char *path, char **out_buf);
  */
 bool copy_file(const char *src, const char *dst, mode_t mode);
 
+/**
+ * Ask the kernel to start reading @path into the page cache in the
+ * background, so that a later read of it doesn't wait on the disk.
+ * This is purely advisory and never fails.
+ */
+void cbm_file_prefetch(const char *path);
+
 /**
  * Wrapper around copy_file to ensure an atomic update of files. This requires
  * that a new file first be written with a new unique name, and only when this
@@ -123,6 +236,15 @@ bool copy_file(const char *src, const char *dst, mode_t mode);
  */
 bool copy_file_atomic(const char *src, const char *dst, mode_t mode);
 
+/**
+ * copy_file_atomic, also producing the hex encoded SHA-256 of the bytes
+ * copied in @digest. The source is hashed as it streams through a user space
+ * buffer, rather than being read a second time, so this forgoes a reflink
+ * or copy_file_range() in favour of that single pass.
+ */
+bool copy_file_atomic_measured(const char *src, const char *dst, mode_t mode,
+                               char digest[CBM_SHA256_HEX_SIZE]);
+
 /**
  * Attempt to determine if the given path is actually mounted or not
  *
@@ -146,10 +268,94 @@ bool cbm_system_has_uefi(void);
 void cbm_set_sync_filesystems(bool should_sync);
 
 /**
- * Sync filesystem if should_sync is set
- * If not set, then this is a no-op
+ * Durability barrier for @path: flush its contents and metadata, followed by
+ * the directory containing it. If @path has been removed only the directory
+ * is flushed, persisting the removal.
+ *
+ * Within a sync phase the barrier is deferred until cbm_sync_phase_end().
+ * This is a no-op if syncing has been disabled.
+ *
+ * @return True if everything was flushed (or deferred)
+ */
+bool cbm_sync_path(const char *path);
+
+/**
+ * Immediately flush the directory containing @path, even within a sync
+ * phase. Use this where later operations depend on the directory being
+ * updated first, i.e. removing a file before replacing it on vfat.
+ */
+bool cbm_sync_parent(const char *path);
+
+/**
+ * Immediately flush an open file descriptor
+ */
+bool cbm_sync_fd(int fd);
+
+/**
+ * Flush the entire filesystem containing @path (and nothing else), for
+ * writes we cannot track individually such as those of external tools.
+ */
+bool cbm_sync_filesystem(const char *path);
+
+/**
+ * Begin grouping barriers into a single phase. Phases may be nested, with
+ * only the outermost cbm_sync_phase_end() performing the flush.
+ */
+void cbm_sync_phase_begin(void);
+
+/**
+ * Complete a phase, flushing every file and then every directory recorded
+ * by cbm_sync_path() since the phase began, each exactly once.
+ *
+ * @return True if everything was flushed
+ */
+bool cbm_sync_phase_end(void);
+
+/**
+ * Parse a byte count with an optional K, M or G suffix, in units of 1024
+ *
+ * @return True if all of @value was understood
+ */
+bool cbm_parse_size(const char *value, uint64_t *size);
+
+/**
+ * How file contents are read while installing and comparing boot assets,
+ * so that maintaining the boot directory doesn't disturb a loaded host.
+ */
+typedef struct CbmIoPolicy {
+        bool drop_cache; /**<Drop files from the page cache once done with them */
+        bool direct;     /**<Read sources with O_DIRECT where supported */
+        bool idle;       /**<Perform I/O in the idle I/O priority class */
+        uint64_t rate;   /**<Bandwidth cap in bytes per second, 0 for none */
+} CbmIoPolicy;
+
+/**
+ * Parse an I/O policy from a list of whitespace or comma separated options:
+ * drop-cache, direct, idle and rate=N with an optional K, M or G suffix.
+ * Anything following a # on a line is a comment.
+ *
+ * @return True if every option was understood
+ */
+bool cbm_io_policy_parse(const char *spec, CbmIoPolicy *policy);
+
+/**
+ * Apply @policy to all further copies and comparisons, or restore the
+ * default of reading everything through the page cache at full speed when
+ * @policy is NULL. The idle priority class is inherited by threads created
+ * afterwards.
+ */
+void cbm_set_io_policy(const CbmIoPolicy *policy);
+
+/**
+ * Wait for the bandwidth cap to allow reading @bytes more
+ */
+void cbm_io_throttle(uint64_t bytes);
+
+/**
+ * Let go of the cached contents of @fd if the policy asks for it, once the
+ * file has been read (or written and flushed) in full
  */
-void cbm_sync(void);
+void cbm_io_done(int fd);
 
 /**
  * Close a previously mapped file
@@ -164,7 +370,7 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file);
 /**
  * Ensure a stack pointer vs a heap pointer, to save on copies
  */
-#define CBM_MAPPED_FILE_INIT &(CbmMappedFile){ 0 };
+#define CBM_MAPPED_FILE_INIT &(CbmMappedFile){.fd = -1 };
 
 /**
  * Handy macro
@@ -0,0 +1,400 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "files.h"
+#include "initrd.h"
+#include "log.h"
+#include "system_stub.h"
+#include "util.h"
+
+/**
+ * Suffix of the files written beside the target while recompressing
+ */
+#define CBM_INITRD_TEMP_SUFFIX ".TmpWrite"
+
+/**
+ * Length of a newc cpio header, the magic followed by 13 hex fields
+ */
+#define CBM_CPIO_HEADER_SIZE 110
+
+/**
+ * Name of the entry ending a cpio archive
+ */
+#define CBM_CPIO_TRAILER "TRAILER!!!"
+
+/**
+ * What an initrd is made up of, as far as recompressing it goes
+ */
+typedef enum {
+        CBM_INITRD_FORMAT_OTHER = 0, /**<Anything we don't take apart */
+        CBM_INITRD_FORMAT_GZIP,      /**<A gzip compressed archive */
+        CBM_INITRD_FORMAT_CPIO,      /**<A single uncompressed archive */
+} CbmInitrdFormat;
+
+bool cbm_initrd_parse_policy(const char *spec, CbmInitrdPolicy *policy)
+{
+        autofree(char) *copy = NULL;
+        char *line = NULL;
+        char *line_state = NULL;
+        unsigned int n_words = 0;
+        int max_level = 0;
+
+        *policy = (CbmInitrdPolicy){ 0 };
+
+        copy = strdup(spec);
+        OOM_CHECK_RET(copy, false);
+
+        for (line = strtok_r(copy, "\n", &line_state); line;
+             line = strtok_r(NULL, "\n", &line_state)) {
+                char *comment = strchr(line, '#');
+                char *word_state = NULL;
+
+                if (comment) {
+                        *comment = '\0';
+                }
+                for (char *word = strtok_r(line, " \t\r", &word_state); word;
+                     word = strtok_r(NULL, " \t\r", &word_state)) {
+                        char *end = NULL;
+                        long level = 0;
+
+                        if (n_words == 0) {
+                                if (streq(word, "zstd")) {
+                                        policy->compression = CBM_INITRD_ZSTD;
+                                        max_level = 19;
+                                } else if (streq(word, "xz")) {
+                                        policy->compression = CBM_INITRD_XZ;
+                                        max_level = 9;
+                                } else if (!streq(word, "none")) {
+                                        LOG_ERROR("Unknown initrd compression: %s", word);
+                                        return false;
+                                }
+                        } else if (n_words == 1 && max_level > 0) {
+                                errno = 0;
+                                level = strtol(word, &end, 10);
+                                if (errno != 0 || end == word || *end != '\0' || level < 1 ||
+                                    level > max_level) {
+                                        LOG_ERROR("Invalid initrd compression level: %s", word);
+                                        return false;
+                                }
+                                policy->level = (int)level;
+                        } else {
+                                LOG_ERROR("Unexpected initrd compression option: %s", word);
+                                return false;
+                        }
+                        ++n_words;
+                }
+        }
+        return true;
+}
+
+const char *cbm_initrd_suffix(CbmInitrdCompression compression)
+{
+        switch (compression) {
+        case CBM_INITRD_ZSTD:
+                return "zst";
+        case CBM_INITRD_XZ:
+                return "xz";
+        default:
+                return NULL;
+        }
+}
+
+bool cbm_initrd_kconfig_supports(const char *kconfig_file, CbmInitrdCompression compression)
+{
+        autofree(char) *text = NULL;
+        const char *option = NULL;
+        char *line = NULL;
+        char *state = NULL;
+
+        switch (compression) {
+        case CBM_INITRD_ZSTD:
+                option = "CONFIG_RD_ZSTD=y";
+                break;
+        case CBM_INITRD_XZ:
+                option = "CONFIG_RD_XZ=y";
+                break;
+        default:
+                return false;
+        }
+        if (!kconfig_file || !file_get_text(kconfig_file, &text)) {
+                return false;
+        }
+        for (line = strtok_r(text, "\n", &state); line; line = strtok_r(NULL, "\n", &state)) {
+                if (streq(line, option)) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Read the 8 hex digits of field @n of a cpio header
+ */
+static bool cbm_cpio_field(const char *header, unsigned int n, uint32_t *value)
+{
+        char digits[9] = { 0 };
+        char *end = NULL;
+
+        memcpy(digits, header + 6 + n * 8, 8);
+        errno = 0;
+        *value = (uint32_t)strtoul(digits, &end, 16);
+        return errno == 0 && end == digits + 8;
+}
+
+static inline off_t cbm_cpio_align(off_t offset)
+{
+        return (offset + 3) & ~(off_t)3;
+}
+
+/**
+ * Walk the cpio archive at the start of @fd. Only a single archive is taken,
+ * with nothing but padding after its trailer. An archive holding kernel/
+ * entries is the one the kernel looks for early microcode in, and must stay
+ * uncompressed for it, whatever follows.
+ */
+static bool cbm_initrd_is_plain_cpio(int fd, off_t size)
+{
+        char header[CBM_CPIO_HEADER_SIZE] = { 0 };
+        char name[PATH_MAX] = { 0 };
+        char pad[4096];
+        off_t offset = 0;
+
+        for (;;) {
+                uint32_t namesize = 0;
+                uint32_t filesize = 0;
+                ssize_t r = 0;
+
+                r = cbm_system_pread(fd, header, sizeof(header), offset);
+                if (r != (ssize_t)sizeof(header) ||
+                    (memcmp(header, "070701", 6) != 0 && memcmp(header, "070702", 6) != 0) ||
+                    !cbm_cpio_field(header, 6, &filesize) ||
+                    !cbm_cpio_field(header, 11, &namesize) || namesize < 1 ||
+                    namesize > sizeof(name)) {
+                        return false;
+                }
+                r = cbm_system_pread(fd, name, namesize, offset + CBM_CPIO_HEADER_SIZE);
+                if (r != (ssize_t)namesize || name[namesize - 1] != '\0') {
+                        return false;
+                }
+                if (strncmp(name, "kernel/", 7) == 0 || streq(name, "kernel")) {
+                        return false;
+                }
+                offset = cbm_cpio_align(offset + CBM_CPIO_HEADER_SIZE + namesize);
+                offset = cbm_cpio_align(offset + filesize);
+                if (streq(name, CBM_CPIO_TRAILER)) {
+                        break;
+                }
+                if (offset >= size) {
+                        return false;
+                }
+        }
+
+        /* Anything but zeroes after the trailer is another archive */
+        while (offset < size) {
+                ssize_t r = cbm_system_pread(fd, pad, sizeof(pad), offset);
+
+                if (r <= 0) {
+                        return false;
+                }
+                for (ssize_t i = 0; i < r; i++) {
+                        if (pad[i] != '\0') {
+                                return false;
+                        }
+                }
+                offset += r;
+        }
+        return true;
+}
+
+static CbmInitrdFormat cbm_initrd_probe(const char *path)
+{
+        unsigned char magic[2] = { 0 };
+        struct stat st = { 0 };
+        CbmInitrdFormat format = CBM_INITRD_FORMAT_OTHER;
+        int fd = -1;
+
+        fd = cbm_system_open(path, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+                return CBM_INITRD_FORMAT_OTHER;
+        }
+        if (cbm_system_fstat(fd, &st) == 0 &&
+            cbm_system_pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)) {
+                if (magic[0] == 0x1f && magic[1] == 0x8b) {
+                        format = CBM_INITRD_FORMAT_GZIP;
+                } else if (cbm_initrd_is_plain_cpio(fd, st.st_size)) {
+                        format = CBM_INITRD_FORMAT_CPIO;
+                }
+        }
+        cbm_system_close(fd);
+        return format;
+}
+
+/**
+ * Run @command through the shell, failing on any non-zero status
+ */
+static bool cbm_initrd_run(const char *command)
+{
+        int ret = 0;
+
+        LOG_DEBUG("Running %s", command);
+        ret = cbm_system_system(command);
+        if (ret != 0) {
+                LOG_WARNING("initrd: \"%s\" exited with status %d", command, ret);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Only paths with no quote of their own are handed to the shell
+ */
+static inline bool cbm_initrd_quotable(const char *path)
+{
+        return strchr(path, '\'') == NULL;
+}
+
+/**
+ * Flush @path to disk before it's renamed over @target, as a torn file
+ * would be installed by every later update
+ */
+static bool cbm_initrd_commit(const char *path, const char *target)
+{
+        int fd = -1;
+        bool ret = false;
+
+        fd = cbm_system_open(path, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+                return false;
+        }
+        ret = cbm_sync_fd(fd);
+        cbm_system_close(fd);
+        if (!ret || cbm_system_rename(path, target) != 0) {
+                return false;
+        }
+        return cbm_sync_parent(target);
+}
+
+CbmInitrdResult cbm_initrd_recompress(const char *source, const char *target,
+                                      const CbmInitrdPolicy *policy)
+{
+        autofree(char) *tmp = NULL;
+        autofree(char) *unpacked = NULL;
+        autofree(char) *command = NULL;
+        autofree(char) *level = NULL;
+        struct stat src_st = { 0 };
+        struct stat st = { 0 };
+        const char *input = source;
+        CbmInitrdResult ret = CBM_INITRD_FAILED;
+        CbmInitrdFormat format = CBM_INITRD_FORMAT_OTHER;
+
+        if (policy->compression == CBM_INITRD_KEEP) {
+                return CBM_INITRD_UNSUITABLE;
+        }
+        /* The tools can only be handed files of the running system */
+        if (!cbm_system_has_native_files() || !cbm_initrd_quotable(source) ||
+            !cbm_initrd_quotable(target)) {
+                return CBM_INITRD_FAILED;
+        }
+        if (cbm_system_stat(source, &src_st) != 0) {
+                LOG_WARNING("Cannot stat initrd %s: %s", source, strerror(errno));
+                return CBM_INITRD_FAILED;
+        }
+
+        format = cbm_initrd_probe(source);
+        if (format == CBM_INITRD_FORMAT_OTHER) {
+                LOG_DEBUG("initrd: %s isn't a single gzip or cpio archive, not recompressing",
+                          source);
+                return CBM_INITRD_UNSUITABLE;
+        }
+
+        tmp = string_printf("%s%s", target, CBM_INITRD_TEMP_SUFFIX);
+        OOM_CHECK_RET(tmp, CBM_INITRD_FAILED);
+
+        /* Decompressed first, to compare the output against */
+        if (format == CBM_INITRD_FORMAT_GZIP) {
+                unpacked = string_printf("%s.cpio%s", target, CBM_INITRD_TEMP_SUFFIX);
+                command = string_printf("gzip -dc '%s' > '%s'", source, unpacked);
+                OOM_CHECK_RET(command, CBM_INITRD_FAILED);
+                /* Trailing data, or a corrupt stream, will never unpack */
+                if (!cbm_initrd_run(command)) {
+                        ret = CBM_INITRD_UNSUITABLE;
+                        goto done;
+                }
+                input = unpacked;
+        }
+
+        if (policy->level > 0) {
+                level = string_printf(" -%d", policy->level);
+        }
+        free(command);
+        /* The kernel only checks the crc32 of an xz stream */
+        command = string_printf(policy->compression == CBM_INITRD_ZSTD
+                                    ? "zstd -q%s -c '%s' > '%s'"
+                                    : "xz -q --check=crc32%s -c '%s' > '%s'",
+                                level ? level : "",
+                                input,
+                                tmp);
+        OOM_CHECK_RET(command, CBM_INITRD_FAILED);
+        if (!cbm_initrd_run(command)) {
+                goto done;
+        }
+        if (cbm_system_stat(tmp, &st) != 0 || st.st_size == 0) {
+                LOG_WARNING("initrd: no output recompressing %s", source);
+                goto done;
+        }
+        if (st.st_size >= src_st.st_size) {
+                LOG_DEBUG("initrd: %s is no smaller recompressed, keeping it", source);
+                ret = CBM_INITRD_UNSUITABLE;
+                goto done;
+        }
+        if (!cbm_initrd_commit(tmp, target)) {
+                LOG_WARNING("Cannot write recompressed initrd %s: %s", target, strerror(errno));
+                goto done;
+        }
+        LOG_INFO("Recompressed initrd %s from %lld to %lld bytes",
+                 source,
+                 (long long)src_st.st_size,
+                 (long long)st.st_size);
+        ret = CBM_INITRD_PACKED;
+
+done:
+        if (unpacked && cbm_file_exists(unpacked)) {
+                cbm_unlink(unpacked);
+        }
+        if (ret != CBM_INITRD_PACKED && cbm_file_exists(tmp)) {
+                cbm_unlink(tmp);
+        }
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
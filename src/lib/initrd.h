@@ -0,0 +1,84 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Compression an initrd may be recompressed with
+ */
+typedef enum {
+        CBM_INITRD_KEEP = 0, /**<Installed as shipped */
+        CBM_INITRD_ZSTD,
+        CBM_INITRD_XZ,
+} CbmInitrdCompression;
+
+/**
+ * How initrds are recompressed as they're installed
+ */
+typedef struct CbmInitrdPolicy {
+        CbmInitrdCompression compression;
+        int level; /**<Level passed to the compressor, 0 for its default */
+} CbmInitrdPolicy;
+
+/**
+ * Outcome of cbm_initrd_recompress
+ */
+typedef enum {
+        CBM_INITRD_FAILED = 0, /**<Couldn't be recompressed this time */
+        CBM_INITRD_PACKED,     /**<Recompressed, and smaller for it */
+        CBM_INITRD_UNSUITABLE, /**<Never worth recompressing */
+} CbmInitrdResult;
+
+/**
+ * Parse a recompression policy: "zstd", "xz" or "none", optionally followed
+ * by a compression level. Anything following a # on a line is a comment.
+ *
+ * @return True if @spec was understood
+ */
+bool cbm_initrd_parse_policy(const char *spec, CbmInitrdPolicy *policy);
+
+/**
+ * Suffix naming files compressed with @compression, NULL for CBM_INITRD_KEEP
+ */
+const char *cbm_initrd_suffix(CbmInitrdCompression compression);
+
+/**
+ * Whether the kernel configured by @kconfig_file can unpack an initrd
+ * compressed with @compression
+ */
+bool cbm_initrd_kconfig_supports(const char *kconfig_file, CbmInitrdCompression compression);
+
+/**
+ * Recompress the initrd at @source into @target with the zstd or xz tools on
+ * the PATH. Only a gzip compressed or uncompressed cpio archive is taken, so
+ * an initrd with early microcode prepended or already compressed as wanted
+ * is left as it is, as is one that isn't any smaller for recompressing.
+ *
+ * @target is written beside itself, flushed and then renamed into place, so
+ * it's either complete or missing.
+ */
+CbmInitrdResult cbm_initrd_recompress(const char *source, const char *target,
+                                      const CbmInitrdPolicy *policy);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,428 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "files.h"
+#include "ledger.h"
+#include "log.h"
+#include "system_stub.h"
+#include "util.h"
+#include "writer.h"
+
+/**
+ * Once this many superseded records have piled up, compacting is worthwhile
+ * even if nothing else changed
+ */
+#define CBM_BOOT_LEDGER_SLACK 64
+
+/**
+ * What reading the ledger found, beyond the records themselves
+ */
+typedef struct CbmBootLedgerScan {
+        size_t records; /**<Records in the ledger, including superseded ones */
+        size_t legacy;  /**<Legacy files found alongside it */
+} CbmBootLedgerScan;
+
+static void cbm_boot_record_free(void *v)
+{
+        CbmBootRecord *record = v;
+
+        if (!record) {
+                return;
+        }
+        free(record->kernel);
+        free(record->boot_id);
+        free(record);
+}
+
+static bool cbm_boot_ledger_valid_field(const char *field)
+{
+        return field && *field && !strpbrk(field, " \t\r\n");
+}
+
+/**
+ * Note a boot of @kernel in @records. Later notes supersede earlier ones,
+ * unless @replace is unset.
+ */
+static void cbm_boot_ledger_note(NcHashmap *records, const char *kernel, const char *boot_id,
+                                 uint64_t timestamp, bool replace)
+{
+        CbmBootRecord *record = nc_hashmap_get(records, kernel);
+
+        if (record && !replace) {
+                return;
+        }
+        if (record) {
+                free(record->boot_id);
+        } else {
+                record = calloc(1, sizeof(CbmBootRecord));
+                if (!record) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                record->kernel = strdup(kernel);
+                /* Keyed by its own identifier, the map owns the record */
+                if (!record->kernel || !nc_hashmap_put(records, record->kernel, record)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        record->boot_id = strdup(boot_id);
+        if (!record->boot_id) {
+                DECLARE_OOM();
+                abort();
+        }
+        record->timestamp = timestamp;
+}
+
+/**
+ * Parse the ledger text into @records. Anything malformed, i.e. a record
+ * torn by a crash, is skipped.
+ */
+static void cbm_boot_ledger_parse(char *text, NcHashmap *records, CbmBootLedgerScan *scan)
+{
+        char *line_save = NULL;
+
+        for (char *line = strtok_r(text, "\n", &line_save); line;
+             line = strtok_r(NULL, "\n", &line_save)) {
+                char *field_save = NULL;
+                char *kernel = strtok_r(line, " ", &field_save);
+                char *boot_id = strtok_r(NULL, " ", &field_save);
+                char *stamp = strtok_r(NULL, " ", &field_save);
+                char *end = NULL;
+                unsigned long long timestamp = 0;
+
+                if (!kernel || !boot_id || !stamp) {
+                        continue;
+                }
+                errno = 0;
+                timestamp = strtoull(stamp, &end, 10);
+                if (errno != 0 || end == stamp || *end != '\0') {
+                        continue;
+                }
+                cbm_boot_ledger_note(records, kernel, boot_id, (uint64_t)timestamp, true);
+                ++scan->records;
+        }
+}
+
+/**
+ * Pick up the k_booted files of older versions. The ledger is more recent
+ * than any of them, so they never supersede a ledger record.
+ */
+static void cbm_boot_ledger_import(const char *dir, NcHashmap *records, CbmBootLedgerScan *scan)
+{
+        void *d = NULL;
+        const char *entry = NULL;
+        size_t prefix_len = strlen(CBM_BOOT_LEGACY_PREFIX);
+
+        d = cbm_system_opendir(dir);
+        if (!d) {
+                return;
+        }
+        while ((entry = cbm_system_readdir(d)) != NULL) {
+                autofree(char) *path = NULL;
+                const char *kernel = entry + prefix_len;
+                struct stat st = { 0 };
+
+                if (strncmp(entry, CBM_BOOT_LEGACY_PREFIX, prefix_len) != 0 ||
+                    !cbm_boot_ledger_valid_field(kernel)) {
+                        continue;
+                }
+                path = string_printf("%s/%s", dir, entry);
+                if (cbm_system_stat(path, &st) != 0) {
+                        continue;
+                }
+                cbm_boot_ledger_note(records, kernel, "-", (uint64_t)st.st_mtime, false);
+                ++scan->legacy;
+        }
+        cbm_system_closedir(d);
+}
+
+static NcHashmap *cbm_boot_ledger_read(const char *dir, CbmBootLedgerScan *scan)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        NcHashmap *records = NULL;
+
+        records = nc_hashmap_new_full(nc_string_hash, nc_string_compare, NULL, cbm_boot_record_free);
+        if (!records) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        path = string_printf("%s/%s", dir, CBM_BOOT_LEDGER_FILE);
+        if (file_get_text(path, &text)) {
+                cbm_boot_ledger_parse(text, records, scan);
+        } else if (errno != ENOENT && cbm_file_exists(path)) {
+                LOG_ERROR("Cannot read boot ledger %s: %s", path, strerror(errno));
+                nc_hashmap_free(records);
+                return NULL;
+        }
+        cbm_boot_ledger_import(dir, records, scan);
+        return records;
+}
+
+NcHashmap *cbm_boot_ledger_load(const char *dir)
+{
+        CbmBootLedgerScan scan = { 0 };
+
+        return cbm_boot_ledger_read(dir, &scan);
+}
+
+/**
+ * Take the lock beside the ledger in @dir. Compaction replaces the ledger,
+ * so a lock on the ledger itself would be left behind with the old one.
+ *
+ * @param create Create @dir if it doesn't exist yet
+ * @return the locked descriptor, closed to release the lock, or -1
+ */
+static int cbm_boot_ledger_lock(const char *dir, bool create)
+{
+        autofree(char) *path = NULL;
+        int saved = 0;
+        int fd = -1;
+
+        path = string_printf("%s/%s", dir, CBM_BOOT_LEDGER_LOCK_FILE);
+        fd = cbm_system_open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOCTTY, 00644);
+        if (fd < 0 && errno == ENOENT && create && cbm_mkdir_p(dir, 00755)) {
+                fd = cbm_system_open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOCTTY, 00644);
+        }
+        if (fd < 0) {
+                return -1;
+        }
+        while (cbm_system_flock(fd, LOCK_EX) != 0) {
+                if (errno != EINTR) {
+                        saved = errno;
+                        (void)cbm_system_close(fd);
+                        errno = saved;
+                        return -1;
+                }
+        }
+        return fd;
+}
+
+/**
+ * Release the lock taken by cbm_boot_ledger_lock, keeping errno intact
+ */
+static void cbm_boot_ledger_unlock(int fd)
+{
+        int saved = errno;
+
+        (void)cbm_system_close(fd);
+        errno = saved;
+}
+
+bool cbm_boot_ledger_append(const char *dir, const char *kernel, const char *boot_id,
+                            uint64_t timestamp)
+{
+        char record[CBM_BOOT_RECORD_SIZE];
+        autofree(char) *path = NULL;
+        ssize_t written = 0;
+        int len = 0;
+        int lock = -1;
+        int fd = -1;
+
+        if (!boot_id || !*boot_id) {
+                boot_id = "-";
+        }
+        if (!cbm_boot_ledger_valid_field(kernel) || !cbm_boot_ledger_valid_field(boot_id)) {
+                errno = EINVAL;
+                return false;
+        }
+
+        /* Padded out, leaving room for the newline */
+        len = snprintf(record, sizeof(record), "%s %s %" PRIu64, kernel, boot_id, timestamp);
+        if (len < 0 || (size_t)len >= sizeof(record) - 1) {
+                errno = ENAMETOOLONG;
+                return false;
+        }
+        memset(record + len, ' ', sizeof(record) - 1 - (size_t)len);
+        record[sizeof(record) - 1] = '\n';
+
+        /* Never into a ledger that compaction is about to replace */
+        lock = cbm_boot_ledger_lock(dir, true);
+        if (lock < 0) {
+                return false;
+        }
+        path = string_printf("%s/%s", dir, CBM_BOOT_LEDGER_FILE);
+        fd = cbm_system_open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 00644);
+        if (fd < 0) {
+                cbm_boot_ledger_unlock(lock);
+                return false;
+        }
+        written = cbm_system_write(fd, record, sizeof(record));
+        if (cbm_system_close(fd) != 0) {
+                cbm_boot_ledger_unlock(lock);
+                return false;
+        }
+        cbm_boot_ledger_unlock(lock);
+        if (written != (ssize_t)sizeof(record)) {
+                if (written >= 0) {
+                        errno = EIO;
+                }
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Remove the legacy files once their boots are in the ledger
+ */
+static void cbm_boot_ledger_remove_legacy(const char *dir)
+{
+        void *d = NULL;
+        const char *entry = NULL;
+
+        d = cbm_system_opendir(dir);
+        if (!d) {
+                return;
+        }
+        while ((entry = cbm_system_readdir(d)) != NULL) {
+                autofree(char) *path = NULL;
+
+                if (strncmp(entry, CBM_BOOT_LEGACY_PREFIX, strlen(CBM_BOOT_LEGACY_PREFIX)) != 0) {
+                        continue;
+                }
+                path = string_printf("%s/%s", dir, entry);
+                if (cbm_unlink(path) < 0) {
+                        LOG_WARNING("Failed to remove %s: %s", path, strerror(errno));
+                }
+        }
+        cbm_system_closedir(d);
+}
+
+/**
+ * Compact the ledger in @dir, once nothing else can append to it
+ */
+static bool cbm_boot_ledger_compact_locked(const char *dir, NcHashmap *keep)
+{
+        autofree(NcHashmap) *records = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *path = NULL;
+        autofree(char) *tmp_path = NULL;
+        CbmBootLedgerScan scan = { 0 };
+        NcHashmapIter iter = { 0 };
+        CbmBootRecord *record = NULL;
+        bool stale = false;
+
+        records = cbm_boot_ledger_read(dir, &scan);
+        if (!records) {
+                return false;
+        }
+
+        nc_hashmap_iter_init(records, &iter);
+        while (nc_hashmap_iter_next(&iter, NULL, (void **)&record)) {
+                if (!nc_hashmap_contains(keep, record->kernel)) {
+                        stale = true;
+                        break;
+                }
+        }
+        if (!stale && scan.legacy == 0 &&
+            scan.records <= (size_t)nc_hashmap_size(records) + CBM_BOOT_LEDGER_SLACK) {
+                return true;
+        }
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+        nc_hashmap_iter_init(records, &iter);
+        while (nc_hashmap_iter_next(&iter, NULL, (void **)&record)) {
+                char line[CBM_BOOT_RECORD_SIZE];
+                int len = 0;
+
+                if (!nc_hashmap_contains(keep, record->kernel)) {
+                        continue;
+                }
+                /* Same fixed size records as those appended */
+                len = snprintf(line,
+                               sizeof(line),
+                               "%s %s %" PRIu64,
+                               record->kernel,
+                               record->boot_id,
+                               record->timestamp);
+                if (len < 0 || (size_t)len >= sizeof(line) - 1) {
+                        continue;
+                }
+                cbm_writer_append_printf(writer, "%-*s\n", (int)sizeof(line) - 1, line);
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        path = string_printf("%s/%s", dir, CBM_BOOT_LEDGER_FILE);
+        tmp_path = string_printf("%s.TmpWrite", path);
+        if (!file_set_text(tmp_path, writer->buffer)) {
+                LOG_WARNING("Cannot write %s: %s", tmp_path, strerror(errno));
+                return false;
+        }
+        if (cbm_system_rename(tmp_path, path) != 0) {
+                LOG_WARNING("Cannot rename %s: %s", tmp_path, strerror(errno));
+                (void)cbm_system_unlink(tmp_path);
+                return false;
+        }
+        cbm_sync_path(path);
+
+        if (scan.legacy > 0) {
+                LOG_INFO("Imported %zu legacy boot records into %s", scan.legacy, path);
+                cbm_boot_ledger_remove_legacy(dir);
+                cbm_sync_path(path);
+        }
+        return true;
+}
+
+bool cbm_boot_ledger_compact(const char *dir, NcHashmap *keep)
+{
+        bool ret = false;
+        int lock = -1;
+
+        lock = cbm_boot_ledger_lock(dir, false);
+        if (lock < 0 && errno == ENOENT) {
+                /* No ledger, nor any legacy files */
+                return true;
+        }
+        if (lock < 0 && errno == EROFS) {
+                /* Nothing can append to it either */
+                return cbm_boot_ledger_compact_locked(dir, keep);
+        }
+        if (lock < 0) {
+                LOG_WARNING("Cannot lock the boot ledger in %s: %s", dir, strerror(errno));
+                return false;
+        }
+        ret = cbm_boot_ledger_compact_locked(dir, keep);
+        cbm_boot_ledger_unlock(lock);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
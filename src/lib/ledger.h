@@ -0,0 +1,101 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nica/hashmap.h"
+
+/**
+ * Directory holding the boot ledger, relative to the root
+ */
+#define CBM_BOOT_LEDGER_DIR "/var/lib/kernel"
+
+/**
+ * Name of the boot ledger within CBM_BOOT_LEDGER_DIR
+ */
+#define CBM_BOOT_LEDGER_FILE "boot-ledger"
+
+/**
+ * Lock beside the ledger, held while appending to or compacting it
+ */
+#define CBM_BOOT_LEDGER_LOCK_FILE "boot-ledger.lock"
+
+/**
+ * Prefix of the per-kernel files that preceded the ledger, i.e.
+ * k_booted_4.4.0-120.lts
+ */
+#define CBM_BOOT_LEGACY_PREFIX "k_booted_"
+
+/**
+ * Every record is padded to exactly this size, so that it's appended with a
+ * single write which never interleaves with another
+ */
+#define CBM_BOOT_RECORD_SIZE 256
+
+/**
+ * A successful boot of a kernel, as recorded in the ledger
+ */
+typedef struct CbmBootRecord {
+        char *kernel;       /**<Kernel identifier, $version-$release.$type */
+        char *boot_id;      /**<Kernel boot ID of that boot, "-" if unknown */
+        uint64_t timestamp; /**<Seconds since the epoch */
+} CbmBootRecord;
+
+/**
+ * Append a record of @kernel booting to the ledger in @dir, creating the
+ * ledger if needed. This opens nothing but the ledger and its lock, so that
+ * it's cheap enough to run at every boot.
+ *
+ * @param kernel Kernel identifier, $version-$release.$type
+ * @param boot_id The current boot ID, or NULL if unknown
+ *
+ * @return True if the record was written in full
+ */
+bool cbm_boot_ledger_append(const char *dir, const char *kernel, const char *boot_id,
+                            uint64_t timestamp);
+
+/**
+ * Read the ledger in @dir, along with any legacy k_booted files which are
+ * imported with their modification time as the timestamp.
+ *
+ * @return a map of kernel identifiers to their most recent CbmBootRecord,
+ * owned by the map, or NULL if the ledger can't be read
+ */
+NcHashmap *cbm_boot_ledger_load(const char *dir);
+
+/**
+ * Rewrite the ledger in @dir to hold only the most recent record of each
+ * kernel found in @keep, once that's worth doing: legacy files are still
+ * present, kernels in the ledger are gone, or enough boots have accumulated.
+ * Legacy files are removed once they're in the ledger. Appends wait for the
+ * rewrite to finish, so that none is lost to the ledger it replaces.
+ *
+ * @param keep Set of kernel identifiers still installed
+ *
+ * @return True if the ledger is compact, or didn't need to be
+ */
+bool cbm_boot_ledger_compact(const char *dir, NcHashmap *keep);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
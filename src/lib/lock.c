@@ -0,0 +1,184 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lock.h"
+#include "log.h"
+#include "nica/files.h"
+#include "util.h"
+
+/**
+ * Layout of the lock file. The two lock bytes are never written, they're
+ * only used for fcntl() record locks:
+ *
+ *  - The run lock is held for as long as passes are being run
+ *  - The state lock guards the generations and is only held briefly
+ *
+ * The run lock is only released while holding the state lock, so a request
+ * is either seen by the holder's final check, or finds the lock free.
+ */
+#define CBM_LOCK_FILE "update.lock"
+#define CBM_LOCK_RUN_BYTE 0
+#define CBM_LOCK_STATE_BYTE 1
+#define CBM_LOCK_REQUESTED_OFFSET 8
+#define CBM_LOCK_DONE_OFFSET 16
+
+static int cbm_update_lock_byte(int fd, off_t byte, short type, bool wait)
+{
+        struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = byte, .l_len = 1 };
+
+        for (;;) {
+                if (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) == 0) {
+                        return 0;
+                }
+                if (errno != EINTR) {
+                        return -1;
+                }
+        }
+}
+
+static uint64_t cbm_update_lock_read(int fd, off_t offset)
+{
+        uint64_t value = 0;
+
+        /* Short read, i.e. a fresh lock file, means nothing happened yet */
+        if (pread(fd, &value, sizeof(value), offset) != sizeof(value)) {
+                return 0;
+        }
+        return value;
+}
+
+static bool cbm_update_lock_write(int fd, off_t offset, uint64_t value)
+{
+        return pwrite(fd, &value, sizeof(value), offset) == sizeof(value);
+}
+
+static void cbm_update_lock_close(CbmUpdateLock *lock)
+{
+        if (lock->fd >= 0) {
+                /* Closing drops any record lock we still hold */
+                close(lock->fd);
+                lock->fd = -1;
+        }
+}
+
+CbmUpdateLockResult cbm_update_lock_enter(CbmUpdateLock *lock, const char *dir, bool wait)
+{
+        autofree(char) *path = NULL;
+        bool running = false;
+
+        lock->fd = -1;
+        lock->ticket = 0;
+
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_ERROR("Cannot create lock directory %s: %s", dir, strerror(errno));
+                return CBM_UPDATE_LOCK_ERROR;
+        }
+        path = string_printf("%s/%s", dir, CBM_LOCK_FILE);
+
+        lock->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOCTTY, 00600);
+        if (lock->fd < 0) {
+                LOG_ERROR("Cannot open lock %s: %s", path, strerror(errno));
+                return CBM_UPDATE_LOCK_ERROR;
+        }
+
+        /* File our request, and see whether anybody is there to serve it */
+        if (cbm_update_lock_byte(lock->fd, CBM_LOCK_STATE_BYTE, F_WRLCK, true) != 0) {
+                goto fail;
+        }
+        lock->ticket = cbm_update_lock_read(lock->fd, CBM_LOCK_REQUESTED_OFFSET) + 1;
+        if (!cbm_update_lock_write(lock->fd, CBM_LOCK_REQUESTED_OFFSET, lock->ticket)) {
+                goto fail;
+        }
+        running = cbm_update_lock_byte(lock->fd, CBM_LOCK_RUN_BYTE, F_WRLCK, false) != 0;
+        if (running && errno != EACCES && errno != EAGAIN) {
+                goto fail;
+        }
+        (void)cbm_update_lock_byte(lock->fd, CBM_LOCK_STATE_BYTE, F_UNLCK, false);
+
+        if (!running) {
+                return CBM_UPDATE_LOCK_ACQUIRED;
+        }
+        if (!wait) {
+                LOG_INFO("An update is already running, it will include these changes");
+                cbm_update_lock_close(lock);
+                return CBM_UPDATE_LOCK_BUSY;
+        }
+
+        LOG_INFO("Waiting for the running update to finish");
+        if (cbm_update_lock_byte(lock->fd, CBM_LOCK_RUN_BYTE, F_WRLCK, true) != 0) {
+                goto fail;
+        }
+        if (cbm_update_lock_read(lock->fd, CBM_LOCK_DONE_OFFSET) >= lock->ticket) {
+                LOG_INFO("The previous update already included these changes");
+                cbm_update_lock_close(lock);
+                return CBM_UPDATE_LOCK_SERVED;
+        }
+        return CBM_UPDATE_LOCK_ACQUIRED;
+
+fail:
+        LOG_ERROR("Cannot lock %s: %s", path, strerror(errno));
+        cbm_update_lock_close(lock);
+        return CBM_UPDATE_LOCK_ERROR;
+}
+
+uint64_t cbm_update_lock_begin_pass(CbmUpdateLock *lock)
+{
+        uint64_t generation = lock->ticket;
+
+        if (cbm_update_lock_byte(lock->fd, CBM_LOCK_STATE_BYTE, F_WRLCK, true) == 0) {
+                generation = cbm_update_lock_read(lock->fd, CBM_LOCK_REQUESTED_OFFSET);
+                (void)cbm_update_lock_byte(lock->fd, CBM_LOCK_STATE_BYTE, F_UNLCK, false);
+        }
+        return generation;
+}
+
+bool cbm_update_lock_end_pass(CbmUpdateLock *lock, uint64_t generation, bool success)
+{
+        bool again = false;
+
+        if (cbm_update_lock_byte(lock->fd, CBM_LOCK_STATE_BYTE, F_WRLCK, true) != 0) {
+                /* Without the generations, all we can do is stop */
+                cbm_update_lock_close(lock);
+                return false;
+        }
+        if (success) {
+                (void)cbm_update_lock_write(lock->fd, CBM_LOCK_DONE_OFFSET, generation);
+        }
+        again = cbm_update_lock_read(lock->fd, CBM_LOCK_REQUESTED_OFFSET) > generation;
+        if (again) {
+                (void)cbm_update_lock_byte(lock->fd, CBM_LOCK_STATE_BYTE, F_UNLCK, false);
+                return true;
+        }
+
+        /* Dropping both at once, nobody can slip a request in between */
+        cbm_update_lock_close(lock);
+        return false;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,70 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Coalescing lock, serialising the processes that want to run an update.
+ *
+ * Each process entering the lock bumps a request generation. Only one of
+ * them holds the lock and runs passes, each pass covering every request made
+ * before it started. Anybody arriving meanwhile either leaves their request
+ * for the holder to pick up, or waits to find out whether it was served.
+ */
+typedef struct CbmUpdateLock {
+        int fd;          /**<Lock file, -1 when not held */
+        uint64_t ticket; /**<Generation of our own request */
+} CbmUpdateLock;
+
+typedef enum {
+        CBM_UPDATE_LOCK_ERROR = 0, /**<The lock is unusable */
+        CBM_UPDATE_LOCK_ACQUIRED,  /**<We hold the lock and must run passes */
+        CBM_UPDATE_LOCK_BUSY,      /**<The holder will serve our request */
+        CBM_UPDATE_LOCK_SERVED,    /**<Our request was served while waiting */
+} CbmUpdateLockResult;
+
+/**
+ * Request an update, and attempt to take the lock within @dir to run it
+ *
+ * @param wait Block until the current holder finishes, rather than leaving
+ * it to serve our request
+ */
+CbmUpdateLockResult cbm_update_lock_enter(CbmUpdateLock *lock, const char *dir, bool wait);
+
+/**
+ * Begin a pass, returning the generation that it will cover
+ */
+uint64_t cbm_update_lock_begin_pass(CbmUpdateLock *lock);
+
+/**
+ * Complete a pass covering @generation. If more requests arrived meanwhile
+ * the lock is kept and another pass must be run, otherwise it's released.
+ *
+ * @param success Whether the pass applied everything it covered
+ * @return True if another pass is needed
+ */
+bool cbm_update_lock_end_pass(CbmUpdateLock *lock, uint64_t generation, bool success);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
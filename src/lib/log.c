@@ -11,26 +11,141 @@
 
 #define _GNU_SOURCE
 
+#include <endian.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "nica/util.h"
 
-static FILE *log_file = NULL;
-static CbmLogLevel min_log_level;
-
 #define PACKAGE_NAME_SHORT "cbm"
 
+/**
+ * Where journald accepts natively formatted entries
+ */
+#define CBM_LOG_JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+/**
+ * Messages are collected here before being written out in a single call
+ */
+#define CBM_LOG_BUFFER_SIZE 8192
+
+/**
+ * Longest message formatted on the stack, anything longer is allocated
+ */
+#define CBM_LOG_MESSAGE_SIZE 1024
+
 static const char *log_str_table[] = {[CBM_LOG_DEBUG] = "DEBUG",     [CBM_LOG_INFO] = "INFO",
                                       [CBM_LOG_SUCCESS] = "SUCCESS", [CBM_LOG_ERROR] = "ERROR",
                                       [CBM_LOG_WARNING] = "WARNING", [CBM_LOG_FATAL] = "FATAL" };
 
+/**
+ * syslog priorities of each level, as the journal records them
+ */
+static const char *log_priority_table[] = {[CBM_LOG_DEBUG] = "7",   [CBM_LOG_INFO] = "6",
+                                           [CBM_LOG_SUCCESS] = "5", [CBM_LOG_ERROR] = "3",
+                                           [CBM_LOG_WARNING] = "4", [CBM_LOG_FATAL] = "2" };
+
+static const char *log_field_table[] = {[CBM_LOG_FIELD_PHASE] = "CBM_PHASE",
+                                        [CBM_LOG_FIELD_KERNEL] = "CBM_KERNEL",
+                                        [CBM_LOG_FIELD_KTYPE] = "CBM_KTYPE" };
+
+/**
+ * Fields of the messages logged by this thread
+ */
+static _Thread_local const char *log_fields[CBM_LOG_FIELD_MAX];
+
+/**
+ * Everything written out, shared between the threads of an update
+ */
+static struct {
+        pthread_mutex_t lock;
+        FILE *file;
+        CbmLogLevel min_level;
+        bool buffered;   /**<Not a terminal, so it can wait for a flush */
+        int journal;     /**<Socket for the native journal protocol, or -1 */
+        char buffer[CBM_LOG_BUFFER_SIZE];
+        size_t buffer_n;
+        unsigned int burst;      /**<Messages allowed per window, 0 for any */
+        time_t window;           /**<Second the current window began */
+        unsigned int window_n;   /**<Messages logged in the current window */
+        unsigned int suppressed; /**<Messages dropped and not yet reported */
+} log_state = {.lock = PTHREAD_MUTEX_INITIALIZER, .journal = -1, .burst = CBM_LOG_RATE_BURST };
+
+static inline const char *cbm_log_level_str(CbmLogLevel l)
+{
+        if (l <= CBM_LOG_FATAL) {
+                return log_str_table[l];
+        }
+        return "unknown";
+}
+
+/**
+ * Whether @file is the stream systemd connected to the journal, in which
+ * case entries are sent natively, fields and all
+ */
+static bool cbm_log_is_journal(FILE *file)
+{
+        const char *stream = getenv("JOURNAL_STREAM");
+        unsigned long long dev = 0;
+        unsigned long long ino = 0;
+        struct stat st = { 0 };
+
+        if (!stream || sscanf(stream, "%llu:%llu", &dev, &ino) != 2) {
+                return false;
+        }
+        if (fstat(fileno(file), &st) != 0) {
+                return false;
+        }
+        return (unsigned long long)st.st_dev == dev && (unsigned long long)st.st_ino == ino;
+}
+
+static int cbm_log_journal_open(void)
+{
+        struct sockaddr_un addr = {.sun_family = AF_UNIX };
+        int fd = -1;
+
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -1;
+        }
+        memcpy(addr.sun_path, CBM_LOG_JOURNAL_SOCKET, sizeof(CBM_LOG_JOURNAL_SOCKET));
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+/**
+ * Write out the buffer, with the lock held
+ */
+static void cbm_log_flush_locked(void)
+{
+        if (log_state.buffer_n == 0 || !log_state.file) {
+                return;
+        }
+        if (fwrite(log_state.buffer, 1, log_state.buffer_n, log_state.file) !=
+            log_state.buffer_n) {
+                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream\n", stderr);
+        }
+        fflush(log_state.file);
+        log_state.buffer_n = 0;
+}
+
 void cbm_log_init(FILE *log)
 {
         const char *env_level = NULL;
-        log_file = log;
         unsigned int nlog_level = CBM_LOG_ERROR;
 
         env_level = getenv("CBM_DEBUG");
@@ -41,7 +156,41 @@ void cbm_log_init(FILE *log)
         if (nlog_level >= CBM_LOG_MAX) {
                 nlog_level = CBM_LOG_FATAL;
         }
-        min_log_level = nlog_level;
+
+        pthread_mutex_lock(&log_state.lock);
+        /* Whatever was bound for the old stream still goes there */
+        cbm_log_flush_locked();
+        log_state.file = log;
+        log_state.min_level = nlog_level;
+        log_state.buffered = !isatty(fileno(log));
+        if (log_state.journal >= 0) {
+                close(log_state.journal);
+                log_state.journal = -1;
+        }
+        if (cbm_log_is_journal(log)) {
+                log_state.journal = cbm_log_journal_open();
+        }
+        pthread_mutex_unlock(&log_state.lock);
+}
+
+void cbm_log_set_rate_limit(unsigned int burst)
+{
+        pthread_mutex_lock(&log_state.lock);
+        log_state.burst = burst;
+        log_state.window_n = 0;
+        pthread_mutex_unlock(&log_state.lock);
+}
+
+static void cbm_log_fork_prepare(void)
+{
+        /* Otherwise the child would write our buffer out a second time */
+        pthread_mutex_lock(&log_state.lock);
+        cbm_log_flush_locked();
+}
+
+static void cbm_log_fork_done(void)
+{
+        pthread_mutex_unlock(&log_state.lock);
 }
 
 /**
@@ -50,50 +199,246 @@ void cbm_log_init(FILE *log)
 __attribute__((constructor)) static void cbm_log_first_init(void)
 {
         cbm_log_init(stderr);
+        pthread_atfork(cbm_log_fork_prepare, cbm_log_fork_done, cbm_log_fork_done);
 }
 
-static inline const char *cbm_log_level_str(CbmLogLevel l)
+__attribute__((destructor)) static void cbm_log_last_flush(void)
 {
-        if (l <= CBM_LOG_FATAL) {
-                return log_str_table[l];
+        cbm_log_flush();
+}
+
+CbmLogFieldScope cbm_log_field_push(CbmLogField field, const char *value)
+{
+        CbmLogFieldScope scope = {.field = field, .previous = log_fields[field] };
+
+        log_fields[field] = value;
+        return scope;
+}
+
+void cbm_log_field_pop(CbmLogFieldScope *scope)
+{
+        log_fields[scope->field] = scope->previous;
+}
+
+/**
+ * Append a line made of @head and @message to the buffer, writing it out
+ * first if there's no room, so that lines are only ever written whole.
+ * Lines that would never fit are written directly.
+ */
+static void cbm_log_append(const char *head, size_t head_len, const char *message)
+{
+        size_t message_len = strlen(message);
+        size_t len = head_len + message_len + 1;
+        char *p = NULL;
+
+        if (log_state.buffer_n + len > sizeof(log_state.buffer)) {
+                cbm_log_flush_locked();
         }
-        return "unknown";
+        if (len > sizeof(log_state.buffer)) {
+                if (fprintf(log_state.file, "%.*s%s\n", (int)head_len, head, message) < 0) {
+                        fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream\n", stderr);
+                }
+                return;
+        }
+        p = log_state.buffer + log_state.buffer_n;
+        memcpy(p, head, head_len);
+        memcpy(p + head_len, message, message_len);
+        p[len - 1] = '\n';
+        log_state.buffer_n += len;
+}
+
+/**
+ * Append a "[LEVEL] cbm (file:Lline): message" line
+ */
+static void cbm_log_append_text(CbmLogLevel level, const char *filename, int lineno,
+                                const char *message)
+{
+        char head[256];
+        int n = 0;
+
+        n = snprintf(head,
+                     sizeof(head),
+                     "[%s] %s (%s:L%d): ",
+                     cbm_log_level_str(level),
+                     PACKAGE_NAME_SHORT,
+                     filename,
+                     lineno);
+        if (n < 0) {
+                return;
+        }
+        cbm_log_append(head, (size_t)n < sizeof(head) ? (size_t)n : sizeof(head) - 1, message);
+}
+
+/**
+ * Native protocol field, in the binary form so values may hold newlines
+ */
+typedef struct CbmJournalField {
+        char name[32];
+        uint64_t size;
+} CbmJournalField;
+
+static void cbm_log_journal_field(struct iovec *iov, CbmJournalField *field, const char *name,
+                                  const char *value)
+{
+        size_t len = strlen(name);
+
+        memcpy(field->name, name, len);
+        field->name[len] = '\n';
+        field->size = htole64((uint64_t)strlen(value));
+        iov[0] = (struct iovec){.iov_base = field->name, .iov_len = len + 1 };
+        iov[1] = (struct iovec){.iov_base = &field->size, .iov_len = sizeof(field->size) };
+        iov[2] = (struct iovec){.iov_base = (void *)value, .iov_len = strlen(value) };
+        iov[3] = (struct iovec){.iov_base = "\n", .iov_len = 1 };
+}
+
+/**
+ * Send a single journal entry, with the lock held
+ *
+ * @return False if the journal refused it
+ */
+static bool cbm_log_send_journal(CbmLogLevel level, const char *filename, int lineno,
+                                 const char *message)
+{
+        CbmJournalField fields[6 + CBM_LOG_FIELD_MAX];
+        struct iovec iov[4 * (6 + CBM_LOG_FIELD_MAX)];
+        struct msghdr msg = { 0 };
+        char line[16];
+        size_t n = 0;
+
+        snprintf(line, sizeof(line), "%d", lineno);
+        cbm_log_journal_field(&iov[4 * n], &fields[n], "MESSAGE", message);
+        ++n;
+        cbm_log_journal_field(&iov[4 * n],
+                              &fields[n],
+                              "PRIORITY",
+                              level < CBM_LOG_MAX ? log_priority_table[level] : "6");
+        ++n;
+        cbm_log_journal_field(&iov[4 * n], &fields[n], "SYSLOG_IDENTIFIER", PACKAGE_NAME);
+        ++n;
+        cbm_log_journal_field(&iov[4 * n], &fields[n], "CODE_FILE", filename);
+        ++n;
+        cbm_log_journal_field(&iov[4 * n], &fields[n], "CODE_LINE", line);
+        ++n;
+        cbm_log_journal_field(&iov[4 * n], &fields[n], "CBM_LEVEL", cbm_log_level_str(level));
+        ++n;
+        for (size_t i = 0; i < CBM_LOG_FIELD_MAX; i++) {
+                if (!log_fields[i]) {
+                        continue;
+                }
+                cbm_log_journal_field(&iov[4 * n], &fields[n], log_field_table[i], log_fields[i]);
+                ++n;
+        }
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 4 * n;
+        return sendmsg(log_state.journal, &msg, MSG_NOSIGNAL) >= 0;
+}
+
+/**
+ * Hand one message to the sink, with the lock held
+ */
+static void cbm_log_emit(CbmLogLevel level, const char *filename, int lineno, const char *message)
+{
+        if (log_state.journal >= 0) {
+                if (cbm_log_send_journal(level, filename, lineno, message)) {
+                        return;
+                }
+                /* i.e. journald went away, the stream still works */
+                close(log_state.journal);
+                log_state.journal = -1;
+        }
+        cbm_log_append_text(level, filename, lineno, message);
+}
+
+/**
+ * Decide whether a message at @level may be logged now, with the lock held
+ */
+static bool cbm_log_admit(CbmLogLevel level)
+{
+        struct timespec now = { 0 };
+
+        if (level >= CBM_LOG_ERROR || log_state.burst == 0) {
+                return true;
+        }
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (now.tv_sec != log_state.window) {
+                log_state.window = now.tv_sec;
+                log_state.window_n = 0;
+        }
+        if (log_state.window_n >= log_state.burst) {
+                ++log_state.suppressed;
+                return false;
+        }
+        ++log_state.window_n;
+        return true;
+}
+
+/**
+ * Account for the messages dropped so far, once they may be logged again
+ */
+static void cbm_log_report_suppressed(void)
+{
+        char message[64];
+
+        if (log_state.suppressed == 0) {
+                return;
+        }
+        snprintf(message, sizeof(message), "Suppressed %u messages", log_state.suppressed);
+        log_state.suppressed = 0;
+        cbm_log_emit(CBM_LOG_WARNING, __FILE__, __LINE__, message);
+}
+
+void cbm_log_flush(void)
+{
+        pthread_mutex_lock(&log_state.lock);
+        cbm_log_report_suppressed();
+        cbm_log_flush_locked();
+        pthread_mutex_unlock(&log_state.lock);
 }
 
 void cbm_log(CbmLogLevel level, const char *filename, int lineno, const char *format, ...)
 {
-        const char *displ = NULL;
         va_list vargs;
         autofree(char) *rend = NULL;
+        char message[CBM_LOG_MESSAGE_SIZE];
+        const char *text = format;
 
         /* Respect minimum log level */
-        if (level < min_log_level) {
+        if (level < log_state.min_level) {
                 return;
         }
 
-        displ = cbm_log_level_str(level);
-
-        va_start(vargs, format);
+        /* Constant messages need no formatting at all */
+        if (strchr(format, '%')) {
+                int n = 0;
 
-        if (vasprintf(&rend, format, vargs) < 0) {
-                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream", log_file);
-                goto clean_args;
+                va_start(vargs, format);
+                n = vsnprintf(message, sizeof(message), format, vargs);
+                va_end(vargs);
+                if (n < 0) {
+                        fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream\n", stderr);
+                        return;
+                }
+                text = message;
+                if ((size_t)n >= sizeof(message)) {
+                        va_start(vargs, format);
+                        if (vasprintf(&rend, format, vargs) >= 0) {
+                                text = rend;
+                        }
+                        va_end(vargs);
+                }
         }
 
-        if (fprintf(log_file,
-                    "[%s] %s (%s:L%d): %s\n",
-                    displ,
-                    PACKAGE_NAME_SHORT,
-                    filename,
-                    lineno,
-                    rend) < 0) {
-                /* Forcibly fall back to stderr with the error */
-                fputs("[FATAL] " PACKAGE_NAME_SHORT ": Cannot log to stream", stderr);
-                goto clean_args;
+        pthread_mutex_lock(&log_state.lock);
+        if (cbm_log_admit(level)) {
+                cbm_log_report_suppressed();
+                cbm_log_emit(level, filename, lineno, text);
         }
-
-clean_args:
-        va_end(vargs);
+        /* Problems are seen as they happen */
+        if (!log_state.buffered || level >= CBM_LOG_ERROR) {
+                cbm_log_flush_locked();
+        }
+        pthread_mutex_unlock(&log_state.lock);
 }
 
 /*
@@ -15,6 +15,16 @@
 
 #include <stdio.h>
 
+#include "config.h"
+
+/**
+ * Call sites below this level are compiled out entirely, see the
+ * with-log-level build option. Errors and warnings are always kept.
+ */
+#ifndef CBM_LOG_MIN_LEVEL
+#define CBM_LOG_MIN_LEVEL 0
+#endif
+
 typedef enum {
         CBM_LOG_DEBUG = 0,
         CBM_LOG_INFO,
@@ -25,6 +35,23 @@ typedef enum {
         CBM_LOG_MAX /* Unused */
 } CbmLogLevel;
 
+/**
+ * Structured fields attached to every message logged by the current thread,
+ * which the journal records alongside the message
+ */
+typedef enum {
+        CBM_LOG_FIELD_PHASE = 0, /**<Step of the update, i.e. plan, install or remove */
+        CBM_LOG_FIELD_KERNEL,    /**<Kernel being worked on */
+        CBM_LOG_FIELD_KTYPE,     /**<Type of kernel being worked on */
+        CBM_LOG_FIELD_MAX
+} CbmLogField;
+
+/**
+ * Messages below CBM_LOG_ERROR allowed per second before the rest are
+ * dropped, and counted in a single warning instead
+ */
+#define CBM_LOG_RATE_BURST 1000
+
 /**
  * Re-initialise the logging functionality, to use a different file descriptor
  * for logging
@@ -33,6 +60,23 @@ typedef enum {
  */
 void cbm_log_init(FILE *log);
 
+/**
+ * Write out any buffered messages. Messages below CBM_LOG_ERROR are buffered
+ * unless logging to a terminal, and flushed once the buffer fills, when a
+ * more severe message is logged, on fork() and at exit.
+ *
+ * @note system() and posix_spawn() run no fork handlers, so this must be
+ * called before spawning a command, and by long-lived callers before they
+ * block. cbm_system_system() and each update already do.
+ */
+void cbm_log_flush(void);
+
+/**
+ * Allow at most @burst messages below CBM_LOG_ERROR per second, or any
+ * number if 0. Defaults to CBM_LOG_RATE_BURST.
+ */
+void cbm_log_set_rate_limit(unsigned int burst);
+
 /**
  * Log current status/error to stderr. It is recommended to use the
  * macros to achieve this.
@@ -40,20 +84,29 @@ void cbm_log_init(FILE *log);
 void cbm_log(CbmLogLevel level, const char *file, int line, const char *format, ...)
     __attribute__((format(printf, 4, 5)));
 
+/**
+ * Whether call sites at @level are compiled in. The arguments of those that
+ * aren't are still type checked, but never evaluated.
+ */
+#define CBM_LOG_COMPILED(level) ((level) >= CBM_LOG_MIN_LEVEL || (level) >= CBM_LOG_ERROR)
+
+#define CBM_LOG_AT(level, ...)                                                                     \
+        (CBM_LOG_COMPILED(level) ? cbm_log(level, __FILE__, __LINE__, __VA_ARGS__) : (void)0)
+
 /**
  * Log a simple debug message
  */
-#define LOG_DEBUG(...) (cbm_log(CBM_LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_DEBUG(...) CBM_LOG_AT(CBM_LOG_DEBUG, __VA_ARGS__)
 
 /**
  * Log an informational message
  */
-#define LOG_INFO(...) (cbm_log(CBM_LOG_INFO, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_INFO(...) CBM_LOG_AT(CBM_LOG_INFO, __VA_ARGS__)
 
 /**
  * Log success
  */
-#define LOG_SUCCESS(...) (cbm_log(CBM_LOG_SUCCESS, __FILE__, __LINE__, __VA_ARGS__))
+#define LOG_SUCCESS(...) CBM_LOG_AT(CBM_LOG_SUCCESS, __VA_ARGS__)
 
 /**
  * Log a non-fatal error
@@ -70,6 +123,35 @@ void cbm_log(CbmLogLevel level, const char *file, int line, const char *format,
  */
 #define LOG_WARNING(...) (cbm_log(CBM_LOG_WARNING, __FILE__, __LINE__, __VA_ARGS__))
 
+/**
+ * A field set for the remainder of a scope, see CBM_LOG_FIELD_SCOPE
+ */
+typedef struct CbmLogFieldScope {
+        CbmLogField field;
+        const char *previous;
+} CbmLogFieldScope;
+
+/**
+ * Set @field to @value for the messages of this thread, until popped. The
+ * value is borrowed, not copied, and NULL clears the field.
+ */
+CbmLogFieldScope cbm_log_field_push(CbmLogField field, const char *value);
+
+/**
+ * Restore the field set aside by cbm_log_field_push
+ */
+void cbm_log_field_pop(CbmLogFieldScope *scope);
+
+#define _CBM_LOG_CONCAT_(a, b) a##b
+#define _CBM_LOG_CONCAT(a, b) _CBM_LOG_CONCAT_(a, b)
+
+/**
+ * Set @field to @value for the remainder of the enclosing scope
+ */
+#define CBM_LOG_FIELD_SCOPE(field, value)                                                          \
+        __attribute__((cleanup(cbm_log_field_pop))) CbmLogFieldScope _CBM_LOG_CONCAT(             \
+            cbm_log_field_, __LINE__) = cbm_log_field_push(field, value)
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
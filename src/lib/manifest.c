@@ -0,0 +1,1326 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "log.h"
+#include "manifest.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+#include "pool.h"
+#include "sha256.h"
+#include "stats.h"
+#include "system_stub.h"
+#include "trace.h"
+#include "util.h"
+#include "writer.h"
+
+/**
+ * Bump whenever the record layout of either file changes
+ */
+#define CBM_MANIFEST_MAGIC "clr-boot-manager-manifest 1"
+#define CBM_DIGEST_CACHE_MAGIC "clr-boot-manager-digests 1"
+#define CBM_JOURNAL_MAGIC "clr-boot-manager-journal 1"
+
+/**
+ * Suffix of the temporary files written beside their targets
+ */
+#define CBM_TEMP_SUFFIX ".TmpWrite"
+
+/**
+ * Bytes of a pair compared by one worker of cbm_manifest_verify, so that a
+ * large initrd is spread across every core rather than read by one
+ */
+#define CBM_VERIFY_EXTENT (8 * 1024 * 1024)
+
+/**
+ * Bytes of an extent read at a time
+ */
+#define CBM_VERIFY_CHUNK (128 * 1024)
+
+/**
+ * What we last installed to a given target
+ */
+typedef struct CbmManifestEntry {
+        char digest[CBM_SHA256_HEX_SIZE]; /**<Digest of the installed contents */
+        long long size;                   /**<Size of the target after install */
+        long long mtime_sec;              /**<Modification time of the target after install */
+        long long mtime_nsec;
+} CbmManifestEntry;
+
+/**
+ * Known digest of a source file
+ */
+typedef struct CbmDigestEntry {
+        CbmFileKey key;                   /**<Identity of the source when hashed */
+        char digest[CBM_SHA256_HEX_SIZE]; /**<Digest of its contents */
+} CbmDigestEntry;
+
+/**
+ * Kernels are installed concurrently, so all state is guarded by lock.
+ */
+struct CbmManifest {
+        pthread_mutex_t lock;
+        bool open;
+        bool verify;
+        char *root;           /**<Tracked root, without trailing slash */
+        char *path;           /**<Path to the manifest itself */
+        char *digest_path;    /**<Path to the source digest cache, may be NULL */
+        NcHashmap *entries;   /**<Relative target path -> CbmManifestEntry */
+        NcHashmap *digests;   /**<Source path -> CbmDigestEntry */
+        bool dirty;           /**<Manifest needs writing back */
+        bool digests_dirty;   /**<Digest cache needs writing back */
+        char *journal_path;   /**<Path to the journal */
+        int journal_fd;       /**<Journal being appended to, or -1 */
+        bool interrupted;     /**<An interrupted update's journal was found */
+        NcHashmap *verified;  /**<Relative target path -> "1" or "0" from cbm_manifest_verify */
+};
+
+/**
+ * Source file key -> digest, shared by every manifest of the process. It
+ * only holds facts about sources, so the roots of any number of managers
+ * updated at once may serve one another's sources from it.
+ */
+static struct {
+        pthread_mutex_t lock;
+        NcHashmap *map;
+} cbm_known_digests = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+static NcHashmap *cbm_manifest_new_map(void)
+{
+        NcHashmap *map = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        if (!map) {
+                DECLARE_OOM();
+                abort();
+        }
+        return map;
+}
+
+/**
+ * Replace any existing value for @key, taking ownership of both
+ */
+static void cbm_manifest_map_set(NcHashmap *map, char *key, void *value)
+{
+        if (!key) {
+                DECLARE_OOM();
+                abort();
+        }
+        nc_hashmap_remove(map, key);
+        if (!nc_hashmap_put(map, key, value)) {
+                DECLARE_OOM();
+                abort();
+        }
+}
+
+/**
+ * The path of @dst relative to the tracked root, or NULL if it lives
+ * elsewhere. Must be called with the lock held.
+ */
+static const char *cbm_manifest_relative(CbmManifest *self, const char *dst)
+{
+        size_t len = 0;
+
+        if (!self || !self->open || !dst) {
+                return NULL;
+        }
+        len = strlen(self->root);
+        if (strncmp(dst, self->root, len) != 0 || dst[len] != '/') {
+                return NULL;
+        }
+        while (dst[len] == '/') {
+                ++len;
+        }
+        return dst[len] ? dst + len : NULL;
+}
+
+/**
+ * Parse a manifest record into @entry
+ *
+ * @return The relative path the record is for, within @line, or NULL if
+ * the record is corrupt
+ */
+static const char *cbm_manifest_parse_record(const char *line, CbmManifestEntry *entry)
+{
+        int offset = 0;
+
+        /* <digest> <size> <mtime> <relative path> */
+        if (sscanf(line,
+                   "%64s %lld %lld.%lld %n",
+                   entry->digest,
+                   &entry->size,
+                   &entry->mtime_sec,
+                   &entry->mtime_nsec,
+                   &offset) != 4 ||
+            strlen(entry->digest) != CBM_SHA256_HEX_SIZE - 1 || line[offset] == '\0') {
+                return NULL;
+        }
+        return line + offset;
+}
+
+/**
+ * Render @entry as the manifest record for @rel, newline terminated
+ */
+static char *cbm_manifest_format_record(const char *rel, const CbmManifestEntry *entry)
+{
+        char *line = string_printf("%s %lld %lld.%lld %s\n",
+                                   entry->digest,
+                                   entry->size,
+                                   entry->mtime_sec,
+                                   entry->mtime_nsec,
+                                   rel);
+        if (!line) {
+                DECLARE_OOM();
+                abort();
+        }
+        return line;
+}
+
+/**
+ * Parse a digest cache record into @entry
+ *
+ * @return The source path the record is for, within @line, or NULL if the
+ * record is corrupt
+ */
+static const char *cbm_manifest_parse_digest(const char *line, CbmDigestEntry *entry)
+{
+        char key[128] = { 0 };
+        int offset = 0;
+
+        /* <digest> <file key> <source path> */
+        if (sscanf(line, "%64s %127s %n", entry->digest, key, &offset) != 2 ||
+            strlen(entry->digest) != CBM_SHA256_HEX_SIZE - 1 || line[offset] == '\0' ||
+            !cbm_file_key_parse(&entry->key, key)) {
+                return NULL;
+        }
+        return line + offset;
+}
+
+static void cbm_manifest_load(CbmManifest *self)
+{
+        autofree(char) *text = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+
+        if (!file_get_text(self->path, &text)) {
+                return;
+        }
+
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, CBM_MANIFEST_MAGIC)) {
+                LOG_DEBUG("Discarding incompatible manifest %s", self->path);
+                self->dirty = true;
+                return;
+        }
+
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                CbmManifestEntry *entry = NULL;
+                const char *rel = NULL;
+
+                entry = calloc(1, sizeof(struct CbmManifestEntry));
+                if (!entry) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                rel = cbm_manifest_parse_record(line, entry);
+                if (!rel) {
+                        LOG_DEBUG("Skipping corrupt manifest record");
+                        self->dirty = true;
+                        free(entry);
+                        continue;
+                }
+                cbm_manifest_map_set(self->entries, strdup(rel), entry);
+        }
+}
+
+/**
+ * Hash the target of a journal record, which was appended as soon as the
+ * target was in place and so possibly before its contents were flushed
+ *
+ * @return True if the target still holds exactly what was installed
+ */
+static bool cbm_manifest_journal_verify(CbmManifest *self, const char *rel,
+                                        const CbmManifestEntry *entry)
+{
+        autofree(char) *path = NULL;
+        uint8_t raw[CBM_SHA256_SIZE];
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        struct stat st = { 0 };
+
+        path = string_printf("%s/%s", self->root, rel);
+        if (stat(path, &st) != 0 || entry->size != (long long)st.st_size ||
+            entry->mtime_sec != (long long)st.st_mtim.tv_sec ||
+            entry->mtime_nsec != (long long)st.st_mtim.tv_nsec) {
+                return false;
+        }
+        if (!cbm_sha256_file(path, raw)) {
+                return false;
+        }
+        cbm_sha256_to_hex(raw, digest);
+        return streq(digest, entry->digest);
+}
+
+/**
+ * Take in whatever the journal of an interrupted update says it installed,
+ * once verified, in the order it was installed
+ */
+static void cbm_manifest_replay_journal(CbmManifest *self)
+{
+        autofree(char) *text = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+        unsigned int intact = 0;
+        unsigned int damaged = 0;
+
+        if (!file_get_text(self->journal_path, &text)) {
+                return;
+        }
+        self->interrupted = true;
+
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, CBM_JOURNAL_MAGIC)) {
+                LOG_WARNING("Discarding incompatible journal %s", self->journal_path);
+                return;
+        }
+
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                CbmManifestEntry *entry = NULL;
+                const char *rel = NULL;
+
+                if (strncmp(line, "plan ", 5) == 0) {
+                        LOG_DEBUG("Interrupted update planned: %s", line + 5);
+                        continue;
+                }
+                entry = calloc(1, sizeof(struct CbmManifestEntry));
+                if (!entry) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                rel = cbm_manifest_parse_record(line, entry);
+                /* A torn append or an unflushed copy, either is copied again */
+                if (!rel || !cbm_manifest_journal_verify(self, rel, entry)) {
+                        ++damaged;
+                        free(entry);
+                        continue;
+                }
+                cbm_manifest_map_set(self->entries, strdup(rel), entry);
+                self->dirty = true;
+                ++intact;
+        }
+        LOG_INFO("Resuming an interrupted update of %s: %u installed files intact, %u not",
+                 self->root,
+                 intact,
+                 damaged);
+}
+
+/**
+ * Remove the temporary files beneath @dir, left there by an interrupted
+ * update. Symlinks are never followed.
+ */
+static void cbm_manifest_sweep(const char *dir, unsigned int *removed)
+{
+        void *d = NULL;
+        const char *entry = NULL;
+        size_t suffix_len = strlen(CBM_TEMP_SUFFIX);
+
+        d = cbm_system_opendir(dir);
+        if (!d) {
+                return;
+        }
+        while ((entry = cbm_system_readdir(d)) != NULL) {
+                autofree(char) *path = NULL;
+                struct stat st = { 0 };
+                size_t len = strlen(entry);
+
+                if (streq(entry, ".") || streq(entry, "..")) {
+                        continue;
+                }
+                path = string_printf("%s/%s", dir, entry);
+                if (cbm_system_lstat(path, &st) != 0) {
+                        continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                        cbm_manifest_sweep(path, removed);
+                } else if (S_ISREG(st.st_mode) && len > suffix_len &&
+                           streq(entry + len - suffix_len, CBM_TEMP_SUFFIX)) {
+                        if (cbm_unlink(path) == 0) {
+                                LOG_DEBUG("Removed orphaned %s", path);
+                                ++*removed;
+                        } else {
+                                LOG_WARNING("Cannot remove orphaned %s: %s", path, strerror(errno));
+                        }
+                }
+        }
+        cbm_system_closedir(d);
+}
+
+static void cbm_manifest_load_digests(CbmManifest *self)
+{
+        autofree(char) *text = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+
+        if (!self->digest_path || !file_get_text(self->digest_path, &text)) {
+                return;
+        }
+
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, CBM_DIGEST_CACHE_MAGIC)) {
+                self->digests_dirty = true;
+                return;
+        }
+
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                CbmDigestEntry *entry = NULL;
+                const char *src = NULL;
+
+                entry = calloc(1, sizeof(struct CbmDigestEntry));
+                if (!entry) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                src = cbm_manifest_parse_digest(line, entry);
+                if (!src) {
+                        self->digests_dirty = true;
+                        free(entry);
+                        continue;
+                }
+                cbm_manifest_map_set(self->digests, strdup(src), entry);
+        }
+}
+
+/**
+ * Atomically replace @path with the contents of @writer
+ */
+static bool cbm_manifest_write_file(const char *path, CbmWriter *writer)
+{
+        autofree(char) *tmp_path = NULL;
+
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        tmp_path = string_printf("%s.TmpWrite", path);
+        if (!file_set_text(tmp_path, writer->buffer)) {
+                LOG_WARNING("Cannot write %s: %s", tmp_path, strerror(errno));
+                return false;
+        }
+        if (rename(tmp_path, path) != 0) {
+                LOG_WARNING("Cannot rename %s: %s", tmp_path, strerror(errno));
+                (void)unlink(tmp_path);
+                return false;
+        }
+        return true;
+}
+
+static void cbm_manifest_save(CbmManifest *self)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        NcHashmapIter iter = { 0 };
+        const char *rel = NULL;
+        CbmManifestEntry *entry = NULL;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        cbm_writer_append_printf(writer, "%s\n", CBM_MANIFEST_MAGIC);
+        nc_hashmap_iter_init(self->entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&rel, (void **)&entry)) {
+                autofree(char) *line = cbm_manifest_format_record(rel, entry);
+
+                cbm_writer_append(writer, line);
+        }
+
+        (void)cbm_manifest_write_file(self->path, writer);
+}
+
+static void cbm_manifest_save_digests(CbmManifest *self)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *dir = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *path = NULL;
+        CbmDigestEntry *entry = NULL;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        cbm_writer_append_printf(writer, "%s\n", CBM_DIGEST_CACHE_MAGIC);
+        nc_hashmap_iter_init(self->digests, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&path, (void **)&entry)) {
+                /* Don't keep digests for sources that have since gone away */
+                if (!nc_file_exists(path)) {
+                        continue;
+                }
+                cbm_writer_append_printf(writer, "%s " CBM_FILE_KEY_FORMAT " %s\n",
+                                         entry->digest,
+                                         CBM_FILE_KEY_ARGS(&entry->key),
+                                         path);
+        }
+
+        dir = strdup(self->digest_path);
+        if (!dir) {
+                DECLARE_OOM();
+                abort();
+        }
+        if (strrchr(dir, '/')) {
+                *strrchr(dir, '/') = '\0';
+        }
+        if (dir[0] && !nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_DEBUG("Cannot create digest cache directory %s: %s", dir, strerror(errno));
+                return;
+        }
+
+        (void)cbm_manifest_write_file(self->digest_path, writer);
+}
+
+CbmManifest *cbm_manifest_new(void)
+{
+        CbmManifest *self = NULL;
+
+        self = calloc(1, sizeof(struct CbmManifest));
+        if (!self) {
+                DECLARE_OOM();
+                abort();
+        }
+        pthread_mutex_init(&self->lock, NULL);
+        self->journal_fd = -1;
+        return self;
+}
+
+void cbm_manifest_free(CbmManifest *self)
+{
+        if (!self) {
+                return;
+        }
+        cbm_manifest_close(self);
+        pthread_mutex_destroy(&self->lock);
+        free(self);
+}
+
+void cbm_manifest_open(CbmManifest *self, const char *root, const char *digest_cache, bool verify)
+{
+        size_t len = 0;
+
+        if (!self || !root) {
+                return;
+        }
+
+        cbm_manifest_close(self);
+
+        pthread_mutex_lock(&self->lock);
+        self->root = strdup(root);
+        if (!self->root) {
+                DECLARE_OOM();
+                abort();
+        }
+        len = strlen(self->root);
+        while (len > 1 && self->root[len - 1] == '/') {
+                self->root[--len] = '\0';
+        }
+        self->path = string_printf("%s/%s", self->root, CBM_MANIFEST_FILE);
+        self->journal_path = string_printf("%s/%s", self->root, CBM_JOURNAL_FILE);
+        if (digest_cache) {
+                self->digest_path = strdup(digest_cache);
+                if (!self->digest_path) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        self->entries = cbm_manifest_new_map();
+        self->digests = cbm_manifest_new_map();
+        self->verified = cbm_manifest_new_map();
+        self->verify = verify;
+        self->dirty = false;
+        self->digests_dirty = false;
+        self->interrupted = false;
+
+        cbm_manifest_load(self);
+        cbm_manifest_replay_journal(self);
+        cbm_manifest_load_digests(self);
+        self->open = true;
+        pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Append @text with a single write, so that a record is either there in
+ * full or torn at the very end
+ */
+static bool cbm_manifest_journal_write(int fd, const char *text)
+{
+        size_t len = strlen(text);
+        ssize_t written = cbm_system_write(fd, text, len);
+
+        if (written != (ssize_t)len) {
+                if (written >= 0) {
+                        errno = EIO;
+                }
+                return false;
+        }
+        return true;
+}
+
+void cbm_manifest_journal_begin(CbmManifest *self, const char *plan)
+{
+        autofree(char) *copy = NULL;
+        unsigned int removed = 0;
+        char *line = NULL;
+        char *saveptr = NULL;
+        int fd = -1;
+
+        if (!self) {
+                return;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        if (!self->open || self->journal_fd >= 0) {
+                pthread_mutex_unlock(&self->lock);
+                return;
+        }
+
+        /* The new journal only covers this update, keep what was recovered */
+        if (self->dirty) {
+                cbm_manifest_save(self);
+                self->dirty = false;
+        }
+        if (self->interrupted) {
+                cbm_manifest_sweep(self->root, &removed);
+                if (removed > 0) {
+                        LOG_INFO("Removed %u files left behind by the interrupted update",
+                                 removed);
+                }
+                self->interrupted = false;
+        }
+
+        fd = cbm_system_open(self->journal_path,
+                             O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC | O_NOCTTY,
+                             00644);
+        if (fd < 0) {
+                LOG_WARNING("Cannot start journal %s: %s",
+                            self->journal_path,
+                            strerror(errno));
+                pthread_mutex_unlock(&self->lock);
+                return;
+        }
+        self->journal_fd = fd;
+
+        if (!cbm_manifest_journal_write(fd, CBM_JOURNAL_MAGIC "\n")) {
+                goto failed;
+        }
+        copy = plan ? strdup(plan) : NULL;
+        for (line = copy ? strtok_r(copy, "\n", &saveptr) : NULL; line;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                autofree(char) *record = string_printf("plan %s\n", line);
+
+                if (!cbm_manifest_journal_write(fd, record)) {
+                        goto failed;
+                }
+        }
+        /* Once, so that nothing done after this can go unnoticed */
+        if (!cbm_sync_fd(fd) || !cbm_sync_parent(self->journal_path)) {
+                goto failed;
+        }
+        pthread_mutex_unlock(&self->lock);
+        return;
+
+failed:
+        LOG_WARNING("Cannot write journal %s: %s", self->journal_path, strerror(errno));
+        pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Append the record for @rel to the journal. Must be called with the lock
+ * held, so that records never interleave.
+ */
+static void cbm_manifest_journal_append(CbmManifest *self, const char *rel,
+                                        const CbmManifestEntry *entry)
+{
+        autofree(char) *line = NULL;
+
+        if (self->journal_fd < 0) {
+                return;
+        }
+        line = cbm_manifest_format_record(rel, entry);
+        /* Not fatal, its copy is merely compared again if interrupted */
+        if (!cbm_manifest_journal_write(self->journal_fd, line)) {
+                LOG_DEBUG("Cannot append to %s: %s", self->journal_path, strerror(errno));
+        }
+}
+
+static void cbm_manifest_release(CbmManifest *self, bool save)
+{
+        if (!self) {
+                return;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        if (self->open && save) {
+                if (self->dirty) {
+                        cbm_manifest_save(self);
+                }
+                if (self->digests_dirty && self->digest_path) {
+                        cbm_manifest_save_digests(self);
+                }
+        }
+        if (self->journal_fd >= 0) {
+                (void)cbm_system_close(self->journal_fd);
+                self->journal_fd = -1;
+                /* The manifest now holds everything it recorded */
+                if (save && cbm_unlink(self->journal_path) != 0) {
+                        LOG_WARNING("Cannot remove %s: %s",
+                                    self->journal_path,
+                                    strerror(errno));
+                }
+        }
+        self->open = false;
+        free(self->root);
+        self->root = NULL;
+        free(self->path);
+        self->path = NULL;
+        free(self->journal_path);
+        self->journal_path = NULL;
+        free(self->digest_path);
+        self->digest_path = NULL;
+        if (self->entries) {
+                nc_hashmap_free(self->entries);
+                self->entries = NULL;
+        }
+        if (self->digests) {
+                nc_hashmap_free(self->digests);
+                self->digests = NULL;
+        }
+        if (self->verified) {
+                nc_hashmap_free(self->verified);
+                self->verified = NULL;
+        }
+        pthread_mutex_unlock(&self->lock);
+}
+
+void cbm_manifest_close(CbmManifest *self)
+{
+        cbm_manifest_release(self, true);
+}
+
+void cbm_manifest_discard(CbmManifest *self)
+{
+        cbm_manifest_release(self, false);
+}
+
+/**
+ * Look up the digest of @src, identified by @key, without hashing anything
+ *
+ * @return True if it was known
+ */
+static bool cbm_manifest_lookup_digest(CbmManifest *self, const char *src, const CbmFileKey *key,
+                                       char digest[CBM_SHA256_HEX_SIZE], bool *by_path)
+{
+        autofree(char) *known_key = NULL;
+        CbmDigestEntry *entry = NULL;
+        const char *known = NULL;
+
+        known_key = string_printf(CBM_FILE_KEY_FORMAT, CBM_FILE_KEY_ARGS(key));
+
+        *by_path = false;
+        if (self) {
+                pthread_mutex_lock(&self->lock);
+                entry = self->digests ? nc_hashmap_get(self->digests, src) : NULL;
+                *by_path = entry && cbm_file_key_equal(&entry->key, key);
+                if (*by_path) {
+                        memcpy(digest, entry->digest, CBM_SHA256_HEX_SIZE);
+                }
+                pthread_mutex_unlock(&self->lock);
+        }
+        if (*by_path) {
+                return true;
+        }
+
+        /* Roots updated by the same process may well share their sources */
+        pthread_mutex_lock(&cbm_known_digests.lock);
+        known = cbm_known_digests.map ? nc_hashmap_get(cbm_known_digests.map, known_key) : NULL;
+        if (known) {
+                memcpy(digest, known, CBM_SHA256_HEX_SIZE);
+        }
+        pthread_mutex_unlock(&cbm_known_digests.lock);
+
+        return known != NULL;
+}
+
+/**
+ * Find the digest of @src, hashing it only if it changed since we last did.
+ * Hashing is performed without the lock so that concurrent installs don't
+ * serialise on one another. If the caller already @measured the contents,
+ * that digest is taken instead of hashing.
+ *
+ * Digests are also remembered by file identity for the life of the process,
+ * so a source shared by several roots (hardlinked, or bind mounted) is only
+ * hashed once in a batch update.
+ */
+static bool cbm_manifest_source_digest(CbmManifest *self, const char *src, const char *measured,
+                                       char digest[CBM_SHA256_HEX_SIZE])
+{
+        CbmFileKey key = { 0 };
+        CbmDigestEntry *entry = NULL;
+        uint8_t raw[CBM_SHA256_SIZE];
+        autofree(char) *known_key = NULL;
+        bool by_path = false;
+        bool known = false;
+
+        if (!cbm_file_key_for_path(&key, src)) {
+                return false;
+        }
+
+        known = cbm_manifest_lookup_digest(self, src, &key, digest, &by_path);
+        if (by_path) {
+                return true;
+        }
+
+        if (!known && measured) {
+                memcpy(digest, measured, CBM_SHA256_HEX_SIZE);
+        } else if (!known) {
+                if (!cbm_sha256_file(src, raw)) {
+                        return false;
+                }
+                cbm_sha256_to_hex(raw, digest);
+        }
+
+        entry = calloc(1, sizeof(struct CbmDigestEntry));
+        if (!entry) {
+                DECLARE_OOM();
+                abort();
+        }
+        entry->key = key;
+        memcpy(entry->digest, digest, CBM_SHA256_HEX_SIZE);
+        known_key = string_printf(CBM_FILE_KEY_FORMAT, CBM_FILE_KEY_ARGS(&key));
+
+        if (self) {
+                pthread_mutex_lock(&self->lock);
+                if (self->digests) {
+                        cbm_manifest_map_set(self->digests, strdup(src), entry);
+                        self->digests_dirty = true;
+                        entry = NULL;
+                }
+                pthread_mutex_unlock(&self->lock);
+        }
+        free(entry);
+        if (!known) {
+                char *value = strndup(digest, CBM_SHA256_HEX_SIZE);
+                if (!value) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                pthread_mutex_lock(&cbm_known_digests.lock);
+                if (!cbm_known_digests.map) {
+                        cbm_known_digests.map = cbm_manifest_new_map();
+                }
+                cbm_manifest_map_set(cbm_known_digests.map, strdup(known_key), value);
+                pthread_mutex_unlock(&cbm_known_digests.lock);
+        }
+
+        return true;
+}
+
+/**
+ * Record that @dst now holds the contents of @src, whose digest may already
+ * have been @measured while copying it
+ */
+static void cbm_manifest_record(CbmManifest *self, const char *src, const char *dst,
+                                const char *measured)
+{
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        CbmManifestEntry *entry = NULL;
+        const char *rel = NULL;
+        struct stat st = { 0 };
+
+        if (!self) {
+                return;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        rel = cbm_manifest_relative(self, dst);
+        pthread_mutex_unlock(&self->lock);
+        if (!rel) {
+                return;
+        }
+
+        if (!cbm_manifest_source_digest(self, src, measured, digest) || stat(dst, &st) != 0) {
+                cbm_manifest_forget(self, dst);
+                return;
+        }
+
+        entry = calloc(1, sizeof(struct CbmManifestEntry));
+        if (!entry) {
+                DECLARE_OOM();
+                abort();
+        }
+        memcpy(entry->digest, digest, CBM_SHA256_HEX_SIZE);
+        entry->size = (long long)st.st_size;
+        entry->mtime_sec = (long long)st.st_mtim.tv_sec;
+        entry->mtime_nsec = (long long)st.st_mtim.tv_nsec;
+
+        pthread_mutex_lock(&self->lock);
+        if (self->open) {
+                cbm_manifest_journal_append(self, rel, entry);
+                cbm_manifest_map_set(self->entries, strdup(rel), entry);
+                nc_hashmap_remove(self->verified, rel);
+                self->dirty = true;
+        } else {
+                free(entry);
+        }
+        pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Full content comparison, refreshing the manifest when they do match so
+ * that the next run can skip it.
+ */
+static bool cbm_manifest_compare_full(CbmManifest *self, const char *src, const char *dst)
+{
+        if (!cbm_files_match(src, dst)) {
+                return false;
+        }
+        cbm_manifest_record(self, src, dst, NULL);
+        return true;
+}
+
+bool cbm_manifest_files_match(CbmManifest *self, const char *src, const char *dst)
+{
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        CbmManifestEntry entry = { 0 };
+        CbmManifestEntry *known = NULL;
+        const char *outcome = NULL;
+        struct stat st = { 0 };
+        bool verify = false;
+        bool have_entry = false;
+
+        if (!src || !dst) {
+                return false;
+        }
+        if (!self) {
+                return cbm_files_match(src, dst);
+        }
+
+        pthread_mutex_lock(&self->lock);
+        if (!cbm_manifest_relative(self, dst)) {
+                pthread_mutex_unlock(&self->lock);
+                return cbm_files_match(src, dst);
+        }
+        verify = self->verify;
+        outcome = nc_hashmap_get(self->verified, cbm_manifest_relative(self, dst));
+        if (outcome) {
+                /* Compared in full just now, by cbm_manifest_verify */
+                pthread_mutex_unlock(&self->lock);
+                return streq(outcome, "1");
+        }
+        known = nc_hashmap_get(self->entries, cbm_manifest_relative(self, dst));
+        if (known) {
+                entry = *known;
+                have_entry = true;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        if (verify) {
+                return cbm_manifest_compare_full(self, src, dst);
+        }
+
+        if (stat(dst, &st) != 0) {
+                return false;
+        }
+
+        /* Unknown, or touched by somebody else since we installed it */
+        if (!have_entry || entry.size != (long long)st.st_size ||
+            entry.mtime_sec != (long long)st.st_mtim.tv_sec ||
+            entry.mtime_nsec != (long long)st.st_mtim.tv_nsec) {
+                return cbm_manifest_compare_full(self, src, dst);
+        }
+
+        if (!cbm_manifest_source_digest(self, src, NULL, digest)) {
+                return false;
+        }
+
+        return streq(digest, entry.digest);
+}
+
+/**
+ * A range of one of the pairs given to cbm_manifest_verify
+ */
+typedef struct CbmVerifyExtent {
+        CbmManifestPair *pair;
+        off_t offset;
+        size_t len;
+        bool differs; /**<Set by the worker comparing it */
+} CbmVerifyExtent;
+
+static void cbm_manifest_verify_extent(void *item, __cbm_unused__ void *userdata)
+{
+        CbmVerifyExtent *extent = item;
+        char *buf1 = NULL;
+        char *buf2 = NULL;
+        int fd1 = -1;
+        int fd2 = -1;
+
+        CBM_TRACE_SCOPE("verify_extent");
+
+        extent->differs = true;
+        fd1 = cbm_system_open(extent->pair->src, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+        fd2 = cbm_system_open(extent->pair->dst, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+        buf1 = malloc(CBM_VERIFY_CHUNK);
+        buf2 = malloc(CBM_VERIFY_CHUNK);
+        if (!buf1 || !buf2) {
+                DECLARE_OOM();
+                abort();
+        }
+        if (fd1 < 0 || fd2 < 0) {
+                goto end;
+        }
+        for (size_t done = 0; done < extent->len; done += CBM_VERIFY_CHUNK) {
+                size_t len = extent->len - done;
+                off_t offset = extent->offset + (off_t)done;
+
+                if (len > CBM_VERIFY_CHUNK) {
+                        len = CBM_VERIFY_CHUNK;
+                }
+                cbm_io_throttle((uint64_t)len * 2);
+                if (cbm_system_pread(fd1, buf1, len, offset) != (ssize_t)len ||
+                    cbm_system_pread(fd2, buf2, len, offset) != (ssize_t)len) {
+                        goto end;
+                }
+                cbm_stats_add(CBM_STAT_BYTES_COMPARED, (uint64_t)len * 2);
+                if (memcmp(buf1, buf2, len) != 0) {
+                        goto end;
+                }
+        }
+        extent->differs = false;
+
+end:
+        if (fd1 >= 0) {
+                cbm_system_close(fd1);
+        }
+        if (fd2 >= 0) {
+                cbm_system_close(fd2);
+        }
+        free(buf1);
+        free(buf2);
+}
+
+/**
+ * Record the outcome of comparing @item, hashing the source of a match for
+ * the manifest unless its digest is cached
+ */
+static void cbm_manifest_verify_settle(void *item, void *userdata)
+{
+        CbmManifestPair *pair = item;
+        CbmManifest *self = userdata;
+        const char *rel = NULL;
+
+        if (pair->matches) {
+                cbm_manifest_record(self, pair->src, pair->dst, NULL);
+        } else {
+                cbm_manifest_forget(self, pair->dst);
+        }
+        if (!self) {
+                return;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        rel = cbm_manifest_relative(self, pair->dst);
+        if (rel) {
+                cbm_manifest_map_set(self->verified,
+                                     strdup(rel),
+                                     strdup(pair->matches ? "1" : "0"));
+        }
+        pthread_mutex_unlock(&self->lock);
+}
+
+void cbm_manifest_verify(CbmManifest *self, CbmManifestPair *pairs, size_t n_pairs,
+                         unsigned int jobs)
+{
+        NcArray *extents = NULL;
+        NcArray *settle = NULL;
+        CbmVerifyExtent *storage = NULL;
+        size_t n_extents = 0;
+        size_t next = 0;
+
+        CBM_TRACE_SCOPE("verify");
+
+        extents = nc_array_new();
+        settle = nc_array_new();
+        if (!extents || !settle) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        /* Sizes first, only pairs of equal size need reading at all */
+        for (size_t i = 0; i < n_pairs; i++) {
+                CbmManifestPair *pair = &pairs[i];
+                struct stat st1 = { 0 };
+                struct stat st2 = { 0 };
+
+                pair->matches = false;
+                pair->size = 0;
+                if (!nc_array_add(settle, pair)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                if (!pair->src || !pair->dst || cbm_system_stat(pair->src, &st1) != 0 ||
+                    cbm_system_stat(pair->dst, &st2) != 0 || st1.st_size != st2.st_size) {
+                        continue;
+                }
+                pair->matches = true;
+                if (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+                        continue;
+                }
+                pair->size = st1.st_size;
+                n_extents += (size_t)((pair->size + CBM_VERIFY_EXTENT - 1) / CBM_VERIFY_EXTENT);
+        }
+
+        storage = calloc(n_extents ? n_extents : 1, sizeof(CbmVerifyExtent));
+        if (!storage) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (size_t i = 0; i < n_pairs; i++) {
+                for (off_t offset = 0; offset < pairs[i].size; offset += CBM_VERIFY_EXTENT) {
+                        CbmVerifyExtent *extent = &storage[next++];
+
+                        extent->pair = &pairs[i];
+                        extent->offset = offset;
+                        extent->len = (size_t)(pairs[i].size - offset);
+                        if (extent->len > CBM_VERIFY_EXTENT) {
+                                extent->len = CBM_VERIFY_EXTENT;
+                        }
+                        if (!nc_array_add(extents, extent)) {
+                                DECLARE_OOM();
+                                abort();
+                        }
+                }
+        }
+
+        cbm_pool_run(extents, jobs, cbm_manifest_verify_extent, NULL);
+        for (size_t i = 0; i < n_extents; i++) {
+                if (storage[i].differs) {
+                        storage[i].pair->matches = false;
+                }
+        }
+        /* Sources not hashed before are hashed in parallel too */
+        cbm_pool_run(settle, jobs, cbm_manifest_verify_settle, self);
+
+        free(storage);
+        nc_array_free(&extents, NULL);
+        nc_array_free(&settle, NULL);
+}
+
+bool cbm_manifest_install_file(CbmManifest *self, const char *src, const char *dst, mode_t mode)
+{
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+
+        return cbm_manifest_install_file_measured(self, src, dst, mode, digest);
+}
+
+bool cbm_manifest_install_file_measured(CbmManifest *self, const char *src, const char *dst,
+                                        mode_t mode, char digest[CBM_SHA256_HEX_SIZE])
+{
+        CbmFileKey key = { 0 };
+        bool by_path = false;
+        bool measured = false;
+
+        /* Already known, so the cheapest copy will do */
+        if (cbm_file_key_for_path(&key, src) &&
+            cbm_manifest_lookup_digest(self, src, &key, digest, &by_path)) {
+                measured = copy_file_atomic(src, dst, mode);
+        } else {
+                measured = copy_file_atomic_measured(src, dst, mode, digest);
+        }
+        if (!measured) {
+                cbm_manifest_forget(self, dst);
+                return false;
+        }
+
+        cbm_manifest_record(self, src, dst, digest);
+        cbm_stats_measure(dst, digest);
+        return true;
+}
+
+bool cbm_manifest_digest(CbmManifest *self, const char *src, char digest[CBM_SHA256_HEX_SIZE])
+{
+        uint8_t raw[CBM_SHA256_SIZE];
+        bool open = false;
+
+        if (self) {
+                pthread_mutex_lock(&self->lock);
+                open = self->digests != NULL;
+                pthread_mutex_unlock(&self->lock);
+        }
+
+        if (open) {
+                return cbm_manifest_source_digest(self, src, NULL, digest);
+        }
+        if (!cbm_sha256_file(src, raw)) {
+                return false;
+        }
+        cbm_sha256_to_hex(raw, digest);
+        return true;
+}
+
+/**
+ * Read the records of the file at @path after checking its @magic, handing
+ * each line to @parse along with @userdata
+ */
+static bool cbm_manifest_read_file(const char *path, const char *magic,
+                                   void (*parse)(char *line, void *userdata), void *userdata)
+{
+        autofree(char) *text = NULL;
+        char *line = NULL;
+        char *saveptr = NULL;
+
+        if (!path || !file_get_text(path, &text)) {
+                return false;
+        }
+        line = strtok_r(text, "\n", &saveptr);
+        if (!line || !streq(line, magic)) {
+                return false;
+        }
+        while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+                parse(line, userdata);
+        }
+        return true;
+}
+
+/**
+ * State of reading either file without tracking it
+ */
+typedef struct CbmManifestReader {
+        const char *root; /**<Tracked root the records are relative to */
+        NcHashmap *map;   /**<Results so far */
+} CbmManifestReader;
+
+static void cbm_manifest_read_record(char *line, void *userdata)
+{
+        CbmManifestReader *reader = userdata;
+        CbmManifestEntry entry = { 0 };
+        autofree(char) *path = NULL;
+        const char *rel = NULL;
+        struct stat st = { 0 };
+
+        rel = cbm_manifest_parse_record(line, &entry);
+        if (!rel) {
+                return;
+        }
+        /* Just as cbm_manifest_files_match trusts it */
+        path = string_printf("%s/%s", reader->root, rel);
+        if (stat(path, &st) != 0 || entry.size != (long long)st.st_size ||
+            entry.mtime_sec != (long long)st.st_mtim.tv_sec ||
+            entry.mtime_nsec != (long long)st.st_mtim.tv_nsec) {
+                return;
+        }
+        cbm_manifest_map_set(reader->map, strdup(entry.digest), strdup(rel));
+}
+
+NcHashmap *cbm_manifest_read(const char *root)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *journal = NULL;
+        CbmManifestReader reader = {.root = root };
+        bool found = false;
+
+        path = string_printf("%s/%s", root, CBM_MANIFEST_FILE);
+        journal = string_printf("%s/%s", root, CBM_JOURNAL_FILE);
+        reader.map = cbm_manifest_new_map();
+        found = cbm_manifest_read_file(path, CBM_MANIFEST_MAGIC, cbm_manifest_read_record, &reader);
+        /* Along with whatever an interrupted update managed to install */
+        if (cbm_manifest_read_file(journal,
+                                   CBM_JOURNAL_MAGIC,
+                                   cbm_manifest_read_record,
+                                   &reader)) {
+                found = true;
+        }
+        if (!found) {
+                nc_hashmap_free(reader.map);
+                return NULL;
+        }
+        return reader.map;
+}
+
+static void cbm_manifest_read_digest(char *line, void *userdata)
+{
+        CbmManifestReader *reader = userdata;
+        CbmDigestEntry entry = { 0 };
+        CbmFileKey key = { 0 };
+        const char *src = NULL;
+
+        src = cbm_manifest_parse_digest(line, &entry);
+        if (!src || !cbm_file_key_for_path(&key, src) || !cbm_file_key_equal(&key, &entry.key)) {
+                return;
+        }
+        cbm_manifest_map_set(reader->map, strdup(src), strdup(entry.digest));
+}
+
+NcHashmap *cbm_manifest_read_digests(const char *digest_cache)
+{
+        CbmManifestReader reader = { 0 };
+
+        reader.map = cbm_manifest_new_map();
+        if (!cbm_manifest_read_file(digest_cache,
+                                    CBM_DIGEST_CACHE_MAGIC,
+                                    cbm_manifest_read_digest,
+                                    &reader)) {
+                nc_hashmap_free(reader.map);
+                return NULL;
+        }
+        return reader.map;
+}
+
+void cbm_manifest_forget(CbmManifest *self, const char *dst)
+{
+        const char *rel = NULL;
+
+        if (!self) {
+                return;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        rel = cbm_manifest_relative(self, dst);
+        if (rel && nc_hashmap_contains(self->entries, rel)) {
+                nc_hashmap_remove(self->entries, rel);
+                self->dirty = true;
+        }
+        if (rel) {
+                nc_hashmap_remove(self->verified, rel);
+        }
+        pthread_mutex_unlock(&self->lock);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
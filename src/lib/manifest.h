@@ -0,0 +1,200 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "nica/hashmap.h"
+#include "sha256.h"
+#include "util.h"
+
+/**
+ * Name of the manifest file, relative to the root it describes
+ */
+#define CBM_MANIFEST_FILE "clr-boot-manager.manifest"
+
+/**
+ * Name of the journal of an update in progress, relative to the root
+ */
+#define CBM_JOURNAL_FILE "clr-boot-manager.journal"
+
+/**
+ * Default location of the source digest cache, relative to the prefix
+ */
+#define CBM_DIGEST_CACHE_PATH "var/cache/clr-boot-manager/digests"
+
+/**
+ * Tracks the files installed beneath one root. Each BootManager owns its
+ * own, so that managers of different roots never share an update's state.
+ *
+ * Every function taking one also accepts NULL, which tracks nothing: files
+ * are compared in full, digests computed afresh and nothing is recorded.
+ */
+typedef struct CbmManifest CbmManifest;
+
+/**
+ * Construct a new, closed manifest
+ */
+CbmManifest *cbm_manifest_new(void);
+
+/**
+ * Close @manifest, writing back any changes, and free it
+ */
+void cbm_manifest_free(CbmManifest *manifest);
+
+/**
+ * Begin tracking the files installed beneath @root (typically the ESP).
+ *
+ * Every installed blob is recorded in a manifest at the top of @root with
+ * its size, modification time and SHA-256 digest. Provided the target still
+ * has the recorded size and mtime, determining whether it's up to date only
+ * requires the digest of the source, rather than reading back the target.
+ *
+ * Source digests are cached by inode, size and mtime in @digest_cache so that
+ * they survive between runs. This may be NULL to only cache in memory.
+ *
+ * If an update of @root was interrupted before it could close the manifest,
+ * the files its journal says were installed are hashed, and those still
+ * holding what was installed are taken into the manifest. Only the copies
+ * that never completed are then found to be out of date.
+ *
+ * @param root Directory containing the installed files
+ * @param digest_cache Path to the source digest cache, or NULL
+ * @param verify Always compare file contents in full, refreshing the manifest
+ */
+void cbm_manifest_open(CbmManifest *manifest, const char *root, const char *digest_cache,
+                       bool verify);
+
+/**
+ * Begin changing the tracked root according to @plan. The journal is
+ * started with the plan, and every file installed from then on is appended
+ * to it, to be recovered should the update be interrupted. Anything the
+ * manifest recovered from an interrupted update is written back first, and
+ * the temporary files that update left behind are removed.
+ *
+ * The journal is removed again by cbm_manifest_close, once the manifest
+ * itself is up to date.
+ *
+ * @param plan Description of the update, one operation per line, or NULL
+ */
+void cbm_manifest_journal_begin(CbmManifest *manifest, const char *plan);
+
+/**
+ * Write back any changes and stop tracking. Safe to call when not open.
+ */
+void cbm_manifest_close(CbmManifest *manifest);
+
+/**
+ * Stop tracking without writing anything back, i.e. after a dry run
+ */
+void cbm_manifest_discard(CbmManifest *manifest);
+
+/**
+ * Determine if @dst is an identical copy of @src.
+ *
+ * When no manifest is open, in verify mode, or for targets outside of the
+ * tracked root this is exactly cbm_files_match, unless the target was
+ * compared by cbm_manifest_verify since.
+ */
+bool cbm_manifest_files_match(CbmManifest *manifest, const char *src, const char *dst);
+
+/**
+ * A source and the target it's installed to, as compared by
+ * cbm_manifest_verify
+ */
+typedef struct CbmManifestPair {
+        const char *src;
+        const char *dst;
+        bool matches; /**<Set to whether @dst is an identical copy of @src */
+        off_t size;   /**<Set to the bytes of each that had to be compared */
+} CbmManifestPair;
+
+/**
+ * Compare every pair of @pairs in full, whatever the manifest says. Each
+ * pair is split into extents of a few MiB, and the extents of all of them
+ * are compared by up to @jobs threads, so a single large initrd is read by
+ * every core at once. The sources of matching pairs are then hashed in
+ * parallel, too, unless their digests are cached, and their targets are
+ * recorded in the manifest. Mismatching targets are dropped from it.
+ *
+ * While the manifest stays open, cbm_manifest_files_match answers for these
+ * targets from the outcome, until they're installed again.
+ */
+void cbm_manifest_verify(CbmManifest *manifest, CbmManifestPair *pairs, size_t n_pairs,
+                         unsigned int jobs);
+
+/**
+ * Install @src at @dst with copy_file_atomic and record it in the manifest,
+ * along with its measurement in the stats
+ *
+ * @return True if the copy succeeded
+ */
+bool cbm_manifest_install_file(CbmManifest *manifest, const char *src, const char *dst,
+                               mode_t mode);
+
+/**
+ * As cbm_manifest_install_file, also storing the hex encoded SHA-256 digest
+ * of what was installed in @digest. Sources whose digest isn't cached yet
+ * are hashed while they're copied, rather than being read a second time.
+ *
+ * @return True if the copy succeeded
+ */
+bool cbm_manifest_install_file_measured(CbmManifest *manifest, const char *src, const char *dst,
+                                        mode_t mode, char digest[CBM_SHA256_HEX_SIZE]);
+
+/**
+ * Find the hex encoded SHA-256 digest of @src. While a manifest is open this
+ * is served from the source digest cache whenever the file is unchanged.
+ *
+ * @return True if the file could be read in full
+ */
+bool cbm_manifest_digest(CbmManifest *manifest, const char *src, char digest[CBM_SHA256_HEX_SIZE]);
+
+/**
+ * Drop @dst from the manifest, i.e. after it has been removed
+ */
+void cbm_manifest_forget(CbmManifest *manifest, const char *dst);
+
+/**
+ * Read the manifest of @root without tracking it, i.e. to report on what's
+ * installed. Only records of targets still untouched since they were
+ * installed are taken, including those in the journal of an update that
+ * was interrupted.
+ *
+ * @return Digest -> path relative to @root of each installed file, or NULL
+ * if @root has no manifest
+ */
+NcHashmap *cbm_manifest_read(const char *root);
+
+/**
+ * Read the source digest cache at @digest_cache without opening it. Never
+ * hashes anything, sources changed since they were hashed are left out.
+ *
+ * @return Source path -> digest, or NULL if there is no cache
+ */
+NcHashmap *cbm_manifest_read_digests(const char *digest_cache);
+
+DEF_AUTOFREE(CbmManifest, cbm_manifest_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
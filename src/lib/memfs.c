@@ -0,0 +1,1040 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+
+#include "log.h"
+#include "memfs.h"
+#include "nica/hashmap.h"
+#include "util.h"
+
+/**
+ * Block size reported through stat and statvfs
+ */
+#define MEMFS_BLOCK_SIZE 4096
+
+/**
+ * Smallest allocation for file contents, most files are tiny
+ */
+#define MEMFS_MIN_ALLOC 64
+
+/**
+ * Descriptors are numbered from here, well clear of any real ones so that
+ * mixing them up fails loudly with EBADF
+ */
+#define MEMFS_FD_BASE (1 << 20)
+
+/**
+ * Symbolic links followed while resolving a single path, as with ELOOP
+ */
+#define MEMFS_MAX_LINKS 40
+
+/**
+ * A file, directory or symbolic link
+ */
+typedef struct MemfsNode {
+        char *name;               /**<Name within the parent */
+        mode_t mode;              /**<Type and permissions */
+        ino_t ino;                /**<Unique within the filesystem */
+        struct MemfsNode *parent; /**<NULL for the root, and once removed */
+        NcHashmap *children;      /**<Directories only, name to MemfsNode */
+        char *data;               /**<File contents, or the link target */
+        size_t length;            /**<Length of data */
+        size_t alloc;             /**<Allocated size of data */
+        unsigned int opened;      /**<Open descriptors, keeping a removed file alive */
+        struct timespec mtime;    /**<Last modification */
+        struct MemfsFile *locker; /**<Descriptor holding the flock() lock, if any */
+} MemfsNode;
+
+/**
+ * An open descriptor
+ */
+typedef struct MemfsFile {
+        MemfsNode *node;
+        size_t offset;
+        int flags;
+} MemfsFile;
+
+/**
+ * An open directory, listing the names it held when opened
+ */
+typedef struct MemfsDir {
+        char **names;
+        size_t n_names;
+        size_t next;
+} MemfsDir;
+
+/**
+ * Where a path leads
+ */
+typedef struct MemfsLookup {
+        MemfsNode *node;        /**<What the path names, NULL if nothing yet */
+        MemfsNode *parent;      /**<Directory holding the final component, if it can */
+        char name[NAME_MAX + 1]; /**<Final component within parent */
+} MemfsLookup;
+
+/**
+ * The one in-memory filesystem. Kernels are installed from multiple threads,
+ * so everything is guarded by lock.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t unlocked; /**<Signalled whenever a flock() lock is released */
+        MemfsNode *root;
+        MemfsFile **files; /**<Indexed by descriptor - MEMFS_FD_BASE */
+        size_t n_files;
+        ino_t next_ino;
+        uint64_t used;     /**<Bytes taken by all file contents */
+        uint64_t capacity; /**<Bytes allowed before ENOSPC */
+} memfs = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .unlocked = PTHREAD_COND_INITIALIZER,
+            .capacity = CBM_MEMFS_DEFAULT_CAPACITY };
+
+static MemfsNode *memfs_node_new(const char *name, mode_t mode)
+{
+        MemfsNode *node = NULL;
+
+        node = calloc(1, sizeof(MemfsNode));
+        if (!node) {
+                DECLARE_OOM();
+                abort();
+        }
+        node->name = strdup(name);
+        if (!node->name) {
+                DECLARE_OOM();
+                abort();
+        }
+        if (S_ISDIR(mode)) {
+                node->children = nc_hashmap_new(nc_string_hash, nc_string_compare);
+                if (!node->children) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        node->mode = mode;
+        node->ino = ++memfs.next_ino;
+        clock_gettime(CLOCK_REALTIME, &node->mtime);
+        return node;
+}
+
+/**
+ * Free @node along with everything beneath it
+ */
+static void memfs_node_free(MemfsNode *node)
+{
+        if (node->children) {
+                NcHashmapIter iter = { 0 };
+                MemfsNode *child = NULL;
+
+                nc_hashmap_iter_init(node->children, &iter);
+                while (nc_hashmap_iter_next(&iter, NULL, (void **)&child)) {
+                        memfs_node_free(child);
+                }
+                nc_hashmap_free(node->children);
+        }
+        if (S_ISREG(node->mode)) {
+                memfs.used -= node->length;
+        }
+        free(node->name);
+        free(node->data);
+        free(node);
+}
+
+static MemfsNode *memfs_root(void)
+{
+        if (!memfs.root) {
+                memfs.root = memfs_node_new("/", S_IFDIR | 00755);
+        }
+        return memfs.root;
+}
+
+static void memfs_attach(MemfsNode *dir, MemfsNode *node)
+{
+        if (!nc_hashmap_put(dir->children, node->name, node)) {
+                DECLARE_OOM();
+                abort();
+        }
+        node->parent = dir;
+        clock_gettime(CLOCK_REALTIME, &dir->mtime);
+}
+
+/**
+ * Take @node out of its directory. It's freed right away unless it's still
+ * open, in which case the last close frees it.
+ */
+static void memfs_detach(MemfsNode *node, bool release)
+{
+        nc_hashmap_steal(node->parent->children, node->name);
+        clock_gettime(CLOCK_REALTIME, &node->parent->mtime);
+        node->parent = NULL;
+        if (release && node->opened == 0) {
+                memfs_node_free(node);
+        }
+}
+
+/**
+ * Resolve @path relative to @dir, following symbolic links on the way and,
+ * if @follow is set, that of the final component too
+ *
+ * @return 0, or the errno value of the failure
+ */
+static int memfs_walk(MemfsNode *dir, const char *path, bool follow, unsigned int depth,
+                      MemfsLookup *out)
+{
+        autofree(char) *copy = NULL;
+        char *save = NULL;
+        char *comp = NULL;
+
+        if (!path || !*path) {
+                return ENOENT;
+        }
+        if (depth > MEMFS_MAX_LINKS) {
+                return ELOOP;
+        }
+        if (*path == '/') {
+                dir = memfs_root();
+        }
+        copy = strdup(path);
+        if (!copy) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        *out = (MemfsLookup){.node = dir };
+        comp = strtok_r(copy, "/", &save);
+        while (comp) {
+                char *next = strtok_r(NULL, "/", &save);
+                bool relative = streq(comp, ".") || streq(comp, "..");
+                MemfsNode *child = NULL;
+
+                if (!S_ISDIR(dir->mode)) {
+                        return ENOTDIR;
+                }
+                if (strlen(comp) > NAME_MAX) {
+                        return ENAMETOOLONG;
+                }
+                if (streq(comp, ".")) {
+                        child = dir;
+                } else if (streq(comp, "..")) {
+                        child = dir->parent ? dir->parent : dir;
+                } else {
+                        child = nc_hashmap_get(dir->children, comp);
+                }
+
+                if (!next) {
+                        if (child && S_ISLNK(child->mode) && follow) {
+                                return memfs_walk(dir, child->data, true, depth + 1, out);
+                        }
+                        out->node = child;
+                        /* Neither "." nor ".." can be created or removed */
+                        if (!relative) {
+                                out->parent = dir;
+                                strcpy(out->name, comp);
+                        }
+                        return 0;
+                }
+
+                if (!child) {
+                        return ENOENT;
+                }
+                if (S_ISLNK(child->mode)) {
+                        MemfsLookup link = { 0 };
+                        int r = memfs_walk(dir, child->data, true, depth + 1, &link);
+
+                        if (r != 0) {
+                                return r;
+                        }
+                        if (!link.node) {
+                                return ENOENT;
+                        }
+                        child = link.node;
+                }
+                dir = child;
+                comp = next;
+        }
+        /* Nothing but slashes, i.e. the root itself */
+        out->node = dir;
+        return 0;
+}
+
+/**
+ * memfs_walk from the root, setting errno on failure
+ */
+static bool memfs_lookup(const char *path, bool follow, MemfsLookup *out)
+{
+        int r = memfs_walk(memfs_root(), path, follow, 0, out);
+
+        if (r != 0) {
+                errno = r;
+                return false;
+        }
+        return true;
+}
+
+static MemfsFile *memfs_get_file(int fd)
+{
+        size_t index = 0;
+
+        if (fd < MEMFS_FD_BASE) {
+                return NULL;
+        }
+        index = (size_t)(fd - MEMFS_FD_BASE);
+        if (index >= memfs.n_files) {
+                return NULL;
+        }
+        return memfs.files[index];
+}
+
+/**
+ * Hand out the lowest free descriptor for @file
+ */
+static int memfs_add_file(MemfsFile *file)
+{
+        size_t index = 0;
+
+        while (index < memfs.n_files && memfs.files[index]) {
+                ++index;
+        }
+        if (index == memfs.n_files) {
+                size_t n = memfs.n_files ? memfs.n_files * 2 : 64;
+                MemfsFile **files = realloc(memfs.files, n * sizeof(MemfsFile *));
+
+                if (!files) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                memset(files + memfs.n_files, 0, (n - memfs.n_files) * sizeof(MemfsFile *));
+                memfs.files = files;
+                memfs.n_files = n;
+        }
+        memfs.files[index] = file;
+        return MEMFS_FD_BASE + (int)index;
+}
+
+static void memfs_fill_stat(const MemfsNode *node, struct stat *st)
+{
+        memset(st, 0, sizeof(struct stat));
+        st->st_dev = makedev(0, 0x4d);
+        st->st_ino = node->ino;
+        st->st_mode = node->mode;
+        st->st_nlink = S_ISDIR(node->mode) ? 2 : 1;
+        st->st_uid = 0;
+        st->st_gid = 0;
+        st->st_size = (off_t)node->length;
+        st->st_blksize = MEMFS_BLOCK_SIZE;
+        st->st_blocks = (blkcnt_t)((node->length + 511) / 512);
+        st->st_atim = node->mtime;
+        st->st_mtim = node->mtime;
+        st->st_ctim = node->mtime;
+}
+
+/**
+ * Ensure @node can hold @length bytes, within the capacity
+ */
+static bool memfs_node_reserve(MemfsNode *node, size_t length)
+{
+        if (length > node->length && memfs.used + (length - node->length) > memfs.capacity) {
+                errno = ENOSPC;
+                return false;
+        }
+        if (length > node->alloc) {
+                size_t alloc = node->alloc ? node->alloc : MEMFS_MIN_ALLOC;
+                char *data = NULL;
+
+                while (alloc < length) {
+                        alloc *= 2;
+                }
+                data = realloc(node->data, alloc);
+                if (!data) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                node->data = data;
+                node->alloc = alloc;
+        }
+        return true;
+}
+
+static void memfs_node_truncate(MemfsNode *node)
+{
+        memfs.used -= node->length;
+        node->length = 0;
+        clock_gettime(CLOCK_REALTIME, &node->mtime);
+}
+
+static int memfs_open(const char *path, int flags, mode_t mode)
+{
+        MemfsLookup lookup = { 0 };
+        MemfsFile *file = NULL;
+        MemfsNode *node = NULL;
+        int accmode = flags & O_ACCMODE;
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, !(flags & O_NOFOLLOW), &lookup)) {
+                goto end;
+        }
+        node = lookup.node;
+        if (node && (flags & O_CREAT) && (flags & O_EXCL)) {
+                errno = EEXIST;
+                goto end;
+        }
+        if (!node) {
+                if (!(flags & O_CREAT)) {
+                        errno = ENOENT;
+                        goto end;
+                }
+                node = memfs_node_new(lookup.name, S_IFREG | (mode & 07777));
+                memfs_attach(lookup.parent, node);
+        }
+        if (S_ISLNK(node->mode)) {
+                errno = ELOOP;
+                goto end;
+        }
+        if (S_ISDIR(node->mode) && accmode != O_RDONLY) {
+                errno = EISDIR;
+                goto end;
+        }
+        if ((flags & O_DIRECTORY) && !S_ISDIR(node->mode)) {
+                errno = ENOTDIR;
+                goto end;
+        }
+        if ((flags & O_TRUNC) && accmode != O_RDONLY && S_ISREG(node->mode)) {
+                memfs_node_truncate(node);
+        }
+
+        file = calloc(1, sizeof(MemfsFile));
+        if (!file) {
+                DECLARE_OOM();
+                abort();
+        }
+        file->node = node;
+        file->flags = flags;
+        ++node->opened;
+        ret = memfs_add_file(file);
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_close(int fd)
+{
+        MemfsFile *file = NULL;
+        MemfsNode *node = NULL;
+
+        pthread_mutex_lock(&memfs.lock);
+        file = memfs_get_file(fd);
+        if (!file) {
+                pthread_mutex_unlock(&memfs.lock);
+                errno = EBADF;
+                return -1;
+        }
+        memfs.files[fd - MEMFS_FD_BASE] = NULL;
+        node = file->node;
+        if (node->locker == file) {
+                node->locker = NULL;
+                pthread_cond_broadcast(&memfs.unlocked);
+        }
+        /* Removed while still open, nothing else refers to it */
+        if (--node->opened == 0 && !node->parent && node != memfs.root) {
+                memfs_node_free(node);
+        }
+        free(file);
+        pthread_mutex_unlock(&memfs.lock);
+        return 0;
+}
+
+/**
+ * Read from @file at @offset, with the lock held
+ */
+static ssize_t memfs_read_at(MemfsFile *file, void *buf, size_t count, size_t offset)
+{
+        MemfsNode *node = file->node;
+
+        if ((file->flags & O_ACCMODE) == O_WRONLY) {
+                errno = EBADF;
+                return -1;
+        }
+        if (S_ISDIR(node->mode)) {
+                errno = EISDIR;
+                return -1;
+        }
+        if (offset >= node->length) {
+                return 0;
+        }
+        if (count > node->length - offset) {
+                count = node->length - offset;
+        }
+        if (count > SSIZE_MAX) {
+                count = SSIZE_MAX;
+        }
+        memcpy(buf, node->data + offset, count);
+        return (ssize_t)count;
+}
+
+static ssize_t memfs_read(int fd, void *buf, size_t count)
+{
+        MemfsFile *file = NULL;
+        ssize_t ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        file = memfs_get_file(fd);
+        if (!file) {
+                errno = EBADF;
+        } else {
+                ret = memfs_read_at(file, buf, count, file->offset);
+                if (ret > 0) {
+                        file->offset += (size_t)ret;
+                }
+        }
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static ssize_t memfs_pread(int fd, void *buf, size_t count, off_t offset)
+{
+        MemfsFile *file = NULL;
+        ssize_t ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        file = memfs_get_file(fd);
+        if (!file) {
+                errno = EBADF;
+        } else if (offset < 0) {
+                errno = EINVAL;
+        } else {
+                ret = memfs_read_at(file, buf, count, (size_t)offset);
+        }
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static ssize_t memfs_write(int fd, const void *buf, size_t count)
+{
+        MemfsFile *file = NULL;
+        MemfsNode *node = NULL;
+        size_t end = 0;
+        ssize_t ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        file = memfs_get_file(fd);
+        if (!file || (file->flags & O_ACCMODE) == O_RDONLY) {
+                errno = EBADF;
+                goto end;
+        }
+        node = file->node;
+        if (file->flags & O_APPEND) {
+                file->offset = node->length;
+        }
+        if (count > SSIZE_MAX) {
+                count = SSIZE_MAX;
+        }
+        end = file->offset + count;
+        if (!memfs_node_reserve(node, end)) {
+                goto end;
+        }
+        /* Writing past the end leaves a hole, which reads back as zeroes */
+        if (file->offset > node->length) {
+                memset(node->data + node->length, 0, file->offset - node->length);
+        }
+        memcpy(node->data + file->offset, buf, count);
+        if (end > node->length) {
+                memfs.used += end - node->length;
+                node->length = end;
+        }
+        file->offset = end;
+        clock_gettime(CLOCK_REALTIME, &node->mtime);
+        ret = (ssize_t)count;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_fstat(int fd, struct stat *st)
+{
+        MemfsFile *file = NULL;
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        file = memfs_get_file(fd);
+        if (!file) {
+                errno = EBADF;
+        } else {
+                memfs_fill_stat(file->node, st);
+                ret = 0;
+        }
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_fsync(int fd)
+{
+        int ret = 0;
+
+        /* Nothing is ever more durable than it already is */
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_get_file(fd)) {
+                errno = EBADF;
+                ret = -1;
+        }
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+/**
+ * Every lock is exclusive, held by one descriptor at a time, which is all
+ * that threads of the one process sharing the filesystem can tell apart
+ */
+static int memfs_flock(int fd, int operation)
+{
+        MemfsFile *file = NULL;
+        int ret = 0;
+
+        pthread_mutex_lock(&memfs.lock);
+        file = memfs_get_file(fd);
+        if (!file) {
+                errno = EBADF;
+                ret = -1;
+        } else if ((operation & LOCK_UN) == LOCK_UN) {
+                if (file->node->locker == file) {
+                        file->node->locker = NULL;
+                        pthread_cond_broadcast(&memfs.unlocked);
+                }
+        } else {
+                while (file->node->locker && file->node->locker != file) {
+                        if ((operation & LOCK_NB) == LOCK_NB) {
+                                errno = EWOULDBLOCK;
+                                ret = -1;
+                                break;
+                        }
+                        pthread_cond_wait(&memfs.unlocked, &memfs.lock);
+                }
+                if (ret == 0) {
+                        file->node->locker = file;
+                }
+        }
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_stat_common(const char *path, struct stat *st, bool follow)
+{
+        MemfsLookup lookup = { 0 };
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, follow, &lookup)) {
+                goto end;
+        }
+        if (!lookup.node) {
+                errno = ENOENT;
+                goto end;
+        }
+        memfs_fill_stat(lookup.node, st);
+        ret = 0;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_stat(const char *path, struct stat *st)
+{
+        return memfs_stat_common(path, st, true);
+}
+
+static int memfs_lstat(const char *path, struct stat *st)
+{
+        return memfs_stat_common(path, st, false);
+}
+
+/**
+ * Whether @node is @dir or lies somewhere beneath it
+ */
+static bool memfs_is_within(const MemfsNode *node, const MemfsNode *dir)
+{
+        for (; node; node = node->parent) {
+                if (node == dir) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+static int memfs_rename(const char *oldpath, const char *newpath)
+{
+        MemfsLookup from = { 0 };
+        MemfsLookup to = { 0 };
+        MemfsNode *node = NULL;
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(oldpath, false, &from) || !memfs_lookup(newpath, false, &to)) {
+                goto end;
+        }
+        node = from.node;
+        if (!node) {
+                errno = ENOENT;
+                goto end;
+        }
+        if (!from.parent || !to.parent) {
+                errno = EBUSY;
+                goto end;
+        }
+        if (to.node == node) {
+                ret = 0;
+                goto end;
+        }
+        if (S_ISDIR(node->mode) && memfs_is_within(to.parent, node)) {
+                errno = EINVAL;
+                goto end;
+        }
+        if (to.node) {
+                if (S_ISDIR(node->mode) && !S_ISDIR(to.node->mode)) {
+                        errno = ENOTDIR;
+                        goto end;
+                }
+                if (!S_ISDIR(node->mode) && S_ISDIR(to.node->mode)) {
+                        errno = EISDIR;
+                        goto end;
+                }
+                if (S_ISDIR(to.node->mode) && nc_hashmap_size(to.node->children) > 0) {
+                        errno = ENOTEMPTY;
+                        goto end;
+                }
+                memfs_detach(to.node, true);
+        }
+
+        memfs_detach(node, false);
+        free(node->name);
+        node->name = strdup(to.name);
+        if (!node->name) {
+                DECLARE_OOM();
+                abort();
+        }
+        memfs_attach(to.parent, node);
+        ret = 0;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_unlink(const char *path)
+{
+        MemfsLookup lookup = { 0 };
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, false, &lookup)) {
+                goto end;
+        }
+        if (!lookup.node) {
+                errno = ENOENT;
+                goto end;
+        }
+        if (S_ISDIR(lookup.node->mode)) {
+                errno = EISDIR;
+                goto end;
+        }
+        memfs_detach(lookup.node, true);
+        ret = 0;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+/**
+ * Create a node for @path, unless something's already there
+ */
+static int memfs_create(const char *path, mode_t mode, const char *target)
+{
+        MemfsLookup lookup = { 0 };
+        MemfsNode *node = NULL;
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, false, &lookup)) {
+                goto end;
+        }
+        if (lookup.node || !lookup.parent) {
+                errno = EEXIST;
+                goto end;
+        }
+        node = memfs_node_new(lookup.name, mode);
+        if (target) {
+                node->data = strdup(target);
+                if (!node->data) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                node->length = strlen(target);
+                node->alloc = node->length + 1;
+        }
+        memfs_attach(lookup.parent, node);
+        ret = 0;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static int memfs_mkdir(const char *path, mode_t mode)
+{
+        return memfs_create(path, S_IFDIR | (mode & 07777), NULL);
+}
+
+static int memfs_symlink(const char *target, const char *path)
+{
+        return memfs_create(path, S_IFLNK | 00777, target);
+}
+
+static int memfs_rmdir(const char *path)
+{
+        MemfsLookup lookup = { 0 };
+        int ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, false, &lookup)) {
+                goto end;
+        }
+        if (!lookup.node) {
+                errno = ENOENT;
+                goto end;
+        }
+        if (!S_ISDIR(lookup.node->mode)) {
+                errno = ENOTDIR;
+                goto end;
+        }
+        if (!lookup.parent) {
+                errno = EBUSY;
+                goto end;
+        }
+        if (nc_hashmap_size(lookup.node->children) > 0) {
+                errno = ENOTEMPTY;
+                goto end;
+        }
+        memfs_detach(lookup.node, true);
+        ret = 0;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static ssize_t memfs_readlink(const char *path, char *buf, size_t size)
+{
+        MemfsLookup lookup = { 0 };
+        size_t len = 0;
+        ssize_t ret = -1;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, false, &lookup)) {
+                goto end;
+        }
+        if (!lookup.node) {
+                errno = ENOENT;
+                goto end;
+        }
+        if (!S_ISLNK(lookup.node->mode)) {
+                errno = EINVAL;
+                goto end;
+        }
+        /* Truncated silently and never terminated, like readlink() */
+        len = lookup.node->length < size ? lookup.node->length : size;
+        memcpy(buf, lookup.node->data, len);
+        ret = (ssize_t)len;
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return ret;
+}
+
+static void *memfs_opendir(const char *path)
+{
+        MemfsLookup lookup = { 0 };
+        MemfsDir *dir = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *name = NULL;
+        size_t i = 0;
+
+        pthread_mutex_lock(&memfs.lock);
+        if (!memfs_lookup(path, true, &lookup)) {
+                goto end;
+        }
+        if (!lookup.node) {
+                errno = ENOENT;
+                goto end;
+        }
+        if (!S_ISDIR(lookup.node->mode)) {
+                errno = ENOTDIR;
+                goto end;
+        }
+
+        dir = calloc(1, sizeof(MemfsDir));
+        if (!dir) {
+                DECLARE_OOM();
+                abort();
+        }
+        dir->n_names = (size_t)nc_hashmap_size(lookup.node->children) + 2;
+        dir->names = calloc(dir->n_names, sizeof(char *));
+        if (!dir->names) {
+                DECLARE_OOM();
+                abort();
+        }
+        dir->names[i++] = strdup(".");
+        dir->names[i++] = strdup("..");
+        nc_hashmap_iter_init(lookup.node->children, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&name, NULL)) {
+                dir->names[i++] = strdup(name);
+        }
+        for (i = 0; i < dir->n_names; i++) {
+                if (!dir->names[i]) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+end:
+        pthread_mutex_unlock(&memfs.lock);
+        return dir;
+}
+
+static const char *memfs_readdir(void *v)
+{
+        MemfsDir *dir = v;
+
+        if (dir->next >= dir->n_names) {
+                return NULL;
+        }
+        return dir->names[dir->next++];
+}
+
+static int memfs_closedir(void *v)
+{
+        MemfsDir *dir = v;
+
+        for (size_t i = 0; i < dir->n_names; i++) {
+                free(dir->names[i]);
+        }
+        free(dir->names);
+        free(dir);
+        return 0;
+}
+
+static int memfs_statvfs(const char *path, struct statvfs *buf)
+{
+        struct stat st = { 0 };
+        uint64_t used = 0;
+
+        if (memfs_stat(path, &st) != 0) {
+                return -1;
+        }
+
+        pthread_mutex_lock(&memfs.lock);
+        used = (memfs.used + MEMFS_BLOCK_SIZE - 1) / MEMFS_BLOCK_SIZE;
+        memset(buf, 0, sizeof(struct statvfs));
+        buf->f_bsize = MEMFS_BLOCK_SIZE;
+        buf->f_frsize = MEMFS_BLOCK_SIZE;
+        buf->f_blocks = (fsblkcnt_t)(memfs.capacity / MEMFS_BLOCK_SIZE);
+        buf->f_bfree = buf->f_blocks > used ? buf->f_blocks - (fsblkcnt_t)used : 0;
+        buf->f_bavail = buf->f_bfree;
+        buf->f_files = (fsfilcnt_t)memfs.next_ino;
+        buf->f_namemax = NAME_MAX;
+        pthread_mutex_unlock(&memfs.lock);
+        return 0;
+}
+
+void cbm_memfs_fill_ops(CbmSystemOps *ops)
+{
+        ops->statvfs = memfs_statvfs;
+        ops->open = memfs_open;
+        ops->close = memfs_close;
+        ops->read = memfs_read;
+        ops->pread = memfs_pread;
+        ops->write = memfs_write;
+        ops->fstat = memfs_fstat;
+        ops->fsync = memfs_fsync;
+        ops->flock = memfs_flock;
+        ops->stat = memfs_stat;
+        ops->lstat = memfs_lstat;
+        ops->rename = memfs_rename;
+        ops->unlink = memfs_unlink;
+        ops->mkdir = memfs_mkdir;
+        ops->rmdir = memfs_rmdir;
+        ops->readlink = memfs_readlink;
+        ops->symlink = memfs_symlink;
+        ops->opendir = memfs_opendir;
+        ops->readdir = memfs_readdir;
+        ops->closedir = memfs_closedir;
+}
+
+void cbm_memfs_set_capacity(uint64_t bytes)
+{
+        pthread_mutex_lock(&memfs.lock);
+        memfs.capacity = bytes;
+        pthread_mutex_unlock(&memfs.lock);
+}
+
+void cbm_memfs_reset(void)
+{
+        pthread_mutex_lock(&memfs.lock);
+        for (size_t i = 0; i < memfs.n_files; i++) {
+                MemfsFile *file = memfs.files[i];
+
+                if (!file) {
+                        continue;
+                }
+                /* Removed files live on through their descriptors alone */
+                if (--file->node->opened == 0 && !file->node->parent &&
+                    file->node != memfs.root) {
+                        memfs_node_free(file->node);
+                }
+                free(file);
+        }
+        free(memfs.files);
+        memfs.files = NULL;
+        memfs.n_files = 0;
+        if (memfs.root) {
+                memfs_node_free(memfs.root);
+                memfs.root = NULL;
+        }
+        memfs.next_ino = 0;
+        memfs.used = 0;
+        memfs.capacity = CBM_MEMFS_DEFAULT_CAPACITY;
+        pthread_mutex_unlock(&memfs.lock);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
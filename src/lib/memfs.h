@@ -0,0 +1,59 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "system_stub.h"
+
+/**
+ * Capacity the in-memory filesystem reports until told otherwise
+ */
+#define CBM_MEMFS_DEFAULT_CAPACITY (4ULL * 1024 * 1024 * 1024)
+
+/**
+ * Fill in the file functions of @ops, along with statvfs, with those of an
+ * in-memory filesystem. Everything else in @ops is left alone, so that it
+ * can be installed over any other vtable with cbm_system_set_vtable.
+ *
+ * The filesystem starts out holding nothing but an empty root directory, and
+ * persists until cbm_memfs_reset(), whichever vtable is active. Relative
+ * paths are taken from the root. Nothing ever touches the disk, so that
+ * simulating updates of thousands of kernels and entries costs no more than
+ * the memory their contents take.
+ */
+void cbm_memfs_fill_ops(CbmSystemOps *ops);
+
+/**
+ * Limit the size of all file contents together, beyond which writes fail
+ * with ENOSPC, i.e. to simulate a small ESP
+ */
+void cbm_memfs_set_capacity(uint64_t bytes);
+
+/**
+ * Throw away every file in the in-memory filesystem, along with anything
+ * still open within it, and restore the default capacity
+ */
+void cbm_memfs_reset(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
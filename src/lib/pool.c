@@ -0,0 +1,108 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "pool.h"
+
+/**
+ * Shared state between all workers of a single cbm_pool_run
+ */
+typedef struct CbmPool {
+        pthread_mutex_t lock; /**<Guards next */
+        NcArray *items;       /**<Work items */
+        uint16_t next;        /**<Index of the next unclaimed item */
+        cbm_pool_func func;   /**<Work function */
+        void *userdata;       /**<Passed to func */
+} CbmPool;
+
+static void *cbm_pool_worker(void *v)
+{
+        CbmPool *pool = v;
+
+        for (;;) {
+                void *item = NULL;
+
+                pthread_mutex_lock(&pool->lock);
+                if (pool->next < pool->items->len) {
+                        item = nc_array_get(pool->items, pool->next);
+                        ++pool->next;
+                }
+                pthread_mutex_unlock(&pool->lock);
+
+                if (!item) {
+                        break;
+                }
+                pool->func(item, pool->userdata);
+        }
+
+        return NULL;
+}
+
+void cbm_pool_run(NcArray *items, unsigned int jobs, cbm_pool_func func, void *userdata)
+{
+        CbmPool pool = {.items = items, .next = 0, .func = func, .userdata = userdata };
+        pthread_t *threads = NULL;
+        unsigned int n_threads = 0;
+
+        if (!items || !func || items->len == 0) {
+                return;
+        }
+
+        /* No sense in having idle workers */
+        if (jobs > items->len) {
+                jobs = items->len;
+        }
+
+        pthread_mutex_init(&pool.lock, NULL);
+
+        if (jobs > 1) {
+                threads = calloc(jobs - 1, sizeof(pthread_t));
+        }
+        if (threads) {
+                for (unsigned int i = 0; i < jobs - 1; i++) {
+                        int r = pthread_create(&threads[i], NULL, cbm_pool_worker, &pool);
+                        if (r != 0) {
+                                LOG_WARNING("Unable to start worker thread: %s", strerror(r));
+                                break;
+                        }
+                        ++n_threads;
+                }
+        }
+
+        /* We're a worker too, so this always completes */
+        cbm_pool_worker(&pool);
+
+        for (unsigned int i = 0; i < n_threads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        free(threads);
+        pthread_mutex_destroy(&pool.lock);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
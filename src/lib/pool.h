@@ -0,0 +1,47 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include "nica/array.h"
+
+/**
+ * Process a single work item. Any result must be stored within the item
+ * itself, as items are processed in no particular order.
+ */
+typedef void (*cbm_pool_func)(void *item, void *userdata);
+
+/**
+ * Run @func over every item in @items using at most @jobs threads, and
+ * return once every item has been processed.
+ *
+ * The calling thread participates in the work, so a @jobs value of 1 (or
+ * a failure to spawn any threads) simply runs everything serially, in order.
+ *
+ * @param items Work items, owned by the caller
+ * @param jobs Maximum number of concurrent workers
+ * @param func Function to apply to each item
+ * @param userdata Passed to every invocation of @func
+ */
+void cbm_pool_run(NcArray *items, unsigned int jobs, cbm_pool_func func, void *userdata);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -25,8 +25,10 @@
 #include "blkid_stub.h"
 #include "files.h"
 #include "log.h"
+#include "nica/files.h"
 #include "probe.h"
 #include "system_stub.h"
+#include "trace.h"
 #include "util.h"
 
 /**
@@ -187,32 +189,126 @@ clean:
         return ret;
 }
 
-CbmDeviceProbe *cbm_probe_path(const char *path)
+/**
+ * Location of the cached probes, relative to the runtime directory. This is
+ * a tmpfs, so they never outlive the boot.
+ */
+#define CBM_PROBE_CACHE_DIR "clr-boot-manager/probe"
+
+/**
+ * Bump whenever the record layout changes
+ */
+#define CBM_PROBE_CACHE_MAGIC "clr-boot-manager-probe 1"
+
+static char *cbm_probe_cache_path(dev_t dev)
 {
-        CbmDeviceProbe probe = { 0 };
-        CbmDeviceProbe *ret = NULL;
-        autofree(char) *devnode = NULL;
-        struct stat st = { 0 };
-        blkid_probe blk_probe = NULL;
-        const char *value = NULL;
-        char *basenom = NULL;
+        return string_printf("%s/%s/%u:%u",
+                             cbm_system_get_runtime_path(),
+                             CBM_PROBE_CACHE_DIR,
+                             major(dev),
+                             minor(dev));
+}
 
-        if (stat(path, &st) != 0) {
-                LOG_ERROR("Path does not exist: %s", path);
+static char *cbm_probe_cache_field(const char *field)
+{
+        char *ret = NULL;
+
+        if (!field || field[0] == '\0') {
                 return NULL;
         }
-        probe.dev = st.st_dev;
-
-        devnode = cbm_system_devnode_to_devpath(probe.dev);
-        if (!devnode) {
+        ret = strdup(field);
+        if (!ret) {
                 DECLARE_OOM();
-                return NULL;
+                abort();
+        }
+        return ret;
+}
+
+/**
+ * Load a previous probe of the same device. Rereading the partition table
+ * recreates the partition's device node, so the identity of the node acts
+ * as the generation of the table it came from.
+ */
+static bool cbm_probe_cache_load(const char *cache_path, const CbmFileKey *generation,
+                                 CbmDeviceProbe *probe)
+{
+        autofree(char) *text = NULL;
+        CbmFileKey key = { 0 };
+        char *cursor = NULL;
+        char *fields[5] = { NULL };
+
+        if (!file_get_text(cache_path, &text)) {
+                return false;
+        }
+
+        /* magic \n generation \n gpt \t uuid \t part_uuid \t luks_uuid \n */
+        cursor = text;
+        fields[0] = strsep(&cursor, "\n");
+        fields[1] = strsep(&cursor, "\n");
+        if (!cursor || !streq(fields[0], CBM_PROBE_CACHE_MAGIC) ||
+            !cbm_file_key_parse(&key, fields[1]) || !cbm_file_key_equal(&key, generation)) {
+                return false;
+        }
+        cursor[strcspn(cursor, "\n")] = '\0';
+        for (size_t i = 0; i < 4; i++) {
+                fields[i] = strsep(&cursor, "\t");
+                if (!fields[i]) {
+                        return false;
+                }
+        }
+
+        probe->gpt = streq(fields[0], "1");
+        probe->uuid = cbm_probe_cache_field(fields[1]);
+        probe->part_uuid = cbm_probe_cache_field(fields[2]);
+        probe->luks_uuid = cbm_probe_cache_field(fields[3]);
+        return true;
+}
+
+/**
+ * Remember the probe for the next run. Failure only costs a probe later on.
+ */
+static void cbm_probe_cache_store(const char *cache_path, const CbmFileKey *generation,
+                                  const CbmDeviceProbe *probe)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *tmp_path = NULL;
+        autofree(char) *text = NULL;
+
+        dir = string_printf("%s/%s", cbm_system_get_runtime_path(), CBM_PROBE_CACHE_DIR);
+        if (!nc_file_exists(dir) && !nc_mkdir_p(dir, 00755)) {
+                LOG_DEBUG("Cannot create probe cache %s: %s", dir, strerror(errno));
+                return;
         }
 
+        text = string_printf("%s\n" CBM_FILE_KEY_FORMAT "\n%d\t%s\t%s\t%s\n",
+                             CBM_PROBE_CACHE_MAGIC,
+                             CBM_FILE_KEY_ARGS(generation),
+                             probe->gpt ? 1 : 0,
+                             probe->uuid ? probe->uuid : "",
+                             probe->part_uuid ? probe->part_uuid : "",
+                             probe->luks_uuid ? probe->luks_uuid : "");
+
+        tmp_path = string_printf("%s.TmpWrite", cache_path);
+        if (!file_set_text(tmp_path, text) || rename(tmp_path, cache_path) != 0) {
+                LOG_DEBUG("Cannot write probe cache %s: %s", cache_path, strerror(errno));
+                (void)unlink(tmp_path);
+        }
+}
+
+/**
+ * Probe @devnode (backing @path) with blkid
+ */
+static bool cbm_probe_device(const char *path, char *devnode, CbmDeviceProbe *probe)
+{
+        blkid_probe blk_probe = NULL;
+        const char *value = NULL;
+        char *basenom = NULL;
+        bool ret = false;
+
         blk_probe = cbm_blkid_new_probe_from_filename(devnode);
         if (!blk_probe) {
-                fprintf(stderr, "Unable to probe %u:%u", major(st.st_dev), minor(st.st_dev));
-                return NULL;
+                fprintf(stderr, "Unable to probe %u:%u", major(probe->dev), minor(probe->dev));
+                return false;
         }
 
         cbm_blkid_probe_enable_superblocks(blk_probe, 1);
@@ -226,30 +322,37 @@ CbmDeviceProbe *cbm_probe_path(const char *path)
         }
 
         if (cbm_blkid_probe_lookup_value(blk_probe, "PART_ENTRY_UUID", &value, NULL) == 0) {
-                probe.part_uuid = strdup(value);
-                if (!probe.part_uuid) {
+                probe->part_uuid = strdup(value);
+                if (!probe->part_uuid) {
                         DECLARE_OOM();
                         goto clean;
                 }
         }
 
         if (cbm_blkid_probe_lookup_value(blk_probe, "UUID", &value, NULL) == 0) {
-                probe.uuid = strdup(value);
-                if (!probe.uuid) {
+                probe->uuid = strdup(value);
+                if (!probe->uuid) {
                         DECLARE_OOM();
                         goto clean;
                 }
         }
 
+        /* The partition entry already names the table it came from, only
+         * probe the whole disk when blkid didn't tell us. */
+        if (cbm_blkid_probe_lookup_value(blk_probe, "PART_ENTRY_SCHEME", &value, NULL) == 0) {
+                probe->gpt = streq(value, "gpt");
+        } else {
+                probe->gpt = cbm_probe_is_gpt(path);
+        }
+
         /* If the device isn't GPT, clear out the the PartUUID */
-        probe.gpt = cbm_probe_is_gpt(path);
-        if (!probe.gpt && probe.part_uuid) {
-                free(probe.part_uuid);
-                probe.part_uuid = NULL;
+        if (!probe->gpt && probe->part_uuid) {
+                free(probe->part_uuid);
+                probe->part_uuid = NULL;
         }
 
         /* Now check we have at least one UUID value */
-        if (!probe.part_uuid && !probe.uuid) {
+        if (!probe->part_uuid && !probe->uuid) {
                 LOG_ERROR("Unable to find UUID for %s: %s", devnode, strerror(errno));
         }
 
@@ -257,7 +360,57 @@ CbmDeviceProbe *cbm_probe_path(const char *path)
         basenom = basename(devnode);
         if (strncmp(basenom, "dm-", 3) == 0) {
                 LOG_DEBUG("Root device exists on device-mapper configuration");
-                probe.luks_uuid = cbm_get_luks_uuid(basenom);
+                probe->luks_uuid = cbm_get_luks_uuid(basenom);
+        }
+
+        ret = true;
+
+clean:
+        cbm_blkid_free_probe(blk_probe);
+        return ret;
+}
+
+CbmDeviceProbe *cbm_probe_path(const char *path)
+{
+        CbmDeviceProbe probe = { 0 };
+        CbmDeviceProbe *ret = NULL;
+        autofree(char) *devnode = NULL;
+        autofree(char) *cache_path = NULL;
+        CbmFileKey generation = { 0 };
+        bool cacheable = false;
+        struct stat st = { 0 };
+        CBM_TRACE_SCOPE("probe_path");
+
+        if (stat(path, &st) != 0) {
+                LOG_ERROR("Path does not exist: %s", path);
+                return NULL;
+        }
+        probe.dev = st.st_dev;
+
+        devnode = cbm_system_devnode_to_devpath(probe.dev);
+        if (!devnode) {
+                DECLARE_OOM();
+                return NULL;
+        }
+
+        /* Without a device node there's nothing to validate a cache against */
+        cacheable = cbm_file_key_for_path(&generation, devnode);
+        if (cacheable) {
+                cache_path = cbm_probe_cache_path(probe.dev);
+        }
+
+        if (cacheable && cbm_probe_cache_load(cache_path, &generation, &probe)) {
+                LOG_DEBUG("Using cached probe of %s", devnode);
+        } else {
+                if (!cbm_probe_device(path, devnode, &probe)) {
+                        free(probe.uuid);
+                        free(probe.part_uuid);
+                        free(probe.luks_uuid);
+                        return NULL;
+                }
+                if (cacheable && (probe.uuid || probe.part_uuid)) {
+                        cbm_probe_cache_store(cache_path, &generation, &probe);
+                }
         }
 
         ret = calloc(1, sizeof(CbmDeviceProbe));
@@ -267,8 +420,6 @@ CbmDeviceProbe *cbm_probe_path(const char *path)
         }
         *ret = probe;
 
-clean:
-        cbm_blkid_free_probe(blk_probe);
         return ret;
 }
 
@@ -0,0 +1,84 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Length of a raw SHA-256 digest
+ */
+#define CBM_SHA256_SIZE 32
+
+/**
+ * Length of a hex encoded SHA-256 digest, including the terminator
+ */
+#define CBM_SHA256_HEX_SIZE ((CBM_SHA256_SIZE * 2) + 1)
+
+/**
+ * Incremental SHA-256 state. Treat as opaque.
+ */
+typedef struct CbmSha256 {
+        uint32_t state[8];  /**<Intermediate hash value */
+        uint64_t length;    /**<Total number of bytes hashed */
+        uint8_t block[64];  /**<Pending partial block */
+        size_t block_len;   /**<Bytes used within block */
+} CbmSha256;
+
+/**
+ * Prepare @ctx for a new digest
+ */
+void cbm_sha256_init(CbmSha256 *ctx);
+
+/**
+ * Feed @len bytes of @data into the digest
+ */
+void cbm_sha256_update(CbmSha256 *ctx, const void *data, size_t len);
+
+/**
+ * Complete the digest, storing it in @digest. @ctx must be reinitialised
+ * before it is used again.
+ */
+void cbm_sha256_final(CbmSha256 *ctx, uint8_t digest[CBM_SHA256_SIZE]);
+
+/**
+ * Feed the entire contents of @path into the digest
+ *
+ * @return True if the file could be read in full
+ */
+bool cbm_sha256_update_file(CbmSha256 *ctx, const char *path);
+
+/**
+ * Compute the digest for the entire contents of @path
+ *
+ * @return True if the file could be read in full
+ */
+bool cbm_sha256_file(const char *path, uint8_t digest[CBM_SHA256_SIZE]);
+
+/**
+ * Hex encode @digest into @out
+ */
+void cbm_sha256_to_hex(const uint8_t digest[CBM_SHA256_SIZE], char out[CBM_SHA256_HEX_SIZE]);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
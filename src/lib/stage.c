@@ -0,0 +1,325 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "files.h"
+#include "log.h"
+#include "nica/array.h"
+#include "stage.h"
+#include "system_stub.h"
+#include "util.h"
+
+/**
+ * A file whose new contents are waiting in the staging directory
+ */
+typedef struct CbmStagedFile {
+        char *target; /**<Where the file goes once committed */
+        char *staged; /**<Where it's written meanwhile */
+} CbmStagedFile;
+
+/**
+ * Staging of a single root, guarded by lock as the parallel installs of an
+ * update may write through it at once
+ */
+struct CbmStage {
+        pthread_mutex_t lock;
+        char *root;     /**<Only files beneath this are staged */
+        char *dir;      /**<The staging directory */
+        bool created;   /**<Whether dir has been created yet */
+        NcArray *files; /**<CbmStagedFile, in the order they were staged */
+};
+
+static void cbm_staged_file_free(void *v)
+{
+        CbmStagedFile *file = v;
+
+        if (!file) {
+                return;
+        }
+        free(file->target);
+        free(file->staged);
+        free(file);
+}
+
+/**
+ * Remove everything in @dir and then @dir itself. The staging directory is
+ * flat, only ever holding the staged files.
+ */
+static void cbm_stage_purge(const char *dir)
+{
+        void *d = NULL;
+        const char *entry = NULL;
+
+        d = cbm_system_opendir(dir);
+        if (!d) {
+                return;
+        }
+        while ((entry = cbm_system_readdir(d)) != NULL) {
+                autofree(char) *path = NULL;
+
+                if (streq(entry, ".") || streq(entry, "..")) {
+                        continue;
+                }
+                path = string_printf("%s/%s", dir, entry);
+                if (cbm_system_unlink(path) != 0 && errno != ENOENT) {
+                        LOG_WARNING("Failed to remove staged %s: %s", path, strerror(errno));
+                }
+        }
+        cbm_system_closedir(d);
+
+        if (cbm_system_rmdir(dir) != 0 && errno != ENOENT) {
+                LOG_WARNING("Failed to remove %s: %s", dir, strerror(errno));
+        }
+}
+
+CbmStage *cbm_stage_new(void)
+{
+        CbmStage *self = NULL;
+
+        self = calloc(1, sizeof(struct CbmStage));
+        if (!self) {
+                return NULL;
+        }
+        pthread_mutex_init(&self->lock, NULL);
+        return self;
+}
+
+void cbm_stage_free(CbmStage *self)
+{
+        if (!self) {
+                return;
+        }
+        cbm_stage_discard(self);
+        pthread_mutex_destroy(&self->lock);
+        free(self);
+}
+
+/**
+ * Take over the staging state, leaving none active
+ */
+static void cbm_stage_take(CbmStage *self, char **root, char **dir, NcArray **files)
+{
+        pthread_mutex_lock(&self->lock);
+        *root = self->root;
+        *dir = self->dir;
+        *files = self->files;
+        self->root = NULL;
+        self->dir = NULL;
+        self->files = NULL;
+        self->created = false;
+        pthread_mutex_unlock(&self->lock);
+}
+
+void cbm_stage_begin(CbmStage *self, const char *root)
+{
+        /* Never two at once, anything still staged is abandoned */
+        cbm_stage_discard(self);
+
+        pthread_mutex_lock(&self->lock);
+        self->root = strdup(root);
+        self->dir = string_printf("%s/%s", root, CBM_STAGE_DIR);
+        self->files = nc_array_new();
+        if (!self->root || !self->files) {
+                DECLARE_OOM();
+                abort();
+        }
+        /* Leftovers of an interrupted update never made it into place */
+        if (cbm_file_exists(self->dir)) {
+                LOG_INFO("Discarding incomplete staged configuration in %s", self->dir);
+                cbm_stage_purge(self->dir);
+        }
+        pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Find the staged file for @path, with the lock held
+ */
+static CbmStagedFile *cbm_stage_find(CbmStage *self, const char *path)
+{
+        for (uint16_t i = 0; self->files && i < self->files->len; i++) {
+                CbmStagedFile *file = nc_array_get(self->files, i);
+
+                if (streq(file->target, path)) {
+                        return file;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Whether @path lies beneath the staging root, with the lock held
+ */
+static bool cbm_stage_covers(CbmStage *self, const char *path)
+{
+        size_t len = 0;
+
+        if (!self->root || !path) {
+                return false;
+        }
+        len = strlen(self->root);
+        return strncmp(path, self->root, len) == 0 && path[len] == '/';
+}
+
+char *cbm_stage_path(CbmStage *self, const char *path)
+{
+        CbmStagedFile *file = NULL;
+        const char *name = NULL;
+        char *ret = NULL;
+
+        if (!self) {
+                return NULL;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        if (!cbm_stage_covers(self, path)) {
+                goto done;
+        }
+
+        file = cbm_stage_find(self, path);
+        if (file) {
+                ret = strdup(file->staged);
+                goto done;
+        }
+
+        if (!self->created) {
+                if (!cbm_mkdir_p(self->dir, 00755)) {
+                        LOG_WARNING("Cannot stage in %s, writing in place: %s",
+                                    self->dir,
+                                    strerror(errno));
+                        goto done;
+                }
+                self->created = true;
+        }
+
+        /* Numbered, as files of different directories may share a name */
+        name = strrchr(path, '/') + 1;
+        file = calloc(1, sizeof(CbmStagedFile));
+        if (!file) {
+                DECLARE_OOM();
+                abort();
+        }
+        file->target = strdup(path);
+        file->staged = string_printf("%s/%u-%s", self->dir, self->files->len, name);
+        if (!file->target || !nc_array_add(self->files, file)) {
+                DECLARE_OOM();
+                abort();
+        }
+        ret = strdup(file->staged);
+
+done:
+        pthread_mutex_unlock(&self->lock);
+        return ret;
+}
+
+char *cbm_stage_resolve(CbmStage *self, const char *path)
+{
+        CbmStagedFile *file = NULL;
+        char *ret = NULL;
+
+        if (!self) {
+                return NULL;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        file = cbm_stage_find(self, path);
+        if (file) {
+                ret = strdup(file->staged);
+        }
+        pthread_mutex_unlock(&self->lock);
+        return ret;
+}
+
+bool cbm_stage_commit(CbmStage *self)
+{
+        autofree(char) *root = NULL;
+        autofree(char) *dir = NULL;
+        NcArray *files = NULL;
+        bool ret = true;
+
+        if (!self) {
+                return true;
+        }
+
+        cbm_stage_take(self, &root, &dir, &files);
+        if (!files) {
+                return true;
+        }
+        if (files->len == 0) {
+                goto done;
+        }
+
+        /* One barrier for the complete new set, before any of it is live */
+        if (!cbm_sync_filesystem(dir)) {
+                LOG_ERROR("Failed to flush the staged configuration in %s", dir);
+                ret = false;
+                goto done;
+        }
+
+        /* Entries go first, the configuration pointing at them last */
+        for (uint16_t i = 0; i < files->len; i++) {
+                CbmStagedFile *file = nc_array_get(files, i);
+
+                if (cbm_system_rename(file->staged, file->target) != 0) {
+                        LOG_ERROR("Failed to move %s into place: %s",
+                                  file->target,
+                                  strerror(errno));
+                        ret = false;
+                        goto done;
+                }
+                cbm_sync_path(file->target);
+        }
+
+done:
+        /* Anything not moved into place is an incomplete set */
+        cbm_stage_purge(dir);
+        nc_array_free(&files, cbm_staged_file_free);
+        return ret;
+}
+
+void cbm_stage_discard(CbmStage *self)
+{
+        autofree(char) *root = NULL;
+        autofree(char) *dir = NULL;
+        NcArray *files = NULL;
+
+        if (!self) {
+                return;
+        }
+
+        cbm_stage_take(self, &root, &dir, &files);
+        if (!files) {
+                return;
+        }
+        if (files->len > 0) {
+                cbm_stage_purge(dir);
+        }
+        nc_array_free(&files, cbm_staged_file_free);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,99 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "util.h"
+
+/**
+ * Name of the staging directory, relative to the root being staged
+ */
+#define CBM_STAGE_DIR ".clr-boot-manager-staging"
+
+/**
+ * Staging of the configuration written beneath one root. Each BootManager
+ * keeps its own, so updates of separate roots may run at once.
+ */
+typedef struct CbmStage CbmStage;
+
+/**
+ * Allocate a stage, with nothing being staged yet
+ */
+CbmStage *cbm_stage_new(void);
+
+/**
+ * Discard anything still staged and free @stage
+ */
+void cbm_stage_free(CbmStage *stage);
+
+/**
+ * Begin staging the files written with file_set_text_staged beneath @root,
+ * which is typically the boot directory.
+ *
+ * Rather than replacing each loader entry or configuration file in place,
+ * followed by its own barrier, the new contents are written to a staging
+ * directory at the top of @root. As that's on the same filesystem, the
+ * complete set is flushed once and then switched over with one rename per
+ * file by cbm_stage_commit(). Until then everything in place is untouched,
+ * so an interrupted update leaves the previous configuration intact.
+ *
+ * Anything left behind in the staging directory by an interrupted update
+ * is discarded.
+ */
+void cbm_stage_begin(CbmStage *stage, const char *root);
+
+/**
+ * Flush everything staged and move it into place, in the order it was first
+ * staged. Safe to call when not staging.
+ *
+ * @return True if every staged file is now in place
+ */
+bool cbm_stage_commit(CbmStage *stage);
+
+/**
+ * Stop staging, throwing away anything staged, i.e. after a failed update
+ */
+void cbm_stage_discard(CbmStage *stage);
+
+/**
+ * Find where new contents for @path should be written
+ *
+ * @return a newly allocated path within the staging directory, or NULL if
+ * @path isn't being staged and must be written in place, as is everything
+ * when @stage is NULL
+ */
+char *cbm_stage_path(CbmStage *stage, const char *path);
+
+/**
+ * Find the staged contents of @path, so that staged files read back as
+ * what they will become
+ *
+ * @return a newly allocated path within the staging directory, or NULL if
+ * nothing has been staged for @path
+ */
+char *cbm_stage_resolve(CbmStage *stage, const char *path);
+
+DEF_AUTOFREE(CbmStage, cbm_stage_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,204 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "util.h"
+
+static const char *cbm_stat_names[CBM_STAT_MAX] = {
+        [CBM_STAT_BYTES_COMPARED] = "bytes_compared",
+        [CBM_STAT_BYTES_COPIED] = "bytes_copied",
+        [CBM_STAT_SYNCS] = "syncs",
+        [CBM_STAT_FILES_CREATED] = "files_created",
+        [CBM_STAT_FILES_UNLINKED] = "files_unlinked",
+        [CBM_STAT_EXISTS_PROBES] = "exists_probes",
+        [CBM_STAT_COMMANDS] = "commands",
+        [CBM_STAT_KERNELS_INSPECTED] = "kernels_inspected",
+        [CBM_STAT_KERNELS_INSTALLED] = "kernels_installed",
+        [CBM_STAT_KERNELS_SKIPPED] = "kernels_skipped",
+        [CBM_STAT_KERNELS_REMOVED] = "kernels_removed",
+        [CBM_STAT_RING_SUBMITS] = "ring_submits",
+};
+
+/**
+ * Digest of one file installed to the boot directory
+ */
+typedef struct CbmMeasurement {
+        char *path;
+        char digest[CBM_SHA256_HEX_SIZE];
+} CbmMeasurement;
+
+/**
+ * Counters are bumped from the install pool, so guard them
+ */
+static struct {
+        pthread_mutex_t lock;
+        uint64_t values[CBM_STAT_MAX];
+        CbmMeasurement *measurements;
+        size_t n_measurements;
+        size_t max_measurements;
+} cbm_stats_state = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+void cbm_stats_add(CbmStat stat, uint64_t n)
+{
+        if (stat >= CBM_STAT_MAX) {
+                return;
+        }
+        pthread_mutex_lock(&cbm_stats_state.lock);
+        cbm_stats_state.values[stat] += n;
+        pthread_mutex_unlock(&cbm_stats_state.lock);
+}
+
+uint64_t cbm_stats_get(CbmStat stat)
+{
+        uint64_t ret = 0;
+
+        if (stat >= CBM_STAT_MAX) {
+                return 0;
+        }
+        pthread_mutex_lock(&cbm_stats_state.lock);
+        ret = cbm_stats_state.values[stat];
+        pthread_mutex_unlock(&cbm_stats_state.lock);
+        return ret;
+}
+
+const char *cbm_stats_name(CbmStat stat)
+{
+        if (stat >= CBM_STAT_MAX) {
+                return NULL;
+        }
+        return cbm_stat_names[stat];
+}
+
+void cbm_stats_measure(const char *path, const char digest[CBM_SHA256_HEX_SIZE])
+{
+        CbmMeasurement *m = NULL;
+
+        if (!path || !digest) {
+                return;
+        }
+
+        pthread_mutex_lock(&cbm_stats_state.lock);
+        if (cbm_stats_state.n_measurements == cbm_stats_state.max_measurements) {
+                size_t max = cbm_stats_state.max_measurements ? cbm_stats_state.max_measurements * 2
+                                                              : 8;
+                m = realloc(cbm_stats_state.measurements, max * sizeof(CbmMeasurement));
+                if (!m) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                cbm_stats_state.measurements = m;
+                cbm_stats_state.max_measurements = max;
+        }
+        m = &cbm_stats_state.measurements[cbm_stats_state.n_measurements];
+        m->path = strdup(path);
+        if (!m->path) {
+                DECLARE_OOM();
+                abort();
+        }
+        memcpy(m->digest, digest, CBM_SHA256_HEX_SIZE);
+        m->digest[CBM_SHA256_HEX_SIZE - 1] = '\0';
+        ++cbm_stats_state.n_measurements;
+        pthread_mutex_unlock(&cbm_stats_state.lock);
+}
+
+void cbm_stats_reset(void)
+{
+        pthread_mutex_lock(&cbm_stats_state.lock);
+        memset(cbm_stats_state.values, 0, sizeof(cbm_stats_state.values));
+        for (size_t i = 0; i < cbm_stats_state.n_measurements; i++) {
+                free(cbm_stats_state.measurements[i].path);
+        }
+        cbm_stats_state.n_measurements = 0;
+        pthread_mutex_unlock(&cbm_stats_state.lock);
+}
+
+/**
+ * Append the measurements, still holding the lock
+ */
+static void cbm_stats_write_measurements(CbmWriter *writer, bool json)
+{
+        if (json) {
+                cbm_writer_append(writer, ",\"measurements\":{");
+        }
+        for (size_t i = 0; i < cbm_stats_state.n_measurements; i++) {
+                const CbmMeasurement *m = &cbm_stats_state.measurements[i];
+
+                if (json) {
+                        if (i > 0) {
+                                cbm_writer_append(writer, ",");
+                        }
+                        cbm_writer_append_json_string(writer, m->path);
+                        cbm_writer_append_printf(writer, ":\"%s\"", m->digest);
+                } else {
+                        cbm_writer_append_printf(writer, "%-20s %s %s\n", "measurement", m->digest,
+                                                 m->path);
+                }
+        }
+        if (json) {
+                cbm_writer_append(writer, "}");
+        }
+}
+
+void cbm_stats_write(CbmWriter *writer, bool json)
+{
+        uint64_t values[CBM_STAT_MAX];
+
+        /* Consistent snapshot, then format without the lock */
+        pthread_mutex_lock(&cbm_stats_state.lock);
+        memcpy(values, cbm_stats_state.values, sizeof(values));
+        pthread_mutex_unlock(&cbm_stats_state.lock);
+
+        if (json) {
+                cbm_writer_append(writer, "{");
+        }
+        for (int i = 0; i < CBM_STAT_MAX; i++) {
+                if (json) {
+                        cbm_writer_append_printf(writer,
+                                                 "%s\"%s\":%" PRIu64,
+                                                 i > 0 ? "," : "",
+                                                 cbm_stat_names[i],
+                                                 values[i]);
+                } else {
+                        cbm_writer_append_printf(writer,
+                                                 "%-20s %" PRIu64 "\n",
+                                                 cbm_stat_names[i],
+                                                 values[i]);
+                }
+        }
+
+        pthread_mutex_lock(&cbm_stats_state.lock);
+        cbm_stats_write_measurements(writer, json);
+        pthread_mutex_unlock(&cbm_stats_state.lock);
+
+        if (json) {
+                cbm_writer_append(writer, "}\n");
+        }
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,95 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sha256.h"
+#include "writer.h"
+
+/**
+ * Process-wide work counters
+ */
+typedef enum {
+        CBM_STAT_BYTES_COMPARED = 0, /**<Bytes read by cbm_files_match */
+        CBM_STAT_BYTES_COPIED,       /**<Bytes written by copy_file */
+        CBM_STAT_SYNCS,              /**<fsync/syncfs calls actually issued */
+        CBM_STAT_FILES_CREATED,      /**<Files created or rewritten */
+        CBM_STAT_FILES_UNLINKED,     /**<Files removed */
+        CBM_STAT_EXISTS_PROBES,      /**<cbm_file_exists calls */
+        CBM_STAT_COMMANDS,           /**<External commands run */
+        CBM_STAT_KERNELS_INSPECTED,  /**<Kernels discovered and parsed */
+        CBM_STAT_KERNELS_INSTALLED,  /**<Kernels installed to the boot directory */
+        CBM_STAT_KERNELS_SKIPPED,    /**<Kernels already up to date */
+        CBM_STAT_KERNELS_REMOVED,    /**<Kernels garbage collected */
+        CBM_STAT_RING_SUBMITS,       /**<io_uring batches submitted */
+        CBM_STAT_MAX
+} CbmStat;
+
+/**
+ * Add @n to the counter @stat. Safe to call from any thread.
+ */
+void cbm_stats_add(CbmStat stat, uint64_t n);
+
+/**
+ * Add one to the counter @stat
+ */
+static inline void cbm_stats_inc(CbmStat stat)
+{
+        cbm_stats_add(stat, 1);
+}
+
+/**
+ * Current value of the counter @stat
+ */
+uint64_t cbm_stats_get(CbmStat stat);
+
+/**
+ * Stable machine readable name of @stat, i.e. "bytes_copied"
+ */
+const char *cbm_stats_name(CbmStat stat);
+
+/**
+ * Remember that @path was installed with the hex encoded SHA-256 @digest,
+ * i.e. for a measured boot policy to be computed from. Safe to call from any
+ * thread.
+ */
+void cbm_stats_measure(const char *path, const char digest[CBM_SHA256_HEX_SIZE]);
+
+/**
+ * Zero every counter, and forget every measurement
+ */
+void cbm_stats_reset(void);
+
+/**
+ * Append every counter to @writer, either as a two column table or as a
+ * single line JSON object. Measurements follow the counters, as
+ * "measurement <digest> <path>" rows or as a "measurements" object mapping
+ * each path to its digest.
+ */
+void cbm_stats_write(CbmWriter *writer, bool json);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
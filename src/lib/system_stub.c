@@ -12,12 +12,21 @@
 #include "system_stub.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "files.h"
 #include "log.h"
+#include "stats.h"
 
 /**
  * Factory function to convert a dev_t to the full device path
@@ -46,18 +55,75 @@ static const char *cbm_get_devfs_path(void)
         return "/dev";
 }
 
+static const char *cbm_get_runtime_path(void)
+{
+        return "/run";
+}
+
+extern char **environ;
+
+/**
+ * As system(3), but the shell starts with nothing blocked and the signals we
+ * may have blocked for a signalfd at their defaults, so that whatever we run
+ * can still be stopped
+ */
+static int cbm_run_shell(const char *command)
+{
+        posix_spawnattr_t attr;
+        sigset_t mask;
+        sigset_t defaults;
+        char *argv[] = { (char *)"sh", (char *)"-c", (char *)command, NULL };
+        pid_t pid = 0;
+        int status = 0;
+        int r = 0;
+
+        sigemptyset(&mask);
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGTERM);
+        sigaddset(&defaults, SIGHUP);
+        sigaddset(&defaults, SIGQUIT);
+
+        if (posix_spawnattr_init(&attr) != 0) {
+                return -1;
+        }
+        if (posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF) != 0 ||
+            posix_spawnattr_setsigmask(&attr, &mask) != 0 ||
+            posix_spawnattr_setsigdefault(&attr, &defaults) != 0) {
+                posix_spawnattr_destroy(&attr);
+                return -1;
+        }
+        /* posix_spawn runs no fork handlers, so the child's output would overtake ours */
+        cbm_log_flush();
+        r = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+        if (r != 0) {
+                errno = r;
+                return -1;
+        }
+
+        while (waitpid(pid, &status, 0) < 0) {
+                if (errno != EINTR) {
+                        return -1;
+                }
+        }
+        return status;
+}
+
 /**
  * Default vtable for system call passthrough
  */
 static CbmSystemOps default_system_ops = {
         .mount = mount,
         .umount = umount,
-        .system = system,
+        .statvfs = statvfs,
+        .system = cbm_run_shell,
         .is_mounted = cbm_is_mounted,
         .get_mountpoint_for_device = cbm_get_mountpoint_for_device,
         .devnode_to_devpath = cbm_devnode_to_devpath,
         .get_sysfs_path = cbm_get_sysfs_path,
         .get_devfs_path = cbm_get_devfs_path,
+        .get_runtime_path = cbm_get_runtime_path,
 };
 
 /**
@@ -80,12 +146,37 @@ void cbm_system_set_vtable(CbmSystemOps *ops)
         /* Ensure the vtable is valid at this point. */
         assert(system_ops->mount != NULL);
         assert(system_ops->umount != NULL);
+        assert(system_ops->statvfs != NULL);
         assert(system_ops->is_mounted != NULL);
         assert(system_ops->get_mountpoint_for_device != NULL);
         assert(system_ops->system != NULL);
         assert(system_ops->devnode_to_devpath != NULL);
         assert(system_ops->get_sysfs_path != NULL);
         assert(system_ops->get_devfs_path != NULL);
+        assert(system_ops->get_runtime_path != NULL);
+        /* The file functions come as a set, or not at all */
+        if (system_ops->open) {
+                assert(system_ops->close != NULL);
+                assert(system_ops->read != NULL);
+                assert(system_ops->pread != NULL);
+                assert(system_ops->write != NULL);
+                assert(system_ops->fstat != NULL);
+                assert(system_ops->fsync != NULL);
+                assert(system_ops->flock != NULL);
+                assert(system_ops->stat != NULL);
+                assert(system_ops->lstat != NULL);
+                assert(system_ops->rename != NULL);
+                assert(system_ops->unlink != NULL);
+                assert(system_ops->mkdir != NULL);
+                assert(system_ops->rmdir != NULL);
+                assert(system_ops->readlink != NULL);
+                assert(system_ops->symlink != NULL);
+                assert(system_ops->opendir != NULL);
+                assert(system_ops->readdir != NULL);
+                assert(system_ops->closedir != NULL);
+        } else {
+                assert(system_ops->readdir == NULL);
+        }
 }
 
 int cbm_system_mount(const char *source, const char *target, const char *filesystemtype,
@@ -99,8 +190,14 @@ int cbm_system_umount(const char *target)
         return system_ops->umount(target);
 }
 
+int cbm_system_statvfs(const char *path, struct statvfs *buf)
+{
+        return system_ops->statvfs(path, buf);
+}
+
 int cbm_system_system(const char *command)
 {
+        cbm_stats_inc(CBM_STAT_COMMANDS);
         return system_ops->system(command);
 }
 
@@ -129,6 +226,171 @@ const char *cbm_system_get_devfs_path()
         return system_ops->get_devfs_path();
 }
 
+const char *cbm_system_get_runtime_path()
+{
+        return system_ops->get_runtime_path();
+}
+
+bool cbm_system_has_native_files(void)
+{
+        return system_ops->open == NULL;
+}
+
+int cbm_system_open(const char *path, int flags, mode_t mode)
+{
+        if (system_ops->open) {
+                return system_ops->open(path, flags, mode);
+        }
+        return open(path, flags, mode);
+}
+
+int cbm_system_close(int fd)
+{
+        if (system_ops->open) {
+                return system_ops->close(fd);
+        }
+        return close(fd);
+}
+
+ssize_t cbm_system_read(int fd, void *buf, size_t count)
+{
+        if (system_ops->open) {
+                return system_ops->read(fd, buf, count);
+        }
+        return read(fd, buf, count);
+}
+
+ssize_t cbm_system_pread(int fd, void *buf, size_t count, off_t offset)
+{
+        if (system_ops->open) {
+                return system_ops->pread(fd, buf, count, offset);
+        }
+        return pread(fd, buf, count, offset);
+}
+
+ssize_t cbm_system_write(int fd, const void *buf, size_t count)
+{
+        if (system_ops->open) {
+                return system_ops->write(fd, buf, count);
+        }
+        return write(fd, buf, count);
+}
+
+int cbm_system_fstat(int fd, struct stat *st)
+{
+        if (system_ops->open) {
+                return system_ops->fstat(fd, st);
+        }
+        return fstat(fd, st);
+}
+
+int cbm_system_fsync(int fd)
+{
+        if (system_ops->open) {
+                return system_ops->fsync(fd);
+        }
+        return fsync(fd);
+}
+
+int cbm_system_flock(int fd, int operation)
+{
+        if (system_ops->open) {
+                return system_ops->flock(fd, operation);
+        }
+        return flock(fd, operation);
+}
+
+int cbm_system_stat(const char *path, struct stat *st)
+{
+        if (system_ops->open) {
+                return system_ops->stat(path, st);
+        }
+        return stat(path, st);
+}
+
+int cbm_system_lstat(const char *path, struct stat *st)
+{
+        if (system_ops->open) {
+                return system_ops->lstat(path, st);
+        }
+        return lstat(path, st);
+}
+
+int cbm_system_rename(const char *oldpath, const char *newpath)
+{
+        if (system_ops->open) {
+                return system_ops->rename(oldpath, newpath);
+        }
+        return rename(oldpath, newpath);
+}
+
+int cbm_system_unlink(const char *path)
+{
+        if (system_ops->open) {
+                return system_ops->unlink(path);
+        }
+        return unlink(path);
+}
+
+int cbm_system_mkdir(const char *path, mode_t mode)
+{
+        if (system_ops->open) {
+                return system_ops->mkdir(path, mode);
+        }
+        return mkdir(path, mode);
+}
+
+int cbm_system_rmdir(const char *path)
+{
+        if (system_ops->open) {
+                return system_ops->rmdir(path);
+        }
+        return rmdir(path);
+}
+
+ssize_t cbm_system_readlink(const char *path, char *buf, size_t size)
+{
+        if (system_ops->open) {
+                return system_ops->readlink(path, buf, size);
+        }
+        return readlink(path, buf, size);
+}
+
+int cbm_system_symlink(const char *target, const char *path)
+{
+        if (system_ops->open) {
+                return system_ops->symlink(target, path);
+        }
+        return symlink(target, path);
+}
+
+void *cbm_system_opendir(const char *path)
+{
+        if (system_ops->open) {
+                return system_ops->opendir(path);
+        }
+        return opendir(path);
+}
+
+const char *cbm_system_readdir(void *dir)
+{
+        struct dirent *ent = NULL;
+
+        if (system_ops->open) {
+                return system_ops->readdir(dir);
+        }
+        ent = readdir(dir);
+        return ent ? ent->d_name : NULL;
+}
+
+int cbm_system_closedir(void *dir)
+{
+        if (system_ops->open) {
+                return system_ops->closedir(dir);
+        }
+        return closedir(dir);
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
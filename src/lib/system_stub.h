@@ -14,6 +14,8 @@
 #define _GNU_SOURCE
 
 #include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 
 /**
@@ -26,6 +28,7 @@ typedef struct CbmSystemOps {
         int (*mount)(const char *source, const char *target, const char *filesystemtype,
                      unsigned long mountflags, const void *data);
         int (*umount)(const char *target);
+        int (*statvfs)(const char *path, struct statvfs *buf);
 
         /* wrap cbm lib functions */
         bool (*is_mounted)(const char *target);
@@ -38,6 +41,30 @@ typedef struct CbmSystemOps {
         char *(*devnode_to_devpath)(dev_t t);
         const char *(*get_sysfs_path)(void);
         const char *(*get_devfs_path)(void);
+        const char *(*get_runtime_path)(void);
+
+        /* file functions. These are optional, but either all or none of them
+         * must be set. When unset, files are accessed directly through the
+         * standard library. Directory handles are opaque to callers. */
+        int (*open)(const char *path, int flags, mode_t mode);
+        int (*close)(int fd);
+        ssize_t (*read)(int fd, void *buf, size_t count);
+        ssize_t (*pread)(int fd, void *buf, size_t count, off_t offset);
+        ssize_t (*write)(int fd, const void *buf, size_t count);
+        int (*fstat)(int fd, struct stat *st);
+        int (*fsync)(int fd);
+        int (*flock)(int fd, int operation);
+        int (*stat)(const char *path, struct stat *st);
+        int (*lstat)(const char *path, struct stat *st);
+        int (*rename)(const char *oldpath, const char *newpath);
+        int (*unlink)(const char *path);
+        int (*mkdir)(const char *path, mode_t mode);
+        int (*rmdir)(const char *path);
+        ssize_t (*readlink)(const char *path, char *buf, size_t size);
+        int (*symlink)(const char *target, const char *path);
+        void *(*opendir)(const char *path);
+        const char *(*readdir)(void *dir);
+        int (*closedir)(void *dir);
 } CbmSystemOps;
 
 /**
@@ -95,6 +122,124 @@ const char *cbm_system_get_sysfs_path(void);
  */
 const char *cbm_system_get_devfs_path(void);
 
+/**
+ * Help mocking by allowing /run to be overridden
+ */
+const char *cbm_system_get_runtime_path(void);
+
+/**
+ * Wrap the statvfs syscall, allowing the free space to be mocked
+ */
+int cbm_system_statvfs(const char *path, struct statvfs *buf);
+
+/**
+ * Whether files are those of the running system, rather than those of an
+ * alternative backend set in the vtable. Only native files can be handed to
+ * the calls of the kernel which the vtable doesn't wrap, such as mmap(),
+ * sendfile() or fallocate(), or to external tools.
+ */
+bool cbm_system_has_native_files(void);
+
+/**
+ * Wrap the open syscall. @mode is only used when creating a file.
+ */
+int cbm_system_open(const char *path, int flags, mode_t mode);
+
+/**
+ * Wrap the close syscall
+ */
+int cbm_system_close(int fd);
+
+/**
+ * Wrap the read syscall
+ */
+ssize_t cbm_system_read(int fd, void *buf, size_t count);
+
+/**
+ * Wrap the pread syscall
+ */
+ssize_t cbm_system_pread(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * Wrap the write syscall
+ */
+ssize_t cbm_system_write(int fd, const void *buf, size_t count);
+
+/**
+ * Wrap the fstat syscall
+ */
+int cbm_system_fstat(int fd, struct stat *st);
+
+/**
+ * Wrap the fsync syscall
+ */
+int cbm_system_fsync(int fd);
+
+/**
+ * Wrap the flock syscall
+ */
+int cbm_system_flock(int fd, int operation);
+
+/**
+ * Wrap the stat syscall
+ */
+int cbm_system_stat(const char *path, struct stat *st);
+
+/**
+ * Wrap the lstat syscall
+ */
+int cbm_system_lstat(const char *path, struct stat *st);
+
+/**
+ * Wrap the rename syscall
+ */
+int cbm_system_rename(const char *oldpath, const char *newpath);
+
+/**
+ * Wrap the unlink syscall
+ */
+int cbm_system_unlink(const char *path);
+
+/**
+ * Wrap the mkdir syscall
+ */
+int cbm_system_mkdir(const char *path, mode_t mode);
+
+/**
+ * Wrap the rmdir syscall
+ */
+int cbm_system_rmdir(const char *path);
+
+/**
+ * Wrap the readlink syscall
+ */
+ssize_t cbm_system_readlink(const char *path, char *buf, size_t size);
+
+/**
+ * Wrap the symlink syscall
+ */
+int cbm_system_symlink(const char *target, const char *path);
+
+/**
+ * Open the directory @path for cbm_system_readdir
+ *
+ * @return an opaque handle, or NULL with errno set
+ */
+void *cbm_system_opendir(const char *path);
+
+/**
+ * Read the next entry of @dir, including "." and ".."
+ *
+ * @return the name of the entry, valid until the next call, or NULL once
+ * there are no more
+ */
+const char *cbm_system_readdir(void *dir);
+
+/**
+ * Close a directory opened with cbm_system_opendir
+ */
+int cbm_system_closedir(void *dir);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
@@ -0,0 +1,295 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "blkid_stub.h"
+#include "files.h"
+#include "log.h"
+#include "system_stub.h"
+#include "topology.h"
+#include "trace.h"
+#include "util.h"
+
+/**
+ * Everything learned about the block devices so far, each part is filled
+ * in on first use
+ */
+static struct {
+        pthread_mutex_t lock;
+        NcHashmap *part_uuids;  /**<Entries of disk/by-partuuid */
+        NcHashmap *part_labels; /**<Entries of disk/by-partlabel */
+        NcHashmap *disks;       /**<"major:minor" -> parent disk */
+        char *esp;              /**<ESP candidate */
+        bool have_esp;          /**<Whether esp has been resolved */
+} cbm_topology = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+void cbm_topology_reset(void)
+{
+        pthread_mutex_lock(&cbm_topology.lock);
+        if (cbm_topology.part_uuids) {
+                nc_hashmap_free(cbm_topology.part_uuids);
+                cbm_topology.part_uuids = NULL;
+        }
+        if (cbm_topology.part_labels) {
+                nc_hashmap_free(cbm_topology.part_labels);
+                cbm_topology.part_labels = NULL;
+        }
+        if (cbm_topology.disks) {
+                nc_hashmap_free(cbm_topology.disks);
+                cbm_topology.disks = NULL;
+        }
+        free(cbm_topology.esp);
+        cbm_topology.esp = NULL;
+        cbm_topology.have_esp = false;
+        pthread_mutex_unlock(&cbm_topology.lock);
+}
+
+static char *cbm_topology_strdup(const char *s)
+{
+        char *ret = strdup(s);
+
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        return ret;
+}
+
+/**
+ * Look up @name within the devfs directory @dir, scanning it the first time
+ * it's needed. Must be called with the lock held.
+ */
+static char *cbm_topology_find_link(NcHashmap **entries, const char *dir, const char *name)
+{
+        autofree(char) *path = NULL;
+
+        path = string_printf("%s/disk/%s", cbm_system_get_devfs_path(), dir);
+        if (!*entries) {
+                CBM_TRACE_SCOPE("topology_scan");
+
+                *entries = cbm_get_dir_entries(path);
+                if (!*entries) {
+                        LOG_DEBUG("Unable to read %s: %s", path, strerror(errno));
+                        return NULL;
+                }
+        }
+
+        if (!nc_hashmap_contains(*entries, name)) {
+                return NULL;
+        }
+        return string_printf("%s/%s", path, name);
+}
+
+char *cbm_topology_part_uuid_node(const char *uuid)
+{
+        char *ret = NULL;
+
+        pthread_mutex_lock(&cbm_topology.lock);
+        ret = cbm_topology_find_link(&cbm_topology.part_uuids, "by-partuuid", uuid);
+        pthread_mutex_unlock(&cbm_topology.lock);
+        return ret;
+}
+
+char *cbm_topology_part_label_node(const char *label)
+{
+        char *ret = NULL;
+
+        pthread_mutex_lock(&cbm_topology.lock);
+        ret = cbm_topology_find_link(&cbm_topology.part_labels, "by-partlabel", label);
+        pthread_mutex_unlock(&cbm_topology.lock);
+        return ret;
+}
+
+/**
+ * Resolve the parent disk of @dev through blkid and the devfs block links
+ */
+static char *cbm_topology_resolve_disk(dev_t dev)
+{
+        dev_t disk;
+        autofree(char) *node = NULL;
+
+        if (cbm_blkid_devno_to_wholedisk(dev, NULL, 0, &disk) < 0) {
+                LOG_ERROR("Invalid block device: %u:%u", major(dev), minor(dev));
+                return NULL;
+        }
+
+        node = string_printf("%s/block/%u:%u",
+                             cbm_system_get_devfs_path(),
+                             major(disk),
+                             minor(disk));
+        return realpath(node, NULL);
+}
+
+char *cbm_topology_parent_disk(dev_t dev)
+{
+        char *key = NULL;
+        const char *disk = NULL;
+        char *ret = NULL;
+
+        key = string_printf("%u:%u", major(dev), minor(dev));
+
+        pthread_mutex_lock(&cbm_topology.lock);
+        if (!cbm_topology.disks) {
+                cbm_topology.disks =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+                if (!cbm_topology.disks) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        disk = nc_hashmap_get(cbm_topology.disks, key);
+        if (disk) {
+                free(key);
+                ret = cbm_topology_strdup(disk);
+        } else {
+                /* Failures aren't remembered, the node may yet appear */
+                ret = cbm_topology_resolve_disk(dev);
+                if (!ret) {
+                        free(key);
+                } else if (!nc_hashmap_put(cbm_topology.disks, key, cbm_topology_strdup(ret))) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        pthread_mutex_unlock(&cbm_topology.lock);
+
+        return ret;
+}
+
+/**
+ * Read the PartUUID of the partition the firmware booted from.
+ *
+ * @param uuid Set to the normalised PartUUID, or NULL if there is no variable
+ * @return False if the variable exists but can't be read
+ */
+static bool cbm_topology_loader_part_uuid(char **uuid)
+{
+        glob_t glo = { 0 };
+        char read_buf[4096];
+        int fd = -1;
+        ssize_t size = 0;
+        char *ret = NULL;
+        int j = 0;
+        autofree(char) *glob_path = NULL;
+
+        *uuid = NULL;
+        glo.gl_offs = 1;
+
+        glob_path = string_printf("%s/firmware/efi/efivars/LoaderDevicePartUUID*",
+                                  cbm_system_get_sysfs_path());
+
+        glob(glob_path, GLOB_DOOFFS, NULL, &glo);
+
+        if (glo.gl_pathc < 1) {
+                globfree(&glo);
+                return true;
+        }
+
+        /* Read the uuid */
+        fd = open(glo.gl_pathv[1], O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        globfree(&glo);
+
+        if (fd < 0) {
+                LOG_ERROR("Unable to read LoaderDevicePartUUID");
+                return false;
+        }
+
+        size = read(fd, read_buf, sizeof(read_buf));
+        close(fd);
+        if (size < 1) {
+                return true;
+        }
+
+        ret = calloc((size_t)(size + 1), sizeof(char));
+        if (!ret) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (ssize_t i = 0; i < size; i++) {
+                char c = read_buf[i];
+                if (!isalnum(c) && c != '-' && c != '_') {
+                        continue;
+                }
+                if (c == '_' || c == '-') {
+                        ret[j] = '-';
+                } else {
+                        ret[j] = (char)tolower(read_buf[i]);
+                }
+                ++j;
+        }
+
+        *uuid = ret;
+        return true;
+}
+
+/**
+ * Must be called with the lock held
+ */
+static char *cbm_topology_resolve_esp(void)
+{
+        autofree(char) *uuid = NULL;
+        char *ret = NULL;
+
+        if (!cbm_topology_loader_part_uuid(&uuid)) {
+                return NULL;
+        }
+
+        if (uuid) {
+                ret = cbm_topology_find_link(&cbm_topology.part_uuids, "by-partuuid", uuid);
+                if (ret) {
+                        return ret;
+                }
+        }
+
+        return cbm_topology_find_link(&cbm_topology.part_labels, "by-partlabel", "ESP");
+}
+
+char *cbm_topology_esp(void)
+{
+        char *ret = NULL;
+
+        pthread_mutex_lock(&cbm_topology.lock);
+        if (!cbm_topology.have_esp) {
+                cbm_topology.esp = cbm_topology_resolve_esp();
+                cbm_topology.have_esp = true;
+        }
+        if (cbm_topology.esp) {
+                ret = cbm_topology_strdup(cbm_topology.esp);
+        }
+        pthread_mutex_unlock(&cbm_topology.lock);
+
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
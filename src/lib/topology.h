@@ -0,0 +1,70 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+/**
+ * Index of the block devices relevant to boot device discovery.
+ *
+ * The partition links in devfs, each parent disk lookup and the ESP
+ * are resolved at most once and then served from memory. Everything is
+ * found through the sysfs and devfs paths of the system vtable.
+ */
+
+/**
+ * Forget everything that has been indexed, i.e. before inspecting a new root.
+ * The index is rebuilt on the next query.
+ */
+void cbm_topology_reset(void);
+
+/**
+ * Find the device node for the partition with the PartUUID @uuid
+ *
+ * @return a newly allocated path within devfs, or NULL if there is none
+ */
+char *cbm_topology_part_uuid_node(const char *uuid);
+
+/**
+ * Find the device node for the partition labelled @label
+ *
+ * @return a newly allocated path within devfs, or NULL if there is none
+ */
+char *cbm_topology_part_label_node(const char *label);
+
+/**
+ * Find the disk containing the block device @dev
+ *
+ * @return the newly allocated, fully resolved path of the disk, or NULL
+ */
+char *cbm_topology_parent_disk(dev_t dev);
+
+/**
+ * Find the ESP candidate. This is the partition the firmware booted from,
+ * according to LoaderDevicePartUUID, or otherwise the partition labelled ESP.
+ *
+ * @return a newly allocated path within devfs, or NULL if there is none
+ */
+char *cbm_topology_esp(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,227 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+#include "util.h"
+
+/**
+ * A completed span
+ */
+typedef struct CbmTraceEvent {
+        const char *name;
+        uint64_t start;
+        uint64_t duration;
+        long tid;
+} CbmTraceEvent;
+
+/**
+ * All recorded spans, appended to from any thread
+ */
+static struct {
+        pthread_mutex_t lock;
+        char *path;             /**<Output file, NULL when disabled */
+        bool enabled;           /**<Read without the lock in cbm_trace_begin */
+        bool registered;        /**<Whether the exit handler is installed */
+        uint64_t epoch;         /**<Timestamps are relative to this */
+        CbmTraceEvent *events;  /**<Recorded spans */
+        size_t n_events;        /**<Number of recorded spans */
+        size_t n_alloc;         /**<Allocated size of events */
+} cbm_trace_state = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t cbm_trace_now(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void cbm_trace_exit(void)
+{
+        cbm_trace_flush();
+}
+
+void cbm_trace_init(const char *path)
+{
+        pthread_mutex_lock(&cbm_trace_state.lock);
+        free(cbm_trace_state.path);
+        cbm_trace_state.path = NULL;
+        free(cbm_trace_state.events);
+        cbm_trace_state.events = NULL;
+        cbm_trace_state.n_events = 0;
+        cbm_trace_state.n_alloc = 0;
+        cbm_trace_state.enabled = false;
+
+        if (path && path[0] != '\0') {
+                cbm_trace_state.path = strdup(path);
+                if (!cbm_trace_state.path) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                cbm_trace_state.epoch = cbm_trace_now();
+                cbm_trace_state.enabled = true;
+                if (!cbm_trace_state.registered) {
+                        atexit(cbm_trace_exit);
+                        cbm_trace_state.registered = true;
+                }
+        }
+        pthread_mutex_unlock(&cbm_trace_state.lock);
+}
+
+/**
+ * Start tracing right away when requested through the environment
+ */
+__attribute__((constructor)) static void cbm_trace_first_init(void)
+{
+        cbm_trace_init(getenv("CBM_TRACE"));
+}
+
+bool cbm_trace_enabled(void)
+{
+        return cbm_trace_state.enabled;
+}
+
+CbmTraceSpan cbm_trace_begin(const char *name)
+{
+        if (!cbm_trace_state.enabled) {
+                return (CbmTraceSpan){ 0 };
+        }
+        return (CbmTraceSpan){.name = name, .start = cbm_trace_now() };
+}
+
+void cbm_trace_end(CbmTraceSpan *span)
+{
+        CbmTraceEvent *event = NULL;
+        uint64_t end = 0;
+
+        if (!span->name) {
+                return;
+        }
+        end = cbm_trace_now();
+
+        pthread_mutex_lock(&cbm_trace_state.lock);
+        /* Tracing was reset while this span was open */
+        if (!cbm_trace_state.enabled || span->start < cbm_trace_state.epoch) {
+                goto done;
+        }
+        if (cbm_trace_state.n_events == cbm_trace_state.n_alloc) {
+                size_t n_alloc = cbm_trace_state.n_alloc ? cbm_trace_state.n_alloc * 2 : 64;
+                CbmTraceEvent *events =
+                    realloc(cbm_trace_state.events, n_alloc * sizeof(CbmTraceEvent));
+                if (!events) {
+                        DECLARE_OOM();
+                        abort();
+                }
+                cbm_trace_state.events = events;
+                cbm_trace_state.n_alloc = n_alloc;
+        }
+        event = &cbm_trace_state.events[cbm_trace_state.n_events++];
+        event->name = span->name;
+        event->start = span->start - cbm_trace_state.epoch;
+        event->duration = end - span->start;
+        event->tid = (long)syscall(SYS_gettid);
+done:
+        pthread_mutex_unlock(&cbm_trace_state.lock);
+        span->name = NULL;
+}
+
+/**
+ * Span names are literals, but never emit broken JSON
+ */
+static void cbm_trace_write_string(FILE *fp, const char *s)
+{
+        fputc('"', fp);
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\') {
+                        fputc('\\', fp);
+                        fputc(*s, fp);
+                } else if ((unsigned char)*s < 0x20) {
+                        fprintf(fp, "\\u%04x", (unsigned int)(unsigned char)*s);
+                } else {
+                        fputc(*s, fp);
+                }
+        }
+        fputc('"', fp);
+}
+
+bool cbm_trace_flush(void)
+{
+        FILE *fp = NULL;
+        bool ret = true;
+        long pid = (long)getpid();
+
+        pthread_mutex_lock(&cbm_trace_state.lock);
+        if (!cbm_trace_state.enabled) {
+                goto done;
+        }
+
+        fp = fopen(cbm_trace_state.path, "we");
+        if (!fp) {
+                LOG_ERROR("Unable to write trace to %s: %s",
+                          cbm_trace_state.path,
+                          strerror(errno));
+                ret = false;
+                goto done;
+        }
+
+        /* Complete ("X") events, timestamps in microseconds */
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+        for (size_t i = 0; i < cbm_trace_state.n_events; i++) {
+                const CbmTraceEvent *event = &cbm_trace_state.events[i];
+
+                fputs("{\"name\":", fp);
+                cbm_trace_write_string(fp, event->name);
+                fprintf(fp,
+                        ",\"cat\":\"cbm\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%ld,\"tid\":%ld}%s\n",
+                        (double)event->start / 1000.0,
+                        (double)event->duration / 1000.0,
+                        pid,
+                        event->tid,
+                        i + 1 < cbm_trace_state.n_events ? "," : "");
+        }
+        fputs("]}\n", fp);
+
+        if (fclose(fp) != 0) {
+                LOG_ERROR("Unable to write trace to %s: %s",
+                          cbm_trace_state.path,
+                          strerror(errno));
+                ret = false;
+        }
+done:
+        pthread_mutex_unlock(&cbm_trace_state.lock);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,83 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A timed region of work, see cbm_trace_begin
+ */
+typedef struct CbmTraceSpan {
+        const char *name; /**<Static name of the span, NULL when not tracing */
+        uint64_t start;   /**<Monotonic start time in nanoseconds */
+} CbmTraceSpan;
+
+/**
+ * Re-initialise tracing to record spans and write them to @path as Chrome
+ * trace-event JSON on exit, or disable tracing if @path is NULL.
+ *
+ * @note This is already called once with the value of CBM_TRACE
+ */
+void cbm_trace_init(const char *path);
+
+/**
+ * Determine whether spans are currently being recorded
+ */
+bool cbm_trace_enabled(void);
+
+/**
+ * Begin a new span. Spans nest naturally: any span that begins and ends
+ * within another is shown beneath it. When tracing is disabled this costs
+ * a single branch.
+ *
+ * @param name Name of the span, which must outlive the process (i.e. a literal)
+ */
+CbmTraceSpan cbm_trace_begin(const char *name);
+
+/**
+ * Complete the span and record it
+ */
+void cbm_trace_end(CbmTraceSpan *span);
+
+/**
+ * Write all recorded spans out now, rather than waiting for exit
+ *
+ * @return True if the trace was written, or tracing is disabled
+ */
+bool cbm_trace_flush(void);
+
+#define __CBM_TRACE_CONCAT(a, b) a##b
+#define _CBM_TRACE_CONCAT(a, b) __CBM_TRACE_CONCAT(a, b)
+
+/**
+ * Trace the remainder of the enclosing scope as @name
+ */
+#define CBM_TRACE_SCOPE(name)                                                                      \
+        __attribute__((cleanup(cbm_trace_end))) CbmTraceSpan _CBM_TRACE_CONCAT(cbm_span_,        \
+                                                                               __LINE__) =         \
+            cbm_trace_begin(name)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
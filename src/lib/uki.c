@@ -0,0 +1,633 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "files.h"
+#include "log.h"
+#include "manifest.h"
+#include "stats.h"
+#include "system_stub.h"
+#include "trace.h"
+#include "uki.h"
+#include "util.h"
+
+/**
+ * Size of a section header, which follow the optional header
+ */
+#define CBM_PE_SECTION_SIZE 40
+
+/**
+ * Headers of the image are read up to this size when looking for the digest
+ */
+#define CBM_PE_HEADER_MAX (64 * 1024)
+
+/**
+ * Size of the blocks the kernel and initrd are streamed in
+ */
+#define CBM_UKI_CHUNK (128 * 1024)
+
+/**
+ * Initialised, readable data
+ */
+#define CBM_PE_SCN_DATA 0x40000040U
+
+/**
+ * Index of the certificate table among the data directories
+ */
+#define CBM_PE_DIR_SECURITY 4
+
+/**
+ * Where everything of interest lies within a PE image
+ */
+typedef struct CbmPeLayout {
+        uint32_t opt;           /**<Offset of the optional header */
+        uint16_t n_sections;    /**<Number of sections */
+        uint32_t sections;      /**<Offset of the section table */
+        uint32_t header_room;   /**<End of the space available for section headers */
+        uint32_t security;      /**<Offset of the certificate table directory, 0 if none */
+        uint32_t file_align;    /**<Alignment of section data in the file */
+        uint32_t section_align; /**<Alignment of sections in memory */
+        uint32_t data_end;      /**<End of the section data in the file */
+        uint32_t image_end;     /**<End of the sections in memory */
+} CbmPeLayout;
+
+/**
+ * A section added to the stub
+ */
+typedef struct CbmUkiSection {
+        const char *name;
+        const char *path; /**<Streamed from this file, or */
+        const char *data; /**<taken from memory */
+        uint32_t size;
+        uint32_t vaddr;
+        uint32_t offset;
+        uint32_t raw_size; /**<Size padded to the file alignment */
+} CbmUkiSection;
+
+static inline uint16_t cbm_le16(const uint8_t *p)
+{
+        return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t cbm_le32(const uint8_t *p)
+{
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+               ((uint32_t)p[3] << 24);
+}
+
+static inline void cbm_put_le16(uint8_t *p, uint16_t v)
+{
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void cbm_put_le32(uint8_t *p, uint32_t v)
+{
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+        p[2] = (uint8_t)(v >> 16);
+        p[3] = (uint8_t)(v >> 24);
+}
+
+/**
+ * Round @v up to @align, a power of two, failing on overflow
+ */
+static bool cbm_align(uint64_t v, uint32_t align, uint32_t *out)
+{
+        uint64_t r = (v + align - 1) & ~((uint64_t)align - 1);
+
+        if (r > UINT32_MAX) {
+                return false;
+        }
+        *out = (uint32_t)r;
+        return true;
+}
+
+static bool cbm_is_pow2(uint32_t v)
+{
+        return v != 0 && (v & (v - 1)) == 0;
+}
+
+/**
+ * Find the layout of the PE image whose first @len bytes are @buf
+ */
+static bool cbm_pe_parse(const uint8_t *buf, size_t len, CbmPeLayout *pe)
+{
+        uint32_t lfanew = 0;
+        uint16_t opt_size = 0;
+        uint16_t magic = 0;
+        uint32_t n_dirs = 0;
+        uint32_t dirs = 0;
+
+        *pe = (CbmPeLayout){ 0 };
+
+        if (len < 0x40 || buf[0] != 'M' || buf[1] != 'Z') {
+                return false;
+        }
+        lfanew = cbm_le32(buf + 0x3c);
+        if ((uint64_t)lfanew + 24 > len || memcmp(buf + lfanew, "PE\0\0", 4) != 0) {
+                return false;
+        }
+        pe->n_sections = cbm_le16(buf + lfanew + 6);
+        opt_size = cbm_le16(buf + lfanew + 20);
+        pe->opt = lfanew + 24;
+        pe->sections = pe->opt + opt_size;
+        if ((uint64_t)pe->sections + (uint64_t)pe->n_sections * CBM_PE_SECTION_SIZE > len ||
+            opt_size < 96) {
+                return false;
+        }
+
+        magic = cbm_le16(buf + pe->opt);
+        if (magic == 0x10b) {
+                n_dirs = 92;
+                dirs = 96;
+        } else if (magic == 0x20b) {
+                n_dirs = 108;
+                dirs = 112;
+        } else {
+                return false;
+        }
+        if (opt_size < n_dirs + 4) {
+                return false;
+        }
+        if (cbm_le32(buf + pe->opt + n_dirs) > CBM_PE_DIR_SECURITY &&
+            opt_size >= dirs + (CBM_PE_DIR_SECURITY + 1) * 8) {
+                pe->security = pe->opt + dirs + CBM_PE_DIR_SECURITY * 8;
+        }
+
+        pe->section_align = cbm_le32(buf + pe->opt + 32);
+        pe->file_align = cbm_le32(buf + pe->opt + 36);
+        pe->header_room = cbm_le32(buf + pe->opt + 60);
+        pe->image_end = cbm_le32(buf + pe->opt + 56);
+        if (!cbm_is_pow2(pe->section_align) || !cbm_is_pow2(pe->file_align)) {
+                return false;
+        }
+
+        pe->data_end = pe->header_room;
+        for (uint16_t i = 0; i < pe->n_sections; i++) {
+                const uint8_t *s = buf + pe->sections + i * CBM_PE_SECTION_SIZE;
+                uint64_t vend = (uint64_t)cbm_le32(s + 12) + cbm_le32(s + 8);
+                uint32_t raw_size = cbm_le32(s + 16);
+                uint32_t raw_ptr = cbm_le32(s + 20);
+
+                if (vend > pe->image_end) {
+                        if (vend > UINT32_MAX) {
+                                return false;
+                        }
+                        pe->image_end = (uint32_t)vend;
+                }
+                if (raw_size == 0) {
+                        continue;
+                }
+                /* Headers can't grow into the data of any section */
+                if (raw_ptr < pe->header_room) {
+                        pe->header_room = raw_ptr;
+                }
+                if ((uint64_t)raw_ptr + raw_size > UINT32_MAX) {
+                        return false;
+                }
+                if (raw_ptr + raw_size > pe->data_end) {
+                        pe->data_end = raw_ptr + raw_size;
+                }
+        }
+        return true;
+}
+
+/**
+ * Read the base of the image at @fd, up to @max bytes
+ */
+static ssize_t cbm_uki_read_head(int fd, uint8_t *buf, size_t max)
+{
+        size_t done = 0;
+
+        while (done < max) {
+                ssize_t r = cbm_system_pread(fd, buf + done, max - done, (off_t)done);
+
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -1;
+                }
+                if (r == 0) {
+                        break;
+                }
+                done += (size_t)r;
+        }
+        return (ssize_t)done;
+}
+
+bool cbm_uki_get_digest(const char *path, char digest[CBM_SHA256_HEX_SIZE])
+{
+        uint8_t *buf = NULL;
+        CbmPeLayout pe = { 0 };
+        ssize_t len = 0;
+        bool ret = false;
+        int fd = -1;
+
+        fd = cbm_system_open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+        if (fd < 0) {
+                return false;
+        }
+        buf = malloc(CBM_PE_HEADER_MAX);
+        if (!buf) {
+                DECLARE_OOM();
+                abort();
+        }
+        len = cbm_uki_read_head(fd, buf, CBM_PE_HEADER_MAX);
+        if (len < 0 || !cbm_pe_parse(buf, (size_t)len, &pe)) {
+                goto end;
+        }
+        for (uint16_t i = 0; i < pe.n_sections; i++) {
+                const uint8_t *s = buf + pe.sections + i * CBM_PE_SECTION_SIZE;
+
+                if (strncmp((const char *)s, CBM_UKI_DIGEST_SECTION, 8) != 0) {
+                        continue;
+                }
+                if (cbm_le32(s + 8) != CBM_SHA256_HEX_SIZE - 1) {
+                        break;
+                }
+                if (cbm_system_pread(fd, digest, CBM_SHA256_HEX_SIZE - 1, cbm_le32(s + 20)) !=
+                    CBM_SHA256_HEX_SIZE - 1) {
+                        break;
+                }
+                digest[CBM_SHA256_HEX_SIZE - 1] = '\0';
+                ret = true;
+                break;
+        }
+
+end:
+        free(buf);
+        cbm_system_close(fd);
+        return ret;
+}
+
+bool cbm_uki_digest(const CbmUkiInputs *inputs, char digest[CBM_SHA256_HEX_SIZE])
+{
+        char part[CBM_SHA256_HEX_SIZE];
+        uint8_t raw[CBM_SHA256_SIZE];
+        autofree(char) *lengths = NULL;
+        CbmSha256 ctx;
+
+        cbm_sha256_init(&ctx);
+
+        /* Every input in turn, each of the files by its own digest */
+        if (!cbm_manifest_digest(inputs->manifest, inputs->stub, part)) {
+                return false;
+        }
+        cbm_sha256_update(&ctx, part, sizeof(part));
+        if (!cbm_manifest_digest(inputs->manifest, inputs->kernel, part)) {
+                return false;
+        }
+        cbm_sha256_update(&ctx, part, sizeof(part));
+        if (inputs->initrd) {
+                if (!cbm_manifest_digest(inputs->manifest, inputs->initrd, part)) {
+                        return false;
+                }
+                cbm_sha256_update(&ctx, part, sizeof(part));
+        } else {
+                cbm_sha256_update(&ctx, "-", 1);
+        }
+
+        /* Lengths first, so that no two sets of strings hash the same */
+        lengths = string_printf("%zu %zu\n", strlen(inputs->cmdline), strlen(inputs->os_release));
+        cbm_sha256_update(&ctx, lengths, strlen(lengths));
+        cbm_sha256_update(&ctx, inputs->cmdline, strlen(inputs->cmdline));
+        cbm_sha256_update(&ctx, inputs->os_release, strlen(inputs->os_release));
+
+        cbm_sha256_final(&ctx, raw);
+        cbm_sha256_to_hex(raw, digest);
+        return true;
+}
+
+static bool cbm_uki_write_all(int fd, const void *buf, size_t len)
+{
+        const char *p = buf;
+
+        while (len > 0) {
+                ssize_t w = cbm_system_write(fd, p, len);
+
+                if (w < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                p += w;
+                len -= (size_t)w;
+        }
+        return true;
+}
+
+/**
+ * Write @len zero bytes to @fd
+ */
+static bool cbm_uki_pad(int fd, size_t len)
+{
+        static const char zeroes[512] = { 0 };
+
+        while (len > 0) {
+                size_t n = len > sizeof(zeroes) ? sizeof(zeroes) : len;
+
+                if (!cbm_uki_write_all(fd, zeroes, n)) {
+                        return false;
+                }
+                len -= n;
+        }
+        return true;
+}
+
+/**
+ * Stream exactly @size bytes of @path to @fd, through @buf
+ */
+static bool cbm_uki_stream(int fd, const char *path, uint32_t size, char *buf)
+{
+        uint32_t done = 0;
+        bool ret = false;
+        int sfd = -1;
+
+        sfd = cbm_system_open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC, 0);
+        if (sfd < 0) {
+                return false;
+        }
+        while (done < size) {
+                size_t want = size - done > CBM_UKI_CHUNK ? CBM_UKI_CHUNK : size - done;
+                ssize_t r = cbm_system_read(sfd, buf, want);
+
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        /* Shrunk since we looked */
+                        if (r == 0) {
+                                errno = EIO;
+                        }
+                        goto end;
+                }
+                cbm_io_throttle((uint64_t)r);
+                if (!cbm_uki_write_all(fd, buf, (size_t)r)) {
+                        goto end;
+                }
+                done += (uint32_t)r;
+        }
+        cbm_stats_add(CBM_STAT_BYTES_COPIED, size);
+        cbm_io_done(sfd);
+        ret = true;
+
+end:
+        cbm_system_close(sfd);
+        return ret;
+}
+
+/**
+ * Size of the file at @path, as long as a section can hold it
+ */
+static bool cbm_uki_file_size(const char *path, uint32_t *size)
+{
+        struct stat st = { 0 };
+
+        if (cbm_system_stat(path, &st) != 0) {
+                return false;
+        }
+        if (st.st_size < 0 || (uint64_t)st.st_size > UINT32_MAX) {
+                errno = EFBIG;
+                return false;
+        }
+        *size = (uint32_t)st.st_size;
+        return true;
+}
+
+/**
+ * Write the image of @inputs to @fd
+ */
+static bool cbm_uki_assemble(const CbmUkiInputs *inputs, const char digest[CBM_SHA256_HEX_SIZE],
+                             int fd)
+{
+        autofree(CbmMappedFile) *stub = CBM_MAPPED_FILE_INIT;
+        CbmUkiSection sections[] = {
+                {.name = ".osrel", .data = inputs->os_release },
+                {.name = ".cmdline", .data = inputs->cmdline },
+                {.name = CBM_UKI_DIGEST_SECTION, .data = digest },
+                {.name = ".initrd", .path = inputs->initrd },
+                /* Last, so that the kernel may grow beyond its image in memory */
+                {.name = ".linux", .path = inputs->kernel },
+        };
+        uint8_t *head = NULL;
+        CbmPeLayout pe = { 0 };
+        uint32_t offset = 0;
+        uint32_t vaddr = 0;
+        uint16_t n_added = 0;
+        char *buf = NULL;
+        bool ret = false;
+
+        if (!cbm_mapped_file_open(inputs->stub, stub)) {
+                LOG_ERROR("Cannot read EFI stub %s: %s", inputs->stub, strerror(errno));
+                return false;
+        }
+        if (!cbm_pe_parse((const uint8_t *)stub->buffer, stub->length, &pe) ||
+            pe.data_end > stub->length) {
+                LOG_ERROR("Not a usable EFI stub: %s", inputs->stub);
+                errno = EINVAL;
+                return false;
+        }
+
+        /* Lay the new sections out after everything the stub has */
+        if (!cbm_align(pe.data_end, pe.file_align, &offset) ||
+            !cbm_align(pe.image_end, pe.section_align, &vaddr)) {
+                errno = EFBIG;
+                return false;
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(sections); i++) {
+                CbmUkiSection *s = &sections[i];
+
+                if (s->path) {
+                        if (!cbm_uki_file_size(s->path, &s->size)) {
+                                LOG_ERROR("Cannot read %s: %s", s->path, strerror(errno));
+                                return false;
+                        }
+                } else if (s->data) {
+                        size_t len = strlen(s->data);
+
+                        if (len > UINT32_MAX) {
+                                errno = EFBIG;
+                                return false;
+                        }
+                        s->size = (uint32_t)len;
+                } else {
+                        /* No initrd */
+                        continue;
+                }
+                s->offset = offset;
+                s->vaddr = vaddr;
+                if (!cbm_align(s->size, pe.file_align, &s->raw_size) ||
+                    !cbm_align((uint64_t)offset + s->raw_size, pe.file_align, &offset) ||
+                    !cbm_align((uint64_t)vaddr + s->size, pe.section_align, &vaddr)) {
+                        errno = EFBIG;
+                        return false;
+                }
+                ++n_added;
+        }
+        if ((uint64_t)pe.sections + (uint64_t)(pe.n_sections + n_added) * CBM_PE_SECTION_SIZE >
+            pe.header_room) {
+                LOG_ERROR("No room for more section headers in EFI stub %s", inputs->stub);
+                errno = ENOSPC;
+                return false;
+        }
+
+        /* The stub up to the end of its data, with the new headers */
+        head = malloc(pe.data_end);
+        if (!head) {
+                DECLARE_OOM();
+                abort();
+        }
+        memcpy(head, stub->buffer, pe.data_end);
+        for (size_t i = 0, n = pe.n_sections; i < ARRAY_SIZE(sections); i++) {
+                const CbmUkiSection *s = &sections[i];
+                uint8_t *h = head + pe.sections + n * CBM_PE_SECTION_SIZE;
+
+                if (!s->path && !s->data) {
+                        continue;
+                }
+                memset(h, 0, CBM_PE_SECTION_SIZE);
+                memcpy(h, s->name, strlen(s->name));
+                cbm_put_le32(h + 8, s->size);
+                cbm_put_le32(h + 12, s->vaddr);
+                cbm_put_le32(h + 16, s->raw_size);
+                cbm_put_le32(h + 20, s->offset);
+                cbm_put_le32(h + 36, CBM_PE_SCN_DATA);
+                ++n;
+        }
+        cbm_put_le16(head + pe.opt - 18, (uint16_t)(pe.n_sections + n_added));
+        cbm_put_le32(head + pe.opt + 56, vaddr);
+        /* Neither checksum nor signature match the new image */
+        cbm_put_le32(head + pe.opt + 64, 0);
+        if (pe.security) {
+                memset(head + pe.security, 0, 8);
+        }
+
+        if (!cbm_uki_write_all(fd, head, pe.data_end) ||
+            !cbm_uki_pad(fd, sections[0].offset - pe.data_end)) {
+                goto end;
+        }
+
+        buf = malloc(CBM_UKI_CHUNK);
+        if (!buf) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(sections); i++) {
+                const CbmUkiSection *s = &sections[i];
+
+                if (s->path) {
+                        if (!cbm_uki_stream(fd, s->path, s->size, buf)) {
+                                LOG_ERROR("Failed to stream %s into image: %s",
+                                          s->path,
+                                          strerror(errno));
+                                goto end;
+                        }
+                } else if (s->data) {
+                        if (!cbm_uki_write_all(fd, s->data, s->size)) {
+                                goto end;
+                        }
+                } else {
+                        continue;
+                }
+                /* Each section directly follows the one before */
+                if (!cbm_uki_pad(fd, s->raw_size - s->size)) {
+                        goto end;
+                }
+        }
+        ret = true;
+
+end:
+        free(buf);
+        free(head);
+        return ret;
+}
+
+bool cbm_uki_install(const CbmUkiInputs *inputs, const char *target, bool *changed)
+{
+        char digest[CBM_SHA256_HEX_SIZE];
+        char current[CBM_SHA256_HEX_SIZE];
+        autofree(char) *new_name = NULL;
+        struct stat st = { 0 };
+        bool ok = false;
+        int fd = -1;
+        CBM_TRACE_SCOPE("uki_install");
+
+        if (changed) {
+                *changed = false;
+        }
+        if (!cbm_uki_digest(inputs, digest)) {
+                return false;
+        }
+        if (cbm_uki_get_digest(target, current) && streq(current, digest)) {
+                return true;
+        }
+
+        /* Same dance as copy_file_atomic */
+        new_name = string_printf("%s.TmpWrite", target);
+        fd = cbm_system_open(new_name, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        cbm_stats_inc(CBM_STAT_FILES_CREATED);
+        ok = cbm_uki_assemble(inputs, digest, fd) && cbm_sync_fd(fd);
+        cbm_io_done(fd);
+        if (cbm_system_close(fd) != 0) {
+                ok = false;
+        }
+        if (!ok) {
+                (void)cbm_unlink(new_name);
+                return false;
+        }
+
+        if (cbm_system_stat(target, &st) == 0) {
+                if (cbm_unlink(target) != 0) {
+                        return false;
+                }
+                /* vfat protect, rename isn't atomic so order the removal first */
+                cbm_sync_parent(target);
+        } else {
+                errno = 0;
+        }
+        if (cbm_system_rename(new_name, target) != 0) {
+                return false;
+        }
+        cbm_sync_path(target);
+
+        if (changed) {
+                *changed = true;
+        }
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
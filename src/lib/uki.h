@@ -0,0 +1,81 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "manifest.h"
+#include "sha256.h"
+
+/**
+ * Name of the section recording what an image was assembled from. PE
+ * section names are limited to 8 bytes.
+ */
+#define CBM_UKI_DIGEST_SECTION ".cbmsum"
+
+/**
+ * Everything a unified kernel image is assembled from
+ */
+typedef struct CbmUkiInputs {
+        const char *stub;       /**<EFI stub the image is built upon */
+        const char *kernel;     /**<Kernel, becoming the .linux section */
+        const char *initrd;     /**<Initrd for the .initrd section, or NULL */
+        const char *cmdline;    /**<Complete kernel command line */
+        const char *os_release; /**<Contents of os-release, for the .osrel section */
+        CbmManifest *manifest;  /**<Manifest serving the digests of the files, or NULL */
+} CbmUkiInputs;
+
+/**
+ * Compute the hex encoded SHA-256 identifying @inputs. The digests of the
+ * files come from cbm_manifest_digest, and so are cached by inode while the
+ * manifest of @inputs is open.
+ *
+ * @return True if every input could be read
+ */
+bool cbm_uki_digest(const CbmUkiInputs *inputs, char digest[CBM_SHA256_HEX_SIZE]);
+
+/**
+ * Read the input digest recorded in the image at @path, reading only its
+ * headers and the digest itself
+ *
+ * @return True if @path is an image assembled by cbm_uki_install
+ */
+bool cbm_uki_get_digest(const char *path, char digest[CBM_SHA256_HEX_SIZE]);
+
+/**
+ * Assemble @inputs into a unified kernel image at @target, unless the image
+ * already there was assembled from identical inputs.
+ *
+ * The stub's headers are extended with the .osrel, .cmdline, .initrd and
+ * .linux sections, along with the input digest, and the kernel and initrd
+ * are streamed into place beside @target in a single pass. The image is
+ * flushed before it's renamed over @target. Any signature of the stub is
+ * dropped, as it no longer covers the image.
+ *
+ * @param changed Set to whether @target was written, may be NULL
+ *
+ * @return True if @target is up to date
+ */
+bool cbm_uki_install(const CbmUkiInputs *inputs, const char *target, bool *changed);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,351 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "stats.h"
+#include "system_stub.h"
+#include "uring.h"
+#include "util.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#define CBM_HAVE_RING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+
+/**
+ * Whether rings may be set up. Once the kernel refuses one, no more are
+ * attempted for the lifetime of the process.
+ */
+static struct {
+        pthread_mutex_t lock;
+        bool disabled;    /**<Forbidden by cbm_ring_set_enabled */
+        bool unsupported; /**<Refused by the kernel */
+} cbm_ring_state = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+void cbm_ring_set_enabled(bool enabled)
+{
+        pthread_mutex_lock(&cbm_ring_state.lock);
+        cbm_ring_state.disabled = !enabled;
+        pthread_mutex_unlock(&cbm_ring_state.lock);
+}
+
+#ifdef CBM_HAVE_RING
+
+static bool cbm_ring_usable(void)
+{
+        bool ret = false;
+
+        pthread_mutex_lock(&cbm_ring_state.lock);
+        ret = !cbm_ring_state.disabled && !cbm_ring_state.unsupported;
+        pthread_mutex_unlock(&cbm_ring_state.lock);
+        return ret;
+}
+
+struct CbmRing {
+        int fd;
+        bool broken;         /**<A run failed, nothing more can be queued */
+        unsigned int queued; /**<Operations queued since the last run */
+        unsigned int entries;
+        void *sq_ptr;
+        size_t sq_len;
+        void *cq_ptr;
+        size_t cq_len;
+        struct io_uring_sqe *sqes;
+        size_t sqes_len;
+        unsigned int *sq_tail;
+        unsigned int *sq_mask;
+        unsigned int *sq_array;
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int *cq_mask;
+        struct io_uring_cqe *cqes;
+};
+
+/**
+ * Remember the kernel won't give us rings, and why
+ */
+static void cbm_ring_mark_unsupported(int err)
+{
+        pthread_mutex_lock(&cbm_ring_state.lock);
+        if (!cbm_ring_state.unsupported) {
+                LOG_DEBUG("io_uring is unavailable, using blocking I/O: %s", strerror(err));
+        }
+        cbm_ring_state.unsupported = true;
+        pthread_mutex_unlock(&cbm_ring_state.lock);
+}
+
+void cbm_ring_free(CbmRing *ring)
+{
+        if (!ring) {
+                return;
+        }
+        if (ring->sqes && ring->sqes != MAP_FAILED) {
+                munmap(ring->sqes, ring->sqes_len);
+        }
+        if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+                munmap(ring->cq_ptr, ring->cq_len);
+        }
+        if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) {
+                munmap(ring->sq_ptr, ring->sq_len);
+        }
+        if (ring->fd >= 0) {
+                close(ring->fd);
+        }
+        free(ring);
+}
+
+static void *cbm_ring_map(int fd, size_t len, off_t offset)
+{
+        return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+CbmRing *cbm_ring_new(unsigned int entries)
+{
+        struct io_uring_params params = { 0 };
+        CbmRing *ring = NULL;
+        long fd = -1;
+
+        /* Other backends have no descriptors the kernel knows about */
+        if (!cbm_ring_usable() || !cbm_system_has_native_files()) {
+                return NULL;
+        }
+
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+                /* Also what seccomp and io_uring_disabled answer */
+                if (errno == ENOSYS || errno == EPERM || errno == EACCES || errno == EINVAL) {
+                        cbm_ring_mark_unsupported(errno);
+                }
+                return NULL;
+        }
+        ring = calloc(1, sizeof(CbmRing));
+        if (!ring) {
+                DECLARE_OOM();
+                abort();
+        }
+        ring->fd = (int)fd;
+
+        /* Plain reads arrived along with this feature, in Linux 5.6 */
+        if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+                cbm_ring_mark_unsupported(ENOSYS);
+                goto fail;
+        }
+
+        ring->entries = params.sq_entries;
+        ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_len > ring->sq_len) {
+                        ring->sq_len = ring->cq_len;
+                }
+                ring->cq_len = ring->sq_len;
+        }
+        ring->sq_ptr = cbm_ring_map(ring->fd, ring->sq_len, IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED) {
+                goto fail;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ptr = ring->sq_ptr;
+        } else {
+                ring->cq_ptr = cbm_ring_map(ring->fd, ring->cq_len, IORING_OFF_CQ_RING);
+                if (ring->cq_ptr == MAP_FAILED) {
+                        goto fail;
+                }
+        }
+        ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = cbm_ring_map(ring->fd, ring->sqes_len, (off_t)IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                goto fail;
+        }
+
+        ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.tail);
+        ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.array);
+        ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.head);
+        ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.tail);
+        ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+        return ring;
+
+fail:
+        cbm_ring_free(ring);
+        return NULL;
+}
+
+unsigned int cbm_ring_pending(const CbmRing *ring)
+{
+        return ring->queued;
+}
+
+/**
+ * Claim the next submission slot, with the ordering given by @flags
+ */
+static struct io_uring_sqe *cbm_ring_next(CbmRing *ring, uint8_t opcode, int fd,
+                                          unsigned int flags)
+{
+        struct io_uring_sqe *sqe = NULL;
+        unsigned int tail = 0;
+        unsigned int index = 0;
+
+        if (ring->broken || ring->queued >= ring->entries) {
+                return NULL;
+        }
+        /* Only ever filled from this thread, so the tail is ours to read */
+        tail = *ring->sq_tail;
+        index = tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = ring->queued;
+        if (flags & CBM_RING_LINK) {
+                sqe->flags |= IOSQE_IO_LINK;
+        }
+        if (flags & CBM_RING_DRAIN) {
+                sqe->flags |= IOSQE_IO_DRAIN;
+        }
+        ring->sq_array[index] = index;
+        ++ring->queued;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+}
+
+bool cbm_ring_queue_pread(CbmRing *ring, int fd, void *buf, size_t count, off_t offset,
+                          unsigned int flags)
+{
+        struct io_uring_sqe *sqe = cbm_ring_next(ring, IORING_OP_READ, fd, flags);
+
+        if (!sqe) {
+                return false;
+        }
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)count;
+        sqe->off = (uint64_t)offset;
+        return true;
+}
+
+bool cbm_ring_queue_fsync(CbmRing *ring, int fd, unsigned int flags)
+{
+        return cbm_ring_next(ring, IORING_OP_FSYNC, fd, flags) != NULL;
+}
+
+bool cbm_ring_run(CbmRing *ring, int *results)
+{
+        unsigned int submitted = 0;
+        unsigned int completed = 0;
+
+        if (ring->broken) {
+                return false;
+        }
+
+        while (completed < ring->queued) {
+                unsigned int head = *ring->cq_head;
+                unsigned int tail = 0;
+                long r = 0;
+
+                cbm_stats_inc(CBM_STAT_RING_SUBMITS);
+                r = syscall(__NR_io_uring_enter,
+                            ring->fd,
+                            ring->queued - submitted,
+                            1,
+                            IORING_ENTER_GETEVENTS,
+                            NULL,
+                            0);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        LOG_DEBUG("io_uring submission failed: %s", strerror(errno));
+                        ring->broken = true;
+                        return false;
+                }
+                submitted += (unsigned int)r;
+
+                tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+                        if (cqe->user_data < ring->queued) {
+                                results[cqe->user_data] = cqe->res;
+                        }
+                        ++completed;
+                }
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+        ring->queued = 0;
+        return true;
+}
+
+#else
+
+struct CbmRing {
+        unsigned int queued;
+};
+
+CbmRing *cbm_ring_new(__cbm_unused__ unsigned int entries)
+{
+        return NULL;
+}
+
+void cbm_ring_free(CbmRing *ring)
+{
+        free(ring);
+}
+
+unsigned int cbm_ring_pending(const CbmRing *ring)
+{
+        return ring->queued;
+}
+
+bool cbm_ring_queue_pread(__cbm_unused__ CbmRing *ring, __cbm_unused__ int fd,
+                          __cbm_unused__ void *buf, __cbm_unused__ size_t count,
+                          __cbm_unused__ off_t offset, __cbm_unused__ unsigned int flags)
+{
+        return false;
+}
+
+bool cbm_ring_queue_fsync(__cbm_unused__ CbmRing *ring, __cbm_unused__ int fd,
+                          __cbm_unused__ unsigned int flags)
+{
+        return false;
+}
+
+bool cbm_ring_run(__cbm_unused__ CbmRing *ring, __cbm_unused__ int *results)
+{
+        return false;
+}
+
+#endif
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
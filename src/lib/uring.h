@@ -0,0 +1,106 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "nica/util.h"
+
+/**
+ * Operations queued on a ring before it has to be run
+ */
+#define CBM_RING_ENTRIES 64
+
+/**
+ * How a queued operation is ordered against the others of its batch
+ */
+typedef enum {
+        CBM_RING_NONE = 0,       /**<Free to run alongside everything else */
+        CBM_RING_LINK = 1 << 0,  /**<The next operation waits for this one to succeed */
+        CBM_RING_DRAIN = 1 << 1, /**<Waits for every earlier operation to complete */
+} CbmRingFlags;
+
+/**
+ * An io_uring submitting batches of file operations with a single syscall
+ */
+typedef struct CbmRing CbmRing;
+
+/**
+ * Set up a ring for at most @entries operations at once.
+ *
+ * @return NULL whenever io_uring is unusable: not built in, refused by the
+ * kernel, disabled, or the files aren't native ones (see
+ * cbm_system_has_native_files). Callers then issue the same operations as
+ * blocking calls.
+ */
+CbmRing *cbm_ring_new(unsigned int entries);
+
+/**
+ * Tear down @ring. Anything still queued is dropped.
+ */
+void cbm_ring_free(CbmRing *ring);
+
+/**
+ * Number of operations queued on @ring and not yet run
+ */
+unsigned int cbm_ring_pending(const CbmRing *ring);
+
+/**
+ * Queue a read of @count bytes of @fd at @offset into @buf
+ *
+ * @return False if the ring is full, in which case it must be run first
+ */
+bool cbm_ring_queue_pread(CbmRing *ring, int fd, void *buf, size_t count, off_t offset,
+                          unsigned int flags);
+
+/**
+ * Queue an fsync of @fd
+ *
+ * @return False if the ring is full, in which case it must be run first
+ */
+bool cbm_ring_queue_fsync(CbmRing *ring, int fd, unsigned int flags);
+
+/**
+ * Submit everything queued on @ring and wait for all of it to complete.
+ *
+ * @param results Receives the result of each operation in the order they
+ * were queued: what the blocking call would have returned, or the negated
+ * errno it failed with. Operations skipped due to a failed link get
+ * -ECANCELED.
+ *
+ * @return False if the ring itself failed, leaving @results undefined
+ */
+bool cbm_ring_run(CbmRing *ring, int *results);
+
+/**
+ * Allow or forbid the use of io_uring, i.e. to exercise the fallbacks.
+ * Allowed by default.
+ */
+void cbm_ring_set_enabled(bool enabled);
+
+DEF_AUTOFREE(CbmRing, cbm_ring_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -17,26 +17,64 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-bool cbm_writer_open(CbmWriter *writer)
+#include "files.h"
+#include "stage.h"
+
+/**
+ * Room for a typical loader entry
+ */
+#define CBM_WRITER_DEFAULT_SIZE 256
+
+/**
+ * Ensure there's room for @n more bytes plus the terminator
+ */
+static bool cbm_writer_reserve(CbmWriter *self, size_t n)
+{
+        size_t need = self->buffer_n + n + 1;
+        char *buffer = NULL;
+
+        if (need <= self->alloc) {
+                return true;
+        }
+        if (need < self->alloc * 2) {
+                need = self->alloc * 2;
+        }
+        buffer = realloc(self->buffer, need);
+        if (!buffer) {
+                self->error = ENOMEM;
+                return false;
+        }
+        self->buffer = buffer;
+        self->alloc = need;
+        return true;
+}
+
+bool cbm_writer_open_sized(CbmWriter *writer, size_t hint)
 {
         if (!writer) {
                 return false;
         }
 
-        if (writer->buffer || writer->memstream) {
+        if (writer->buffer || writer->open) {
                 return false;
         }
 
-        writer->memstream = open_memstream(&writer->buffer, &writer->buffer_n);
-        if (!writer->memstream) {
-                writer->error = ENOMEM;
+        if (!cbm_writer_reserve(writer, hint)) {
                 return false;
         }
+        writer->buffer[0] = '\0';
+        writer->open = true;
 
         return true;
 }
 
+bool cbm_writer_open(CbmWriter *writer)
+{
+        return cbm_writer_open_sized(writer, CBM_WRITER_DEFAULT_SIZE);
+}
+
 void cbm_writer_free(CbmWriter *self)
 {
         if (!self) {
@@ -51,49 +89,92 @@ void cbm_writer_close(CbmWriter *self)
         if (!self) {
                 return;
         }
-        if (!self->memstream) {
-                return;
-        }
-        fclose(self->memstream);
-        self->memstream = NULL;
+        self->open = false;
 }
 
-void cbm_writer_append(CbmWriter *self, const char *s)
+/**
+ * Check that appending is possible at all
+ */
+static bool cbm_writer_can_append(CbmWriter *self)
 {
         if (!self || self->error != 0) {
-                return;
+                return false;
         }
 
-        /* Set EBADF as we tried to use a closed memstream */
-        if (!self->memstream) {
+        /* Set EBADF as we tried to use a closed writer */
+        if (!self->open) {
                 self->error = EBADF;
-                return;
-        }
-
-        if (fprintf(self->memstream, "%s", s) < 0) {
-                self->error = errno;
+                return false;
         }
+        return true;
 }
 
-void cbm_writer_append_printf(CbmWriter *self, const char *fmt, ...)
+void cbm_writer_append(CbmWriter *self, const char *s)
 {
-        if (!self || self->error != 0) {
+        size_t len = 0;
+
+        if (!cbm_writer_can_append(self)) {
                 return;
         }
 
-        /* Set EBADF as we tried to use a closed memstream */
-        if (!self->memstream) {
-                self->error = EBADF;
+        len = strlen(s);
+        if (!cbm_writer_reserve(self, len)) {
                 return;
         }
+        memcpy(self->buffer + self->buffer_n, s, len + 1);
+        self->buffer_n += len;
+}
 
+void cbm_writer_append_printf(CbmWriter *self, const char *fmt, ...)
+{
         va_list va;
+        va_list retry;
+        size_t room = 0;
+        int len = 0;
 
+        if (!cbm_writer_can_append(self)) {
+                return;
+        }
+
+        /* Format straight into the free space, growing once if it won't fit */
+        room = self->alloc - self->buffer_n;
         va_start(va, fmt);
-        if (vfprintf(self->memstream, fmt, va) < 0) {
-                self->error = errno;
+        va_copy(retry, va);
+        len = vsnprintf(self->buffer + self->buffer_n, room, fmt, va);
+        if (len >= 0 && (size_t)len >= room) {
+                if (cbm_writer_reserve(self, (size_t)len)) {
+                        room = self->alloc - self->buffer_n;
+                        len = vsnprintf(self->buffer + self->buffer_n, room, fmt, retry);
+                } else {
+                        /* Drop the truncated output */
+                        self->buffer[self->buffer_n] = '\0';
+                        len = 0;
+                }
         }
+        va_end(retry);
         va_end(va);
+
+        if (len < 0) {
+                self->error = errno ? errno : EINVAL;
+                self->buffer[self->buffer_n] = '\0';
+                return;
+        }
+        self->buffer_n += (size_t)len;
+}
+
+void cbm_writer_append_json_string(CbmWriter *self, const char *s)
+{
+        cbm_writer_append(self, "\"");
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\') {
+                        cbm_writer_append_printf(self, "\\%c", *s);
+                } else if ((unsigned char)*s < 0x20) {
+                        cbm_writer_append_printf(self, "\\u%04x", (unsigned int)(unsigned char)*s);
+                } else {
+                        cbm_writer_append_printf(self, "%c", *s);
+                }
+        }
+        cbm_writer_append(self, "\"");
 }
 
 int cbm_writer_error(CbmWriter *self)
@@ -105,6 +186,62 @@ int cbm_writer_error(CbmWriter *self)
         return ENOMEM;
 }
 
+bool cbm_writer_matches_file(CbmWriter *self, CbmStage *stage, const char *path)
+{
+        autofree(CbmMappedFile) *mapped = CBM_MAPPED_FILE_INIT;
+        autofree(char) *staged = NULL;
+        struct stat st = { 0 };
+
+        if (!self || !self->buffer || self->error != 0) {
+                return false;
+        }
+
+        /* Compare against what @path is about to become */
+        staged = cbm_stage_resolve(stage, path);
+        if (staged) {
+                path = staged;
+        }
+
+        /* Sizes first, empty files can't be mapped */
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+            (size_t)st.st_size != self->buffer_n) {
+                return false;
+        }
+        if (self->buffer_n == 0) {
+                return true;
+        }
+
+        if (!cbm_mapped_file_open(path, mapped) || mapped->length != self->buffer_n) {
+                return false;
+        }
+        return memcmp(mapped->buffer, self->buffer, self->buffer_n) == 0;
+}
+
+bool cbm_writer_commit_if_changed(CbmWriter *self, CbmStage *stage, const char *path,
+                                  bool *changed)
+{
+        if (changed) {
+                *changed = false;
+        }
+
+        cbm_writer_close(self);
+        if (cbm_writer_error(self) != 0 || !self->buffer) {
+                return false;
+        }
+
+        if (cbm_writer_matches_file(self, stage, path)) {
+                return true;
+        }
+
+        if (!file_set_text_staged(stage, path, self->buffer)) {
+                return false;
+        }
+        if (changed) {
+                *changed = true;
+        }
+        return true;
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
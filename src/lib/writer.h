@@ -15,10 +15,16 @@
 
 #define _GNU_SOURCE
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "stage.h"
+
 typedef struct CbmWriter {
-        FILE *memstream;
-        char *buffer;
-        size_t buffer_n;
+        char *buffer;    /**<Contents, always NUL terminated once opened */
+        size_t buffer_n; /**<Length of the contents */
+        size_t alloc;    /**<Allocated size of buffer */
+        bool open;       /**<Whether appends are still possible */
         int error;
 } CbmWriter;
 
@@ -29,6 +35,12 @@ typedef struct CbmWriter {
  */
 bool cbm_writer_open(CbmWriter *writer);
 
+/**
+ * Construct a new CbmWriter, reserving room for @hint bytes of output up
+ * front so that typically sized output never needs to grow the buffer.
+ */
+bool cbm_writer_open_sized(CbmWriter *writer, size_t hint);
+
 /**
  * Clean up a previously allocated CbmWriter
  */
@@ -51,6 +63,12 @@ void cbm_writer_append(CbmWriter *writer, const char *s);
 void cbm_writer_append_printf(CbmWriter *writer, const char *fmt, ...)
     __attribute__((format(printf, 2, 3)));
 
+/**
+ * Append @s as a quoted JSON string. Paths come from the filesystem, so
+ * anything may need escaping.
+ */
+void cbm_writer_append_json_string(CbmWriter *writer, const char *s);
+
 /**
  * Return an error that may exist in the stream, otherwise 0.
  * This allows utilising CbmWriter in a failsafe fashion, and checking the
@@ -58,6 +76,27 @@ void cbm_writer_append_printf(CbmWriter *writer, const char *fmt, ...)
  */
 int cbm_writer_error(CbmWriter *writer);
 
+/**
+ * Determine if the file at @path already holds exactly the contents of
+ * @writer. The file is compared in place, without reading it into memory.
+ *
+ * @param stage Staging @path may be written through, compared instead if
+ * it has been staged already, or NULL
+ */
+bool cbm_writer_matches_file(CbmWriter *writer, CbmStage *stage, const char *path);
+
+/**
+ * Close @writer and write its contents to @path with file_set_text_staged,
+ * unless @path already holds exactly those contents. An unchanged file is
+ * neither written nor flushed.
+ *
+ * @param stage Staging to write @path through, or NULL
+ * @param changed Set to whether @path was (re)written, may be NULL
+ * @return False if the writer is in error or the file couldn't be written
+ */
+bool cbm_writer_commit_if_changed(CbmWriter *writer, CbmStage *stage, const char *path,
+                                  bool *changed);
+
 /* Convenience: Automatically clean up the CbmWriter */
 DEF_AUTOFREE(CbmWriter, cbm_writer_free)
 
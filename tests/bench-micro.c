@@ -0,0 +1,791 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/**
+ * Microbenchmarks for the primitives run once per kernel or per file.
+ *
+ * Each benchmark is calibrated to a number of operations filling the round
+ * time, and then run for a number of rounds with that same count. The
+ * median round is reported as nanoseconds per operation, along with the
+ * allocations, bytes allocated and bytes read and written per operation.
+ * Allocations are counted by wrapping malloc and friends in this
+ * executable, I/O as accounted by /proc/self/io.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "cmdline.h"
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+#include "os-release.h"
+#include "util.h"
+#include "writer.h"
+
+#include "blkid-harness.h"
+#include "harness.h"
+#include "system-harness.h"
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+#define SCRATCH_DIR TOP_BUILD_DIR "/micro"
+
+/**
+ * Version of the JSON output, bumped whenever a field changes meaning
+ */
+#define BENCH_JSON_VERSION 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/**
+ * Every allocation made by the process, whichever thread made it
+ */
+static struct {
+        uint64_t count;
+        uint64_t bytes;
+} bench_allocs;
+
+static void bench_count_alloc(size_t size)
+{
+        __atomic_add_fetch(&bench_allocs.count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bench_allocs.bytes, (uint64_t)size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+        bench_count_alloc(size);
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+        bench_count_alloc(nmemb * size);
+        return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+        bench_count_alloc(size);
+        return __libc_realloc(ptr, size);
+}
+
+/**
+ * Counters sampled before and after a round
+ */
+typedef struct BenchCounters {
+        uint64_t ns;
+        uint64_t allocs;
+        uint64_t alloc_bytes;
+        unsigned long long rchar;
+        unsigned long long wchar;
+} BenchCounters;
+
+/**
+ * Outcome of a single benchmark
+ */
+typedef struct BenchResult {
+        uint64_t ops;          /**<Operations in each round */
+        double ns_min;         /**<Fastest round */
+        double ns_median;      /**<Median round */
+        double allocs;         /**<Allocations */
+        double alloc_bytes;    /**<Bytes allocated */
+        double read_bytes;     /**<Bytes read */
+        double write_bytes;    /**<Bytes written */
+} BenchResult;
+
+/**
+ * Whatever a benchmark set up for its operations
+ */
+typedef struct BenchState {
+        const struct MicroBench *bench;
+        BootManager *manager;
+        KernelArray *kernels;
+        const Kernel *kernel;
+        char *path;
+        char *other;
+} BenchState;
+
+/**
+ * A benchmark, running one operation per call of @run
+ */
+typedef struct MicroBench {
+        const char *name;
+        bool (*setup)(BenchState *state);
+        bool (*run)(BenchState *state);
+        size_t kib; /**<Size of the files it works on, if any */
+} MicroBench;
+
+static uint64_t bench_now_ns(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_io(BenchCounters *counters)
+{
+        char key[32];
+        unsigned long long value = 0;
+        FILE *fp = NULL;
+
+        fp = fopen("/proc/self/io", "r");
+        if (!fp) {
+                return;
+        }
+        while (fscanf(fp, "%31[^:]: %llu\n", key, &value) == 2) {
+                if (streq(key, "rchar")) {
+                        counters->rchar = value;
+                } else if (streq(key, "wchar")) {
+                        counters->wchar = value;
+                }
+        }
+        fclose(fp);
+}
+
+/**
+ * Sample every counter, so that sampling them costs the round nothing
+ */
+static void bench_sample(BenchCounters *counters, bool begin)
+{
+        if (begin) {
+                bench_io(counters);
+                counters->allocs = __atomic_load_n(&bench_allocs.count, __ATOMIC_RELAXED);
+                counters->alloc_bytes = __atomic_load_n(&bench_allocs.bytes, __ATOMIC_RELAXED);
+                counters->ns = bench_now_ns();
+                return;
+        }
+        counters->ns = bench_now_ns();
+        counters->allocs = __atomic_load_n(&bench_allocs.count, __ATOMIC_RELAXED);
+        counters->alloc_bytes = __atomic_load_n(&bench_allocs.bytes, __ATOMIC_RELAXED);
+        bench_io(counters);
+}
+
+/**
+ * Replace @path with @kib KiB of data
+ */
+static bool bench_write_file(const char *path, size_t kib, unsigned int seed)
+{
+        char buf[1024];
+        int fd = -1;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        for (size_t i = 0; i < kib; i++) {
+                for (size_t j = 0; j < sizeof(buf); j++) {
+                        seed = seed * 1103515245 + 12345;
+                        buf[j] = (char)(seed >> 16);
+                }
+                if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+                        close(fd);
+                        return false;
+                }
+        }
+        return close(fd) == 0;
+}
+
+static bool bench_copy_data(const char *name, const char *target)
+{
+        autofree(char) *source = string_printf("%s/tests/data/%s", TOP_DIR, name);
+
+        return copy_file_atomic(source, target, 00644);
+}
+
+static bool bench_setup_cmdline_file(BenchState *state)
+{
+        state->path = string_printf("%s/cmdline", SCRATCH_DIR);
+        return bench_copy_data("cmdline/mangledmess", state->path);
+}
+
+static bool bench_cmdline_file(BenchState *state)
+{
+        autofree(char) *cmdline = cbm_parse_cmdline_file(state->path);
+
+        return cmdline != NULL;
+}
+
+/**
+ * A root with a cmdline file and fragments in both cmdline.d directories
+ */
+static bool bench_setup_cmdline_files(BenchState *state)
+{
+        autofree(char) *conf = NULL;
+        autofree(char) *vendor = NULL;
+
+        state->path = string_printf("%s/cmdline-root", SCRATCH_DIR);
+        conf = string_printf("%s/%s/cmdline.d", state->path, KERNEL_CONF_DIRECTORY);
+        vendor = string_printf("%s/%s/cmdline.d", state->path, VENDOR_KERNEL_CONF_DIRECTORY);
+        if (!nc_mkdir_p(conf, 00755) || !nc_mkdir_p(vendor, 00755)) {
+                return false;
+        }
+        for (size_t i = 0; i < 8; i++) {
+                autofree(char) *path = string_printf("%s/bench-%zu.conf", i < 4 ? conf : vendor, i);
+                autofree(char) *text = string_printf("# Fragment %zu\nbench.option%zu=%zu\n",
+                                                     i,
+                                                     i,
+                                                     i);
+
+                if (!file_set_text(path, text)) {
+                        return false;
+                }
+        }
+        state->other = string_printf("%s/%s/cmdline", state->path, KERNEL_CONF_DIRECTORY);
+        return bench_copy_data("etc/kernel/cmdline", state->other);
+}
+
+static bool bench_cmdline_files(BenchState *state)
+{
+        autofree(char) *cmdline = cbm_parse_cmdline_files(state->path);
+
+        return cmdline != NULL;
+}
+
+static bool bench_setup_os_release(BenchState *state)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *path = NULL;
+
+        state->path = string_printf("%s/os-release-root", SCRATCH_DIR);
+        dir = string_printf("%s/usr/lib", state->path);
+        path = string_printf("%s/os-release", dir);
+        return nc_mkdir_p(dir, 00755) && bench_copy_data("clear.os-release", path);
+}
+
+static bool bench_os_release(BenchState *state)
+{
+        CbmOsRelease *os_release = cbm_os_release_new_for_root(state->path);
+
+        if (!os_release) {
+                return false;
+        }
+        cbm_os_release_free(os_release);
+        return true;
+}
+
+/**
+ * Build a document of about 4 KiB from short appends, as a loader entry
+ * or config file is
+ */
+static bool bench_writer_append(__cbm_unused__ BenchState *state)
+{
+        CbmWriter writer = { 0 };
+        bool ret = false;
+
+        if (!cbm_writer_open(&writer)) {
+                return false;
+        }
+        for (int i = 0; i < 64; i++) {
+                cbm_writer_append(&writer,
+                                  "options root=PARTUUID=0000 quiet console=tty0 rw rootwait\n");
+        }
+        cbm_writer_close(&writer);
+        ret = cbm_writer_error(&writer) == 0;
+        cbm_writer_free(&writer);
+        return ret;
+}
+
+static bool bench_writer_append_printf(__cbm_unused__ BenchState *state)
+{
+        CbmWriter writer = { 0 };
+        bool ret = false;
+
+        if (!cbm_writer_open(&writer)) {
+                return false;
+        }
+        for (int i = 0; i < 64; i++) {
+                cbm_writer_append_printf(&writer,
+                                         "linux /EFI/%s/%s.native.4.2.%d-%d\n",
+                                         KERNEL_NAMESPACE,
+                                         KERNEL_NAMESPACE,
+                                         i,
+                                         100 + i);
+        }
+        cbm_writer_close(&writer);
+        ret = cbm_writer_error(&writer) == 0;
+        cbm_writer_free(&writer);
+        return ret;
+}
+
+/**
+ * Two identical files of the benchmark's size
+ */
+static bool bench_setup_pair(BenchState *state)
+{
+        state->path = string_printf("%s/%s-a", SCRATCH_DIR, state->bench->name);
+        state->other = string_printf("%s/%s-b", SCRATCH_DIR, state->bench->name);
+        return bench_write_file(state->path, state->bench->kib, 1) &&
+               bench_write_file(state->other, state->bench->kib, 1);
+}
+
+static bool bench_files_match(BenchState *state)
+{
+        return cbm_files_match(state->path, state->other);
+}
+
+static bool bench_copy_atomic(BenchState *state)
+{
+        return copy_file_atomic(state->path, state->other, 00644);
+}
+
+static bool bench_parse_system_kernel(__cbm_unused__ BenchState *state)
+{
+        SystemKernel kernel = { 0 };
+
+        return cbm_parse_system_kernel("4.2.1-121.kvm", &kernel);
+}
+
+static PlaygroundKernel bench_kernels[] = {
+        { "4.2.1", "kvm", 121, false, false },    { "4.2.3", "kvm", 124, true, false },
+        { "4.2.1", "native", 137, false, false }, { "4.2.3", "native", 138, true, false },
+        { "4.2.1", "lts", 201, false, false },    { "4.2.3", "lts", 205, true, false },
+        { "4.2.1", "hyperv", 301, false, false }, { "4.2.3", "hyperv", 302, true, false },
+};
+
+/**
+ * A playground whose kernels are discovered once, up front
+ */
+static bool bench_setup_kernels(BenchState *state, bool uefi)
+{
+        PlaygroundConfig config = { "4.2.1-121.kvm",
+                                    bench_kernels,
+                                    ARRAY_SIZE(bench_kernels),
+                                    .uefi = uefi,
+                                    .disable_modules = true };
+
+        state->manager = prepare_playground(&config);
+        if (!state->manager) {
+                return false;
+        }
+        state->kernels = boot_manager_get_kernels(state->manager);
+        return state->kernels && state->kernels->len == ARRAY_SIZE(bench_kernels);
+}
+
+static bool bench_setup_map_kernels(BenchState *state)
+{
+        return bench_setup_kernels(state, true);
+}
+
+static bool bench_map_kernels(BenchState *state)
+{
+        NcHashmap *map = boot_manager_map_kernels(state->manager, state->kernels);
+
+        if (!map) {
+                return false;
+        }
+        nc_hashmap_free(map);
+        return true;
+}
+
+/**
+ * The GRUB2 probes only ever find a UUID
+ */
+static int bench_grub2_lookup_value(__cbm_unused__ blkid_probe pr, const char *name,
+                                    const char **data, size_t *len)
+{
+        if (!name || !data || !streq(name, "UUID")) {
+                return -1;
+        }
+        *data = DEFAULT_UUID;
+        if (len) {
+                *len = strlen(*data);
+        }
+        return 0;
+}
+
+/**
+ * A GRUB2 root writing its own entries, already updated once so that
+ * every further operation only regenerates and compares them
+ */
+static bool bench_setup_grub2(BenchState *state)
+{
+        static CbmBlkidOps blkid_ops;
+
+        blkid_ops = BlkidTestOps;
+        blkid_ops.probe_lookup_value = bench_grub2_lookup_value;
+        cbm_blkid_set_vtable(&blkid_ops);
+
+        if (!bench_setup_kernels(state, false)) {
+                return false;
+        }
+        if (!file_set_text(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/grub2-native", "")) {
+                return false;
+        }
+        boot_manager_set_image_mode(state->manager, false);
+        if (!boot_manager_update(state->manager)) {
+                return false;
+        }
+        state->kernel = boot_manager_get_default_for_type(state->manager,
+                                                          state->kernels,
+                                                          "kvm");
+        return state->kernel != NULL;
+}
+
+/**
+ * Write the menu entries of every installed kernel through
+ * grub2_write_kernel, which only the backend can call directly
+ */
+static bool bench_grub2_entries(BenchState *state)
+{
+        return boot_manager_set_default_kernel(state->manager, state->kernel);
+}
+
+static const MicroBench bench_list[] = {
+        { "cmdline-file", bench_setup_cmdline_file, bench_cmdline_file, 0 },
+        { "cmdline-files", bench_setup_cmdline_files, bench_cmdline_files, 0 },
+        { "os-release", bench_setup_os_release, bench_os_release, 0 },
+        { "writer-append", NULL, bench_writer_append, 0 },
+        { "writer-append-printf", NULL, bench_writer_append_printf, 0 },
+        { "files-match-4k", bench_setup_pair, bench_files_match, 4 },
+        { "files-match-1m", bench_setup_pair, bench_files_match, 1024 },
+        { "files-match-16m", bench_setup_pair, bench_files_match, 16384 },
+        { "copy-atomic-4k", bench_setup_pair, bench_copy_atomic, 4 },
+        { "copy-atomic-1m", bench_setup_pair, bench_copy_atomic, 1024 },
+        { "parse-system-kernel", NULL, bench_parse_system_kernel, 0 },
+        { "map-kernels", bench_setup_map_kernels, bench_map_kernels, 0 },
+        { "grub2-entries", bench_setup_grub2, bench_grub2_entries, 0 },
+};
+
+static void bench_state_free(BenchState *state)
+{
+        if (state->kernels) {
+                kernel_array_free(state->kernels);
+        }
+        if (state->manager) {
+                boot_manager_free(state->manager);
+        }
+        free(state->path);
+        free(state->other);
+        memset(state, 0, sizeof(*state));
+        cbm_blkid_set_vtable(&BlkidTestOps);
+}
+
+/**
+ * Run @ops operations, filling in @sample with the difference of every
+ * counter
+ */
+static bool bench_round(BenchState *state, uint64_t ops, BenchCounters *sample)
+{
+        BenchCounters begin = { 0 };
+        BenchCounters end = { 0 };
+
+        bench_sample(&begin, true);
+        for (uint64_t i = 0; i < ops; i++) {
+                if (!state->bench->run(state)) {
+                        return false;
+                }
+        }
+        bench_sample(&end, false);
+
+        sample->ns = end.ns - begin.ns;
+        sample->allocs = end.allocs - begin.allocs;
+        sample->alloc_bytes = end.alloc_bytes - begin.alloc_bytes;
+        sample->rchar = end.rchar - begin.rchar;
+        sample->wchar = end.wchar - begin.wchar;
+        return true;
+}
+
+static int bench_compare_rounds(const void *a, const void *b)
+{
+        const BenchCounters *ca = a;
+        const BenchCounters *cb = b;
+
+        if (ca->ns < cb->ns) {
+                return -1;
+        }
+        return ca->ns > cb->ns ? 1 : 0;
+}
+
+/**
+ * Calibrate and then run @bench for @rounds rounds of about @round_ns each
+ */
+static bool bench_run(const MicroBench *bench, size_t rounds, uint64_t round_ns, uint64_t ops,
+                      BenchResult *result)
+{
+        BenchState state = {.bench = bench };
+        BenchCounters *samples = NULL;
+        const BenchCounters *median = NULL;
+        bool ret = false;
+
+        if (bench->setup && !bench->setup(&state)) {
+                fprintf(stderr, "%s: setup failed\n", bench->name);
+                goto done;
+        }
+
+        /* Warms the caches, and finds how many operations fill a round */
+        if (ops == 0) {
+                BenchCounters sample = { 0 };
+
+                ops = 1;
+                for (;;) {
+                        if (!bench_round(&state, ops, &sample)) {
+                                fprintf(stderr, "%s: failed during calibration\n", bench->name);
+                                goto done;
+                        }
+                        if (sample.ns >= round_ns / 8 || ops >= UINT32_MAX) {
+                                break;
+                        }
+                        ops *= 2;
+                }
+                ops = sample.ns ? (uint64_t)((double)ops * (double)round_ns / (double)sample.ns)
+                                : ops;
+                if (ops == 0) {
+                        ops = 1;
+                }
+        }
+
+        samples = calloc(rounds, sizeof(BenchCounters));
+        if (!samples) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (size_t i = 0; i < rounds; i++) {
+                if (!bench_round(&state, ops, &samples[i])) {
+                        fprintf(stderr, "%s: failed in round %zu\n", bench->name, i);
+                        goto done;
+                }
+        }
+
+        qsort(samples, rounds, sizeof(BenchCounters), bench_compare_rounds);
+        median = &samples[rounds / 2];
+        *result = (BenchResult){
+                .ops = ops,
+                .ns_min = (double)samples[0].ns / (double)ops,
+                .ns_median = (double)median->ns / (double)ops,
+                .allocs = (double)median->allocs / (double)ops,
+                .alloc_bytes = (double)median->alloc_bytes / (double)ops,
+                .read_bytes = (double)median->rchar / (double)ops,
+                .write_bytes = (double)median->wchar / (double)ops,
+        };
+        ret = true;
+
+done:
+        free(samples);
+        bench_state_free(&state);
+        return ret;
+}
+
+static void bench_print_text(const MicroBench *bench, const BenchResult *result)
+{
+        printf("%-22s %10" PRIu64 " %12.1f %12.1f %10.2f %12.1f %12.1f %12.1f\n",
+               bench->name,
+               result->ops,
+               result->ns_min,
+               result->ns_median,
+               result->allocs,
+               result->alloc_bytes,
+               result->read_bytes,
+               result->write_bytes);
+}
+
+/**
+ * One object per line, keys always in the same order, so that runs may be
+ * compared with diff or line oriented tools
+ */
+static void bench_print_json(const MicroBench *bench, const BenchResult *result, bool first)
+{
+        printf("%s\n{\"name\":\"%s\",\"ops\":%" PRIu64
+               ",\"ns_per_op\":%.1f,\"ns_per_op_min\":%.1f,\"allocs_per_op\":%.2f"
+               ",\"alloc_bytes_per_op\":%.1f,\"read_bytes_per_op\":%.1f"
+               ",\"write_bytes_per_op\":%.1f}",
+               first ? "" : ",",
+               bench->name,
+               result->ops,
+               result->ns_median,
+               result->ns_min,
+               result->allocs,
+               result->alloc_bytes,
+               result->read_bytes,
+               result->write_bytes);
+}
+
+static void bench_usage(const char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-r rounds] [-t round-ms] [-n ops] [-j] [-l] [-v] [NAME...]\n"
+                "\n"
+                "  -n  Run exactly this many operations per round, skipping calibration\n"
+                "  -j  Print the results as JSON\n"
+                "  -l  List the benchmarks\n"
+                "  -v  Show log messages from clr-boot-manager\n"
+                "\n"
+                "Only the benchmarks whose names begin with one of the NAMEs are run.\n",
+                progname);
+}
+
+static bool bench_parse_count(const char *arg, uint64_t *out)
+{
+        char *end = NULL;
+        unsigned long long v = 0;
+
+        errno = 0;
+        v = strtoull(arg, &end, 10);
+        if (errno != 0 || end == arg || *end != '\0') {
+                return false;
+        }
+        *out = (uint64_t)v;
+        return true;
+}
+
+static bool bench_selected(const MicroBench *bench, int argc, char **argv)
+{
+        if (argc == 0) {
+                return true;
+        }
+        for (int i = 0; i < argc; i++) {
+                if (strncmp(bench->name, argv[i], strlen(argv[i])) == 0) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+int main(int argc, char **argv)
+{
+        uint64_t rounds = 5;
+        uint64_t round_ms = 50;
+        uint64_t ops = 0;
+        bool json = false;
+        bool verbose = false;
+        bool first = true;
+        FILE *log = NULL;
+        bool ok = true;
+        int c = 0;
+
+        while ((c = getopt(argc, argv, "r:t:n:jlvh")) != -1) {
+                uint64_t *target = NULL;
+
+                switch (c) {
+                case 'r':
+                        target = &rounds;
+                        break;
+                case 't':
+                        target = &round_ms;
+                        break;
+                case 'n':
+                        target = &ops;
+                        break;
+                case 'j':
+                        json = true;
+                        continue;
+                case 'l':
+                        for (size_t i = 0; i < ARRAY_SIZE(bench_list); i++) {
+                                printf("%s\n", bench_list[i].name);
+                        }
+                        return EXIT_SUCCESS;
+                case 'v':
+                        verbose = true;
+                        continue;
+                case 'h':
+                        bench_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        bench_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                if (!bench_parse_count(optarg, target)) {
+                        fprintf(stderr, "Invalid value for -%c: %s\n", c, optarg);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (rounds == 0 || round_ms == 0) {
+                fprintf(stderr, "Rounds and the round time must be non-zero\n");
+                return EXIT_FAILURE;
+        }
+
+        /* Logging would only skew the results */
+        log = verbose ? stderr : fopen("/dev/null", "w");
+        cbm_set_sync_filesystems(false);
+        cbm_log_init(log ? log : stderr);
+        setenv("CBM_BOOTVAR_TEST_MODE", "yes", 1);
+        cbm_blkid_set_vtable(&BlkidTestOps);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        if (!nc_mkdir_p(SCRATCH_DIR, 00755)) {
+                fprintf(stderr, "Unable to create %s: %s\n", SCRATCH_DIR, strerror(errno));
+                return EXIT_FAILURE;
+        }
+
+        if (json) {
+                printf("{\"version\":%d,\"rounds\":%" PRIu64 ",\"benchmarks\":[",
+                       BENCH_JSON_VERSION,
+                       rounds);
+        } else {
+                printf("# %" PRIu64 " rounds of %" PRIu64 " ms\n", rounds, round_ms);
+                printf("%-22s %10s %12s %12s %10s %12s %12s %12s\n",
+                       "# benchmark",
+                       "ops",
+                       "min-ns/op",
+                       "ns/op",
+                       "allocs/op",
+                       "alloc-B/op",
+                       "read-B/op",
+                       "write-B/op");
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(bench_list); i++) {
+                const MicroBench *bench = &bench_list[i];
+                BenchResult result = { 0 };
+
+                if (!bench_selected(bench, argc - optind, argv + optind)) {
+                        continue;
+                }
+                if (!bench_run(bench, (size_t)rounds, round_ms * 1000000ULL, ops, &result)) {
+                        ok = false;
+                        continue;
+                }
+                if (json) {
+                        bench_print_json(bench, &result, first);
+                } else {
+                        bench_print_text(bench, &result);
+                }
+                first = false;
+                fflush(stdout);
+        }
+        if (json) {
+                printf("\n]}\n");
+        }
+
+        if (log && log != stderr) {
+                fclose(log);
+        }
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,566 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2017 Intel Corporation
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+/**
+ * Synthetic benchmarks for the update path.
+ *
+ * A fake root is generated with a configurable number of kernels spread
+ * over a number of kernel types, with blobs of a given size, and any number
+ * of cmdline.d fragments. Each scenario is run several times, reporting the
+ * median wall time along with the I/O performed as accounted by
+ * /proc/self/io.
+ */
+
+#define _GNU_SOURCE
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootloader.h"
+#include "bootman.h"
+#include "config.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "util.h"
+
+#include "blkid-harness.h"
+#include "harness.h"
+#include "system-harness.h"
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+
+/**
+ * Shape of the generated root
+ */
+typedef struct BenchConfig {
+        size_t kernels;      /**<Kernels per type */
+        size_t types;        /**<Number of kernel types */
+        size_t kernel_kib;   /**<Size of each kernel blob */
+        size_t initrd_kib;   /**<Size of each initrd */
+        size_t fragments;    /**<Number of cmdline.d fragments */
+        size_t rounds;       /**<Repetitions of each scenario */
+        bool uefi;           /**<UEFI (systemd class) or legacy (syslinux) */
+} BenchConfig;
+
+/**
+ * Cost of a single measured operation
+ */
+typedef struct BenchSample {
+        double wall_ms;       /**<Elapsed wall time */
+        unsigned long long rchar;  /**<Bytes read */
+        unsigned long long wchar;  /**<Bytes written */
+        unsigned long long syscr;  /**<read-like syscalls */
+        unsigned long long syscw;  /**<write-like syscalls */
+} BenchSample;
+
+/**
+ * Generated state for one round
+ */
+typedef struct BenchRoot {
+        PlaygroundKernel *kernels;
+        char **versions;
+        char **ktypes;
+        size_t n_kernels;
+        char *uts_name;
+        PlaygroundConfig config;
+} BenchRoot;
+
+typedef bool (*bench_func)(BootManager *manager, BenchSample *sample);
+
+static double bench_now_ms(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Snapshot the I/O accounting for this process
+ */
+static void bench_io(BenchSample *sample)
+{
+        autofree(FILE) *fp = NULL;
+        char key[32];
+        unsigned long long value = 0;
+
+        memset(sample, 0, sizeof(*sample));
+        fp = fopen("/proc/self/io", "r");
+        if (!fp) {
+                return;
+        }
+        while (fscanf(fp, "%31[^:]: %llu\n", key, &value) == 2) {
+                if (streq(key, "rchar")) {
+                        sample->rchar = value;
+                } else if (streq(key, "wchar")) {
+                        sample->wchar = value;
+                } else if (streq(key, "syscr")) {
+                        sample->syscr = value;
+                } else if (streq(key, "syscw")) {
+                        sample->syscw = value;
+                }
+        }
+}
+
+static void bench_begin(BenchSample *sample)
+{
+        bench_io(sample);
+        sample->wall_ms = bench_now_ms();
+}
+
+static void bench_end(BenchSample *sample)
+{
+        BenchSample now = { 0 };
+        double end = bench_now_ms();
+
+        bench_io(&now);
+        sample->wall_ms = end - sample->wall_ms;
+        sample->rchar = now.rchar - sample->rchar;
+        sample->wchar = now.wchar - sample->wchar;
+        sample->syscr = now.syscr - sample->syscr;
+        sample->syscw = now.syscw - sample->syscw;
+}
+
+/**
+ * Replace @path with @kib KiB of data that differs between blobs, so that
+ * nothing may be deduplicated or compared early.
+ */
+static bool bench_write_blob(const char *path, size_t kib, unsigned int seed)
+{
+        char buf[1024];
+        int fd = -1;
+
+        if (kib == 0) {
+                return true;
+        }
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        for (size_t i = 0; i < kib; i++) {
+                for (size_t j = 0; j < sizeof(buf); j++) {
+                        seed = seed * 1103515245 + 12345;
+                        buf[j] = (char)(seed >> 16);
+                }
+                if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+                        close(fd);
+                        return false;
+                }
+        }
+        return close(fd) == 0;
+}
+
+static void bench_root_free(BenchRoot *root)
+{
+        for (size_t i = 0; i < root->n_kernels; i++) {
+                free(root->versions[i]);
+                free(root->ktypes[i]);
+        }
+        free(root->versions);
+        free(root->ktypes);
+        free(root->kernels);
+        free(root->uts_name);
+        memset(root, 0, sizeof(*root));
+}
+
+/**
+ * Generate the root described by @config, returning a manager for it
+ */
+static BootManager *bench_prepare(const BenchConfig *config, BenchRoot *root)
+{
+        BootManager *manager = NULL;
+        autofree(char) *frag_dir = NULL;
+
+        root->n_kernels = config->kernels * config->types;
+        root->kernels = calloc(root->n_kernels, sizeof(PlaygroundKernel));
+        root->versions = calloc(root->n_kernels, sizeof(char *));
+        root->ktypes = calloc(root->n_kernels, sizeof(char *));
+        if (!root->kernels || !root->versions || !root->ktypes) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (size_t t = 0; t < config->types; t++) {
+                for (size_t i = 0; i < config->kernels; i++) {
+                        size_t n = t * config->kernels + i;
+                        PlaygroundKernel *k = &root->kernels[n];
+
+                        root->versions[n] = string_printf("4.%zu.%zu", t, i);
+                        root->ktypes[n] = string_printf("bench%zu", t);
+                        k->version = root->versions[n];
+                        k->ktype = root->ktypes[n];
+                        k->release = (int)(100 + i);
+                        k->default_for_type = i + 1 == config->kernels;
+                }
+        }
+
+        /* Running the newest kernel of the first type */
+        root->uts_name = string_printf("4.0.%zu-%zu.bench0",
+                                       config->kernels - 1,
+                                       100 + config->kernels - 1);
+        root->config = (PlaygroundConfig){
+                .uts_name = root->uts_name,
+                .initial_kernels = root->kernels,
+                .n_kernels = root->n_kernels,
+                .uefi = config->uefi,
+                .disable_modules = true,
+        };
+
+        manager = prepare_playground(&root->config);
+        if (!manager) {
+                return NULL;
+        }
+
+        /* Grow the blobs to a realistic size */
+        for (size_t n = 0; n < root->n_kernels; n++) {
+                const PlaygroundKernel *k = &root->kernels[n];
+                autofree(char) *kfile = NULL;
+                autofree(char) *initrd = NULL;
+
+                kfile = string_printf("%s/%s/%s.%s.%s-%d",
+                                      PLAYGROUND_ROOT,
+                                      KERNEL_DIRECTORY,
+                                      KERNEL_NAMESPACE,
+                                      k->ktype,
+                                      k->version,
+                                      k->release);
+                initrd = string_printf("%s/%s/initrd-%s.%s.%s-%d",
+                                       PLAYGROUND_ROOT,
+                                       KERNEL_DIRECTORY,
+                                       KERNEL_NAMESPACE,
+                                       k->ktype,
+                                       k->version,
+                                       k->release);
+                if (!bench_write_blob(kfile, config->kernel_kib, (unsigned int)n * 2) ||
+                    !bench_write_blob(initrd, config->initrd_kib, (unsigned int)n * 2 + 1)) {
+                        fprintf(stderr, "Failed to write kernel blobs: %s\n", strerror(errno));
+                        goto fail;
+                }
+        }
+
+        frag_dir = string_printf("%s/%s/cmdline.d", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        if (config->fragments > 0 && !nc_mkdir_p(frag_dir, 00755)) {
+                goto fail;
+        }
+        for (size_t i = 0; i < config->fragments; i++) {
+                autofree(char) *path = NULL;
+                autofree(char) *text = NULL;
+
+                path = string_printf("%s/bench-%zu.conf", frag_dir, i);
+                text = string_printf("# Fragment %zu\nbench.option%zu=%zu\n", i, i, i);
+                if (!file_set_text(path, text)) {
+                        goto fail;
+                }
+        }
+
+        return manager;
+fail:
+        boot_manager_free(manager);
+        return NULL;
+}
+
+static bool bench_get_kernels(BootManager *manager, BenchSample *sample)
+{
+        KernelArray *kernels = NULL;
+
+        bench_begin(sample);
+        kernels = boot_manager_get_kernels(manager);
+        bench_end(sample);
+
+        if (!kernels) {
+                return false;
+        }
+        kernel_array_free(kernels);
+        return true;
+}
+
+static bool bench_update(BootManager *manager, BenchSample *sample)
+{
+        bool ret = false;
+
+        bench_begin(sample);
+        ret = boot_manager_update(manager);
+        bench_end(sample);
+
+        return ret;
+}
+
+static bool bench_update_image(BootManager *manager, BenchSample *sample)
+{
+        boot_manager_set_image_mode(manager, true);
+        return bench_update(manager, sample);
+}
+
+static bool bench_update_native(BootManager *manager, BenchSample *sample)
+{
+        boot_manager_set_image_mode(manager, false);
+        return bench_update(manager, sample);
+}
+
+/**
+ * Measure the second of two updates, i.e. with the ESP already populated
+ */
+static bool bench_update_image_warm(BootManager *manager, BenchSample *sample)
+{
+        boot_manager_set_image_mode(manager, true);
+        if (!boot_manager_update(manager)) {
+                return false;
+        }
+        return bench_update(manager, sample);
+}
+
+static bool bench_update_native_warm(BootManager *manager, BenchSample *sample)
+{
+        boot_manager_set_image_mode(manager, false);
+        if (!boot_manager_update(manager)) {
+                return false;
+        }
+        return bench_update(manager, sample);
+}
+
+/**
+ * Measure the backend alone: installing the bootloader and then writing out
+ * the configuration for the newest kernel.
+ */
+static bool bench_bootloader(BootManager *manager, BenchSample *sample)
+{
+        autofree(KernelArray) *kernels = NULL;
+        const Kernel *newest = NULL;
+        bool ret = false;
+
+        kernels = boot_manager_get_kernels(manager);
+        if (!kernels || kernels->len == 0) {
+                return false;
+        }
+        newest = nc_array_get(kernels, kernels->len - 1);
+
+        bench_begin(sample);
+        ret = boot_manager_modify_bootloader(manager,
+                                             BOOTLOADER_OPERATION_INSTALL |
+                                                 BOOTLOADER_OPERATION_NO_CHECK) &&
+              boot_manager_install_kernel(manager, newest) &&
+              boot_manager_set_default_kernel(manager, newest);
+        bench_end(sample);
+
+        return ret;
+}
+
+static int bench_compare_samples(const void *a, const void *b)
+{
+        const BenchSample *sa = a;
+        const BenchSample *sb = b;
+
+        if (sa->wall_ms < sb->wall_ms) {
+                return -1;
+        }
+        return sa->wall_ms > sb->wall_ms ? 1 : 0;
+}
+
+/**
+ * Run one scenario for every round on a freshly generated root, and report
+ * the median round.
+ */
+static bool bench_run(const BenchConfig *config, const char *name, bench_func func)
+{
+        BenchSample *samples = NULL;
+        const BenchSample *median = NULL;
+
+        samples = calloc(config->rounds, sizeof(BenchSample));
+        if (!samples) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (size_t i = 0; i < config->rounds; i++) {
+                BenchRoot root = { 0 };
+                BootManager *manager = NULL;
+                bool ok = false;
+
+                manager = bench_prepare(config, &root);
+                ok = manager && func(manager, &samples[i]);
+                if (manager) {
+                        boot_manager_free(manager);
+                }
+                bench_root_free(&root);
+                if (!ok) {
+                        fprintf(stderr, "%s: failed in round %zu\n", name, i);
+                        free(samples);
+                        return false;
+                }
+        }
+
+        qsort(samples, config->rounds, sizeof(BenchSample), bench_compare_samples);
+        median = &samples[config->rounds / 2];
+
+        printf("%-20s %10.3f %10.3f %10.3f %12llu %12llu %8llu %8llu\n",
+               name,
+               samples[0].wall_ms,
+               median->wall_ms,
+               samples[config->rounds - 1].wall_ms,
+               median->rchar,
+               median->wchar,
+               median->syscr,
+               median->syscw);
+        free(samples);
+        return true;
+}
+
+static void bench_usage(const char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-k kernels-per-type] [-t types] [-s kernel-KiB] [-i initrd-KiB]\n"
+                "       [-c cmdline-fragments] [-r rounds] [-l] [-S] [-v]\n"
+                "\n"
+                "  -l  Use a legacy (syslinux) root instead of UEFI\n"
+                "  -S  Flush changes to disk as a real update would\n"
+                "  -v  Show log messages from clr-boot-manager\n",
+                progname);
+}
+
+static bool bench_parse_size(const char *arg, size_t *out)
+{
+        char *end = NULL;
+        unsigned long long v = 0;
+
+        errno = 0;
+        v = strtoull(arg, &end, 10);
+        if (errno != 0 || end == arg || *end != '\0') {
+                return false;
+        }
+        *out = (size_t)v;
+        return true;
+}
+
+int main(int argc, char **argv)
+{
+        BenchConfig config = {.kernels = 3,
+                              .types = 2,
+                              .kernel_kib = 4096,
+                              .initrd_kib = 16384,
+                              .fragments = 4,
+                              .rounds = 5,
+                              .uefi = true };
+        bool sync = false;
+        bool verbose = false;
+        FILE *log = NULL;
+        bool ok = true;
+        int c = 0;
+
+        while ((c = getopt(argc, argv, "k:t:s:i:c:r:lSvh")) != -1) {
+                size_t *target = NULL;
+
+                switch (c) {
+                case 'k':
+                        target = &config.kernels;
+                        break;
+                case 't':
+                        target = &config.types;
+                        break;
+                case 's':
+                        target = &config.kernel_kib;
+                        break;
+                case 'i':
+                        target = &config.initrd_kib;
+                        break;
+                case 'c':
+                        target = &config.fragments;
+                        break;
+                case 'r':
+                        target = &config.rounds;
+                        break;
+                case 'l':
+                        config.uefi = false;
+                        continue;
+                case 'S':
+                        sync = true;
+                        continue;
+                case 'v':
+                        verbose = true;
+                        continue;
+                case 'h':
+                        bench_usage(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        bench_usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+                if (!bench_parse_size(optarg, target)) {
+                        fprintf(stderr, "Invalid value for -%c: %s\n", c, optarg);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (config.kernels == 0 || config.types == 0 || config.rounds == 0) {
+                fprintf(stderr, "Kernels, types and rounds must all be non-zero\n");
+                return EXIT_FAILURE;
+        }
+
+        /* Logging would only skew the results */
+        log = verbose ? stderr : fopen("/dev/null", "w");
+        cbm_set_sync_filesystems(sync);
+        cbm_log_init(log ? log : stderr);
+        setenv("CBM_BOOTVAR_TEST_MODE", "yes", 1);
+        cbm_blkid_set_vtable(&BlkidTestOps);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        printf("# %s: %zu kernels x %zu types, kernel %zu KiB, initrd %zu KiB, "
+               "%zu cmdline fragments, %zu rounds\n",
+               config.uefi ? "uefi" : "legacy",
+               config.kernels,
+               config.types,
+               config.kernel_kib,
+               config.initrd_kib,
+               config.fragments,
+               config.rounds);
+        printf("%-20s %10s %10s %10s %12s %12s %8s %8s\n",
+               "# scenario",
+               "min-ms",
+               "median-ms",
+               "max-ms",
+               "read-B",
+               "write-B",
+               "syscr",
+               "syscw");
+
+        ok = bench_run(&config, "get-kernels", bench_get_kernels) && ok;
+        ok = bench_run(&config, "bootloader", bench_bootloader) && ok;
+        ok = bench_run(&config, "update-image", bench_update_image) && ok;
+        ok = bench_run(&config, "update-image-warm", bench_update_image_warm) && ok;
+        ok = bench_run(&config, "update-native", bench_update_native) && ok;
+        ok = bench_run(&config, "update-native-warm", bench_update_native_warm) && ok;
+
+        if (log && log != stderr) {
+                fclose(log);
+        }
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -13,9 +13,13 @@
 #include <check.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cmdline.h"
+#include "config.h"
+#include "files.h"
 #include "log.h"
+#include "nica/files.h"
 #include "util.h"
 
 START_TEST(cbm_cmdline_test_comments)
@@ -105,6 +109,84 @@ START_TEST(cbm_cmdline_test_dirs_vendor_merged)
 }
 END_TEST
 
+START_TEST(cbm_cmdline_test_edges)
+{
+        const char *file = TOP_BUILD_DIR "/cmdline-edges";
+        autofree(char) *p = NULL;
+        autofree(char) *empty = NULL;
+        autofree(char) *missing = NULL;
+
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR, 00755), "Failed to create test directory");
+
+        /* Windows line endings, inner whitespace and no final newline */
+        fail_if(!file_set_text(file, "  \t\n# comment\n\tfoo  bar \r\n\n  baz"),
+                "Failed to write cmdline file");
+        p = cbm_parse_cmdline_file(file);
+        fail_if(!p, "Failed to parse cmdline file");
+        fail_if(!streq(p, "foo  bar baz"), "Edge case file does not match: '%s'", p);
+
+        fail_if(!file_set_text(file, ""), "Failed to write empty cmdline file");
+        empty = cbm_parse_cmdline_file(file);
+        fail_if(!empty || !streq(empty, ""), "Empty file should give an empty cmdline");
+
+        missing = cbm_parse_cmdline_file(TOP_BUILD_DIR "/no-such-cmdline");
+        fail_if(!missing || !streq(missing, ""), "Missing file should give an empty cmdline");
+}
+END_TEST
+
+START_TEST(cbm_cmdline_test_cached)
+{
+        const char *root = TOP_BUILD_DIR "/cmdline-cache-root";
+        const char *cache = TOP_BUILD_DIR "/cmdline-cache-root/snapshot";
+        const char *conf_dir = TOP_BUILD_DIR "/cmdline-cache-root/" KERNEL_CONF_DIRECTORY;
+        const char *cmdline = TOP_BUILD_DIR "/cmdline-cache-root/" KERNEL_CONF_DIRECTORY "/cmdline";
+        const char *vendor_dir =
+            TOP_BUILD_DIR "/cmdline-cache-root/" VENDOR_KERNEL_CONF_DIRECTORY "/cmdline.d";
+        autofree(char) *vendor_file = NULL;
+        autofree(char) *snapshot = NULL;
+        autofree(char) *tampered = NULL;
+        char *p = NULL;
+        char *magic = NULL;
+        char *body = NULL;
+
+        vendor_file = string_printf("%s/10-vendor.conf", vendor_dir);
+        (void)nc_rm_rf(root);
+        fail_if(!nc_mkdir_p(conf_dir, 00755), "Failed to create conf dir");
+        fail_if(!file_set_text(cmdline, "one"), "Failed to write cmdline");
+
+        p = cbm_parse_cmdline_files_cached(root, cache);
+        fail_if(!p || !streq(p, "one"), "Initial cmdline does not match");
+        free(p);
+
+        /* Unchanged inputs must be served from the snapshot alone */
+        fail_if(!file_get_text(cache, &snapshot), "Snapshot not written");
+        magic = strchr(snapshot, '\n');
+        fail_if(!magic || !(body = strchr(magic + 1, '\n')), "Malformed snapshot");
+        tampered = string_printf("%.*s\n\tcached%s", (int)(magic - snapshot), snapshot, body);
+        fail_if(!file_set_text(cache, tampered), "Failed to tamper with snapshot");
+        p = cbm_parse_cmdline_files_cached(root, cache);
+        fail_if(!p || !streq(p, "cached"), "Snapshot not used for unchanged inputs");
+        free(p);
+
+        /* Edited sources invalidate it */
+        fail_if(!file_set_text(cmdline, "two"), "Failed to rewrite cmdline");
+        p = cbm_parse_cmdline_files_cached(root, cache);
+        fail_if(!p || !streq(p, "two"), "Edited cmdline not picked up: '%s'", p);
+        free(p);
+
+        /* As do new fragments in directories that didn't exist before */
+        fail_if(!nc_mkdir_p(vendor_dir, 00755), "Failed to create vendor dir");
+        fail_if(!file_set_text(vendor_file, "zero"), "Failed to write vendor fragment");
+        p = cbm_parse_cmdline_files_cached(root, cache);
+        fail_if(!p || !streq(p, "zero two"), "New fragment not picked up: '%s'", p);
+        free(p);
+
+        p = cbm_parse_cmdline_files_cached(root, NULL);
+        fail_if(!p || !streq(p, "zero two"), "Uncached cmdline does not match");
+        free(p);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -116,9 +198,11 @@ static Suite *core_suite(void)
         tcase_add_test(tc, cbm_cmdline_test_mangledmess);
         tcase_add_test(tc, cbm_cmdline_test_multi);
         tcase_add_test(tc, cbm_cmdline_test_oneline);
+        tcase_add_test(tc, cbm_cmdline_test_edges);
         tcase_add_test(tc, cbm_cmdline_test_dirs);
         tcase_add_test(tc, cbm_cmdline_test_dirs_vendor_only);
         tcase_add_test(tc, cbm_cmdline_test_dirs_vendor_merged);
+        tcase_add_test(tc, cbm_cmdline_test_cached);
         suite_add_tcase(s, tc);
 
         return s;
@@ -12,16 +12,38 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "bootman.h"
+#include "casepath.h"
 #include "config.h"
 #include "files.h"
+#include "initrd.h"
+#include "ledger.h"
+#include "lock.h"
 #include "log.h"
+#include "manifest.h"
+#include "memfs.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "sha256.h"
+#include "stage.h"
+#include "stats.h"
+#include "trace.h"
+#include "uki.h"
+#include "uring.h"
 #include "util.h"
 #include "writer.h"
 
@@ -29,6 +51,12 @@
 #include "harness.h"
 #include "system-harness.h"
 
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+
+#define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
+
 static PlaygroundKernel core_kernels[] = { { "4.2.1", "kvm", 121, false },
                                            { "4.2.3", "kvm", 124, true },
                                            { "4.2.1", "native", 137, false },
@@ -204,8 +232,8 @@ START_TEST(bootman_list_kernels_modules_test)
         fail_if(kernel->meta.release != 121, "Invalid fourth reversed element");
 
         for (uint16_t i = 0; i < list->len; i++) {
-                const Kernel *k = nc_array_get(list, i);
-                fail_if(k->source.module_dir == NULL,
+                Kernel *k = nc_array_get(list, i);
+                fail_if(boot_manager_kernel_get_module_dir(m, k) == NULL,
                         "Kernel has no module directory when it should");
         }
 }
@@ -252,8 +280,8 @@ START_TEST(bootman_list_kernels_no_modules_test)
         fail_if(kernel->meta.release != 121, "Invalid fourth reversed element");
 
         for (uint16_t i = 0; i < list->len; i++) {
-                const Kernel *k = nc_array_get(list, i);
-                fail_if(k->source.module_dir != NULL,
+                Kernel *k = nc_array_get(list, i);
+                fail_if(boot_manager_kernel_get_module_dir(m, k) != NULL,
                         "Kernel has a module directory when it shouldn't");
         }
 }
@@ -305,6 +333,1500 @@ START_TEST(bootman_map_kernels_test)
 }
 END_TEST
 
+START_TEST(bootman_index_kernels_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *list = NULL;
+        autofree(KernelIndex) *index = NULL;
+        KernelTypeIndex *type = NULL;
+        Kernel *running = NULL;
+
+        m = prepare_playground(&core_config);
+        fail_if(!set_kernel_booted(&core_kernels[0], true), "Failed to mark kernel as booted");
+        fail_if(!set_kernel_booted(&core_kernels[2], true), "Failed to mark kernel as booted");
+
+        list = boot_manager_get_kernels(m);
+        fail_if(!list, "Failed to list kernels");
+        index = boot_manager_index_kernels(m, list);
+        fail_if(!index, "Failed to index kernels");
+        fail_if(index->types->len != 2, "Invalid number of indexed types");
+
+        /* Same answers as the linear lookups */
+        type = kernel_index_get_type(index, "kvm");
+        fail_if(!type, "Failed to get KVM type index");
+        fail_if(type->kernels->len != 2, "Incorrect list length for kvm");
+        fail_if(((Kernel *)nc_array_get(type->kernels, 0))->meta.release != 124,
+                "kvm kernels not sorted");
+        fail_if(type->default_kernel != boot_manager_get_default_for_type(m, list, "kvm"),
+                "Mismatched kvm default");
+        fail_if(!type->last_booted || type->last_booted->meta.release != 121,
+                "Mismatched kvm last booted");
+        fail_if(type->last_booted != boot_manager_get_last_booted(m, type->kernels),
+                "Index disagrees on last booted kvm");
+
+        type = kernel_index_get_type(index, "native");
+        fail_if(!type, "Failed to get native type index");
+        fail_if(!type->default_kernel || type->default_kernel->meta.release != 138,
+                "Mismatched native default");
+        fail_if(!type->last_booted || type->last_booted->meta.release != 137,
+                "Mismatched native last booted");
+        fail_if(kernel_index_get_type(index, "lts") != NULL, "Found kernels of a missing type");
+
+        /* uname is 4.2.1-121.kvm */
+        running = boot_manager_index_get_running_kernel(m, index);
+        fail_if(!running, "Failed to find running kernel");
+        fail_if(running != boot_manager_get_running_kernel(m, list), "Mismatched running kernel");
+
+        /* Only the release has to match for the fallback */
+        fail_if(!boot_manager_set_uname(m, "4.2.9-124.kvm"), "Failed to set uname");
+        running = boot_manager_index_get_running_kernel(m, index);
+        fail_if(!running || running->meta.release != 124, "Failed to fall back on the release");
+        fail_if(!boot_manager_set_uname(m, "4.2.9-125.kvm"), "Failed to set uname");
+        fail_if(boot_manager_index_get_running_kernel(m, index) != NULL,
+                "Matched a kernel that isn't running");
+}
+END_TEST
+
+/**
+ * Optional source paths are looked up on first use, and only then
+ */
+START_TEST(bootman_kernel_lazy_sources_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *list = NULL;
+        const char *sysmap_file = TOP_BUILD_DIR "/tests/update_playground/" KERNEL_DIRECTORY
+                                                "/System.map-4.2.1-121.kvm";
+        const char *found = NULL;
+        Kernel *kernel = NULL;
+
+        m = prepare_playground(&core_config);
+        list = boot_manager_get_kernels(m);
+        fail_if(!list, "Failed to list kernels");
+
+        for (uint16_t i = 0; i < list->len; i++) {
+                Kernel *k = nc_array_get(list, i);
+                fail_if(k->extra.resolved != 0, "Optional sources resolved during the scan");
+                if (k->meta.release == 121) {
+                        kernel = k;
+                }
+        }
+        fail_if(!kernel, "Failed to find kernel");
+
+        /* Appearing after the scan is still in time for the first use */
+        fail_if(!file_set_text(sysmap_file, "System.map"), "Failed to write System.map");
+        found = boot_manager_kernel_get_sysmap_file(kernel);
+        fail_if(!found || !strstr(found, "/System.map-4.2.1-121.kvm"), "System.map not found");
+        found = boot_manager_kernel_get_kconfig_file(kernel);
+        fail_if(!found || !strstr(found, "/config-4.2.1-121.kvm"), "Kernel config not found");
+        fail_if(boot_manager_kernel_get_headers_dir(m, kernel) != NULL,
+                "Found headers that don't exist");
+        fail_if(!boot_manager_kernel_get_kboot_file(m, kernel), "No legacy boot file path");
+
+        /* Looked up only once */
+        fail_if(unlink(sysmap_file) != 0, "Failed to remove System.map");
+        fail_if(!boot_manager_kernel_get_sysmap_file(kernel), "System.map lookup not cached");
+}
+END_TEST
+
+START_TEST(bootman_kernel_cache_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *list = NULL;
+        autofree(KernelArray) *cached = NULL;
+        autofree(KernelArray) *updated = NULL;
+        autofree(KernelArray) *no_initrd = NULL;
+        autofree(KernelArray) *new_initrd = NULL;
+        PlaygroundKernel new_kernel = { "4.2.4", "native", 140, false };
+        const char *initrd_file = TOP_BUILD_DIR "/tests/update_playground/" KERNEL_DIRECTORY
+                                                "/initrd-" KERNEL_NAMESPACE ".kvm.4.2.3-124";
+        const char *cache_file = TOP_BUILD_DIR
+            "/tests/update_playground/var/cache/clr-boot-manager/kernels";
+        const char *cmdline_file = TOP_BUILD_DIR "/tests/update_playground/" KERNEL_DIRECTORY
+                                                 "/cmdline-4.2.1-121.kvm";
+
+        m = prepare_playground(&core_config);
+
+        list = boot_manager_get_kernels(m);
+        fail_if(!list, "Failed to list kernels");
+        fail_if(list->len != 4, "Invalid number of discovered kernels");
+        fail_if(!nc_file_exists(cache_file), "Kernel cache was not written");
+
+        /* Modify a single cmdline, only that kernel must be re-inspected */
+        fail_if(!file_set_text(cmdline_file, "changed-cmdline-for-kernel"),
+                "Failed to update cmdline file");
+
+        cached = boot_manager_get_kernels(m);
+        fail_if(!cached, "Failed to list cached kernels");
+        fail_if(cached->len != 4, "Invalid number of cached kernels");
+
+        nc_array_qsort(list, kernel_compare);
+        nc_array_qsort(cached, kernel_compare);
+        for (uint16_t i = 0; i < list->len; i++) {
+                Kernel *a = nc_array_get(list, i);
+                Kernel *b = nc_array_get(cached, i);
+
+                fail_if(!streq(a->source.path, b->source.path), "Mismatched kernel path");
+                fail_if(!streq(a->target.path, b->target.path), "Mismatched target path");
+                fail_if(!boot_manager_kernel_get_module_dir(m, a) ||
+                            !boot_manager_kernel_get_module_dir(m, b),
+                        "Missing module directory");
+                fail_if(!streq(boot_manager_kernel_get_module_dir(m, a),
+                               boot_manager_kernel_get_module_dir(m, b)),
+                        "Mismatched module directory");
+                fail_if(!b->target.initrd_path, "Missing initrd from cache");
+                fail_if(!streq(a->target.initrd_path, b->target.initrd_path),
+                        "Mismatched initrd path");
+                if (b->meta.release == 121) {
+                        fail_if(!strstr(b->meta.cmdline, "changed-cmdline-for-kernel"),
+                                "Stale cmdline returned from cache");
+                } else {
+                        fail_if(!streq(a->meta.cmdline, b->meta.cmdline), "Mismatched cmdline");
+                }
+        }
+
+        /* New kernels are picked up alongside the cached ones */
+        fail_if(!push_kernel_update(&core_config, &new_kernel), "Failed to push kernel update");
+        updated = boot_manager_get_kernels(m);
+        fail_if(!updated, "Failed to list updated kernels");
+        fail_if(updated->len != 5, "New kernel not discovered");
+
+        /* Initrds come and go beside unchanged kernels */
+        fail_if(unlink(initrd_file) != 0, "Failed to remove initrd");
+        no_initrd = boot_manager_get_kernels(m);
+        fail_if(!no_initrd, "Failed to list kernels");
+        for (uint16_t i = 0; i < no_initrd->len; i++) {
+                const Kernel *k = nc_array_get(no_initrd, i);
+
+                fail_if(k->meta.release == 124 && k->source.initrd_file,
+                        "Removed initrd returned from cache");
+        }
+        fail_if(!file_set_text(initrd_file, "regenerated"), "Failed to restore initrd");
+        new_initrd = boot_manager_get_kernels(m);
+        fail_if(!new_initrd, "Failed to list kernels");
+        for (uint16_t i = 0; i < new_initrd->len; i++) {
+                const Kernel *k = nc_array_get(new_initrd, i);
+
+                fail_if(k->meta.release == 124 && !k->source.initrd_file,
+                        "Added initrd missing from cache");
+        }
+}
+END_TEST
+
+START_TEST(bootman_kernel_parallel_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *serial = NULL;
+        autofree(KernelArray) *parallel = NULL;
+        const char *cache_file = TOP_BUILD_DIR
+            "/tests/update_playground/var/cache/clr-boot-manager/kernels";
+        PlaygroundKernel extra[] = { { "4.2.4", "native", 139, false },
+                                     { "4.2.5", "native", 140, false },
+                                     { "4.2.6", "kvm", 141, false } };
+
+        m = prepare_playground(&core_config);
+        for (size_t i = 0; i < ARRAY_SIZE(extra); i++) {
+                fail_if(!push_kernel_update(&core_config, &extra[i]), "Failed to add kernel");
+        }
+
+        serial = boot_manager_get_kernels(m);
+        fail_if(!serial || serial->len != 7, "Invalid number of serially discovered kernels");
+
+        /* Cold again, fanned out across more workers than there are kernels */
+        fail_if(unlink(cache_file) != 0, "Failed to drop the kernel cache");
+        boot_manager_set_jobs(m, 16);
+        parallel = boot_manager_get_kernels(m);
+        boot_manager_set_jobs(m, 1);
+        fail_if(!parallel || parallel->len != serial->len, "Parallel discovery lost kernels");
+
+        /* In the same order, without sorting */
+        for (uint16_t i = 0; i < serial->len; i++) {
+                Kernel *a = nc_array_get(serial, i);
+                Kernel *b = nc_array_get(parallel, i);
+
+                fail_if(!streq(a->source.path, b->source.path), "Kernels out of scan order");
+                fail_if(!streq(a->meta.cmdline, b->meta.cmdline), "Mismatched cmdline");
+                fail_if(!a->source.initrd_file != !b->source.initrd_file, "Mismatched initrd");
+        }
+}
+END_TEST
+
+START_TEST(bootman_manifest_test)
+{
+        autofree(CbmManifest) *tracked = cbm_manifest_new();
+        autofree(BootManager) *m = NULL;
+        const char *root = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY;
+        const char *src = TOP_BUILD_DIR "/tests/update_playground/manifest-source";
+        const char *dst = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/blob";
+        autofree(char) *manifest = NULL;
+        uint8_t digest[CBM_SHA256_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        struct stat st = { 0 };
+        struct timespec times[2];
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!nc_mkdir_p(root, 00755), "Failed to create boot directory");
+        manifest = string_printf("%s/%s", root, CBM_MANIFEST_FILE);
+
+        /* Known answer */
+        fail_if(!file_set_text(src, "abc"), "Failed to write source");
+        fail_if(!cbm_sha256_file(src, digest), "Failed to hash source");
+        cbm_sha256_to_hex(digest, hex);
+        fail_if(!streq(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"),
+                "Incorrect SHA-256 digest");
+
+        cbm_manifest_open(tracked, root, NULL, false);
+        fail_if(cbm_manifest_files_match(tracked, src, dst), "Missing target cannot match");
+        fail_if(!cbm_manifest_install_file(tracked, src, dst, 00644), "Failed to install file");
+        fail_if(!cbm_manifest_files_match(tracked, src, dst), "Installed file doesn't match");
+        cbm_manifest_close(tracked);
+        fail_if(!nc_file_exists(manifest), "Manifest was not written");
+
+        /* Same size and mtime means the manifest is trusted, without reading the target */
+        fail_if(stat(dst, &st) != 0, "Failed to stat target");
+        fail_if(!file_set_text(dst, "abd"), "Failed to modify target");
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        fail_if(utimensat(AT_FDCWD, dst, times, 0) != 0, "Failed to restore mtime");
+
+        cbm_manifest_open(tracked, root, NULL, false);
+        fail_if(!cbm_manifest_files_match(tracked, src, dst), "Manifest should be trusted");
+        cbm_manifest_close(tracked);
+
+        /* Verification always inspects the target in full */
+        cbm_manifest_open(tracked, root, NULL, true);
+        fail_if(cbm_manifest_files_match(tracked, src, dst),
+                "Verify didn't detect modified target");
+        fail_if(!cbm_manifest_install_file(tracked, src, dst, 00644), "Failed to repair file");
+        fail_if(!cbm_manifest_files_match(tracked, src, dst), "Repaired file doesn't match");
+        cbm_manifest_close(tracked);
+
+        /* Changed sources are always detected */
+        cbm_manifest_open(tracked, root, NULL, false);
+        fail_if(!file_set_text(src, "abcd"), "Failed to modify source");
+        fail_if(cbm_manifest_files_match(tracked, src, dst), "Changed source wasn't detected");
+        cbm_manifest_close(tracked);
+}
+END_TEST
+
+/**
+ * Write @size bytes of a repeating pattern to @path, with the last byte
+ * replaced by @last
+ */
+static bool write_test_pattern(const char *path, size_t size, char last)
+{
+        autofree(char) *data = NULL;
+        FILE *fp = NULL;
+        bool ret = false;
+
+        data = malloc(size);
+        if (!data) {
+                return false;
+        }
+        for (size_t i = 0; i < size; i++) {
+                data[i] = (char)(i % 251);
+        }
+        data[size - 1] = last;
+        fp = fopen(path, "w");
+        if (!fp) {
+                return false;
+        }
+        ret = fwrite(data, 1, size, fp) == size;
+        return fclose(fp) == 0 && ret;
+}
+
+START_TEST(bootman_manifest_verify_test)
+{
+        autofree(CbmManifest) *tracked = cbm_manifest_new();
+        autofree(BootManager) *m = NULL;
+        const char *root = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY;
+        const char *big_src = TOP_BUILD_DIR "/tests/update_playground/verify-big";
+        const char *big_dst = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/big";
+        const char *src = TOP_BUILD_DIR "/tests/update_playground/manifest-source";
+        const char *dst = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/blob";
+        const char *missing = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/missing";
+        const size_t big_size = 9 * 1024 * 1024 + 17;
+        CbmManifestPair pairs[3] = { { 0 } };
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!nc_mkdir_p(root, 00755), "Failed to create boot directory");
+
+        /* Past the first extent, so only the last one differs */
+        fail_if(!write_test_pattern(big_src, big_size, 'a'), "Failed to write source");
+        fail_if(!write_test_pattern(big_dst, big_size, 'b'), "Failed to write target");
+        fail_if(!file_set_text(src, "abc"), "Failed to write source");
+        fail_if(!file_set_text(dst, "abc"), "Failed to write target");
+
+        pairs[0] = (CbmManifestPair){.src = big_src, .dst = big_dst };
+        pairs[1] = (CbmManifestPair){.src = src, .dst = dst };
+        pairs[2] = (CbmManifestPair){.src = src, .dst = missing };
+
+        cbm_manifest_open(tracked, root, NULL, true);
+        cbm_manifest_verify(tracked, pairs, 3, 4);
+        fail_if(pairs[0].matches, "Difference in the last extent wasn't found");
+        fail_if(pairs[0].size != (off_t)big_size, "Large pair wasn't compared in full");
+        fail_if(!pairs[1].matches, "Identical copy reported as differing");
+        fail_if(pairs[2].matches, "Missing target cannot match");
+
+        /* Answered from the comparison, then compared afresh once installed */
+        fail_if(cbm_manifest_files_match(tracked, big_src, big_dst),
+                "Verified mismatch was trusted");
+        fail_if(!cbm_manifest_files_match(tracked, src, dst), "Verified match wasn't trusted");
+        fail_if(!cbm_manifest_install_file(tracked, big_src, big_dst, 00644),
+                "Failed to repair file");
+        fail_if(!cbm_manifest_files_match(tracked, big_src, big_dst),
+                "Repaired file doesn't match");
+        cbm_manifest_close(tracked);
+
+        /* The match was recorded for updates that trust the manifest */
+        cbm_manifest_open(tracked, root, NULL, false);
+        fail_if(!cbm_manifest_files_match(tracked, src, dst), "Verified match wasn't recorded");
+        cbm_manifest_close(tracked);
+}
+END_TEST
+
+START_TEST(bootman_manifest_journal_test)
+{
+        autofree(CbmManifest) *tracked = cbm_manifest_new();
+        autofree(BootManager) *m = NULL;
+        const char *root = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY;
+        const char *src = TOP_BUILD_DIR "/tests/update_playground/manifest-source";
+        const char *dst = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/blob";
+        const char *torn = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/torn";
+        const char *orphan =
+            TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/EFI/blob.TmpWrite";
+        autofree(char) *manifest = NULL;
+        autofree(char) *journal = NULL;
+        struct stat st = { 0 };
+        struct timespec times[2];
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/EFI", 00755),
+                "Failed to create boot directory");
+        manifest = string_printf("%s/%s", root, CBM_MANIFEST_FILE);
+        journal = string_printf("%s/%s", root, CBM_JOURNAL_FILE);
+
+        /* Interrupted with the copies in place and nothing written back */
+        fail_if(!file_set_text(src, "abc"), "Failed to write source");
+        cbm_manifest_open(tracked, root, NULL, false);
+        cbm_manifest_journal_begin(tracked, "install native blob\ntotal 3 1 0\n");
+        fail_if(!nc_file_exists(journal), "Journal not started");
+        fail_if(!cbm_manifest_install_file(tracked, src, dst, 00644), "Failed to install file");
+        fail_if(!cbm_manifest_install_file(tracked, src, torn, 00644), "Failed to install file");
+        fail_if(!file_set_text(orphan, "half a copy"), "Failed to leave a copy behind");
+        cbm_manifest_discard(tracked);
+        fail_if(nc_file_exists(manifest), "Manifest written by an interrupted update");
+        fail_if(!nc_file_exists(journal), "Journal lost by an interrupted update");
+
+        /* Contents that never made it to disk under the recorded size and mtime */
+        fail_if(stat(torn, &st) != 0, "Failed to stat target");
+        fail_if(!file_set_text(torn, "\0\0\0"), "Failed to tear target");
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        fail_if(utimensat(AT_FDCWD, torn, times, 0) != 0, "Failed to restore mtime");
+
+        /* Only the intact copy is trusted, without comparing it again */
+        cbm_manifest_open(tracked, root, NULL, false);
+        fail_if(stat(dst, &st) != 0, "Failed to stat target");
+        fail_if(!file_set_text(dst, "abd"), "Failed to modify target");
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        fail_if(utimensat(AT_FDCWD, dst, times, 0) != 0, "Failed to restore mtime");
+        fail_if(!cbm_manifest_files_match(tracked, src, dst), "Journaled copy wasn't recovered");
+        fail_if(cbm_manifest_files_match(tracked, src, torn), "Torn copy was trusted");
+        fail_if(!nc_file_exists(orphan), "Orphan removed before resuming");
+
+        cbm_manifest_journal_begin(tracked, NULL);
+        fail_if(nc_file_exists(orphan), "Orphaned copy not removed");
+        fail_if(!cbm_manifest_install_file(tracked, src, torn, 00644), "Failed to repair file");
+        cbm_manifest_close(tracked);
+        fail_if(nc_file_exists(journal), "Journal left behind by a complete update");
+        fail_if(!nc_file_exists(manifest), "Recovered manifest not written");
+}
+END_TEST
+
+START_TEST(bootman_sync_phase_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *text = NULL;
+        const char *dir = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY;
+        const char *file = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/synced";
+        const char *copy = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/copied";
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!nc_mkdir_p(dir, 00755), "Failed to create boot directory");
+
+        cbm_set_sync_filesystems(true);
+
+        /* Immediate barriers */
+        fail_if(!file_set_text(file, "immediate"), "Failed to write file");
+        fail_if(!cbm_sync_path(file), "Failed to flush written file");
+        fail_if(!cbm_sync_path(TOP_BUILD_DIR "/tests/update_playground/no-such-file"),
+                "Removed files only need their directory flushed");
+        fail_if(!cbm_sync_filesystem(dir), "Failed to flush filesystem");
+
+        /* Deferred, nested barriers */
+        cbm_sync_phase_begin();
+        cbm_sync_phase_begin();
+        fail_if(!file_set_text(file, "deferred"), "Failed to write file in phase");
+        fail_if(!copy_file_atomic(file, copy, 00644), "Failed to copy file in phase");
+        fail_if(!cbm_sync_phase_end(), "Inner phase end failed");
+        fail_if(!cbm_sync_phase_end(), "Outer phase end failed flushing");
+        fail_if(!cbm_sync_phase_end(), "Unbalanced phase end should be harmless");
+
+        cbm_set_sync_filesystems(false);
+
+        fail_if(!file_get_text(copy, &text), "Failed to read copied file");
+        fail_if(!streq(text, "deferred"), "Copied file has the wrong contents");
+}
+END_TEST
+
+START_TEST(bootman_stage_test)
+{
+        autofree(CbmStage) *stage = cbm_stage_new();
+        autofree(BootManager) *m = NULL;
+        autofree(char) *text = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        const char *root = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY;
+        const char *entries = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/entries";
+        const char *entry = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/entries/a";
+        const char *config = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/a";
+        const char *outside = TOP_BUILD_DIR "/tests/update_playground/outside";
+        const char *staging =
+            TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/" CBM_STAGE_DIR;
+        bool changed = false;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!nc_mkdir_p(entries, 00755), "Failed to create entries directory");
+        fail_if(!file_set_text(entry, "old entry"), "Failed to write entry");
+        fail_if(!file_set_text(config, "old config"), "Failed to write config");
+
+        /* Nothing in place changes until the commit */
+        cbm_stage_begin(stage, root);
+        fail_if(!file_set_text_staged(stage, entry, "new entry"), "Failed to stage entry");
+        fail_if(!file_set_text_staged(stage, config, "new config"), "Failed to stage config");
+        fail_if(!file_set_text_staged(stage, outside, "in place"),
+                "Failed to write outside the root");
+        fail_if(!cbm_file_exists(staging), "Staging directory not created");
+        fail_if(!file_get_text_staged(stage, outside, &text) || !streq(text, "in place"),
+                "Files outside the root must be written in place");
+        free(text);
+        text = NULL;
+
+        /* Staged files read back as their new contents */
+        fail_if(!file_get_text_staged(stage, entry, &text) || !streq(text, "new entry"),
+                "Staged entry doesn't read back");
+        free(text);
+        text = NULL;
+        fail_if(!cbm_writer_open(writer), "Failed to open writer");
+        cbm_writer_append(writer, "new config");
+        fail_if(!cbm_writer_commit_if_changed(writer, stage, config, &changed),
+                "Failed to compare");
+        fail_if(changed, "Staged config should match its staged contents");
+
+        fail_if(!cbm_stage_commit(stage), "Failed to commit staged files");
+        fail_if(cbm_file_exists(staging), "Staging directory left behind");
+        fail_if(!file_get_text_staged(stage, entry, &text) || !streq(text, "new entry"),
+                "Entry not switched");
+        free(text);
+        text = NULL;
+        fail_if(!file_get_text_staged(stage, config, &text) || !streq(text, "new config"),
+                "Config not switched");
+        free(text);
+        text = NULL;
+
+        /* Discarding leaves the previous files alone */
+        cbm_stage_begin(stage, root);
+        fail_if(!file_set_text_staged(stage, entry, "discarded"), "Failed to stage entry");
+        cbm_stage_discard(stage);
+        fail_if(cbm_file_exists(staging), "Staging directory left behind");
+        fail_if(!file_get_text_staged(stage, entry, &text) || !streq(text, "new entry"),
+                "Discarded entry replaced the old one");
+        fail_if(!cbm_stage_commit(stage), "Committing without staging should be harmless");
+}
+END_TEST
+
+START_TEST(bootman_manager_state_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(BootManager) *other = NULL;
+        autofree(char) *text = NULL;
+        const char *root = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY;
+        const char *other_root = TOP_BUILD_DIR "/tests/update_playground/other-boot";
+        const char *src = TOP_BUILD_DIR "/tests/update_playground/manifest-source";
+        const char *dst = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/blob";
+        const char *entry = TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/entry";
+        const char *other_entry = TOP_BUILD_DIR "/tests/update_playground/other-boot/entry";
+        const char *manifest =
+            TOP_BUILD_DIR "/tests/update_playground" BOOT_DIRECTORY "/" CBM_MANIFEST_FILE;
+        const char *other_manifest =
+            TOP_BUILD_DIR "/tests/update_playground/other-boot/" CBM_MANIFEST_FILE;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        other = boot_manager_new();
+        fail_if(!other, "Failed to create second manager");
+        fail_if(!nc_mkdir_p(root, 00755), "Failed to create boot directory");
+        fail_if(!nc_mkdir_p(other_root, 00755), "Failed to create second boot directory");
+        fail_if(!file_set_text(src, "abc"), "Failed to write source");
+        fail_if(boot_manager_get_manifest(m) == boot_manager_get_manifest(other),
+                "Managers share a manifest");
+        fail_if(boot_manager_get_stage(m) == boot_manager_get_stage(other),
+                "Managers share a stage");
+
+        /* Both updating at once, each of its own root */
+        cbm_manifest_open(boot_manager_get_manifest(m), root, NULL, false);
+        cbm_manifest_open(boot_manager_get_manifest(other), other_root, NULL, false);
+        cbm_stage_begin(boot_manager_get_stage(m), root);
+        cbm_stage_begin(boot_manager_get_stage(other), other_root);
+        fail_if(!cbm_manifest_install_file(boot_manager_get_manifest(m), src, dst, 00644),
+                "Failed to install file");
+        fail_if(!file_set_text_staged(boot_manager_get_stage(m), entry, "first"),
+                "Failed to stage entry");
+        fail_if(!file_set_text_staged(boot_manager_get_stage(other), other_entry, "second"),
+                "Failed to stage second entry");
+
+        /* The second one giving up leaves the first one's update alone */
+        cbm_stage_discard(boot_manager_get_stage(other));
+        cbm_manifest_discard(boot_manager_get_manifest(other));
+        fail_if(cbm_file_exists(other_entry), "Discarded entry was written");
+        fail_if(!cbm_manifest_files_match(boot_manager_get_manifest(m), src, dst),
+                "Installed file doesn't match");
+
+        fail_if(!cbm_stage_commit(boot_manager_get_stage(m)), "Failed to commit staged files");
+        fail_if(!file_get_text(entry, &text) || !streq(text, "first"), "Entry not switched");
+        cbm_manifest_close(boot_manager_get_manifest(m));
+        fail_if(!cbm_file_exists(manifest), "Manifest not written back");
+        fail_if(cbm_file_exists(other_manifest), "Discarded manifest was written back");
+}
+END_TEST
+
+START_TEST(bootman_boot_ledger_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(NcHashmap) *records = NULL;
+        autofree(NcHashmap) *keep = NULL;
+        const char *dir = TOP_BUILD_DIR "/tests/update_playground" CBM_BOOT_LEDGER_DIR;
+        const char *ledger = TOP_BUILD_DIR
+            "/tests/update_playground" CBM_BOOT_LEDGER_DIR "/" CBM_BOOT_LEDGER_FILE;
+        const char *legacy = TOP_BUILD_DIR "/tests/update_playground" CBM_BOOT_LEDGER_DIR
+                                           "/" CBM_BOOT_LEGACY_PREFIX "4.4.0-119.native";
+        const CbmBootRecord *record = NULL;
+        struct stat st = { 0 };
+        char name[32];
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+
+        /* Fixed size records, the last of each kernel wins */
+        fail_if(!cbm_boot_ledger_append(dir, "4.4.0-120.native", "boot-a", 10), "Append failed");
+        fail_if(!cbm_boot_ledger_append(dir, "4.4.0-120.native", NULL, 20), "Append failed");
+        fail_if(!cbm_boot_ledger_append(dir, "4.4.1-121.kvm", "boot-b", 30), "Append failed");
+        fail_if(cbm_boot_ledger_append(dir, "not valid", "boot-c", 40), "Invalid id appended");
+        fail_if(stat(ledger, &st) != 0 || st.st_size != 3 * CBM_BOOT_RECORD_SIZE,
+                "Ledger records aren't of a fixed size");
+        fail_if(!file_set_text(legacy, "clr-boot-manager file\n"), "Failed to write legacy file");
+
+        records = cbm_boot_ledger_load(dir);
+        fail_if(!records, "Failed to load the ledger");
+        fail_if(nc_hashmap_size(records) != 3, "Wrong number of booted kernels");
+        record = nc_hashmap_get(records, "4.4.0-120.native");
+        fail_if(!record || record->timestamp != 20 || !streq(record->boot_id, "-"),
+                "Later record didn't supersede the earlier one");
+        fail_if(!nc_hashmap_contains(records, "4.4.0-119.native"), "Legacy file not imported");
+
+        /* Nothing to do while every kernel is kept and nothing is legacy */
+        keep = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        fail_if(!keep, "Out of memory");
+        nc_hashmap_put(keep, "4.4.0-120.native", "4.4.0-120.native");
+        nc_hashmap_put(keep, "4.4.0-119.native", "4.4.0-119.native");
+        fail_if(!cbm_boot_ledger_compact(dir, keep), "Failed to compact the ledger");
+        fail_if(nc_file_exists(legacy), "Legacy file kept after importing it");
+
+        nc_hashmap_free(records);
+        records = cbm_boot_ledger_load(dir);
+        fail_if(!records || nc_hashmap_size(records) != 2, "Removed kernel still in the ledger");
+        fail_if(!nc_hashmap_contains(records, "4.4.0-119.native"), "Legacy record lost");
+        fail_if(stat(ledger, &st) != 0 || st.st_size != 2 * CBM_BOOT_RECORD_SIZE,
+                "Compacted records aren't of a fixed size");
+
+        /* Enough boots of the same kernel are compacted away too */
+        for (int i = 0; i < 100; i++) {
+                snprintf(name, sizeof(name), "boot-%d", i);
+                fail_if(!cbm_boot_ledger_append(dir, "4.4.0-120.native", name, (uint64_t)i),
+                        "Append failed");
+        }
+        fail_if(!cbm_boot_ledger_compact(dir, keep), "Failed to compact the ledger");
+        fail_if(stat(ledger, &st) != 0 || st.st_size != 2 * CBM_BOOT_RECORD_SIZE,
+                "Superseded records not compacted");
+}
+END_TEST
+
+static int (*ledger_race_rename_next)(const char *oldpath, const char *newpath) = NULL;
+static pthread_t ledger_race_thread;
+static bool ledger_race_started = false;
+static bool ledger_race_appended = false;
+static bool ledger_race_early = false;
+
+static void *ledger_race_append(__cbm_unused__ void *userdata)
+{
+        bool appended = cbm_boot_ledger_append("/ledger", "4.4.2-122.native", "boot-late", 50);
+
+        __atomic_store_n(&ledger_race_appended, appended, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+/**
+ * Boot reported just as compaction moves the rewritten ledger into place
+ */
+static int ledger_race_rename(const char *oldpath, const char *newpath)
+{
+        struct timespec delay = {.tv_nsec = 100 * 1000 * 1000 };
+
+        if (!ledger_race_started && strstr(newpath, CBM_BOOT_LEDGER_FILE)) {
+                ledger_race_started =
+                    pthread_create(&ledger_race_thread, NULL, ledger_race_append, NULL) == 0;
+                nanosleep(&delay, NULL);
+                ledger_race_early = __atomic_load_n(&ledger_race_appended, __ATOMIC_ACQUIRE);
+        }
+        return ledger_race_rename_next(oldpath, newpath);
+}
+
+START_TEST(bootman_boot_ledger_race_test)
+{
+        autofree(NcHashmap) *records = NULL;
+        autofree(NcHashmap) *keep = NULL;
+        CbmSystemOps ops = SystemTestOps;
+
+        cbm_memfs_fill_ops(&ops);
+        ledger_race_rename_next = ops.rename;
+        ops.rename = ledger_race_rename;
+        cbm_system_set_vtable(&ops);
+
+        fail_if(!cbm_boot_ledger_append("/ledger", "4.4.0-120.native", NULL, 10), "Append failed");
+        fail_if(!cbm_boot_ledger_append("/ledger", "4.4.1-121.kvm", NULL, 20), "Append failed");
+
+        /* The kvm kernel is gone, so the ledger is rewritten */
+        keep = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        fail_if(!keep, "Out of memory");
+        nc_hashmap_put(keep, "4.4.0-120.native", "4.4.0-120.native");
+        nc_hashmap_put(keep, "4.4.2-122.native", "4.4.2-122.native");
+        fail_if(!cbm_boot_ledger_compact("/ledger", keep), "Failed to compact the ledger");
+        fail_if(!ledger_race_started, "Boot never reported during compaction");
+        pthread_join(ledger_race_thread, NULL);
+        fail_if(ledger_race_early, "Boot reported while the ledger was being rewritten");
+        fail_if(!ledger_race_appended, "Failed to report the boot");
+
+        records = cbm_boot_ledger_load("/ledger");
+        fail_if(!records, "Failed to load the ledger");
+        fail_if(!nc_hashmap_contains(records, "4.4.2-122.native"), "Boot lost to compaction");
+        fail_if(!nc_hashmap_contains(records, "4.4.0-120.native"), "Kept boot lost");
+        fail_if(nc_hashmap_contains(records, "4.4.1-121.kvm"), "Removed kernel still recorded");
+
+        cbm_memfs_reset();
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+START_TEST(bootman_memfs_test)
+{
+        autofree(CbmStage) *stage = cbm_stage_new();
+        autofree(NcHashmap) *entries = NULL;
+        autofree(NcHashmap) *records = NULL;
+        autofree(char) *text = NULL;
+        CbmSystemOps ops = SystemTestOps;
+        const char *root = "/cbm-memfs-test";
+        const char *dir = "/cbm-memfs-test/boot/loader/entries";
+        struct statvfs vfs = { 0 };
+        struct stat st = { 0 };
+        char path[PATH_MAX];
+        char link[PATH_MAX];
+        ssize_t len = 0;
+
+        cbm_memfs_fill_ops(&ops);
+        cbm_system_set_vtable(&ops);
+        fail_if(cbm_system_has_native_files(), "In-memory files reported as native");
+
+        /* Enough entries that doing this on disk would be felt */
+        fail_if(!cbm_mkdir_p(dir, 00755), "Failed to create directories");
+        for (int i = 0; i < 5000; i++) {
+                snprintf(path, sizeof(path), "%s/entry-%d.conf", dir, i);
+                fail_if(!file_set_text(path, "title Clear Linux\n"), "Failed to write entry");
+        }
+        entries = cbm_get_dir_entries(dir);
+        fail_if(!entries || nc_hashmap_size(entries) != 5000, "Entries missing from listing");
+        fail_if(nc_file_exists(root), "In-memory files written to disk");
+
+        fail_if(!file_get_text("/cbm-memfs-test/boot/loader/entries/entry-42.conf", &text),
+                "Failed to read back entry");
+        fail_if(!streq(text, "title Clear Linux\n"), "Entry read back wrong");
+
+        /* Copies take the chunked path, never the kernel's own */
+        fail_if(!copy_file_atomic("/cbm-memfs-test/boot/loader/entries/entry-1.conf",
+                                  "/cbm-memfs-test/boot/copy.conf",
+                                  00644),
+                "Failed to copy entry");
+        fail_if(!cbm_files_match("/cbm-memfs-test/boot/loader/entries/entry-1.conf",
+                                 "/cbm-memfs-test/boot/copy.conf"),
+                "Copy doesn't match its source");
+        fail_if(!file_set_text("/cbm-memfs-test/boot/copy.conf", "title Other\n"),
+                "Failed to replace copy");
+        fail_if(cbm_files_match("/cbm-memfs-test/boot/loader/entries/entry-1.conf",
+                                "/cbm-memfs-test/boot/copy.conf"),
+                "Changed copy still matches");
+
+        /* Links resolve relative to their directory */
+        fail_if(cbm_system_symlink("loader/entries/entry-7.conf", "/cbm-memfs-test/boot/default") !=
+                    0,
+                "Failed to create link");
+        len = cbm_system_readlink("/cbm-memfs-test/boot/default", link, sizeof(link) - 1);
+        fail_if(len < 0, "Failed to read link");
+        link[len] = '\0';
+        fail_if(!streq(link, "loader/entries/entry-7.conf"), "Link target read back wrong");
+        fail_if(cbm_system_stat("/cbm-memfs-test/boot/default", &st) != 0 || !S_ISREG(st.st_mode),
+                "Link not followed");
+
+        /* Staged switch and a boot ledger, all within memory */
+        cbm_stage_begin(stage, "/cbm-memfs-test/boot");
+        fail_if(!file_set_text_staged(stage,
+                                      "/cbm-memfs-test/boot/loader/loader.conf",
+                                      "default entry-7\n"),
+                "Failed to stage loader.conf");
+        fail_if(cbm_file_exists("/cbm-memfs-test/boot/loader/loader.conf"), "Staged file in place");
+        fail_if(!cbm_stage_commit(stage), "Failed to commit staging");
+        fail_if(!cbm_file_exists("/cbm-memfs-test/boot/loader/loader.conf"), "Commit lost file");
+        fail_if(!cbm_boot_ledger_append("/cbm-memfs-test/ledger", "4.4.0-120.native", NULL, 1),
+                "Failed to append to ledger");
+        records = cbm_boot_ledger_load("/cbm-memfs-test/ledger");
+        fail_if(!records || nc_hashmap_size(records) != 1, "Ledger read back wrong");
+
+        /* A full filesystem refuses further writes */
+        cbm_memfs_set_capacity(64 * 1024);
+        fail_if(cbm_system_statvfs(root, &vfs) != 0 || vfs.f_bfree != 0, "Capacity not reported");
+        fail_if(file_set_text("/cbm-memfs-test/boot/full.conf", "title Full\n"),
+                "Wrote beyond capacity");
+        fail_if(errno != ENOSPC, "Writing beyond capacity didn't report ENOSPC");
+
+        fail_if(!cbm_rm_rf(root), "Failed to remove tree");
+        fail_if(cbm_file_exists(root), "Tree survived removal");
+
+        cbm_memfs_reset();
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+START_TEST(bootman_copy_file_test)
+{
+        autofree(BootManager) *m = NULL;
+        const char *src = TOP_BUILD_DIR "/tests/update_playground/copy-source";
+        const char *dst = TOP_BUILD_DIR "/tests/update_playground/copy-target";
+        const char *empty = TOP_BUILD_DIR "/tests/update_playground/copy-empty";
+        autofree(char) *data = NULL;
+        char digest[CBM_SHA256_HEX_SIZE] = { 0 };
+        char expected[CBM_SHA256_HEX_SIZE] = { 0 };
+        uint8_t raw[CBM_SHA256_SIZE];
+        struct stat st = { 0 };
+        size_t len = (4 * 1024 * 1024) + 17;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+
+        /* Large enough to need several passes, with an odd tail */
+        data = malloc(len + 1);
+        fail_if(!data, "Out of memory");
+        for (size_t i = 0; i < len; i++) {
+                data[i] = (char)('a' + (i % 26));
+        }
+        data[len] = '\0';
+        fail_if(!file_set_text(src, data), "Failed to write copy source");
+
+        fail_if(!copy_file(src, dst, 00644), "Failed to copy file");
+        fail_if(!cbm_files_match(src, dst), "Copied file doesn't match");
+        fail_if(stat(dst, &st) != 0 || (size_t)st.st_size != len, "Copied file has wrong size");
+
+        /* Hashing while copying must agree with hashing the source itself */
+        fail_if(!cbm_sha256_file(src, raw), "Failed to hash copy source");
+        cbm_sha256_to_hex(raw, expected);
+        fail_if(!copy_file_atomic_measured(src, dst, 00644, digest), "Failed measured copy");
+        fail_if(!cbm_files_match(src, dst), "Measured copy doesn't match");
+        fail_if(!streq(digest, expected), "Measured digest %s, expected %s", digest, expected);
+
+        /* Overwriting a larger target must truncate it */
+        fail_if(!file_set_text(src, "small"), "Failed to shrink copy source");
+        fail_if(!copy_file(src, dst, 00644), "Failed to copy over existing file");
+        fail_if(!cbm_files_match(src, dst), "Overwritten file doesn't match");
+
+        fail_if(!file_set_text(empty, ""), "Failed to write empty file");
+        fail_if(!copy_file(empty, dst, 00644), "Failed to copy empty file");
+        fail_if(stat(dst, &st) != 0 || st.st_size != 0, "Empty copy isn't empty");
+}
+END_TEST
+
+/**
+ * Comparisons settle what they can from metadata, and stop reading at the
+ * first difference
+ */
+START_TEST(bootman_files_match_test)
+{
+        autofree(BootManager) *m = NULL;
+        const char *a = TOP_BUILD_DIR "/tests/update_playground/match-a";
+        const char *b = TOP_BUILD_DIR "/tests/update_playground/match-b";
+        autofree(char) *data = NULL;
+        size_t len = (4 * 1024 * 1024) + 17;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+
+        data = malloc(len + 1);
+        fail_if(!data, "Out of memory");
+        for (size_t i = 0; i < len; i++) {
+                data[i] = (char)('a' + (i % 26));
+        }
+        data[len] = '\0';
+        fail_if(!file_set_text(a, data), "Failed to write first file");
+        fail_if(!file_set_text(b, data), "Failed to write second file");
+
+        cbm_stats_reset();
+        fail_if(!cbm_files_match(a, b), "Identical files don't match");
+        fail_if(cbm_stats_get(CBM_STAT_BYTES_COMPARED) != (uint64_t)len * 2,
+                "Identical files not compared in full");
+
+        /* A difference in the last byte is still found */
+        data[len - 1] = '!';
+        fail_if(!file_set_text(b, data), "Failed to rewrite second file");
+        fail_if(cbm_files_match(a, b), "Files differing at the end match");
+
+        /* One near the start stops the comparison early */
+        data[len - 1] = 'a';
+        data[10] = '!';
+        fail_if(!file_set_text(b, data), "Failed to rewrite second file");
+        cbm_stats_reset();
+        fail_if(cbm_files_match(a, b), "Files differing at the start match");
+        fail_if(cbm_stats_get(CBM_STAT_BYTES_COMPARED) >= (uint64_t)len,
+                "Comparison didn't stop at the first difference");
+
+        /* Neither the same file nor differing sizes need reading */
+        cbm_stats_reset();
+        fail_if(!cbm_files_match(a, a), "File doesn't match itself");
+        fail_if(!file_set_text(b, "short"), "Failed to shrink second file");
+        fail_if(cbm_files_match(a, b), "Files of different sizes match");
+        fail_if(cbm_stats_get(CBM_STAT_BYTES_COMPARED) != 0, "Read files without need");
+}
+END_TEST
+
+/**
+ * Rings run their batch in full, and everything using them gets the same
+ * answers through the blocking fallback
+ */
+START_TEST(bootman_ring_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(CbmRing) *ring = NULL;
+        const char *a = TOP_BUILD_DIR "/tests/update_playground/ring-a";
+        const char *b = TOP_BUILD_DIR "/tests/update_playground/ring-b";
+        autofree(char) *data = NULL;
+        size_t len = (1024 * 1024) + 3;
+        char buf[8] = { 0 };
+        int results[3] = { 0 };
+        int fd = -1;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+
+        data = malloc(len + 1);
+        fail_if(!data, "Out of memory");
+        for (size_t i = 0; i < len; i++) {
+                data[i] = (char)('a' + (i % 26));
+        }
+        data[len] = '\0';
+        fail_if(!file_set_text(a, data), "Failed to write first file");
+        fail_if(!file_set_text(b, data), "Failed to write second file");
+
+        /* The kernel may well refuse rings, i.e. under seccomp */
+        ring = cbm_ring_new(4);
+        if (ring) {
+                fd = open(a, O_RDONLY | O_CLOEXEC);
+                fail_if(fd < 0, "Failed to open file");
+                fail_if(!cbm_ring_queue_pread(ring, fd, buf, 4, 26, CBM_RING_LINK),
+                        "Failed to queue read");
+                fail_if(!cbm_ring_queue_fsync(ring, fd, CBM_RING_NONE), "Failed to queue fsync");
+                fail_if(!cbm_ring_queue_pread(ring, fd, buf + 4, 3, 2, CBM_RING_DRAIN),
+                        "Failed to queue read");
+                fail_if(cbm_ring_pending(ring) != 3, "Wrong number of queued operations");
+                fail_if(!cbm_ring_run(ring, results), "Failed to run ring");
+                fail_if(results[0] != 4 || results[1] != 0 || results[2] != 3,
+                        "Wrong ring results");
+                fail_if(memcmp(buf, "abcdcde", 7) != 0, "Wrong data read through ring");
+                fail_if(cbm_ring_pending(ring) != 0, "Ring still has operations queued");
+                close(fd);
+        }
+
+        fail_if(!cbm_files_match(a, b), "Identical files don't match");
+        cbm_ring_set_enabled(false);
+        fail_if(cbm_ring_new(4) != NULL, "Got a ring while disabled");
+        fail_if(!cbm_files_match(a, b), "Identical files don't match without a ring");
+        data[len - 2] = '!';
+        fail_if(!file_set_text(b, data), "Failed to rewrite second file");
+        fail_if(cbm_files_match(a, b), "Different files match without a ring");
+        cbm_ring_set_enabled(true);
+        fail_if(cbm_files_match(a, b), "Different files match");
+}
+END_TEST
+
+/**
+ * Find the data of section @name in the image @buf
+ */
+static const char *find_test_section(const char *buf, const char *name, uint32_t *size)
+{
+        const uint8_t *b = (const uint8_t *)buf;
+        uint16_t n = (uint16_t)(b[0x46] | (b[0x47] << 8));
+        const uint8_t *s = b + 0x40 + 24 + 240;
+
+        for (uint16_t i = 0; i < n; i++, s += 40) {
+                if (strncmp((const char *)s, name, 8) == 0) {
+                        *size = (uint32_t)(s[8] | (s[9] << 8) | (s[10] << 16));
+                        return buf + (s[20] | (s[21] << 8) | (s[22] << 16));
+                }
+        }
+        return NULL;
+}
+
+START_TEST(bootman_uki_test)
+{
+        autofree(BootManager) *m = NULL;
+        const char *stub = TOP_BUILD_DIR "/tests/update_playground/uki-stub";
+        const char *kernel = TOP_BUILD_DIR "/tests/update_playground/uki-kernel";
+        const char *target = TOP_BUILD_DIR "/tests/update_playground/uki.efi";
+        CbmUkiInputs inputs = {.stub = stub,
+                               .kernel = kernel,
+                               .initrd = NULL,
+                               .cmdline = "root=UUID=test quiet",
+                               .os_release = "NAME=\"Test\"\n" };
+        char digest[CBM_SHA256_HEX_SIZE];
+        char embedded[CBM_SHA256_HEX_SIZE];
+        autofree(CbmMappedFile) *mapped = CBM_MAPPED_FILE_INIT;
+        const char *image = NULL;
+        const char *data = NULL;
+        uint32_t size = 0;
+        bool changed = false;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!create_efi_stub(stub), "Failed to create stub");
+        fail_if(!file_set_text(kernel, "kernel image"), "Failed to write kernel");
+
+        fail_if(!cbm_uki_install(&inputs, target, &changed), "Failed to assemble image");
+        fail_if(!changed, "New image wasn't written");
+        fail_if(!cbm_uki_digest(&inputs, digest), "Failed to digest inputs");
+        fail_if(!cbm_uki_get_digest(target, embedded), "Image has no digest");
+        fail_if(!streq(digest, embedded), "Image has the wrong digest");
+
+        /* Identical inputs leave the image alone */
+        fail_if(!cbm_uki_install(&inputs, target, &changed), "Failed to check image");
+        fail_if(changed, "Unchanged image was rewritten");
+
+        fail_if(!cbm_mapped_file_open(target, mapped), "Failed to read image");
+        image = mapped->buffer;
+        fail_if(image[0x46] != 5, "Wrong number of sections");
+        fail_if(memcmp(image + 0x400, "\xcc\xcc", 2) != 0, "Stub code wasn't kept");
+        data = find_test_section(image, ".linux", &size);
+        fail_if(!data || size != 12 || memcmp(data, "kernel image", 12) != 0,
+                "Wrong .linux section");
+        data = find_test_section(image, ".cmdline", &size);
+        fail_if(!data || size != strlen(inputs.cmdline) || memcmp(data, inputs.cmdline, size) != 0,
+                "Wrong .cmdline section");
+        fail_if(find_test_section(image, ".initrd", &size) != NULL, "Unexpected .initrd section");
+
+        /* Any change of input is a new image */
+        inputs.cmdline = "root=UUID=test";
+        fail_if(!cbm_uki_install(&inputs, target, &changed), "Failed to rebuild image");
+        fail_if(!changed, "Changed image wasn't rewritten");
+        fail_if(cbm_uki_get_digest(stub, embedded), "Stub has a digest");
+}
+END_TEST
+
+START_TEST(bootman_retention_parse_test)
+{
+        RetentionPolicy policy = { 0 };
+
+        fail_if(!boot_manager_retention_parse("keep=2, max-age=2w # trailing\n"
+                                              "budget=64M pin=native-137\npin=kvm-121",
+                                              &policy),
+                "Failed to parse retention policy");
+        fail_if(!policy.configured || policy.keep != 2, "Wrong number of kernels kept");
+        fail_if(policy.max_age != 14 * 24 * 60 * 60, "Wrong maximum age");
+        fail_if(policy.budget != 64 * 1024 * 1024, "Wrong budget");
+        fail_if(!policy.pins || !nc_hashmap_contains(policy.pins, "kvm-121") ||
+                    !nc_hashmap_contains(policy.pins, "native-137"),
+                "Missing pinned kernels");
+        boot_manager_retention_clear(&policy);
+        fail_if(policy.configured || policy.pins, "Policy not cleared");
+
+        fail_if(!boot_manager_retention_parse("max-age=90", &policy) || policy.max_age != 90,
+                "Ages are in seconds without a suffix");
+        boot_manager_retention_clear(&policy);
+        fail_if(boot_manager_retention_parse("keep=-1", &policy), "Accepted a negative keep");
+        boot_manager_retention_clear(&policy);
+        fail_if(boot_manager_retention_parse("max-age=3y", &policy), "Accepted bad age");
+        boot_manager_retention_clear(&policy);
+        fail_if(boot_manager_retention_parse("pin=", &policy), "Accepted empty pin");
+        boot_manager_retention_clear(&policy);
+        fail_if(boot_manager_retention_parse("keep-all", &policy), "Accepted unknown option");
+        boot_manager_retention_clear(&policy);
+}
+END_TEST
+
+/**
+ * Write a newc cpio archive holding a single compressible file named @name
+ */
+static bool write_test_cpio(const char *path, const char *name)
+{
+        FILE *f = NULL;
+        const char *names[] = { name, "TRAILER!!!" };
+        const char *line = "clr-boot-manager initrd test\n";
+        size_t data_size = 64 * strlen(line);
+        bool ret = true;
+
+        f = fopen(path, "w");
+        if (!f) {
+                return false;
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+                size_t namesize = strlen(names[i]) + 1;
+                size_t filesize = i == 0 ? data_size : 0;
+
+                fprintf(f,
+                        "070701%08X%08X%08X%08X%08X%08X%08zX%08X%08X%08X%08X%08zX%08X",
+                        (unsigned int)i + 1,
+                        i == 0 ? 0100644u : 0u,
+                        0u,
+                        0u,
+                        1u,
+                        0u,
+                        filesize,
+                        0u,
+                        0u,
+                        0u,
+                        0u,
+                        namesize,
+                        0u);
+                fwrite(names[i], 1, namesize, f);
+                for (size_t pad = (110 + namesize) % 4; pad && pad < 4; pad++) {
+                        fputc('\0', f);
+                }
+                for (size_t n = 0; n < filesize; n += strlen(line)) {
+                        fputs(line, f);
+                }
+        }
+        /* Padded out to a block like cpio would */
+        for (int i = 0; i < 512; i++) {
+                fputc('\0', f);
+        }
+        ret = !ferror(f);
+        return fclose(f) == 0 && ret;
+}
+
+START_TEST(bootman_initrd_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+        autofree(char) *packed = NULL;
+        const char *kconfig = PLAYGROUND_ROOT "/initrd-kconfig";
+        const char *initrd = PLAYGROUND_ROOT "/initrd-source";
+        const char *target = PLAYGROUND_ROOT "/initrd-target";
+        CbmSystemOps ops = SystemTestOps;
+        CbmInitrdPolicy policy = { 0 };
+        Kernel *kernel = NULL;
+        const char *kernel_kconfig = NULL;
+        unsigned char magic[4] = { 0 };
+        struct stat st = { 0 };
+        bool have_zstd = false;
+        FILE *f = NULL;
+
+        fail_if(!cbm_initrd_parse_policy("zstd 15 # trailing\n", &policy), "Failed to parse zstd");
+        fail_if(policy.compression != CBM_INITRD_ZSTD || policy.level != 15, "Wrong zstd policy");
+        fail_if(!cbm_initrd_parse_policy("xz", &policy) || policy.compression != CBM_INITRD_XZ ||
+                    policy.level != 0,
+                "Wrong xz policy");
+        fail_if(!cbm_initrd_parse_policy("none", &policy) || policy.compression != CBM_INITRD_KEEP,
+                "Wrong policy for none");
+        fail_if(cbm_initrd_parse_policy("gzip", &policy), "Accepted unknown compression");
+        fail_if(cbm_initrd_parse_policy("zstd 42", &policy), "Accepted bad level");
+        fail_if(cbm_initrd_parse_policy("xz 3 4", &policy), "Accepted trailing option");
+        fail_if(cbm_initrd_parse_policy("none 3", &policy), "Accepted level without compression");
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+
+        fail_if(!file_set_text(kconfig, "CONFIG_RD_ZSTD=y\n# CONFIG_RD_XZ is not set\n"),
+                "Failed to write kconfig");
+        fail_if(!cbm_initrd_kconfig_supports(kconfig, CBM_INITRD_ZSTD), "zstd not supported");
+        fail_if(cbm_initrd_kconfig_supports(kconfig, CBM_INITRD_XZ), "Unset option supported");
+        fail_if(cbm_initrd_kconfig_supports(NULL, CBM_INITRD_ZSTD), "Missing kconfig supported");
+
+        /* Not an initrd we take apart, so no tool is ever run */
+        policy = (CbmInitrdPolicy){.compression = CBM_INITRD_ZSTD };
+        fail_if(!file_set_text(initrd, "compressed already"), "Failed to write initrd");
+        fail_if(cbm_initrd_recompress(initrd, target, &policy) != CBM_INITRD_UNSUITABLE,
+                "Recompressed an unknown initrd");
+        fail_if(!write_test_cpio(initrd, "kernel/x86/microcode/GenuineIntel.bin"),
+                "Failed to write early cpio");
+        fail_if(cbm_initrd_recompress(initrd, target, &policy) != CBM_INITRD_UNSUITABLE,
+                "Recompressed early microcode");
+        fail_if(!write_test_cpio(initrd, "init"), "Failed to write cpio");
+        f = fopen(initrd, "a");
+        fail_if(!f || fputs("070701", f) < 0 || fclose(f) != 0, "Failed to append to cpio");
+        fail_if(cbm_initrd_recompress(initrd, target, &policy) != CBM_INITRD_UNSUITABLE,
+                "Recompressed concatenated archives");
+
+        /* The harness runs nothing, so there's no output to install */
+        fail_if(!write_test_cpio(initrd, "init"), "Failed to write cpio");
+        fail_if(cbm_initrd_recompress(initrd, target, &policy) != CBM_INITRD_FAILED,
+                "Missing output not reported");
+        fail_if(nc_file_exists(target), "Target written without output");
+
+        ops.system = system;
+        cbm_system_set_vtable(&ops);
+        have_zstd = system("command -v zstd >/dev/null 2>&1") == 0;
+        if (have_zstd) {
+                fail_if(cbm_initrd_recompress(initrd, target, &policy) != CBM_INITRD_PACKED,
+                        "Failed to recompress cpio");
+                f = fopen(target, "r");
+                fail_if(!f || fread(magic, 1, sizeof(magic), f) != sizeof(magic),
+                        "Failed to read recompressed initrd");
+                fclose(f);
+                fail_if(magic[0] != 0x28 || magic[1] != 0xb5 || magic[2] != 0x2f ||
+                            magic[3] != 0xfd,
+                        "Recompressed initrd isn't zstd");
+                fail_if(nc_file_exists(PLAYGROUND_ROOT "/initrd-target.TmpWrite"),
+                        "Temporary output left behind");
+        }
+
+        /* Through a kernel, whose own kconfig decides */
+        kernels = boot_manager_get_kernels(m);
+        fail_if(!kernels || kernels->len == 0, "Failed to find kernels");
+        kernel = nc_array_get(kernels, 0);
+        kernel_kconfig = boot_manager_kernel_get_kconfig_file(kernel);
+        fail_if(!kernel_kconfig || !kernel->source.initrd_file, "Kernel lacks kconfig or initrd");
+        fail_if(!boot_manager_pack_initrd(m, &policy, kernel, true), "Failed to pack initrd");
+        fail_if(kernel->source.packed_initrd, "Packed initrd the kernel can't unpack");
+        fail_if(!file_set_text(kernel_kconfig, "CONFIG_RD_ZSTD=y\n"), "Failed to write kconfig");
+        fail_if(!write_test_cpio(kernel->source.initrd_file, "init"), "Failed to write cpio");
+        fail_if(!boot_manager_pack_initrd(m, &policy, kernel, have_zstd), "Failed to pack initrd");
+        if (have_zstd) {
+                fail_if(!kernel->source.packed_initrd, "Initrd not recompressed");
+                fail_if(!streq(boot_manager_kernel_get_initrd_source(kernel),
+                               kernel->source.packed_initrd),
+                        "Recompressed initrd not installed");
+                fail_if(stat(kernel->source.packed_initrd, &st) != 0, "Cached initrd missing");
+                packed = boot_manager_find_packed_initrd(m, kernel, CBM_INITRD_ZSTD);
+                fail_if(!packed || !streq(packed, kernel->source.packed_initrd),
+                        "Cached initrd not found");
+
+                /* Only looked up the second time round */
+                fail_if(!boot_manager_pack_initrd(m, &policy, kernel, false),
+                        "Failed to pack initrd");
+                fail_if(!kernel->source.packed_initrd, "Cached initrd not used");
+
+                /* Nothing references it once the kernel's gone */
+                kernel_array_free(kernels);
+                kernels = nc_array_new();
+                fail_if(!kernels, "Failed to allocate array");
+                boot_manager_collect_packed_initrds(m, kernels);
+                fail_if(nc_file_exists(packed), "Unused cached initrd kept");
+        } else {
+                fail_if(kernel->source.packed_initrd, "Packed initrd without tools");
+        }
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+START_TEST(bootman_io_policy_test)
+{
+        autofree(BootManager) *m = NULL;
+        const char *src = TOP_BUILD_DIR "/tests/update_playground/policy-source";
+        const char *dst = TOP_BUILD_DIR "/tests/update_playground/policy-target";
+        autofree(char) *data = NULL;
+        CbmIoPolicy policy = { 0 };
+        struct stat st = { 0 };
+        size_t len = (2 * 1024 * 1024) + 4099;
+
+        fail_if(!cbm_io_policy_parse("drop-cache, rate=2M # trailing\nidle", &policy),
+                "Failed to parse policy");
+        fail_if(!policy.drop_cache || !policy.idle || policy.direct, "Wrong policy flags");
+        fail_if(policy.rate != 2 * 1024 * 1024, "Wrong policy rate");
+        fail_if(!cbm_io_policy_parse("", &policy) || policy.drop_cache,
+                "Empty policy should be the default");
+        fail_if(cbm_io_policy_parse("direct, fast", &policy), "Accepted unknown option");
+        fail_if(cbm_io_policy_parse("rate=12X", &policy), "Accepted bad rate");
+        fail_if(cbm_io_policy_parse("rate=", &policy), "Accepted empty rate");
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(boot_manager_set_io_policy(m, "idle,slow"), "Manager accepted a bad policy");
+        fail_if(!boot_manager_set_io_policy(m, "direct"), "Manager rejected a policy");
+
+        data = malloc(len + 1);
+        fail_if(!data, "Out of memory");
+        for (size_t i = 0; i < len; i++) {
+                data[i] = (char)('A' + (i % 23));
+        }
+        data[len] = '\0';
+        fail_if(!file_set_text(src, data), "Failed to write policy source");
+
+        /* Chunked copies must match the fast path byte for byte, whether or
+         * not the filesystem is happy with O_DIRECT */
+        policy = (CbmIoPolicy){.drop_cache = true, .direct = true, .rate = 1024ULL * 1024 * 1024 };
+        cbm_set_io_policy(&policy);
+        fail_if(!copy_file(src, dst, 00644), "Failed to copy under policy");
+        fail_if(!cbm_files_match(src, dst), "Policy copy doesn't match");
+        fail_if(stat(dst, &st) != 0 || (size_t)st.st_size != len, "Policy copy has wrong size");
+
+        fail_if(!file_set_text(src, "tiny"), "Failed to shrink policy source");
+        fail_if(!copy_file(src, dst, 00644), "Failed to copy small file under policy");
+        fail_if(!cbm_files_match(src, dst), "Small policy copy doesn't match");
+        cbm_set_io_policy(NULL);
+}
+END_TEST
+
+START_TEST(bootman_case_path_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path = NULL;
+        const char *base = TOP_BUILD_DIR "/tests/update_playground/esp";
+        const char *blob = TOP_BUILD_DIR "/tests/update_playground/esp/EFI/BOOT/bootx64.EFI";
+        const char *renamed = TOP_BUILD_DIR "/tests/update_playground/esp/EFI/BOOT/BOOTX64.efi";
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests/update_playground/esp/EFI/BOOT", 00755),
+                "Failed to create ESP");
+        fail_if(!file_set_text(blob, "blob"), "Failed to write EFI blob");
+        cbm_case_path_reset();
+
+        path = cbm_case_path_build(base, "efi", "Boot", "BOOTX64.EFI", NULL);
+        fail_if(!streq(path, blob), "Wrong spelling: %s", path);
+        free(path);
+
+        /* Components may span several directories */
+        path = cbm_case_path_build(base, "/efi/boot/", "BootX64.efi", NULL);
+        fail_if(!streq(path, blob), "Wrong spelling of nested components: %s", path);
+        free(path);
+
+        /* Missing entries keep the spelling asked for */
+        path = cbm_case_path_build(base, "EFI", "boot", "Missing.conf", NULL);
+        fail_if(!streq(path, TOP_BUILD_DIR "/tests/update_playground/esp/EFI/BOOT/Missing.conf"),
+                "Missing entry was respelled: %s", path);
+        free(path);
+
+        /* The directory was indexed already, until invalidated */
+        fail_if(rename(blob, renamed) != 0, "Failed to rename EFI blob");
+        path = cbm_case_path_build(base, "EFI", "BOOT", "bootx64.efi", NULL);
+        fail_if(!streq(path, blob), "Directory was read again: %s", path);
+        free(path);
+
+        cbm_case_path_invalidate(blob);
+        path = cbm_case_path_build(base, "EFI", "BOOT", "bootx64.efi", NULL);
+        fail_if(!streq(path, renamed), "Invalidated directory wasn't read again: %s", path);
+}
+END_TEST
+
+START_TEST(bootman_update_lock_test)
+{
+        const char *dir = TOP_BUILD_DIR "/tests/update_playground/lock";
+        CbmUpdateLock lock = {.fd = -1 };
+        uint64_t generation = 0;
+        int status = 0;
+        pid_t pid;
+
+        fail_if(cbm_update_lock_enter(&lock, dir, false) != CBM_UPDATE_LOCK_ACQUIRED,
+                "Failed to take a free lock");
+        generation = cbm_update_lock_begin_pass(&lock);
+
+        /* Record locks are per process, so contend from a child */
+        pid = fork();
+        fail_if(pid < 0, "Failed to fork");
+        if (pid == 0) {
+                CbmUpdateLock other = {.fd = -1 };
+
+                _exit(cbm_update_lock_enter(&other, dir, false) == CBM_UPDATE_LOCK_BUSY ? 0 : 1);
+        }
+        fail_if(waitpid(pid, &status, 0) != pid, "Failed to wait for child");
+        fail_if(!WIFEXITED(status) || WEXITSTATUS(status) != 0,
+                "Concurrent request didn't leave the update to the holder");
+
+        /* The request arrived during our pass, so exactly one more is due */
+        fail_if(!cbm_update_lock_end_pass(&lock, generation, true), "Lost concurrent request");
+        generation = cbm_update_lock_begin_pass(&lock);
+        fail_if(cbm_update_lock_end_pass(&lock, generation, true), "Needless extra pass");
+        fail_if(lock.fd >= 0, "Lock not released after the last pass");
+
+        /* Released, so the next request runs its own update */
+        fail_if(cbm_update_lock_enter(&lock, dir, true) != CBM_UPDATE_LOCK_ACQUIRED,
+                "Failed to take a released lock");
+        generation = cbm_update_lock_begin_pass(&lock);
+        fail_if(cbm_update_lock_end_pass(&lock, generation, true), "Needless extra pass");
+}
+END_TEST
+
+/**
+ * Commands must not inherit the signals blocked for the daemon's signalfd
+ */
+START_TEST(bootman_spawn_mask_test)
+{
+        sigset_t mask;
+        sigset_t old;
+        int status = 0;
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        fail_if(sigprocmask(SIG_BLOCK, &mask, &old) != 0, "Failed to block signals");
+
+        cbm_system_reset_vtable();
+        status = cbm_system_system("exec grep -Eq '^SigBlk:[[:space:]]*0+$' /proc/self/status");
+        cbm_system_set_vtable(&SystemTestOps);
+        fail_if(sigprocmask(SIG_SETMASK, &old, NULL) != 0, "Failed to restore signals");
+
+        fail_if(status < 0 || !WIFEXITED(status), "Failed to run command");
+        fail_if(WEXITSTATUS(status) != 0, "Command inherited the blocked signals");
+}
+END_TEST
+
+START_TEST(bootman_trace_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *trace = NULL;
+        const char *path = TOP_BUILD_DIR "/tests/update_playground/trace.json";
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        boot_manager_set_image_mode(m, true);
+
+        cbm_trace_init(path);
+        fail_if(!cbm_trace_enabled(), "Tracing not enabled");
+        {
+                CBM_TRACE_SCOPE("test.outer");
+                fail_if(!boot_manager_update(m), "Failed to update in image mode");
+        }
+        fail_if(!cbm_trace_flush(), "Failed to write trace");
+        cbm_trace_init(NULL);
+        fail_if(cbm_trace_enabled(), "Tracing still enabled");
+
+        fail_if(!file_get_text(path, &trace), "Failed to read trace");
+        fail_if(!strstr(trace, "\"traceEvents\":["), "Trace isn't in trace event format");
+        fail_if(!strstr(trace, "{\"name\":\"test.outer\",\"cat\":\"cbm\",\"ph\":\"X\""),
+                "Missing enclosing span");
+        fail_if(!strstr(trace, "\"name\":\"update_image\""), "Missing update_image span");
+        fail_if(!strstr(trace, "\"name\":\"bootloader.reconcile_kernels\""),
+                "Missing bootloader span");
+}
+END_TEST
+
+START_TEST(bootman_log_test)
+{
+        autofree(char) *text = NULL;
+        const char *path = TOP_BUILD_DIR "/tests/update_playground/log.txt";
+        char long_message[2048];
+        const char *c = NULL;
+        FILE *log = NULL;
+        int n_debug = 0;
+        struct stat st = { 0 };
+
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests/update_playground", 00755),
+                "Failed to create playground");
+        log = fopen(path, "w");
+        fail_if(!log, "Failed to open log");
+        cbm_log_init(log);
+        cbm_log_set_rate_limit(4);
+
+        /* Collected until flushed, past the burst only counted */
+        for (int i = 0; i < 10; i++) {
+                LOG_DEBUG("Message %d", i);
+        }
+        fail_if(stat(path, &st) != 0 || st.st_size != 0, "Debug messages weren't buffered");
+        cbm_log_flush();
+        fail_if(stat(path, &st) != 0 || st.st_size == 0, "Flush wrote nothing");
+
+        /* Errors are never dropped, nor held back */
+        cbm_log_set_rate_limit(0);
+        memset(long_message, 'x', sizeof(long_message) - 1);
+        long_message[sizeof(long_message) - 1] = '\0';
+        LOG_ERROR("Long %s", long_message);
+        LOG_ERROR("Constant");
+        cbm_log_set_rate_limit(CBM_LOG_RATE_BURST);
+        cbm_log_init(stderr);
+        fclose(log);
+
+        fail_if(!file_get_text(path, &text), "Failed to read log");
+        for (c = strstr(text, "[DEBUG]"); c; c = strstr(c + 1, "[DEBUG]")) {
+                ++n_debug;
+        }
+        fail_if(n_debug == 0 || n_debug >= 10, "Debug messages weren't rate limited");
+        fail_if(!strstr(text, "[WARNING] cbm ("), "Suppressed messages weren't reported");
+        fail_if(!strstr(text, "messages\n"), "Suppressed messages weren't counted");
+        fail_if(!strstr(text, long_message), "Long message was truncated");
+        fail_if(!strstr(text, "): Constant\n"), "Constant message missing");
+}
+END_TEST
+
+START_TEST(bootman_stats_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(CbmWriter) *measured = CBM_WRITER_INIT;
+        const char *measurements = NULL;
+        uint64_t copied = 0;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+        boot_manager_set_image_mode(m, true);
+
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update in image mode");
+        copied = cbm_stats_get(CBM_STAT_BYTES_COPIED);
+        fail_if(cbm_stats_get(CBM_STAT_KERNELS_INSPECTED) == 0, "No kernels inspected");
+        fail_if(cbm_stats_get(CBM_STAT_KERNELS_INSTALLED) == 0, "No kernels installed");
+        fail_if(cbm_stats_get(CBM_STAT_FILES_CREATED) == 0, "No files created");
+        fail_if(cbm_stats_get(CBM_STAT_EXISTS_PROBES) == 0, "No existence probes");
+        fail_if(copied == 0, "No bytes copied");
+
+        /* Every installed file was measured on the way */
+        fail_if(!cbm_writer_open(measured), "Failed to open writer");
+        cbm_stats_write(measured, true);
+        cbm_writer_close(measured);
+        fail_if(cbm_writer_error(measured) != 0, "Failed to write stats");
+        measurements = strstr(measured->buffer, ",\"measurements\":{\"");
+        fail_if(!measurements, "No measurements in JSON stats: %s", measured->buffer);
+        fail_if(!strstr(measurements, "/kernel-" KERNEL_NAMESPACE "."), "Kernel not measured");
+
+        /* Nothing changed, so nothing should be written the second time */
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to repeat image update");
+        fail_if(cbm_stats_get(CBM_STAT_KERNELS_INSTALLED) != 0, "Up to date kernels reinstalled");
+        fail_if(cbm_stats_get(CBM_STAT_KERNELS_SKIPPED) == 0, "Up to date kernels not skipped");
+        fail_if(cbm_stats_get(CBM_STAT_BYTES_COPIED) != 0, "Up to date kernels copied again");
+
+        cbm_stats_reset();
+        cbm_stats_add(CBM_STAT_BYTES_COPIED, 42);
+        cbm_stats_inc(CBM_STAT_COMMANDS);
+        fail_if(!cbm_writer_open(writer), "Failed to open writer");
+        cbm_stats_write(writer, true);
+        cbm_writer_close(writer);
+        fail_if(cbm_writer_error(writer) != 0, "Failed to write stats");
+        fail_if(strncmp(writer->buffer, "{\"bytes_compared\":0,\"bytes_copied\":42,", 38) != 0,
+                "Malformed JSON stats: %s",
+                writer->buffer);
+        fail_if(!strstr(writer->buffer, ",\"commands\":1,"), "Commands not counted");
+        fail_if(!streq(cbm_stats_name(CBM_STAT_KERNELS_REMOVED), "kernels_removed"),
+                "Unexpected counter name");
+}
+END_TEST
+
 START_TEST(bootman_timeout_test)
 {
         autofree(BootManager) *m = NULL;
@@ -326,6 +1848,86 @@ START_TEST(bootman_timeout_test)
 }
 END_TEST
 
+START_TEST(bootman_lazy_facets_test)
+{
+        autofree(BootManager) *m = NULL;
+
+        m = prepare_playground(&core_config);
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to set prefix");
+
+        /* The timeout never needs the devices, os-release or bootloader */
+        fail_if(!boot_manager_set_timeout_value(m, 3), "Failed to set timeout value");
+        fail_if(boot_manager_get_timeout_value(m) != 3, "Failed to get timeout value");
+        fail_if(m->facets != 0, "Timeout set up facets it doesn't need");
+        fail_if(m->bootloader != NULL, "Timeout selected a bootloader");
+        fail_if(m->sysconfig->root_device != NULL, "Timeout probed the root device");
+
+        /* Each facet only brings the ones it depends on */
+        fail_if(!boot_manager_get_os_id(m), "Failed to get the OS ID");
+        fail_if(m->facets != BOOT_MANAGER_FACET_OS_RELEASE, "os-release brought other facets");
+        fail_if(!boot_manager_get_root_device(m), "Failed to probe the root device");
+        fail_if(m->bootloader != NULL, "Probe selected a bootloader");
+
+        fail_if(!boot_manager_require(m, BOOT_MANAGER_FACET_BOOTLOADER), "Failed to select loader");
+        fail_if(!m->bootloader, "No bootloader selected");
+
+        /* A new prefix starts over */
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reset prefix");
+        fail_if(m->facets != 0 || m->bootloader != NULL, "Facets survived a new prefix");
+        fail_if(!boot_manager_update(m), "Failed to update with lazy facets");
+        fail_if(!boot_manager_set_timeout_value(m, 0), "Failed to disable timeout value");
+}
+END_TEST
+
+START_TEST(bootman_snapshot_test)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *text = NULL;
+        const char *snapshot = PLAYGROUND_ROOT "/run/clr-boot-manager/system";
+        const char *os_release = PLAYGROUND_ROOT "/" SYSCONFDIR "/os-release";
+        const char *name = "clr-boot-manager testing";
+        char *found = NULL;
+
+        if (!nc_file_exists("/proc/sys/kernel/random/boot_id")) {
+                return;
+        }
+
+        m = prepare_playground(&core_config);
+        fail_if(!boot_manager_get_root_device(m), "Failed to probe the root device");
+        fail_if(!file_get_text(snapshot, &text), "Probing didn't take a snapshot");
+        fail_if(!strstr(text, "\nos\tPRETTY_NAME\tclr-boot-manager testing\n"),
+                "os-release missing from the snapshot");
+
+        /* Prove the next inspection is served by the snapshot */
+        found = strstr(text, name);
+        fail_if(!found, "No name to alter");
+        memcpy(found, "clr-boot-manager restore", strlen(name));
+        fail_if(!file_set_text(snapshot, text), "Failed to alter the snapshot");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reset prefix");
+        fail_if(!boot_manager_get_root_device(m), "Failed to restore the root device");
+        fail_if(m->facets != (BOOT_MANAGER_FACET_PROBE | BOOT_MANAGER_FACET_OS_RELEASE),
+                "Snapshot didn't restore os-release");
+        fail_if(!streq(boot_manager_get_os_name(m), "clr-boot-manager restore"),
+                "Inspection wasn't served by the snapshot");
+
+        /* Changing an input invalidates it */
+        fail_if(!file_set_text((char *)os_release, "PRETTY_NAME=\"clr-boot-manager changed\"\n"),
+                "Failed to change os-release");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reset prefix");
+        fail_if(!boot_manager_get_root_device(m), "Failed to probe the root device");
+        fail_if(!streq(boot_manager_get_os_name(m), "clr-boot-manager changed"),
+                "Stale snapshot was used");
+
+        /* Images never use it */
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reset prefix");
+        fail_if(boot_manager_load_snapshot(m), "Image used the snapshot");
+
+        boot_manager_discard_snapshot(m);
+        fail_if(nc_file_exists(snapshot), "Snapshot not discarded");
+}
+END_TEST
+
 START_TEST(bootman_writer_simple_test)
 {
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
@@ -344,6 +1946,42 @@ START_TEST(bootman_writer_simple_test)
 }
 END_TEST
 
+START_TEST(bootman_arena_test)
+{
+        autofree(CbmArena) *arena = cbm_arena_new();
+        autofree(char) *big = NULL;
+        char *strings[2000] = { NULL };
+        char *copy = NULL;
+        long *zeroed = NULL;
+        size_t len = 40000;
+
+        /* Enough to span several chunks */
+        for (size_t i = 0; i < ARRAY_SIZE(strings); i++) {
+                strings[i] = cbm_arena_printf(arena, "kernel-%zu.%s", i, "native");
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(strings); i++) {
+                autofree(char) *expect = string_printf("kernel-%zu.%s", i, "native");
+                fail_if(!streq(strings[i], expect), "Arena string was overwritten");
+        }
+
+        zeroed = cbm_arena_alloc(arena, 16 * sizeof(long));
+        fail_if(((uintptr_t)zeroed % sizeof(long)) != 0, "Arena allocation misaligned");
+        for (size_t i = 0; i < 16; i++) {
+                fail_if(zeroed[i] != 0, "Arena allocation not zeroed");
+        }
+
+        /* Larger than a chunk, without losing what's left of the current one */
+        big = malloc(len + 1);
+        fail_if(!big, "Out of memory");
+        memset(big, 'x', len);
+        big[len] = '\0';
+        copy = cbm_arena_printf(arena, "%s", big);
+        fail_if(!streq(copy, big), "Large arena string is wrong");
+        fail_if(!streq(cbm_arena_strdup(arena, "after"), "after"), "Arena string is wrong");
+        fail_if(!streq(strings[0], "kernel-0.native"), "Arena string was overwritten");
+}
+END_TEST
+
 START_TEST(bootman_writer_printf_test)
 {
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
@@ -388,6 +2026,81 @@ START_TEST(bootman_writer_mut_test)
 }
 END_TEST
 
+START_TEST(bootman_writer_grow_test)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *expected = NULL;
+        char chunk[101];
+
+        memset(chunk, 'x', sizeof(chunk) - 1);
+        chunk[sizeof(chunk) - 1] = '\0';
+
+        /* Far beyond the hint, through both append paths */
+        fail_if(!cbm_writer_open_sized(writer, 8), "Failed to create writer");
+        for (int i = 0; i < 50; i++) {
+                cbm_writer_append_printf(writer, "%03d%s", i, chunk);
+                cbm_writer_append(writer, "\n");
+        }
+        cbm_writer_close(writer);
+        fail_if(cbm_writer_error(writer) != 0, "Error should be 0");
+        fail_if(writer->buffer_n != 50 * 104, "Unexpected length %zu", writer->buffer_n);
+        fail_if(writer->buffer_n != strlen(writer->buffer), "Length doesn't match contents");
+
+        expected = string_printf("049%s\n", chunk);
+        fail_if(!streq(writer->buffer + 49 * 104, expected), "Last record is wrong");
+}
+END_TEST
+
+START_TEST(bootman_writer_commit_test)
+{
+        autofree(BootManager) *m = NULL;
+        const char *path = TOP_BUILD_DIR "/tests/update_playground/writer-commit";
+        struct stat before = { 0 };
+        struct stat after = { 0 };
+        bool changed = false;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare playground");
+
+        {
+                autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+                fail_if(!cbm_writer_open(writer), "Failed to create writer");
+                cbm_writer_append(writer, "title one\n");
+                fail_if(!cbm_writer_commit_if_changed(writer, NULL, path, &changed),
+                        "Failed to commit");
+                fail_if(!changed, "New file not written");
+                fail_if(!cbm_writer_matches_file(writer, NULL, path),
+                        "Written file doesn't match");
+        }
+        fail_if(stat(path, &before) != 0, "Committed file missing");
+
+        /* Identical contents leave the file alone */
+        {
+                autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+                fail_if(!cbm_writer_open(writer), "Failed to create writer");
+                cbm_writer_append_printf(writer, "title %s\n", "one");
+                fail_if(!cbm_writer_commit_if_changed(writer, NULL, path, &changed),
+                        "Failed to commit");
+                fail_if(changed, "Unchanged file rewritten");
+        }
+        fail_if(stat(path, &after) != 0, "Committed file missing");
+        fail_if(before.st_ino != after.st_ino, "Unchanged file replaced");
+
+        /* Prefixes of the existing contents are a change */
+        {
+                autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+                autofree(char) *text = NULL;
+                fail_if(!cbm_writer_open(writer), "Failed to create writer");
+                cbm_writer_append(writer, "title");
+                fail_if(cbm_writer_matches_file(writer, NULL, path), "Prefix matched");
+                fail_if(!cbm_writer_commit_if_changed(writer, NULL, path, &changed),
+                        "Failed to commit");
+                fail_if(!changed, "Changed file not written");
+                fail_if(!file_get_text(path, &text) || !streq(text, "title"), "Wrong contents");
+        }
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -405,13 +2118,44 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_list_kernels_modules_test);
         tcase_add_test(tc, bootman_list_kernels_no_modules_test);
         tcase_add_test(tc, bootman_map_kernels_test);
+        tcase_add_test(tc, bootman_index_kernels_test);
+        tcase_add_test(tc, bootman_kernel_cache_test);
+        tcase_add_test(tc, bootman_kernel_lazy_sources_test);
+        tcase_add_test(tc, bootman_kernel_parallel_test);
+        tcase_add_test(tc, bootman_manifest_test);
+        tcase_add_test(tc, bootman_manifest_verify_test);
+        tcase_add_test(tc, bootman_manifest_journal_test);
+        tcase_add_test(tc, bootman_sync_phase_test);
+        tcase_add_test(tc, bootman_stage_test);
+        tcase_add_test(tc, bootman_manager_state_test);
+        tcase_add_test(tc, bootman_boot_ledger_test);
+        tcase_add_test(tc, bootman_boot_ledger_race_test);
+        tcase_add_test(tc, bootman_memfs_test);
+        tcase_add_test(tc, bootman_copy_file_test);
+        tcase_add_test(tc, bootman_files_match_test);
+        tcase_add_test(tc, bootman_ring_test);
+        tcase_add_test(tc, bootman_uki_test);
+        tcase_add_test(tc, bootman_io_policy_test);
+        tcase_add_test(tc, bootman_retention_parse_test);
+        tcase_add_test(tc, bootman_initrd_test);
+        tcase_add_test(tc, bootman_case_path_test);
+        tcase_add_test(tc, bootman_update_lock_test);
         tcase_add_test(tc, bootman_timeout_test);
+        tcase_add_test(tc, bootman_lazy_facets_test);
+        tcase_add_test(tc, bootman_snapshot_test);
+        tcase_add_test(tc, bootman_spawn_mask_test);
+        tcase_add_test(tc, bootman_trace_test);
+        tcase_add_test(tc, bootman_log_test);
+        tcase_add_test(tc, bootman_stats_test);
         suite_add_tcase(s, tc);
 
         tc = tcase_create("bootman_writer_functions");
         tcase_add_test(tc, bootman_writer_simple_test);
         tcase_add_test(tc, bootman_writer_printf_test);
+        tcase_add_test(tc, bootman_arena_test);
         tcase_add_test(tc, bootman_writer_mut_test);
+        tcase_add_test(tc, bootman_writer_grow_test);
+        tcase_add_test(tc, bootman_writer_commit_test);
         suite_add_tcase(s, tc);
 
         return s;
@@ -15,6 +15,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "bootman.h"
 #include "config.h"
@@ -228,6 +230,122 @@ START_TEST(bootman_grub2_namespace_migration)
 }
 END_TEST
 
+/**
+ * grub-mkconfig and the default links must be left alone when none of their
+ * inputs changed, and redone as soon as one does.
+ */
+START_TEST(bootman_grub2_mkconfig_skip)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *record = NULL;
+        autofree(char) *new_record = NULL;
+        const char *stamp = BOOT_FULL "/grub/.clr-boot-manager-mkconfig";
+        struct stat before = { 0 };
+        struct stat after = { 0 };
+
+        m = prepare_playground(&grub2_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&grub2_kernels[1], true), "Failed to set kernel as booted");
+        fail_if(!boot_manager_update(m), "Failed initial update");
+
+        /* The test harness never really runs grub-mkconfig */
+        fail_if(!file_set_text(BOOT_FULL "/grub/grub.cfg", "# generated"),
+                "Failed to write grub.cfg");
+        fail_if(!boot_manager_update(m), "Failed to regenerate config");
+        fail_if(!file_get_text(stamp, &record), "grub-mkconfig inputs not recorded");
+
+        fail_if(lstat(PLAYGROUND_ROOT "/vmlinuz", &before) != 0, "Missing default link");
+        fail_if(!boot_manager_update(m), "Failed no-op update");
+        fail_if(lstat(PLAYGROUND_ROOT "/vmlinuz", &after) != 0, "Lost default link");
+        fail_if(before.st_ino != after.st_ino ||
+                    before.st_mtim.tv_sec != after.st_mtim.tv_sec ||
+                    before.st_mtim.tv_nsec != after.st_mtim.tv_nsec,
+                "Default link was recreated without any change");
+
+        /* Changing the defaults must run grub-mkconfig again */
+        fail_if(!nc_mkdir_p(PLAYGROUND_ROOT "/etc/default", 00755),
+                "Failed to create defaults dir");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/etc/default/grub", "GRUB_TIMEOUT=3\n"),
+                "Failed to write GRUB defaults");
+        fail_if(!boot_manager_update(m), "Failed update after changing defaults");
+        fail_if(!file_get_text(stamp, &new_record), "grub-mkconfig inputs not recorded");
+        fail_if(streq(record, new_record), "grub-mkconfig skipped despite new defaults");
+        fail_if(!nc_file_exists(PLAYGROUND_ROOT "/vmlinuz"), "Default link not restored");
+}
+END_TEST
+
+
+static int grub2_mkconfig_runs = 0;
+
+static int grub2_count_system(const char *command)
+{
+        if (strstr(command, "grub-mkconfig")) {
+                ++grub2_mkconfig_runs;
+        }
+        return 0;
+}
+
+/**
+ * The native mode writes plain GRUB entries, leaving grub-mkconfig alone
+ * when only the kernels changed.
+ */
+START_TEST(bootman_grub2_native_entries)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *entries = NULL;
+        autofree(char) *script = NULL;
+        autofree(char) *new_script = NULL;
+        CbmSystemOps system_ops = SystemTestOps;
+        PlaygroundKernel update = { "4.2.4", "kvm", 125, true, true };
+        const char *entries_path = BOOT_FULL "/grub/" KERNEL_NAMESPACE ".cfg";
+        const char *script_path = PLAYGROUND_ROOT "/etc/grub.d/10_" KERNEL_NAMESPACE;
+
+        system_ops.system = grub2_count_system;
+        grub2_mkconfig_runs = 0;
+
+        m = prepare_playground(&grub2_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" KERNEL_CONF_DIRECTORY "/grub2-native", ""),
+                "Failed to select the native mode");
+        fail_if(!set_kernel_booted(&grub2_kernels[1], true), "Failed to set kernel as booted");
+
+        cbm_system_set_vtable(&system_ops);
+        fail_if(!boot_manager_update(m), "Failed initial native update");
+        fail_if(grub2_mkconfig_runs != 1, "grub-mkconfig not run for a new configuration");
+
+        fail_if(!file_get_text(entries_path, &entries), "Native entries not written");
+        fail_if(!strstr(entries, "menuentry '"), "Native entries lack a menuentry");
+        fail_if(strstr(entries, "echo \""), "Native entries written as a script");
+        fail_if(!file_get_text(script_path, &script), "grub.d script not written");
+        fail_if(!strstr(script, KERNEL_NAMESPACE ".cfg"), "grub.d script doesn't source entries");
+
+        /* The test harness never really runs grub-mkconfig */
+        fail_if(!file_set_text(BOOT_FULL "/grub/grub.cfg", "# generated"),
+                "Failed to write grub.cfg");
+        fail_if(!boot_manager_update(m), "Failed to regenerate config");
+        fail_if(grub2_mkconfig_runs != 2, "grub-mkconfig not run for a new grub.cfg");
+
+        /* A new kernel only changes our own entries */
+        fail_if(!push_kernel_update(&grub2_config, &update), "Failed to push kernel update");
+        fail_if(!set_kernel_default(&update), "Failed to set default kernel");
+        boot_manager_refresh(m);
+        fail_if(!boot_manager_update(m), "Failed to update to the new kernel");
+        fail_if(grub2_mkconfig_runs != 2, "grub-mkconfig run for a kernel change");
+
+        free(entries);
+        entries = NULL;
+        fail_if(!file_get_text(entries_path, &entries), "Native entries lost");
+        fail_if(!strstr(entries, "4.2.4-125.kvm"), "New kernel missing from native entries");
+        fail_if(!file_get_text(script_path, &new_script), "grub.d script lost");
+        fail_if(!streq(script, new_script), "grub.d script changed with the kernels");
+        fail_if(!nc_file_exists(PLAYGROUND_ROOT "/vmlinuz"), "Default link not updated");
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -240,6 +358,8 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_grub2_native);
         tcase_add_test(tc, bootman_grub2_update_from_unknown);
         tcase_add_test(tc, bootman_grub2_namespace_migration);
+        tcase_add_test(tc, bootman_grub2_mkconfig_skip);
+        tcase_add_test(tc, bootman_grub2_native_entries);
         suite_add_tcase(s, tc);
 
         return s;
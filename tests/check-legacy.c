@@ -15,6 +15,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/sysmacros.h>
 
 #include "bootman.h"
@@ -257,6 +259,76 @@ START_TEST(bootman_legacy_update_native)
 }
 END_TEST
 
+static int legacy_extlinux_runs = 0;
+
+static int legacy_count_system(const char *command)
+{
+        if (strstr(command, "extlinux")) {
+                ++legacy_extlinux_runs;
+        }
+        return 0;
+}
+
+/**
+ * Updating the bootloader must leave the disk and extlinux alone while they
+ * match their sources, and redo only the part that doesn't.
+ */
+START_TEST(bootman_legacy_update_skip)
+{
+        autofree(BootManager) *m = NULL;
+        PlaygroundConfig start_conf = { 0 };
+        CbmSystemOps system_ops = SystemTestOps;
+        const char *syslinux_source = PLAYGROUND_ROOT "/usr/share/syslinux/gptmbr.bin";
+        const char *syslinux_v2 = TOP_DIR "/tests/data/gptmbr.bin.v2";
+        const char *syslinux_disk = PLAYGROUND_ROOT "/dev/leRootDevice";
+        const char *ldlinux = PLAYGROUND_ROOT "/" BOOT_DIRECTORY "/ldlinux.sys";
+        struct stat before = { 0 };
+        struct stat after = { 0 };
+
+        system_ops.system = legacy_count_system;
+        legacy_extlinux_runs = 0;
+
+        m = prepare_playground(&start_conf);
+        fail_if(!m, "Fatal: Cannot initialise playground");
+        boot_manager_set_image_mode(m, false);
+
+        cbm_system_set_vtable(&system_ops);
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_INSTALL),
+                "Failed to install bootloader");
+        fail_if(legacy_extlinux_runs != 1, "extlinux not run on install");
+
+        /* What the real extlinux would have left behind */
+        fail_if(!file_set_text(ldlinux, "ldlinux"), "Failed to write ldlinux.sys");
+        fail_if(!boot_manager_needs_update(m), "Changed ldlinux.sys not noticed");
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_UPDATE),
+                "Failed to update bootloader");
+        fail_if(legacy_extlinux_runs != 2, "extlinux not run for a changed ldlinux.sys");
+
+        fail_if(boot_manager_needs_update(m), "Unchanged bootloader needs an update");
+        fail_if(stat(syslinux_disk, &before) != 0, "Missing disk");
+        fail_if(!boot_manager_modify_bootloader(m,
+                                                BOOTLOADER_OPERATION_UPDATE |
+                                                    BOOTLOADER_OPERATION_NO_CHECK),
+                "Failed to forcibly update bootloader");
+        fail_if(stat(syslinux_disk, &after) != 0, "Lost disk");
+        fail_if(legacy_extlinux_runs != 2, "extlinux run without any change");
+        fail_if(before.st_mtim.tv_sec != after.st_mtim.tv_sec ||
+                    before.st_mtim.tv_nsec != after.st_mtim.tv_nsec,
+                "Matching MBR was rewritten");
+
+        /* A new MBR alone doesn't call for extlinux */
+        fail_if(!copy_file(syslinux_v2, syslinux_source, 00644),
+                "Failed to bump source bootloader");
+        fail_if(!boot_manager_needs_update(m), "New MBR not noticed");
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_UPDATE),
+                "Failed to update bootloader");
+        fail_if(!cbm_files_match(syslinux_source, syslinux_disk), "MBR not updated");
+        fail_if(legacy_extlinux_runs != 2, "extlinux run for an MBR change");
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -271,6 +343,7 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_native);
+        tcase_add_test(tc, bootman_legacy_update_skip);
         suite_add_tcase(s, tc);
 
         return s;
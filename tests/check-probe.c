@@ -28,9 +28,11 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <libgen.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/sysmacros.h>
 
 #include "blkid_stub.h"
@@ -39,7 +41,9 @@
 #include "config.h"
 #include "files.h"
 #include "log.h"
+#include "nica/files.h"
 #include "probe.h"
+#include "topology.h"
 
 #include "blkid-harness.h"
 #include "harness.h"
@@ -211,6 +215,95 @@ START_TEST(bootman_probe_basic_none)
 }
 END_TEST
 
+/**
+ * A second probe of the same device is served from the runtime cache until
+ * the device node changes underneath it
+ */
+START_TEST(bootman_probe_cached)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        autofree(BootManager) *m = NULL;
+        autofree(CbmDeviceProbe) *probe = NULL;
+        autofree(CbmDeviceProbe) *cached = NULL;
+        autofree(CbmDeviceProbe) *reprobed = NULL;
+        autofree(char) *devnode = NULL;
+        bootman_probe_set_gpt_vtables();
+
+        m = prepare_playground(&config);
+        set_test_system_legacy();
+
+        /* The cache is only trusted against an existing device node */
+        devnode = cbm_system_devnode_to_devpath(makedev(8, 8));
+        fail_if(!file_set_text(devnode, "le-root-device"), "Failed to create device node");
+
+        probe = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!probe, "Failed to get probe for a valid rootfs");
+        fail_if(!probe->gpt, "GPT UEFI root not detected as GPT");
+
+        /* MBR would be detected now if blkid were consulted */
+        bootman_probe_set_mbr_vtables();
+        cached = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!cached, "Failed to get cached probe");
+        fail_if(!cached->gpt, "Cached probe was not used");
+        fail_if(!cached->part_uuid || !streq(cached->part_uuid, DEFAULT_PART_UUID),
+                "Cached probe lost the PartUUID");
+        fail_if(!cached->uuid || !streq(cached->uuid, probe->uuid), "Cached probe lost the UUID");
+        fail_if(cached->luks_uuid, "Cached probe gained a LUKS UUID");
+
+        /* A rewritten partition table invalidates the cache */
+        fail_if(!file_set_text(devnode, "le-new-root-device"), "Failed to change device node");
+        reprobed = cbm_probe_path(PLAYGROUND_ROOT);
+        fail_if(!reprobed, "Failed to reprobe the rootfs");
+        fail_if(reprobed->gpt, "Stale cached probe used after the device changed");
+        fail_if(reprobed->part_uuid, "MBR UEFI root has a PartUUID detected");
+}
+END_TEST
+
+/**
+ * Boot device discovery is answered from the topology index until it's reset
+ */
+START_TEST(bootman_probe_topology)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        autofree(BootManager) *m = NULL;
+        autofree(char) *esp = NULL;
+        autofree(char) *indexed = NULL;
+        autofree(char) *labelled = NULL;
+        autofree(char) *disk = NULL;
+        autofree(char) *label = NULL;
+        autofree(char) *partuuid_dir = NULL;
+        bootman_probe_set_gpt_vtables();
+
+        m = prepare_playground(&config);
+        set_test_system_legacy();
+
+        partuuid_dir = string_printf("%s/disk/by-partuuid", cbm_system_get_devfs_path());
+        esp = get_boot_device();
+        fail_if(!esp, "Failed to find the ESP");
+        fail_if(strncmp(esp, partuuid_dir, strlen(partuuid_dir)) != 0,
+                "ESP not found by PartUUID: %s",
+                esp);
+
+        /* Index is still valid, even once the devices go away */
+        fail_if(!nc_rm_rf(partuuid_dir), "Failed to remove by-partuuid");
+        indexed = get_boot_device();
+        fail_if(!indexed || !streq(esp, indexed), "ESP lookup didn't use the index");
+
+        /* A reset rescans, now only finding the label */
+        label = string_printf("%s/disk/by-partlabel/ESP", cbm_system_get_devfs_path());
+        fail_if(!nc_mkdir_p(PLAYGROUND_ROOT "/dev/disk/by-partlabel", 00755),
+                "Failed to create by-partlabel");
+        fail_if(!file_set_text(label, "clr-boot-manager ESP"), "Failed to create ESP label");
+        cbm_topology_reset();
+        labelled = get_boot_device();
+        fail_if(!labelled || !streq(labelled, label), "ESP not found by label after reset");
+
+        disk = get_parent_disk(PLAYGROUND_ROOT);
+        fail_if(!disk, "Failed to find the parent disk");
+        fail_if(!streq(basename(disk), "leRootDevice"), "Wrong parent disk: %s", disk);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -223,6 +316,8 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_probe_basic_gpt);
         tcase_add_test(tc, bootman_probe_basic_mbr);
         tcase_add_test(tc, bootman_probe_basic_none);
+        tcase_add_test(tc, bootman_probe_cached);
+        tcase_add_test(tc, bootman_probe_topology);
         suite_add_tcase(s, tc);
 
         return s;
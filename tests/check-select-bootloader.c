@@ -75,7 +75,9 @@ static void bootman_select_set_default_vtables(void)
 static void ensure_bootloader_is(BootManager *manager, const char *expected)
 {
         fail_if(manager == NULL, "No BootManager");
-        fail_if(!manager->bootloader, "No bootloader is selected. Expected %s", expected);
+        fail_if(!boot_manager_require(manager, BOOT_MANAGER_FACET_BOOTLOADER) ||
+                    !manager->bootloader,
+                "No bootloader is selected. Expected %s", expected);
         const char *name = manager->bootloader->name;
         fail_if(!streq(name, expected), "Expected bootloader '%s', got '%s'", expected, name);
 }
@@ -263,6 +265,65 @@ START_TEST(bootman_select_syslinux_image_with_boot)
 }
 END_TEST
 
+/**
+ * Probes of the root, which a device spec must avoid entirely
+ */
+static int spec_probe_count = 0;
+
+static blkid_probe spec_blkid_new_probe_from_filename(const char *filename)
+{
+        ++spec_probe_count;
+        return test_blkid_new_probe_from_filename(filename);
+}
+
+/**
+ * We're operating in image mode on a UEFI host, with a device spec saying the
+ * image boots legacy from a GPT disk. Nothing may be probed.
+ */
+START_TEST(bootman_select_syslinux_image_with_spec)
+{
+        PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        autofree(BootManager) *m = NULL;
+        CbmBlkidOps blkid_ops = BlkidTestOps;
+        const CbmDeviceProbe *root = NULL;
+        const char *spec = PLAYGROUND_ROOT "/device-spec";
+
+        blkid_ops.probe_new_from_filename = spec_blkid_new_probe_from_filename;
+        cbm_blkid_set_vtable(&blkid_ops);
+        cbm_system_set_vtable(&SystemTestOps);
+
+        m = prepare_playground(&config);
+        fail_if(!file_set_text(spec,
+                               "# Built on a loop device\n"
+                               "ROOT_PARTUUID = 1d5a6a3c-1b6e-4d5f-8d3e-3f7c2a1b9e01\n"
+                               "ROOT_UUID=7e1f53a2-5c0b-4a8e-9b61-2d4f0c8a7b13\n"
+                               "BOOT_MASK=legacy,gpt\n"),
+                "Failed to write device spec");
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_set_device_spec(m, spec), "Failed to load device spec");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to set prefix");
+        spec_probe_count = 0;
+
+        ensure_bootloader_is(m, "syslinux");
+        root = boot_manager_get_root_device(m);
+        fail_if(!root || !root->gpt, "Root device not taken from the spec");
+        fail_if(!streq(root->part_uuid, "1d5a6a3c-1b6e-4d5f-8d3e-3f7c2a1b9e01"),
+                "Wrong PartUUID for the root");
+        fail_if(!streq(root->uuid, "7e1f53a2-5c0b-4a8e-9b61-2d4f0c8a7b13"),
+                "Wrong UUID for the root");
+        fail_if(root->luks_uuid != NULL, "LUKS UUID invented");
+        fail_if(spec_probe_count != 0, "Root probed in spite of the device spec");
+
+        /* Anything ambiguous is refused before it's ever used */
+        fail_if(cbm_device_spec_parse("ROOT_UUID=abc\nBOOT_MASK=uefi,legacy\n") != NULL,
+                "Accepted two ways of booting");
+        fail_if(cbm_device_spec_parse("ROOT_UUID=abc\nBOOT_MASK=uefi\nROOT_LABEL=x\n") != NULL,
+                "Accepted an unknown key");
+        fail_if(cbm_device_spec_parse("BOOT_MASK=uefi\n") != NULL, "Accepted no root");
+}
+END_TEST
+
 /**
  * ############ BEGIN GRUB2 TESTS #################
  */
@@ -412,6 +473,7 @@ static Suite *core_suite(void)
         tc = tcase_create("bootman_select_syslinux_functions");
         tcase_add_test(tc, bootman_select_syslinux_native_with_boot);
         tcase_add_test(tc, bootman_select_syslinux_image_with_boot);
+        tcase_add_test(tc, bootman_select_syslinux_image_with_spec);
         suite_add_tcase(s, tc);
 
         /* grub2 tests */
@@ -11,18 +11,29 @@
 
 #define _GNU_SOURCE
 #include <check.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "bootloader.h"
 #include "bootman.h"
 #include "config.h"
 #include "files.h"
+#include "lock.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "stage.h"
+#include "uki.h"
 #include "util.h"
 #include "writer.h"
 
@@ -30,6 +41,14 @@
 #include "harness.h"
 #include "system-harness.h"
 
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+
+#define _BOOTMAN_INTERNAL_
+#include "bootman_private.h"
+#undef _BOOTMAN_INTERNAL_
+
 #define PLAYGROUND_ROOT TOP_BUILD_DIR "/tests/update_playground"
 #define BOOT_FULL PLAYGROUND_ROOT "/" BOOT_DIRECTORY
 
@@ -132,6 +151,779 @@ START_TEST(bootman_uefi_native_no_modules)
 }
 END_TEST
 
+/**
+ * Ensure concurrent installation yields the same result as a serial one,
+ * both in native and image mode.
+ */
+START_TEST(bootman_uefi_parallel_install)
+{
+        autofree(BootManager) *m = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        boot_manager_set_jobs(m, 4);
+        fail_if(boot_manager_get_jobs(m) != 4, "Failed to set number of jobs");
+
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode with 4 jobs");
+
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Running kernel not installed");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Default kvm kernel not installed");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[3])),
+                "Default native kernel not installed");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[2])),
+                "Uninteresting kernel shouldn't be kept around.");
+        fail_if(nc_file_exists(BOOT_FULL "/" CBM_STAGE_DIR),
+                "Staged configuration left behind after switching over");
+
+        boot_manager_free(m);
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        boot_manager_set_jobs(m, 4);
+        fail_if(!boot_manager_update(m), "Failed to update image with 4 jobs");
+
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[i])),
+                        "Image kernel not installed");
+        }
+}
+END_TEST
+
+/**
+ * A dry run must describe the update without performing any of it, and once
+ * the update has been applied there must be nothing left to copy.
+ */
+START_TEST(bootman_uefi_update_plan)
+{
+        autofree(BootManager) *m = NULL;
+        const char *plan = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        fail_if(boot_manager_get_plan(m) != NULL, "Plan exists before any update");
+        boot_manager_set_dry_run(m, true);
+        fail_if(!boot_manager_update(m), "Failed to plan native update");
+
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan, "No plan produced by dry run");
+        fail_if(!strstr(plan, "bootloader install\n"), "Plan does not install the bootloader");
+        fail_if(!strstr(plan, "install kvm "), "Plan does not install the kvm kernel");
+        fail_if(!strstr(plan, "\nremove "), "Plan does not garbage collect");
+        fail_if(strstr(plan, "\ntotal 0 "), "Plan has nothing to copy");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[0])),
+                "Dry run installed a kernel");
+        fail_if(boot_manager_needs_install(m) == false, "Dry run installed the bootloader");
+
+        boot_manager_set_dry_run(m, false);
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Newest kernel not installed");
+
+        boot_manager_set_dry_run(m, true);
+        fail_if(!boot_manager_update(m), "Failed to plan no-op update");
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan, "No plan produced by second dry run");
+        fail_if(strstr(plan, "bootloader "), "Bootloader changes planned after update");
+        fail_if(!strstr(plan, "\ntotal 0 0 0\n"), "Copies or removals planned after update");
+}
+END_TEST
+
+/**
+ * A verifying update must find a damaged kernel the manifest still vouches
+ * for, and repairing it must leave nothing else to do
+ */
+START_TEST(bootman_uefi_verify)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *blob = NULL;
+        autofree(char) *text = NULL;
+        const char *plan = NULL;
+        struct stat st = { 0 };
+        struct timespec times[2];
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        boot_manager_set_jobs(m, 4);
+        fail_if(!boot_manager_update(m), "Failed to install every kernel");
+
+        /* Damaged in place, under the size and mtime it was installed with */
+        fail_if(!boot_manager_require(m, BOOT_MANAGER_FACET_BOOTLOADER), "No bootloader");
+        blob = string_printf("%s/%s/kernel-%s.kvm.4.2.3-124",
+                             BOOT_FULL,
+                             m->bootloader->get_kernel_destination(m),
+                             KERNEL_NAMESPACE);
+        fail_if(stat(blob, &st) != 0, "Installed kernel is missing");
+        fail_if(!file_get_text(blob, &text), "Failed to read installed kernel");
+        fail_if(text[0] == '\0', "Installed kernel is empty");
+        text[0] = text[0] == 'X' ? 'Y' : 'X';
+        fail_if(!file_set_text(blob, text), "Failed to damage installed kernel");
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        fail_if(utimensat(AT_FDCWD, blob, times, 0) != 0, "Failed to restore mtime");
+
+        boot_manager_set_dry_run(m, true);
+        fail_if(!boot_manager_update(m), "Failed to plan trusting update");
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan || strstr(plan, "install "), "Manifest should be trusted");
+
+        boot_manager_set_verify(m, true);
+        fail_if(!boot_manager_update(m), "Failed to verify");
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan || !strstr(plan, "install kvm "), "Damaged kernel not found");
+        fail_if(!strstr(plan, " 1 0\n"), "Intact kernels reinstalled");
+
+        boot_manager_set_dry_run(m, false);
+        fail_if(!boot_manager_update(m), "Failed to repair");
+        boot_manager_set_dry_run(m, true);
+        fail_if(!boot_manager_update(m), "Failed to verify repair");
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan || !strstr(plan, "\ntotal 0 0 0\n"), "Repair left differences behind");
+}
+END_TEST
+
+/**
+ * An update left to one already running must say that its changes aren't
+ * confirmed, rather than pass for a completed update
+ */
+START_TEST(bootman_uefi_deferred_update)
+{
+        autofree(BootManager) *m = NULL;
+        CbmUpdateLock lock = {.fd = -1 };
+        int status = 0;
+        pid_t pid;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+
+        fail_if(cbm_update_lock_enter(&lock, PLAYGROUND_ROOT "/run/clr-boot-manager", false) !=
+                    CBM_UPDATE_LOCK_ACQUIRED,
+                "Failed to take the update lock");
+
+        /* Record locks are per process, so update from a child */
+        pid = fork();
+        fail_if(pid < 0, "Failed to fork");
+        if (pid == 0) {
+                bool deferred = boot_manager_update(m) && boot_manager_update_deferred(m);
+
+                _exit(deferred && confirm_kernel_uninstalled(m, &uefi_kernels[3]) ? 0 : 1);
+        }
+        fail_if(waitpid(pid, &status, 0) != pid, "Failed to wait for child");
+        fail_if(!WIFEXITED(status) || WEXITSTATUS(status) != 0,
+                "Update left to the lock holder wasn't reported as deferred");
+
+        /* Once the holder's gone the update is our own again */
+        close(lock.fd);
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(boot_manager_update_deferred(m), "Completed update reported as deferred");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &uefi_kernels[3]),
+                "Newest kernel not installed");
+}
+END_TEST
+
+/**
+ * An update limited to a changed kernel leaves the other types alone
+ */
+START_TEST(bootman_uefi_update_changed_kernel)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *vendor = NULL;
+        autofree(char) *running_entry = NULL;
+        PlaygroundKernel native = { "4.2.4", "native", 139, true, false };
+        BootManager *full = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Running kernel not installed");
+
+        /* Damage the running kvm kernel, only a full update repairs it */
+        vendor = strdup(boot_manager_get_vendor_prefix(m));
+        running_entry = string_printf("%s/loader/entries/%s-kvm-4.2.1-121.conf", BOOT_FULL, vendor);
+        fail_if(unlink(running_entry) != 0, "Failed to remove running kernel entry");
+
+        fail_if(!push_kernel_update(&uefi_config, &native), "Failed to add native kernel");
+        fail_if(!set_kernel_default(&native), "Failed to make the native kernel default");
+        fail_if(boot_manager_add_changed_kernel(m, "vmlinuz"), "Accepted a bogus kernel name");
+        fail_if(!boot_manager_add_changed_kernel(m,
+                                                 PLAYGROUND_ROOT KERNEL_DIRECTORY
+                                                 "/" KERNEL_NAMESPACE ".native.4.2.4-139"),
+                "Failed to name the changed kernel");
+        fail_if(!boot_manager_update(m), "Failed to update the changed kernel type");
+
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &native), "New kernel not installed");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[3])), "Old native kernel kept");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Default kvm kernel removed");
+        fail_if(nc_file_exists(running_entry), "Other kernel type was repaired");
+
+        full = boot_manager_new();
+        fail_if(!full, "Failed to create second manager");
+        fail_if(!boot_manager_set_prefix(full, PLAYGROUND_ROOT), "Failed to set prefix");
+        fail_if(!boot_manager_set_uname(full, uefi_config.uts_name), "Failed to set uname");
+        boot_manager_set_image_mode(full, false);
+        fail_if(!boot_manager_update(full), "Failed to run a full update");
+        boot_manager_free(full);
+        fail_if(!nc_file_exists(running_entry), "Full update didn't repair the running kernel");
+}
+END_TEST
+
+/**
+ * Render the status of @m, as JSON
+ */
+static char *uefi_get_status(BootManager *m)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        char *ret = NULL;
+
+        fail_if(!cbm_writer_open(writer), "Failed to open writer");
+        fail_if(!boot_manager_write_status(m, writer, true), "Failed to write status");
+        cbm_writer_close(writer);
+        fail_if(cbm_writer_error(writer) != 0, "Failed to write status");
+        ret = strdup(writer->buffer);
+        fail_if(!ret, "Out of memory");
+        return ret;
+}
+
+START_TEST(bootman_uefi_status)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *status = NULL;
+        BootManager *query = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        status = uefi_get_status(m);
+        fail_if(!strstr(status, "\"manifest\":false"), "Manifest found before any update");
+        fail_if(strstr(status, "\"needs_update\":false"), "Nothing to do before any update");
+
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        /* A fresh query, answered without probing anything */
+        query = boot_manager_new();
+        fail_if(!query, "Failed to create query manager");
+        fail_if(!boot_manager_set_prefix(query, PLAYGROUND_ROOT), "Failed to set prefix");
+        fail_if(!boot_manager_set_uname(query, uefi_config.uts_name), "Failed to set uname");
+        boot_manager_set_image_mode(query, false);
+        boot_manager_set_dry_run(query, true);
+        free(status);
+        status = uefi_get_status(query);
+        fail_if(query->facets & BOOT_MANAGER_FACET_PROBE, "Status probed the root");
+        boot_manager_free(query);
+
+        fail_if(!strstr(status, "\"manifest\":true"), "No manifest after update");
+        fail_if(!strstr(status, "\"needs_update\":false}"), "Update needed after update");
+        fail_if(!strstr(status, "\"installed\":true"), "No kernel reported as installed");
+        fail_if(!strstr(status, "\"running\":\"org.clearlinux.kvm.4.2.1-121\""),
+                "Wrong running kernel");
+        fail_if(!strstr(status, "\"default\":\"org.clearlinux.kvm.4.2.3-124\""),
+                "Wrong default kernel");
+}
+END_TEST
+
+START_TEST(bootman_uefi_retention)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *status = NULL;
+        const char *policy = PLAYGROUND_ROOT KERNEL_CONF_DIRECTORY "/retention";
+        PlaygroundKernel extra[] = { { "4.2.4", "native", 139, false, false },
+                                     { "4.2.5", "native", 140, true, false } };
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        for (size_t i = 0; i < ARRAY_SIZE(extra); i++) {
+                fail_if(!push_kernel_update(&uefi_config, &extra[i]), "Failed to add kernel");
+        }
+        fail_if(!set_kernel_default(&extra[1]), "Failed to make the newest kernel default");
+
+        /* One more of each type, and whatever is pinned */
+        fail_if(!file_set_text(policy, "keep=1 # newest\npin=native-137\n"),
+                "Failed to write retention policy");
+        status = uefi_get_status(m);
+        fail_if(!strstr(status, "\"release\":139,\"default\":false,\"running\":false,"
+                                "\"last_boot\":null,\"keep\":true"),
+                "Status doesn't keep the newest further kernel");
+        fail_if(!boot_manager_update(m), "Failed to update with a retention policy");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &extra[1]), "Default kernel removed");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &extra[0]), "Kept kernel removed");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[2])),
+                "Pinned kernel removed");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[3])), "Unkept kernel installed");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Running kernel removed");
+
+        /* Without the running kernel, a configured policy still collects */
+        boot_manager_set_uname(m, "unknown-uname");
+        fail_if(!file_set_text(policy, "keep=0\n"), "Failed to rewrite retention policy");
+        fail_if(!boot_manager_update(m), "Failed to update without a running kernel");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &extra[1]), "Default kernel removed");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Default kvm kernel removed");
+        fail_if(!confirm_kernel_uninstalled(m, &extra[0]), "Further kernel kept");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[2])), "Unpinned kernel kept");
+
+        /* A bad policy falls back to keeping only what's always kept */
+        fail_if(!file_set_text(policy, "keep=lots\n"), "Failed to break retention policy");
+        fail_if(!boot_manager_set_uname(m, uefi_config.uts_name), "Failed to restore the uname");
+        fail_if(!boot_manager_update(m), "Failed to update with a bad retention policy");
+        fail_if(unlink(policy) != 0, "Failed to remove retention policy");
+}
+END_TEST
+
+static int mirror_mounts = 0;
+static int mirror_umounts = 0;
+
+static int mirror_mount(__cbm_unused__ const char *source, const char *target,
+                        __cbm_unused__ const char *filesystemtype,
+                        __cbm_unused__ unsigned long mountflags, __cbm_unused__ const void *data)
+{
+        if (strstr(target, "/clr-boot-manager/esp/")) {
+                ++mirror_mounts;
+        }
+        return 0;
+}
+
+static int mirror_umount(const char *target)
+{
+        if (strstr(target, "/clr-boot-manager/esp/")) {
+                ++mirror_umounts;
+        }
+        return 0;
+}
+
+/**
+ * Applying the timeout rewrites loader.conf just as a full update would, on
+ * every mirrored ESP too
+ */
+START_TEST(bootman_uefi_apply_timeout)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *node = NULL;
+        autofree(char) *mirror_conf = NULL;
+        autofree(char) *mirrored = NULL;
+        autofree(char) *expected = NULL;
+        autofree(char) *conf = NULL;
+        autofree(char) *applied = NULL;
+        const char *loader_conf = BOOT_FULL "/loader/loader.conf";
+        const char *report = NULL;
+        CbmSystemOps ops = SystemTestOps;
+
+        ops.mount = mirror_mount;
+        ops.umount = mirror_umount;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        cbm_system_set_vtable(&ops);
+        boot_manager_set_image_mode(m, false);
+        fail_if(boot_manager_apply_timeout(m), "Applied the timeout before any update");
+
+        node = string_printf("%s/disk/by-partuuid/0fc63daf-8483-4772-8e79-3d69d8477de4",
+                             cbm_system_get_devfs_path());
+        fail_if(!file_set_text(node, "clr-boot-manager mirrored ESP"), "Failed to create mirror");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" BOOT_MANAGER_MIRRORS_FILE,
+                               "PARTUUID=0fc63daf-8483-4772-8e79-3d69d8477de4\n"),
+                "Failed to write mirrors file");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to inspect again");
+        fail_if(!boot_manager_set_boot_dir(m, BOOT_FULL), "Failed to reset boot dir");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        fail_if(!boot_manager_set_timeout_value(m, 7), "Failed to set the timeout");
+        mirror_mounts = 0;
+        mirror_umounts = 0;
+        fail_if(!boot_manager_apply_timeout(m), "Failed to apply the timeout");
+        fail_if(!file_get_text(loader_conf, &conf), "Failed to read loader.conf");
+        fail_if(strncmp(conf, "timeout 7\ndefault ", 18) != 0, "Timeout not applied: %s", conf);
+
+        /* The mirror is kept identical, and reported on */
+        fail_if(mirror_mounts != 1 || mirror_umounts != 1, "Mirror not mounted for the timeout");
+        mirror_conf = string_printf("%s/clr-boot-manager/esp/0/loader/loader.conf",
+                                    cbm_system_get_runtime_path());
+        fail_if(!file_get_text(mirror_conf, &mirrored), "Failed to read the mirror's loader.conf");
+        fail_if(!streq(conf, mirrored), "Timeout not applied to the mirror: %s", mirrored);
+        report = boot_manager_get_report(m);
+        expected = string_printf("esp %s updated\nesp %s updated\n",
+                                 m->sysconfig->boot_device,
+                                 (const char *)nc_array_get(m->sysconfig->boot_mirrors, 0));
+        fail_if(!report || !streq(report, expected), "Unexpected report: %s", report);
+
+        /* A full update must agree with it byte for byte */
+        fail_if(!boot_manager_update(m), "Failed to update with the timeout");
+        fail_if(!file_get_text(loader_conf, &applied), "Failed to reread loader.conf");
+        fail_if(!streq(conf, applied), "Update disagrees with the applied timeout");
+
+        free(conf);
+        conf = NULL;
+        fail_if(!boot_manager_set_timeout_value(m, -1), "Failed to remove the timeout");
+        fail_if(!boot_manager_apply_timeout(m), "Failed to apply no timeout");
+        fail_if(!file_get_text(loader_conf, &conf), "Failed to read loader.conf");
+        fail_if(strstr(conf, "timeout") != NULL, "Timeout not removed: %s", conf);
+        fail_if(strncmp(conf, "default ", 8) != 0, "Default lost with the timeout: %s", conf);
+        free(mirrored);
+        mirrored = NULL;
+        fail_if(!file_get_text(mirror_conf, &mirrored), "Failed to reread the mirror");
+        fail_if(!streq(conf, mirrored), "Timeout not removed from the mirror: %s", mirrored);
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+/**
+ * Within one update, installing a kernel that was already installed must
+ * not touch the boot directory again.
+ */
+START_TEST(bootman_uefi_install_memo)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+        autofree(char) *kernel_target = NULL;
+        autofree(char) *initrd_target = NULL;
+        const char *initrd_source = NULL;
+        Kernel *kernel = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        kernels = boot_manager_get_kernels(m);
+        fail_if(!kernels || kernels->len == 0, "Failed to find kernels");
+        kernel = nc_array_get(kernels, 0);
+        fail_if(!boot_manager_get_kernel_targets(m,
+                                                 kernel,
+                                                 &kernel_target,
+                                                 &initrd_source,
+                                                 &initrd_target),
+                "Failed to determine kernel targets");
+
+        boot_manager_installs_begin(m);
+        fail_if(!boot_manager_install_kernel(m, kernel), "Failed to install kernel");
+        fail_if(!boot_manager_install_done(m, kernel), "Install was not recorded");
+
+        /* A repeated install must be skipped entirely */
+        fail_if(unlink(kernel_target) != 0, "Failed to remove installed kernel");
+        fail_if(!boot_manager_install_kernel(m, kernel), "Failed to reinstall kernel");
+        fail_if(nc_file_exists(kernel_target), "Repeated install was not skipped");
+
+        /* Outside of an update every install is performed */
+        boot_manager_installs_end(m);
+        fail_if(boot_manager_install_done(m, kernel), "Install outlived the update");
+        fail_if(!boot_manager_install_kernel(m, kernel), "Failed to repair kernel");
+        fail_if(!nc_file_exists(kernel_target), "Kernel was not repaired");
+}
+END_TEST
+
+/**
+ * Track mounts of the boot device, as if they were real
+ */
+static int keep_mount_count = 0;
+static bool keep_mount_active = false;
+
+static int keep_mount_mount(__cbm_unused__ const char *source, __cbm_unused__ const char *target,
+                            __cbm_unused__ const char *filesystemtype,
+                            __cbm_unused__ unsigned long mountflags,
+                            __cbm_unused__ const void *data)
+{
+        ++keep_mount_count;
+        keep_mount_active = true;
+        return 0;
+}
+
+static int keep_mount_umount(__cbm_unused__ const char *target)
+{
+        keep_mount_active = false;
+        return 0;
+}
+
+static bool keep_mount_is_mounted(__cbm_unused__ const char *target)
+{
+        return keep_mount_active;
+}
+
+/**
+ * A kept boot device must be mounted once for many updates, and only be
+ * unmounted when released.
+ */
+START_TEST(bootman_uefi_keep_mounted)
+{
+        autofree(BootManager) *m = NULL;
+        CbmSystemOps ops = SystemTestOps;
+
+        ops.mount = keep_mount_mount;
+        ops.umount = keep_mount_umount;
+        ops.is_mounted = keep_mount_is_mounted;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        cbm_system_set_vtable(&ops);
+        boot_manager_set_image_mode(m, false);
+
+        /* By default the mount never outlives the update */
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(keep_mount_count != 1 || keep_mount_active, "Boot device wasn't unmounted");
+        fail_if(boot_manager_has_kept_mount(m), "Mount kept without asking");
+
+        boot_manager_set_keep_mounted(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update keeping the mount");
+        fail_if(!boot_manager_update(m), "Failed to update on the kept mount");
+        fail_if(keep_mount_count != 2, "Kept boot device was mounted again");
+        fail_if(!keep_mount_active || !boot_manager_has_kept_mount(m), "Mount wasn't kept");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Running kernel not installed");
+
+        fail_if(!boot_manager_release_mount(m), "Failed to release the mount");
+        fail_if(keep_mount_active || boot_manager_has_kept_mount(m), "Mount wasn't released");
+        fail_if(!boot_manager_release_mount(m), "Releasing twice should be harmless");
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+/**
+ * Determine whether every file below @a is also below @b, with the same
+ * contents. Manifests record their own ESP's timestamps, so they differ.
+ */
+static bool mirror_tree_copied(const char *a, const char *b)
+{
+        DIR *dir = opendir(a);
+        struct dirent *ent = NULL;
+        bool ret = dir != NULL;
+
+        while (ret && (ent = readdir(dir)) != NULL) {
+                autofree(char) *path_a = NULL;
+                autofree(char) *path_b = NULL;
+                struct stat st = { 0 };
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..") ||
+                    streq(ent->d_name, CBM_MANIFEST_FILE)) {
+                        continue;
+                }
+                path_a = string_printf("%s/%s", a, ent->d_name);
+                path_b = string_printf("%s/%s", b, ent->d_name);
+                if (stat(path_a, &st) == 0 && S_ISDIR(st.st_mode)) {
+                        ret = mirror_tree_copied(path_a, path_b);
+                } else if (!cbm_files_match(path_a, path_b)) {
+                        fprintf(stderr, "Not mirrored: %s\n", path_b);
+                        ret = false;
+                }
+        }
+        if (dir) {
+                closedir(dir);
+        }
+        return ret;
+}
+
+/**
+ * Every ESP listed as a mirror receives the same update as the boot device,
+ * each one being reported on
+ */
+START_TEST(bootman_uefi_mirrored_esp)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *node = NULL;
+        autofree(char) *mirror = NULL;
+        autofree(char) *expected = NULL;
+        const char *report = NULL;
+        CbmSystemOps ops = SystemTestOps;
+
+        ops.mount = mirror_mount;
+        ops.umount = mirror_umount;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        cbm_system_set_vtable(&ops);
+
+        node = string_printf("%s/disk/by-partuuid/0fc63daf-8483-4772-8e79-3d69d8477de4",
+                             cbm_system_get_devfs_path());
+        fail_if(!file_set_text(node, "clr-boot-manager mirrored ESP"), "Failed to create mirror");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" BOOT_MANAGER_MIRRORS_FILE,
+                               "# Second disk of the pair\n"
+                               "PARTUUID=0FC63DAF-8483-4772-8E79-3D69D8477DE4\n"
+                               "PARTLABEL=NoSuchPartition\n"),
+                "Failed to write mirrors file");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to inspect again");
+        fail_if(!boot_manager_set_boot_dir(m, BOOT_FULL), "Failed to reset boot dir");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        fail_if(!boot_manager_update(m), "Failed to update mirrored ESPs");
+        fail_if(mirror_mounts != 1 || mirror_umounts != 1, "Mirror not mounted for the update");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Running kernel not installed");
+
+        mirror = string_printf("%s/clr-boot-manager/esp/0", cbm_system_get_runtime_path());
+        fail_if(!mirror_tree_copied(BOOT_FULL, mirror), "Mirror differs from the boot device");
+
+        report = boot_manager_get_report(m);
+        fail_if(!report, "No per-ESP report");
+        expected = string_printf("esp %s updated\nesp %s updated\n",
+                                 m->sysconfig->boot_device,
+                                 (const char *)nc_array_get(m->sysconfig->boot_mirrors, 0));
+        fail_if(!streq(report, expected), "Unexpected report: %s", report);
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+/**
+ * Several mirrors are updated at once, each its own copy of the boot
+ * device, and still reported on in the order they're listed
+ */
+START_TEST(bootman_uefi_mirrored_esps_concurrent)
+{
+        static const char *uuids[] = {
+                "0fc63daf-8483-4772-8e79-3d69d8477de4",
+                "1fc63daf-8483-4772-8e79-3d69d8477de4",
+        };
+        autofree(BootManager) *m = NULL;
+        autofree(char) *boot_dir = NULL;
+        autofree(char) *expected = NULL;
+        const char *report = NULL;
+        const char *plan = NULL;
+        const char *at = NULL;
+        CbmSystemOps ops = SystemTestOps;
+
+        ops.mount = mirror_mount;
+        ops.umount = mirror_umount;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        cbm_system_set_vtable(&ops);
+
+        for (size_t i = 0; i < ARRAY_SIZE(uuids); i++) {
+                autofree(char) *node = string_printf("%s/disk/by-partuuid/%s",
+                                                     cbm_system_get_devfs_path(),
+                                                     uuids[i]);
+                fail_if(!file_set_text(node, "clr-boot-manager mirrored ESP"),
+                        "Failed to create mirror");
+        }
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/" BOOT_MANAGER_MIRRORS_FILE,
+                               "PARTUUID=0fc63daf-8483-4772-8e79-3d69d8477de4\n"
+                               "PARTUUID=1fc63daf-8483-4772-8e79-3d69d8477de4\n"),
+                "Failed to write mirrors file");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to inspect again");
+        fail_if(!boot_manager_set_boot_dir(m, BOOT_FULL), "Failed to reset boot dir");
+        boot_manager_set_image_mode(m, false);
+        boot_manager_set_jobs(m, 4);
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+
+        fail_if(!boot_manager_update(m), "Failed to update mirrored ESPs");
+        fail_if(mirror_mounts != 2 || mirror_umounts != 2, "Mirrors not mounted for the update");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Running kernel not installed");
+        boot_dir = boot_manager_get_boot_dir(m);
+        fail_if(!boot_dir || !streq(boot_dir, BOOT_FULL), "Boot directory changed by the mirrors");
+
+        for (size_t i = 0; i < ARRAY_SIZE(uuids); i++) {
+                autofree(char) *mirror = string_printf("%s/clr-boot-manager/esp/%u",
+                                                       cbm_system_get_runtime_path(),
+                                                       (unsigned int)i);
+                fail_if(!mirror_tree_copied(BOOT_FULL, mirror),
+                        "Mirror %s differs from the boot device",
+                        mirror);
+        }
+
+        report = boot_manager_get_report(m);
+        fail_if(!report, "No per-ESP report");
+        expected = string_printf("esp %s updated\nesp %s updated\nesp %s updated\n",
+                                 m->sysconfig->boot_device,
+                                 (const char *)nc_array_get(m->sysconfig->boot_mirrors, 0),
+                                 (const char *)nc_array_get(m->sysconfig->boot_mirrors, 1));
+        fail_if(!streq(report, expected), "Unexpected report: %s", report);
+
+        /* Each ESP's plan follows its own header, in the same order */
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan, "No plan for the ESPs");
+        at = plan;
+        for (uint16_t i = 0; i < m->sysconfig->boot_mirrors->len; i++) {
+                autofree(char) *header =
+                    string_printf("esp %s\n",
+                                  (const char *)nc_array_get(m->sysconfig->boot_mirrors, i));
+
+                at = strstr(at, header);
+                fail_if(!at, "Plan of mirror %u missing or out of order: %s", i, plan);
+        }
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
+/**
+ * Free blocks reported for the boot directory, in 4 KiB blocks
+ */
+static fsblkcnt_t space_free_blocks = 0;
+
+static int space_statvfs(__cbm_unused__ const char *path, struct statvfs *buf)
+{
+        memset(buf, 0, sizeof(*buf));
+        buf->f_bsize = 4096;
+        buf->f_frsize = 4096;
+        buf->f_bavail = space_free_blocks;
+        buf->f_bfree = space_free_blocks;
+        return 0;
+}
+
+/**
+ * A boot directory too small for the old and new kernels at once must have
+ * the old ones removed first, and an update that can't fit at all must be
+ * refused before anything is touched.
+ */
+START_TEST(bootman_uefi_space_schedule)
+{
+        autofree(BootManager) *m = NULL;
+        CbmSystemOps ops = SystemTestOps;
+        PlaygroundKernel new_kernel = { "4.2.4", "native", 139, true, false };
+        const char *plan = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to install every kernel");
+
+        /* The new native kernel retires both installed native kernels */
+        boot_manager_set_image_mode(m, false);
+        fail_if(!push_kernel_update(&uefi_config, &new_kernel), "Failed to push kernel update");
+        fail_if(!set_kernel_default(&new_kernel), "Failed to set the new default");
+        ops.statvfs = space_statvfs;
+        cbm_system_set_vtable(&ops);
+
+        /* Not even the reserve is free */
+        space_free_blocks = 100;
+        fail_if(boot_manager_update(m), "Update didn't refuse to overfill the boot directory");
+        fail_if(!confirm_kernel_uninstalled(m, &new_kernel), "Refused update installed a kernel");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &uefi_kernels[2]),
+                "Refused update removed a kernel");
+
+        /* One spare block past the reserve, the new kernel needs two */
+        space_free_blocks = (512 * 1024) / 4096 + 1;
+        boot_manager_set_dry_run(m, true);
+        fail_if(!boot_manager_update(m), "Failed to plan the update");
+        plan = boot_manager_get_plan(m);
+        fail_if(!plan || !strstr(plan, "\nschedule remove-first\n"), "Removals not scheduled first");
+
+        boot_manager_set_dry_run(m, false);
+        fail_if(!boot_manager_update(m), "Failed to update after making room");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &new_kernel), "New kernel not installed");
+        fail_if(!confirm_kernel_uninstalled(m, &uefi_kernels[2]), "Old kernel not removed");
+        fail_if(!confirm_kernel_uninstalled(m, &uefi_kernels[3]), "Old kernel not removed");
+
+        cbm_system_set_vtable(&SystemTestOps);
+}
+END_TEST
+
 /**
  * This test is designed to perform a system update to a new kernel, when the
  * current kernel cannot be detected. This ensures we can perform a transition
@@ -247,6 +1039,67 @@ START_TEST(bootman_uefi_update_native)
 }
 END_TEST
 
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+#if UINTPTR_MAX == 0xffffffffffffffff
+#define SHIM_EFI_SUFFIX "x64.efi"
+#else
+#define SHIM_EFI_SUFFIX "ia32.efi"
+#endif
+
+static bool uefi_same_file(const struct stat *a, const struct stat *b)
+{
+        return a->st_ino == b->st_ino && a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+               a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * Updating shim must only copy the blobs that changed, and nothing at all
+ * when both are current.
+ */
+START_TEST(bootman_uefi_shim_differential_update)
+{
+        autofree(BootManager) *m = NULL;
+        const char *shim_src = PLAYGROUND_ROOT "/usr/lib/shim/shim" SHIM_EFI_SUFFIX;
+        const char *shim_dst = BOOT_FULL "/EFI/" KERNEL_NAMESPACE "/bootloader" SHIM_EFI_SUFFIX;
+        const char *loader_dst = BOOT_FULL "/EFI/" KERNEL_NAMESPACE "/loader" SHIM_EFI_SUFFIX;
+        struct stat shim_before = { 0 };
+        struct stat shim_after = { 0 };
+        struct stat loader_before = { 0 };
+        struct stat loader_after = { 0 };
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!boot_manager_modify_bootloader(m,
+                                                BOOTLOADER_OPERATION_INSTALL |
+                                                    BOOTLOADER_OPERATION_NO_CHECK),
+                "Failed to install bootloader");
+
+        fail_if(stat(shim_dst, &shim_before) != 0, "shim not installed");
+        fail_if(stat(loader_dst, &loader_before) != 0, "systemd-boot not installed");
+        fail_if(!boot_manager_modify_bootloader(m,
+                                                BOOTLOADER_OPERATION_UPDATE |
+                                                    BOOTLOADER_OPERATION_NO_CHECK),
+                "Failed to forcibly update bootloader");
+        fail_if(stat(shim_dst, &shim_after) != 0, "Lost shim");
+        fail_if(stat(loader_dst, &loader_after) != 0, "Lost systemd-boot");
+        fail_if(!uefi_same_file(&shim_before, &shim_after), "Current shim was copied again");
+        fail_if(!uefi_same_file(&loader_before, &loader_after),
+                "Current systemd-boot was copied again");
+
+        /* Only the shim changed */
+        fail_if(!file_set_text(shim_src, "faux-shim-revision: 2\n"), "Failed to bump shim");
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_UPDATE),
+                "Failed to update bootloader");
+        fail_if(!cbm_files_match(shim_src, shim_dst), "shim not updated");
+        fail_if(stat(loader_dst, &loader_after) != 0, "Lost systemd-boot");
+        fail_if(!uefi_same_file(&loader_before, &loader_after),
+                "Unchanged systemd-boot was copied again");
+}
+END_TEST
+#endif /* HAVE_SHIM_SYSTEMD_BOOT */
+
+
 /**
  * This test is currently specific only to the UEFI bootloader support,
  * as this is the only situation whereby it is possible to completely
@@ -305,6 +1158,151 @@ START_TEST(bootman_uefi_remove_bootloader)
 }
 END_TEST
 
+/**
+ * Loader entries are brought in line in one pass, pruning our own stale
+ * entries while leaving everybody else's alone
+ */
+START_TEST(bootman_uefi_reconcile_entries)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *stale = NULL;
+        autofree(char) *renamed = NULL;
+        const char *foreign = BOOT_FULL "/loader/entries/other-os.conf";
+        const char *vendor = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        vendor = boot_manager_get_vendor_prefix(m);
+
+        fail_if(!nc_mkdir_p(BOOT_FULL "/loader/entries", 00755), "Failed to create loader dirs");
+        stale = string_printf("%s/loader/entries/%s-kvm-4.0.0-1.conf", BOOT_FULL, vendor);
+        fail_if(!file_set_text(stale, "title stale\n"), "Failed to write stale entry");
+        fail_if(!file_set_text(foreign, "title other\n"), "Failed to write foreign entry");
+
+        /* An existing entry in another spelling is updated in place */
+        renamed = string_printf("%s/loader/entries/%s-KVM-4.2.1-121.CONF", BOOT_FULL, vendor);
+        fail_if(!file_set_text(renamed, "title old\n"), "Failed to write misspelled entry");
+
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        fail_if(nc_file_exists(stale), "Stale entry wasn't pruned");
+        fail_if(!nc_file_exists(foreign), "Foreign entry was pruned");
+        fail_if(!nc_file_exists(renamed), "Misspelled entry was replaced");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[2])),
+                "Uninteresting kernel shouldn't be kept around.");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Default kvm kernel not installed");
+}
+END_TEST
+
+/**
+ * With a stub configured, kernels are installed as unified images in
+ * /EFI/Linux and any loader entries of ours are pruned.
+ */
+START_TEST(bootman_uefi_unified_images)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *entry = NULL;
+        autofree(char) *image = NULL;
+        autofree(char) *stale = NULL;
+        char digest[CBM_SHA256_HEX_SIZE];
+        const char *vendor = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        fail_if(!create_efi_stub(PLAYGROUND_ROOT "/usr/lib/test.stub"), "Failed to create stub");
+        fail_if(!file_set_text(PLAYGROUND_ROOT KERNEL_CONF_DIRECTORY "/uki", "/usr/lib/test.stub\n"),
+                "Failed to enable unified images");
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to reset prefix");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!boot_manager_require(m, BOOT_MANAGER_FACET_BOOTLOADER), "No bootloader");
+        fail_if(!(m->bootloader->get_capabilities(m) & BOOTLOADER_CAP_UKI),
+                "Unified images not enabled");
+        vendor = boot_manager_get_vendor_prefix(m);
+
+        fail_if(!nc_mkdir_p(BOOT_FULL "/loader/entries", 00755), "Failed to create loader dirs");
+        entry = string_printf("%s/loader/entries/%s-kvm-4.2.1-121.conf", BOOT_FULL, vendor);
+        fail_if(!file_set_text(entry, "title old\n"), "Failed to write old entry");
+        fail_if(!nc_mkdir_p(BOOT_FULL "/EFI/Linux", 00755), "Failed to create image dir");
+        stale = string_printf("%s/EFI/Linux/%s-kvm-4.0.0-1.efi", BOOT_FULL, vendor);
+        fail_if(!file_set_text(stale, "stale"), "Failed to write stale image");
+
+        fail_if(!boot_manager_update(m), "Failed to update with unified images");
+
+        image = string_printf("%s/EFI/Linux/%s-kvm-4.2.1-121.efi", BOOT_FULL, vendor);
+        fail_if(!cbm_uki_get_digest(image, digest), "Unified image wasn't assembled");
+        fail_if(nc_file_exists(entry), "Loader entry wasn't pruned");
+        fail_if(nc_file_exists(stale), "Stale image wasn't pruned");
+
+        /* The blobs only live on inside the images */
+        fail_if(kernel_installed_files_count(m, &(uefi_kernels[0])) != 0,
+                "Kernel blobs were installed");
+}
+END_TEST
+
+/**
+ * Count the blobs in the kernel destination of @m
+ */
+static int uefi_count_blobs(BootManager *m)
+{
+        autofree(char) *dir = NULL;
+        NcHashmap *entries = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *name = NULL;
+        int count = 0;
+
+        dir = string_printf("%s%s", BOOT_FULL, m->bootloader->get_kernel_destination(m));
+        entries = cbm_get_dir_entries(dir);
+        fail_if(!entries, "Failed to read kernel destination");
+
+        nc_hashmap_iter_init(entries, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&name, NULL)) {
+                if (strncmp(name, "blob-", 5) == 0) {
+                        ++count;
+                }
+        }
+        nc_hashmap_free(entries);
+        return count;
+}
+
+START_TEST(bootman_uefi_dedup)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *entry = NULL;
+        autofree(char) *text = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+
+        /* Kernels and initrds of each version have identical contents */
+        boot_manager_set_dedup(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update with dedup");
+        fail_if(uefi_count_blobs(m) != 2, "Identical blobs weren't shared");
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(kernel_installed_files_count(m, &uefi_kernels[i]) != 1,
+                        "Kernel installed outside of the blob store");
+        }
+
+        entry = string_printf("%s/loader/entries/%s-kvm-4.2.1-121.conf",
+                              BOOT_FULL,
+                              boot_manager_get_vendor_prefix(m));
+        fail_if(!file_get_text(entry, &text), "Failed to read loader entry");
+        fail_if(!strstr(text, "/blob-"), "Loader entry doesn't name the blob");
+
+        /* Dropping dedup moves every entry back, and empties the store */
+        boot_manager_set_dedup(m, false);
+        boot_manager_refresh(m);
+        fail_if(!boot_manager_update(m), "Failed to update without dedup");
+        fail_if(uefi_count_blobs(m) != 0, "Unreferenced blobs weren't collected");
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(!confirm_kernel_installed(m, &uefi_config, &uefi_kernels[i]),
+                        "Kernel not installed to its own files");
+        }
+}
+END_TEST
+
 START_TEST(bootman_uefi_namespace_migration)
 {
         autofree(BootManager) *m = NULL;
@@ -413,6 +1411,68 @@ START_TEST(bootman_uefi_ensure_removed)
 }
 END_TEST
 
+/**
+ * Removing every kernel at once must leave nothing of them behind, however
+ * many jobs share the work
+ */
+START_TEST(bootman_uefi_batch_remove)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        kernels = boot_manager_get_kernels(m);
+        fail_if(!kernels || kernels->len != ARRAY_SIZE(uefi_kernels), "Wrong number of kernels");
+
+        boot_manager_set_jobs(m, 4);
+        fail_if(!boot_manager_remove_kernels(m, kernels), "Failed to remove kernels");
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[i])),
+                        "Kernel not fully removed");
+        }
+}
+END_TEST
+
+/**
+ * Every manager has its own bootloader state, so that one going away leaves
+ * the others in working order
+ */
+START_TEST(bootman_uefi_independent_managers)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(KernelArray) *kernels = NULL;
+        BootManager *other = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        other = boot_manager_new();
+        fail_if(!other, "Failed to create second manager");
+        fail_if(!boot_manager_set_prefix(other, PLAYGROUND_ROOT), "Failed to set prefix");
+        fail_if(!boot_manager_set_boot_dir(other, BOOT_FULL), "Failed to set boot dir");
+        boot_manager_set_image_mode(other, true);
+        fail_if(!boot_manager_update(other), "Failed to update image with second manager");
+        fail_if(boot_manager_get_bootloader_data(m) == boot_manager_get_bootloader_data(other),
+                "Bootloader state shared between managers");
+        boot_manager_free(other);
+
+        /* The entries directory is only known to the bootloader state */
+        kernels = boot_manager_get_kernels(m);
+        fail_if(!kernels || kernels->len != ARRAY_SIZE(uefi_kernels), "Wrong number of kernels");
+        fail_if(!boot_manager_remove_kernels(m, kernels), "Failed to remove kernels");
+        for (size_t i = 0; i < ARRAY_SIZE(uefi_kernels); i++) {
+                fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[i])),
+                        "Kernel not fully removed");
+        }
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -423,12 +1483,33 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_uefi_get_boot_device);
         tcase_add_test(tc, bootman_uefi_image_modules);
         tcase_add_test(tc, bootman_uefi_native_modules);
+        tcase_add_test(tc, bootman_uefi_parallel_install);
+        tcase_add_test(tc, bootman_uefi_update_plan);
+        tcase_add_test(tc, bootman_uefi_verify);
+        tcase_add_test(tc, bootman_uefi_deferred_update);
+        tcase_add_test(tc, bootman_uefi_status);
+        tcase_add_test(tc, bootman_uefi_update_changed_kernel);
+        tcase_add_test(tc, bootman_uefi_retention);
+        tcase_add_test(tc, bootman_uefi_apply_timeout);
+        tcase_add_test(tc, bootman_uefi_install_memo);
+        tcase_add_test(tc, bootman_uefi_keep_mounted);
+        tcase_add_test(tc, bootman_uefi_mirrored_esp);
+        tcase_add_test(tc, bootman_uefi_mirrored_esps_concurrent);
+        tcase_add_test(tc, bootman_uefi_space_schedule);
         tcase_add_test(tc, bootman_uefi_update_from_unknown);
         tcase_add_test(tc, bootman_uefi_update_image);
         tcase_add_test(tc, bootman_uefi_update_native);
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        tcase_add_test(tc, bootman_uefi_shim_differential_update);
+#endif
         tcase_add_test(tc, bootman_uefi_remove_bootloader);
         tcase_add_test(tc, bootman_uefi_namespace_migration);
+        tcase_add_test(tc, bootman_uefi_reconcile_entries);
+        tcase_add_test(tc, bootman_uefi_unified_images);
+        tcase_add_test(tc, bootman_uefi_dedup);
         tcase_add_test(tc, bootman_uefi_ensure_removed);
+        tcase_add_test(tc, bootman_uefi_batch_remove);
+        tcase_add_test(tc, bootman_uefi_independent_managers);
         suite_add_tcase(s, tc);
 
         /* Tests without kernel modules */
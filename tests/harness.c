@@ -16,8 +16,10 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "bootman.h"
@@ -25,6 +27,7 @@
 #include "bootman_private.h"
 #undef _BOOTMAN_INTERNAL_
 #include "files.h"
+#include "ledger.h"
 #include "nica/files.h"
 
 #include "config.h"
@@ -188,30 +191,47 @@ bool set_kernel_default(PlaygroundKernel *kernel)
 
 bool set_kernel_booted(PlaygroundKernel *kernel, bool did_boot)
 {
-        /*  /var/lib/kernel/k_booted_4.4.0-120.lts  */
+        /*  4.4.0-120.lts in /var/lib/kernel/boot-ledger  */
         if (!kernel) {
                 return false;
         }
+        autofree(char) *id = NULL;
         autofree(char) *p = NULL;
+        autofree(NcHashmap) *records = NULL;
+        autofree(NcHashmap) *keep = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *name = NULL;
 
-        p = string_printf("%s/var/lib/kernel/k_booted_%s-%d.%s",
-                          PLAYGROUND_ROOT,
-                          kernel->version,
-                          kernel->release,
-                          kernel->ktype);
+        id = string_printf("%s-%d.%s", kernel->version, kernel->release, kernel->ktype);
 
-        if (!did_boot) {
-                if (nc_file_exists(p) && unlink(p) < 0) {
-                        fprintf(stderr, "Cannot unlink %s: %s\n", p, strerror(errno));
+        if (did_boot) {
+                if (!cbm_boot_ledger_append(PLAYGROUND_ROOT CBM_BOOT_LEDGER_DIR, id, NULL, 1)) {
+                        fprintf(stderr, "Cannot record boot of %s: %s\n", id, strerror(errno));
                         return false;
                 }
                 return true;
         }
-        if (!file_set_text((const char *)p, "clr-boot-manager file\n")) {
-                fprintf(stderr, "Cannot write k_boot file %s: %s\n", p, strerror(errno));
+
+        /* Unbooting is only for tests, the ledger itself never forgets */
+        p = string_printf("%s" CBM_BOOT_LEDGER_DIR "/" CBM_BOOT_LEGACY_PREFIX "%s",
+                          PLAYGROUND_ROOT,
+                          id);
+        if (nc_file_exists(p) && unlink(p) < 0) {
+                fprintf(stderr, "Cannot unlink %s: %s\n", p, strerror(errno));
                 return false;
         }
-        return true;
+        records = cbm_boot_ledger_load(PLAYGROUND_ROOT CBM_BOOT_LEDGER_DIR);
+        keep = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        if (!records || !keep) {
+                return false;
+        }
+        nc_hashmap_iter_init(records, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&name, NULL)) {
+                if (!streq(name, id) && !nc_hashmap_put(keep, name, (void *)name)) {
+                        return false;
+                }
+        }
+        return cbm_boot_ledger_compact(PLAYGROUND_ROOT CBM_BOOT_LEDGER_DIR, keep);
 }
 
 bool push_kernel_update(PlaygroundConfig *config, PlaygroundKernel *kernel)
@@ -480,12 +500,17 @@ int kernel_installed_files_count(BootManager *manager, PlaygroundKernel *kernel)
         autofree(char) *initrd_file = NULL;
         autofree(char) *initrd_file_legacy = NULL;
         /* where the kernel files are expected to be found on the ESP */
-        const char *esp_path = manager->bootloader->get_kernel_destination
-                                   ? manager->bootloader->get_kernel_destination(manager)
-                                   : "EFI/" KERNEL_NAMESPACE;
+        const char *esp_path = NULL;
         const char *vendor = NULL;
         int file_count = 0;
 
+        if (!boot_manager_require(manager, BOOT_MANAGER_FACET_BOOTLOADER)) {
+                return -1;
+        }
+        esp_path = manager->bootloader->get_kernel_destination
+                       ? manager->bootloader->get_kernel_destination(manager)
+                       : "EFI/" KERNEL_NAMESPACE;
+
         vendor = boot_manager_get_vendor_prefix(manager);
 
         kernel_blob = string_printf("%s/%s/kernel-%s.%s.%s-%d",
@@ -572,6 +597,60 @@ bool create_timeout_conf(void)
         return true;
 }
 
+/**
+ * Write a minimal PE32+ image with a single .text section to @path
+ */
+bool create_efi_stub(const char *path)
+{
+        uint8_t stub[0x600] = { 0 };
+        uint8_t *opt = stub + 0x40 + 24;
+        uint8_t *text = opt + 240;
+        FILE *fp = NULL;
+
+#define PUT16(p, v)                                                                                \
+        do {                                                                                       \
+                (p)[0] = (uint8_t)(v);                                                             \
+                (p)[1] = (uint8_t)((v) >> 8);                                                      \
+        } while (0)
+#define PUT32(p, v)                                                                                \
+        do {                                                                                       \
+                PUT16(p, (v)&0xffff);                                                              \
+                PUT16((p) + 2, (v) >> 16);                                                         \
+        } while (0)
+        stub[0] = 'M';
+        stub[1] = 'Z';
+        PUT32(stub + 0x3c, 0x40);
+        memcpy(stub + 0x40, "PE\0\0", 4);
+        PUT16(stub + 0x44, 0x8664);
+        PUT16(stub + 0x46, 1);
+        PUT16(stub + 0x54, 240);
+        PUT16(opt, 0x20b);
+        PUT32(opt + 32, 0x1000);
+        PUT32(opt + 36, 0x200);
+        PUT32(opt + 56, 0x2000);
+        PUT32(opt + 60, 0x400);
+        PUT32(opt + 108, 16);
+        memcpy(text, ".text", 5);
+        PUT32(text + 8, 0x10);
+        PUT32(text + 12, 0x1000);
+        PUT32(text + 16, 0x200);
+        PUT32(text + 20, 0x400);
+#undef PUT32
+#undef PUT16
+        memset(stub + 0x400, 0xcc, 0x10);
+
+        fp = fopen(path, "w");
+        if (!fp) {
+                fprintf(stderr, "Failed to create: %s %s\n", path, strerror(errno));
+                return false;
+        }
+        if (fwrite(stub, 1, sizeof(stub), fp) != sizeof(stub)) {
+                fclose(fp);
+                return false;
+        }
+        return fclose(fp) == 0;
+}
+
 void set_test_system_uefi(void)
 {
         autofree(char) *root = NULL;
@@ -102,6 +102,12 @@ bool confirm_kernel_uninstalled(BootManager *manager, PlaygroundKernel *kernel);
  */
 bool create_timeout_conf(void);
 
+/**
+ * Create a minimal PE32+ image at @path to assemble unified kernel images
+ * upon
+ */
+bool create_efi_stub(const char *path);
+
 /**
  * Set up the test harness to emulate UEFI
  */
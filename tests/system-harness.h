@@ -56,6 +56,11 @@ static const char *test_get_devfs_path(void)
         return TOP_BUILD_DIR "/tests/update_playground/dev";
 }
 
+static const char *test_get_runtime_path(void)
+{
+        return TOP_BUILD_DIR "/tests/update_playground/run";
+}
+
 /**
  * Default vtable for testing. Copy into a local struct and override specific
  * fields.
@@ -63,12 +68,14 @@ static const char *test_get_devfs_path(void)
 CbmSystemOps SystemTestOps = {
         .mount = test_mount,
         .umount = test_umount,
+        .statvfs = statvfs,
         .system = test_system,
         .is_mounted = test_is_mounted,
         .get_mountpoint_for_device = test_get_mountpoint_for_device,
         .devnode_to_devpath = test_devnode_to_devpath,
         .get_sysfs_path = test_get_sysfs_path,
         .get_devfs_path = test_get_devfs_path,
+        .get_runtime_path = test_get_runtime_path,
 };
 
 /*